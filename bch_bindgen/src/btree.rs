@@ -25,6 +25,25 @@ impl<'f> BtreeTrans<'f> {
     }
 }
 
+impl<'f> BtreeTrans<'f> {
+    pub fn shape_to_text(&self, btree: c::btree_id) -> BtreeShapeToText<'_, 'f> {
+        BtreeShapeToText { trans: self, btree }
+    }
+}
+
+pub struct BtreeShapeToText<'t, 'f> {
+    trans: &'t BtreeTrans<'f>,
+    btree: c::btree_id,
+}
+
+impl<'t, 'f> fmt::Display for BtreeShapeToText<'t, 'f> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        printbuf_to_formatter(f, |buf| unsafe {
+            c::bch2_btree_shape_to_text(buf, self.trans.raw, self.btree)
+        })
+    }
+}
+
 impl<'f> Drop for BtreeTrans<'f> {
     fn drop(&mut self) {
         unsafe { c::bch2_trans_put(&mut *self.raw) }
@@ -200,11 +219,78 @@ impl<'t> Drop for BtreeNodeIter<'t> {
     }
 }
 
+/// A key read straight out of a btree node: the key is unpacked (it's only
+/// 40 bytes), the value is borrowed from the node buffer without copying
+pub struct BtreeNodeKey<'b> {
+    pub k: c::bkey,
+    pub v: &'b c::bch_val,
+}
+
+impl<'b> BtreeNodeKey<'b> {
+    pub fn as_bkey_s_c(&self) -> BkeySC<'_> {
+        BkeySC {
+            k:    &self.k,
+            v:    self.v,
+            iter: PhantomData,
+        }
+    }
+}
+
+/// Iterates over the live keys of a single btree node, in sorted order,
+/// without going through the btree iterator for every key.
+///
+/// The node borrow comes from a BtreeNodeIter, which holds the node locked
+/// until it's advanced - so keys can't outlive the lock. This sees only what's
+/// in the node: keys in the journal that haven't been replayed yet, and the
+/// key cache, are not overlaid the way BtreeIter does.
+pub struct BtreeNodeKeys<'b> {
+    b:    &'b c::btree,
+    iter: c::btree_node_iter,
+}
+
+impl<'b> Iterator for BtreeNodeKeys<'b> {
+    type Item = BtreeNodeKey<'b>;
+
+    fn next(&mut self) -> Option<BtreeNodeKey<'b>> {
+        unsafe {
+            let mut k: MaybeUninit<c::bkey> = MaybeUninit::uninit();
+            let b = self.b as *const c::btree as *mut c::btree;
+            let ret = c::bch2_btree_node_iter_peek_unpack(&mut self.iter, b, k.as_mut_ptr());
+
+            if ret.k.is_null() {
+                return None;
+            }
+
+            c::bch2_btree_node_iter_advance(&mut self.iter, b);
+            Some(BtreeNodeKey {
+                k: k.assume_init(),
+                v: &*ret.v,
+            })
+        }
+    }
+}
+
 impl<'b, 'f> c::btree {
     pub fn to_text(&'b self, fs: &'f Fs) -> BtreeNodeToText<'b, 'f> {
         BtreeNodeToText { b: &self, fs }
     }
 
+    pub fn keys(&'b self) -> BtreeNodeKeys<'b> {
+        unsafe {
+            let mut iter: MaybeUninit<c::btree_node_iter> = MaybeUninit::uninit();
+
+            c::bch2_btree_node_iter_init_from_start(
+                iter.as_mut_ptr(),
+                self as *const c::btree as *mut c::btree,
+            );
+
+            BtreeNodeKeys {
+                b:    self,
+                iter: iter.assume_init(),
+            }
+        }
+    }
+
     pub fn ondisk_to_text(&'b self, fs: &'f Fs) -> BtreeNodeOndiskToText<'b, 'f> {
         BtreeNodeOndiskToText { b: &self, fs }
     }
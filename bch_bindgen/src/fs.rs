@@ -8,6 +8,11 @@ pub struct Fs {
     pub raw: *mut c::bch_fs,
 }
 
+// bch_fs does its own locking: transactions may be run against it from any
+// number of threads
+unsafe impl Send for Fs {}
+unsafe impl Sync for Fs {}
+
 impl Fs {
     pub fn open(devs: &Vec<PathBuf>, opts: c::bch_opts) -> Result<Fs, bch_errcode> {
         let devs: Vec<_> = devs
@@ -6,6 +6,10 @@ use anyhow::anyhow;
 
 pub use crate::bcachefs::bch2_free_super;
 
+// A superblock handle owns its buffers and block device; it may be read on one
+// thread and used or freed on another
+unsafe impl Send for bch_sb_handle {}
+
 pub fn read_super_opts(
     path: &std::path::Path,
     mut opts: bch_opts,
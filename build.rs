@@ -15,6 +15,10 @@ fn main() {
     println!("cargo:rustc-link-lib=keyutils");
     println!("cargo:rustc-link-lib=aio");
 
+    if std::env::var("BCACHEFS_URING").is_ok() {
+        println!("cargo:rustc-link-lib=uring");
+    }
+
     if std::env::var("BCACHEFS_FUSE").is_ok() {
         println!("cargo:rustc-link-lib=fuse3");
     }
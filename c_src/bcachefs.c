@@ -35,6 +35,8 @@ void bcachefs_usage(void)
 	     "  show-super               Dump superblock information to stdout\n"
 	     "  set-fs-option            Set a filesystem option\n"
 	     "  reset-counters           Reset all counters on an unmounted device\n"
+	     "  zstd-dict train          Train a zstd compression dictionary\n"
+	     "  zstd-dict set            Store a zstd dictionary in an unmounted filesystem\n"
 	     "\n"
 	     "Mount:\n"
 	     "  mount                    Mount a filesystem\n"
@@ -52,6 +54,7 @@ void bcachefs_usage(void)
 #endif
 	     "Commands for managing a running filesystem:\n"
 	     "  fs usage                 Show disk usage\n"
+	     "  fs top                   Show filesystem event rates\n"
 	     "\n"
 	     "Commands for managing devices within a running filesystem:\n"
 	     "  device add               Add a new device to an existing filesystem\n"
@@ -67,10 +70,13 @@ void bcachefs_usage(void)
 	     "  subvolume create         Create a new subvolume\n"
 	     "  subvolume delete         Delete an existing subvolume\n"
 	     "  subvolume snapshot       Create a snapshot\n"
+	     "  subvolume send           Stream a snapshot, or changes since an older one\n"
+	     "  subvolume receive        Apply a stream from subvolume send\n"
 	     "\n"
 	     "Commands for managing filesystem data:\n"
 	     "  data rereplicate         Rereplicate degraded data\n"
 	     "  data job                 Kick off low level data jobs\n"
+	     "  data defrag              Defragment files\n"
 	     "\n"
 	     "Encryption:\n"
 	     "  unlock                   Unlock an encrypted filesystem prior to running/mounting\n"
@@ -89,6 +95,7 @@ void bcachefs_usage(void)
 	     "  dump                     Dump filesystem metadata to a qcow2 image\n"
 	     "  list                     List filesystem metadata in textual form\n"
 	     "  list_journal             List contents of journal\n"
+	     "  bench                    Run btree microbenchmarks on a scratch filesystem\n"
 	     "\n"
 	     "FUSE:\n"
 	     "  fusemount                Mount a filesystem via FUSE\n"
@@ -119,6 +126,8 @@ int fs_cmds(int argc, char *argv[])
 	}
 	if (!strcmp(cmd, "usage"))
 		return cmd_fs_usage(argc, argv);
+	if (!strcmp(cmd, "top"))
+		return cmd_fs_top(argc, argv);
 
 	return 0;
 }
@@ -159,6 +168,40 @@ int data_cmds(int argc, char *argv[])
 		return cmd_data_rereplicate(argc, argv);
 	if (!strcmp(cmd, "job"))
 		return cmd_data_job(argc, argv);
+	if (!strcmp(cmd, "defrag"))
+		return cmd_data_defrag(argc, argv);
 
 	return 0;
 }
+
+/* create, delete and snapshot are implemented in Rust: */
+int subvolume_cmds(int argc, char *argv[])
+{
+	char *cmd = pop_cmd(&argc, argv);
+
+	if (argc < 1) {
+		bcachefs_usage();
+		exit(EXIT_FAILURE);
+	}
+	if (!strcmp(cmd, "send"))
+		return cmd_subvolume_send(argc, argv);
+	if (!strcmp(cmd, "receive"))
+		return cmd_subvolume_receive(argc, argv);
+
+	return 0;
+}
+
+int zstd_dict_cmds(int argc, char *argv[])
+{
+	char *cmd = pop_cmd(&argc, argv);
+
+	if (argc < 1)
+		return zstd_dict_usage();
+	if (!strcmp(cmd, "train"))
+		return cmd_zstd_dict_train(argc, argv);
+	if (!strcmp(cmd, "set"))
+		return cmd_zstd_dict_set(argc, argv);
+
+	zstd_dict_usage();
+	return 1;
+}
@@ -0,0 +1,283 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "cmds.h"
+#include "libbcachefs.h"
+#include "libbcachefs/btree_trace_format.h"
+#include "libbcachefs/darray.h"
+#include "libbcachefs/errcode.h"
+#include "libbcachefs/opts.h"
+#include "libbcachefs/super.h"
+#include "libbcachefs/tests.h"
+
+static const char * const bench_default_tests[] = {
+	"rand_insert",
+	"rand_insert_multi",
+	"rand_lookup",
+	"rand_mixed",
+	"rand_delete",
+	"seq_insert",
+	"seq_lookup",
+	"seq_overwrite",
+	"seq_delete",
+	NULL
+};
+
+static void bench_usage(void)
+{
+	puts("bcachefs bench - run btree microbenchmarks\n"
+	     "Usage: bcachefs bench [OPTION]... device...\n"
+	     "\n"
+	     "Runs the in-kernel btree perf tests against an unmounted filesystem\n"
+	     "and reports the results as JSON. Test keys are written to the xattrs\n"
+	     "btree at inode 0 - only run this on a scratch filesystem.\n"
+	     "\n"
+	     "Options:\n"
+	     "  -T, --test=name             Test to run; may be given multiple times\n"
+	     "                              (default: all rand_* and seq_* tests)\n"
+	     "                              Data path and namespace tests, which use files\n"
+	     "                              in the root directory: data_write_seq,\n"
+	     "                              data_write_rand, data_read_seq, data_read_rand,\n"
+	     "                              reflink_remap, fs_create_unlink, fs_rename\n"
+	     "  -o, --options=opts          Filesystem options, e.g. compression=lz4,\n"
+	     "                              data_checksum=xxhash,data_replicas=2\n"
+	     "  -n, --nr=nr                 Number of operations per test (default 100k)\n"
+	     "  -t, --threads=nr            Number of threads (default 1)\n"
+	     "  -w, --warmup=nr             Operations to run before measuring (default 0)\n"
+	     "  -d, --distribution=dist     Key distribution for rand_* tests:\n"
+	     "                              uniform (default), zipfian, sequential\n"
+	     "  -r, --replay=file           Instead of the tests, replay a btree workload\n"
+	     "                              captured from debugfs btree_trace\n"
+	     "      --timed                 Replay at the recorded rate, not flat out\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+}
+
+static const struct {
+	const char	*name;
+	unsigned	ppm;
+} bench_quantiles[] = {
+	{ "p50",	500000 },
+	{ "p90",	900000 },
+	{ "p99",	990000 },
+	{ "p999",	999000 },
+	{ "p9999",	999900 },
+};
+
+static void bench_result_to_json(const char *test, u64 nr, unsigned nr_threads,
+				 struct bch2_perf_test_result *r)
+{
+	struct bch2_perf_test_hist *h = r->latency;
+	u64 time = max_t(u64, r->time, 1);
+
+	printf("    {\n"
+	       "      \"test\": \"%s\",\n"
+	       "      \"distribution\": \"%s\",\n"
+	       "      \"nr\": %llu,\n"
+	       "      \"warmup\": %llu,\n"
+	       "      \"threads\": %u,\n"
+	       "      \"time_ns\": %llu,\n"
+	       "      \"ns_per_op\": %llu,\n"
+	       "      \"ops_per_sec\": %llu,\n",
+	       test, bch2_perf_test_dists[r->dist], nr, r->warmup, nr_threads, r->time,
+	       div64_u64(time * nr_threads, max_t(u64, nr, 1)),
+	       div64_u64(nr * NSEC_PER_SEC, time));
+
+	printf("      \"latency_ns\": {\n"
+	       "        \"count\": %llu,\n"
+	       "        \"mean\": %llu,\n",
+	       h->nr,
+	       h->nr ? div64_u64(h->sum, h->nr) : 0);
+
+	for (unsigned i = 0; i < ARRAY_SIZE(bench_quantiles); i++)
+		printf("        \"%s\": %llu,\n", bench_quantiles[i].name,
+		       bch2_perf_test_hist_quantile(h, bench_quantiles[i].ppm));
+
+	printf("        \"max\": %llu\n"
+	       "      }\n"
+	       "    }", h->max);
+}
+
+/* Reads a trace from debugfs btree_trace, dropping the header records: */
+static struct btree_trace_entry *bench_read_trace(const char *path, size_t *nr)
+{
+	int fd = xopen(path, O_RDONLY);
+	size_t nr_records = xfstat(fd).st_size / sizeof(struct btree_trace_entry);
+	struct btree_trace_entry *e = xmalloc(max_t(size_t, nr_records, 1) * sizeof(*e));
+	size_t i, n = 0;
+
+	xpread(fd, e, nr_records * sizeof(*e), 0);
+	close(fd);
+
+	for (i = 0; i < nr_records; i++) {
+		struct btree_trace_header *h = (void *) &e[i];
+
+		if (le64_to_cpu(h->magic) == BTREE_TRACE_MAGIC) {
+			if (le32_to_cpu(h->version) != BTREE_TRACE_VERSION ||
+			    le32_to_cpu(h->entry_size) != sizeof(*e))
+				die("%s: unsupported trace version %u", path,
+				    le32_to_cpu(h->version));
+			if (h->dropped)
+				fprintf(stderr, "warning: %llu updates were dropped while tracing\n",
+					le64_to_cpu(h->dropped));
+			continue;
+		}
+
+		if (!i)
+			die("%s: not a btree trace", path);
+		if (e[i].op >= BTREE_TRACE_OP_NR)
+			die("%s: invalid record %zu", path, i);
+
+		e[n++] = e[i];
+	}
+
+	*nr = n;
+	return e;
+}
+
+static int bench_replay(struct bch_fs *c, const char *path, bool timed,
+			struct bch2_perf_test_hist *latency)
+{
+	struct bch2_perf_test_result r = { .latency = latency };
+	size_t nr, nr_trans = 0;
+	struct btree_trace_entry *e = bench_read_trace(path, &nr);
+
+	for (size_t i = 0; i < nr; i++)
+		nr_trans += i == 0 || (e[i].flags & BTREE_TRACE_FIRST);
+
+	memset(latency, 0, sizeof(*latency));
+
+	int ret = bch2_btree_trace_replay(c, e, nr, timed, &r);
+	if (ret)
+		fprintf(stderr, "replay of %s failed: %s\n", path, bch2_err_str(ret));
+	else
+		bench_result_to_json("replay", nr_trans, 1, &r);
+
+	free(e);
+	return ret;
+}
+
+int cmd_bench(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "test",	required_argument,	NULL, 'T' },
+		{ "nr",		required_argument,	NULL, 'n' },
+		{ "threads",	required_argument,	NULL, 't' },
+		{ "warmup",	required_argument,	NULL, 'w' },
+		{ "distribution", required_argument,	NULL, 'd' },
+		{ "options",	required_argument,	NULL, 'o' },
+		{ "replay",	required_argument,	NULL, 'r' },
+		{ "timed",	no_argument,		NULL, 'R' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct bch_opts opts = bch2_opts_empty();
+	char *opts_str = NULL, *replay = NULL;
+	bool timed = false;
+	DARRAY(const char *) tests = {};
+	u64 nr = 100000, warmup = 0;
+	unsigned nr_threads = 1;
+	enum bch2_perf_test_dist dist = BCH_PERF_TEST_DIST_uniform;
+	int opt, ret = 0;
+
+	while ((opt = getopt_long(argc, argv, "T:n:t:w:d:o:r:h", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'T':
+			if (darray_push(&tests, optarg))
+				die("allocation failure");
+			break;
+		case 'n':
+			if (bch2_strtoull_h(optarg, &nr) || !nr)
+				die("invalid number of operations %s", optarg);
+			break;
+		case 't':
+			if (kstrtouint(optarg, 10, &nr_threads) || !nr_threads)
+				die("invalid number of threads %s", optarg);
+			break;
+		case 'w':
+			if (bch2_strtoull_h(optarg, &warmup))
+				die("invalid number of warmup operations %s", optarg);
+			break;
+		case 'd':
+			ret = match_string(bch2_perf_test_dists, -1, optarg);
+			if (ret < 0)
+				die("invalid distribution %s", optarg);
+			dist = ret;
+			ret = 0;
+			break;
+		case 'o':
+			opts_str = optarg;
+			break;
+		case 'r':
+			replay = optarg;
+			break;
+		case 'R':
+			timed = true;
+			break;
+		case 'h':
+			bench_usage();
+			exit(EXIT_SUCCESS);
+		}
+	args_shift(optind);
+
+	if (!argc)
+		die("Please supply one or more devices");
+
+	if (!tests.nr)
+		for (const char * const *i = bench_default_tests; *i; i++)
+			if (darray_push(&tests, *i))
+				die("allocation failure");
+
+	if (opts_str) {
+		struct printbuf parse_later = PRINTBUF;
+
+		if (bch2_parse_mount_opts(NULL, &opts, &parse_later, opts_str))
+			die("invalid options %s", opts_str);
+		printbuf_exit(&parse_later);
+	}
+
+	struct bch_fs *c = bch2_fs_open(argv, argc, opts);
+	if (IS_ERR(c))
+		die("Error opening %s: %s", argv[0], bch2_err_str(PTR_ERR(c)));
+
+	printf("{\n"
+	       "  \"results\": [\n");
+
+	struct bch2_perf_test_hist *latency = xmalloc(sizeof(*latency));
+
+	if (replay) {
+		ret = bench_replay(c, replay, timed, latency);
+		goto out;
+	}
+
+	darray_for_each(tests, i) {
+		struct bch2_perf_test_result r = {
+			.warmup		= warmup,
+			.dist		= dist,
+			.latency	= latency,
+		};
+
+		memset(latency, 0, sizeof(*latency));
+
+		ret = __bch2_btree_perf_test(c, *i, nr, nr_threads, &r);
+		if (ret) {
+			fprintf(stderr, "test %s failed: %s\n", *i, bch2_err_str(ret));
+			break;
+		}
+
+		if (i != tests.data)
+			printf(",\n");
+		bench_result_to_json(*i, nr, nr_threads, &r);
+	}
+out:
+	printf("\n"
+	       "  ]\n"
+	       "}\n");
+
+	bch2_fs_stop(c);
+	free(latency);
+	darray_exit(&tests);
+	return ret ? EXIT_FAILURE : 0;
+}
@@ -1,7 +1,12 @@
 
 
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "libbcachefs/bcachefs_ioctl.h"
 #include "libbcachefs/btree_cache.h"
@@ -18,6 +23,7 @@ int data_usage(void)
 	     "Commands:\n"
 	     "  rereplicate                     Rereplicate degraded data\n"
 	     "  job                             Kick off low level data jobs\n"
+	     "  defrag                          Defragment files\n"
 	     "\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
 	return 0;
@@ -71,12 +77,14 @@ static void data_job_usage(void)
 	     "\n"
 	     "Kick off a data job and report progress\n"
 	     "\n"
-	     "job: one of scrub, rereplicate, migrate, rewrite_old_nodes, or drop_extra_replicas\n"
+	     "job: one of scrub, rereplicate, migrate, rewrite_old_nodes, drop_extra_replicas,\n"
+	     "     dedup, btree_defrag or defrag\n"
 	     "\n"
 	     "Options:\n"
 	     "  -b btree                    btree to operate on\n"
 	     "  -s inode:offset       start position\n"
 	     "  -e inode:offset       end position\n"
+	     "  -d dev                      device index, for scrub and migrate\n"
 	     "  -h, --help                  display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
 	exit(EXIT_SUCCESS);
@@ -92,7 +100,7 @@ int cmd_data_job(int argc, char *argv[])
 	};
 	int opt;
 
-	while ((opt = getopt(argc, argv, "s:e:h")) != -1)
+	while ((opt = getopt(argc, argv, "s:e:d:h")) != -1)
 		switch (opt) {
 		case 'b':
 			op.start_btree = read_string_list_or_die(optarg,
@@ -105,6 +113,11 @@ int cmd_data_job(int argc, char *argv[])
 			op.end_pos	= bpos_parse(optarg);
 		case 'e':
 			break;
+		case 'd':
+			/* scrub.dev and migrate.dev are the same field: */
+			if (kstrtouint(optarg, 10, &op.migrate.dev))
+				die("invalid device index %s", optarg);
+			break;
 		case 'h':
 			data_job_usage();
 		}
@@ -125,3 +138,162 @@ int cmd_data_job(int argc, char *argv[])
 
 	return bchu_data(bcache_fs_open(fs_path), op);
 }
+
+static void data_defrag_usage(void)
+{
+	puts("bcachefs data defrag\n"
+	     "Usage: bcachefs data defrag [OPTION]... file|directory...\n"
+	     "\n"
+	     "Rewrites fragmented files on a mounted filesystem so that their data is\n"
+	     "contiguous on disk. Directories are walked recursively; files whose\n"
+	     "average extent is already at least the target size are skipped.\n"
+	     "\n"
+	     "Options:\n"
+	     "  -s, --extent-size=size      Target extent size (default 8M)\n"
+	     "  -r, --rate=size             Maximum rate to rewrite at, per second\n"
+	     "                              (default: no limit)\n"
+	     "  -v, --verbose               Print each file as it's defragmented\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+}
+
+static struct data_defrag_state {
+	struct bchfs_handle	fs;
+	bool			have_fs;
+	u64			extent_sectors;
+	u64			max_rate;
+	bool			verbose;
+	u64			nr_files;
+	u64			nr_defragged;
+} defrag;
+
+static bool file_fragmented(int fd)
+{
+	struct fiemap_iter iter;
+	struct fiemap_extent e;
+	u64 nr = 0, bytes = 0;
+
+	fiemap_for_each(fd, iter, e) {
+		if (e.fe_flags & FIEMAP_EXTENT_UNKNOWN)
+			continue;
+		nr++;
+		bytes += e.fe_length;
+	}
+	fiemap_iter_exit(&iter);
+
+	return nr > 1 && bytes / nr < defrag.extent_sectors << 9;
+}
+
+/* Like bchu_data(), but waits for the job without printing progress: */
+static void defrag_file(const char *path, u64 inum)
+{
+	struct bch_ioctl_data op = {
+		.op		= BCH_DATA_OP_defrag,
+		.start_btree	= BTREE_ID_extents,
+		.start_pos	= POS(inum, 0),
+		.end_btree	= BTREE_ID_extents,
+		.end_pos	= POS(inum, U64_MAX),
+		.defrag	= {
+			.extent_sectors	= defrag.extent_sectors,
+			.max_rate	= defrag.max_rate,
+		},
+	};
+	int progress_fd = xioctl(defrag.fs.ioctl_fd, BCH_IOCTL_DATA, &op);
+
+	while (1) {
+		struct bch_ioctl_data_event e;
+
+		if (read(progress_fd, &e, sizeof(e)) != sizeof(e))
+			die("error reading from progress fd %m");
+
+		if (!e.type && e.p.data_type == U8_MAX)
+			break;
+	}
+
+	close(progress_fd);
+
+	if (defrag.verbose)
+		printf("%s\n", path);
+}
+
+static int data_defrag_file(const char *path, const struct stat *st,
+			    int type, struct FTW *ftw)
+{
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "error opening %s: %m\n", path);
+		return 0;
+	}
+
+	if (!defrag.have_fs) {
+		defrag.fs = bcache_fs_open(path);
+		defrag.have_fs = true;
+	}
+
+	defrag.nr_files++;
+
+	if (file_fragmented(fd)) {
+		defrag_file(path, st->st_ino);
+		defrag.nr_defragged++;
+	}
+
+	close(fd);
+	return 0;
+}
+
+int cmd_data_defrag(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "extent-size",	required_argument,	NULL, 's' },
+		{ "rate",		required_argument,	NULL, 'r' },
+		{ "verbose",		no_argument,		NULL, 'v' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	u64 extent_size = 8 << 20;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "s:r:vh", longopts, NULL)) != -1)
+		switch (opt) {
+		case 's':
+			if (bch2_strtoull_h(optarg, &extent_size) ||
+			    extent_size < 4096 ||
+			    (extent_size >> 9) > U32_MAX)
+				die("invalid extent size %s", optarg);
+			break;
+		case 'r':
+			if (bch2_strtoull_h(optarg, &defrag.max_rate))
+				die("invalid rate %s", optarg);
+			break;
+		case 'v':
+			defrag.verbose = true;
+			break;
+		case 'h':
+			data_defrag_usage();
+			exit(EXIT_SUCCESS);
+		default:
+			data_defrag_usage();
+			exit(EXIT_FAILURE);
+		}
+	args_shift(optind);
+
+	if (!argc)
+		die("Please supply one or more files or directories");
+
+	defrag.extent_sectors = extent_size >> 9;
+
+	/* The first file found opens the filesystem; don't cross into others: */
+	for (unsigned i = 0; i < argc; i++)
+		if (nftw(argv[i], data_defrag_file, 64, FTW_PHYS|FTW_MOUNT) < 0)
+			die("error walking %s: %m", argv[i]);
+
+	printf("%llu files checked, %llu defragmented\n",
+	       defrag.nr_files, defrag.nr_defragged);
+
+	if (defrag.have_fs)
+		bcache_fs_close(defrag.fs);
+	return 0;
+}
@@ -1,5 +1,6 @@
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -23,52 +24,33 @@ static void dump_usage(void)
 	     "Usage: bcachefs dump [OPTION]... <devices>\n"
 	     "\n"
 	     "Options:\n"
-	     "  -o output     Output qcow2 image(s)\n"
-	     "  -f, --force   Force; overwrite when needed\n"
-	     "  --nojournal   Don't dump entire journal, just dirty entries\n"
-	     "  -h, --help    Display this help and exit\n"
+	     "  -o output       Output qcow2 image(s)\n"
+	     "  -f, --force     Force; overwrite when needed\n"
+	     "  -z, --compress  Compress the image(s); zeroed blocks are always omitted\n"
+	     "  -b, --backing   Record each device as its image's backing file: the\n"
+	     "                  image can then be used in place of the device, e.g.\n"
+	     "                  with fsck, and writes go to the image, not the device\n"
+	     "  --nojournal     Don't dump entire journal, just dirty entries\n"
+	     "  -h, --help      Display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
 }
 
-static void dump_node(struct bch_fs *c, struct bch_dev *ca, struct bkey_s_c k, ranges *data)
+/* @data is indexed by device: */
+static void dump_node(struct bch_fs *c, struct bkey_s_c k, ranges *data)
 {
 	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
 
 	bkey_for_each_ptr(ptrs, ptr)
-		if (ptr->dev == ca->dev_idx)
-			range_add(data, ptr->offset << 9, c->opts.btree_node_size);
+		if (ptr->dev < c->sb.nr_devices)
+			range_add(&data[ptr->dev], ptr->offset << 9, c->opts.btree_node_size);
 }
 
-static void dump_one_device(struct bch_fs *c, struct bch_dev *ca, int fd,
-			    bool entire_journal)
+/* Walks the btree once, for every device: */
+static void dump_btree_ranges(struct bch_fs *c, ranges *data)
 {
-	struct bch_sb *sb = ca->disk_sb.sb;
-	ranges data = { 0 };
-	unsigned i;
 	int ret;
 
-	/* Superblock: */
-	range_add(&data, BCH_SB_LAYOUT_SECTOR << 9,
-		  sizeof(struct bch_sb_layout));
-
-	for (i = 0; i < sb->layout.nr_superblocks; i++)
-		range_add(&data,
-			  le64_to_cpu(sb->layout.sb_offset[i]) << 9,
-			  vstruct_bytes(sb));
-
-	/* Journal: */
-	for (i = 0; i < ca->journal.nr; i++)
-		if (entire_journal ||
-		    ca->journal.bucket_seq[i] >= c->journal.last_seq_ondisk) {
-			u64 bucket = ca->journal.buckets[i];
-
-			range_add(&data,
-				  bucket_bytes(ca) * bucket,
-				  bucket_bytes(ca));
-		}
-
-	/* Btree: */
-	for (i = 0; i < BTREE_ID_NR; i++) {
+	for (unsigned i = 0; i < BTREE_ID_NR; i++) {
 		struct btree_trans *trans = bch2_trans_get(c);
 		struct btree_iter iter;
 		struct btree *b;
@@ -79,7 +61,7 @@ static void dump_one_device(struct bch_fs *c, struct bch_dev *ca, int fd,
 			struct bkey_s_c k;
 
 			for_each_btree_node_key_unpack(b, k, &iter, &u)
-				dump_node(c, ca, k, &data);
+				dump_node(c, k, data);
 		}
 
 		if (ret)
@@ -87,15 +69,59 @@ static void dump_one_device(struct bch_fs *c, struct bch_dev *ca, int fd,
 
 		b = bch2_btree_id_root(c, i)->b;
 		if (!btree_node_fake(b))
-			dump_node(c, ca, bkey_i_to_s_c(&b->key), &data);
+			dump_node(c, bkey_i_to_s_c(&b->key), data);
 
 		bch2_trans_iter_exit(trans, &iter);
 		bch2_trans_put(trans);
 	}
+}
+
+static void dump_sb_journal_ranges(struct bch_fs *c, struct bch_dev *ca,
+				   ranges *data, bool entire_journal)
+{
+	struct bch_sb *sb = ca->disk_sb.sb;
+	unsigned i;
+
+	/* Superblock: */
+	range_add(data, BCH_SB_LAYOUT_SECTOR << 9,
+		  sizeof(struct bch_sb_layout));
+
+	for (i = 0; i < sb->layout.nr_superblocks; i++)
+		range_add(data,
+			  le64_to_cpu(sb->layout.sb_offset[i]) << 9,
+			  vstruct_bytes(sb));
+
+	/* Journal: */
+	for (i = 0; i < ca->journal.nr; i++)
+		if (entire_journal ||
+		    ca->journal.bucket_seq[i] >= c->journal.last_seq_ondisk) {
+			u64 bucket = ca->journal.buckets[i];
+
+			range_add(data,
+				  bucket_bytes(ca) * bucket,
+				  bucket_bytes(ca));
+		}
+}
 
-	qcow2_write_image(ca->disk_sb.bdev->bd_fd, fd, &data,
-			  max_t(unsigned, c->opts.btree_node_size / 8, block_bytes(c)));
-	darray_exit(&data);
+struct dump_dev {
+	struct bch_fs		*c;
+	struct bch_dev		*ca;
+	int			fd;
+	bool			compress;
+	char			*backing;
+	ranges			*data;
+	pthread_t		thread;
+};
+
+static void *dump_one_device(void *arg)
+{
+	struct dump_dev *d = arg;
+	struct bch_fs *c = d->c;
+
+	qcow2_write_image(d->ca->disk_sb.bdev->bd_fd, d->fd, d->data,
+			  max_t(unsigned, c->opts.btree_node_size / 8, block_bytes(c)),
+			  d->compress, d->backing);
+	return NULL;
 }
 
 int cmd_dump(int argc, char *argv[])
@@ -103,6 +129,8 @@ int cmd_dump(int argc, char *argv[])
 	static const struct option longopts[] = {
 		{ "force",		no_argument,		NULL, 'f' },
 		{ "nojournal",		no_argument,		NULL, 'j' },
+		{ "compress",		no_argument,		NULL, 'z' },
+		{ "backing",		no_argument,		NULL, 'b' },
 		{ "verbose",		no_argument,		NULL, 'v' },
 		{ "help",		no_argument,		NULL, 'h' },
 		{ NULL }
@@ -110,19 +138,20 @@ int cmd_dump(int argc, char *argv[])
 	struct bch_opts opts = bch2_opts_empty();
 	char *out = NULL;
 	unsigned nr_devices = 0;
-	bool force = false, entire_journal = true;
-	int fd, opt;
+	bool force = false, entire_journal = true, compress = false, backing = false;
+	int opt;
 
 	opt_set(opts, direct_io,	false);
 	opt_set(opts, read_only,	true);
 	opt_set(opts, nochanges,	true);
+	opt_set(opts, mmap_devices,	true);
 	opt_set(opts, norecovery,	true);
 	opt_set(opts, degraded,		true);
 	opt_set(opts, very_degraded,	true);
 	opt_set(opts, errors,		BCH_ON_ERROR_continue);
 	opt_set(opts, fix_errors,	FSCK_FIX_no);
 
-	while ((opt = getopt_long(argc, argv, "o:fvh",
+	while ((opt = getopt_long(argc, argv, "o:fzbvh",
 				  longopts, NULL)) != -1)
 		switch (opt) {
 		case 'o':
@@ -134,6 +163,12 @@ int cmd_dump(int argc, char *argv[])
 		case 'j':
 			entire_journal = false;
 			break;
+		case 'z':
+			compress = true;
+			break;
+		case 'b':
+			backing = true;
+			break;
 		case 'v':
 			opt_set(opts, verbose, true);
 			break;
@@ -160,6 +195,13 @@ int cmd_dump(int argc, char *argv[])
 
 	BUG_ON(!nr_devices);
 
+	ranges *data = xcalloc(c->sb.nr_devices, sizeof(*data));
+	struct dump_dev *devs = xcalloc(nr_devices, sizeof(*devs));
+	struct dump_dev *d = devs;
+
+	dump_btree_ranges(c, data);
+
+	/* Devices are independent, so they're written in parallel: */
 	for_each_online_member(c, ca) {
 		int flags = O_WRONLY|O_CREAT|O_TRUNC;
 
@@ -169,15 +211,45 @@ int cmd_dump(int argc, char *argv[])
 		char *path = nr_devices > 1
 			? mprintf("%s.%u.qcow2", out, ca->dev_idx)
 			: mprintf("%s.qcow2", out);
-		fd = xopen(path, flags, 0600);
+
+		if (ca->disk_sb.bdev->bd_qcow2)
+			die("%s is a qcow2 image, not a device", ca->disk_sb.sb_name);
+
+		*d = (struct dump_dev) {
+			.c		= c,
+			.ca		= ca,
+			.fd		= xopen(path, flags, 0600),
+			.compress	= compress,
+			.data		= &data[ca->dev_idx],
+		};
 		free(path);
 
-		dump_one_device(c, ca, fd, entire_journal);
-		close(fd);
+		if (backing) {
+			d->backing = realpath(ca->disk_sb.sb_name, NULL);
+			if (!d->backing)
+				die("error getting path of %s: %m", ca->disk_sb.sb_name);
+		}
+
+		dump_sb_journal_ranges(c, ca, d->data, entire_journal);
+
+		if (pthread_create(&d->thread, NULL, dump_one_device, d))
+			die("error creating thread");
+		d++;
+	}
+
+	for (d = devs; d < devs + nr_devices; d++) {
+		pthread_join(d->thread, NULL);
+		close(d->fd);
+		free(d->backing);
 	}
 
 	up_read(&c->state_lock);
 
+	for (unsigned i = 0; i < c->sb.nr_devices; i++)
+		darray_exit(&data[i]);
+	free(data);
+	free(devs);
+
 	bch2_fs_stop(c);
 	return 0;
 }
@@ -10,7 +10,9 @@
 #include "libbcachefs/bcachefs_ioctl.h"
 #include "libbcachefs/buckets.h"
 #include "libbcachefs/disk_accounting.h"
+#include "libbcachefs/disk_groups.h"
 #include "libbcachefs/opts.h"
+#include "libbcachefs/sb-members.h"
 #include "libbcachefs/super-io.h"
 
 #include "cmds.h"
@@ -257,11 +259,13 @@ static int fs_usage_v1_to_text(struct printbuf *out,
 			BIT(BCH_DISK_ACCOUNTING_replicas)|
 			BIT(BCH_DISK_ACCOUNTING_compression)|
 			BIT(BCH_DISK_ACCOUNTING_btree)|
-			BIT(BCH_DISK_ACCOUNTING_rebalance_work));
+			BIT(BCH_DISK_ACCOUNTING_rebalance_work)|
+			BIT(BCH_DISK_ACCOUNTING_rebalance_work_target));
 	if (!a)
 		return -1;
 
 	darray_accounting_p a_sorted = {};
+	struct bch_sb *sb = NULL;
 
 	accounting_sort(&a_sorted, a);
 
@@ -381,9 +385,24 @@ static int fs_usage_v1_to_text(struct printbuf *out,
 			prt_units_u64(out, a->v.d[0] << 9);
 			prt_newline(out);
 			break;
+		case BCH_DISK_ACCOUNTING_rebalance_work_target:
+			if (new_type) {
+				prt_printf(out, "\nPending writeback, by target:\n");
+				printbuf_tabstops_reset(out);
+				printbuf_tabstop_push(out, 16);
+				printbuf_tabstop_push(out, 16);
+				sb = bchu_read_super(fs, -1);
+			}
+			bch2_opt_target_to_text(out, NULL, sb, acc_k.rebalance_work_target.target);
+			prt_tab(out);
+			prt_units_u64(out, a->v.d[0] << 9);
+			prt_tab_rjust(out);
+			prt_newline(out);
+			break;
 		}
 	}
 
+	free(sb);
 	darray_exit(&a_sorted);
 	free(a);
 	return 0;
@@ -469,6 +488,25 @@ static void fs_usage_v0_to_text(struct printbuf *out,
 	free(u);
 }
 
+static void journal_entry_stats_to_text(struct printbuf *out,
+					struct bchfs_handle fs)
+{
+	/* Older kernels don't export this: */
+	if (faccessat(fs.sysfs_fd, "journal_entry_stats", R_OK, 0))
+		return;
+
+	char *stats = read_file_str(fs.sysfs_fd, "journal_entry_stats");
+	if (!stats)
+		return;
+
+	prt_printf(out, "\nJournal entries since mount:\n");
+	printbuf_indent_add(out, 2);
+	prt_str_indented(out, stats);
+	printbuf_indent_sub(out, 2);
+	prt_newline(out);
+	free(stats);
+}
+
 static void fs_usage_to_text(struct printbuf *out, const char *path)
 {
 	struct bchfs_handle fs = bcache_fs_open(path);
@@ -481,12 +519,200 @@ static void fs_usage_to_text(struct printbuf *out, const char *path)
 	fs_usage_v0_to_text(out, fs, dev_names);
 devs:
 	devs_usage_to_text(out, fs, dev_names);
+	journal_entry_stats_to_text(out, fs);
 
 	darray_exit(&dev_names);
 
 	bcache_fs_close(fs);
 }
 
+static void prt_json_str(struct printbuf *out, const char *s)
+{
+	prt_char(out, '"');
+	for (; s && *s; s++)
+		if (*s == '"' || *s == '\\')
+			prt_printf(out, "\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			prt_printf(out, "\\u%04x", *s);
+		else
+			prt_char(out, *s);
+	prt_char(out, '"');
+}
+
+static void accounting_json_section(struct printbuf *out, darray_accounting_p *a_sorted,
+				    enum disk_accounting_type type, const char *name,
+				    void (*fn)(struct printbuf *, struct disk_accounting_pos *,
+					       struct bkey_i_accounting *))
+{
+	bool first = true;
+
+	prt_printf(out, ",\n  \"%s\": [", name);
+	darray_for_each(*a_sorted, i) {
+		struct disk_accounting_pos acc_k;
+		bpos_to_disk_accounting_pos(&acc_k, (*i)->k.p);
+
+		if (acc_k.type != type)
+			continue;
+
+		prt_str(out, first ? "\n    {" : ",\n    {");
+		fn(out, &acc_k, *i);
+		prt_char(out, '}');
+		first = false;
+	}
+	prt_str(out, first ? "]" : "\n  ]");
+}
+
+static void persistent_reserved_to_json(struct printbuf *out, struct disk_accounting_pos *k,
+					struct bkey_i_accounting *a)
+{
+	prt_printf(out, "\"nr_replicas\": %u, \"bytes\": %llu",
+		   k->persistent_reserved.nr_replicas, a->v.d[0] << 9);
+}
+
+static void replicas_to_json(struct printbuf *out, struct disk_accounting_pos *k,
+			     struct bkey_i_accounting *a)
+{
+	prt_str(out, "\"data_type\": \"");
+	bch2_prt_data_type(out, k->replicas.data_type);
+	prt_printf(out, "\", \"nr_required\": %u, \"devs\": [", k->replicas.nr_required);
+	for (unsigned i = 0; i < k->replicas.nr_devs; i++)
+		prt_printf(out, "%s%u", i ? ", " : "", k->replicas.devs[i]);
+	prt_printf(out, "], \"bytes\": %llu", a->v.d[0] << 9);
+}
+
+static void compression_to_json(struct printbuf *out, struct disk_accounting_pos *k,
+				struct bkey_i_accounting *a)
+{
+	prt_str(out, "\"type\": \"");
+	bch2_prt_compression_type(out, k->compression.type);
+	prt_printf(out, "\", \"nr_extents\": %llu, \"uncompressed_bytes\": %llu, \"compressed_bytes\": %llu",
+		   a->v.d[0], a->v.d[1] << 9, a->v.d[2] << 9);
+}
+
+static void btree_to_json(struct printbuf *out, struct disk_accounting_pos *k,
+			  struct bkey_i_accounting *a)
+{
+	prt_printf(out, "\"btree\": \"%s\", \"bytes\": %llu",
+		   bch2_btree_id_str(k->btree.id), a->v.d[0] << 9);
+}
+
+static void rebalance_work_to_json(struct printbuf *out, struct disk_accounting_pos *k,
+				   struct bkey_i_accounting *a)
+{
+	prt_printf(out, "\"bytes\": %llu", a->v.d[0] << 9);
+}
+
+static void rebalance_work_target_to_json(struct printbuf *out, struct disk_accounting_pos *k,
+					  struct bkey_i_accounting *a)
+{
+	prt_printf(out, "\"target\": %u, \"bytes\": %llu",
+		   k->rebalance_work_target.target, a->v.d[0] << 9);
+}
+
+static void dev_usage_to_json(struct printbuf *out, darray_accounting_p *a_sorted,
+			      struct bch_sb *sb, struct dev_name *d)
+{
+	struct bch_member m = bch2_sb_member_get(sb, d->idx);
+	unsigned bucket_size = le16_to_cpu(m.bucket_size);
+	bool first = true;
+
+	prt_printf(out, "\n    {\"dev\": %u, \"label\": ", d->idx);
+	prt_json_str(out, d->label);
+	prt_str(out, ", \"path\": ");
+	prt_json_str(out, d->dev);
+	prt_printf(out, ", \"state\": \"%s\", \"bucket_size\": %u, \"nr_buckets\": %llu, \"data_types\": {",
+		   bch2_member_states[BCH_MEMBER_STATE(&m)],
+		   bucket_size << 9,
+		   le64_to_cpu(m.nbuckets) - le16_to_cpu(m.first_bucket));
+
+	darray_for_each(*a_sorted, i) {
+		struct disk_accounting_pos acc_k;
+		bpos_to_disk_accounting_pos(&acc_k, (*i)->k.p);
+
+		if (acc_k.type != BCH_DISK_ACCOUNTING_dev_data_type ||
+		    acc_k.dev_data_type.dev != d->idx)
+			continue;
+
+		unsigned type = acc_k.dev_data_type.data_type;
+		u64 buckets = (*i)->v.d[0];
+		/* as in dev_usage_type_to_text(): */
+		u64 sectors = type == BCH_DATA_free ||
+			type == BCH_DATA_need_discard ||
+			type == BCH_DATA_need_gc_gens
+			? buckets * bucket_size
+			: (*i)->v.d[1];
+
+		prt_str(out, first ? "\"" : ", \"");
+		bch2_prt_data_type(out, type);
+		prt_printf(out, "\": {\"buckets\": %llu, \"bytes\": %llu, \"fragmented_bytes\": %llu}",
+			   buckets, sectors << 9, (*i)->v.d[2] << 9);
+		first = false;
+	}
+	prt_str(out, "}}");
+}
+
+/*
+ * Everything comes from one (paginated) accounting query and one superblock
+ * read, so this is cheap enough for monitoring to poll:
+ */
+static void fs_usage_to_json(struct printbuf *out, const char *path)
+{
+	struct bchfs_handle fs = bcache_fs_open(path);
+	dev_names dev_names = bchu_fs_get_devices(fs);
+	struct bch_ioctl_query_accounting *a =
+		bchu_fs_accounting(fs,
+			BIT(BCH_DISK_ACCOUNTING_persistent_reserved)|
+			BIT(BCH_DISK_ACCOUNTING_replicas)|
+			BIT(BCH_DISK_ACCOUNTING_dev_data_type)|
+			BIT(BCH_DISK_ACCOUNTING_compression)|
+			BIT(BCH_DISK_ACCOUNTING_btree)|
+			BIT(BCH_DISK_ACCOUNTING_rebalance_work)|
+			BIT(BCH_DISK_ACCOUNTING_rebalance_work_target));
+	if (!a)
+		die("%s: kernel does not support accounting queries", path);
+
+	struct bch_sb *sb = bchu_read_super(fs, -1);
+	darray_accounting_p a_sorted = {};
+
+	accounting_sort(&a_sorted, a);
+
+	prt_str(out, "{\n  \"uuid\": \"");
+	pr_uuid(out, fs.uuid.b);
+	prt_printf(out, "\",\n  \"capacity\": %llu,\n  \"used\": %llu,\n  \"online_reserved\": %llu",
+		   a->capacity << 9, a->used << 9, a->online_reserved << 9);
+
+	accounting_json_section(out, &a_sorted, BCH_DISK_ACCOUNTING_persistent_reserved,
+				"persistent_reserved", persistent_reserved_to_json);
+	accounting_json_section(out, &a_sorted, BCH_DISK_ACCOUNTING_replicas,
+				"replicas", replicas_to_json);
+	accounting_json_section(out, &a_sorted, BCH_DISK_ACCOUNTING_compression,
+				"compression", compression_to_json);
+	accounting_json_section(out, &a_sorted, BCH_DISK_ACCOUNTING_btree,
+				"btree", btree_to_json);
+	accounting_json_section(out, &a_sorted, BCH_DISK_ACCOUNTING_rebalance_work,
+				"rebalance_work", rebalance_work_to_json);
+	accounting_json_section(out, &a_sorted, BCH_DISK_ACCOUNTING_rebalance_work_target,
+				"rebalance_work_target", rebalance_work_target_to_json);
+
+	sort(dev_names.data, dev_names.nr, sizeof(dev_names.data[0]), dev_by_label_cmp, NULL);
+
+	prt_str(out, ",\n  \"devices\": [");
+	darray_for_each(dev_names, dev) {
+		if (dev != dev_names.data)
+			prt_char(out, ',');
+		dev_usage_to_json(out, &a_sorted, sb, dev);
+		free(dev->dev);
+		free(dev->label);
+	}
+	prt_str(out, "\n  ]\n}\n");
+
+	darray_exit(&a_sorted);
+	darray_exit(&dev_names);
+	free(sb);
+	free(a);
+	bcache_fs_close(fs);
+}
+
 static void fs_usage_usage(void)
 {
 	puts("bcachefs fs usage - display detailed filesystem usage\n"
@@ -494,6 +720,7 @@ static void fs_usage_usage(void)
 	     "\n"
 	     "Options:\n"
 	     "  -h, --human-readable              Human readable units\n"
+	     "  -j, --json                        Output JSON, for monitoring\n"
 	     "  -H, --help                        Display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
 }
@@ -503,19 +730,23 @@ int cmd_fs_usage(int argc, char *argv[])
 	static const struct option longopts[] = {
 		{ "help",		no_argument,		NULL, 'H' },
 		{ "human-readable",     no_argument,            NULL, 'h' },
+		{ "json",		no_argument,		NULL, 'j' },
 		{ NULL }
 	};
-	bool human_readable = false;
+	bool human_readable = false, json = false;
 	struct printbuf buf = PRINTBUF;
 	char *fs;
 	int opt;
 
-	while ((opt = getopt_long(argc, argv, "h",
+	while ((opt = getopt_long(argc, argv, "hj",
 				  longopts, NULL)) != -1)
 		switch (opt) {
 		case 'h':
 			human_readable = true;
 			break;
+		case 'j':
+			json = true;
+			break;
 		case 'H':
 			fs_usage_usage();
 			exit(EXIT_SUCCESS);
@@ -528,13 +759,19 @@ int cmd_fs_usage(int argc, char *argv[])
 	if (!argc) {
 		printbuf_reset(&buf);
 		buf.human_readable_units = human_readable;
-		fs_usage_to_text(&buf, ".");
+		if (json)
+			fs_usage_to_json(&buf, ".");
+		else
+			fs_usage_to_text(&buf, ".");
 		printf("%s", buf.buf);
 	} else {
 		while ((fs = arg_pop())) {
 			printbuf_reset(&buf);
 			buf.human_readable_units = human_readable;
-			fs_usage_to_text(&buf, fs);
+			if (json)
+				fs_usage_to_json(&buf, fs);
+			else
+				fs_usage_to_text(&buf, fs);
 			printf("%s", buf.buf);
 		}
 	}
@@ -4,7 +4,10 @@
 #include <sys/uio.h>
 #include <unistd.h>
 #include "cmds.h"
+#include "libbcachefs/btree_gc.h"
+#include "libbcachefs/btree_iter.h"
 #include "libbcachefs/error.h"
+#include "libbcachefs/lock_profile.h"
 #include "libbcachefs.h"
 #include "libbcachefs/super.h"
 #include "libbcachefs/super-io.h"
@@ -23,6 +26,9 @@ static void fsck_usage(void)
 	     "  -r, --ratelimit_errors  Don't display more than 10 errors of a given type\n"
 	     "  -R, --reconstruct_alloc Reconstruct the alloc btree\n"
 	     "  -k, --kernel            Use the in-kernel fsck implementation\n"
+	     "  -q, --quick[=nr]        Quick check, without repair: check the superblock,\n"
+	     "                          journal and btree topology, and read a random\n"
+	     "                          sample of nr leaf nodes per btree (default 1000)\n"
 	     "  -v                      Be verbose\n"
 	     "  -h, --help              Display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
@@ -111,6 +117,49 @@ static void append_opt(struct printbuf *out, const char *opt)
 	prt_str(out, opt);
 }
 
+static int fsck_quick(darray_str devs, unsigned nr_samples, bool verbose)
+{
+	struct bch_opts opts = bch2_opts_empty();
+	struct printbuf parse_later = PRINTBUF;
+	struct bch_fsck_sample s;
+	int ret;
+
+	ret = bch2_parse_mount_opts(NULL, &opts, &parse_later,
+				    "degraded,read_only,nochanges,fix_errors=no");
+	if (ret)
+		return ret;
+	opt_set(opts, verbose, verbose);
+
+	/* The superblock and journal are validated when we start: */
+	struct bch_fs *c = bch2_fs_open(devs.data, devs.nr, opts);
+	if (IS_ERR(c))
+		exit(8);
+
+	printf("checking btree topology\n");
+	ret = bch2_check_topology(c);
+
+	if (!ret) {
+		printf("sampling leaf nodes\n");
+		ret = bch2_fsck_sample_leaves(c, nr_samples, &s);
+	}
+
+	if (!ret) {
+		struct printbuf buf = PRINTBUF;
+
+		bch2_fsck_sample_to_text(&buf, &s);
+		printf("%s", buf.buf);
+		printbuf_exit(&buf);
+	}
+
+	ret = ret || s.nr_errors || test_bit(BCH_FS_error, &c->flags) ? 4 : 0;
+	if (ret)
+		fprintf(stderr, "%s: has errors, run a full fsck\n", c->name);
+
+	bch2_fs_stop(c);
+	printbuf_exit(&parse_later);
+	return ret;
+}
+
 static bool should_use_kernel_fsck(darray_str devs)
 {
 	system("modprobe bcachefs");
@@ -167,10 +216,13 @@ int cmd_fsck(int argc, char *argv[])
 		{ "reconstruct_alloc",	no_argument,		NULL, 'R' },
 		{ "kernel",		no_argument,		NULL, 'k' },
 		{ "no-kernel",		no_argument,		NULL, 'K' },
+		{ "quick",		optional_argument,	NULL, 'q' },
 		{ "help",		no_argument,		NULL, 'h' },
 		{ NULL }
 	};
 	int kernel = -1; /* unset */
+	bool quick = false, verbose = false;
+	unsigned nr_samples = 1000;
 	int opt, ret = 0;
 	struct printbuf opts_str = PRINTBUF;
 
@@ -183,7 +235,7 @@ int cmd_fsck(int argc, char *argv[])
 	append_opt(&opts_str, "read_only");
 
 	while ((opt = getopt_long(argc, argv,
-				  "apynfo:rRkvh",
+				  "apynfo:rRkq::vh",
 				  longopts, NULL)) != -1)
 		switch (opt) {
 		case 'a': /* outdated alias for -p */
@@ -213,8 +265,15 @@ int cmd_fsck(int argc, char *argv[])
 		case 'K':
 			kernel = false;
 			break;
+		case 'q':
+			quick = true;
+			if (optarg &&
+			    (kstrtouint(optarg, 10, &nr_samples) || !nr_samples))
+				die("invalid number of samples %s", optarg);
+			break;
 		case 'v':
 			append_opt(&opts_str, "verbose");
+			verbose = true;
 			break;
 		case 'h':
 			fsck_usage();
@@ -229,6 +288,15 @@ int cmd_fsck(int argc, char *argv[])
 
 	darray_str devs = get_or_split_cmdline_devs(argc, argv);
 
+	if (quick) {
+		darray_for_each(devs, i)
+			if (dev_mounted(*i))
+				die("%s is mounted: run fsck without --quick to check it online", *i);
+
+		printbuf_exit(&opts_str);
+		return fsck_quick(devs, nr_samples, verbose);
+	}
+
 	darray_for_each(devs, i)
 		if (dev_mounted(*i)) {
 			printf("Running fsck online\n");
@@ -283,6 +351,22 @@ userland_fsck:
 			ret |= 4;
 		}
 
+		if (c->opts.verbose) {
+			struct printbuf buf = PRINTBUF;
+
+			bch2_fs_btree_trans_restarts_to_text(&buf, c);
+			printf("%s", buf.buf);
+			printbuf_exit(&buf);
+		}
+
+		if (c->opts.lock_profiling) {
+			struct printbuf buf = PRINTBUF;
+
+			bch2_lock_profile_to_text(&buf, c);
+			printf("%s", buf.buf);
+			printbuf_exit(&buf);
+		}
+
 		bch2_fs_stop(c);
 	}
 
@@ -3,8 +3,10 @@
 #include <errno.h>
 #include <float.h>
 #include <getopt.h>
+#include <signal.h>
 #include <stdio.h>
 #include <sys/statvfs.h>
+#include <sys/sysinfo.h>
 
 #include <fuse_lowlevel.h>
 
@@ -23,23 +25,80 @@
 #include "libbcachefs/inode.h"
 #include "libbcachefs/io_read.h"
 #include "libbcachefs/io_write.h"
+#include "libbcachefs/journal.h"
+#include "libbcachefs/lock_profile.h"
 #include "libbcachefs/opts.h"
 #include "libbcachefs/super.h"
+#include "libbcachefs/xattr.h"
 
 /* mode_to_type(): */
 #include "libbcachefs/fs.h"
 
 #include <linux/dcache.h>
+#include <linux/kthread.h>
+#include <linux/xattr.h>
 
 /* XXX cut and pasted from fsck.c */
 #define QSTR(n) { { { .len = strlen(n) } }, .name = n }
 
-/* used by write_aligned function for waiting on bch2_write closure */
-struct write_aligned_op_t {
-        struct closure cl;
+struct fuse_align_io {
+	off_t		start;
+	size_t		pad_start;
+	off_t		end;
+	size_t		pad_end;
+	size_t		size;
+};
+
+/*
+ * Reads and writes are answered from their completion path, so that the
+ * session threads can go on to the next request while the IO is in flight:
+ */
+struct fuse_read_op {
+	fuse_req_t		req;
+	struct fuse_align_io	align;
+	size_t			size;
+	void			*buf;
+	struct bio_vec		bv;
 
-        /* must be last: */
-        struct bch_write_op             op;
+	/* must be last: */
+	struct bch_read_bio	rbio;
+};
+
+struct fuse_write_op {
+	fuse_req_t		req;
+	struct fuse_align_io	align;
+	size_t			size;
+	void			*buf;
+	struct bio_vec		bv;
+
+	/* must be last: */
+	struct bch_write_op	op;
+};
+
+/* buffered writes, see bf_wb_write(): */
+static struct delayed_work bf_wb_work;
+static bool bf_wb_dirty(subvol_inum);
+static int bf_wb_flush_inum(struct bch_fs *, subvol_inum);
+static void bf_wb_flush_all(void);
+
+/* per inode xattr cache, see bf_xattr_cache_lookup(): */
+static void bf_xattr_cache_init(void);
+static void bf_xattr_cache_invalidate(subvol_inum);
+static void bf_xattr_cache_exit(void);
+
+/* group commit of directory ops, see bf_dirop(): */
+static void bf_dirops_init(void);
+
+/* -o attr_timeout=, -o entry_timeout=; we're the only writer by default */
+static double bf_attr_timeout	= DBL_MAX;
+static double bf_entry_timeout	= DBL_MAX;
+
+/* used by write_aligned_sync() for waiting on the write */
+struct fuse_write_sync_op {
+	struct closure		cl;
+
+	/* must be last: */
+	struct fuse_write_op	w;
 };
 
 
@@ -79,8 +138,8 @@ static struct fuse_entry_param inode_to_entry(struct bch_fs *c,
 		.ino		= unmap_root_ino(bi->bi_inum),
 		.generation	= bi->bi_generation,
 		.attr		= inode_to_stat(c, bi),
-		.attr_timeout	= DBL_MAX,
-		.entry_timeout	= DBL_MAX,
+		.attr_timeout	= bf_attr_timeout,
+		.entry_timeout	= bf_entry_timeout,
 	};
 }
 
@@ -92,16 +151,65 @@ static void bcachefs_fuse_init(void *arg, struct fuse_conn_info *conn)
 	} else
 		fuse_log(FUSE_LOG_DEBUG, "fuse_init: writeback not capable\n");
 
+	/* Move data to and from /dev/fuse with splice() where we can: */
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ|
+				       FUSE_CAP_SPLICE_WRITE|
+				       FUSE_CAP_SPLICE_MOVE);
+
 	//conn->want |= FUSE_CAP_POSIX_ACL;
+
+	bf_xattr_cache_init();
+	bf_dirops_init();
 }
 
 static void bcachefs_fuse_destroy(void *arg)
 {
 	struct bch_fs *c = arg;
 
+	cancel_delayed_work_sync(&bf_wb_work);
+	bf_wb_flush_all();
+	bf_xattr_cache_exit();
+
+	if (c->opts.lock_profiling) {
+		struct printbuf buf = PRINTBUF;
+
+		bch2_lock_profile_to_text(&buf, c);
+		fprintf(stderr, "%s", buf.buf);
+		printbuf_exit(&buf);
+	}
+
 	bch2_fs_stop(c);
 }
 
+/*
+ * Look up the directory, the dirent and the target inode in one transaction:
+ * returns 1 if @name doesn't exist.
+ */
+static int lookup_trans(struct btree_trans *trans, subvol_inum dir,
+			const struct qstr *name, subvol_inum *inum,
+			struct bch_inode_unpacked *bi)
+{
+	struct bch_inode_unpacked dir_u;
+	struct btree_iter iter = { NULL };
+
+	int ret = bch2_inode_find_by_inum_trans(trans, dir, &dir_u);
+	if (ret)
+		return ret;
+
+	struct bch_hash_info hash_info = bch2_hash_info_init(trans->c, &dir_u);
+
+	ret = bch2_dirent_lookup_trans(trans, &iter, dir, &hash_info,
+				       name, inum, 0);
+	if (bch2_err_matches(ret, ENOENT))
+		return 1;
+	if (ret)
+		return ret;
+
+	bch2_trans_iter_exit(trans, &iter);
+
+	return bch2_inode_find_by_inum_trans(trans, *inum, bi);
+}
+
 static void bcachefs_fuse_lookup(fuse_req_t req, fuse_ino_t dir_ino,
 				 const char *name)
 {
@@ -115,25 +223,20 @@ static void bcachefs_fuse_lookup(fuse_req_t req, fuse_ino_t dir_ino,
 	fuse_log(FUSE_LOG_DEBUG, "fuse_lookup(dir=%llu name=%s)\n",
 		 dir.inum, name);
 
-	ret = bch2_inode_find_by_inum(c, dir, &bi);
-	if (ret) {
-		fuse_reply_err(req, -ret);
-		return;
-	}
-
-	struct bch_hash_info hash_info = bch2_hash_info_init(c, &bi);
-
-	ret = bch2_dirent_lookup(c, dir, &hash_info, &qstr, &inum);
-	if (ret) {
+	ret = bch2_trans_run(c, lockrestart_do(trans,
+			lookup_trans(trans, dir, &qstr, &inum, &bi)));
+	if (ret > 0) {
 		struct fuse_entry_param e = {
-			.attr_timeout	= DBL_MAX,
-			.entry_timeout	= DBL_MAX,
+			.attr_timeout	= bf_attr_timeout,
+			.entry_timeout	= bf_entry_timeout,
 		};
 		fuse_reply_entry(req, &e);
 		return;
 	}
 
-	ret = bch2_inode_find_by_inum(c, inum, &bi);
+	if (!ret && bf_wb_dirty(inum))
+		ret =   bf_wb_flush_inum(c, inum) ?:
+			bch2_inode_find_by_inum(c, inum, &bi);
 	if (ret)
 		goto err;
 
@@ -158,7 +261,8 @@ static void bcachefs_fuse_getattr(fuse_req_t req, fuse_ino_t ino,
 
 	fuse_log(FUSE_LOG_DEBUG, "fuse_getattr(inum=%llu)\n", inum.inum);
 
-	int ret = bch2_inode_find_by_inum(c, inum, &bi);
+	int ret = bf_wb_flush_inum(c, inum) ?:
+		bch2_inode_find_by_inum(c, inum, &bi);
 	if (ret) {
 		fuse_log(FUSE_LOG_DEBUG, "fuse_getattr error %i\n", ret);
 		fuse_reply_err(req, -ret);
@@ -168,7 +272,7 @@ static void bcachefs_fuse_getattr(fuse_req_t req, fuse_ino_t ino,
 	fuse_log(FUSE_LOG_DEBUG, "fuse_getattr success\n");
 
 	attr = inode_to_stat(c, &bi);
-	fuse_reply_attr(req, &attr, DBL_MAX);
+	fuse_reply_attr(req, &attr, bf_attr_timeout);
 }
 
 static void bcachefs_fuse_setattr(fuse_req_t req, fuse_ino_t ino,
@@ -186,6 +290,12 @@ static void bcachefs_fuse_setattr(fuse_req_t req, fuse_ino_t ino,
 
 	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_setattr(%llu, %x)\n", inum.inum, to_set);
 
+	ret = bf_wb_flush_inum(c, inum);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
 	trans = bch2_trans_get(c);
 retry:
 	bch2_trans_begin(trans);
@@ -225,29 +335,138 @@ err:
 
 	if (!ret) {
 		*attr = inode_to_stat(c, &inode_u);
-		fuse_reply_attr(req, attr, DBL_MAX);
+		fuse_reply_attr(req, attr, bf_attr_timeout);
 	} else {
 		fuse_reply_err(req, -ret);
 	}
 }
 
+/*
+ * Creates, unlinks and renames are group committed per directory: ops on a
+ * directory that arrive while another thread is committing ops on it are
+ * queued, and then all applied in as few transactions as bch2_dirops() can -
+ * so a parallel untar or rm -rf writes each directory inode and dirent leaf
+ * once per batch, not once per entry.
+ *
+ * Directories are hashed to a fixed set of queues; directories that share a
+ * queue are committed one after the other.
+ */
+#define BF_DIROPS_QUEUE_BITS	8
+#define BF_DIROPS_BATCH_MAX	(BCH_DIROPS_TRANS_MAX * 2)
+
+struct bf_dirop {
+	struct list_head	list;
+	subvol_inum		dir;
+	struct bch_dirop	op;
+	bool			done;
+};
+
+struct bf_dirops_queue {
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	bool			busy;
+	struct list_head	pending;
+};
+
+static struct bf_dirops_queue bf_dirops_queues[1U << BF_DIROPS_QUEUE_BITS];
+
+static void bf_dirops_init(void)
+{
+	for (unsigned i = 0; i < ARRAY_SIZE(bf_dirops_queues); i++) {
+		struct bf_dirops_queue *q = bf_dirops_queues + i;
+
+		pthread_mutex_init(&q->lock, NULL);
+		pthread_cond_init(&q->wait, NULL);
+		INIT_LIST_HEAD(&q->pending);
+	}
+}
+
+/*
+ * Commit the ops queued for the directory at the head of the queue; called with
+ * q->lock held, which is dropped while committing:
+ */
+static void bf_dirops_commit(struct bch_fs *c, struct bf_dirops_queue *q)
+{
+	struct bf_dirop *batch[BF_DIROPS_BATCH_MAX], *w, *n;
+	struct bch_dirop *ops = calloc(BF_DIROPS_BATCH_MAX, sizeof(*ops));
+	subvol_inum dir = list_first_entry(&q->pending, struct bf_dirop, list)->dir;
+	unsigned nr = 0;
+
+	list_for_each_entry_safe(w, n, &q->pending, list) {
+		if (w->dir.subvol	!= dir.subvol ||
+		    w->dir.inum		!= dir.inum)
+			continue;
+
+		list_del(&w->list);
+		batch[nr++] = w;
+
+		if (nr == BF_DIROPS_BATCH_MAX)
+			break;
+	}
+
+	pthread_mutex_unlock(&q->lock);
+
+	if (ops) {
+		for (unsigned i = 0; i < nr; i++)
+			ops[i] = batch[i]->op;
+
+		bch2_dirops(c, dir, ops, nr);
+
+		for (unsigned i = 0; i < nr; i++)
+			batch[i]->op = ops[i];
+		free(ops);
+	} else {
+		for (unsigned i = 0; i < nr; i++)
+			bch2_dirops(c, dir, &batch[i]->op, 1);
+	}
+
+	pthread_mutex_lock(&q->lock);
+
+	for (unsigned i = 0; i < nr; i++)
+		batch[i]->done = true;
+}
+
+static int bf_dirop(struct bch_fs *c, subvol_inum dir, struct bch_dirop *op)
+{
+	struct bf_dirops_queue *q = bf_dirops_queues +
+		hash_64(dir.inum ^ ((u64) dir.subvol << 32), BF_DIROPS_QUEUE_BITS);
+	struct bf_dirop w = { .dir = dir, .op = *op };
+
+	pthread_mutex_lock(&q->lock);
+	list_add_tail(&w.list, &q->pending);
+
+	while (!w.done) {
+		if (q->busy) {
+			pthread_cond_wait(&q->wait, &q->lock);
+			continue;
+		}
+
+		q->busy = true;
+		bf_dirops_commit(c, q);
+		q->busy = false;
+		pthread_cond_broadcast(&q->wait);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	*op = w.op;
+	return op->ret;
+}
+
 static int do_create(struct bch_fs *c, subvol_inum dir,
 		     const char *name, mode_t mode, dev_t rdev,
 		     struct bch_inode_unpacked *new_inode)
 {
-	struct qstr qstr = QSTR(name);
-	struct bch_inode_unpacked dir_u;
-	uid_t uid = 0;
-	gid_t gid = 0;
-
-	bch2_inode_init_early(c, new_inode);
+	struct bch_dirop op = {
+		.type	= BCH_DIROP_create,
+		.name	= QSTR(name),
+		.mode	= mode,
+		.rdev	= rdev,
+	};
 
-	return bch2_trans_do(c, NULL, NULL, 0,
-			bch2_create_trans(trans,
-				dir, &dir_u,
-				new_inode, &qstr,
-				uid, gid, mode, rdev, NULL, NULL,
-				(subvol_inum) { 0 }, 0));
+	int ret = bf_dirop(c, dir, &op);
+	if (!ret)
+		*new_inode = op.inode_u;
+	return ret;
 }
 
 static void bcachefs_fuse_mknod(fuse_req_t req, fuse_ino_t dir_ino,
@@ -289,16 +508,19 @@ static void bcachefs_fuse_unlink(fuse_req_t req, fuse_ino_t dir_ino,
 				 const char *name)
 {
 	struct bch_fs *c = fuse_req_userdata(req);
-	struct bch_inode_unpacked dir_u, inode_u;
-	struct qstr qstr = QSTR(name);
+	struct bch_dirop op = {
+		.type	= BCH_DIROP_unlink,
+		.name	= QSTR(name),
+	};
 	subvol_inum dir = map_root_ino(dir_ino);
 
 	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_unlink(%llu, %s)\n", dir.inum, name);
 
-	int ret = bch2_trans_do(c, NULL, NULL,
-				BCH_TRANS_COMMIT_no_enospc,
-			    bch2_unlink_trans(trans, dir, &dir_u,
-					      &inode_u, &qstr, false));
+	int ret = bf_dirop(c, dir, &op);
+
+	/* the inode number may be reused: */
+	if (!ret && !bch2_inode_nlink_get(&op.inode_u))
+		bf_xattr_cache_invalidate((subvol_inum) { dir.subvol, op.inode_u.bi_inum });
 
 	fuse_reply_err(req, -ret);
 }
@@ -319,8 +541,8 @@ static void bcachefs_fuse_rename(fuse_req_t req,
 	struct bch_fs *c = fuse_req_userdata(req);
 	struct bch_inode_unpacked dst_dir_u, src_dir_u;
 	struct bch_inode_unpacked src_inode_u, dst_inode_u;
-	struct qstr dst_name = QSTR(srcname);
-	struct qstr src_name = QSTR(dstname);
+	struct qstr src_name = QSTR(srcname);
+	struct qstr dst_name = QSTR(dstname);
 	subvol_inum src_dir = map_root_ino(src_dir_ino);
 	subvol_inum dst_dir = map_root_ino(dst_dir_ino);
 	int ret;
@@ -329,6 +551,19 @@ static void bcachefs_fuse_rename(fuse_req_t req,
 		 "bcachefs_fuse_rename(%llu, %s, %llu, %s, %x)\n",
 		 src_dir.inum, srcname, dst_dir.inum, dstname, flags);
 
+	if (src_dir.subvol	== dst_dir.subvol &&
+	    src_dir.inum	== dst_dir.inum) {
+		struct bch_dirop op = {
+			.type		= BCH_DIROP_rename,
+			.name		= src_name,
+			.dst_name	= dst_name,
+			.rename_mode	= BCH_RENAME,
+		};
+
+		fuse_reply_err(req, -bf_dirop(c, src_dir, &op));
+		return;
+	}
+
 	/* XXX handle overwrites */
 	ret = bch2_trans_do(c, NULL, NULL, 0,
 		bch2_rename_trans(trans,
@@ -402,21 +637,6 @@ static void bcachefs_fuse_read_endio(struct bio *bio)
 }
 
 
-static void bcachefs_fuse_write_endio(struct bch_write_op *op)
-{
-       struct write_aligned_op_t *w = container_of(op,struct write_aligned_op_t,op);
-       closure_put(&w->cl);
-}
-
-
-struct fuse_align_io {
-	off_t		start;
-	size_t		pad_start;
-	off_t		end;
-	size_t		pad_end;
-	size_t		size;
-};
-
 /* Handle unaligned start and end */
 /* TODO: align to block_bytes, sector size, or page size? */
 static struct fuse_align_io align_io(const struct bch_fs *c, size_t size,
@@ -481,26 +701,45 @@ static int read_aligned(struct bch_fs *c, subvol_inum inum, size_t aligned_size,
 	rbio.bio.bi_end_io		= bcachefs_fuse_read_endio;
 	rbio.bio.bi_private		= &cl;
 
-	bch2_read(c, rbio_init(&rbio.bio, io_opts), inum);
+	bch2_read(c, rbio_init(&rbio.bio, io_opts), inum, 0);
 
 	closure_sync(&cl);
 
 	return -blk_status_to_errno(rbio.bio.bi_status);
 }
 
+static void bcachefs_fuse_read_async_endio(struct bio *bio)
+{
+	struct fuse_read_op *r = container_of(bio, struct fuse_read_op, rbio.bio);
+	int ret = blk_status_to_errno(bio->bi_status);
+
+	if (likely(!ret)) {
+		struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(r->size);
+		bufv.buf[0].mem = r->buf + r->align.pad_start;
+
+		fuse_reply_data(r->req, &bufv, FUSE_BUF_SPLICE_MOVE);
+	} else
+		fuse_reply_err(r->req, -ret);
+
+	free(r->buf);
+	free(r);
+}
+
 static void bcachefs_fuse_read(fuse_req_t req, fuse_ino_t ino,
 			       size_t size, off_t offset,
 			       struct fuse_file_info *fi)
 {
 	subvol_inum inum = map_root_ino(ino);
 	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_io_opts io_opts;
 
 	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_read(%llu, %zd, %lld)\n",
 		 inum, size, offset);
 
 	/* Check inode size. */
 	struct bch_inode_unpacked bi;
-	int ret = bch2_inode_find_by_inum(c, inum, &bi);
+	int ret = bf_wb_flush_inum(c, inum) ?:
+		bch2_inode_find_by_inum(c, inum, &bi);
 	if (ret) {
 		fuse_reply_err(req, -ret);
 		return;
@@ -513,22 +752,30 @@ static void bcachefs_fuse_read(fuse_req_t req, fuse_ino_t ino,
 	}
 	size = end - offset;
 
-	struct fuse_align_io align = align_io(c, size, offset);
+	struct fuse_read_op *r = malloc(sizeof(*r));
+	if (!r) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
 
-	void *buf = aligned_alloc(PAGE_SIZE, align.size);
-	if (!buf) {
+	r->req		= req;
+	r->align	= align_io(c, size, offset);
+	r->size		= size;
+	r->buf		= aligned_alloc(PAGE_SIZE, r->align.size);
+	if (!r->buf) {
+		free(r);
 		fuse_reply_err(req, ENOMEM);
 		return;
 	}
 
-	ret = read_aligned(c, inum, align.size, align.start, buf);
+	bch2_inode_opts_get(&io_opts, c, &bi);
 
-	if (likely(!ret))
-		fuse_reply_buf(req, buf + align.pad_start, size);
-	else
-		fuse_reply_err(req, -ret);
+	userbio_init(&r->rbio.bio, &r->bv, r->buf, r->align.size);
+	bio_set_op_attrs(&r->rbio.bio, REQ_OP_READ, REQ_SYNC);
+	r->rbio.bio.bi_iter.bi_sector	= r->align.start >> 9;
+	r->rbio.bio.bi_end_io		= bcachefs_fuse_read_async_endio;
 
-	free(buf);
+	bch2_read(c, rbio_init(&r->rbio.bio, io_opts), inum, 0);
 }
 
 static int inode_update_times(struct bch_fs *c, subvol_inum inum)
@@ -566,23 +813,50 @@ err:
 	return ret;
 }
 
-static int write_aligned(struct bch_fs *c, subvol_inum inum,
-			 struct bch_io_opts io_opts, void *buf,
-			 size_t aligned_size, off_t aligned_offset,
-			 off_t new_i_size, size_t *written_out)
+static void bcachefs_fuse_write_endio(struct bch_write_op *op)
 {
+	struct fuse_write_op *w = container_of(op, struct fuse_write_op, op);
 
-	struct write_aligned_op_t w = { 0 }
-;
-	struct bch_write_op	*op = &w.op;
-	struct bio_vec		bv;
+	/* Figure out how many unaligned bytes were written. */
+	size_t written = !op->error
+		? align_fix_up_bytes(&w->align, op->written << 9)
+		: 0;
+	BUG_ON(written > w->size);
 
-	BUG_ON(aligned_size & (block_bytes(c) - 1));
-	BUG_ON(aligned_offset & (block_bytes(c) - 1));
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write: wrote %zd bytes\n",
+		 written);
 
-	*written_out = 0;
+	if (written > 0)
+		fuse_reply_write(w->req, written);
+	else
+		fuse_reply_err(w->req, op->error ? -op->error : EIO);
 
-	closure_init_stack(&w.cl);
+	free(w->buf);
+	free(w);
+}
+
+static void bcachefs_fuse_write_sync_endio(struct bch_write_op *op)
+{
+	struct fuse_write_sync_op *s =
+		container_of(op, struct fuse_write_sync_op, w.op);
+
+	closure_put(&s->cl);
+}
+
+/*
+ * Submit an aligned write: on success, @end_io is called when the write
+ * completes.
+ */
+static int write_aligned(struct bch_fs *c, subvol_inum inum,
+			 struct bch_io_opts io_opts, struct fuse_write_op *w,
+			 off_t new_i_size, void (*end_io)(struct bch_write_op *))
+{
+	struct bch_write_op	*op = &w->op;
+	size_t			aligned_size = w->align.size;
+	off_t			aligned_offset = w->align.start;
+
+	BUG_ON(aligned_size & (block_bytes(c) - 1));
+	BUG_ON(aligned_offset & (block_bytes(c) - 1));
 
 	bch2_write_op_init(op, c, io_opts); /* XXX reads from op?! */
 	op->write_point	= writepoint_hashed(0);
@@ -591,9 +865,9 @@ static int write_aligned(struct bch_fs *c, subvol_inum inum,
 	op->subvol	= inum.subvol;
 	op->pos		= POS(inum.inum, aligned_offset >> 9);
 	op->new_i_size	= new_i_size;
-	op->end_io = bcachefs_fuse_write_endio;
+	op->end_io	= end_io;
 
-	userbio_init(&op->wbio.bio, &bv, buf, aligned_size);
+	userbio_init(&op->wbio.bio, &w->bv, w->buf, aligned_size);
 	bio_set_op_attrs(&op->wbio.bio, REQ_OP_WRITE, REQ_SYNC);
 
 	if (bch2_disk_reservation_get(c, &op->res, aligned_size >> 9,
@@ -602,35 +876,324 @@ static int write_aligned(struct bch_fs *c, subvol_inum inum,
 		return -ENOSPC;
 	}
 
-	closure_get(&w.cl);
-
 	closure_call(&op->cl, bch2_write, NULL, NULL);
+	return 0;
+}
+
+static int write_aligned_sync(struct bch_fs *c, subvol_inum inum,
+			      struct bch_io_opts io_opts, void *buf,
+			      size_t aligned_size, off_t aligned_offset,
+			      off_t new_i_size, size_t *written_out)
+{
+	struct fuse_write_sync_op s = { 0 };
+	struct fuse_write_op *w = &s.w;
+	int ret;
+
+	w->align	= align_io(c, aligned_size, aligned_offset);
+	w->buf		= buf;
+
+	closure_init_stack(&s.cl);
+	closure_get(&s.cl);
+
+	ret = write_aligned(c, inum, io_opts, w, new_i_size,
+			    bcachefs_fuse_write_sync_endio);
+	if (ret)
+		closure_put(&s.cl);
+	closure_sync(&s.cl);
+
+	ret = ret ?: w->op.error;
+	*written_out = !ret ? w->op.written << 9 : 0;
+	return ret;
+}
+
+/*
+ * Small writes are buffered per inode, and written out with a single
+ * bch2_write() and inode times update: when the buffer fills up, on a write
+ * that doesn't fit, on flush/fsync, before reads and attribute lookups of the
+ * inode, and otherwise after BF_WB_EXPIRE.
+ */
+#define BF_WB_SIZE		(1U << 20)
+#define BF_WB_MAX_WRITE		(64U << 10)
+#define BF_WB_EXPIRE		(5 * HZ)
+
+struct bf_wb {
+	struct list_head	list;
+	unsigned		ref;		/* protected by bf_wb_lock */
+	pthread_mutex_t		lock;
+
+	struct bch_fs		*c;
+	subvol_inum		inum;
+	off_t			start;		/* block aligned */
+	size_t			len;
+	void			*buf;
+};
+
+static LIST_HEAD(bf_wb_list);
+static pthread_mutex_t bf_wb_lock = PTHREAD_MUTEX_INITIALIZER;
 
-	closure_sync(&w.cl);
+static struct bf_wb *bf_wb_get(struct bch_fs *c, subvol_inum inum, bool create)
+{
+	struct bf_wb *wb;
+
+	pthread_mutex_lock(&bf_wb_lock);
+	list_for_each_entry(wb, &bf_wb_list, list)
+		if (wb->inum.subvol	== inum.subvol &&
+		    wb->inum.inum	== inum.inum)
+			goto found;
 
-	if (!op->error)
-		*written_out = op->written << 9;
+	wb = create ? calloc(1, sizeof(*wb)) : NULL;
+	if (!wb)
+		goto out;
 
-	return op->error;
+	wb->buf = aligned_alloc(PAGE_SIZE, BF_WB_SIZE);
+	if (!wb->buf) {
+		free(wb);
+		wb = NULL;
+		goto out;
+	}
+
+	pthread_mutex_init(&wb->lock, NULL);
+	wb->c		= c;
+	wb->inum	= inum;
+	list_add(&wb->list, &bf_wb_list);
+found:
+	wb->ref++;
+out:
+	pthread_mutex_unlock(&bf_wb_lock);
+	return wb;
 }
 
-static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t ino,
-				const char *buf, size_t size,
-				off_t offset,
-				struct fuse_file_info *fi)
+static void bf_wb_put(struct bf_wb *wb)
+{
+	pthread_mutex_lock(&bf_wb_lock);
+	if (!--wb->ref && !wb->len) {
+		list_del(&wb->list);
+		pthread_mutex_destroy(&wb->lock);
+		free(wb->buf);
+		free(wb);
+	}
+	pthread_mutex_unlock(&bf_wb_lock);
+}
+
+/* Write out buffered data, wb->lock must be held: */
+static int __bf_wb_flush(struct bf_wb *wb)
+{
+	struct bch_fs *c = wb->c;
+	struct bch_inode_unpacked bi;
+	struct bch_io_opts io_opts;
+	off_t end = wb->start + wb->len;
+	size_t aligned_len = round_up(wb->len, block_bytes(c));
+	size_t written;
+	int ret;
+
+	if (!wb->len)
+		return 0;
+
+	ret = bch2_inode_find_by_inum(c, wb->inum, &bi);
+	if (ret)
+		goto out;
+
+	bch2_inode_opts_get(&io_opts, c, &bi);
+
+	/* Partial last block: fill in the rest of it from what's on disk */
+	if (aligned_len != wb->len) {
+		memset(wb->buf + wb->len, 0, aligned_len - wb->len);
+
+		if (bi.bi_size > end) {
+			void *tail = aligned_alloc(PAGE_SIZE, block_bytes(c));
+			unsigned tail_offset = wb->len & (block_bytes(c) - 1);
+
+			BUG_ON(!tail);
+
+			ret = read_aligned(c, wb->inum, block_bytes(c),
+					   round_down(end, block_bytes(c)), tail);
+			if (!ret)
+				memcpy(wb->buf + wb->len, tail + tail_offset,
+				       block_bytes(c) - tail_offset);
+			free(tail);
+			if (ret)
+				goto out;
+		}
+	}
+
+	ret =   inode_update_times(c, wb->inum) ?:
+		write_aligned_sync(c, wb->inum, io_opts, wb->buf,
+				   aligned_len, wb->start, end, &written);
+out:
+	wb->len = 0;
+	return ret;
+}
+
+static bool bf_wb_dirty(subvol_inum inum)
+{
+	struct bf_wb *wb;
+	bool ret = false;
+
+	pthread_mutex_lock(&bf_wb_lock);
+	list_for_each_entry(wb, &bf_wb_list, list)
+		if (wb->inum.subvol	== inum.subvol &&
+		    wb->inum.inum	== inum.inum) {
+			ret = READ_ONCE(wb->len) != 0;
+			break;
+		}
+	pthread_mutex_unlock(&bf_wb_lock);
+
+	return ret;
+}
+
+static int bf_wb_flush_inum(struct bch_fs *c, subvol_inum inum)
+{
+	struct bf_wb *wb = bf_wb_get(c, inum, false);
+	int ret;
+
+	if (!wb)
+		return 0;
+
+	pthread_mutex_lock(&wb->lock);
+	ret = __bf_wb_flush(wb);
+	pthread_mutex_unlock(&wb->lock);
+	bf_wb_put(wb);
+
+	return ret;
+}
+
+static void bf_wb_flush_all(void)
+{
+	DARRAY(struct bf_wb *) wbs = {};
+	struct bf_wb *wb;
+
+	pthread_mutex_lock(&bf_wb_lock);
+	list_for_each_entry(wb, &bf_wb_list, list)
+		if (!darray_push(&wbs, wb))
+			wb->ref++;
+	pthread_mutex_unlock(&bf_wb_lock);
+
+	darray_for_each(wbs, i) {
+		wb = *i;
+
+		pthread_mutex_lock(&wb->lock);
+		int ret = __bf_wb_flush(wb);
+		if (ret)
+			bch_err(wb->c, "error writing back inode %llu: %s",
+				wb->inum.inum, bch2_err_str(ret));
+		pthread_mutex_unlock(&wb->lock);
+		bf_wb_put(wb);
+	}
+
+	darray_exit(&wbs);
+}
+
+static void bf_wb_work_fn(struct work_struct *work)
+{
+	bf_wb_flush_all();
+}
+
+/*
+ * Returns 1 if the write was buffered, 0 if it should be submitted directly,
+ * or an error:
+ */
+static int bf_wb_write(struct bch_fs *c, subvol_inum inum,
+		       struct fuse_bufvec *bufv, off_t offset, size_t size)
+{
+	struct bf_wb *wb;
+	ssize_t copied;
+	int ret = 0;
+
+	/* Big writes go straight to bch2_write(), after what's buffered: */
+	if (size > BF_WB_MAX_WRITE)
+		return bf_wb_flush_inum(c, inum);
+
+	wb = bf_wb_get(c, inum, true);
+	if (!wb)
+		return 0;
+
+	pthread_mutex_lock(&wb->lock);
+
+	if (wb->len &&
+	    !(offset >= wb->start &&
+	      offset <= wb->start + wb->len &&
+	      offset + size <= wb->start + BF_WB_SIZE)) {
+		ret = __bf_wb_flush(wb);
+		if (ret)
+			goto out;
+	}
+
+	if (!wb->len) {
+		wb->start = round_down(offset, block_bytes(c));
+
+		/* Read partial start data. */
+		if (offset != wb->start) {
+			memset(wb->buf, 0, block_bytes(c));
+
+			ret = read_aligned(c, inum, block_bytes(c), wb->start,
+					   wb->buf);
+			if (ret)
+				goto out;
+		}
+	}
+
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	dst.buf[0].mem = wb->buf + (offset - wb->start);
+
+	copied = fuse_buf_copy(&dst, bufv, 0);
+	if (copied != size) {
+		ret = copied < 0 ? copied : -EIO;
+		goto out;
+	}
+
+	wb->len = max_t(size_t, wb->len, offset + size - wb->start);
+
+	ret = wb->len == BF_WB_SIZE
+		? __bf_wb_flush(wb) ?: 1
+		: 1;
+
+	queue_delayed_work(system_wq, &bf_wb_work, BF_WB_EXPIRE);
+out:
+	pthread_mutex_unlock(&wb->lock);
+	bf_wb_put(wb);
+
+	return ret;
+}
+
+/*
+ * With FUSE_CAP_SPLICE_READ, write data comes to us in a pipe: fuse_buf_copy()
+ * then reads it straight into the buffer we hand to bch2_write(), instead of
+ * being copied once into the request buffer and then again into ours.
+ */
+static void bcachefs_fuse_write_buf(fuse_req_t req, fuse_ino_t ino,
+				    struct fuse_bufvec *bufv, off_t offset,
+				    struct fuse_file_info *fi)
 {
 	subvol_inum inum = map_root_ino(ino);
 	struct bch_fs *c	= fuse_req_userdata(req);
 	struct bch_io_opts	io_opts;
-	size_t			aligned_written;
+	size_t			size = fuse_buf_size(bufv);
+	ssize_t			copied;
 	int			ret = 0;
 
-	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write(%llu, %zd, %lld)\n",
-		 inum, size, offset);
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write(%llu, %zd, %lld)\n",
+		 inum, size, offset);
+
+	ret = bf_wb_write(c, inum, bufv, offset, size);
+	if (ret) {
+		if (ret > 0)
+			fuse_reply_write(req, size);
+		else
+			fuse_reply_err(req, -ret);
+		return;
+	}
+
+	struct fuse_write_op *w = malloc(sizeof(*w));
+	BUG_ON(!w);
 
-	struct fuse_align_io align = align_io(c, size, offset);
-	void *aligned_buf = aligned_alloc(PAGE_SIZE, align.size);
-	BUG_ON(!aligned_buf);
+	w->req		= req;
+	w->align	= align_io(c, size, offset);
+	w->size		= size;
+	w->buf		= aligned_alloc(PAGE_SIZE, w->align.size);
+	BUG_ON(!w->buf);
+
+	struct fuse_align_io align = w->align;
+	void *aligned_buf = w->buf;
 
 	if (get_inode_io_opts(c, inum, &io_opts)) {
 		ret = -ENOENT;
@@ -667,40 +1230,33 @@ static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t ino,
 	}
 
 	/* Overlay what we want to write. */
-	memcpy(aligned_buf + align.pad_start, buf, size);
-
-	/* Actually write. */
-	ret = write_aligned(c, inum, io_opts, aligned_buf,
-			    align.size, align.start,
-			    offset + size, &aligned_written);
-
-	/* Figure out how many unaligned bytes were written. */
-	size_t written = align_fix_up_bytes(&align, aligned_written);
-	BUG_ON(written > size);
-
-	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write: wrote %zd bytes\n",
-		 written);
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	dst.buf[0].mem = aligned_buf + align.pad_start;
 
-	if (written > 0)
-		ret = 0;
+	copied = fuse_buf_copy(&dst, bufv, 0);
+	if (copied != size) {
+		ret = copied < 0 ? copied : -EIO;
+		goto err;
+	}
 
 	/*
-	 * Update inode times.
+	 * Update inode times - before the write, like file_update_time(), so
+	 * that the request can be answered from the write completion.
 	 * TODO: Integrate with bch2_extent_update()
 	 */
-	if (!ret)
-		ret = inode_update_times(c, inum);
+	ret = inode_update_times(c, inum);
+	if (ret)
+		goto err;
 
-	if (!ret) {
-		BUG_ON(written == 0);
-		fuse_reply_write(req, written);
-		free(aligned_buf);
+	/* Actually write. */
+	ret = write_aligned(c, inum, io_opts, w, offset + size,
+			    bcachefs_fuse_write_endio);
+	if (!ret)
 		return;
-	}
-
 err:
 	fuse_reply_err(req, -ret);
-	free(aligned_buf);
+	free(w->buf);
+	free(w);
 }
 
 static void bcachefs_fuse_symlink(fuse_req_t req, const char *link,
@@ -735,9 +1291,9 @@ static void bcachefs_fuse_symlink(fuse_req_t req, const char *link,
 	subvol_inum inum = (subvol_inum) { dir.subvol, new_inode.bi_inum };
 
 	size_t aligned_written;
-	ret = write_aligned(c, inum, io_opts, aligned_buf,
-			    align.size, align.start, link_len + 1,
-			    &aligned_written);
+	ret = write_aligned_sync(c, inum, io_opts, aligned_buf,
+				 align.size, align.start, link_len + 1,
+				 &aligned_written);
 	free(aligned_buf);
 
 	if (ret)
@@ -795,28 +1351,35 @@ err:
 	free(buf);
 }
 
-#if 0
 /*
  * FUSE flush is essentially the close() call, however it is not guaranteed
  * that one flush happens per open/create.
  *
- * It doesn't have to do anything, and is mostly relevant for NFS-style
- * filesystems where close has some relationship to caching.
+ * We write out buffered writes here, so that errors are reported from close().
  */
-static void bcachefs_fuse_flush(fuse_req_t req, fuse_ino_t inum,
+static void bcachefs_fuse_flush(fuse_req_t req, fuse_ino_t ino,
 				struct fuse_file_info *fi)
 {
 	struct bch_fs *c = fuse_req_userdata(req);
+
+	fuse_reply_err(req, -bf_wb_flush_inum(c, map_root_ino(ino)));
 }
 
-static void bcachefs_fuse_release(fuse_req_t req, fuse_ino_t inum,
-				  struct fuse_file_info *fi)
+static void bcachefs_fuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+				struct fuse_file_info *fi)
 {
 	struct bch_fs *c = fuse_req_userdata(req);
+	int ret = bf_wb_flush_inum(c, map_root_ino(ino));
+
+	if (!ret)
+		ret = bch2_journal_flush(&c->journal);
+
+	fuse_reply_err(req, -ret);
 }
 
-static void bcachefs_fuse_fsync(fuse_req_t req, fuse_ino_t inum, int datasync,
-				struct fuse_file_info *fi)
+#if 0
+static void bcachefs_fuse_release(fuse_req_t req, fuse_ino_t inum,
+				  struct fuse_file_info *fi)
 {
 	struct bch_fs *c = fuse_req_userdata(req);
 }
@@ -963,14 +1526,153 @@ reply:
 	free(buf);
 }
 
-#if 0
-static void bcachefs_fuse_readdirplus(fuse_req_t req, fuse_ino_t dir,
+/*
+ * Unlike readdir, we return the attributes of each entry: read the inodes in
+ * the same transaction as the dirents, so that `ls -l` doesn't have to do a
+ * lookup per entry.
+ */
+struct fuse_dirplus_context {
+	fuse_req_t		req;
+	char			*buf;
+	size_t			bufsize;
+	u64			pos;
+};
+
+static bool fuse_dirplus_add(struct fuse_dirplus_context *ctx,
+			     const char *name,
+			     const struct fuse_entry_param *e,
+			     u64 pos)
+{
+	size_t len = fuse_add_direntry_plus(ctx->req, ctx->buf, ctx->bufsize,
+					    name, e, pos + 1);
+
+	if (len > ctx->bufsize)
+		return false;
+
+	ctx->buf	+= len;
+	ctx->bufsize	-= len;
+	ctx->pos	= pos + 1;
+	return true;
+}
+
+static bool fuse_dirplus_dots(struct fuse_dirplus_context *ctx, fuse_ino_t dir)
+{
+	/* The kernel doesn't instantiate dentries for the dots: */
+	struct fuse_entry_param e = {
+		.attr.st_ino	= dir,
+		.attr.st_mode	= S_IFDIR,
+	};
+
+	if (ctx->pos == 0 &&
+	    !fuse_dirplus_add(ctx, ".", &e, 0))
+		return false;
+
+	e.attr.st_ino = /*TODO: parent*/ 1;
+
+	if (ctx->pos == 1 &&
+	    !fuse_dirplus_add(ctx, "..", &e, 1))
+		return false;
+
+	return true;
+}
+
+static int fuse_dirplus_emit(struct btree_trans *trans,
+			     struct fuse_dirplus_context *ctx,
+			     subvol_inum dir, struct bkey_s_c_dirent d)
+{
+	struct bch_fs *c = trans->c;
+	struct qstr qname = bch2_dirent_get_name(d);
+	char name[BCH_NAME_MAX + 1];
+	u64 pos = d.k->p.offset;
+	subvol_inum target;
+	struct bch_inode_unpacked bi;
+
+	memcpy(name, qname.name, qname.len);
+	name[qname.len] = '\0';
+
+	int ret = bch2_dirent_read_target(trans, dir, d, &target);
+	if (ret > 0)
+		return 0;
+
+	ret = ret ?: bch2_inode_find_by_inum_nowarn_trans(trans, target, &bi);
+	if (bch2_err_matches(ret, ENOENT))
+		return 0;
+	if (ret)
+		return ret;
+
+	struct fuse_entry_param e = inode_to_entry(c, &bi);
+
+	/* Positive return stops the iteration: the reply buffer is full */
+	return !fuse_dirplus_add(ctx, name, &e, pos);
+}
+
+static void bcachefs_fuse_readdirplus(fuse_req_t req, fuse_ino_t dir_ino,
 				      size_t size, off_t off,
 				      struct fuse_file_info *fi)
 {
+	subvol_inum dir = map_root_ino(dir_ino);
+	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_inode_unpacked bi;
+	struct bkey_buf sk;
+	char *buf = calloc(size, 1);
+	struct fuse_dirplus_context ctx = {
+		.req		= req,
+		.buf		= buf,
+		.bufsize	= size,
+		.pos		= off,
+	};
+	int ret = 0;
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_readdirplus(dir=%llu, size=%zu, "
+		 "off=%lld)\n", dir.inum, size, off);
+
+	/* So that we return up to date i_size: */
+	bf_wb_flush_all();
+
+	ret = bch2_inode_find_by_inum(c, dir, &bi);
+	if (ret)
+		goto reply;
+
+	if (!S_ISDIR(bi.bi_mode)) {
+		ret = -ENOTDIR;
+		goto reply;
+	}
+
+	if (!fuse_dirplus_dots(&ctx, dir_ino))
+		goto reply;
+
+	bch2_bkey_buf_init(&sk);
+
+	ret = bch2_trans_run(c,
+		for_each_btree_key_in_subvolume_upto(trans, iter, BTREE_ID_dirents,
+				   POS(dir.inum, ctx.pos),
+				   POS(dir.inum, U64_MAX),
+				   dir.subvol, 0, k, ({
+			if (k.k->type != KEY_TYPE_dirent)
+				continue;
+
+			bch2_bkey_buf_reassemble(&sk, c, k);
+			fuse_dirplus_emit(trans, &ctx, dir,
+					  bkey_i_to_s_c_dirent(sk.k));
+		})));
+
+	bch2_bkey_buf_exit(&sk, c);
+
+	if (ret > 0)
+		ret = 0;
+reply:
+	if (!ret) {
+		fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_readdirplus reply %zd\n",
+					ctx.buf - buf);
+		fuse_reply_buf(req, buf, ctx.buf - buf);
+	} else {
+		fuse_reply_err(req, -ret);
+	}
 
+	free(buf);
 }
 
+#if 0
 static void bcachefs_fuse_releasedir(fuse_req_t req, fuse_ino_t inum,
 				     struct fuse_file_info *fi)
 {
@@ -1003,33 +1705,317 @@ static void bcachefs_fuse_statfs(fuse_req_t req, fuse_ino_t inum)
 	fuse_reply_statfs(req, &statbuf);
 }
 
-#if 0
-static void bcachefs_fuse_setxattr(fuse_req_t req, fuse_ino_t inum,
-				   const char *name, const char *value,
-				   size_t size, int flags)
+/*
+ * xattrs:
+ *
+ * There's no VFS inode cache in userspace, so every getxattr would be a lookup
+ * of the inode (for the hash info) and then of the xattr - and the kernel asks
+ * for security xattrs on every write. Small values, and the fact that an
+ * xattr doesn't exist, are cached per inode, and invalidated when that inode's
+ * xattrs are changed or it's deleted.
+ *
+ * POSIX ACLs aren't supported in userspace, and the bcachefs.* options
+ * namespace isn't exposed here.
+ */
+#define BF_XATTR_CACHE_VAL_MAX	256
+#define BF_XATTR_CACHE_MAX	(64 << 10)
+#define BF_XATTR_CACHE_BITS	10
+
+struct bf_xattr_inode {
+	struct list_head	list;
+	subvol_inum		inum;
+	struct list_head	xattrs;
+};
+
+struct bf_xattr {
+	struct list_head	list;
+	u8			type;
+	/* value length, or -ENODATA if the xattr doesn't exist: */
+	int			len;
+	u8			name_len;
+	/* name, then value: */
+	char			data[];
+};
+
+static struct list_head bf_xattr_cache[1U << BF_XATTR_CACHE_BITS];
+static pthread_mutex_t bf_xattr_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned bf_xattr_nr;
+
+static const struct {
+	const char	*prefix;
+	u8		type;
+} bf_xattr_prefixes[] = {
+	{ XATTR_USER_PREFIX,		KEY_TYPE_XATTR_INDEX_USER	},
+	{ XATTR_TRUSTED_PREFIX,		KEY_TYPE_XATTR_INDEX_TRUSTED	},
+	{ XATTR_SECURITY_PREFIX,	KEY_TYPE_XATTR_INDEX_SECURITY	},
+};
+
+/* Strips the namespace prefix; returns the xattr type, or -EOPNOTSUPP: */
+static int bf_xattr_name_parse(const char **name)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	for (unsigned i = 0; i < ARRAY_SIZE(bf_xattr_prefixes); i++) {
+		const char *p = bf_xattr_prefixes[i].prefix;
+
+		if (!strncmp(*name, p, strlen(p))) {
+			*name += strlen(p);
+			return **name ? bf_xattr_prefixes[i].type : -EINVAL;
+		}
+	}
+
+	return -EOPNOTSUPP;
+}
+
+static void bf_xattr_cache_init(void)
+{
+	for (unsigned i = 0; i < ARRAY_SIZE(bf_xattr_cache); i++)
+		INIT_LIST_HEAD(&bf_xattr_cache[i]);
+}
+
+static struct list_head *bf_xattr_bucket(subvol_inum inum)
+{
+	return &bf_xattr_cache[hash_64(inum.inum ^ ((u64) inum.subvol << 32),
+				       BF_XATTR_CACHE_BITS)];
+}
+
+static struct bf_xattr_inode *bf_xattr_inode_find(subvol_inum inum, bool create)
+{
+	struct list_head *bucket = bf_xattr_bucket(inum);
+	struct bf_xattr_inode *i;
+
+	list_for_each_entry(i, bucket, list)
+		if (i->inum.subvol == inum.subvol &&
+		    i->inum.inum == inum.inum)
+			return i;
+
+	if (!create)
+		return NULL;
+
+	i = malloc(sizeof(*i));
+	if (i) {
+		i->inum = inum;
+		INIT_LIST_HEAD(&i->xattrs);
+		list_add(&i->list, bucket);
+	}
+	return i;
+}
+
+static void bf_xattr_inode_free(struct bf_xattr_inode *i)
+{
+	struct bf_xattr *x, *n;
+
+	list_for_each_entry_safe(x, n, &i->xattrs, list) {
+		list_del(&x->list);
+		free(x);
+		bf_xattr_nr--;
+	}
+
+	list_del(&i->list);
+	free(i);
+}
+
+static void bf_xattr_cache_invalidate(subvol_inum inum)
+{
+	pthread_mutex_lock(&bf_xattr_lock);
+	struct bf_xattr_inode *i = bf_xattr_inode_find(inum, false);
+	if (i)
+		bf_xattr_inode_free(i);
+	pthread_mutex_unlock(&bf_xattr_lock);
+}
+
+static void bf_xattr_cache_exit(void)
+{
+	struct bf_xattr_inode *i, *n;
+
+	pthread_mutex_lock(&bf_xattr_lock);
+	for (unsigned b = 0; b < ARRAY_SIZE(bf_xattr_cache); b++)
+		list_for_each_entry_safe(i, n, &bf_xattr_cache[b], list)
+			bf_xattr_inode_free(i);
+	pthread_mutex_unlock(&bf_xattr_lock);
+}
+
+/* Returns true on a hit, with *ret set to the value length or -ENODATA: */
+static bool bf_xattr_cache_lookup(subvol_inum inum, u8 type, const char *name,
+				  void *buf, size_t size, int *ret)
+{
+	unsigned name_len = strlen(name);
+	struct bf_xattr *x;
+	bool hit = false;
+
+	pthread_mutex_lock(&bf_xattr_lock);
+	struct bf_xattr_inode *i = bf_xattr_inode_find(inum, false);
+	if (i)
+		list_for_each_entry(x, &i->xattrs, list)
+			if (x->type == type &&
+			    x->name_len == name_len &&
+			    !memcmp(x->data, name, name_len)) {
+				*ret = x->len;
+				if (x->len > 0 && x->len <= size)
+					memcpy(buf, x->data + name_len, x->len);
+				hit = true;
+				break;
+			}
+	pthread_mutex_unlock(&bf_xattr_lock);
+
+	return hit;
+}
+
+static void bf_xattr_cache_add(subvol_inum inum, u8 type, const char *name,
+			       const void *val, int len)
+{
+	unsigned name_len = strlen(name);
+
+	if (len > BF_XATTR_CACHE_VAL_MAX)
+		return;
+
+	struct bf_xattr *x = malloc(sizeof(*x) + name_len + max(len, 0));
+	if (!x)
+		return;
+
+	x->type		= type;
+	x->len		= len;
+	x->name_len	= name_len;
+	memcpy(x->data, name, name_len);
+	if (len > 0)
+		memcpy(x->data + name_len, val, len);
+
+	pthread_mutex_lock(&bf_xattr_lock);
+	if (bf_xattr_nr >= BF_XATTR_CACHE_MAX) {
+		pthread_mutex_unlock(&bf_xattr_lock);
+		bf_xattr_cache_exit();
+		pthread_mutex_lock(&bf_xattr_lock);
+	}
+
+	struct bf_xattr_inode *i = bf_xattr_inode_find(inum, true);
+	if (i) {
+		list_add(&x->list, &i->xattrs);
+		bf_xattr_nr++;
+	} else {
+		free(x);
+	}
+	pthread_mutex_unlock(&bf_xattr_lock);
+}
+
+static int bf_xattr_get_trans(struct btree_trans *trans, subvol_inum inum,
+			      u8 type, const char *name, void *buf)
+{
+	struct bch_inode_unpacked bi;
+	int ret = bch2_inode_find_by_inum_trans(trans, inum, &bi);
+	if (ret)
+		return ret;
+
+	struct bch_hash_info hash = bch2_hash_info_init(trans->c, &bi);
+	struct xattr_search_key search = X_SEARCH(type, name, strlen(name));
+	struct btree_iter iter;
+	struct bkey_s_c k = bch2_hash_lookup(trans, &iter, bch2_xattr_hash_desc, &hash,
+					     inum, &search, 0);
+	ret = bkey_err(k);
+	if (ret)
+		return bch2_err_matches(ret, ENOENT) ? -ENODATA : ret;
+
+	struct bkey_s_c_xattr xattr = bkey_s_c_to_xattr(k);
+	ret = le16_to_cpu(xattr.v->x_val_len);
+	memcpy(buf, xattr_val(xattr.v), ret);
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
 }
 
-static void bcachefs_fuse_getxattr(fuse_req_t req, fuse_ino_t inum,
+static void bcachefs_fuse_getxattr(fuse_req_t req, fuse_ino_t ino,
 				   const char *name, size_t size)
 {
 	struct bch_fs *c = fuse_req_userdata(req);
+	subvol_inum inum = map_root_ino(ino);
+	/* xattr keys are at most U8_MAX u64s: */
+	char val[U8_MAX * sizeof(u64)];
+	int ret = bf_xattr_name_parse(&name);
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_getxattr(%llu, %s)\n", inum.inum, name);
+
+	if (ret < 0)
+		goto err;
+
+	u8 type = ret;
+	if (!bf_xattr_cache_lookup(inum, type, name, val, sizeof(val), &ret)) {
+		ret = bch2_trans_run(c, lockrestart_do(trans,
+				bf_xattr_get_trans(trans, inum, type, name, val)));
+		if (ret >= 0 || ret == -ENODATA)
+			bf_xattr_cache_add(inum, type, name, val, ret);
+	}
+
+	if (ret < 0)
+		goto err;
+
+	if (!size)
+		fuse_reply_xattr(req, ret);
+	else if (ret > size)
+		fuse_reply_err(req, ERANGE);
+	else
+		fuse_reply_buf(req, val, ret);
+	return;
+err:
+	fuse_reply_err(req, -bch2_err_class(ret));
+}
+
+static int bf_xattr_set_trans(struct btree_trans *trans, subvol_inum inum,
+			      u8 type, const char *name,
+			      const void *value, size_t size, int flags)
+{
+	struct bch_inode_unpacked bi;
+	int ret = bch2_inode_find_by_inum_trans(trans, inum, &bi);
+	if (ret)
+		return ret;
+
+	struct bch_hash_info hash = bch2_hash_info_init(trans->c, &bi);
+
+	return bch2_xattr_set(trans, inum, &bi, &hash, name, value, size, type, flags);
+}
+
+static int bf_xattr_set(struct bch_fs *c, subvol_inum inum, const char *name,
+			const void *value, size_t size, int flags)
+{
+	int ret = bf_xattr_name_parse(&name);
+	if (ret < 0)
+		return ret;
+
+	u8 type = ret;
 
-	fuse_reply_xattr(req, );
+	/* bch2_xattr_set() updates the inode: */
+	ret = bf_wb_flush_inum(c, inum);
+	if (ret)
+		return ret;
+
+	/* invalidate after the update, so that a racing lookup can't re-add it: */
+	ret = bch2_trans_do(c, NULL, NULL, 0,
+		bf_xattr_set_trans(trans, inum, type, name, value, size, flags));
+	bf_xattr_cache_invalidate(inum);
+	return ret;
 }
 
-static void bcachefs_fuse_listxattr(fuse_req_t req, fuse_ino_t inum, size_t size)
+static void bcachefs_fuse_setxattr(fuse_req_t req, fuse_ino_t ino,
+				   const char *name, const char *value,
+				   size_t size, int flags)
 {
 	struct bch_fs *c = fuse_req_userdata(req);
+	subvol_inum inum = map_root_ino(ino);
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_setxattr(%llu, %s, %zu)\n",
+		 inum.inum, name, size);
+
+	int ret = bf_xattr_set(c, inum, name, value ?: "", size, flags);
+	fuse_reply_err(req, -bch2_err_class(ret));
 }
 
-static void bcachefs_fuse_removexattr(fuse_req_t req, fuse_ino_t inum,
+static void bcachefs_fuse_removexattr(fuse_req_t req, fuse_ino_t ino,
 				      const char *name)
 {
 	struct bch_fs *c = fuse_req_userdata(req);
+	subvol_inum inum = map_root_ino(ino);
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_removexattr(%llu, %s)\n",
+		 inum.inum, name);
+
+	int ret = bf_xattr_set(c, inum, name, NULL, 0, XATTR_REPLACE);
+	fuse_reply_err(req, -bch2_err_class(ret));
 }
-#endif
 
 static void bcachefs_fuse_create(fuse_req_t req, fuse_ino_t dir_ino,
 				 const char *name, mode_t mode,
@@ -1055,13 +2041,6 @@ err:
 }
 
 #if 0
-static void bcachefs_fuse_write_buf(fuse_req_t req, fuse_ino_t inum,
-				    struct fuse_bufvec *bufv, off_t off,
-				    struct fuse_file_info *fi)
-{
-	struct bch_fs *c = fuse_req_userdata(req);
-}
-
 static void bcachefs_fuse_fallocate(fuse_req_t req, fuse_ino_t inum, int mode,
 				    off_t offset, off_t length,
 				    struct fuse_file_info *fi)
@@ -1086,20 +2065,19 @@ static const struct fuse_lowlevel_ops bcachefs_fuse_ops = {
 	.link		= bcachefs_fuse_link,
 	.open		= bcachefs_fuse_open,
 	.read		= bcachefs_fuse_read,
-	.write		= bcachefs_fuse_write,
-	//.flush	= bcachefs_fuse_flush,
+	.flush		= bcachefs_fuse_flush,
 	//.release	= bcachefs_fuse_release,
-	//.fsync	= bcachefs_fuse_fsync,
+	.fsync		= bcachefs_fuse_fsync,
 	//.opendir	= bcachefs_fuse_opendir,
 	.readdir	= bcachefs_fuse_readdir,
-	//.readdirplus	= bcachefs_fuse_readdirplus,
+	.readdirplus	= bcachefs_fuse_readdirplus,
 	//.releasedir	= bcachefs_fuse_releasedir,
 	//.fsyncdir	= bcachefs_fuse_fsyncdir,
 	.statfs		= bcachefs_fuse_statfs,
-	//.setxattr	= bcachefs_fuse_setxattr,
-	//.getxattr	= bcachefs_fuse_getxattr,
+	.setxattr	= bcachefs_fuse_setxattr,
+	.getxattr	= bcachefs_fuse_getxattr,
 	//.listxattr	= bcachefs_fuse_listxattr,
-	//.removexattr	= bcachefs_fuse_removexattr,
+	.removexattr	= bcachefs_fuse_removexattr,
 	.create		= bcachefs_fuse_create,
 
 	/* posix locks: */
@@ -1107,7 +2085,7 @@ static const struct fuse_lowlevel_ops bcachefs_fuse_ops = {
 	.getlk		= bcachefs_fuse_getlk,
 	.setlk		= bcachefs_fuse_setlk,
 #endif
-	//.write_buf	= bcachefs_fuse_write_buf,
+	.write_buf	= bcachefs_fuse_write_buf,
 	//.fallocate	= bcachefs_fuse_fallocate,
 
 };
@@ -1120,6 +2098,9 @@ struct bf_context {
 	char            *devices_str;
 	char            **devices;
 	int             nr_devices;
+	unsigned        nr_threads;
+	double          attr_timeout;
+	double          entry_timeout;
 };
 
 static void bf_context_free(struct bf_context *ctx)
@@ -1133,6 +2114,9 @@ static void bf_context_free(struct bf_context *ctx)
 }
 
 static struct fuse_opt bf_opts[] = {
+	{ "threads=%u", offsetof(struct bf_context, nr_threads), 0 },
+	{ "attr_timeout=%lf", offsetof(struct bf_context, attr_timeout), 0 },
+	{ "entry_timeout=%lf", offsetof(struct bf_context, entry_timeout), 0 },
 	FUSE_OPT_END
 };
 
@@ -1194,14 +2178,99 @@ static void usage(char *argv[])
 {
 	printf("Usage: %s fusemount [options] <dev>[:dev2:...] <mountpoint>\n",
 	       argv[0]);
-	printf("\n");
+	printf("\n"
+	       "Options:\n"
+	       "    -o threads=N           number of threads serving requests\n"
+	       "                           (default: number of cpus)\n"
+	       "    -o attr_timeout=S      seconds the kernel may cache attributes\n"
+	       "    -o entry_timeout=S     seconds the kernel may cache lookups\n"
+	       "                           (default: forever)\n"
+	       "\n");
+}
+
+/*
+ * We run our own multithreaded session loop instead of fuse_session_loop_mt():
+ * requests need to be handled from threads that have a task_struct, i.e.
+ * kthreads.
+ */
+static int bcachefs_fuse_session_thread(void *arg)
+{
+	struct fuse_session *se = arg;
+	struct fuse_buf fbuf = { .mem = NULL };
+	int ret = 0;
+
+	while (!fuse_session_exited(se)) {
+		ret = fuse_session_receive_buf(se, &fbuf);
+		if (ret == -EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+
+		fuse_session_process_buf(se, &fbuf);
+	}
+
+	free(fbuf.mem);
+	fuse_session_exit(se);
+
+	return ret < 0 ? ret : 0;
+}
+
+static int bcachefs_fuse_session_loop(struct fuse_session *se,
+				      unsigned nr_threads)
+{
+	struct task_struct **threads = calloc(nr_threads, sizeof(*threads));
+	sigset_t sigs, oldsigs;
+	unsigned i, nr = 0;
+	int ret;
+
+	if (!threads)
+		die("error allocating memory");
+
+	/*
+	 * Signals have to be delivered to this thread, so that it's the one
+	 * that sees the session exit and unmounts:
+	 */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+
+	for (i = 1; i < nr_threads; i++) {
+		struct task_struct *p =
+			kthread_run(bcachefs_fuse_session_thread, se,
+				    "bch-fuse/%u", i);
+		if (IS_ERR(p))
+			break;
+
+		get_task_struct(p);
+		threads[nr++] = p;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+	ret = bcachefs_fuse_session_thread(se);
+
+	/* Unmounting wakes up the other threads, blocked on /dev/fuse: */
+	fuse_session_unmount(se);
+
+	for (i = 0; i < nr; i++) {
+		kthread_stop(threads[i]);
+		put_task_struct(threads[i]);
+	}
+	free(threads);
+
+	return ret;
 }
 
 int cmd_fusemount(int argc, char *argv[])
 {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 	struct bch_opts bch_opts = bch2_opts_empty();
-	struct bf_context ctx = { 0 };
+	struct bf_context ctx = {
+		.attr_timeout	= DBL_MAX,
+		.entry_timeout	= DBL_MAX,
+	};
 	struct bch_fs *c = NULL;
 	int ret = 0, i;
 
@@ -1262,6 +2331,11 @@ int cmd_fusemount(int argc, char *argv[])
 		die("error opening %s: %s", ctx.devices_str,
 		    bch2_err_str(PTR_ERR(c)));
 
+	INIT_DELAYED_WORK(&bf_wb_work, bf_wb_work_fn);
+
+	bf_attr_timeout		= ctx.attr_timeout;
+	bf_entry_timeout	= ctx.entry_timeout;
+
 	/* Fuse */
 	struct fuse_session *se =
 		fuse_session_new(&args, &bcachefs_fuse_ops,
@@ -1285,10 +2359,10 @@ int cmd_fusemount(int argc, char *argv[])
 
 	fuse_daemonize(fuse_opts.foreground);
 
-	ret = fuse_session_loop(se);
+	ret = bcachefs_fuse_session_loop(se, fuse_opts.singlethread ? 1
+					 : ctx.nr_threads ?: get_nprocs());
 
 	/* Cleanup */
-	fuse_session_unmount(se);
 	fuse_remove_signal_handlers(se);
 	fuse_session_destroy(se);
 
@@ -1,6 +1,7 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -8,13 +9,17 @@
 #include "libbcachefs.h"
 #include "tools-util.h"
 
+#include "linux/sort.h"
+
 #include "libbcachefs/bcachefs.h"
 #include "libbcachefs/btree_iter.h"
+#include "libbcachefs/buckets.h"
 #include "libbcachefs/errcode.h"
 #include "libbcachefs/error.h"
 #include "libbcachefs/journal_io.h"
 #include "libbcachefs/journal_seq_blacklist.h"
 #include "libbcachefs/super.h"
+#include "libbcachefs/super-io.h"
 
 static const char *NORMAL	= "\x1B[0m";
 static const char *RED		= "\x1B[31m";
@@ -29,7 +34,11 @@ static void list_journal_usage(void)
 	     "  -n, --nr-entries=nr               Number of journal entries to print, starting from the most recent\n"
 	     "  -t, --transaction-filter=bbpos    Filter transactions not updating <bbpos>\n"
 	     "                                    Or entries not matching the range <bbpos-bbpos>\n"
+	     "  -f, --transaction-fn=fn           Filter transactions not started by fn\n"
 	     "  -k, --key-filter=btree            Filter keys not updating btree\n"
+	     "  -s, --stats                       Print space used by each entry type instead of entries\n"
+	     "  -S, --stream                      Walk journal buckets directly, without reading the\n"
+	     "                                    whole journal into memory first\n"
 	     "  -v, --verbose                     Verbose mode\n"
 	     "  -h, --help                        Display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
@@ -79,16 +88,38 @@ static bool entry_matches_transaction_filter(struct jset_entry *entry,
 	return false;
 }
 
+struct journal_filter {
+	d_bbpos_range	transaction;
+	darray_str	transaction_fn;
+	d_btree_id	key;
+};
+
+static bool transaction_fn_matches(struct jset_entry *entry, darray_str filter)
+{
+	struct jset_entry_log *l = container_of(entry, struct jset_entry_log, entry);
+	unsigned bytes = vstruct_bytes(entry) - offsetof(struct jset_entry_log, d);
+	unsigned len = strnlen(l->d, bytes);
+
+	darray_for_each(filter, fn)
+		if (strlen(*fn) == len && !memcmp(*fn, l->d, len))
+			return true;
+	return false;
+}
+
 static bool should_print_transaction(struct jset_entry *entry, struct jset_entry *end,
-				     d_bbpos_range filter)
+				     struct journal_filter *f)
 {
-	if (!filter.nr)
+	if (f->transaction_fn.nr &&
+	    !transaction_fn_matches(entry, f->transaction_fn))
+		return false;
+
+	if (!f->transaction.nr)
 		return true;
 
 	for (entry = vstruct_next(entry);
 	     entry != end && !entry_is_transaction_start(entry);
 	     entry = vstruct_next(entry))
-		if (entry_matches_transaction_filter(entry, filter))
+		if (entry_matches_transaction_filter(entry, f->transaction))
 			return true;
 
 	return false;
@@ -112,9 +143,79 @@ static bool should_print_entry(struct jset_entry *entry, d_btree_id filter)
 	return false;
 }
 
+static void jset_print(struct bch_fs *c, struct jset *j, bool blacklisted,
+		       struct printbuf *written_at, struct journal_filter *f)
+{
+	struct printbuf buf = PRINTBUF;
+
+	if (!f->transaction.nr && !f->transaction_fn.nr) {
+		if (blacklisted)
+			printf("blacklisted ");
+
+		printf("journal entry     %llu\n", le64_to_cpu(j->seq));
+
+		prt_printf(&buf,
+			   "  version         %u\n"
+			   "  last seq        %llu\n"
+			   "  flush           %u\n"
+			   "  written at      ",
+			   le32_to_cpu(j->version),
+			   le64_to_cpu(j->last_seq),
+			   !JSET_NO_FLUSH(j));
+		prt_str(&buf, written_at->buf);
+
+		if (blacklisted)
+			star_start_of_lines(buf.buf);
+		printf("%s\n", buf.buf);
+		printbuf_reset(&buf);
+	}
+
+	struct jset_entry *entry = j->start;
+	struct jset_entry *end = vstruct_last(j);
+	while (entry != end) {
+
+		/*
+		 * log entries denote the start of a new transaction
+		 * commit:
+		 */
+		if (entry_is_transaction_start(entry)) {
+			if (!should_print_transaction(entry, end, f)) {
+				do {
+					entry = vstruct_next(entry);
+				} while (entry != end && !entry_is_transaction_start(entry));
+
+				continue;
+			}
+
+			prt_newline(&buf);
+		}
+
+		if (!should_print_entry(entry, f->key))
+			goto next;
+
+		bool highlight = entry_matches_transaction_filter(entry, f->transaction);
+		if (highlight)
+			fputs(RED, stdout);
+
+		printbuf_indent_add(&buf, 4);
+		bch2_journal_entry_to_text(&buf, c, entry);
+
+		if (blacklisted)
+			star_start_of_lines(buf.buf);
+		printf("%s\n", buf.buf);
+		printbuf_reset(&buf);
+
+		if (highlight)
+			fputs(NORMAL, stdout);
+next:
+		entry = vstruct_next(entry);
+	}
+
+	printbuf_exit(&buf);
+}
+
 static void journal_entries_print(struct bch_fs *c, unsigned nr_entries,
-				  d_bbpos_range transaction_filter,
-				  d_btree_id key_filter)
+				  struct journal_filter *f)
 {
 	struct journal_replay *p, **_p;
 	struct genradix_iter iter;
@@ -132,72 +233,247 @@ static void journal_entries_print(struct bch_fs *c, unsigned nr_entries,
 			bch2_journal_seq_is_blacklisted(c,
 					le64_to_cpu(p->j.seq), false);
 
-		if (!transaction_filter.nr) {
-			if (blacklisted)
-				printf("blacklisted ");
+		printbuf_reset(&buf);
+		bch2_journal_ptrs_to_text(&buf, c, p);
+		jset_print(c, &p->j, blacklisted, &buf, f);
+	}
 
-			printf("journal entry     %llu\n", le64_to_cpu(p->j.seq));
+	printbuf_exit(&buf);
+}
 
-			printbuf_reset(&buf);
+/*
+ * Streaming mode: walk journal buckets straight off the devices, without
+ * bch2_journal_read() and the in memory table of every journal entry it
+ * builds.
+ *
+ * We first read the seq of the first entry in each journal bucket, so that each
+ * device's buckets can be walked in seq order; then we merge entries from all
+ * devices by seq, with one bucket per device mapped at a time, and skip
+ * entries we've already seen on another device:
+ */
+struct journal_stream_bucket {
+	u64		seq;
+	unsigned	bucket;
+};
+
+struct journal_stream_dev {
+	struct bch_dev	*ca;
+	DARRAY(struct journal_stream_bucket) buckets;
+	unsigned	idx;
+
+	void		*p;
+	size_t		len;
+	unsigned	offset;
+	unsigned	entry_offset;
+	u64		bucket_seq;
+	struct jset	*j;
+};
+
+typedef DARRAY(struct journal_stream_dev) d_journal_stream_dev;
+
+static int journal_stream_bucket_cmp(const void *_l, const void *_r)
+{
+	const struct journal_stream_bucket *l = _l;
+	const struct journal_stream_bucket *r = _r;
 
-			prt_printf(&buf,
-				   "  version         %u\n"
-				   "  last seq        %llu\n"
-				   "  flush           %u\n"
-				   "  written at      ",
-				   le32_to_cpu(p->j.version),
-				   le64_to_cpu(p->j.last_seq),
-				   !JSET_NO_FLUSH(&p->j));
-			bch2_journal_ptrs_to_text(&buf, c, p);
+	return cmp_int(l->seq, r->seq);
+}
 
-			if (blacklisted)
-				star_start_of_lines(buf.buf);
-			printf("%s\n", buf.buf);
-			printbuf_reset(&buf);
-		}
+static void *journal_bucket_map(struct bch_dev *ca, unsigned bucket,
+				size_t len, int advice)
+{
+	off_t offset = bucket_to_sector(ca, ca->journal.buckets[bucket]) << 9;
 
-		struct jset_entry *entry = p->j.start;
-		struct jset_entry *end = vstruct_last(&p->j);
-		while (entry != end) {
+	/* private mapping: entries are decrypted in place */
+	void *p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+		       ca->disk_sb.bdev->bd_fd, offset);
+	if (p == MAP_FAILED)
+		die("error mapping journal bucket %u on %s: %m", bucket, ca->name);
 
-			/*
-			 * log entries denote the start of a new transaction
-			 * commit:
-			 */
-			if (entry_is_transaction_start(entry)) {
-				if (!should_print_transaction(entry, end, transaction_filter)) {
-					do {
-						entry = vstruct_next(entry);
-					} while (entry != end && !entry_is_transaction_start(entry));
+	madvise(p, len, advice);
+	return p;
+}
+
+static struct jset *journal_bucket_next_jset(struct bch_fs *c, struct bch_dev *ca,
+					     void *p, unsigned *offset)
+{
+	unsigned bucket_size = ca->mi.bucket_size;
+
+	if (*offset + block_sectors(c) > bucket_size)
+		return NULL;
+
+	struct jset *j = p + (*offset << 9);
+	if (le64_to_cpu(j->magic) != jset_magic(c))
+		return NULL;
+
+	unsigned sectors = vstruct_sectors(j, c->block_bits);
+	if (!sectors || *offset + sectors > bucket_size)
+		return NULL;
 
-					continue;
-				}
+	*offset += sectors;
+	return j;
+}
+
+static void journal_stream_dev_init(struct bch_fs *c, struct journal_stream_dev *d)
+{
+	struct bch_dev *ca = d->ca;
+	size_t len = block_bytes(c);
+
+	for (unsigned b = 0; b < ca->journal.nr; b++) {
+		void *p = journal_bucket_map(ca, b, len, MADV_RANDOM);
+		unsigned offset = 0;
+		struct jset *j = journal_bucket_next_jset(c, ca, p, &offset);
+
+		if (j)
+			darray_push(&d->buckets, ((struct journal_stream_bucket) {
+				.seq	= le64_to_cpu(j->seq),
+				.bucket	= b,
+			}));
+		munmap(p, len);
+	}
+
+	sort(d->buckets.data, d->buckets.nr, sizeof(d->buckets.data[0]),
+	     journal_stream_bucket_cmp, NULL);
+}
 
-				prt_newline(&buf);
+/* Advance to the next entry on this device, mapping the next bucket as needed: */
+static void journal_stream_dev_advance(struct bch_fs *c, struct journal_stream_dev *d,
+				       u64 seq_min)
+{
+	struct bch_dev *ca = d->ca;
+
+	while (1) {
+		if (d->p) {
+			d->entry_offset = d->offset;
+			d->j = journal_bucket_next_jset(c, ca, d->p, &d->offset);
+
+			/* Stale entries from a previous pass through the ring: */
+			if (d->j && le64_to_cpu(d->j->seq) >= d->bucket_seq) {
+				d->bucket_seq = le64_to_cpu(d->j->seq);
+				return;
 			}
 
-			if (!should_print_entry(entry, key_filter))
-				goto next;
+			munmap(d->p, d->len);
+			d->p = NULL;
+			d->idx++;
+		}
+
+		/* Skip buckets entirely older than what we're printing: */
+		while (d->idx + 1 < d->buckets.nr &&
+		       d->buckets.data[d->idx + 1].seq <= seq_min)
+			d->idx++;
+
+		if (d->idx >= d->buckets.nr) {
+			d->j = NULL;
+			return;
+		}
 
-			bool highlight = entry_matches_transaction_filter(entry, transaction_filter);
-			if (highlight)
-				fputs(RED, stdout);
+		d->len		= ca->mi.bucket_size << 9;
+		d->p		= journal_bucket_map(ca, d->buckets.data[d->idx].bucket,
+						     d->len, MADV_SEQUENTIAL);
+		d->offset	= 0;
+		d->bucket_seq	= 0;
+	}
+}
 
-			printbuf_indent_add(&buf, 4);
-			bch2_journal_entry_to_text(&buf, c, entry);
+static void journal_entries_stream(struct bch_fs *c, unsigned nr_entries,
+				   struct journal_filter *f)
+{
+	d_journal_stream_dev devs = {};
+	struct printbuf buf = PRINTBUF;
+	u64 seq_max = 0, seq_min = 0, last_seq = 0;
+	int ret;
 
-			if (blacklisted)
-				star_start_of_lines(buf.buf);
-			printf("%s\n", buf.buf);
-			printbuf_reset(&buf);
+	ret = bch2_blacklist_table_initialize(c);
+	if (ret)
+		die("error initializing journal seq blacklist table: %s", bch2_err_str(ret));
 
-			if (highlight)
-				fputs(NORMAL, stdout);
-next:
-			entry = vstruct_next(entry);
+	for_each_online_member(c, ca) {
+		struct journal_stream_dev d = { .ca = ca };
+
+		journal_stream_dev_init(c, &d);
+		if (d.buckets.nr)
+			seq_max = max(seq_max, darray_last(d.buckets).seq);
+		darray_push(&devs, d);
+	}
+
+	/*
+	 * We don't know the newest seq until we've walked the newest bucket; the
+	 * first entry in the newest bucket is close enough for --nr-entries:
+	 */
+	if (nr_entries != U32_MAX && seq_max > nr_entries)
+		seq_min = seq_max - nr_entries;
+
+	darray_for_each(devs, d)
+		journal_stream_dev_advance(c, d, seq_min);
+
+	while (1) {
+		struct journal_stream_dev *d = NULL;
+
+		darray_for_each(devs, i)
+			if (i->j && (!d || le64_to_cpu(i->j->seq) < le64_to_cpu(d->j->seq)))
+				d = i;
+		if (!d)
+			break;
+
+		struct bch_dev *ca = d->ca;
+		struct jset *j = d->j, *u;
+		u64 seq = le64_to_cpu(j->seq);
+		unsigned bucket = d->buckets.data[d->idx].bucket;
+		u64 sector = bucket_to_sector(ca, ca->journal.buckets[bucket]) +
+			d->entry_offset;
+		bool csum_good;
+
+		if (seq <= last_seq || seq < seq_min)
+			goto next;
+
+		ret = bch2_journal_jset_read(c, ca, j, sector, &u, &csum_good);
+		if (ret) {
+			fprintf(stderr, "%s: error reading journal entry %llu at sector %llu: %s\n",
+				ca->name, seq, sector, bch2_err_str(ret));
+			goto next;
 		}
+
+		printbuf_reset(&buf);
+		prt_printf(&buf, "%u:%u:%u (sector %llu)%s",
+			   ca->dev_idx, bucket, d->entry_offset, sector,
+			   csum_good ? "" : " (bad csum)");
+
+		jset_print(c, u, bch2_journal_seq_is_blacklisted(c, seq, false), &buf, f);
+		last_seq = seq;
+
+		if (u != j)
+			kvfree(u);
+next:
+		journal_stream_dev_advance(c, d, seq_min);
 	}
 
+	darray_for_each(devs, d)
+		darray_exit(&d->buckets);
+	darray_exit(&devs);
+	printbuf_exit(&buf);
+}
+
+static void journal_entries_stats(struct bch_fs *c, unsigned nr_entries)
+{
+	struct journal_entry_stats stats = {};
+	struct journal_replay *p, **_p;
+	struct genradix_iter iter;
+	struct printbuf buf = PRINTBUF;
+
+	genradix_for_each(&c->journal_entries, iter, _p) {
+		p = *_p;
+		if (!p)
+			continue;
+
+		if (le64_to_cpu(p->j.seq) + nr_entries < atomic64_read(&c->journal.seq))
+			continue;
+
+		bch2_journal_entry_stats_account(&stats, &p->j);
+	}
+
+	bch2_journal_entry_stats_to_text(&buf, &stats);
+	printf("%s", buf.buf);
 	printbuf_exit(&buf);
 }
 
@@ -206,19 +482,23 @@ int cmd_list_journal(int argc, char *argv[])
 	static const struct option longopts[] = {
 		{ "nr-entries",		required_argument,	NULL, 'n' },
 		{ "transaction-filter",	required_argument,	NULL, 't' },
+		{ "transaction-fn",	required_argument,	NULL, 'f' },
 		{ "key-filter",		required_argument,	NULL, 'k' },
+		{ "stats",		no_argument,		NULL, 's' },
+		{ "stream",		no_argument,		NULL, 'S' },
 		{ "verbose",		no_argument,		NULL, 'v' },
 		{ "help",		no_argument,		NULL, 'h' },
 		{ NULL }
 	};
 	struct bch_opts opts = bch2_opts_empty();
 	u32 nr_entries = U32_MAX;
-	d_bbpos_range	transaction_filter = { 0 };
-	d_btree_id	key_filter = { 0 };
+	struct journal_filter filter = {};
+	bool stats = false, stream = false;
 	int opt;
 
 	opt_set(opts, noexcl,		true);
 	opt_set(opts, nochanges,	true);
+	opt_set(opts, mmap_devices,	true);
 	opt_set(opts, norecovery,	true);
 	opt_set(opts, read_only,	true);
 	opt_set(opts, degraded,		true);
@@ -228,7 +508,7 @@ int cmd_list_journal(int argc, char *argv[])
 	opt_set(opts, retain_recovery_info ,true);
 	opt_set(opts, read_journal_only,true);
 
-	while ((opt = getopt_long(argc, argv, "an:t:k:vh",
+	while ((opt = getopt_long(argc, argv, "an:t:f:k:sSvh",
 				  longopts, NULL)) != -1)
 		switch (opt) {
 		case 'a':
@@ -240,10 +520,19 @@ int cmd_list_journal(int argc, char *argv[])
 			opt_set(opts, read_entire_journal, true);
 			break;
 		case 't':
-			darray_push(&transaction_filter, bbpos_range_parse(optarg));
+			darray_push(&filter.transaction, bbpos_range_parse(optarg));
+			break;
+		case 'f':
+			darray_push(&filter.transaction_fn, optarg);
 			break;
 		case 'k':
-			darray_push(&key_filter, read_string_list_or_die(optarg, __bch2_btree_ids, "btree id"));
+			darray_push(&filter.key, read_string_list_or_die(optarg, __bch2_btree_ids, "btree id"));
+			break;
+		case 's':
+			stats = true;
+			break;
+		case 'S':
+			stream = true;
 			break;
 		case 'v':
 			opt_set(opts, verbose, true);
@@ -257,13 +546,25 @@ int cmd_list_journal(int argc, char *argv[])
 	if (!argc)
 		die("Please supply device(s) to open");
 
+	if (stream && stats)
+		die("--stream and --stats are mutually exclusive");
+
+	/* Streaming mode reads the journal itself: */
+	if (stream)
+		opt_set(opts, nostart, true);
+
 	darray_str devs = get_or_split_cmdline_devs(argc, argv);
 
 	struct bch_fs *c = bch2_fs_open(devs.data, devs.nr, opts);
 	if (IS_ERR(c))
 		die("error opening %s: %s", argv[0], bch2_err_str(PTR_ERR(c)));
 
-	journal_entries_print(c, nr_entries, transaction_filter, key_filter);
+	if (stream)
+		journal_entries_stream(c, nr_entries, &filter);
+	else if (stats)
+		journal_entries_stats(c, nr_entries);
+	else
+		journal_entries_print(c, nr_entries, &filter);
 	bch2_fs_stop(c);
 	return 0;
 }
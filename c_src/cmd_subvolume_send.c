@@ -0,0 +1,846 @@
+/*
+ * bcachefs subvolume send/receive: replicate a subvolume by streaming the keys
+ * that differ between two of its snapshots.
+ *
+ * Both snapshots are in the same snapshot tree, so for every position in the
+ * inodes, dirents, xattrs and extents btrees we can tell which key each of them
+ * sees: the key in the nearest ancestor snapshot. If that's the same key (same
+ * snapshot ID), nothing changed there - keys in interior snapshot nodes are
+ * never modified. Otherwise we send the key visible in the new snapshot, or a
+ * deletion if there isn't one; extents are sent as the data they point to,
+ * read through the new snapshot.
+ *
+ * Within each btree all deletions are sent before any keys, so that applying
+ * a deletion can never clobber a key that was just received.
+ *
+ * Receive applies the stream to a subvolume that's a copy of the parent
+ * snapshot (or to an empty one, for a full stream): keys go in with the bulk
+ * loader, data is rewritten with normal writes.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "cmds.h"
+#include "libbcachefs.h"
+#include "posix_to_bcachefs.h"
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/alloc_foreground.h"
+#include "libbcachefs/bkey_buf.h"
+#include "libbcachefs/btree_iter.h"
+#include "libbcachefs/btree_update.h"
+#include "libbcachefs/buckets.h"
+#include "libbcachefs/dirent.h"
+#include "libbcachefs/errcode.h"
+#include "libbcachefs/inode.h"
+#include "libbcachefs/io_misc.h"
+#include "libbcachefs/io_read.h"
+#include "libbcachefs/io_write.h"
+#include "libbcachefs/snapshot.h"
+#include "libbcachefs/subvolume.h"
+#include "libbcachefs/super.h"
+
+#define SEND_MAGIC		0x31646e6573686362ULL	/* "bchsend1" */
+#define SEND_VERSION		1
+#define SEND_INCREMENTAL	(1U << 0)
+
+/* Data is sent in chunks of at most this many bytes: */
+#define SEND_DATA_MAX		(1U << 20)
+
+struct send_header {
+	__le64			magic;
+	__le32			version;
+	__le32			flags;
+	/* root directory of the subvolume that was sent: */
+	__le64			root_inum;
+	__le64			pad;
+};
+
+enum send_rec_type {
+	SEND_REC_key		= 1,	/* a bkey_i */
+	SEND_REC_delete		= 2,	/* a struct bkey: position and size */
+	SEND_REC_data		= 3,	/* struct send_data, then the data */
+	SEND_REC_end		= 4,
+};
+
+struct send_rec {
+	__u8			type;
+	__u8			btree_id;
+	__le16			pad;
+	/* bytes of payload following: */
+	__le32			bytes;
+};
+
+struct send_data {
+	__le64			inum;
+	/* sectors: */
+	__le64			offset;
+};
+
+static const enum btree_id send_btrees[] = {
+	BTREE_ID_inodes,
+	BTREE_ID_dirents,
+	BTREE_ID_xattrs,
+	BTREE_ID_extents,
+};
+
+static void send_write(FILE *f, const void *buf, size_t bytes)
+{
+	if (fwrite(buf, 1, bytes, f) != bytes)
+		die("write error: %m");
+}
+
+static void send_rec(FILE *f, enum send_rec_type type, enum btree_id btree,
+		     const void *buf, size_t bytes)
+{
+	struct send_rec r = {
+		.type		= type,
+		.btree_id	= btree,
+		.bytes		= cpu_to_le32(bytes),
+	};
+
+	send_write(f, &r, sizeof(r));
+	send_write(f, buf, bytes);
+}
+
+static void recv_read(FILE *f, void *buf, size_t bytes)
+{
+	if (fread(buf, 1, bytes, f) != bytes)
+		die(feof(f) ? "truncated stream" : "read error: %m");
+}
+
+/* Send */
+
+struct send_range {
+	u64			inum;
+	u64			start;
+	u64			end;
+};
+
+struct send_state {
+	struct bch_fs		*c;
+	FILE			*out;
+	/* keys go here while scanning a btree, after the deletions: */
+	FILE			*keys;
+	u32			subvol;
+	u32			snap;
+	/* 0 for a full send: */
+	u32			parent_snap;
+	u32			tree;
+	enum btree_id		btree;
+
+	/* the keys each snapshot sees at the current position: */
+	struct bpos		pos;
+	bool			have_pos;
+	bool			new_done;
+	bool			old_done;
+	bool			have_new;
+	bool			have_old;
+	struct bkey_buf		new;
+	struct bkey		old;
+
+	DARRAY(struct send_range) data;
+
+	u64			nr_keys;
+	u64			nr_deletes;
+	u64			nr_skipped;
+	u64			data_sectors;
+};
+
+static bool send_key_has_data(struct bkey_s_c k)
+{
+	return k.k->type == KEY_TYPE_extent ||
+		k.k->type == KEY_TYPE_reflink_p ||
+		k.k->type == KEY_TYPE_inline_data;
+}
+
+static void send_data_add(struct send_state *s, struct bkey_s_c k)
+{
+	struct send_range *r = s->data.nr ? &darray_last(s->data) : NULL;
+
+	if (r && r->inum == k.k->p.inode && r->end == bkey_start_offset(k.k)) {
+		r->end = k.k->p.offset;
+		return;
+	}
+
+	if (darray_push(&s->data, ((struct send_range) {
+			.inum	= k.k->p.inode,
+			.start	= bkey_start_offset(k.k),
+			.end	= k.k->p.offset,
+		})))
+		die("allocation failure");
+}
+
+static void send_pos_flush(struct send_state *s)
+{
+	if (s->have_new &&
+	    !(s->have_old && s->old.p.snapshot == s->new.k->k.p.snapshot)) {
+		struct bkey_i *k = s->new.k;
+
+		if (k->k.type == KEY_TYPE_dirent &&
+		    bkey_i_to_dirent(k)->v.d_type == DT_SUBVOL) {
+			/* nested subvolumes aren't sent: */
+			s->nr_skipped++;
+		} else if (s->btree == BTREE_ID_extents &&
+			   send_key_has_data(bkey_i_to_s_c(k))) {
+			send_data_add(s, bkey_i_to_s_c(k));
+			s->data_sectors += k->k.size;
+		} else {
+			k->k.p.snapshot = 0;
+			send_rec(s->keys, SEND_REC_key, s->btree, k, bkey_bytes(&k->k));
+			s->nr_keys++;
+		}
+	} else if (!s->have_new && s->have_old) {
+		s->old.p.snapshot = 0;
+		send_rec(s->out, SEND_REC_delete, s->btree, &s->old, sizeof(s->old));
+		s->nr_deletes++;
+	}
+
+	s->have_pos	= false;
+	s->new_done	= false;
+	s->old_done	= false;
+	s->have_new	= false;
+	s->have_old	= false;
+}
+
+/*
+ * Keys at a given position are in snapshot ID order, and children have
+ * smaller IDs than their parents: the first key in an ancestor of a snapshot
+ * is the one it sees.
+ */
+static int send_key(struct send_state *s, struct bkey_s_c k)
+{
+	struct bch_fs *c = s->c;
+	u32 snapshot = k.k->p.snapshot;
+
+	if (s->have_pos &&
+	    (k.k->p.inode != s->pos.inode ||
+	     k.k->p.offset != s->pos.offset))
+		send_pos_flush(s);
+
+	if (bch2_snapshot_tree(c, snapshot) != s->tree)
+		return 0;
+
+	s->pos		= k.k->p;
+	s->have_pos	= true;
+
+	if (!s->new_done && bch2_snapshot_is_ancestor(c, s->snap, snapshot)) {
+		s->new_done = true;
+		if (!bkey_whiteout(k.k)) {
+			bch2_bkey_buf_reassemble(&s->new, c, k);
+			s->have_new = true;
+		}
+	}
+
+	if (s->parent_snap &&
+	    !s->old_done && bch2_snapshot_is_ancestor(c, s->parent_snap, snapshot)) {
+		s->old_done = true;
+		if (!bkey_whiteout(k.k)) {
+			s->old = *k.k;
+			s->have_old = true;
+		}
+	}
+
+	return 0;
+}
+
+static void send_read_endio(struct bio *bio)
+{
+	closure_put(bio->bi_private);
+}
+
+static int send_read(struct bch_fs *c, subvol_inum inum, struct bch_io_opts opts,
+		     u64 sector, void *buf, size_t bytes)
+{
+	struct bch_read_bio rbio;
+	struct bio_vec bv;
+	struct closure cl;
+
+	bio_init(&rbio.bio, NULL, &bv, 1, 0);
+	rbio.bio.bi_iter.bi_size	= bytes;
+	rbio.bio.bi_iter.bi_sector	= sector;
+	bv.bv_page			= buf;
+	bv.bv_len			= bytes;
+	bv.bv_offset			= 0;
+	bio_set_op_attrs(&rbio.bio, REQ_OP_READ, REQ_SYNC);
+
+	closure_init_stack(&cl);
+	closure_get(&cl);
+	rbio.bio.bi_end_io		= send_read_endio;
+	rbio.bio.bi_private		= &cl;
+
+	bch2_read(c, rbio_init(&rbio.bio, opts), inum, 0);
+	closure_sync(&cl);
+
+	return -blk_status_to_errno(rbio.bio.bi_status);
+}
+
+static void send_data(struct send_state *s)
+{
+	struct bch_fs *c = s->c;
+	void *buf = xmalloc(sizeof(struct send_data) + SEND_DATA_MAX);
+	struct send_data *d = buf;
+
+	darray_for_each(s->data, r) {
+		subvol_inum inum = { s->subvol, r->inum };
+		struct bch_inode_unpacked bi;
+		struct bch_io_opts opts;
+
+		int ret = bch2_inode_find_by_inum(c, inum, &bi);
+		if (ret)
+			die("error looking up inode %llu: %s", r->inum, bch2_err_str(ret));
+		bch2_inode_opts_get(&opts, c, &bi);
+
+		for (u64 offset = r->start; offset < r->end;) {
+			u64 sectors = min_t(u64, r->end - offset, SEND_DATA_MAX >> 9);
+
+			ret = send_read(c, inum, opts, offset, d + 1, sectors << 9);
+			if (ret)
+				die("error reading inode %llu at %llu: %s",
+				    r->inum, offset << 9, bch2_err_str(ret));
+
+			d->inum		= cpu_to_le64(r->inum);
+			d->offset	= cpu_to_le64(offset);
+			send_rec(s->out, SEND_REC_data, BTREE_ID_extents,
+				 buf, sizeof(*d) + (sectors << 9));
+			offset += sectors;
+		}
+	}
+
+	s->data.nr = 0;
+	free(buf);
+}
+
+/* Appends the keys buffered while scanning a btree to the stream: */
+static void send_keys_copy(struct send_state *s)
+{
+	char buf[1 << 16];
+	size_t n;
+
+	rewind(s->keys);
+	while ((n = fread(buf, 1, sizeof(buf), s->keys)))
+		send_write(s->out, buf, n);
+	if (ferror(s->keys))
+		die("error reading temporary file: %m");
+
+	rewind(s->keys);
+	if (ftruncate(fileno(s->keys), 0))
+		die("error truncating temporary file: %m");
+}
+
+static int send_btree(struct send_state *s, enum btree_id btree)
+{
+	s->btree = btree;
+
+	int ret = bch2_trans_run(s->c,
+		for_each_btree_key(trans, iter, btree, POS_MIN,
+				   BTREE_ITER_all_snapshots|BTREE_ITER_prefetch, k,
+			send_key(s, k)));
+	if (ret)
+		return ret;
+
+	if (s->have_pos)
+		send_pos_flush(s);
+
+	fflush(s->keys);
+	send_keys_copy(s);
+
+	if (btree == BTREE_ID_extents)
+		send_data(s);
+	return 0;
+}
+
+static void subvolume_send_usage(void)
+{
+	puts("bcachefs subvolume send - stream the contents of a snapshot\n"
+	     "Usage: bcachefs subvolume send [OPTION]... subvolume device...\n"
+	     "\n"
+	     "Writes the contents of a (read only) snapshot subvolume of an unmounted\n"
+	     "filesystem as a stream, to be applied with bcachefs subvolume receive.\n"
+	     "With -p, only what changed since an older snapshot of the same\n"
+	     "subvolume is sent. Subvolumes are given by ID.\n"
+	     "\n"
+	     "Options:\n"
+	     "  -p, --parent=subvolume      Send only the differences from this snapshot\n"
+	     "  -o, --output=file           Write to file instead of stdout\n"
+	     "  -v, --verbose               Print what was sent on stderr\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+}
+
+static int send_lookup(struct btree_trans *trans, u32 subvol,
+		       u32 *snap, u64 *root_inum)
+{
+	struct bch_subvolume s;
+	int ret = bch2_subvolume_get(trans, subvol, true, 0, &s);
+	if (ret)
+		return ret;
+
+	*snap = le32_to_cpu(s.snapshot);
+	if (root_inum)
+		*root_inum = le64_to_cpu(s.inode);
+	return 0;
+}
+
+int cmd_subvolume_send(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "parent",	required_argument,	NULL, 'p' },
+		{ "output",	required_argument,	NULL, 'o' },
+		{ "verbose",	no_argument,		NULL, 'v' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct bch_opts opts = bch2_opts_empty();
+	struct send_state s = {};
+	u32 parent = 0;
+	const char *output = NULL;
+	bool verbose = false;
+	u64 root_inum;
+	int opt, ret;
+
+	opt_set(opts, read_only,	true);
+	opt_set(opts, nochanges,	true);
+	opt_set(opts, degraded,		true);
+	opt_set(opts, errors,		BCH_ON_ERROR_continue);
+
+	while ((opt = getopt_long(argc, argv, "p:o:vh", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'p':
+			if (kstrtouint(optarg, 10, &parent) || !parent)
+				die("invalid subvolume %s", optarg);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'h':
+			subvolume_send_usage();
+			exit(EXIT_SUCCESS);
+		default:
+			subvolume_send_usage();
+			exit(EXIT_FAILURE);
+		}
+	args_shift(optind);
+
+	char *subvol_str = arg_pop();
+	if (!subvol_str || kstrtouint(subvol_str, 10, &s.subvol) || !s.subvol)
+		die("Please supply a subvolume ID");
+	if (!argc)
+		die("Please supply one or more devices");
+
+	s.out = output ? fopen(output, "w") : stdout;
+	if (!s.out)
+		die("error opening %s: %m", output);
+	s.keys = tmpfile();
+	if (!s.keys)
+		die("error creating temporary file: %m");
+
+	struct bch_fs *c = bch2_fs_open(argv, argc, opts);
+	if (IS_ERR(c))
+		die("error opening %s: %s", argv[0], bch2_err_str(PTR_ERR(c)));
+	s.c = c;
+
+	ret = bch2_trans_run(c, lockrestart_do(trans,
+			send_lookup(trans, s.subvol, &s.snap, &root_inum) ?:
+			(parent ? send_lookup(trans, parent, &s.parent_snap, NULL) : 0)));
+	if (ret)
+		die("error looking up subvolumes: %s", bch2_err_str(ret));
+
+	s.tree = bch2_snapshot_tree(c, s.snap);
+	if (parent && bch2_snapshot_tree(c, s.parent_snap) != s.tree)
+		die("subvolume %u is not a snapshot of the same subvolume as %u",
+		    parent, s.subvol);
+
+	struct send_header h = {
+		.magic		= cpu_to_le64(SEND_MAGIC),
+		.version	= cpu_to_le32(SEND_VERSION),
+		.flags		= cpu_to_le32(parent ? SEND_INCREMENTAL : 0),
+		.root_inum	= cpu_to_le64(root_inum),
+	};
+	send_write(s.out, &h, sizeof(h));
+
+	bch2_bkey_buf_init(&s.new);
+
+	for (unsigned i = 0; i < ARRAY_SIZE(send_btrees); i++) {
+		ret = send_btree(&s, send_btrees[i]);
+		if (ret)
+			die("error walking %s: %s",
+			    bch2_btree_id_str(send_btrees[i]), bch2_err_str(ret));
+	}
+
+	send_rec(s.out, SEND_REC_end, 0, NULL, 0);
+
+	if (fflush(s.out))
+		die("write error: %m");
+
+	if (verbose)
+		fprintf(stderr, "sent %llu keys, %llu deletions, %llu sectors of data\n",
+			s.nr_keys, s.nr_deletes, s.data_sectors);
+	if (s.nr_skipped)
+		fprintf(stderr, "skipped %llu nested subvolumes\n", s.nr_skipped);
+
+	bch2_bkey_buf_exit(&s.new, c);
+	darray_exit(&s.data);
+	bch2_fs_stop(c);
+
+	fclose(s.keys);
+	if (output)
+		fclose(s.out);
+	return 0;
+}
+
+/* Receive */
+
+struct recv_state {
+	struct bch_fs		*c;
+	u32			subvol;
+	u32			snap;
+	u64			root_inum;
+	u64			stream_root_inum;
+	/* fields of the destination's root inode that are specific to it: */
+	struct bch_inode_unpacked root;
+
+	struct bulk_insert	keys[BTREE_ID_NR];
+	/* inodes are reapplied after the data, which updates bi_sectors: */
+	DARRAY(u64)		inodes;
+
+	u64			nr_keys;
+	u64			nr_deletes;
+	u64			data_sectors;
+};
+
+static int recv_root_lookup(struct btree_trans *trans, struct recv_state *r)
+{
+	struct bch_subvolume s;
+	int ret = bch2_subvolume_get(trans, r->subvol, true, 0, &s);
+	if (ret)
+		return ret;
+
+	r->snap		= le32_to_cpu(s.snapshot);
+	r->root_inum	= le64_to_cpu(s.inode);
+
+	return bch2_inode_find_by_inum_trans(trans,
+			(subvol_inum) { r->subvol, r->root_inum }, &r->root);
+}
+
+/* The stream's root becomes the destination subvolume's root: */
+static int recv_set_root(struct btree_trans *trans, struct recv_state *r)
+{
+	struct btree_iter iter;
+	struct bkey_i_subvolume *s =
+		bch2_bkey_get_mut_typed(trans, &iter, BTREE_ID_subvolumes,
+					POS(0, r->subvol), 0, subvolume);
+	int ret = PTR_ERR_OR_ZERO(s);
+	if (ret)
+		return ret;
+
+	s->v.inode = cpu_to_le64(r->stream_root_inum);
+	bch2_trans_iter_exit(trans, &iter);
+
+	return bch2_btree_delete(trans, BTREE_ID_inodes,
+				 SPOS(0, r->root_inum, r->snap), 0);
+}
+
+static void recv_inode(struct recv_state *r, struct bkey_i *k)
+{
+	struct bkey_inode_buf packed;
+
+	if (bkey_is_inode(&k->k) && k->k.p.offset == r->stream_root_inum) {
+		struct bch_inode_unpacked u;
+
+		if (bch2_inode_unpack(bkey_i_to_s_c(k), &u))
+			die("invalid inode in stream");
+
+		u.bi_subvol		= r->root.bi_subvol;
+		u.bi_parent_subvol	= r->root.bi_parent_subvol;
+		u.bi_dir		= r->root.bi_dir;
+		u.bi_dir_offset		= r->root.bi_dir_offset;
+
+		bch2_inode_pack(&packed, &u);
+		packed.inode.k.p.snapshot = r->snap;
+		k = &packed.inode.k_i;
+	}
+
+	bulk_insert_add(r->c, &r->keys[BTREE_ID_inodes], k);
+
+	if (darray_make_room(&r->inodes, k->k.u64s))
+		die("allocation failure");
+	bkey_copy((void *) (r->inodes.data + r->inodes.nr), k);
+	r->inodes.nr += k->k.u64s;
+}
+
+static void recv_inodes_reapply(struct recv_state *r)
+{
+	struct bulk_insert *b = &r->keys[BTREE_ID_inodes];
+
+	for (struct bkey_i *k = (void *) r->inodes.data;
+	     k != (void *) (r->inodes.data + r->inodes.nr);
+	     k = bkey_next(k))
+		bulk_insert_add(r->c, b, k);
+	bulk_insert_flush(r->c, b);
+}
+
+static void recv_delete(struct recv_state *r, enum btree_id btree, struct bkey *k)
+{
+	struct bch_fs *c = r->c;
+	int ret;
+
+	switch (btree) {
+	case BTREE_ID_extents: {
+		s64 i_sectors_delta = 0;
+
+		ret = bch2_fpunch(c, (subvol_inum) { r->subvol, k->p.inode },
+				  bkey_start_offset(k), k->p.offset, &i_sectors_delta);
+		break;
+	}
+	case BTREE_ID_dirents:
+	case BTREE_ID_xattrs: {
+		/* hash tables: a whiteout, so that later entries can still be found */
+		struct bkey_i w;
+
+		bkey_init(&w.k);
+		w.k.type	= KEY_TYPE_whiteout;
+		w.k.p		= k->p;
+		w.k.p.snapshot	= r->snap;
+
+		ret = bch2_trans_do(c, NULL, NULL, 0,
+				    bch2_btree_insert_trans(trans, btree, &w, 0));
+		break;
+	}
+	default:
+		ret = bch2_trans_do(c, NULL, NULL, 0,
+				    bch2_btree_delete(trans, btree,
+						      SPOS(k->p.inode, k->p.offset, r->snap), 0));
+		break;
+	}
+
+	if (ret)
+		die("error deleting %s key: %s", bch2_btree_id_str(btree), bch2_err_str(ret));
+	r->nr_deletes++;
+}
+
+struct recv_write {
+	struct closure		cl;
+	struct bio_vec		bv;
+
+	/* must be last: */
+	struct bch_write_op	op;
+};
+
+static void recv_write_endio(struct bch_write_op *op)
+{
+	struct recv_write *w = container_of(op, struct recv_write, op);
+
+	closure_put(&w->cl);
+}
+
+static void recv_data(struct recv_state *r, struct send_data *d, size_t bytes)
+{
+	struct bch_fs *c = r->c;
+	subvol_inum inum = { r->subvol, le64_to_cpu(d->inum) };
+	struct bch_inode_unpacked bi;
+	struct bch_io_opts opts;
+	struct recv_write w = {};
+	struct bch_write_op *op = &w.op;
+
+	if (bytes & (block_bytes(c) - 1))
+		die("misaligned data in stream");
+
+	int ret = bch2_inode_find_by_inum(c, inum, &bi);
+	if (ret)
+		die("error looking up inode %llu: %s", inum.inum, bch2_err_str(ret));
+	bch2_inode_opts_get(&opts, c, &bi);
+
+	bch2_write_op_init(op, c, opts);
+	op->write_point	= writepoint_hashed(0);
+	op->nr_replicas	= opts.data_replicas;
+	op->target	= opts.foreground_target;
+	op->subvol	= inum.subvol;
+	op->pos		= POS(inum.inum, le64_to_cpu(d->offset));
+	op->end_io	= recv_write_endio;
+
+	bio_init(&op->wbio.bio, NULL, &w.bv, 1, 0);
+	op->wbio.bio.bi_iter.bi_size	= bytes;
+	w.bv.bv_page			= (void *) (d + 1);
+	w.bv.bv_len			= bytes;
+	w.bv.bv_offset			= 0;
+	bio_set_op_attrs(&op->wbio.bio, REQ_OP_WRITE, REQ_SYNC);
+
+	ret = bch2_disk_reservation_get(c, &op->res, bytes >> 9, op->nr_replicas, 0);
+	if (ret)
+		die("error reserving space: %s", bch2_err_str(ret));
+
+	closure_init_stack(&w.cl);
+	closure_get(&w.cl);
+	closure_call(&op->cl, bch2_write, NULL, NULL);
+	closure_sync(&w.cl);
+
+	if (op->error)
+		die("write error: %s", bch2_err_str(op->error));
+
+	r->data_sectors += bytes >> 9;
+}
+
+static void subvolume_receive_usage(void)
+{
+	puts("bcachefs subvolume receive - apply a stream from subvolume send\n"
+	     "Usage: bcachefs subvolume receive [OPTION]... subvolume device...\n"
+	     "\n"
+	     "Applies a stream written by bcachefs subvolume send to a subvolume of\n"
+	     "an unmounted filesystem, given by ID. The subvolume must be empty for a\n"
+	     "full stream, or an unchanged copy of the parent snapshot for an\n"
+	     "incremental one.\n"
+	     "\n"
+	     "Options:\n"
+	     "  -i, --input=file            Read from file instead of stdin\n"
+	     "  -v, --verbose               Print what was received\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+}
+
+int cmd_subvolume_receive(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "input",	required_argument,	NULL, 'i' },
+		{ "verbose",	no_argument,		NULL, 'v' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct bch_opts opts = bch2_opts_empty();
+	struct recv_state r = {};
+	const char *input = NULL;
+	bool verbose = false;
+	int opt, ret;
+
+	while ((opt = getopt_long(argc, argv, "i:vh", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'i':
+			input = optarg;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'h':
+			subvolume_receive_usage();
+			exit(EXIT_SUCCESS);
+		default:
+			subvolume_receive_usage();
+			exit(EXIT_FAILURE);
+		}
+	args_shift(optind);
+
+	char *subvol_str = arg_pop();
+	if (!subvol_str || kstrtouint(subvol_str, 10, &r.subvol) || !r.subvol)
+		die("Please supply a subvolume ID");
+	if (!argc)
+		die("Please supply one or more devices");
+
+	FILE *in = input ? fopen(input, "r") : stdin;
+	if (!in)
+		die("error opening %s: %m", input);
+
+	struct send_header h;
+	recv_read(in, &h, sizeof(h));
+	if (le64_to_cpu(h.magic) != SEND_MAGIC)
+		die("not a bcachefs send stream");
+	if (le32_to_cpu(h.version) != SEND_VERSION)
+		die("unsupported send stream version %u", le32_to_cpu(h.version));
+	r.stream_root_inum = le64_to_cpu(h.root_inum);
+
+	struct bch_fs *c = bch2_fs_open(argv, argc, opts);
+	if (IS_ERR(c))
+		die("error opening %s: %s", argv[0], bch2_err_str(PTR_ERR(c)));
+	r.c = c;
+
+	ret = bch2_trans_run(c, lockrestart_do(trans, recv_root_lookup(trans, &r)));
+	if (ret)
+		die("error looking up subvolume %u: %s", r.subvol, bch2_err_str(ret));
+
+	if (r.root_inum != r.stream_root_inum) {
+		if (le32_to_cpu(h.flags) & SEND_INCREMENTAL)
+			die("subvolume %u is not a copy of the stream's parent snapshot",
+			    r.subvol);
+
+		ret = bch2_trans_do(c, NULL, NULL, 0, recv_set_root(trans, &r));
+		if (ret)
+			die("error updating subvolume %u: %s", r.subvol, bch2_err_str(ret));
+	}
+
+	for (unsigned i = 0; i < BTREE_ID_NR; i++)
+		r.keys[i].btree = i;
+	r.keys[BTREE_ID_inodes].flags	= BTREE_ITER_cached;
+
+	void *buf = xmalloc(sizeof(struct send_data) + SEND_DATA_MAX);
+	enum btree_id btree = BTREE_ID_NR;
+
+	while (1) {
+		struct send_rec rec;
+
+		recv_read(in, &rec, sizeof(rec));
+
+		u32 bytes = le32_to_cpu(rec.bytes);
+		if (rec.type > SEND_REC_end ||
+		    rec.btree_id >= BTREE_ID_NR ||
+		    bytes > sizeof(struct send_data) + SEND_DATA_MAX)
+			die("invalid record in stream");
+
+		recv_read(in, buf, bytes);
+
+		/* keys for a btree are in the stream after its deletions: */
+		if (btree != BTREE_ID_NR &&
+		    (rec.btree_id != btree || rec.type == SEND_REC_end))
+			bulk_insert_flush(c, &r.keys[btree]);
+		btree = rec.btree_id;
+
+		if (rec.type == SEND_REC_end)
+			break;
+
+		switch (rec.type) {
+		case SEND_REC_key: {
+			struct bkey_i *k = buf;
+
+			if (bytes < sizeof(k->k) || bkey_bytes(&k->k) != bytes)
+				die("invalid key in stream");
+
+			k->k.p.snapshot = r.snap;
+			if (btree == BTREE_ID_inodes)
+				recv_inode(&r, k);
+			else
+				bulk_insert_add(c, &r.keys[btree], k);
+			r.nr_keys++;
+			break;
+		}
+		case SEND_REC_delete:
+			if (bytes != sizeof(struct bkey))
+				die("invalid deletion in stream");
+			bulk_insert_flush(c, &r.keys[btree]);
+			recv_delete(&r, btree, buf);
+			break;
+		case SEND_REC_data:
+			if (bytes < sizeof(struct send_data))
+				die("invalid data in stream");
+			bulk_insert_flush(c, &r.keys[btree]);
+			recv_data(&r, buf, bytes - sizeof(struct send_data));
+			break;
+		}
+	}
+
+	recv_inodes_reapply(&r);
+
+	if (verbose)
+		printf("received %llu keys, %llu deletions, %llu sectors of data\n",
+		       r.nr_keys, r.nr_deletes, r.data_sectors);
+
+	free(buf);
+	for (unsigned i = 0; i < BTREE_ID_NR; i++)
+		darray_exit(&r.keys[i].keys);
+	darray_exit(&r.inodes);
+	bch2_fs_stop(c);
+
+	if (input)
+		fclose(in);
+	return 0;
+}
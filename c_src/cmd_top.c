@@ -0,0 +1,254 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libbcachefs/bcachefs_ioctl.h"
+#include "libbcachefs/sb-counters.h"
+
+#include "cmds.h"
+#include "libbcachefs.h"
+
+static const char * const top_time_stat_names[] = {
+#define x(name) #name,
+	BCH_TIME_STATS()
+#undef x
+	NULL
+};
+
+static void fs_top_usage(void)
+{
+	puts("bcachefs fs top - display filesystem event rates\n"
+	     "Usage: bcachefs fs top [OPTION]... <mountpoint>\n"
+	     "\n"
+	     "Takes a snapshot of the filesystem's counters every interval and\n"
+	     "shows the rate of change of each counter, the rate and mean latency\n"
+	     "of each timed operation, and per device IO throughput.\n"
+	     "\n"
+	     "Options:\n"
+	     "  -i, --interval=seconds      Time between snapshots (default 1)\n"
+	     "  -n, --iterations=nr         Exit after nr intervals (default: run forever)\n"
+	     "  -j, --json                  Output one JSON object per interval\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+}
+
+static u64 top_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static u64 top_rate(u64 delta, u64 elapsed_ns)
+{
+	return div64_u64(delta * NSEC_PER_SEC, max_t(u64, elapsed_ns, 1));
+}
+
+static struct bch_ioctl_dev_io *top_dev_prev(struct bch_ioctl_query_stats *s,
+					     unsigned dev)
+{
+	struct bch_ioctl_dev_io *d = bchu_stats_devs(s);
+
+	for (unsigned i = 0; i < s->nr_devs; i++)
+		if (d[i].dev == dev)
+			return &d[i];
+	return NULL;
+}
+
+static void top_to_text(struct printbuf *out,
+			struct bch_ioctl_query_stats *prev,
+			struct bch_ioctl_query_stats *cur,
+			u64 elapsed_ns)
+{
+	u64 *c0 = bchu_stats_counters(prev), *c1 = bchu_stats_counters(cur);
+	struct bch_ioctl_time_stat *t0 = bchu_stats_time_stats(prev);
+	struct bch_ioctl_time_stat *t1 = bchu_stats_time_stats(cur);
+	struct bch_ioctl_dev_io *d1 = bchu_stats_devs(cur);
+
+	prt_str(out, "used:\t");
+	prt_units_u64(out, cur->used << 9);
+	prt_str(out, " / ");
+	prt_units_u64(out, cur->capacity << 9);
+	prt_newline(out);
+	prt_newline(out);
+
+	printbuf_tabstops_reset(out);
+	printbuf_tabstop_push(out, 32);
+	printbuf_tabstop_push(out, 16);
+	printbuf_tabstop_push(out, 16);
+	printbuf_tabstop_push(out, 16);
+
+	prt_printf(out, "device\rread/s\rwrite/s\r\n");
+	for (unsigned i = 0; i < cur->nr_devs; i++) {
+		struct bch_ioctl_dev_io *d0 = top_dev_prev(prev, d1[i].dev);
+
+		prt_printf(out, "%u\t", d1[i].dev);
+		for (unsigned rw = 0; rw < 2; rw++) {
+			u64 delta = d0 ? d1[i].sectors[rw] - d0->sectors[rw] : 0;
+
+			prt_units_u64(out, top_rate(delta, elapsed_ns) << 9);
+			prt_str(out, "\r");
+		}
+		prt_newline(out);
+	}
+	prt_newline(out);
+
+	prt_printf(out, "operation\rops/s\rmean\rp99\r\n");
+	for (unsigned i = 0; i < min(cur->nr_time_stats, prev->nr_time_stats); i++) {
+		u64 count = t1[i].count - t0[i].count;
+
+		if (!count)
+			continue;
+
+		prt_printf(out, "%s\t%llu\r",
+			   i < BCH_TIME_STAT_NR ? top_time_stat_names[i] : "(unknown)",
+			   top_rate(count, elapsed_ns));
+		bch2_pr_time_units(out, div64_u64(t1[i].total_ns - t0[i].total_ns, count));
+		prt_str(out, "\r");
+		bch2_pr_time_units(out, t1[i].p99_ns);
+		prt_str(out, "\r\n");
+	}
+	prt_newline(out);
+
+	prt_printf(out, "counter\rtotal\rper sec\r\n");
+	for (unsigned i = 0; i < min(cur->nr_counters, prev->nr_counters); i++) {
+		u64 delta = c1[i] - c0[i];
+
+		if (!delta)
+			continue;
+
+		prt_printf(out, "%s\t%llu\r%llu\r\n",
+			   i < BCH_COUNTER_NR ? bch2_counter_names[i] : "(unknown)",
+			   c1[i], top_rate(delta, elapsed_ns));
+	}
+}
+
+static void top_to_json(struct printbuf *out,
+			struct bch_ioctl_query_stats *prev,
+			struct bch_ioctl_query_stats *cur,
+			u64 elapsed_ns)
+{
+	u64 *c0 = bchu_stats_counters(prev), *c1 = bchu_stats_counters(cur);
+	struct bch_ioctl_time_stat *t0 = bchu_stats_time_stats(prev);
+	struct bch_ioctl_time_stat *t1 = bchu_stats_time_stats(cur);
+	struct bch_ioctl_dev_io *d1 = bchu_stats_devs(cur);
+
+	prt_printf(out, "{\"interval_ns\":%llu,\"capacity\":%llu,\"used\":%llu,\"online_reserved\":%llu",
+		   elapsed_ns, cur->capacity << 9, cur->used << 9, cur->online_reserved << 9);
+
+	prt_str(out, ",\"devices\":[");
+	for (unsigned i = 0; i < cur->nr_devs; i++) {
+		struct bch_ioctl_dev_io *d0 = top_dev_prev(prev, d1[i].dev);
+
+		prt_printf(out, "%s{\"dev\":%u,\"read_bytes_per_sec\":%llu,\"write_bytes_per_sec\":%llu}",
+			   i ? "," : "", d1[i].dev,
+			   top_rate(d0 ? d1[i].sectors[READ]  - d0->sectors[READ]  : 0, elapsed_ns) << 9,
+			   top_rate(d0 ? d1[i].sectors[WRITE] - d0->sectors[WRITE] : 0, elapsed_ns) << 9);
+	}
+
+	prt_str(out, "],\"time_stats\":{");
+	bool first = true;
+	for (unsigned i = 0; i < min3(cur->nr_time_stats, prev->nr_time_stats, BCH_TIME_STAT_NR); i++) {
+		u64 count = t1[i].count - t0[i].count;
+
+		prt_printf(out, "%s\"%s\":{\"count\":%llu,\"per_sec\":%llu,\"mean_ns\":%llu,"
+			   "\"max_ns\":%llu,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}",
+			   first ? "" : ",", top_time_stat_names[i],
+			   t1[i].count, top_rate(count, elapsed_ns),
+			   count ? div64_u64(t1[i].total_ns - t0[i].total_ns, count) : 0,
+			   t1[i].max_ns, t1[i].p50_ns, t1[i].p99_ns, t1[i].p999_ns);
+		first = false;
+	}
+
+	prt_str(out, "},\"counters\":{");
+	first = true;
+	for (unsigned i = 0; i < min3(cur->nr_counters, prev->nr_counters, BCH_COUNTER_NR); i++) {
+		prt_printf(out, "%s\"%s\":{\"total\":%llu,\"per_sec\":%llu}",
+			   first ? "" : ",", bch2_counter_names[i],
+			   c1[i], top_rate(c1[i] - c0[i], elapsed_ns));
+		first = false;
+	}
+	prt_str(out, "}}\n");
+}
+
+int cmd_fs_top(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "interval",	required_argument,	NULL, 'i' },
+		{ "iterations",	required_argument,	NULL, 'n' },
+		{ "json",	no_argument,		NULL, 'j' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	unsigned interval = 1;
+	u64 iterations = 0;
+	bool json = false;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "i:n:jh", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'i':
+			if (kstrtouint(optarg, 10, &interval) || !interval)
+				die("invalid interval %s", optarg);
+			break;
+		case 'n':
+			if (kstrtoull(optarg, 10, &iterations))
+				die("invalid number of iterations %s", optarg);
+			break;
+		case 'j':
+			json = true;
+			break;
+		case 'h':
+			fs_top_usage();
+			exit(EXIT_SUCCESS);
+		default:
+			fs_top_usage();
+			exit(EXIT_FAILURE);
+		}
+	args_shift(optind);
+
+	const char *path = arg_pop() ?: ".";
+	if (argc)
+		die("Please supply a single filesystem");
+
+	struct bchfs_handle fs = bcache_fs_open(path);
+	struct bch_ioctl_query_stats *prev = bchu_fs_stats(fs, 0);
+	if (!prev)
+		die("%s: kernel does not support BCH_IOCTL_QUERY_STATS", path);
+
+	struct printbuf buf = PRINTBUF;
+	bool clear = !json && isatty(STDOUT_FILENO);
+	u64 prev_time = top_now_ns();
+
+	for (u64 i = 0; !iterations || i < iterations; i++) {
+		sleep(interval);
+
+		struct bch_ioctl_query_stats *cur = bchu_fs_stats(fs, 0);
+		u64 cur_time = top_now_ns();
+
+		printbuf_reset(&buf);
+		if (json) {
+			top_to_json(&buf, prev, cur, cur_time - prev_time);
+		} else {
+			if (clear)
+				prt_str(&buf, "\033[2J\033[H");
+			top_to_text(&buf, prev, cur, cur_time - prev_time);
+			prt_newline(&buf);
+		}
+
+		fputs(buf.buf, stdout);
+		fflush(stdout);
+
+		free(prev);
+		prev = cur;
+		prev_time = cur_time;
+	}
+
+	printbuf_exit(&buf);
+	free(prev);
+	bcache_fs_close(fs);
+	return 0;
+}
@@ -0,0 +1,251 @@
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zdict.h>
+
+#include "cmds.h"
+#include "libbcachefs.h"
+#include "libbcachefs/darray.h"
+#include "libbcachefs/super-io.h"
+
+int zstd_dict_usage(void)
+{
+	puts("bcachefs zstd-dict - manage zstd compression dictionaries\n"
+	     "Usage: bcachefs zstd-dict <CMD> [OPTIONS]\n"
+	     "\n"
+	     "Commands:\n"
+	     "  train                           Train a dictionary from sample files\n"
+	     "  set                             Store a dictionary in an (unmounted) filesystem\n"
+	     "\n"
+	     "Data compressed with a dictionary can't be read without it, so a\n"
+	     "filesystem's dictionary can't be replaced once set; use it with\n"
+	     "compression=zstd:dict\n"
+	     "\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+	return 0;
+}
+
+static void zstd_dict_train_usage(void)
+{
+	puts("bcachefs zstd-dict train\n"
+	     "Usage: bcachefs zstd-dict train [OPTION]... -o output file|directory...\n"
+	     "\n"
+	     "Options:\n"
+	     "  -o, --output=file           Where to write the dictionary\n"
+	     "  -s, --size=size             Dictionary size (default 32k, max 64k)\n"
+	     "  -c, --chunk=size            Split samples into chunks of this size\n"
+	     "                              (default 128k, the default encoded_extent_max)\n"
+	     "  -m, --max=size              Stop after sampling this much data\n"
+	     "                              (default 100 times the dictionary size)\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+}
+
+static struct zstd_dict_samples {
+	darray_char	buf;
+	DARRAY(size_t)	sizes;
+	u64		chunk;
+	u64		max;
+} samples;
+
+static int zstd_dict_sample_file(const char *path, const struct stat *st,
+				 int type, struct FTW *ftw)
+{
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+
+	if (samples.buf.nr >= samples.max)
+		return 1;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "error opening %s: %m\n", path);
+		return 0;
+	}
+
+	while (samples.buf.nr < samples.max) {
+		if (darray_make_room(&samples.buf, samples.chunk))
+			die("allocation failure");
+
+		ssize_t ret = read(fd, samples.buf.data + samples.buf.nr, samples.chunk);
+		if (ret < 0)
+			die("error reading %s: %m", path);
+		if (!ret)
+			break;
+
+		samples.buf.nr += ret;
+		if (darray_push(&samples.sizes, ret))
+			die("allocation failure");
+	}
+
+	close(fd);
+	return 0;
+}
+
+int cmd_zstd_dict_train(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "output",	required_argument,	NULL, 'o' },
+		{ "size",	required_argument,	NULL, 's' },
+		{ "chunk",	required_argument,	NULL, 'c' },
+		{ "max",	required_argument,	NULL, 'm' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	const char *output = NULL;
+	u64 dict_size = 32 << 10;
+	int opt;
+
+	samples.chunk	= 128 << 10;
+	samples.max	= 0;
+
+	while ((opt = getopt_long(argc, argv, "o:s:c:m:h", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'o':
+			output = optarg;
+			break;
+		case 's':
+			if (bch2_strtoull_h(optarg, &dict_size) ||
+			    !dict_size || dict_size > BCH_ZSTD_DICT_MAX_BYTES)
+				die("invalid dictionary size %s", optarg);
+			break;
+		case 'c':
+			if (bch2_strtoull_h(optarg, &samples.chunk) ||
+			    !samples.chunk)
+				die("invalid chunk size %s", optarg);
+			break;
+		case 'm':
+			if (bch2_strtoull_h(optarg, &samples.max))
+				die("invalid size %s", optarg);
+			break;
+		case 'h':
+			zstd_dict_train_usage();
+			exit(EXIT_SUCCESS);
+		}
+	args_shift(optind);
+
+	if (!output)
+		die("Please supply an output file");
+	if (!argc)
+		die("Please supply one or more files or directories to sample");
+
+	if (!samples.max)
+		samples.max = dict_size * 100;
+
+	for (unsigned i = 0; i < argc; i++)
+		if (nftw(argv[i], zstd_dict_sample_file, 64, FTW_PHYS) < 0)
+			die("error walking %s: %m", argv[i]);
+
+	if (!samples.sizes.nr)
+		die("No data to sample");
+
+	void *dict = xmalloc(dict_size);
+	size_t ret = ZDICT_trainFromBuffer(dict, dict_size,
+					   samples.buf.data,
+					   samples.sizes.data,
+					   samples.sizes.nr);
+	if (ZDICT_isError(ret))
+		die("error training dictionary: %s", ZDICT_getErrorName(ret));
+
+	int fd = xopen(output, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	xpwrite(fd, dict, ret, 0, "writing dictionary");
+	close(fd);
+
+	printf("dictionary %u, %zu bytes, trained on %zu samples (%zu bytes)\n",
+	       ZDICT_getDictID(dict, ret), ret,
+	       samples.sizes.nr, samples.buf.nr);
+
+	free(dict);
+	darray_exit(&samples.buf);
+	darray_exit(&samples.sizes);
+	return 0;
+}
+
+static void zstd_dict_set_usage(void)
+{
+	puts("bcachefs zstd-dict set\n"
+	     "Usage: bcachefs zstd-dict set [OPTION]... dictionary device...\n"
+	     "\n"
+	     "Options:\n"
+	     "  -l, --level=level           zstd compression level to use with the dictionary\n"
+	     "                              (default 0, zstd's default)\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+}
+
+int cmd_zstd_dict_set(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "level",	required_argument,	NULL, 'l' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct bch_opts opts = bch2_opts_empty();
+	unsigned level = 0;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "l:h", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'l':
+			if (kstrtouint(optarg, 10, &level) || level > 22)
+				die("invalid level %s", optarg);
+			break;
+		case 'h':
+			zstd_dict_set_usage();
+			exit(EXIT_SUCCESS);
+		}
+	args_shift(optind);
+
+	char *dict_path = arg_pop();
+	if (!dict_path)
+		die("Please supply a dictionary");
+	if (!argc)
+		die("Please supply one or more devices");
+
+	int fd = xopen(dict_path, O_RDONLY);
+	u64 bytes = xfstat(fd).st_size;
+	if (!bytes || bytes > BCH_ZSTD_DICT_MAX_BYTES)
+		die("%s: invalid dictionary size %llu (max %u)",
+		    dict_path, bytes, BCH_ZSTD_DICT_MAX_BYTES);
+
+	void *dict = xmalloc(bytes);
+	xpread(fd, dict, bytes, 0);
+	close(fd);
+
+	unsigned dict_id = ZDICT_getDictID(dict, bytes);
+	if (!dict_id)
+		die("%s is not a zstd dictionary", dict_path);
+
+	opt_set(opts, nostart, true);
+
+	/* open every component device, so they're all updated: */
+	struct bch_fs *c = bch2_fs_open(argv, argc, opts);
+	if (IS_ERR(c))
+		die("Error opening %s: %s", argv[0], bch2_err_str(PTR_ERR(c)));
+
+	mutex_lock(&c->sb_lock);
+	if (bch2_sb_field_get(c->disk_sb.sb, zstd_dict))
+		die("Filesystem already has a zstd dictionary");
+
+	struct bch_sb_field_zstd_dict *d =
+		bch2_sb_field_resize(&c->disk_sb, zstd_dict,
+				     DIV_ROUND_UP(sizeof(*d) + bytes, sizeof(u64)));
+	if (!d)
+		die("Not enough space in superblock for a %llu byte dictionary", bytes);
+
+	d->dict_id	= cpu_to_le32(dict_id);
+	d->dict_bytes	= cpu_to_le32(bytes);
+	d->level	= level;
+	memcpy(d->data, dict, bytes);
+
+	bch2_write_super(c);
+	mutex_unlock(&c->sb_lock);
+	bch2_fs_stop(c);
+
+	free(dict);
+	return 0;
+}
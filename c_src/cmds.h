@@ -15,6 +15,7 @@ int cmd_reset_counters(int argc, char *argv[]);
 int cmd_set_option(int argc, char *argv[]);
 
 int cmd_fs_usage(int argc, char *argv[]);
+int cmd_fs_top(int argc, char *argv[]);
 
 int device_usage(void);
 int cmd_device_add(int argc, char *argv[]);
@@ -29,6 +30,7 @@ int cmd_device_resize_journal(int argc, char *argv[]);
 int data_usage(void);
 int cmd_data_rereplicate(int argc, char *argv[]);
 int cmd_data_job(int argc, char *argv[]);
+int cmd_data_defrag(int argc, char *argv[]);
 
 int cmd_unlock(int argc, char *argv[]);
 int cmd_set_passphrase(int argc, char *argv[]);
@@ -36,9 +38,14 @@ int cmd_remove_passphrase(int argc, char *argv[]);
 
 int cmd_fsck(int argc, char *argv[]);
 
+int zstd_dict_usage(void);
+int cmd_zstd_dict_train(int argc, char *argv[]);
+int cmd_zstd_dict_set(int argc, char *argv[]);
+
 int cmd_dump(int argc, char *argv[]);
 int cmd_list_journal(int argc, char *argv[]);
 int cmd_kill_btree_node(int argc, char *argv[]);
+int cmd_bench(int argc, char *argv[]);
 
 int cmd_migrate(int argc, char *argv[]);
 int cmd_migrate_superblock(int argc, char *argv[]);
@@ -51,6 +58,8 @@ int subvolume_usage(void);
 int cmd_subvolume_create(int argc, char *argv[]);
 int cmd_subvolume_delete(int argc, char *argv[]);
 int cmd_subvolume_snapshot(int argc, char *argv[]);
+int cmd_subvolume_send(int argc, char *argv[]);
+int cmd_subvolume_receive(int argc, char *argv[]);
 
 int cmd_fusemount(int argc, char *argv[]);
 
@@ -59,5 +68,6 @@ int device_cmds(int argc, char *argv[]);
 int fs_cmds(int argc, char *argv[]);
 int data_cmds(int argc, char *argv[]);
 int subvolume_cmds(int argc, char *argv[]);
+int zstd_dict_cmds(int argc, char *argv[]);
 
 #endif /* _CMDS_H */
@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -31,6 +32,12 @@
 
 #define NSEC_PER_SEC	1000000000L
 
+struct format_dev {
+	struct dev_opts		*dev;
+	struct bch_sb		*sb;
+	pthread_t		thread;
+};
+
 static void init_layout(struct bch_sb_layout *l,
 			unsigned block_size,
 			unsigned sb_size,
@@ -144,6 +151,31 @@ static unsigned parse_target(struct bch_sb_handle *sb,
 	return 0;
 }
 
+static void *format_one_device(void *arg)
+{
+	struct format_dev *d = arg;
+	struct dev_opts *i = d->dev;
+
+	if (i->sb_offset == BCH_SB_SECTOR) {
+		/* Zero start of disk */
+		static const char zeroes[BCH_SB_SECTOR << 9];
+
+		/*
+		 * Only when we own the whole device - the migrate tool formats
+		 * over an existing filesystem:
+		 */
+		if (i->discard)
+			blkdev_issue_discard(i->bdev, 0, i->size >> 9, GFP_KERNEL);
+
+		xpwrite(i->bdev->bd_fd, zeroes, BCH_SB_SECTOR << 9, 0,
+			"zeroing start of disk");
+	}
+
+	bch2_super_write(i->bdev->bd_fd, d->sb);
+	close(i->bdev->bd_fd);
+	return NULL;
+}
+
 struct bch_sb *bch2_format(struct bch_opt_strs	fs_opt_strs,
 			   struct bch_opts	fs_opts,
 			   struct format_opts	opts,
@@ -166,6 +198,11 @@ struct bch_sb *bch2_format(struct bch_opt_strs	fs_opt_strs,
 		die("blocksize too small: %u, must be greater than device blocksize %u",
 		    fs_opts.block_size, max_dev_block_size);
 
+	for (i = devs; i < devs + nr_devs; i++)
+		if (bdev_is_zoned(i->bdev))
+			die("cannot format %s: zoned block devices (zone size %u sectors) are not supported",
+			    i->path, bdev_zone_sectors(i->bdev));
+
 	/* get device size, if it wasn't specified: */
 	for (i = devs; i < devs + nr_devs; i++)
 		if (!i->size)
@@ -284,6 +321,8 @@ struct bch_sb *bch2_format(struct bch_opt_strs	fs_opt_strs,
 		parse_target(&sb, devs, nr_devs, fs_opt_strs.promote_target));
 	SET_BCH_SB_METADATA_TARGET(sb.sb,
 		parse_target(&sb, devs, nr_devs, fs_opt_strs.metadata_target));
+	SET_BCH_SB_JOURNAL_TARGET(sb.sb,
+		parse_target(&sb, devs, nr_devs, fs_opt_strs.journal_target));
 
 	/* Crypt: */
 	if (opts.encrypted) {
@@ -296,7 +335,11 @@ struct bch_sb *bch2_format(struct bch_opt_strs	fs_opt_strs,
 
 	bch2_sb_members_cpy_v2_v1(&sb);
 
+	struct format_dev *fdevs = xcalloc(nr_devs, sizeof(*fdevs));
+	size_t sb_bytes = round_up(sb.buffer_size, 4096);
+
 	for (i = devs; i < devs + nr_devs; i++) {
+		struct format_dev *d = fdevs + (i - devs);
 		u64 size_sectors = i->size >> 9;
 
 		sb.sb->dev_idx = i - devs;
@@ -325,17 +368,27 @@ struct bch_sb *bch2_format(struct bch_opt_strs	fs_opt_strs,
 			l->sb_offset[l->nr_superblocks++] = cpu_to_le64(backup_sb);
 		}
 
-		if (i->sb_offset == BCH_SB_SECTOR) {
-			/* Zero start of disk */
-			static const char zeroes[BCH_SB_SECTOR << 9];
-
-			xpwrite(i->bdev->bd_fd, zeroes, BCH_SB_SECTOR << 9, 0,
-				"zeroing start of disk");
-		}
+		d->dev	= i;
+		d->sb	= aligned_alloc(4096, sb_bytes);
+		if (!d->sb)
+			die("allocation failure");
+		memset(d->sb, 0, sb_bytes);
+		memcpy(d->sb, sb.sb, sb.buffer_size);
+	}
 
-		bch2_super_write(i->bdev->bd_fd, sb.sb);
-		close(i->bdev->bd_fd);
+	/*
+	 * The rest is per device IO - discards in particular can take a long time
+	 * on big devices, so do them all at once:
+	 */
+	for (struct format_dev *d = fdevs; d < fdevs + nr_devs; d++)
+		if (pthread_create(&d->thread, NULL, format_one_device, d))
+			die("error creating thread");
+
+	for (struct format_dev *d = fdevs; d < fdevs + nr_devs; d++) {
+		pthread_join(d->thread, NULL);
+		free(d->sb);
 	}
+	free(fdevs);
 
 	return sb.sb;
 }
@@ -510,12 +563,44 @@ int bchu_dev_path_to_idx(struct bchfs_handle fs, const char *dev_path)
 	return idx;
 }
 
+static u64 monotonic_secs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/* Throughput and ETA, from the progress made since we started watching: */
+static void data_job_rate_to_text(struct printbuf *out,
+				  struct bch_ioctl_data_event *e,
+				  u64 start_time, u64 start_sectors)
+{
+	u64 elapsed = monotonic_secs() - start_time;
+	u64 done = e->p.sectors_done - min(e->p.sectors_done, start_sectors);
+
+	if (!elapsed || !done)
+		return;
+
+	u64 rate = done / elapsed;
+	u64 remaining = e->p.sectors_total - min(e->p.sectors_total, e->p.sectors_done);
+	u64 eta = remaining / rate;
+
+	prt_str(out, ", ");
+	prt_human_readable_u64(out, rate << 9);
+	prt_printf(out, "/sec, eta %llu:%02llu:%02llu",
+		   eta / 3600, (eta / 60) % 60, eta % 60);
+}
+
 int bchu_data(struct bchfs_handle fs, struct bch_ioctl_data cmd)
 {
 	int progress_fd = xioctl(fs.ioctl_fd, BCH_IOCTL_DATA, &cmd);
+	u64 start_time = monotonic_secs();
+	s64 start_sectors = -1;
 
 	while (1) {
 		struct bch_ioctl_data_event e;
+		struct printbuf buf = PRINTBUF;
 
 		if (read(progress_fd, &e, sizeof(e)) != sizeof(e))
 			die("error reading from progress fd %m");
@@ -526,6 +611,10 @@ int bchu_data(struct bchfs_handle fs, struct bch_ioctl_data cmd)
 		if (e.p.data_type == U8_MAX)
 			break;
 
+		/* A resumed job starts with sectors already done: */
+		if (start_sectors < 0)
+			start_sectors = e.p.sectors_done;
+
 		printf("\33[2K\r");
 
 		printf("%llu%% complete: current position %s",
@@ -543,6 +632,10 @@ int bchu_data(struct bchfs_handle fs, struct bch_ioctl_data cmd)
 			       e.p.pos.offset);
 		}
 
+		data_job_rate_to_text(&buf, &e, start_time, start_sectors);
+		printf("%s", buf.buf);
+		printbuf_exit(&buf);
+
 		fflush(stdout);
 		sleep(1);
 	}
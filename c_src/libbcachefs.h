@@ -171,11 +171,72 @@ static inline struct bch_ioctl_fs_usage *bchu_fs_usage(struct bchfs_handle fs)
 	}
 }
 
+/*
+ * Reads all accounting keys matching a filter, a page at a time, in the same
+ * format as BCH_IOCTL_QUERY_ACCOUNTING; returns NULL if the kernel doesn't
+ * support BCH_IOCTL_QUERY_ACCOUNTING_V2:
+ */
+static inline struct bch_ioctl_query_accounting *
+bchu_fs_accounting_filtered(struct bchfs_handle fs, unsigned typemask,
+			    unsigned flags, unsigned dev,
+			    u32 snapshot_start, u32 snapshot_end)
+{
+	unsigned page_u64s = 4096;
+	struct bch_ioctl_query_accounting_v2 *q = NULL;
+	struct bch_ioctl_query_accounting *ret = xcalloc(1, sizeof(*ret));
+	struct bpos pos = POS_MIN;
+
+	while (!bpos_eq(pos, SPOS_MAX)) {
+		q = xrealloc(q, sizeof(*q) + page_u64s * sizeof(u64));
+		memset(q, 0, sizeof(*q));
+
+		q->accounting_u64s	= page_u64s;
+		q->accounting_types_mask = typemask;
+		q->flags		= flags;
+		q->dev			= dev;
+		q->snapshot_start	= snapshot_start;
+		q->snapshot_end		= snapshot_end;
+		q->pos			= pos;
+
+		if (ioctl(fs.ioctl_fd, BCH_IOCTL_QUERY_ACCOUNTING_V2, q)) {
+			if (errno == ENOTTY) {
+				free(q);
+				free(ret);
+				return NULL;
+			}
+			if (errno == ERANGE) {
+				page_u64s *= 2;
+				continue;
+			}
+			die("BCH_IOCTL_QUERY_ACCOUNTING_V2 error: %m");
+		}
+
+		ret = xrealloc(ret, sizeof(*ret) +
+			       (ret->accounting_u64s + q->accounting_u64s) * sizeof(u64));
+		memcpy((u64 *) ret->accounting + ret->accounting_u64s,
+		       q->accounting, q->accounting_u64s * sizeof(u64));
+
+		ret->capacity		= q->capacity;
+		ret->used		= q->used;
+		ret->online_reserved	= q->online_reserved;
+		ret->accounting_u64s	+= q->accounting_u64s;
+		ret->accounting_types_mask = typemask;
+		pos = q->pos;
+	}
+
+	free(q);
+	return ret;
+}
+
 static inline struct bch_ioctl_query_accounting *bchu_fs_accounting(struct bchfs_handle fs,
 								    unsigned typemask)
 {
 	unsigned accounting_u64s = 128;
-	struct bch_ioctl_query_accounting *ret = NULL;
+	struct bch_ioctl_query_accounting *ret =
+		bchu_fs_accounting_filtered(fs, typemask, 0, 0, 0, U32_MAX);
+
+	if (ret)
+		return ret;
 
 	while (1) {
 		ret = xrealloc(ret, sizeof(*ret) + accounting_u64s * sizeof(u64));
@@ -200,6 +261,58 @@ static inline struct bch_ioctl_query_accounting *bchu_fs_accounting(struct bchfs
 	}
 }
 
+static inline struct bch_ioctl_query_stats *bchu_fs_stats(struct bchfs_handle fs,
+							  unsigned flags)
+{
+	struct bch_ioctl_query_stats *ret = xcalloc(sizeof(*ret), 1);
+
+	while (1) {
+		unsigned nr_counters	= ret->nr_counters;
+		unsigned nr_time_stats	= ret->nr_time_stats;
+		unsigned nr_devs	= ret->nr_devs;
+
+		ret = xrealloc(ret, sizeof(*ret) +
+			       nr_counters * sizeof(u64) +
+			       nr_time_stats * sizeof(struct bch_ioctl_time_stat) +
+			       nr_devs * sizeof(struct bch_ioctl_dev_io));
+		memset(ret, 0, sizeof(*ret));
+
+		ret->flags		= flags;
+		ret->nr_counters	= nr_counters;
+		ret->nr_time_stats	= nr_time_stats;
+		ret->nr_devs		= nr_devs;
+
+		if (!ioctl(fs.ioctl_fd, BCH_IOCTL_QUERY_STATS, ret))
+			return ret;
+
+		if (errno == ENOTTY) {
+			free(ret);
+			return NULL;
+		}
+
+		/* kernel filled in the sizes required: */
+		if (errno == ERANGE)
+			continue;
+
+		die("BCH_IOCTL_QUERY_STATS error: %m");
+	}
+}
+
+static inline u64 *bchu_stats_counters(struct bch_ioctl_query_stats *s)
+{
+	return s->d;
+}
+
+static inline struct bch_ioctl_time_stat *bchu_stats_time_stats(struct bch_ioctl_query_stats *s)
+{
+	return (void *) (s->d + s->nr_counters);
+}
+
+static inline struct bch_ioctl_dev_io *bchu_stats_devs(struct bch_ioctl_query_stats *s)
+{
+	return (void *) (bchu_stats_time_stats(s) + s->nr_time_stats);
+}
+
 static inline struct bch_ioctl_dev_usage_v2 *bchu_dev_usage(struct bchfs_handle fs,
 							    unsigned idx)
 {
@@ -1,5 +1,6 @@
 #include <dirent.h>
 #include <sys/xattr.h>
+#include <linux/sort.h>
 #include <linux/xattr.h>
 
 #include "posix_to_bcachefs.h"
@@ -10,18 +11,125 @@
 #include "libbcachefs/str_hash.h"
 #include "libbcachefs/xattr.h"
 
+/*
+ * Bulk insert: keys that nothing reads back until we're done (final inode
+ * updates, and the extents migrate points at the old filesystem's data) are
+ * buffered per btree, sorted, and inserted BULK_INSERT_KEYS at a time in a
+ * single transaction - instead of paying for a transaction commit and journal
+ * reservation per key. Since they're sorted, consecutive keys land in the same
+ * leaf and the btree fills in order.
+ *
+ * Anything that might read a buffered key must call bulk_insert_flush_all()
+ * first.
+ */
+#define BULK_INSERT_KEYS	128
+#define BULK_INSERT_U64s	(BULK_INSERT_KEYS * BKEY_EXTENT_U64s_MAX)
+
+static struct bulk_insert bulk_inodes	= { .btree = BTREE_ID_inodes, .flags = BTREE_ITER_cached };
+static struct bulk_insert bulk_extents	= { .btree = BTREE_ID_extents };
+
+static int bulk_insert_key_cmp(const void *_l, const void *_r)
+{
+	const struct bkey_i *l = *((const struct bkey_i **) _l);
+	const struct bkey_i *r = *((const struct bkey_i **) _r);
+
+	/* Later updates to the same key must win: */
+	return bpos_cmp(l->k.p, r->k.p) ?: cmp_int(l, r);
+}
+
+static int bulk_insert_trans(struct btree_trans *trans, struct bulk_insert *b,
+			     struct bkey_i **keys, unsigned nr)
+{
+	for (unsigned i = 0; i < nr; i++) {
+		int ret = bch2_btree_insert_trans(trans, b->btree, keys[i], b->flags);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+void bulk_insert_flush(struct bch_fs *c, struct bulk_insert *b)
+{
+	DARRAY(struct bkey_i *) keys = {};
+
+	if (!b->nr)
+		return;
+
+	if (darray_make_room(&keys, b->nr))
+		die("error allocating memory");
+
+	for (struct bkey_i *k = (void *) b->keys.data;
+	     k != (void *) (b->keys.data + b->keys.nr);
+	     k = bkey_next(k))
+		keys.data[keys.nr++] = k;
+
+	sort(keys.data, keys.nr, sizeof(keys.data[0]), bulk_insert_key_cmp, NULL);
+
+	for (unsigned i = 0; i < keys.nr; i += BULK_INSERT_KEYS) {
+		unsigned nr = min_t(unsigned, keys.nr - i, BULK_INSERT_KEYS);
+		struct disk_reservation res = {};
+		u64 sectors = 0;
+		int ret;
+
+		if (b->btree == BTREE_ID_extents)
+			for (unsigned j = i; j < i + nr; j++)
+				sectors += keys.data[j]->k.size;
+
+		ret = bch2_disk_reservation_get(c, &res, sectors, 1,
+						BCH_DISK_RESERVATION_NOFAIL);
+		if (ret)
+			die("error reserving space in new filesystem: %s",
+			    bch2_err_str(ret));
+
+		ret = bch2_trans_do(c, &res, NULL, 0,
+			bulk_insert_trans(trans, b, keys.data + i, nr));
+		if (ret)
+			die("btree insert error %s", bch2_err_str(ret));
+
+		bch2_disk_reservation_put(c, &res);
+	}
+
+	darray_exit(&keys);
+	b->keys.nr	= 0;
+	b->nr		= 0;
+}
+
+static void bulk_insert_flush_all(struct bch_fs *c)
+{
+	bulk_insert_flush(c, &bulk_inodes);
+	bulk_insert_flush(c, &bulk_extents);
+}
+
+void bulk_insert_add(struct bch_fs *c, struct bulk_insert *b,
+		     const struct bkey_i *k)
+{
+	if (darray_make_room(&b->keys, k->k.u64s))
+		die("error allocating memory");
+
+	bkey_copy((void *) (b->keys.data + b->keys.nr), k);
+	b->keys.nr += k->k.u64s;
+
+	if (++b->nr >= BULK_INSERT_KEYS * 8 ||
+	    b->keys.nr >= BULK_INSERT_U64s * 8)
+		bulk_insert_flush(c, b);
+}
+
+static void bulk_insert_exit(struct bch_fs *c)
+{
+	bulk_insert_flush_all(c);
+	darray_exit(&bulk_inodes.keys);
+	darray_exit(&bulk_extents.keys);
+}
+
 void update_inode(struct bch_fs *c,
 			 struct bch_inode_unpacked *inode)
 {
 	struct bkey_inode_buf packed;
-	int ret;
 
 	bch2_inode_pack(&packed, inode);
 	packed.inode.k.p.snapshot = U32_MAX;
-	ret = bch2_btree_insert(c, BTREE_ID_inodes, &packed.inode.k_i,
-				NULL, 0, BTREE_ITER_cached);
-	if (ret)
-		die("error updating inode: %s", bch2_err_str(ret));
+	bulk_insert_add(c, &bulk_inodes, &packed.inode.k_i);
 }
 
 void create_link(struct bch_fs *c,
@@ -32,6 +140,9 @@ void create_link(struct bch_fs *c,
 	struct bch_inode_unpacked parent_u;
 	struct bch_inode_unpacked inode;
 
+	/* bch2_link_trans() updates the inode we're linking to: */
+	bulk_insert_flush_all(c);
+
 	int ret = bch2_trans_do(c, NULL, NULL, 0,
 		bch2_link_trans(trans,
 				(subvol_inum) { 1, parent->bi_inum }, &parent_u,
@@ -134,43 +245,91 @@ void copy_xattrs(struct bch_fs *c, struct bch_inode_unpacked *dst,
 	}
 }
 
-#define WRITE_DATA_BUF	(1 << 20)
+#define WRITE_DATA_BUF		(1 << 20)
+#define WRITE_DATA_INFLIGHT	8
+
+/*
+ * Data writes are asynchronous: we keep a ring of write buffers, and only wait
+ * for a write to complete when its buffer is reused - so that reading from the
+ * source filesystem overlaps with writes to the new filesystem.
+ *
+ * Completing a write updates the inode in the btree (i_sectors), so writes to
+ * an inode must be flushed before we update it ourselves from copy_dir().
+ */
+struct copy_data_write {
+	struct bch_write_op	op;
+	struct closure		cl;
+	struct bio_vec		bv[WRITE_DATA_BUF / PAGE_SIZE];
+	char			buf[WRITE_DATA_BUF] __aligned(PAGE_SIZE);
+};
+
+static struct copy_data_write writes[WRITE_DATA_INFLIGHT];
+static unsigned next_write;
+
+static void write_data_init(void)
+{
+	for (unsigned i = 0; i < ARRAY_SIZE(writes); i++)
+		closure_init(&writes[i].cl, NULL);
+}
 
-static char buf[WRITE_DATA_BUF] __aligned(PAGE_SIZE);
+static void write_data_wait(struct copy_data_write *w)
+{
+	closure_sync(&w->cl);
+
+	if (w->op.error)
+		die("write error: %s", bch2_err_str(w->op.error));
+}
+
+static void write_data_flush(void)
+{
+	for (unsigned i = 0; i < ARRAY_SIZE(writes); i++)
+		write_data_wait(&writes[i]);
+}
+
+static struct copy_data_write *write_data_get(void)
+{
+	struct copy_data_write *w = &writes[next_write++ % ARRAY_SIZE(writes)];
+
+	write_data_wait(w);
+	return w;
+}
+
+static void write_data_endio(struct bch_write_op *op)
+{
+	struct copy_data_write *w = container_of(op, struct copy_data_write, op);
+
+	closure_put(&w->cl);
+}
 
 static void write_data(struct bch_fs *c,
 		       struct bch_inode_unpacked *dst_inode,
-		       u64 dst_offset, void *buf, size_t len)
+		       u64 dst_offset, struct copy_data_write *w, size_t len)
 {
-	struct bch_write_op op;
-	struct bio_vec bv[WRITE_DATA_BUF / PAGE_SIZE];
+	struct bch_write_op *op = &w->op;
 
 	BUG_ON(dst_offset	& (block_bytes(c) - 1));
 	BUG_ON(len		& (block_bytes(c) - 1));
 	BUG_ON(len > WRITE_DATA_BUF);
 
-	bio_init(&op.wbio.bio, NULL, bv, ARRAY_SIZE(bv), 0);
-	bch2_bio_map(&op.wbio.bio, buf, len);
+	bio_init(&op->wbio.bio, NULL, w->bv, ARRAY_SIZE(w->bv), 0);
+	bch2_bio_map(&op->wbio.bio, w->buf, len);
 
-	bch2_write_op_init(&op, c, bch2_opts_to_inode_opts(c->opts));
-	op.write_point	= writepoint_hashed(0);
-	op.nr_replicas	= 1;
-	op.subvol	= 1;
-	op.pos		= SPOS(dst_inode->bi_inum, dst_offset >> 9, U32_MAX);
-	op.flags |= BCH_WRITE_SYNC;
+	bch2_write_op_init(op, c, bch2_opts_to_inode_opts(c->opts));
+	op->write_point	= writepoint_hashed(0);
+	op->nr_replicas	= 1;
+	op->subvol	= 1;
+	op->pos		= SPOS(dst_inode->bi_inum, dst_offset >> 9, U32_MAX);
+	op->end_io	= write_data_endio;
 
-	int ret = bch2_disk_reservation_get(c, &op.res, len >> 9,
+	int ret = bch2_disk_reservation_get(c, &op->res, len >> 9,
 					    c->opts.data_replicas, 0);
 	if (ret)
 		die("error reserving space in new filesystem: %s", bch2_err_str(ret));
 
-	closure_call(&op.cl, bch2_write, NULL, NULL);
+	closure_get(&w->cl);
+	closure_call(&op->cl, bch2_write, NULL, NULL);
 
-	BUG_ON(!(op.flags & BCH_WRITE_SUBMITTED));
 	dst_inode->bi_sectors += len >> 9;
-
-	if (op.error)
-		die("write error: %s", bch2_err_str(op.error));
 }
 
 void copy_data(struct bch_fs *c,
@@ -178,13 +337,14 @@ void copy_data(struct bch_fs *c,
 		      int src_fd, u64 start, u64 end)
 {
 	while (start < end) {
-		unsigned len = min_t(u64, end - start, sizeof(buf));
+		struct copy_data_write *w = write_data_get();
+		unsigned len = min_t(u64, end - start, sizeof(w->buf));
 		unsigned pad = round_up(len, block_bytes(c)) - len;
 
-		xpread(src_fd, buf, len, start);
-		memset(buf + len, 0, pad);
+		xpread(src_fd, w->buf, len, start);
+		memset(w->buf + len, 0, pad);
 
-		write_data(c, dst_inode, start, buf, len + pad);
+		write_data(c, dst_inode, start, w, len + pad);
 		start += len;
 	}
 }
@@ -208,9 +368,7 @@ static void link_data(struct bch_fs *c, struct bch_inode_unpacked *dst,
 		struct bkey_i_extent *e;
 		BKEY_PADDED_ONSTACK(k, BKEY_EXTENT_VAL_U64s_MAX) k;
 		u64 b = sector_to_bucket(ca, physical);
-		struct disk_reservation res;
 		unsigned sectors;
-		int ret;
 
 		sectors = min(ca->mi.bucket_size -
 			      (physical & (ca->mi.bucket_size - 1)),
@@ -227,17 +385,7 @@ static void link_data(struct bch_fs *c, struct bch_inode_unpacked *dst,
 					.gen = *bucket_gen(ca, b),
 				  });
 
-		ret = bch2_disk_reservation_get(c, &res, sectors, 1,
-						BCH_DISK_RESERVATION_NOFAIL);
-		if (ret)
-			die("error reserving space in new filesystem: %s",
-			    bch2_err_str(ret));
-
-		ret = bch2_btree_insert(c, BTREE_ID_extents, &e->k_i, &res, 0, 0);
-		if (ret)
-			die("btree insert error %s", bch2_err_str(ret));
-
-		bch2_disk_reservation_put(c, &res);
+		bulk_insert_add(c, &bulk_extents, &e->k_i);
 
 		dst->bi_sectors	+= sectors;
 		logical		+= sectors;
@@ -249,15 +397,16 @@ static void link_data(struct bch_fs *c, struct bch_inode_unpacked *dst,
 void copy_link(struct bch_fs *c, struct bch_inode_unpacked *dst,
 		      char *src)
 {
+	struct copy_data_write *w = write_data_get();
 	ssize_t i;
-	ssize_t ret = readlink(src, buf, sizeof(buf));
+	ssize_t ret = readlink(src, w->buf, sizeof(w->buf));
 	if (ret < 0)
 		die("readlink error: %m");
 
 	for (i = ret; i < round_up(ret, block_bytes(c)); i++)
-		buf[i] = 0;
+		w->buf[i] = 0;
 
-	write_data(c, dst, 0, buf, round_up(ret, block_bytes(c)));
+	write_data(c, dst, 0, w, round_up(ret, block_bytes(c)));
 }
 
 static void copy_file(struct bch_fs *c, struct bch_inode_unpacked *dst,
@@ -395,6 +544,7 @@ static void copy_dir(struct copy_fs_state *s,
 		}
 
 		copy_times(c, &inode, &stat);
+		write_data_flush();
 		update_inode(c, &inode);
 next:
 		free(child_path);
@@ -440,6 +590,8 @@ void copy_fs(struct bch_fs *c, int src_fd, const char *src_path,
 	if (fchdir(src_fd))
 		die("chdir error: %m");
 
+	write_data_init();
+
 	struct stat stat = xfstat(src_fd);
 	copy_times(c, &root_inode, &stat);
 	copy_xattrs(c, &root_inode, ".");
@@ -452,6 +604,7 @@ void copy_fs(struct bch_fs *c, int src_fd, const char *src_path,
 		reserve_old_fs_space(c, &root_inode, &s->extents);
 
 	update_inode(c, &root_inode);
+	bulk_insert_exit(c);
 
 	if (BCH_MIGRATE_migrate == s->type)
 		darray_exit(&s->extents);
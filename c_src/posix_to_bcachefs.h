@@ -51,4 +51,19 @@ struct copy_fs_state {
  */
 void copy_fs(struct bch_fs *c, int src_fd, const char *src_path,
 		    struct copy_fs_state *s);
+
+/*
+ * Bulk insert: keys added are buffered, then sorted and inserted in batches;
+ * nothing may read them back until bulk_insert_flush(). Also used by
+ * subvolume receive:
+ */
+struct bulk_insert {
+	enum btree_id		btree;
+	enum btree_iter_update_trigger_flags flags;
+	unsigned		nr;
+	DARRAY(u64)		keys;
+};
+
+void bulk_insert_flush(struct bch_fs *, struct bulk_insert *);
+void bulk_insert_add(struct bch_fs *, struct bulk_insert *, const struct bkey_i *);
 #endif /* _LIBBCACHE_H */
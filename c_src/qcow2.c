@@ -1,7 +1,10 @@
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "qcow2.h"
 #include "tools-util.h"
@@ -9,6 +12,11 @@
 #define QCOW_MAGIC		(('Q' << 24) | ('F' << 16) | ('I' << 8) | 0xfb)
 #define QCOW_VERSION		2
 #define QCOW_OFLAG_COPIED	(1LL << 63)
+#define QCOW_OFLAG_COMPRESSED	(1LL << 62)
+#define QCOW_OFFSET_MASK	0x00fffffffffffe00ULL
+
+/* Largest single read from the source device: */
+#define QCOW2_IO_BYTES		(1U << 20)
 
 struct qcow2_hdr {
 	u32			magic;
@@ -37,13 +45,20 @@ struct qcow2_image {
 	u64			*l1_table;
 	u64			l1_offset;
 	u32			l1_index;
+	bool			l2_dirty;
 	u64			*l2_table;
 	u64			offset;
+
+	bool			compress;
+	z_stream		z;
+	char			*out;
 };
 
 static void flush_l2(struct qcow2_image *img)
 {
-	if (img->l1_index != -1) {
+	if (img->l1_index != -1 && img->l2_dirty) {
+		/* compressed clusters are byte aligned; tables must not be: */
+		img->offset = round_up(img->offset, img->block_size);
 		img->l1_table[img->l1_index] =
 			cpu_to_be64(img->offset|QCOW_OFLAG_COPIED);
 		xpwrite(img->fd, img->l2_table, img->block_size, img->offset,
@@ -51,30 +66,107 @@ static void flush_l2(struct qcow2_image *img)
 		img->offset += img->block_size;
 
 		memset(img->l2_table, 0, img->block_size);
-		img->l1_index = -1;
 	}
+	img->l1_index = -1;
+	img->l2_dirty = false;
 }
 
-static void add_l2(struct qcow2_image *img, u64 src_blk, u64 dst_offset)
+static void set_l1(struct qcow2_image *img, u64 src_blk)
 {
 	unsigned l2_size = img->block_size / sizeof(u64);
 	u64 l1_index = src_blk / l2_size;
-	u64 l2_index = src_blk & (l2_size - 1);
 
 	if (img->l1_index != l1_index) {
 		flush_l2(img);
 		img->l1_index = l1_index;
 	}
+}
+
+static void add_l2(struct qcow2_image *img, u64 src_blk, u64 entry)
+{
+	unsigned l2_size = img->block_size / sizeof(u64);
+
+	BUG_ON(src_blk / l2_size != img->l1_index);
+
+	img->l2_table[src_blk & (l2_size - 1)] = cpu_to_be64(entry);
+	img->l2_dirty = true;
+}
+
+/* Returns compressed size, or 0 if the block doesn't compress: */
+static size_t compress_block(struct qcow2_image *img, const void *src, void *dst)
+{
+	deflateReset(&img->z);
+	img->z.next_in		= (void *) src;
+	img->z.avail_in		= img->block_size;
+	img->z.next_out		= dst;
+	img->z.avail_out	= img->block_size - 1;
+
+	if (deflate(&img->z, Z_FINISH) != Z_STREAM_END)
+		return 0;
+
+	return img->block_size - 1 - img->z.avail_out;
+}
+
+static u64 compressed_l2_entry(struct qcow2_image *img, u64 offset, size_t bytes)
+{
+	unsigned csize_shift = 62 - (ilog2(img->block_size) - 8);
+	u64 nr_sectors = ((offset + bytes - 1) >> 9) - (offset >> 9);
+
+	return QCOW_OFLAG_COMPRESSED | offset | (nr_sectors << csize_shift);
+}
+
+/*
+ * Write one chunk read from the source, which doesn't cross an L2 table:
+ * zeroed blocks are left unallocated, and everything else goes out in a
+ * single write.
+ */
+static void write_chunk(struct qcow2_image *img, const char *buf,
+			u64 src_offset, size_t len)
+{
+	u64 blk = src_offset / img->block_size;
+	size_t out = 0;
+
+	set_l1(img, blk);
+
+	for (size_t i = 0; i < len; i += img->block_size, blk++) {
+		const char *b = buf + i;
+
+		if (!memchr_inv(b, 0, img->block_size))
+			continue;
+
+		if (img->compress) {
+			size_t bytes = compress_block(img, b, img->out + out);
+
+			if (bytes) {
+				add_l2(img, blk, compressed_l2_entry(img, img->offset + out, bytes));
+				out += bytes;
+				continue;
+			}
+		}
+
+		size_t aligned = round_up(img->offset + out, img->block_size) - img->offset;
+		memset(img->out + out, 0, aligned - out);
+		out = aligned;
+
+		memcpy(img->out + out, b, img->block_size);
+		add_l2(img, blk, (img->offset + out)|QCOW_OFLAG_COPIED);
+		out += img->block_size;
+	}
 
-	img->l2_table[l2_index] = cpu_to_be64(dst_offset|QCOW_OFLAG_COPIED);
+	if (out)
+		xpwrite(img->fd, img->out, out, img->offset, "qcow2 data");
+	img->offset += out;
 }
 
 void qcow2_write_image(int infd, int outfd, ranges *data,
-		       unsigned block_size)
+		       unsigned block_size, bool compress,
+		       const char *backing)
 {
 	u64 image_size = get_size(infd);
 	unsigned l2_size = block_size / sizeof(u64);
 	unsigned l1_size = DIV_ROUND_UP(image_size, (u64) block_size * l2_size);
+	u64 l2_bytes = (u64) block_size * l2_size;
+	unsigned io_bytes = max(QCOW2_IO_BYTES, block_size);
 	struct qcow2_hdr hdr = { 0 };
 	struct qcow2_image img = {
 		.fd		= outfd,
@@ -83,31 +175,46 @@ void qcow2_write_image(int infd, int outfd, ranges *data,
 		.l1_table	= xcalloc(l1_size, sizeof(u64)),
 		.l1_index	= -1,
 		.offset		= round_up(sizeof(hdr), block_size),
+		.compress	= compress,
+		/* worst case, every raw block is preceded by alignment padding: */
+		.out		= xmalloc(io_bytes * 2),
 	};
-	char *buf = xmalloc(block_size);
+	char *buf = xmalloc(io_bytes);
 	u64 src_offset, dst_offset;
 
 	assert(is_power_of_2(block_size));
 
+	if (compress &&
+	    deflateInit2(&img.z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+			 -12, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		die("deflateInit2 error");
+
 	ranges_roundup(data, block_size);
 	ranges_sort_merge(data);
 
 	/* Write data: */
 	darray_for_each(*data, r)
-		for (src_offset = r->start;
-		     src_offset < r->end;
-		     src_offset += block_size) {
-			dst_offset = img.offset;
-			img.offset += img.block_size;
+		for (src_offset = r->start; src_offset < r->end;) {
+			size_t len = min3(r->end - src_offset, (u64) io_bytes,
+					  round_down(src_offset, l2_bytes) + l2_bytes - src_offset);
 
-			xpread(infd, buf, block_size, src_offset);
-			xpwrite(outfd, buf, block_size, dst_offset,
-				"qcow2 data");
+			/* start reading the next chunk while we write this one: */
+			if (src_offset + len < r->end)
+				posix_fadvise(infd, src_offset + len,
+					      min(r->end - src_offset - len, (u64) io_bytes),
+					      POSIX_FADV_WILLNEED);
+			else if (r + 1 < &darray_top(*data))
+				posix_fadvise(infd, r[1].start,
+					      min(r[1].end - r[1].start, (u64) io_bytes),
+					      POSIX_FADV_WILLNEED);
 
-			add_l2(&img, src_offset / block_size, dst_offset);
+			xpread(infd, buf, len, src_offset);
+			write_chunk(&img, buf, src_offset, len);
+			src_offset += len;
 		}
 
 	flush_l2(&img);
+	img.offset = round_up(img.offset, block_size);
 
 	/* Write L1 table: */
 	dst_offset		= img.offset;
@@ -124,11 +231,333 @@ void qcow2_write_image(int infd, int outfd, ranges *data,
 	hdr.l1_table_offset	= cpu_to_be64(dst_offset);
 
 	memset(buf, 0, block_size);
+
+	if (backing) {
+		size_t len = strlen(backing);
+
+		if (sizeof(hdr) + len > block_size)
+			die("backing file name too long");
+
+		hdr.backing_file_offset	= cpu_to_be64(sizeof(hdr));
+		hdr.backing_file_size	= cpu_to_be32(len);
+		memcpy(buf + sizeof(hdr), backing, len);
+	}
+
 	memcpy(buf, &hdr, sizeof(hdr));
 	xpwrite(img.fd, buf, block_size, 0,
 		"qcow2 header");
 
+	if (compress)
+		deflateEnd(&img.z);
+	free(img.out);
 	free(img.l2_table);
 	free(img.l1_table);
 	free(buf);
 }
+
+/*
+ * Read-write access to qcow2 images, so that they can be used in place of a
+ * block device (see linux/blkdev.c): unallocated clusters read from the
+ * backing file, if the image has one, and writes allocate new clusters at the
+ * end of the image - the backing file is never written to.
+ *
+ * Refcounts aren't maintained, as they aren't by qcow2_write_image(); the
+ * image is usable by us and by qemu, but qemu-img check will complain.
+ */
+struct qcow2_file {
+	pthread_mutex_t		lock;
+	int			fd;
+	int			backing_fd;
+	u32			block_size;
+	u64			size;
+	u32			l1_size;
+	u64			l1_offset;
+	/* big endian, as on disk: */
+	u64			*l1_table;
+	/* where the next cluster will be allocated: */
+	u64			end;
+	void			*buf;
+};
+
+bool qcow2_probe(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	__be32 magic = 0;
+
+	if (fd < 0)
+		return false;
+
+	bool ret = pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) &&
+		be32_to_cpu(magic) == QCOW_MAGIC;
+	close(fd);
+	return ret;
+}
+
+static int qcow2_pread_full(int fd, void *buf, size_t len, u64 offset)
+{
+	ssize_t ret = pread(fd, buf, len, offset);
+
+	if (ret < 0)
+		return -errno;
+	/* reads past the end of the file return zeroes: */
+	memset(buf + ret, 0, len - ret);
+	return 0;
+}
+
+static int qcow2_pwrite_full(int fd, const void *buf, size_t len, u64 offset)
+{
+	ssize_t ret = pwrite(fd, buf, len, offset);
+
+	if (ret < 0)
+		return -errno;
+	return ret == len ? 0 : -EIO;
+}
+
+struct qcow2_file *qcow2_open(int fd)
+{
+	struct qcow2_hdr hdr;
+	int ret = qcow2_pread_full(fd, &hdr, sizeof(hdr), 0);
+	if (ret)
+		return ERR_PTR(ret);
+
+	if (be32_to_cpu(hdr.magic) != QCOW_MAGIC ||
+	    be32_to_cpu(hdr.version) != QCOW_VERSION ||
+	    hdr.crypt_method ||
+	    be32_to_cpu(hdr.block_bits) < 9 ||
+	    be32_to_cpu(hdr.block_bits) > 21)
+		return ERR_PTR(-EINVAL);
+
+	struct qcow2_file *q = xcalloc(1, sizeof(*q));
+
+	pthread_mutex_init(&q->lock, NULL);
+	q->fd		= fd;
+	q->backing_fd	= -1;
+	q->block_size	= 1U << be32_to_cpu(hdr.block_bits);
+	q->size		= be64_to_cpu(hdr.size);
+	q->l1_size	= be32_to_cpu(hdr.l1_size);
+	q->l1_offset	= be64_to_cpu(hdr.l1_table_offset);
+	q->l1_table	= xcalloc(max(q->l1_size, 1U), sizeof(u64));
+	q->end		= round_up(xfstat(fd).st_size, q->block_size);
+	q->buf		= xmalloc(q->block_size);
+
+	ret = qcow2_pread_full(fd, q->l1_table, q->l1_size * sizeof(u64), q->l1_offset);
+	if (ret)
+		goto err;
+
+	u32 backing_len = be32_to_cpu(hdr.backing_file_size);
+	if (backing_len) {
+		char *backing = xcalloc(backing_len + 1, 1);
+
+		ret = qcow2_pread_full(fd, backing, backing_len,
+				       be64_to_cpu(hdr.backing_file_offset));
+		if (!ret) {
+			q->backing_fd = open(backing, O_RDONLY);
+			if (q->backing_fd < 0) {
+				ret = -errno;
+				fprintf(stderr, "error opening qcow2 backing file %s: %m\n", backing);
+			}
+		}
+		free(backing);
+		if (ret)
+			goto err;
+	}
+
+	return q;
+err:
+	qcow2_close(q);
+	return ERR_PTR(ret);
+}
+
+void qcow2_close(struct qcow2_file *q)
+{
+	if (q->backing_fd >= 0)
+		close(q->backing_fd);
+	pthread_mutex_destroy(&q->lock);
+	free(q->buf);
+	free(q->l1_table);
+	free(q);
+}
+
+u64 qcow2_size(struct qcow2_file *q)
+{
+	return q->size;
+}
+
+static int qcow2_alloc_cluster(struct qcow2_file *q, u64 *offset)
+{
+	*offset = q->end;
+	q->end += q->block_size;
+	return 0;
+}
+
+/* Returns the position in the image of the L2 entry for @blk, or 0: */
+static int qcow2_l2_entry_pos(struct qcow2_file *q, u64 blk, bool alloc, u64 *pos)
+{
+	unsigned l2_size = q->block_size / sizeof(u64);
+	u64 l1_index = blk / l2_size;
+	int ret;
+
+	*pos = 0;
+	if (l1_index >= q->l1_size)
+		return alloc ? -ERANGE : 0;
+
+	u64 l2 = be64_to_cpu(q->l1_table[l1_index]) & QCOW_OFFSET_MASK;
+	if (!l2) {
+		if (!alloc)
+			return 0;
+
+		memset(q->buf, 0, q->block_size);
+		ret =   qcow2_alloc_cluster(q, &l2) ?:
+			qcow2_pwrite_full(q->fd, q->buf, q->block_size, l2);
+		if (ret)
+			return ret;
+
+		q->l1_table[l1_index] = cpu_to_be64(l2|QCOW_OFLAG_COPIED);
+		ret = qcow2_pwrite_full(q->fd, &q->l1_table[l1_index], sizeof(u64),
+					q->l1_offset + l1_index * sizeof(u64));
+		if (ret)
+			return ret;
+	}
+
+	*pos = l2 + (blk & (l2_size - 1)) * sizeof(u64);
+	return 0;
+}
+
+static int qcow2_l2_entry(struct qcow2_file *q, u64 blk, u64 *entry)
+{
+	u64 pos;
+	__be64 v = 0;
+	int ret = qcow2_l2_entry_pos(q, blk, false, &pos);
+
+	if (!ret && pos)
+		ret = qcow2_pread_full(q->fd, &v, sizeof(v), pos);
+	*entry = be64_to_cpu(v);
+	return ret;
+}
+
+static int qcow2_read_compressed(struct qcow2_file *q, u64 entry, void *buf)
+{
+	unsigned cluster_bits = ilog2(q->block_size);
+	unsigned csize_shift = 62 - (cluster_bits - 8);
+	u64 offset = entry & ((1ULL << csize_shift) - 1);
+	u64 nr_sectors = ((entry >> csize_shift) & ((1ULL << (cluster_bits - 8)) - 1)) + 1;
+	size_t bytes = nr_sectors * 512 - (offset & 511);
+	void *cbuf = xmalloc(bytes);
+	z_stream z = {
+		.next_in	= cbuf,
+		.avail_in	= bytes,
+		.next_out	= buf,
+		.avail_out	= q->block_size,
+	};
+	int ret = qcow2_pread_full(q->fd, cbuf, bytes, offset);
+
+	if (!ret) {
+		if (inflateInit2(&z, -12) != Z_OK)
+			die("inflateInit2 error");
+
+		int zret = inflate(&z, Z_FINISH);
+		if ((zret != Z_STREAM_END && zret != Z_BUF_ERROR) || z.avail_out)
+			ret = -EIO;
+		inflateEnd(&z);
+	}
+
+	free(cbuf);
+	return ret;
+}
+
+static int qcow2_read_cluster(struct qcow2_file *q, u64 blk, void *buf)
+{
+	u64 entry;
+	int ret = qcow2_l2_entry(q, blk, &entry);
+	if (ret)
+		return ret;
+
+	if (entry & QCOW_OFLAG_COMPRESSED)
+		return qcow2_read_compressed(q, entry, buf);
+
+	if (entry & QCOW_OFFSET_MASK)
+		return qcow2_pread_full(q->fd, buf, q->block_size, entry & QCOW_OFFSET_MASK);
+
+	if (q->backing_fd >= 0)
+		return qcow2_pread_full(q->backing_fd, buf, q->block_size,
+					blk * q->block_size);
+
+	memset(buf, 0, q->block_size);
+	return 0;
+}
+
+int qcow2_pread(struct qcow2_file *q, void *buf, size_t len, u64 offset)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&q->lock);
+	while (len && !ret) {
+		u64 blk = offset / q->block_size;
+		unsigned b_offset = offset & (q->block_size - 1);
+		size_t b_len = min_t(size_t, len, q->block_size - b_offset);
+
+		ret = qcow2_read_cluster(q, blk, q->buf);
+		memcpy(buf, q->buf + b_offset, b_len);
+
+		buf	+= b_len;
+		offset	+= b_len;
+		len	-= b_len;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return ret;
+}
+
+static int qcow2_write_cluster(struct qcow2_file *q, u64 blk, const void *buf,
+			       unsigned b_offset, size_t b_len)
+{
+	u64 entry, pos, dst;
+	int ret = qcow2_l2_entry(q, blk, &entry);
+	if (ret)
+		return ret;
+
+	/* already allocated, and not compressed: overwrite in place */
+	if (!(entry & QCOW_OFLAG_COMPRESSED) && (entry & QCOW_OFFSET_MASK))
+		return qcow2_pwrite_full(q->fd, buf, b_len,
+					 (entry & QCOW_OFFSET_MASK) + b_offset);
+
+	/* copy on write - allocating the L2 table uses q->buf, so do it first: */
+	ret = qcow2_l2_entry_pos(q, blk, true, &pos);
+	if (ret)
+		return ret;
+
+	if (b_len < q->block_size) {
+		ret = qcow2_read_cluster(q, blk, q->buf);
+		if (ret)
+			return ret;
+	}
+	memcpy(q->buf + b_offset, buf, b_len);
+
+	ret =   qcow2_alloc_cluster(q, &dst) ?:
+		qcow2_pwrite_full(q->fd, q->buf, q->block_size, dst);
+	if (ret)
+		return ret;
+
+	/* data first, then the mapping: */
+	__be64 v = cpu_to_be64(dst|QCOW_OFLAG_COPIED);
+	return qcow2_pwrite_full(q->fd, &v, sizeof(v), pos);
+}
+
+int qcow2_pwrite(struct qcow2_file *q, const void *buf, size_t len, u64 offset)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&q->lock);
+	while (len && !ret) {
+		u64 blk = offset / q->block_size;
+		unsigned b_offset = offset & (q->block_size - 1);
+		size_t b_len = min_t(size_t, len, q->block_size - b_offset);
+
+		ret = qcow2_write_cluster(q, blk, buf, b_offset, b_len);
+
+		buf	+= b_len;
+		offset	+= b_len;
+		len	-= b_len;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return ret;
+}
@@ -4,6 +4,15 @@
 #include <linux/types.h>
 #include "tools-util.h"
 
-void qcow2_write_image(int, int, ranges *, unsigned);
+void qcow2_write_image(int, int, ranges *, unsigned, bool, const char *);
+
+struct qcow2_file;
+
+bool qcow2_probe(const char *);
+struct qcow2_file *qcow2_open(int);
+void qcow2_close(struct qcow2_file *);
+u64 qcow2_size(struct qcow2_file *);
+int qcow2_pread(struct qcow2_file *, void *, size_t, u64);
+int qcow2_pwrite(struct qcow2_file *, const void *, size_t, u64);
 
 #endif /* _QCOW2_H */
@@ -413,6 +413,7 @@ static u32 crc32c_default(u32 crc, const void *buf, size_t size)
 #include <linux/compiler.h>
 
 #ifdef __x86_64__
+#include <immintrin.h>
 
 #ifdef CONFIG_X86_64
 #define REX_PRE "0x48, "
@@ -449,13 +450,108 @@ static u32 crc32c_sse42(u32 crc, const void *buf, size_t size)
 	return crc;
 }
 
+/*
+ * crc32 has a latency of 3 cycles but a throughput of one per cycle: so for
+ * big buffers, run three independent streams over adjacent lanes and combine
+ * them at the end, shifting the first two with a carryless multiply.
+ *
+ * Shifting a crc by n bytes (appending n zero bytes) is multiplying it by
+ * x^(8n) mod P: for a 32 bit crc s, crc32(0, clmul(s, x^(8n - 33) mod P)).
+ */
+#define CRC32C_LANE_LONG	4096
+#define CRC32C_LANE_SHORT	256
+
+/* x^(8n - 33) mod P, x^(16n - 33) mod P for n = lane size, bit reflected: */
+static const u32 crc32c_k_long[2]	= { 0x82f89c77, 0x54a86326 };
+static const u32 crc32c_k_short[2]	= { 0xb9e02b86, 0xdd7e3b0c };
+
+__attribute__((target("sse4.2,pclmul")))
+static inline u32 crc32c_3way(u32 crc, const u8 *p, size_t lane, const u32 *k)
+{
+	u64 a = crc, b = 0, c = 0;
+	size_t i;
+
+	for (i = 0; i < lane; i += 8) {
+		u64 va, vb, vc;
+
+		memcpy(&va, p + i, 8);
+		memcpy(&vb, p + i + lane, 8);
+		memcpy(&vc, p + i + lane * 2, 8);
+
+		a = _mm_crc32_u64(a, va);
+		b = _mm_crc32_u64(b, vb);
+		c = _mm_crc32_u64(c, vc);
+	}
+
+	__m128i t = _mm_xor_si128(
+		_mm_clmulepi64_si128(_mm_cvtsi32_si128(a), _mm_cvtsi32_si128(k[1]), 0),
+		_mm_clmulepi64_si128(_mm_cvtsi32_si128(b), _mm_cvtsi32_si128(k[0]), 0));
+
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(t)) ^ c;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static u32 crc32c_pclmul(u32 crc, const void *buf, size_t size)
+{
+	const u8 *p = buf;
+
+	while (size >= CRC32C_LANE_LONG * 3) {
+		crc = crc32c_3way(crc, p, CRC32C_LANE_LONG, crc32c_k_long);
+		p	+= CRC32C_LANE_LONG * 3;
+		size	-= CRC32C_LANE_LONG * 3;
+	}
+
+	while (size >= CRC32C_LANE_SHORT * 3) {
+		crc = crc32c_3way(crc, p, CRC32C_LANE_SHORT, crc32c_k_short);
+		p	+= CRC32C_LANE_SHORT * 3;
+		size	-= CRC32C_LANE_SHORT * 3;
+	}
+
+	return crc32c_sse42(crc, p, size);
+}
+
+#endif
+
+#ifdef __aarch64__
+#include <sys/auxv.h>
+
+static u32 crc32c_armv8(u32 crc, const void *buf, size_t size)
+{
+	const u8 *p = buf;
+
+	while (size >= 8) {
+		u64 v;
+
+		memcpy(&v, p, 8);
+		__asm__(".arch_extension crc\n\t"
+			"crc32cx %w0, %w0, %x1"
+			: "+r"(crc) : "r"(v));
+		p	+= 8;
+		size	-= 8;
+	}
+
+	while (size--)
+		__asm__(".arch_extension crc\n\t"
+			"crc32cb %w0, %w0, %w1"
+			: "+r"(crc) : "r"((u32) *p++));
+
+	return crc;
+}
+
 #endif
 
 static void *resolve_crc32c(void)
 {
 #ifdef __x86_64__
+	if (__builtin_cpu_supports("sse4.2") &&
+	    __builtin_cpu_supports("pclmul"))
+		return crc32c_pclmul;
 	if (__builtin_cpu_supports("sse4.2"))
 		return crc32c_sse42;
+#endif
+#ifdef __aarch64__
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+		return crc32c_armv8;
 #endif
 	return crc32c_default;
 }
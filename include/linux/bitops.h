@@ -74,6 +74,18 @@ static inline int __test_and_set_bit(int nr, unsigned long *addr)
 	return (old & mask) != 0;
 }
 
+static inline int __test_and_clear_bit(int nr, unsigned long *addr)
+{
+	unsigned long mask = BIT_MASK(nr);
+	unsigned long *p = ((unsigned long *)addr) + BIT_WORD(nr);
+	unsigned long old;
+
+	old = *p;
+	*p = old & ~mask;
+
+	return (old & mask) != 0;
+}
+
 static inline bool test_and_set_bit(long nr, volatile unsigned long *addr)
 {
 	unsigned long mask = BIT_MASK(nr);
@@ -30,6 +30,8 @@ typedef unsigned int __bitwise blk_mode_t;
 #define BLK_OPEN_WRITE_IOCTL	((__force blk_mode_t)(1 << 4))
 
 #define BLK_OPEN_BUFFERED	((__force blk_mode_t)(1 << 5))
+/* map read only devices into memory, see bdev_mmap_addr(): */
+#define BLK_OPEN_MMAP		((__force blk_mode_t)(1 << 6))
 
 struct inode {
 	unsigned long		i_ino;
@@ -51,6 +53,8 @@ struct hd_struct {
 	struct kobject		kobj;
 };
 
+struct qcow2_file;
+
 struct block_device {
 	struct kobject		kobj;
 	dev_t			bd_dev;
@@ -62,6 +66,12 @@ struct block_device {
 	struct gendisk *	bd_disk;
 	struct gendisk		__bd_disk;
 	int			bd_fd;
+	int			bd_uring_slot;
+	/* if the device is a qcow2 image: */
+	struct qcow2_file	*bd_qcow2;
+	/* if opened with BLK_OPEN_MMAP: */
+	void			*bd_map;
+	size_t			bd_map_size;
 };
 
 #define bdev_kobj(_bdev) (&((_bdev)->kobj))
@@ -25,6 +25,7 @@ struct user_namespace;
 
 struct file {
 	struct inode		*f_inode;
+	int			f_fd;	/* shmem_file_setup() */
 };
 
 static inline struct inode *file_inode(const struct file *f)
@@ -42,6 +43,12 @@ static inline void submit_bio(struct bio *bio)
 	generic_make_request(bio);
 }
 
+struct blk_plug {
+};
+
+void blk_start_plug(struct blk_plug *);
+void blk_finish_plug(struct blk_plug *);
+
 int blkdev_issue_discard(struct block_device *, sector_t, sector_t, gfp_t);
 int blkdev_issue_zeroout(struct block_device *, sector_t, sector_t, gfp_t, unsigned);
 
@@ -62,8 +69,14 @@ int blkdev_issue_zeroout(struct block_device *, sector_t, sector_t, gfp_t, unsig
 #define blk_queue_nonrot(q)		((void) (q), 0)
 
 unsigned bdev_logical_block_size(struct block_device *bdev);
+unsigned bdev_zone_sectors(struct block_device *bdev);
 sector_t get_capacity(struct gendisk *disk);
 
+static inline bool bdev_is_zoned(struct block_device *bdev)
+{
+	return bdev_zone_sectors(bdev) != 0;
+}
+
 struct blk_holder_ops {
         void (*mark_dead)(struct block_device *bdev);
 };
@@ -78,6 +91,9 @@ struct file *bdev_file_open_by_path(const char *, blk_mode_t, void *,
 				    const struct blk_holder_ops *);
 int lookup_bdev(const char *path, dev_t *);
 
+void *bdev_mmap_addr(struct block_device *, u64, size_t);
+void bdev_mmap_release(struct block_device *, void *, size_t);
+
 struct super_block {
 	void			*s_fs_info;
 };
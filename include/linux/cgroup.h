@@ -0,0 +1,6 @@
+#ifndef __TOOLS_LINUX_CGROUP_H
+#define __TOOLS_LINUX_CGROUP_H
+
+/* No cgroups in userspace: CONFIG_CGROUPS is never set */
+
+#endif /* __TOOLS_LINUX_CGROUP_H */
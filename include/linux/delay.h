@@ -0,0 +1,22 @@
+#ifndef __TOOLS_LINUX_DELAY_H
+#define __TOOLS_LINUX_DELAY_H
+
+#include <time.h>
+#include <linux/time64.h>
+
+static inline void usleep_range(unsigned long min, unsigned long max)
+{
+	struct timespec ts = {
+		.tv_sec		= min / USEC_PER_SEC,
+		.tv_nsec	= (min % USEC_PER_SEC) * NSEC_PER_USEC,
+	};
+
+	nanosleep(&ts, NULL);
+}
+
+static inline void fsleep(unsigned long usecs)
+{
+	usleep_range(usecs, usecs * 2);
+}
+
+#endif /* __TOOLS_LINUX_DELAY_H */
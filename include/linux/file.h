@@ -0,0 +1,8 @@
+#ifndef _LINUX_FILE_H
+#define _LINUX_FILE_H
+
+struct file;
+
+void fput(struct file *);
+
+#endif /* _LINUX_FILE_H */
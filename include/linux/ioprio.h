@@ -1,6 +1,11 @@
 #ifndef IOPRIO_H
 #define IOPRIO_H
 
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct task_struct;
+
 /*
  * Gives us 8 prio classes with 13-bits of data for each class
  */
@@ -43,4 +48,10 @@ enum {
  */
 #define IOPRIO_NORM	(4)
 
+/* ioprio is per thread: this only works for the calling thread */
+static inline int set_task_ioprio(struct task_struct *task, int ioprio)
+{
+	return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio);
+}
+
 #endif
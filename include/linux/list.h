@@ -48,6 +48,12 @@ static inline void list_splice_init(struct list_head *list,
 	INIT_LIST_HEAD(list);
 }
 
+static inline void list_splice_tail(struct list_head *list,
+				    struct list_head *head)
+{
+	list_splice(list, head->prev);
+}
+
 #define list_last_entry(ptr, type, member) \
 	list_entry((ptr)->prev, type, member)
 
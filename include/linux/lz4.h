@@ -3,6 +3,9 @@
 #define LZ4_compress_destSize(src, dst, srclen, dstlen, workspace)	\
 	LZ4_compress_destSize(src, dst, srclen, dstlen)
 
+#define LZ4_compress_default(src, dst, srclen, dstlen, workspace)	\
+	LZ4_compress_default(src, dst, srclen, dstlen)
+
 #define LZ4_compress_HC(src, dst, srclen, dstlen, level, workspace)	-1
 
 #define LZ4_MEM_COMPRESS 0
@@ -5,11 +5,13 @@
 #ifndef _LINUX_MEMPOOL_H
 #define _LINUX_MEMPOOL_H
 
+#include <linux/atomic.h>
 #include <linux/wait.h>
 #include <linux/compiler.h>
 #include <linux/slab.h>
 
 struct kmem_cache;
+struct mempool_cache;
 
 typedef void * (mempool_alloc_t)(gfp_t gfp_mask, void *pool_data);
 typedef void (mempool_free_t)(void *element, void *pool_data);
@@ -24,6 +26,14 @@ typedef struct mempool_s {
 	mempool_alloc_t *alloc;
 	mempool_free_t *free;
 	wait_queue_head_t wait;
+
+	/* Per thread caches in front of the reserve, see mempool.c: */
+	struct mempool_cache *caches;
+
+	atomic64_t alloc_cached;	/* from a per thread cache */
+	atomic64_t alloc_fresh;		/* from pool->alloc */
+	atomic64_t alloc_reserve;	/* fell back to the reserve */
+	atomic64_t alloc_wait;		/* reserve empty, had to wait */
 } mempool_t;
 
 static inline bool mempool_initialized(mempool_t *pool)
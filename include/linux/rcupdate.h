@@ -11,10 +11,12 @@
 #define rcu_dereference_protected(p, c)	rcu_dereference(p)
 #define rcu_access_pointer(p)		READ_ONCE(p)
 
-#define kfree_rcu(ptr, rcu_head)	kfree(ptr) /* XXX */
-#define kfree_rcu_mightsleep(ptr)	kfree(ptr) /* XXX */
-#define kvfree_rcu(ptr, rcu_head)	kfree(ptr) /* XXX */
-#define kvfree_rcu_mightsleep(ptr)	kfree(ptr) /* XXX */
+void __kvfree_rcu(void *);
+
+#define kfree_rcu(ptr, rcu_head)	__kvfree_rcu((void *) (ptr))
+#define kfree_rcu_mightsleep(ptr)	__kvfree_rcu((void *) (ptr))
+#define kvfree_rcu(ptr, rcu_head)	__kvfree_rcu((void *) (ptr))
+#define kvfree_rcu_mightsleep(ptr)	__kvfree_rcu((void *) (ptr))
 
 #define RCU_INIT_POINTER(p, v)		WRITE_ONCE(p, v)
 
@@ -141,6 +141,12 @@ static inline long io_schedule_timeout(long timeout)
 	return schedule_timeout(timeout);
 }
 
+static inline long schedule_timeout_uninterruptible(long timeout)
+{
+	__set_current_state(TASK_UNINTERRUPTIBLE);
+	return schedule_timeout(timeout);
+}
+
 int wake_up_process(struct task_struct *);
 
 static inline u64 ktime_get_seconds(void)
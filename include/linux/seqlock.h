@@ -26,6 +26,14 @@ repeat:
 	return ret;
 }
 
+static inline unsigned raw_read_seqcount(const seqcount_t *s)
+{
+	unsigned ret = READ_ONCE(s->sequence);
+
+	smp_rmb();
+	return ret;
+}
+
 static inline int read_seqcount_retry(const seqcount_t *s, unsigned start)
 {
 	smp_rmb();
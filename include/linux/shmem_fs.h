@@ -0,0 +1,14 @@
+#ifndef _LINUX_SHMEM_FS_H
+#define _LINUX_SHMEM_FS_H
+
+#include <linux/types.h>
+
+struct file;
+
+/* Backed by an unlinked file in $TMPDIR: */
+struct file *shmem_file_setup(const char *, loff_t, unsigned long);
+
+ssize_t kernel_read(struct file *, void *, size_t, loff_t *);
+ssize_t kernel_write(struct file *, const void *, size_t, loff_t *);
+
+#endif /* _LINUX_SHMEM_FS_H */
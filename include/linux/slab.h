@@ -186,41 +186,16 @@ static inline void *kmemdup(const void *src, size_t len, gfp_t gfp)
 	return p;
 }
 
-struct kmem_cache {
-	size_t		    obj_size;
-};
+struct kmem_cache;
 
-static inline void *kmem_cache_alloc(struct kmem_cache *c, gfp_t gfp)
-{
-	return kmalloc(c->obj_size, gfp);
-}
-
-static inline void *kmem_cache_zalloc(struct kmem_cache *c, gfp_t gfp)
-{
-	return kzalloc(c->obj_size, gfp);
-}
-
-static inline void kmem_cache_free(struct kmem_cache *c, void *p)
-{
-	kfree(p);
-}
-
-static inline void kmem_cache_destroy(struct kmem_cache *p)
-{
-	kfree(p);
-}
-
-static inline struct kmem_cache *kmem_cache_create(size_t obj_size)
-{
-	struct kmem_cache *p = kmalloc(sizeof(*p), GFP_KERNEL);
-	if (!p)
-		return NULL;
-
-	p->obj_size = obj_size;
-	return p;
-}
+void *kmem_cache_alloc(struct kmem_cache *, gfp_t);
+void *kmem_cache_zalloc(struct kmem_cache *, gfp_t);
+void kmem_cache_free(struct kmem_cache *, void *);
+void kmem_cache_destroy(struct kmem_cache *);
+struct kmem_cache *kmem_cache_create(const char *, size_t);
 
-#define KMEM_CACHE(_struct, _flags)	kmem_cache_create(sizeof(struct _struct))
+#define KMEM_CACHE(_struct, _flags)					\
+	kmem_cache_create(#_struct, sizeof(struct _struct))
 
 #define PAGE_KERNEL		0
 #define PAGE_KERNEL_EXEC	1
@@ -11,6 +11,7 @@ extern char *strim(char *);
 extern void memzero_explicit(void *, size_t);
 int match_string(const char * const *, size_t, const char *);
 extern void * memscan(void *,int, size_t);
+extern void *memchr_inv(const void *, int, size_t);
 
 #define kstrndup(s, n, gfp)		strndup(s, n)
 #define kstrdup(s, gfp)			strdup(s)
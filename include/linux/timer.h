@@ -2,12 +2,15 @@
 #define __TOOLS_LINUX_TIMER_H
 
 #include <string.h>
+#include <linux/list.h>
 #include <linux/types.h>
 
 struct timer_list {
 	unsigned long		expires;
 	void			(*function)(struct timer_list *timer);
 	bool			pending;
+	unsigned		idx;
+	struct list_head	entry;
 };
 
 static inline void timer_setup(struct timer_list *timer,
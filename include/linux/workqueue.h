@@ -26,6 +26,7 @@ struct work_struct {
 	atomic_long_t data;
 	struct list_head entry;
 	work_func_t func;
+	struct workqueue_struct *wq;
 };
 
 #define INIT_WORK(_work, _func)					\
@@ -33,6 +34,7 @@ do {								\
 	(_work)->data.counter = 0;				\
 	INIT_LIST_HEAD(&(_work)->entry);			\
 	(_work)->func = (_func);				\
+	(_work)->wq = NULL;					\
 } while (0)
 
 struct delayed_work {
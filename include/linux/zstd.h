@@ -220,6 +220,85 @@ zstd_dctx *zstd_init_dctx(void *workspace, size_t workspace_size);
 size_t zstd_decompress_dctx(zstd_dctx *dctx, void *dst, size_t dst_capacity,
 	const void *src, size_t src_size);
 
+/* ======   Dictionaries   ====== */
+
+typedef ZSTD_customMem zstd_custom_mem;
+
+typedef ZSTD_CDict zstd_cdict;
+
+/**
+ * zstd_create_cdict_byreference() - create a compression dictionary
+ * @dict:       The dictionary content. It must outlive the returned cdict.
+ * @dict_size:  The size of the dictionary.
+ * @cparams:    The compression parameters to be used with this dictionary.
+ * @custom_mem: Allocator to use, or all NULL for the default.
+ *
+ * Return:      A compression dictionary, or NULL on error.
+ */
+zstd_cdict *zstd_create_cdict_byreference(const void *dict, size_t dict_size,
+	zstd_compression_parameters cparams, zstd_custom_mem custom_mem);
+
+/**
+ * zstd_free_cdict() - free a compression dictionary
+ * @cdict: The dictionary to free, may be NULL.
+ *
+ * Return: Always zero.
+ */
+size_t zstd_free_cdict(zstd_cdict *cdict);
+
+/**
+ * zstd_compress_using_cdict() - compress src into dst, using a dictionary
+ * @cctx:         The context. Must have been initialized with zstd_init_cctx().
+ * @dst:          The buffer to compress src into.
+ * @dst_capacity: The size of the destination buffer.
+ * @src:          The data to compress.
+ * @src_size:     The size of the data to compress.
+ * @cdict:        The dictionary to use; its parameters are used.
+ *
+ * Return:        The compressed size or an error, which can be checked using
+ *                zstd_is_error().
+ */
+size_t zstd_compress_using_cdict(zstd_cctx *cctx, void *dst,
+	size_t dst_capacity, const void *src, size_t src_size,
+	const zstd_cdict *cdict);
+
+typedef ZSTD_DDict zstd_ddict;
+
+/**
+ * zstd_create_ddict_byreference() - create a decompression dictionary
+ * @dict:       The dictionary content. It must outlive the returned ddict.
+ * @dict_size:  The size of the dictionary.
+ * @custom_mem: Allocator to use, or all NULL for the default.
+ *
+ * Return:      A decompression dictionary, or NULL on error.
+ */
+zstd_ddict *zstd_create_ddict_byreference(const void *dict, size_t dict_size,
+	zstd_custom_mem custom_mem);
+
+/**
+ * zstd_free_ddict() - free a decompression dictionary
+ * @ddict: The dictionary to free, may be NULL.
+ *
+ * Return: Always zero.
+ */
+size_t zstd_free_ddict(zstd_ddict *ddict);
+
+/**
+ * zstd_decompress_using_ddict() - decompress src into dst, using a dictionary
+ * @dctx:         The decompression context.
+ * @dst:          The buffer to decompress src into.
+ * @dst_capacity: The size of the destination buffer.
+ * @src:          The zstd compressed data to decompress.
+ * @src_size:     The exact size of the data to decompress.
+ * @ddict:        The dictionary the data was compressed with.
+ *
+ * Return:        The decompressed size or an error, which can be checked using
+ *                zstd_is_error().
+ */
+size_t zstd_decompress_using_ddict(zstd_dctx *dctx, void *dst,
+	size_t dst_capacity, const void *src, size_t src_size,
+	const zstd_ddict *ddict);
+
 /* ======   Streaming Buffers   ====== */
 
 /**
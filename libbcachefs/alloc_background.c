@@ -97,6 +97,13 @@ static void bch2_alloc_unpack_v1(struct bkey_alloc_unpacked *out,
 #undef  x
 }
 
+enum {
+	BCH_ALLOC_FIELDS_V2_NR = 0
+#define x(_name, _bits)	+ 1
+	BCH_ALLOC_FIELDS_V2()
+#undef  x
+};
+
 static int bch2_alloc_unpack_v2(struct bkey_alloc_unpacked *out,
 				struct bkey_s_c k)
 {
@@ -105,23 +112,20 @@ static int bch2_alloc_unpack_v2(struct bkey_alloc_unpacked *out,
 	const u8 *end = bkey_val_end(a);
 	unsigned fieldnr = 0;
 	int ret;
-	u64 v;
+	u64 v[BCH_ALLOC_FIELDS_V2_NR] = {};
 
 	out->gen	= a.v->gen;
 	out->oldest_gen	= a.v->oldest_gen;
 	out->data_type	= a.v->data_type;
 
+	ret = bch2_varint_decode_fast_n(in, end, v,
+			min_t(unsigned, a.v->nr_fields, ARRAY_SIZE(v)));
+	if (ret < 0)
+		return ret;
+
 #define x(_name, _bits)							\
-	if (fieldnr < a.v->nr_fields) {					\
-		ret = bch2_varint_decode_fast(in, end, &v);		\
-		if (ret < 0)						\
-			return ret;					\
-		in += ret;						\
-	} else {							\
-		v = 0;							\
-	}								\
-	out->_name = v;							\
-	if (v != out->_name)						\
+	out->_name = v[fieldnr];					\
+	if (v[fieldnr] != out->_name)					\
 		return -1;						\
 	fieldnr++;
 
@@ -138,7 +142,7 @@ static int bch2_alloc_unpack_v3(struct bkey_alloc_unpacked *out,
 	const u8 *end = bkey_val_end(a);
 	unsigned fieldnr = 0;
 	int ret;
-	u64 v;
+	u64 v[BCH_ALLOC_FIELDS_V2_NR] = {};
 
 	out->gen	= a.v->gen;
 	out->oldest_gen	= a.v->oldest_gen;
@@ -147,17 +151,14 @@ static int bch2_alloc_unpack_v3(struct bkey_alloc_unpacked *out,
 	out->need_inc_gen = BCH_ALLOC_V3_NEED_INC_GEN(a.v);
 	out->journal_seq = le64_to_cpu(a.v->journal_seq);
 
+	ret = bch2_varint_decode_fast_n(in, end, v,
+			min_t(unsigned, a.v->nr_fields, ARRAY_SIZE(v)));
+	if (ret < 0)
+		return ret;
+
 #define x(_name, _bits)							\
-	if (fieldnr < a.v->nr_fields) {					\
-		ret = bch2_varint_decode_fast(in, end, &v);		\
-		if (ret < 0)						\
-			return ret;					\
-		in += ret;						\
-	} else {							\
-		v = 0;							\
-	}								\
-	out->_name = v;							\
-	if (v != out->_name)						\
+	out->_name = v[fieldnr];					\
+	if (v[fieldnr] != out->_name)					\
 		return -1;						\
 	fieldnr++;
 
@@ -476,12 +477,46 @@ err:
 	return ERR_PTR(ret);
 }
 
+/*
+ * A write that allocated many extents from the same bucket has the triggers
+ * for each extent update the same alloc key: if we already have a pending
+ * update for the bucket that we created, we can modify it in place instead of
+ * looking up, copying and replacing it again for every extent:
+ */
+static struct bkey_i_alloc_v4 *
+alloc_update_pending(struct btree_trans *trans, struct bpos pos,
+		     enum btree_iter_update_trigger_flags flags)
+{
+	trans_for_each_update(trans, i) {
+		if (i->btree_id < BTREE_ID_alloc)
+			continue;
+		if (i->btree_id > BTREE_ID_alloc)
+			break;
+
+		if (!i->level &&
+		    bpos_eq(i->k->k.p, pos) &&
+		    i->flags == flags &&
+		    i->k->k.type == KEY_TYPE_alloc_v4 &&
+		    !i->insert_trigger_run &&
+		    !i->overwrite_trigger_run &&
+		    (void *) i->k >= trans->mem &&
+		    (void *) i->k < trans->mem + trans->mem_top)
+			return bkey_i_to_alloc_v4(i->k);
+	}
+
+	return NULL;
+}
+
 __flatten
 struct bkey_i_alloc_v4 *bch2_trans_start_alloc_update(struct btree_trans *trans, struct bpos pos,
 						      enum btree_iter_update_trigger_flags flags)
 {
 	struct btree_iter iter;
-	struct bkey_i_alloc_v4 *a = bch2_trans_start_alloc_update_noupdate(trans, &iter, pos);
+	struct bkey_i_alloc_v4 *a = alloc_update_pending(trans, pos, flags);
+	if (a)
+		return a;
+
+	a = bch2_trans_start_alloc_update_noupdate(trans, &iter, pos);
 	int ret = PTR_ERR_OR_ZERO(a);
 	if (ret)
 		return ERR_PTR(ret);
@@ -591,65 +626,212 @@ iter_err:
 	return ret;
 }
 
-int bch2_alloc_read(struct bch_fs *c)
+/*
+ * Reading in bucket gens at mount is split up by device, each device's range
+ * of the bucket_gens (or alloc) btree walked by its own thread:
+ */
+struct alloc_read_dev {
+	struct closure		cl;
+	struct bch_fs		*c;
+	unsigned		dev_idx;
+	struct bucket_gens	*gens;
+	int			ret;
+};
+
+static int bch2_dev_alloc_read(struct btree_trans *trans, struct alloc_read_dev *r)
 {
-	struct btree_trans *trans = bch2_trans_get(c);
-	struct bch_dev *ca = NULL;
-	int ret;
+	struct bch_fs *c = trans->c;
+	struct bucket_gens *gens = r->gens;
 
-	if (c->sb.version_upgrade_complete >= bcachefs_metadata_version_bucket_gens) {
-		ret = for_each_btree_key(trans, iter, BTREE_ID_bucket_gens, POS_MIN,
-					 BTREE_ITER_prefetch, k, ({
+	if (c->sb.version_upgrade_complete >= bcachefs_metadata_version_bucket_gens)
+		return for_each_btree_key_upto(trans, iter, BTREE_ID_bucket_gens,
+					POS(r->dev_idx, 0), POS(r->dev_idx, U64_MAX),
+					BTREE_ITER_prefetch, k, ({
 			u64 start = bucket_gens_pos_to_alloc(k.k->p, 0).offset;
 			u64 end = bucket_gens_pos_to_alloc(bpos_nosnap_successor(k.k->p), 0).offset;
 
 			if (k.k->type != KEY_TYPE_bucket_gens)
 				continue;
 
-			ca = bch2_dev_iterate(c, ca, k.k->p.inode);
-			/*
-			 * Not a fsck error because this is checked/repaired by
-			 * bch2_check_alloc_key() which runs later:
-			 */
-			if (!ca) {
-				bch2_btree_iter_set_pos(&iter, POS(k.k->p.inode + 1, 0));
-				continue;
-			}
-
 			const struct bch_bucket_gens *g = bkey_s_c_to_bucket_gens(k).v;
 
-			for (u64 b = max_t(u64, ca->mi.first_bucket, start);
-			     b < min_t(u64, ca->mi.nbuckets, end);
-			     b++)
-				*bucket_gen(ca, b) = g->gens[b & KEY_TYPE_BUCKET_GENS_MASK];
+			start	= max_t(u64, gens->first_bucket, start);
+			end	= min_t(u64, gens->nbuckets, end);
+
+			if (start < end)
+				memcpy(gens->b + start,
+				       g->gens + (start & KEY_TYPE_BUCKET_GENS_MASK),
+				       end - start);
 			0;
 		}));
-	} else {
-		ret = for_each_btree_key(trans, iter, BTREE_ID_alloc, POS_MIN,
-					 BTREE_ITER_prefetch, k, ({
-			ca = bch2_dev_iterate(c, ca, k.k->p.inode);
-			/*
-			 * Not a fsck error because this is checked/repaired by
-			 * bch2_check_alloc_key() which runs later:
-			 */
-			if (!ca) {
-				bch2_btree_iter_set_pos(&iter, POS(k.k->p.inode + 1, 0));
-				continue;
-			}
 
+	return for_each_btree_key_upto(trans, iter, BTREE_ID_alloc,
+				POS(r->dev_idx, 0), POS(r->dev_idx, U64_MAX),
+				BTREE_ITER_prefetch, k, ({
+		u64 b = k.k->p.offset;
+
+		if (b >= gens->first_bucket && b < gens->nbuckets) {
 			struct bch_alloc_v4 a;
-			*bucket_gen(ca, k.k->p.offset) = bch2_alloc_to_v4(k, &a)->gen;
-			0;
-		}));
+			gens->b[b] = bch2_alloc_to_v4(k, &a)->gen;
+		}
+		0;
+	}));
+}
+
+static CLOSURE_CALLBACK(bch2_dev_alloc_read_work)
+{
+	closure_type(r, struct alloc_read_dev, cl);
+
+	r->ret = bch2_trans_run(r->c, bch2_dev_alloc_read(trans, r));
+	closure_return(cl);
+}
+
+int bch2_alloc_read(struct bch_fs *c)
+{
+	struct alloc_read_dev *devs = kcalloc(BCH_SB_MEMBERS_MAX, sizeof(*devs), GFP_KERNEL);
+	struct closure cl;
+	unsigned nr = 0;
+	int ret = 0;
+
+	if (!devs)
+		return -BCH_ERR_ENOMEM_fs_other_alloc;
+
+	/*
+	 * Keys for devices that don't exist are checked/repaired by
+	 * bch2_check_alloc_key(), which runs later, so aren't a fsck error
+	 * here:
+	 */
+	for_each_member_device(c, ca) {
+		struct alloc_read_dev *r = devs + nr++;
+
+		r->c		= c;
+		r->dev_idx	= ca->dev_idx;
+		r->gens		= bucket_gens(ca);
 	}
 
-	bch2_dev_put(ca);
-	bch2_trans_put(trans);
+	closure_init_stack(&cl);
+
+	/* The calling thread reads the first device: */
+	for (struct alloc_read_dev *r = devs + 1; r < devs + nr; r++)
+		closure_call(&r->cl, bch2_dev_alloc_read_work, system_unbound_wq, &cl);
+
+	if (nr)
+		devs->ret = bch2_trans_run(c, bch2_dev_alloc_read(trans, devs));
+
+	closure_sync(&cl);
 
+	for (struct alloc_read_dev *r = devs; r < devs + nr; r++)
+		ret = ret ?: r->ret;
+
+	kfree(devs);
 	bch_err_fn(c, ret);
 	return ret;
 }
 
+/* Free bucket summary: */
+
+static void bucket_free_summary_add(struct bucket_free_summary *s,
+				    u64 bucket, u64 end, int v)
+{
+	end = min_t(u64, end, s->nbuckets);
+
+	while (bucket < end) {
+		size_t r = bucket >> BUCKET_FREE_REGION_SHIFT;
+		u64 n = min_t(u64, end, (u64) (r + 1) << BUCKET_FREE_REGION_SHIFT) - bucket;
+
+		atomic_add(v * n, &s->regions[r]);
+		atomic_add(v * n, &s->groups[r / BUCKET_FREE_GROUP]);
+		bucket += n;
+	}
+}
+
+static void bch2_dev_free_summary_mod(struct bch_dev *ca, u64 bucket, int v)
+{
+	rcu_read_lock();
+	struct bucket_free_summary *s = rcu_dereference(ca->free_summary);
+	if (s)
+		bucket_free_summary_add(s, bucket, bucket + 1, v);
+	rcu_read_unlock();
+}
+
+/*
+ * Returns the first bucket >= @bucket in a region with free buckets, @bucket
+ * if we don't have a summary for it, or U64_MAX if no region past @bucket has
+ * free buckets:
+ */
+u64 bch2_dev_free_summary_next(struct bch_dev *ca, u64 bucket)
+{
+	u64 ret = bucket;
+
+	rcu_read_lock();
+	struct bucket_free_summary *s = rcu_dereference(ca->free_summary);
+	if (!s || bucket >= s->nbuckets)
+		goto out;
+
+	size_t r = bucket >> BUCKET_FREE_REGION_SHIFT;
+	while (r < s->nr_regions) {
+		if (!(r % BUCKET_FREE_GROUP) &&
+		    atomic_read(&s->groups[r / BUCKET_FREE_GROUP]) <= 0) {
+			r += BUCKET_FREE_GROUP;
+			continue;
+		}
+
+		if (atomic_read(&s->regions[r]) > 0)
+			break;
+		r++;
+	}
+
+	ret = r < s->nr_regions
+		? max_t(u64, bucket, (u64) r << BUCKET_FREE_REGION_SHIFT)
+		: U64_MAX;
+out:
+	rcu_read_unlock();
+	return ret;
+}
+
+static void bucket_free_summary_free_rcu(struct rcu_head *rcu)
+{
+	kvfree(container_of(rcu, struct bucket_free_summary, rcu));
+}
+
+/* Rebuild the free bucket summary for @ca from the freespace btree: */
+int bch2_dev_free_summary_init(struct bch_fs *c, struct bch_dev *ca)
+{
+	size_t nr_regions = DIV_ROUND_UP(ca->mi.nbuckets, 1ULL << BUCKET_FREE_REGION_SHIFT);
+	size_t nr_groups = DIV_ROUND_UP(nr_regions, BUCKET_FREE_GROUP);
+	struct bucket_free_summary *s, *old;
+
+	s = kvzalloc(struct_size(s, regions, nr_regions + nr_groups), GFP_KERNEL);
+	if (!s)
+		return -BCH_ERR_ENOMEM_bucket_free_summary_init;
+
+	s->nbuckets	= ca->mi.nbuckets;
+	s->nr_regions	= nr_regions;
+	s->nr_groups	= nr_groups;
+	s->groups	= s->regions + nr_regions;
+
+	int ret = bch2_trans_run(c,
+		for_each_btree_key_upto(trans, iter, BTREE_ID_freespace,
+				   POS(ca->dev_idx, 0),
+				   POS(ca->dev_idx, U64_MAX), 0, k, ({
+			u64 bucket = bkey_start_offset(k.k) & ~(~0ULL << 56);
+
+			bucket_free_summary_add(s, bucket, bucket + k.k->size, 1);
+			0;
+		})));
+	if (ret) {
+		kvfree(s);
+		bch_err_fn(c, ret);
+		return ret;
+	}
+
+	old = rcu_dereference_protected(ca->free_summary, 1);
+	rcu_assign_pointer(ca->free_summary, s);
+	if (old)
+		call_rcu(&old->rcu, bucket_free_summary_free_rcu);
+	return 0;
+}
+
 /* Free space/discard btree: */
 
 static int bch2_bucket_do_index(struct btree_trans *trans,
@@ -951,6 +1133,11 @@ int bch2_trigger_alloc(struct btree_trans *trans,
 #define statechange(expr)		!eval_state(old_a, expr) && eval_state(new_a, expr)
 #define bucket_flushed(a)		(!a->journal_seq || a->journal_seq <= c->journal.flushed_seq_ondisk)
 
+		if (statechange(a->data_type == BCH_DATA_free))
+			bch2_dev_free_summary_mod(ca, new.k->p.offset, 1);
+		if (statechange(a->data_type != BCH_DATA_free))
+			bch2_dev_free_summary_mod(ca, new.k->p.offset, -1);
+
 		if (statechange(a->data_type == BCH_DATA_free) &&
 		    bucket_flushed(new_a))
 			closure_wake_up(&c->freelist_wait);
@@ -1715,18 +1902,158 @@ found:
 	mutex_unlock(&ca->discard_buckets_in_flight_lock);
 }
 
+/*
+ * Discard pipeline:
+ *
+ * Buckets to be discarded are batched up; adjacent buckets are merged into
+ * a single range, and ranges are issued as async discards, with a limited
+ * number in flight per device and optional bandwidth/IOPS limits - some
+ * devices stall reads while processing large numbers of discards:
+ */
+
+#define DISCARD_BATCH_MAX		256
+#define DISCARD_BIOS_IN_FLIGHT_MAX	8
+
+struct discard_bios {
+	struct closure		cl;
+	struct bch_dev		*ca;
+};
+
+static void bch2_discard_endio(struct bio *bio)
+{
+	struct discard_bios *d = bio->bi_private;
+	struct bch_dev *ca = d->ca;
+
+	/* discards are only advisory, errors are ignored: */
+	bio_put(bio);
+
+	atomic_dec(&ca->discard_bios_in_flight);
+	wake_up(&ca->discard_wait);
+	closure_put(&d->cl);
+}
+
+static void discard_ratelimit(struct bch_dev *ca, u64 sectors)
+{
+	struct bch_fs *c = ca->fs;
+	u32 max_rate = c->opts.discard_max_rate;
+	u32 max_iops = c->opts.discard_max_iops;
+	u64 delay = 0;
+
+	if (!max_rate && !max_iops)
+		return;
+
+	spin_lock(&ca->discard_ratelimit_lock);
+	if (max_rate) {
+		ca->discard_bytes_ratelimit.rate = max_rate;
+		delay = max(delay, bch2_ratelimit_delay(&ca->discard_bytes_ratelimit));
+		bch2_ratelimit_increment(&ca->discard_bytes_ratelimit, sectors << 9);
+	}
+
+	if (max_iops) {
+		ca->discard_iops_ratelimit.rate = max_iops;
+		delay = max(delay, bch2_ratelimit_delay(&ca->discard_iops_ratelimit));
+		bch2_ratelimit_increment(&ca->discard_iops_ratelimit, 1);
+	}
+	spin_unlock(&ca->discard_ratelimit_lock);
+
+	if (delay)
+		schedule_timeout_uninterruptible(delay);
+}
+
+static int u64_cmp(const void *_l, const void *_r)
+{
+	const u64 *l = _l, *r = _r;
+
+	return cmp_int(*l, *r);
+}
+
+/*
+ * Discard a set of buckets on @ca, merging adjacent buckets: returns when all
+ * discards have completed. @buckets is sorted in place.
+ */
+void bch2_dev_discard_buckets(struct bch_dev *ca, u64 *buckets, size_t nr)
+{
+	struct bch_fs *c = ca->fs;
+	struct block_device *bdev = ca->disk_sb.bdev;
+	u64 max_sectors = min_t(u64, bdev_max_discard_sectors(bdev), UINT_MAX >> 9);
+	struct discard_bios d = { .ca = ca };
+
+	if (!nr || !ca->mi.discard || c->opts.nochanges || !max_sectors)
+		return;
+
+	sort(buckets, nr, sizeof(buckets[0]), u64_cmp, NULL);
+
+	closure_init_stack(&d.cl);
+
+	for (size_t i = 0; i < nr;) {
+		u64 start = buckets[i], end = start + 1;
+
+		for (i++; i < nr && buckets[i] <= end; i++)
+			end = max(end, buckets[i] + 1);
+
+		u64 sector	= bucket_to_sector(ca, start);
+		u64 sectors_left = (end - start) * ca->mi.bucket_size;
+
+		while (sectors_left) {
+			u64 sectors = min(sectors_left, max_sectors);
+
+			discard_ratelimit(ca, sectors);
+
+			wait_event(ca->discard_wait,
+				   atomic_add_unless(&ca->discard_bios_in_flight, 1,
+						     DISCARD_BIOS_IN_FLIGHT_MAX));
+
+			struct bio *bio = bio_alloc(bdev, 0, REQ_OP_DISCARD, GFP_NOFS);
+			bio->bi_iter.bi_sector	= sector;
+			bio->bi_iter.bi_size	= sectors << 9;
+			bio->bi_end_io		= bch2_discard_endio;
+			bio->bi_private		= &d;
+
+			closure_get(&d.cl);
+			submit_bio(bio);
+
+			atomic64_add(sectors, &ca->discard_sectors_issued);
+			sector		+= sectors;
+			sectors_left	-= sectors;
+		}
+	}
+
+	closure_sync(&d.cl);
+}
+
+void bch2_dev_discard_backlog_to_text(struct printbuf *out, struct bch_dev *ca)
+{
+	struct bch_dev_usage usage = bch2_dev_usage_read(ca);
+	size_t in_flight;
+
+	mutex_lock(&ca->discard_buckets_in_flight_lock);
+	in_flight = ca->discard_buckets_in_flight.nr;
+	mutex_unlock(&ca->discard_buckets_in_flight_lock);
+
+	printbuf_tabstop_push(out, 24);
+
+	prt_printf(out, "need discard:\t%llu buckets\n",
+		   usage.d[BCH_DATA_need_discard].buckets);
+	prt_printf(out, "buckets in flight:\t%zu\n", in_flight);
+	prt_printf(out, "discards in flight:\t%u\n",
+		   atomic_read(&ca->discard_bios_in_flight));
+	prt_printf(out, "discarded:\t");
+	prt_human_readable_u64(out, atomic64_read(&ca->discard_sectors_issued) << 9);
+	prt_newline(out);
+}
+
 struct discard_buckets_state {
 	u64		seen;
 	u64		open;
 	u64		need_journal_commit;
 	u64		discarded;
 	u64		need_journal_commit_this_dev;
+	darray_u64	batch;
 };
 
 static int bch2_discard_one_bucket(struct btree_trans *trans,
 				   struct bch_dev *ca,
 				   struct btree_iter *need_discard_iter,
-				   struct bpos *discard_pos_done,
 				   struct discard_buckets_state *s)
 {
 	struct bch_fs *c = trans->c;
@@ -1735,7 +2062,6 @@ static int bch2_discard_one_bucket(struct btree_trans *trans,
 	struct bkey_s_c k;
 	struct bkey_i_alloc_v4 *a;
 	struct printbuf buf = PRINTBUF;
-	bool discard_locked = false;
 	int ret = 0;
 
 	if (bch2_bucket_is_open_safe(c, pos.inode, pos.offset)) {
@@ -1797,30 +2123,24 @@ static int bch2_discard_one_bucket(struct btree_trans *trans,
 		goto out;
 	}
 
+	/*
+	 * The discard is issued, and need_discard cleared, when the batch is
+	 * flushed; the in flight entry keeps the fast path off this bucket
+	 * until then:
+	 */
 	if (discard_in_flight_add(ca, iter.pos.offset, true))
 		goto out;
 
-	discard_locked = true;
-
-	if (!bkey_eq(*discard_pos_done, iter.pos) &&
-	    ca->mi.discard && !c->opts.nochanges) {
-		/*
-		 * This works without any other locks because this is the only
-		 * thread that removes items from the need_discard tree
-		 */
-		bch2_trans_unlock_long(trans);
-		blkdev_issue_discard(ca->disk_sb.bdev,
-				     k.k->p.offset * ca->mi.bucket_size,
-				     ca->mi.bucket_size,
-				     GFP_KERNEL);
-		*discard_pos_done = iter.pos;
-
-		ret = bch2_trans_relock_notrace(trans);
-		if (ret)
-			goto out;
+	ret = darray_push(&s->batch, iter.pos.offset);
+	if (ret) {
+		discard_in_flight_remove(ca, iter.pos.offset);
+		goto out;
 	}
 
-	SET_BCH_ALLOC_V4_NEED_DISCARD(&a->v, false);
+	/* batch full: stop iterating and flush */
+	if (s->batch.nr >= DISCARD_BATCH_MAX)
+		ret = 1;
+	goto out;
 write:
 	alloc_data_type_set(&a->v, a->v.data_type);
 
@@ -1834,33 +2154,99 @@ write:
 	count_event(c, bucket_discard);
 	s->discarded++;
 out:
-	if (discard_locked)
-		discard_in_flight_remove(ca, iter.pos.offset);
 	s->seen++;
 	bch2_trans_iter_exit(trans, &iter);
 	printbuf_exit(&buf);
 	return ret;
 }
 
+static int bch2_clear_bucket_needs_discard(struct btree_trans *trans, struct bpos bucket)
+{
+	struct btree_iter iter;
+	bch2_trans_iter_init(trans, &iter, BTREE_ID_alloc, bucket, BTREE_ITER_intent);
+	struct bkey_s_c k = bch2_btree_iter_peek_slot(&iter);
+	int ret = bkey_err(k);
+	if (ret)
+		goto err;
+
+	struct bkey_i_alloc_v4 *a = bch2_alloc_to_v4_mut(trans, k);
+	ret = PTR_ERR_OR_ZERO(a);
+	if (ret)
+		goto err;
+
+	BUG_ON(a->v.dirty_sectors);
+	SET_BCH_ALLOC_V4_NEED_DISCARD(&a->v, false);
+	alloc_data_type_set(&a->v, a->v.data_type);
+
+	ret = bch2_trans_update(trans, &iter, &a->k_i, 0);
+err:
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+/*
+ * Discard a batch of buckets, then clear need_discard: the buckets must not be
+ * reused until the discards have completed:
+ */
+static int discard_buckets_flush(struct bch_fs *c, struct bch_dev *ca,
+				 darray_u64 *batch, u64 *discarded)
+{
+	int ret = 0;
+
+	bch2_dev_discard_buckets(ca, batch->data, batch->nr);
+
+	darray_for_each(*batch, i) {
+		if (!ret) {
+			ret = bch2_trans_do(c, NULL, NULL,
+				BCH_WATERMARK_btree|
+				BCH_TRANS_COMMIT_no_enospc,
+				bch2_clear_bucket_needs_discard(trans, POS(ca->dev_idx, *i)));
+			bch_err_fn(c, ret);
+
+			if (!ret) {
+				count_event(c, bucket_discard);
+				(*discarded)++;
+			}
+		}
+
+		discard_in_flight_remove(ca, *i);
+	}
+
+	batch->nr = 0;
+	return ret;
+}
+
 static void bch2_do_discards_work(struct work_struct *work)
 {
 	struct bch_dev *ca = container_of(work, struct bch_dev, discard_work);
 	struct bch_fs *c = ca->fs;
 	struct discard_buckets_state s = {};
-	struct bpos discard_pos_done = POS_MAX;
+	struct bpos pos = POS(ca->dev_idx, 0);
+	bool batch_full;
 	int ret;
 
 	/*
-	 * We're doing the commit in bch2_discard_one_bucket instead of using
-	 * for_each_btree_key_commit() so that we can increment counters after
-	 * successful commit:
+	 * Walk the need_discard btree one batch at a time: the walk stops
+	 * when the batch is full, and we pick up where we left off after it's
+	 * been flushed:
 	 */
-	ret = bch2_trans_run(c,
-		for_each_btree_key_upto(trans, iter,
-				   BTREE_ID_need_discard,
-				   POS(ca->dev_idx, 0),
-				   POS(ca->dev_idx, U64_MAX), 0, k,
-			bch2_discard_one_bucket(trans, ca, &iter, &discard_pos_done, &s)));
+	do {
+		ret = bch2_trans_run(c,
+			for_each_btree_key_upto(trans, iter,
+					   BTREE_ID_need_discard, pos,
+					   POS(ca->dev_idx, U64_MAX), 0, k, ({
+				pos = iter.pos;
+				bch2_discard_one_bucket(trans, ca, &iter, &s);
+			})));
+		batch_full = ret > 0;
+		if (batch_full)
+			ret = 0;
+
+		int ret2 = discard_buckets_flush(c, ca, &s.batch, &s.discarded);
+		ret = ret ?: ret2;
+	} while (!ret && batch_full);
+
+	darray_exit(&s.batch);
 
 	trace_discard_buckets(c, s.seen, s.open, s.need_journal_commit, s.discarded,
 			      bch2_err_str(ret));
@@ -1893,72 +2279,35 @@ void bch2_do_discards(struct bch_fs *c)
 		bch2_dev_do_discards(ca);
 }
 
-static int bch2_clear_bucket_needs_discard(struct btree_trans *trans, struct bpos bucket)
-{
-	struct btree_iter iter;
-	bch2_trans_iter_init(trans, &iter, BTREE_ID_alloc, bucket, BTREE_ITER_intent);
-	struct bkey_s_c k = bch2_btree_iter_peek_slot(&iter);
-	int ret = bkey_err(k);
-	if (ret)
-		goto err;
-
-	struct bkey_i_alloc_v4 *a = bch2_alloc_to_v4_mut(trans, k);
-	ret = PTR_ERR_OR_ZERO(a);
-	if (ret)
-		goto err;
-
-	BUG_ON(a->v.dirty_sectors);
-	SET_BCH_ALLOC_V4_NEED_DISCARD(&a->v, false);
-	alloc_data_type_set(&a->v, a->v.data_type);
-
-	ret = bch2_trans_update(trans, &iter, &a->k_i, 0);
-err:
-	bch2_trans_iter_exit(trans, &iter);
-	return ret;
-}
-
 static void bch2_do_discards_fast_work(struct work_struct *work)
 {
 	struct bch_dev *ca = container_of(work, struct bch_dev, discard_fast_work);
 	struct bch_fs *c = ca->fs;
+	darray_u64 batch = {};
+	u64 discarded = 0;
 
 	while (1) {
-		bool got_bucket = false;
-		u64 bucket;
-
 		mutex_lock(&ca->discard_buckets_in_flight_lock);
 		darray_for_each(ca->discard_buckets_in_flight, i) {
 			if (i->in_progress)
 				continue;
 
-			got_bucket = true;
-			bucket = i->bucket;
+			if (batch.nr >= DISCARD_BATCH_MAX ||
+			    darray_push(&batch, i->bucket))
+				break;
 			i->in_progress = true;
-			break;
 		}
 		mutex_unlock(&ca->discard_buckets_in_flight_lock);
 
-		if (!got_bucket)
+		if (!batch.nr)
 			break;
 
-		if (ca->mi.discard && !c->opts.nochanges)
-			blkdev_issue_discard(ca->disk_sb.bdev,
-					     bucket_to_sector(ca, bucket),
-					     ca->mi.bucket_size,
-					     GFP_KERNEL);
-
-		int ret = bch2_trans_do(c, NULL, NULL,
-			BCH_WATERMARK_btree|
-			BCH_TRANS_COMMIT_no_enospc,
-			bch2_clear_bucket_needs_discard(trans, POS(ca->dev_idx, bucket)));
-		bch_err_fn(c, ret);
-
-		discard_in_flight_remove(ca, bucket);
-
-		if (ret)
+		if (discard_buckets_flush(c, ca, &batch, &discarded))
 			break;
 	}
 
+	darray_exit(&batch);
+
 	bch2_write_ref_put(c, BCH_WRITE_REF_discard_fast);
 	percpu_ref_put(&ca->io_ref);
 }
@@ -1984,10 +2333,27 @@ put_ioref:
 	percpu_ref_put(&ca->io_ref);
 }
 
+/*
+ * Buckets are invalidated in batches, committed together - sized by how many
+ * buckets the allocator wants, up to INVALIDATE_BATCH_MAX; and a transaction
+ * looks at no more than INVALIDATE_SCAN_MAX lru entries, since entries for
+ * open buckets and stale entries are skipped:
+ */
+#define INVALIDATE_BATCH_MAX		32
+#define INVALIDATE_SCAN_MAX		256
+
+struct invalidate_batch {
+	unsigned		nr;
+	struct {
+		struct bpos	bucket;
+		unsigned	cached_sectors;
+	}			d[INVALIDATE_BATCH_MAX];
+};
+
 static int invalidate_one_bucket(struct btree_trans *trans,
 				 struct btree_iter *lru_iter,
 				 struct bkey_s_c lru_k,
-				 s64 *nr_to_invalidate)
+				 struct invalidate_batch *batch)
 {
 	struct bch_fs *c = trans->c;
 	struct bkey_i_alloc_v4 *a = NULL;
@@ -1996,9 +2362,6 @@ static int invalidate_one_bucket(struct btree_trans *trans,
 	unsigned cached_sectors;
 	int ret = 0;
 
-	if (*nr_to_invalidate <= 0)
-		return 1;
-
 	if (!bch2_dev_bucket_exists(c, bucket)) {
 		prt_str(&buf, "lru entry points to invalid bucket");
 		goto err;
@@ -2033,14 +2396,9 @@ static int invalidate_one_bucket(struct btree_trans *trans,
 	a->v.io_time[READ]	= bch2_current_io_time(c, READ);
 	a->v.io_time[WRITE]	= bch2_current_io_time(c, WRITE);
 
-	ret = bch2_trans_commit(trans, NULL, NULL,
-				BCH_WATERMARK_btree|
-				BCH_TRANS_COMMIT_no_enospc);
-	if (ret)
-		goto out;
-
-	trace_and_count(c, bucket_invalidate, c, bucket.inode, bucket.offset, cached_sectors);
-	--*nr_to_invalidate;
+	batch->d[batch->nr].bucket		= bucket;
+	batch->d[batch->nr].cached_sectors	= cached_sectors;
+	batch->nr++;
 out:
 	printbuf_exit(&buf);
 	return ret;
@@ -2102,23 +2460,56 @@ static void bch2_do_invalidates_work(struct work_struct *work)
 				     ((bch2_current_io_time(c, READ) + U32_MAX) &
 				      LRU_TIME_MAX)), 0);
 
-	while (true) {
+	while (nr_to_invalidate > 0) {
+		struct invalidate_batch batch;
+		struct bpos batch_start = iter.pos;
+		bool batch_wrapped = wrapped, done = false;
+		unsigned batch_max = min_t(s64, nr_to_invalidate, INVALIDATE_BATCH_MAX);
+
+		batch.nr = 0;
 		bch2_trans_begin(trans);
 
-		struct bkey_s_c k = next_lru_key(trans, &iter, ca, &wrapped);
-		ret = bkey_err(k);
-		if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+		for (unsigned scanned = 0;
+		     batch.nr < batch_max && scanned < INVALIDATE_SCAN_MAX;
+		     scanned++) {
+			struct bkey_s_c k = next_lru_key(trans, &iter, ca, &wrapped);
+			ret = bkey_err(k);
+			if (ret)
+				break;
+			if (!k.k) {
+				done = true;
+				break;
+			}
+
+			ret = invalidate_one_bucket(trans, &iter, k, &batch);
+			if (ret)
+				break;
+
+			bch2_btree_iter_advance(&iter);
+		}
+
+		if (!ret && batch.nr)
+			ret = bch2_trans_commit(trans, NULL, NULL,
+						BCH_WATERMARK_btree|
+						BCH_TRANS_COMMIT_no_enospc);
+		if (bch2_err_matches(ret, BCH_ERR_transaction_restart)) {
+			bch2_btree_iter_set_pos(&iter, batch_start);
+			wrapped = batch_wrapped;
+			ret = 0;
 			continue;
+		}
 		if (ret)
 			break;
-		if (!k.k)
-			break;
 
-		ret = invalidate_one_bucket(trans, &iter, k, &nr_to_invalidate);
-		if (ret)
-			break;
+		for (unsigned i = 0; i < batch.nr; i++)
+			trace_and_count(c, bucket_invalidate, c,
+					batch.d[i].bucket.inode,
+					batch.d[i].bucket.offset,
+					batch.d[i].cached_sectors);
+		nr_to_invalidate -= batch.nr;
 
-		bch2_btree_iter_advance(&iter);
+		if (done)
+			break;
 	}
 	bch2_trans_iter_exit(trans, &iter);
 err:
@@ -2151,6 +2542,48 @@ void bch2_do_invalidates(struct bch_fs *c)
 		bch2_dev_do_invalidates(ca);
 }
 
+/*
+ * Find the end of the run of free buckets with the same genbits starting at
+ * @iter, so they can be indexed with a single extent. We don't look past the
+ * end of the btree node @iter points to, so the whole run is covered by the
+ * node lock held until commit - same as bch2_get_key_or_hole():
+ */
+static int bch2_free_run_end(struct btree_iter *iter, struct bpos end,
+			     u64 genbits, u64 *run_end)
+{
+	struct btree_trans *trans = iter->trans;
+	struct btree_path *path = btree_iter_path(trans, iter);
+	struct btree_iter iter2;
+	struct bkey_s_c k;
+	int ret;
+
+	if (!bpos_eq(path->l[0].b->key.k.p, SPOS_MAX))
+		end = bkey_min(end, bpos_nosnap_successor(path->l[0].b->key.k.p));
+	end = bkey_min(end, POS(iter->pos.inode, iter->pos.offset + KEY_SIZE_MAX));
+
+	*run_end = iter->pos.offset + 1;
+
+	bch2_trans_copy_iter(&iter2, iter);
+	bch2_btree_iter_set_pos(&iter2, POS(iter->pos.inode, *run_end));
+
+	while (!(ret = bkey_err(k = bch2_btree_iter_peek_upto(&iter2, end))) &&
+	       k.k && bkey_lt(k.k->p, end)) {
+		struct bch_alloc_v4 a_convert;
+		const struct bch_alloc_v4 *a = bch2_alloc_to_v4(k, &a_convert);
+
+		if (k.k->p.offset != *run_end ||
+		    a->data_type != BCH_DATA_free ||
+		    alloc_freespace_genbits(*a) != genbits)
+			break;
+
+		++*run_end;
+		bch2_btree_iter_advance(&iter2);
+	}
+
+	bch2_trans_iter_exit(trans, &iter2);
+	return ret;
+}
+
 int bch2_dev_freespace_init(struct bch_fs *c, struct bch_dev *ca,
 			    u64 bucket_start, u64 bucket_end)
 {
@@ -2180,6 +2613,12 @@ int bch2_dev_freespace_init(struct bch_fs *c, struct bch_dev *ca,
 			last_updated = jiffies;
 		}
 
+		/* Background init must get out of the way of going RO: */
+		if (test_bit(BCH_FS_going_ro, &c->flags)) {
+			ret = -BCH_ERR_erofs_no_writes;
+			break;
+		}
+
 		bch2_trans_begin(trans);
 
 		if (bkey_ge(iter.pos, end)) {
@@ -2193,13 +2632,39 @@ int bch2_dev_freespace_init(struct bch_fs *c, struct bch_dev *ca,
 			goto bkey_err;
 
 		if (k.k->type) {
-			/*
-			 * We process live keys in the alloc btree one at a
-			 * time:
-			 */
 			struct bch_alloc_v4 a_convert;
 			const struct bch_alloc_v4 *a = bch2_alloc_to_v4(k, &a_convert);
 
+			if (a->data_type == BCH_DATA_free) {
+				/* Runs of free buckets go in as a single extent: */
+				struct bkey_i *freespace;
+				u64 start = k.k->p.offset, run_end;
+
+				freespace = bch2_trans_kmalloc(trans, sizeof(*freespace));
+				ret =   PTR_ERR_OR_ZERO(freespace) ?:
+					bch2_free_run_end(&iter, end, alloc_freespace_genbits(*a), &run_end);
+				if (ret)
+					goto bkey_err;
+
+				bkey_init(&freespace->k);
+				freespace->k.type	= KEY_TYPE_set;
+				freespace->k.p		= alloc_freespace_pos(k.k->p, *a);
+				bch2_key_resize(&freespace->k, run_end - start);
+
+				ret = bch2_btree_insert_trans(trans, BTREE_ID_freespace, freespace, 0) ?:
+					bch2_trans_commit(trans, NULL, NULL,
+							  BCH_TRANS_COMMIT_no_enospc);
+				if (ret)
+					goto bkey_err;
+
+				bch2_btree_iter_set_pos(&iter, POS(ca->dev_idx, run_end));
+				continue;
+			}
+
+			/*
+			 * Other live keys in the alloc btree are processed one
+			 * at a time:
+			 */
 			ret =   bch2_bucket_do_index(trans, ca, k, a, true) ?:
 				bch2_trans_commit(trans, NULL, NULL,
 						  BCH_TRANS_COMMIT_no_enospc);
@@ -2239,7 +2704,8 @@ bkey_err:
 	bch2_trans_put(trans);
 
 	if (ret < 0) {
-		bch_err_msg(ca, ret, "initializing free space");
+		if (!bch2_err_matches(ret, EROFS))
+			bch_err_msg(ca, ret, "initializing free space");
 		return ret;
 	}
 
@@ -2251,17 +2717,123 @@ bkey_err:
 	return 0;
 }
 
+/*
+ * Buckets past the old end of a device that's being grown have never had alloc
+ * keys, so they're all free: add them to the freespace btree as extents without
+ * scanning the alloc btree, and account for them in the same transaction:
+ */
+int bch2_dev_freespace_grow(struct btree_trans *trans, struct bch_dev *ca,
+			    u64 old_nbuckets, u64 nbuckets)
+{
+	struct disk_accounting_pos acc = {
+		.type = BCH_DISK_ACCOUNTING_dev_data_type,
+		.dev_data_type.dev = ca->dev_idx,
+		.dev_data_type.data_type = BCH_DATA_free,
+	};
+	u64 v[3] = { nbuckets - old_nbuckets, 0, 0 };
+	u64 bucket = max_t(u64, old_nbuckets, ca->mi.first_bucket);
+	int ret = bch2_disk_accounting_mod(trans, &acc, v, ARRAY_SIZE(v), false);
+
+	while (!ret && bucket < nbuckets) {
+		u64 n = min_t(u64, nbuckets - bucket, KEY_SIZE_MAX);
+		struct bkey_i *k = bch2_trans_kmalloc(trans, sizeof(*k));
+
+		ret = PTR_ERR_OR_ZERO(k);
+		if (ret)
+			break;
+
+		bkey_init(&k->k);
+		k->k.type	= KEY_TYPE_set;
+		k->k.p		= POS(ca->dev_idx, bucket + n);
+		k->k.size	= n;
+
+		ret = bch2_btree_insert_trans(trans, BTREE_ID_freespace, k, 0);
+		bucket += n;
+	}
+
+	return ret;
+}
+
+static CLOSURE_CALLBACK(bch2_dev_freespace_init_thread)
+{
+	closure_type(ca, struct bch_dev, freespace_init_cl);
+
+	ca->freespace_init_ret = bch2_dev_freespace_init(ca->fs, ca, 0, ca->mi.nbuckets);
+	bch2_dev_put(ca);
+	closure_return(cl);
+}
+
+/*
+ * With lazy_freespace_init, devices whose freespace btree hasn't been built
+ * are initialized in the background once we're read-write: until then the
+ * allocator falls back to scanning the alloc btree (bch2_bucket_alloc_early()),
+ * and the alloc trigger keeps the index up to date for buckets that change
+ * underneath the scan:
+ */
+static void bch2_dev_freespace_init_work(struct work_struct *work)
+{
+	struct bch_dev *ca = container_of(work, struct bch_dev, freespace_init_work);
+	struct bch_fs *c = ca->fs;
+
+	bch_info(ca, "initializing freespace in the background");
+
+	int ret = bch2_dev_freespace_init(c, ca, 0, ca->mi.nbuckets) ?:
+		bch2_dev_free_summary_init(c, ca);
+	if (!ret) {
+		mutex_lock(&c->sb_lock);
+		bch2_write_super(c);
+		mutex_unlock(&c->sb_lock);
+		bch_info(ca, "done initializing freespace");
+	}
+
+	bch2_write_ref_put(c, BCH_WRITE_REF_freespace_init);
+	percpu_ref_put(&ca->io_ref);
+}
+
+void bch2_do_freespace_init(struct bch_fs *c)
+{
+	for_each_member_device(c, ca) {
+		if (ca->mi.freespace_initialized)
+			continue;
+
+		if (!bch2_dev_get_ioref(c, ca->dev_idx, WRITE))
+			continue;
+
+		if (!bch2_write_ref_tryget(c, BCH_WRITE_REF_freespace_init)) {
+			percpu_ref_put(&ca->io_ref);
+			continue;
+		}
+
+		if (!queue_work(c->write_ref_wq, &ca->freespace_init_work)) {
+			bch2_write_ref_put(c, BCH_WRITE_REF_freespace_init);
+			percpu_ref_put(&ca->io_ref);
+		}
+	}
+}
+
 int bch2_fs_freespace_init(struct bch_fs *c)
 {
+	struct closure cl;
 	int ret = 0;
 	bool doing_init = false;
 
+	if (c->opts.lazy_freespace_init) {
+		bch2_do_freespace_init(c);
+		goto summary;
+	}
+
 	/*
 	 * We can crash during the device add path, so we need to check this on
-	 * every mount:
+	 * every mount.
+	 *
+	 * Devices are independent, so with many devices (or big ones) we scan
+	 * them all in parallel:
 	 */
+	closure_init_stack(&cl);
 
 	for_each_member_device(c, ca) {
+		ca->freespace_init_ret = 0;
+
 		if (ca->mi.freespace_initialized)
 			continue;
 
@@ -2270,12 +2842,20 @@ int bch2_fs_freespace_init(struct bch_fs *c)
 			doing_init = true;
 		}
 
-		ret = bch2_dev_freespace_init(c, ca, 0, ca->mi.nbuckets);
-		if (ret) {
-			bch2_dev_put(ca);
-			bch_err_fn(c, ret);
-			return ret;
-		}
+		bch2_dev_get(ca);
+		closure_call(&ca->freespace_init_cl,
+			     bch2_dev_freespace_init_thread,
+			     system_unbound_wq, &cl);
+	}
+
+	closure_sync(&cl);
+
+	for_each_member_device(c, ca)
+		if (!ret)
+			ret = ca->freespace_init_ret;
+	if (ret) {
+		bch_err_fn(c, ret);
+		return ret;
 	}
 
 	if (doing_init) {
@@ -2284,6 +2864,18 @@ int bch2_fs_freespace_init(struct bch_fs *c)
 		mutex_unlock(&c->sb_lock);
 		bch_verbose(c, "done initializing freespace");
 	}
+summary:
+	/* Devices still being initialized in the background do this when done: */
+	for_each_member_device(c, ca) {
+		if (!ca->mi.freespace_initialized)
+			continue;
+
+		ret = bch2_dev_free_summary_init(c, ca);
+		if (ret) {
+			bch2_dev_put(ca);
+			return ret;
+		}
+	}
 
 	return 0;
 }
@@ -2322,21 +2914,27 @@ out:
 
 /* Startup/shutdown (ro/rw): */
 
-void bch2_recalc_capacity(struct bch_fs *c)
+unsigned long bch2_fs_ra_pages(struct bch_fs *c)
 {
-	u64 capacity = 0, reserved_sectors = 0, gc_reserve;
-	unsigned bucket_size_max = 0;
 	unsigned long ra_pages = 0;
 
-	lockdep_assert_held(&c->state_lock);
-
 	for_each_online_member(c, ca) {
 		struct backing_dev_info *bdi = ca->disk_sb.bdev->bd_disk->bdi;
 
 		ra_pages += bdi->ra_pages;
 	}
 
-	bch2_set_ra_pages(c, ra_pages);
+	return ra_pages;
+}
+
+void bch2_recalc_capacity(struct bch_fs *c)
+{
+	u64 capacity = 0, reserved_sectors = 0, gc_reserve;
+	unsigned bucket_size_max = 0;
+
+	lockdep_assert_held(&c->state_lock);
+
+	bch2_set_ra_pages(c, bch2_fs_ra_pages(c));
 
 	for_each_rw_member(c, ca) {
 		u64 dev_reserve = 0;
@@ -2405,11 +3003,10 @@ u64 bch2_min_rw_member_capacity(struct bch_fs *c)
 static bool bch2_dev_has_open_write_point(struct bch_fs *c, struct bch_dev *ca)
 {
 	struct open_bucket *ob;
+	unsigned i;
 	bool ret = false;
 
-	for (ob = c->open_buckets;
-	     ob < c->open_buckets + ARRAY_SIZE(c->open_buckets);
-	     ob++) {
+	for_each_open_bucket(c, ob, i) {
 		spin_lock(&ob->lock);
 		if (ob->valid && !ob->on_partial_list &&
 		    ob->dev == ca->dev_idx)
@@ -2467,15 +3064,21 @@ void bch2_dev_allocator_add(struct bch_fs *c, struct bch_dev *ca)
 
 void bch2_dev_allocator_background_exit(struct bch_dev *ca)
 {
+	kvfree(rcu_dereference_protected(ca->free_summary, 1));
 	darray_exit(&ca->discard_buckets_in_flight);
 }
 
 void bch2_dev_allocator_background_init(struct bch_dev *ca)
 {
 	mutex_init(&ca->discard_buckets_in_flight_lock);
+	init_waitqueue_head(&ca->discard_wait);
+	spin_lock_init(&ca->discard_ratelimit_lock);
+	bch2_ratelimit_reset(&ca->discard_bytes_ratelimit);
+	bch2_ratelimit_reset(&ca->discard_iops_ratelimit);
 	INIT_WORK(&ca->discard_work, bch2_do_discards_work);
 	INIT_WORK(&ca->discard_fast_work, bch2_do_discards_fast_work);
 	INIT_WORK(&ca->invalidate_work, bch2_do_invalidates_work);
+	INIT_WORK(&ca->freespace_init_work, bch2_dev_freespace_init_work);
 }
 
 void bch2_fs_allocator_background_init(struct bch_fs *c)
@@ -308,6 +308,8 @@ int bch2_trigger_alloc(struct btree_trans *, enum btree_id, unsigned,
 		       enum btree_iter_update_trigger_flags);
 int bch2_check_alloc_info(struct bch_fs *);
 int bch2_check_alloc_to_lru_refs(struct bch_fs *);
+void bch2_dev_discard_buckets(struct bch_dev *, u64 *, size_t);
+void bch2_dev_discard_backlog_to_text(struct printbuf *, struct bch_dev *);
 void bch2_dev_do_discards(struct bch_dev *);
 void bch2_do_discards(struct bch_fs *);
 
@@ -339,8 +341,13 @@ static inline const struct bch_backpointer *alloc_v4_backpointers_c(const struct
 }
 
 int bch2_dev_freespace_init(struct bch_fs *, struct bch_dev *, u64, u64);
+u64 bch2_dev_free_summary_next(struct bch_dev *, u64);
+int bch2_dev_free_summary_init(struct bch_fs *, struct bch_dev *);
+int bch2_dev_freespace_grow(struct btree_trans *, struct bch_dev *, u64, u64);
+void bch2_do_freespace_init(struct bch_fs *);
 int bch2_fs_freespace_init(struct bch_fs *);
 
+unsigned long bch2_fs_ra_pages(struct bch_fs *);
 void bch2_recalc_capacity(struct bch_fs *);
 u64 bch2_min_rw_member_capacity(struct bch_fs *);
 
@@ -77,7 +77,7 @@ void bch2_reset_alloc_cursors(struct bch_fs *c)
 
 static void bch2_open_bucket_hash_add(struct bch_fs *c, struct open_bucket *ob)
 {
-	open_bucket_idx_t idx = ob - c->open_buckets;
+	open_bucket_idx_t idx = ob->idx;
 	open_bucket_idx_t *slot = open_bucket_hashslot(c, ob->dev, ob->bucket);
 
 	ob->hash = *slot;
@@ -86,12 +86,12 @@ static void bch2_open_bucket_hash_add(struct bch_fs *c, struct open_bucket *ob)
 
 static void bch2_open_bucket_hash_remove(struct bch_fs *c, struct open_bucket *ob)
 {
-	open_bucket_idx_t idx = ob - c->open_buckets;
+	open_bucket_idx_t idx = ob->idx;
 	open_bucket_idx_t *slot = open_bucket_hashslot(c, ob->dev, ob->bucket);
 
 	while (*slot != idx) {
 		BUG_ON(!*slot);
-		slot = &c->open_buckets[*slot].hash;
+		slot = &ob_from_idx(c, *slot)->hash;
 	}
 
 	*slot = ob->hash;
@@ -120,7 +120,7 @@ void __bch2_open_bucket_put(struct bch_fs *c, struct open_bucket *ob)
 	bch2_open_bucket_hash_remove(c, ob);
 
 	ob->freelist = c->open_buckets_freelist;
-	c->open_buckets_freelist = ob - c->open_buckets;
+	c->open_buckets_freelist = ob->idx;
 
 	c->open_buckets_nr_free++;
 	ca->nr_open_buckets--;
@@ -141,18 +141,99 @@ void bch2_open_bucket_write_error(struct bch_fs *c,
 			bch2_ec_bucket_cancel(c, ob);
 }
 
+static inline unsigned open_buckets_reserved(struct bch_fs *c,
+						enum bch_watermark watermark)
+{
+	unsigned nr = READ_ONCE(c->open_buckets_nr);
+
+	switch (watermark) {
+	case BCH_WATERMARK_interior_updates:
+		return 0;
+	case BCH_WATERMARK_reclaim:
+		return nr / 6;
+	case BCH_WATERMARK_btree:
+	case BCH_WATERMARK_btree_copygc:
+		return nr / 4;
+	case BCH_WATERMARK_copygc:
+		return nr / 3;
+	default:
+		return nr / 2;
+	}
+}
+
+/*
+ * Open buckets per device, for normal allocations, when there's more than one
+ * device: one device that's slow to fill its buckets shouldn't be able to pin
+ * the entire table, which would stall allocations from every other device
+ */
+static inline unsigned open_buckets_dev_quota(struct bch_fs *c)
+{
+	unsigned nr_devs = dev_mask_nr(&c->rw_devs[BCH_DATA_user]);
+	unsigned nr = READ_ONCE(c->open_buckets_nr);
+
+	return nr_devs > 1
+		? max(nr / 4, nr * 2 / nr_devs)
+		: UINT_MAX;
+}
+
+static void bch2_open_buckets_grow_work(struct work_struct *work)
+{
+	struct bch_fs *c = container_of(work, struct bch_fs, open_buckets_grow_work);
+	unsigned nr = READ_ONCE(c->open_buckets_nr);
+	struct open_bucket *chunk, *ob;
+
+	/* Don't grow the table if it would strand too much free space: */
+	if (nr >= OPEN_BUCKETS_MAX ||
+	    (u64) (nr + OPEN_BUCKETS_COUNT) * c->bucket_size_max * 32 >
+	    bch2_fs_usage_read_short(c).free)
+		return;
+
+	chunk = kvzalloc(OPEN_BUCKETS_COUNT * sizeof(*chunk), GFP_KERNEL);
+	if (!chunk)
+		return;
+
+	for (ob = chunk; ob < chunk + OPEN_BUCKETS_COUNT; ob++) {
+		spin_lock_init(&ob->lock);
+		ob->idx = nr + (ob - chunk);
+	}
+
+	spin_lock(&c->freelist_lock);
+	c->open_bucket_chunks[nr / OPEN_BUCKETS_COUNT] = chunk;
+
+	for (ob = chunk; ob < chunk + OPEN_BUCKETS_COUNT; ob++) {
+		ob->freelist = c->open_buckets_freelist;
+		c->open_buckets_freelist = ob->idx;
+	}
+	c->open_buckets_nr_free += OPEN_BUCKETS_COUNT;
+
+	/* order the chunk pointer vs. unlocked table walkers: */
+	smp_store_release(&c->open_buckets_nr, nr + OPEN_BUCKETS_COUNT);
+	spin_unlock(&c->freelist_lock);
+
+	closure_wake_up(&c->open_buckets_wait);
+}
+
 static struct open_bucket *bch2_open_bucket_alloc(struct bch_fs *c)
 {
 	struct open_bucket *ob;
 
 	BUG_ON(!c->open_buckets_freelist || !c->open_buckets_nr_free);
 
-	ob = c->open_buckets + c->open_buckets_freelist;
+	ob = ob_from_idx(c, c->open_buckets_freelist);
 	c->open_buckets_freelist = ob->freelist;
 	atomic_set(&ob->pin, 1);
 	ob->data_type = 0;
 
 	c->open_buckets_nr_free--;
+
+	/*
+	 * Normal allocations block once they've eaten through half the table -
+	 * start growing it before we get there:
+	 */
+	if (c->open_buckets_nr_free <=
+	    open_buckets_reserved(c, BCH_WATERMARK_normal) + OPEN_BUCKETS_COUNT / 8 &&
+	    c->open_buckets_nr < OPEN_BUCKETS_MAX)
+		queue_work(system_unbound_wq, &c->open_buckets_grow_work);
 	return ob;
 }
 
@@ -163,8 +244,7 @@ static void open_bucket_free_unused(struct bch_fs *c, struct open_bucket *ob)
 
 	spin_lock(&c->freelist_lock);
 	ob->on_partial_list = true;
-	c->open_buckets_partial[c->open_buckets_partial_nr++] =
-		ob - c->open_buckets;
+	c->open_buckets_partial[c->open_buckets_partial_nr++] = ob->idx;
 	spin_unlock(&c->freelist_lock);
 
 	closure_wake_up(&c->open_buckets_wait);
@@ -185,23 +265,6 @@ long bch2_bucket_alloc_new_fs(struct bch_dev *ca)
 	return -1;
 }
 
-static inline unsigned open_buckets_reserved(enum bch_watermark watermark)
-{
-	switch (watermark) {
-	case BCH_WATERMARK_interior_updates:
-		return 0;
-	case BCH_WATERMARK_reclaim:
-		return OPEN_BUCKETS_COUNT / 6;
-	case BCH_WATERMARK_btree:
-	case BCH_WATERMARK_btree_copygc:
-		return OPEN_BUCKETS_COUNT / 4;
-	case BCH_WATERMARK_copygc:
-		return OPEN_BUCKETS_COUNT / 3;
-	default:
-		return OPEN_BUCKETS_COUNT / 2;
-	}
-}
-
 static struct open_bucket *__try_alloc_bucket(struct bch_fs *c, struct bch_dev *ca,
 					      u64 bucket,
 					      enum bch_watermark watermark,
@@ -234,15 +297,29 @@ static struct open_bucket *__try_alloc_bucket(struct bch_fs *c, struct bch_dev *
 
 	spin_lock(&c->freelist_lock);
 
-	if (unlikely(c->open_buckets_nr_free <= open_buckets_reserved(watermark))) {
+	if (unlikely(c->open_buckets_nr_free <= open_buckets_reserved(c, watermark))) {
 		if (cl)
 			closure_wait(&c->open_buckets_wait, cl);
 
+		if (c->open_buckets_nr < OPEN_BUCKETS_MAX)
+			queue_work(system_unbound_wq, &c->open_buckets_grow_work);
+
 		track_event_change(&c->times[BCH_TIME_blocked_allocate_open_bucket], true);
+		track_event_change(&c->times[BCH_TIME_blocked_allocate_open_bucket_stripe + watermark], true);
 		spin_unlock(&c->freelist_lock);
 		return ERR_PTR(-BCH_ERR_open_buckets_empty);
 	}
 
+	if (unlikely(watermark < BCH_WATERMARK_btree &&
+		     ca->nr_open_buckets >= open_buckets_dev_quota(c))) {
+		if (cl)
+			closure_wait(&c->open_buckets_wait, cl);
+
+		track_event_change(&c->times[BCH_TIME_blocked_allocate_open_bucket_stripe + watermark], true);
+		spin_unlock(&c->freelist_lock);
+		return ERR_PTR(-BCH_ERR_open_buckets_dev_quota);
+	}
+
 	/* Recheck under lock: */
 	if (bch2_bucket_is_open(c, ca->dev_idx, bucket)) {
 		spin_unlock(&c->freelist_lock);
@@ -265,6 +342,7 @@ static struct open_bucket *__try_alloc_bucket(struct bch_fs *c, struct bch_dev *
 	bch2_open_bucket_hash_add(c, ob);
 
 	track_event_change(&c->times[BCH_TIME_blocked_allocate_open_bucket], false);
+	track_event_change(&c->times[BCH_TIME_blocked_allocate_open_bucket_stripe + watermark], false);
 	track_event_change(&c->times[BCH_TIME_blocked_allocate], false);
 
 	spin_unlock(&c->freelist_lock);
@@ -484,6 +562,7 @@ static struct open_bucket *bch2_bucket_alloc_freelist(struct btree_trans *trans,
 	u64 *dev_alloc_cursor = &ca->alloc_cursor[s->btree_bitmap];
 	u64 alloc_start = max_t(u64, ca->mi.first_bucket, READ_ONCE(*dev_alloc_cursor));
 	u64 alloc_cursor = alloc_start;
+	bool use_summary = true, summary_skipped = false;
 	int ret;
 
 	BUG_ON(ca->new_fs_bucket_idx);
@@ -493,6 +572,31 @@ again:
 		if (k.k->p.inode != ca->dev_idx)
 			break;
 
+		if (use_summary) {
+			u64 genbits = bkey_start_offset(k.k) >> 56;
+			u64 bucket = max(alloc_cursor, bkey_start_offset(k.k)) & ~(~0ULL << 56);
+			u64 next = bch2_dev_free_summary_next(ca, bucket);
+
+			if (next != bucket) {
+				/* no free buckets until @next: */
+				s->skipped_free_summary++;
+				summary_skipped = true;
+
+				if (next == U64_MAX) {
+					if (genbits == U8_MAX)
+						break;
+					alloc_cursor = (genbits + 1) << 56;
+				} else {
+					alloc_cursor = next | (genbits << 56);
+				}
+
+				if (alloc_cursor >= k.k->p.offset) {
+					bch2_btree_iter_set_pos(&iter, POS(ca->dev_idx, alloc_cursor));
+					continue;
+				}
+			}
+		}
+
 		for (alloc_cursor = max(alloc_cursor, bkey_start_offset(k.k));
 		     alloc_cursor < k.k->p.offset;
 		     alloc_cursor++) {
@@ -540,6 +644,13 @@ fail:
 		goto again;
 	}
 
+	/* The summary is only a hint - if it didn't find anything, do a full scan: */
+	if (!ob && summary_skipped) {
+		use_summary = summary_skipped = false;
+		alloc_cursor = alloc_start = ca->mi.first_bucket;
+		goto again;
+	}
+
 	*dev_alloc_cursor = alloc_cursor;
 
 	return ob;
@@ -564,14 +675,15 @@ static noinline void trace_bucket_alloc2(struct bch_fs *c, struct bch_dev *ca,
 	prt_printf(&buf, "free\t%llu\n",	usage->d[BCH_DATA_free].buckets);
 	prt_printf(&buf, "avail\t%llu\n",	dev_buckets_free(ca, *usage, watermark));
 	prt_printf(&buf, "copygc_wait\t%lu/%lli\n",
-		   bch2_copygc_wait_amount(c),
-		   c->copygc_wait - atomic64_read(&c->io_clock[WRITE].now));
+		   bch2_copygc_dev_wait_amount(ca),
+		   ca->copygc_wait - atomic64_read(&c->io_clock[WRITE].now));
 	prt_printf(&buf, "seen\t%llu\n",	s->buckets_seen);
 	prt_printf(&buf, "open\t%llu\n",	s->skipped_open);
 	prt_printf(&buf, "need journal commit\t%llu\n", s->skipped_need_journal_commit);
 	prt_printf(&buf, "nocow\t%llu\n",	s->skipped_nocow);
 	prt_printf(&buf, "nouse\t%llu\n",	s->skipped_nouse);
 	prt_printf(&buf, "mi_btree_bitmap\t%llu\n", s->skipped_mi_btree_bitmap);
+	prt_printf(&buf, "free_summary\t%llu\n", s->skipped_free_summary);
 
 	if (!IS_ERR(ob)) {
 		prt_printf(&buf, "allocated\t%llu\n", ob->bucket);
@@ -689,29 +801,56 @@ struct open_bucket *bch2_bucket_alloc(struct bch_fs *c, struct bch_dev *ca,
 	return ob;
 }
 
-static int __dev_stripe_cmp(struct dev_stripe_state *stripe,
-			    unsigned l, unsigned r)
+static inline bool dev_stripe_lt(struct dev_stripe_state *stripe, u8 l, u8 r)
 {
-	return ((stripe->next_alloc[l] > stripe->next_alloc[r]) -
-		(stripe->next_alloc[l] < stripe->next_alloc[r]));
+	return stripe->next_alloc[l] != stripe->next_alloc[r]
+		? stripe->next_alloc[l] < stripe->next_alloc[r]
+		: l < r;
 }
 
-#define dev_stripe_cmp(l, r) __dev_stripe_cmp(stripe, l, r)
+/*
+ * Insertion sort: since the last resort only one device's next_alloc has
+ * increased, and the rescaling in bch2_dev_stripe_increment() preserves
+ * order, so this is nearly always a single pass:
+ */
+static void dev_stripe_resort(struct dev_stripe_state *stripe)
+{
+	if (unlikely(!stripe->sorted_init)) {
+		for (unsigned i = 0; i < BCH_SB_MEMBERS_MAX; i++)
+			stripe->sorted[i] = i;
+		stripe->sorted_init = true;
+	}
+
+	for (unsigned i = 1; i < BCH_SB_MEMBERS_MAX; i++) {
+		u8 dev = stripe->sorted[i];
+		unsigned j = i;
+
+		while (j && dev_stripe_lt(stripe, dev, stripe->sorted[j - 1])) {
+			stripe->sorted[j] = stripe->sorted[j - 1];
+			--j;
+		}
+		stripe->sorted[j] = dev;
+	}
+}
 
 struct dev_alloc_list bch2_dev_alloc_list(struct bch_fs *c,
 					  struct dev_stripe_state *stripe,
 					  struct bch_devs_mask *devs)
 {
 	struct dev_alloc_list ret = { .nr = 0 };
-	unsigned i;
 
-	for_each_set_bit(i, devs->d, BCH_SB_MEMBERS_MAX)
-		ret.devs[ret.nr++] = i;
+	if (unlikely(!stripe->sorted_init))
+		dev_stripe_resort(stripe);
+
+	for (unsigned i = 0; i < BCH_SB_MEMBERS_MAX; i++)
+		if (test_bit(stripe->sorted[i], devs->d))
+			ret.devs[ret.nr++] = stripe->sorted[i];
 
-	bubble_sort(ret.devs, ret.nr, dev_stripe_cmp);
 	return ret;
 }
 
+#define DEV_CONGESTED_WRITE_PENALTY	8
+
 static inline void bch2_dev_stripe_increment_inlined(struct bch_dev *ca,
 			       struct dev_stripe_state *stripe,
 			       struct bch_dev_usage *usage)
@@ -723,6 +862,16 @@ static inline void bch2_dev_stripe_increment_inlined(struct bch_dev *ca,
 		: 1ULL << 48;
 	u64 scale = *v / 4;
 
+	/*
+	 * A congested device - one whose recent IOs have been much slower than
+	 * it's normally capable of - gets a smaller share of new writes, down
+	 * to 1/DEV_CONGESTED_WRITE_PENALTY at CONGESTED_MAX, so that one sick
+	 * or overloaded device doesn't limit the whole target:
+	 */
+	free_space_inv += div_u64(free_space_inv * (DEV_CONGESTED_WRITE_PENALTY - 1) *
+				  min_t(u64, bch2_dev_congested(ca), CONGESTED_MAX),
+				  CONGESTED_MAX);
+
 	if (*v + free_space_inv >= *v)
 		*v += free_space_inv;
 	else
@@ -731,6 +880,8 @@ static inline void bch2_dev_stripe_increment_inlined(struct bch_dev *ca,
 	for (v = stripe->next_alloc;
 	     v < stripe->next_alloc + ARRAY_SIZE(stripe->next_alloc); v++)
 		*v = *v < scale ? 0 : *v - scale;
+
+	dev_stripe_resort(stripe);
 }
 
 void bch2_dev_stripe_increment(struct bch_dev *ca,
@@ -870,7 +1021,7 @@ static int bucket_alloc_from_stripe(struct btree_trans *trans,
 			if (!h->s->blocks[ec_idx])
 				continue;
 
-			ob = c->open_buckets + h->s->blocks[ec_idx];
+			ob = ob_from_idx(c, h->s->blocks[ec_idx]);
 			if (ob->dev == devs_sorted.devs[i] &&
 			    !test_and_set_bit(ec_idx, h->s->blocks_allocated))
 				goto got_bucket;
@@ -964,7 +1115,7 @@ static int bucket_alloc_set_partial(struct bch_fs *c,
 		goto unlock;
 
 	for (i = c->open_buckets_partial_nr - 1; i >= 0; --i) {
-		struct open_bucket *ob = c->open_buckets + c->open_buckets_partial[i];
+		struct open_bucket *ob = ob_from_idx(c, c->open_buckets_partial[i]);
 
 		if (want_bucket(c, wp, devs_may_alloc, have_cache, ec, ob)) {
 			struct bch_dev *ca = ob_dev(c, ob);
@@ -1130,7 +1281,7 @@ static bool should_drop_bucket(struct open_bucket *ob, struct bch_fs *c,
 				if (!ob->ec->blocks[i])
 					continue;
 
-				ob2 = c->open_buckets + ob->ec->blocks[i];
+				ob2 = ob_from_idx(c, ob->ec->blocks[i]);
 				drop |= ob2->dev == ca->dev_idx;
 			}
 			mutex_unlock(&ob->ec->lock);
@@ -1165,10 +1316,12 @@ void bch2_open_buckets_stop(struct bch_fs *c, struct bch_dev *ca,
 	unsigned i;
 
 	/* Next, close write points that point to this device... */
-	for (i = 0; i < ARRAY_SIZE(c->write_points); i++)
+	for (i = 0; i < c->write_points_max; i++)
 		bch2_writepoint_stop(c, ca, ec, &c->write_points[i]);
 
 	bch2_writepoint_stop(c, ca, ec, &c->copygc_write_point);
+	bch2_writepoint_stop(c, ca, ec, &c->copygc_cold_write_point);
+	bch2_writepoint_stop(c, ca, ec, &c->ec_compact_write_point);
 	bch2_writepoint_stop(c, ca, ec, &c->rebalance_write_point);
 	bch2_writepoint_stop(c, ca, ec, &c->btree_write_point);
 
@@ -1185,7 +1338,7 @@ void bch2_open_buckets_stop(struct bch_fs *c, struct bch_dev *ca,
 	i = 0;
 	while (i < c->open_buckets_partial_nr) {
 		struct open_bucket *ob =
-			c->open_buckets + c->open_buckets_partial[i];
+			ob_from_idx(c, c->open_buckets_partial[i]);
 
 		if (should_drop_bucket(ob, c, ca, ec)) {
 			--c->open_buckets_partial_nr;
@@ -1208,7 +1361,7 @@ static inline struct hlist_head *writepoint_hash(struct bch_fs *c,
 						 unsigned long write_point)
 {
 	unsigned hash =
-		hash_long(write_point, ilog2(ARRAY_SIZE(c->write_points_hash)));
+		hash_long(write_point, ilog2(c->write_points_max));
 
 	return &c->write_points_hash[hash];
 }
@@ -1240,7 +1393,8 @@ static bool try_increase_writepoints(struct bch_fs *c)
 {
 	struct write_point *wp;
 
-	if (c->write_points_nr == ARRAY_SIZE(c->write_points) ||
+	if (c->write_points_nr == c->write_points_max ||
+	    c->open_buckets_nr_free < c->open_buckets_nr / 4 ||
 	    too_many_writepoints(c, 32))
 		return false;
 
@@ -1548,36 +1702,79 @@ static inline void writepoint_init(struct write_point *wp,
 void bch2_fs_allocator_foreground_init(struct bch_fs *c)
 {
 	struct open_bucket *ob;
-	struct write_point *wp;
+
+	BUILD_BUG_ON(BCH_TIME_blocked_allocate_open_bucket_interior_updates -
+		     BCH_TIME_blocked_allocate_open_bucket_stripe !=
+		     BCH_WATERMARK_interior_updates - BCH_WATERMARK_stripe);
 
 	mutex_init(&c->write_points_hash_lock);
-	c->write_points_nr = ARRAY_SIZE(c->write_points);
+	INIT_WORK(&c->open_buckets_grow_work, bch2_open_buckets_grow_work);
+
+	c->open_bucket_chunks[0]	= c->open_buckets_initial;
+	c->open_buckets_nr		= OPEN_BUCKETS_COUNT;
 
 	/* open bucket 0 is a sentinal NULL: */
-	spin_lock_init(&c->open_buckets[0].lock);
+	spin_lock_init(&c->open_buckets_initial[0].lock);
 
-	for (ob = c->open_buckets + 1;
-	     ob < c->open_buckets + ARRAY_SIZE(c->open_buckets); ob++) {
+	for (ob = c->open_buckets_initial + 1;
+	     ob < c->open_buckets_initial + OPEN_BUCKETS_COUNT; ob++) {
 		spin_lock_init(&ob->lock);
+		ob->idx = ob - c->open_buckets_initial;
 		c->open_buckets_nr_free++;
 
 		ob->freelist = c->open_buckets_freelist;
-		c->open_buckets_freelist = ob - c->open_buckets;
+		c->open_buckets_freelist = ob->idx;
 	}
 
 	writepoint_init(&c->btree_write_point,		BCH_DATA_btree);
 	writepoint_init(&c->rebalance_write_point,	BCH_DATA_user);
 	writepoint_init(&c->copygc_write_point,		BCH_DATA_user);
+	writepoint_init(&c->copygc_cold_write_point,	BCH_DATA_user);
+	writepoint_init(&c->ec_compact_write_point,	BCH_DATA_user);
+}
+
+void bch2_fs_allocator_foreground_exit(struct bch_fs *c)
+{
+	unsigned i;
+
+	cancel_work_sync(&c->open_buckets_grow_work);
+
+	for (i = 1; i < OPEN_BUCKETS_CHUNKS; i++)
+		kvfree(c->open_bucket_chunks[i]);
+
+	kvfree(c->write_points_hash);
+	kvfree(c->write_points);
+}
+
+int bch2_fs_write_points_init(struct bch_fs *c)
+{
+	struct write_point *wp;
+	unsigned nr = clamp_t(unsigned,
+			      roundup_pow_of_two(num_possible_cpus() * WRITE_POINTS_PER_CPU),
+			      WRITE_POINT_MIN, WRITE_POINT_MAX);
+
+	c->write_points		= kvzalloc(nr * sizeof(c->write_points[0]), GFP_KERNEL);
+	c->write_points_hash	= kvzalloc(nr * sizeof(c->write_points_hash[0]), GFP_KERNEL);
+	if (!c->write_points || !c->write_points_hash)
+		return -BCH_ERR_ENOMEM_fs_write_points_init;
+
+	c->write_points_max	= nr;
 
 	for (wp = c->write_points;
-	     wp < c->write_points + c->write_points_nr; wp++) {
+	     wp < c->write_points + c->write_points_max; wp++) {
 		writepoint_init(wp, BCH_DATA_user);
 
 		wp->last_used	= local_clock();
 		wp->write_point	= (unsigned long) wp;
+	}
+
+	c->write_points_nr = WRITE_POINT_MIN;
+
+	for (wp = c->write_points;
+	     wp < c->write_points + c->write_points_nr; wp++)
 		hlist_add_head_rcu(&wp->node,
 				   writepoint_hash(c, wp->write_point));
-	}
+	return 0;
 }
 
 void bch2_open_bucket_to_text(struct printbuf *out, struct bch_fs *c, struct open_bucket *ob)
@@ -1586,8 +1783,8 @@ void bch2_open_bucket_to_text(struct printbuf *out, struct bch_fs *c, struct ope
 	unsigned data_type = ob->data_type;
 	barrier(); /* READ_ONCE() doesn't work on bitfields */
 
-	prt_printf(out, "%zu ref %u ",
-		   ob - c->open_buckets,
+	prt_printf(out, "%u ref %u ",
+		   ob->idx,
 		   atomic_read(&ob->pin));
 	bch2_prt_data_type(out, data_type);
 	prt_printf(out, " %u:%llu gen %u allocated %u/%u",
@@ -1604,12 +1801,11 @@ void bch2_open_buckets_to_text(struct printbuf *out, struct bch_fs *c,
 			       struct bch_dev *ca)
 {
 	struct open_bucket *ob;
+	unsigned i;
 
 	out->atomic++;
 
-	for (ob = c->open_buckets;
-	     ob < c->open_buckets + ARRAY_SIZE(c->open_buckets);
-	     ob++) {
+	for_each_open_bucket(c, ob, i) {
 		spin_lock(&ob->lock);
 		if (ob->valid && !ob->on_partial_list &&
 		    (!ca || ob->dev == ca->dev_idx))
@@ -1629,7 +1825,7 @@ void bch2_open_buckets_partial_to_text(struct printbuf *out, struct bch_fs *c)
 
 	for (i = 0; i < c->open_buckets_partial_nr; i++)
 		bch2_open_bucket_to_text(out, c,
-				c->open_buckets + c->open_buckets_partial[i]);
+				ob_from_idx(c, c->open_buckets_partial[i]));
 
 	spin_unlock(&c->freelist_lock);
 	--out->atomic;
@@ -1673,13 +1869,19 @@ void bch2_write_points_to_text(struct printbuf *out, struct bch_fs *c)
 
 	prt_str(out, "Foreground write points\n");
 	for (wp = c->write_points;
-	     wp < c->write_points + ARRAY_SIZE(c->write_points);
+	     wp < c->write_points + c->write_points_nr;
 	     wp++)
 		bch2_write_point_to_text(out, c, wp);
 
 	prt_str(out, "Copygc write point\n");
 	bch2_write_point_to_text(out, c, &c->copygc_write_point);
 
+	prt_str(out, "Copygc cold write point\n");
+	bch2_write_point_to_text(out, c, &c->copygc_cold_write_point);
+
+	prt_str(out, "Stripe compaction write point\n");
+	bch2_write_point_to_text(out, c, &c->ec_compact_write_point);
+
 	prt_str(out, "Rebalance write point\n");
 	bch2_write_point_to_text(out, c, &c->rebalance_write_point);
 
@@ -1689,12 +1891,13 @@ void bch2_write_points_to_text(struct printbuf *out, struct bch_fs *c)
 
 void bch2_fs_alloc_debug_to_text(struct printbuf *out, struct bch_fs *c)
 {
-	unsigned nr[BCH_DATA_NR];
+	struct open_bucket *ob;
+	unsigned i, nr[BCH_DATA_NR];
 
 	memset(nr, 0, sizeof(nr));
 
-	for (unsigned i = 0; i < ARRAY_SIZE(c->open_buckets); i++)
-		nr[c->open_buckets[i].data_type]++;
+	for_each_open_bucket(c, ob, i)
+		nr[ob->data_type]++;
 
 	printbuf_tabstops_reset(out);
 	printbuf_tabstop_push(out, 24);
@@ -1711,8 +1914,9 @@ void bch2_fs_alloc_debug_to_text(struct printbuf *out, struct bch_fs *c)
 
 	prt_newline(out);
 	prt_printf(out, "freelist_wait\t%s\n",			c->freelist_wait.list.first ? "waiting" : "empty");
-	prt_printf(out, "open buckets allocated\t%i\n",		OPEN_BUCKETS_COUNT - c->open_buckets_nr_free);
-	prt_printf(out, "open buckets total\t%u\n",		OPEN_BUCKETS_COUNT);
+	prt_printf(out, "open buckets allocated\t%i\n",		c->open_buckets_nr - c->open_buckets_nr_free);
+	prt_printf(out, "open buckets total\t%u\n",		c->open_buckets_nr);
+	prt_printf(out, "open buckets max\t%u\n",		OPEN_BUCKETS_MAX);
 	prt_printf(out, "open_buckets_wait\t%s\n",		c->open_buckets_wait.list.first ? "waiting" : "empty");
 	prt_printf(out, "open_buckets_btree\t%u\n",		nr[BCH_DATA_btree]);
 	prt_printf(out, "open_buckets_user\t%u\n",		nr[BCH_DATA_user]);
@@ -1723,12 +1927,13 @@ void bch2_dev_alloc_debug_to_text(struct printbuf *out, struct bch_dev *ca)
 {
 	struct bch_fs *c = ca->fs;
 	struct bch_dev_usage stats = bch2_dev_usage_read(ca);
-	unsigned nr[BCH_DATA_NR];
+	struct open_bucket *ob;
+	unsigned i, nr[BCH_DATA_NR];
 
 	memset(nr, 0, sizeof(nr));
 
-	for (unsigned i = 0; i < ARRAY_SIZE(c->open_buckets); i++)
-		nr[c->open_buckets[i].data_type]++;
+	for_each_open_bucket(c, ob, i)
+		nr[ob->data_type]++;
 
 	printbuf_tabstops_reset(out);
 	printbuf_tabstop_push(out, 12);
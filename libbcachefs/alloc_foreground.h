@@ -35,6 +35,22 @@ static inline struct bch_dev *ob_dev(struct bch_fs *c, struct open_bucket *ob)
 	return bch2_dev_have_ref(c, ob->dev);
 }
 
+static inline struct open_bucket *ob_from_idx(struct bch_fs *c, unsigned idx)
+{
+	return c->open_bucket_chunks[idx / OPEN_BUCKETS_COUNT] +
+		idx % OPEN_BUCKETS_COUNT;
+}
+
+/*
+ * Iterates over every open bucket in the table, including the sentinal;
+ * the table may grow while we're iterating, but never shrinks:
+ */
+#define for_each_open_bucket(_c, _ob, _i)				\
+	for ((_i) = 0;							\
+	     (_i) < smp_load_acquire(&(_c)->open_buckets_nr) &&		\
+	     ((_ob) = ob_from_idx(_c, _i), true);			\
+	     (_i)++)
+
 struct open_bucket *bch2_bucket_alloc(struct bch_fs *, struct bch_dev *,
 				      enum bch_watermark, enum bch_data_type,
 				      struct closure *);
@@ -44,13 +60,13 @@ static inline void ob_push(struct bch_fs *c, struct open_buckets *obs,
 {
 	BUG_ON(obs->nr >= ARRAY_SIZE(obs->v));
 
-	obs->v[obs->nr++] = ob - c->open_buckets;
+	obs->v[obs->nr++] = ob->idx;
 }
 
 #define open_bucket_for_each(_c, _obs, _ob, _i)				\
 	for ((_i) = 0;							\
 	     (_i) < (_obs)->nr &&					\
-	     ((_ob) = (_c)->open_buckets + (_obs)->v[_i], true);	\
+	     ((_ob) = ob_from_idx(_c, (_obs)->v[_i]), true);		\
 	     (_i)++)
 
 static inline struct open_bucket *ec_open_bucket(struct bch_fs *c,
@@ -122,7 +138,7 @@ static inline open_bucket_idx_t *open_bucket_hashslot(struct bch_fs *c,
 {
 	return c->open_buckets_hash +
 		(jhash_3words(dev, bucket, bucket >> 32, 0) &
-		 (OPEN_BUCKETS_COUNT - 1));
+		 (OPEN_BUCKETS_MAX - 1));
 }
 
 static inline bool bch2_bucket_is_open(struct bch_fs *c, unsigned dev, u64 bucket)
@@ -130,7 +146,7 @@ static inline bool bch2_bucket_is_open(struct bch_fs *c, unsigned dev, u64 bucke
 	open_bucket_idx_t slot = *open_bucket_hashslot(c, dev, bucket);
 
 	while (slot) {
-		struct open_bucket *ob = &c->open_buckets[slot];
+		struct open_bucket *ob = ob_from_idx(c, slot);
 
 		if (ob->dev == dev && ob->bucket == bucket)
 			return true;
@@ -215,12 +231,28 @@ static inline struct write_point_specifier writepoint_hashed(unsigned long v)
 	return (struct write_point_specifier) { .v = v | 1 };
 }
 
+/*
+ * Sequential streams within one file get their own write point, and thus their
+ * own buckets: streams are told apart by file offset, in units of
+ * 1 << WRITE_POINT_STREAM_SHIFT sectors:
+ */
+#define WRITE_POINT_STREAM_SHIFT	17
+
+static inline struct write_point_specifier writepoint_hashed_stream(unsigned long v,
+								     u64 sector)
+{
+	return writepoint_hashed(v ^ (unsigned long)
+			hash_64(sector >> WRITE_POINT_STREAM_SHIFT, BITS_PER_LONG));
+}
+
 static inline struct write_point_specifier writepoint_ptr(struct write_point *wp)
 {
 	return (struct write_point_specifier) { .v = (unsigned long) wp };
 }
 
 void bch2_fs_allocator_foreground_init(struct bch_fs *);
+void bch2_fs_allocator_foreground_exit(struct bch_fs *);
+int bch2_fs_write_points_init(struct bch_fs *);
 
 void bch2_open_bucket_to_text(struct printbuf *, struct bch_fs *, struct open_bucket *);
 void bch2_open_buckets_to_text(struct printbuf *, struct bch_fs *, struct bch_dev *);
@@ -21,6 +21,7 @@ struct bucket_alloc_state {
 	u64	skipped_nocow;
 	u64	skipped_nouse;
 	u64	skipped_mi_btree_bitmap;
+	u64	skipped_free_summary;
 };
 
 #define BCH_WATERMARKS()		\
@@ -42,10 +43,23 @@ enum bch_watermark {
 #define BCH_WATERMARK_BITS	3
 #define BCH_WATERMARK_MASK	~(~0U << BCH_WATERMARK_BITS)
 
+/*
+ * The open bucket table starts out with OPEN_BUCKETS_COUNT entries; when
+ * allocations start eating into the reserves it's grown, a chunk of
+ * OPEN_BUCKETS_COUNT at a time, up to OPEN_BUCKETS_MAX:
+ */
 #define OPEN_BUCKETS_COUNT	1024
+#define OPEN_BUCKETS_MAX	8192
+#define OPEN_BUCKETS_CHUNKS	(OPEN_BUCKETS_MAX / OPEN_BUCKETS_COUNT)
 
-#define WRITE_POINT_HASH_NR	32
-#define WRITE_POINT_MAX		32
+/*
+ * The foreground write point table is sized by the number of CPUs, between
+ * WRITE_POINT_MIN and WRITE_POINT_MAX; write points are brought into use as
+ * needed, starting with WRITE_POINT_MIN:
+ */
+#define WRITE_POINT_MIN		32
+#define WRITE_POINT_MAX		256
+#define WRITE_POINTS_PER_CPU	4
 
 /*
  * 0 is never a valid open_bucket_idx_t:
@@ -57,6 +71,7 @@ struct open_bucket {
 	atomic_t		pin;
 	open_bucket_idx_t	freelist;
 	open_bucket_idx_t	hash;
+	open_bucket_idx_t	idx;
 
 	/*
 	 * When an open bucket has an ec_stripe attached, this is the index of
@@ -83,6 +98,13 @@ struct open_buckets {
 
 struct dev_stripe_state {
 	u64			next_alloc[BCH_SB_MEMBERS_MAX];
+	/*
+	 * All device indices, sorted by next_alloc (ties by index): kept up to
+	 * date by bch2_dev_stripe_increment(), so that bch2_dev_alloc_list()
+	 * only has to filter it:
+	 */
+	u8			sorted[BCH_SB_MEMBERS_MAX];
+	bool			sorted_init;
 };
 
 #define WRITE_POINT_STATES()		\
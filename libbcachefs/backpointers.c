@@ -12,6 +12,7 @@
 #include "error.h"
 
 #include <linux/mm.h>
+#include <linux/sort.h>
 
 static bool extent_matches_bp(struct bch_fs *c,
 			      enum btree_id btree_id, unsigned level,
@@ -261,6 +262,55 @@ out:
 	return ret;
 }
 
+/*
+ * Read all of a bucket's backpointers in one pass: @bps is left empty if the
+ * bucket's generation no longer matches @gen (if @gen >= 0):
+ */
+int bch2_bucket_backpointers_get(struct btree_trans *trans,
+				 struct bch_dev *ca,
+				 struct bpos bucket, int gen,
+				 darray_bucket_backpointers *bps,
+				 unsigned iter_flags)
+{
+	struct bpos bp_end_pos = bucket_pos_to_bp(ca, bpos_nosnap_successor(bucket), 0);
+	struct btree_iter alloc_iter = { NULL }, bp_iter = { NULL };
+	struct bkey_s_c k;
+	int ret = 0;
+
+	bps->nr = 0;
+
+	if (gen >= 0) {
+		k = bch2_bkey_get_iter(trans, &alloc_iter, BTREE_ID_alloc,
+				       bucket, BTREE_ITER_cached|iter_flags);
+		ret = bkey_err(k);
+		if (ret)
+			goto out;
+
+		if (k.k->type != KEY_TYPE_alloc_v4 ||
+		    bkey_s_c_to_alloc_v4(k).v->gen != gen)
+			goto out;
+	}
+
+	for_each_btree_key_upto_norestart(trans, bp_iter, BTREE_ID_backpointers,
+					  bucket_pos_to_bp(ca, bucket, 0),
+					  bpos_predecessor(bp_end_pos),
+					  iter_flags, k, ret) {
+		if (k.k->type != KEY_TYPE_backpointer)
+			continue;
+
+		ret = darray_push(bps, ((struct bucket_backpointer) {
+			.pos	= k.k->p,
+			.bp	= *bkey_s_c_to_backpointer(k).v,
+		}));
+		if (ret)
+			break;
+	}
+out:
+	bch2_trans_iter_exit(trans, &bp_iter);
+	bch2_trans_iter_exit(trans, &alloc_iter);
+	return ret;
+}
+
 static void backpointer_not_found(struct btree_trans *trans,
 				  struct bpos bp_pos,
 				  struct bch_backpointer bp,
@@ -302,6 +352,37 @@ static void backpointer_not_found(struct btree_trans *trans,
 	printbuf_exit(&buf);
 }
 
+/*
+ * Look up the key a leaf backpointer points to, with an iterator the caller has
+ * already initialized for bp.btree_id at level 0: resolving many backpointers
+ * in sorted order this way reuses the same btree_path instead of traversing
+ * from the root each time. @iter is left initialized on every return.
+ */
+struct bkey_s_c bch2_backpointer_get_key_iter(struct btree_trans *trans,
+					      struct btree_iter *iter,
+					      struct bpos bp_pos,
+					      struct bch_backpointer bp)
+{
+	struct bch_fs *c = trans->c;
+	struct bpos bucket;
+
+	EBUG_ON(bp.level);
+
+	if (!bp_pos_to_bucket_nodev(c, bp_pos, &bucket))
+		return bkey_s_c_err(-EIO);
+
+	bch2_btree_iter_set_pos(iter, bp.pos);
+	struct bkey_s_c k = bch2_btree_iter_peek_slot(iter);
+	if (bkey_err(k))
+		return k;
+
+	if (k.k && extent_matches_bp(c, bp.btree_id, bp.level, k, bucket, bp))
+		return k;
+
+	backpointer_not_found(trans, bp_pos, bp, k);
+	return bkey_s_c_null;
+}
+
 struct bkey_s_c bch2_backpointer_get_key(struct btree_trans *trans,
 					 struct btree_iter *iter,
 					 struct bpos bp_pos,
@@ -309,29 +390,15 @@ struct bkey_s_c bch2_backpointer_get_key(struct btree_trans *trans,
 					 unsigned iter_flags)
 {
 	if (likely(!bp.level)) {
-		struct bch_fs *c = trans->c;
-
-		struct bpos bucket;
-		if (!bp_pos_to_bucket_nodev(c, bp_pos, &bucket))
-			return bkey_s_c_err(-EIO);
-
 		bch2_trans_node_iter_init(trans, iter,
 					  bp.btree_id,
 					  bp.pos,
 					  0, 0,
 					  iter_flags);
-		struct bkey_s_c k = bch2_btree_iter_peek_slot(iter);
-		if (bkey_err(k)) {
+		struct bkey_s_c k = bch2_backpointer_get_key_iter(trans, iter, bp_pos, bp);
+		if (!k.k || bkey_err(k))
 			bch2_trans_iter_exit(trans, iter);
-			return k;
-		}
-
-		if (k.k && extent_matches_bp(c, bp.btree_id, bp.level, k, bucket, bp))
-			return k;
-
-		bch2_trans_iter_exit(trans, iter);
-		backpointer_not_found(trans, bp_pos, bp, k);
-		return bkey_s_c_null;
+		return k;
 	} else {
 		struct btree *b = bch2_backpointer_get_node(trans, iter, bp_pos, bp);
 
@@ -653,8 +720,86 @@ missing:
 	goto out;
 }
 
+/*
+ * Like backpointers to extents, the backpointers for leaf level keys are
+ * checked in batches: the backpointers we expect are collected from a run of
+ * keys, then looked up in sorted order with bch2_btree_lookup_batch() - only
+ * mismatches go through check_bp_exists():
+ */
+#define BP_LOOKUP_BATCH		4096
+
+struct bp_expected_batch {
+	struct extents_to_bp_state		*s;
+	DARRAY(struct bkey_i_backpointer)	bps;
+	DARRAY(struct bpos)			pos;
+};
+
+static int bp_expected_cmp(const void *_l, const void *_r)
+{
+	const struct bkey_i_backpointer *l = _l;
+	const struct bkey_i_backpointer *r = _r;
+
+	return bpos_cmp(l->k.p, r->k.p);
+}
+
+static int bp_expected_check(struct btree_trans *trans, struct btree_iter *iter,
+			     struct bkey_s_c bp_k, size_t idx, void *arg)
+{
+	struct bp_expected_batch *b = arg;
+	struct bkey_i_backpointer *bp = b->bps.data + idx;
+	struct btree_iter extent_iter;
+	struct bpos bucket;
+	int ret = 0;
+
+	if (bp_k.k->type == KEY_TYPE_backpointer &&
+	    !memcmp(bkey_s_c_to_backpointer(bp_k).v, &bp->v, sizeof(bp->v)))
+		return 0;
+
+	if (!bp_pos_to_bucket_nodev(trans->c, bp->k.p, &bucket))
+		return -EIO;
+
+	/*
+	 * The extent may have been overwritten since we collected the batch;
+	 * only check_bp_exists() if it still has this pointer:
+	 */
+	bch2_trans_node_iter_init(trans, &extent_iter, bp->v.btree_id, bp->v.pos, 0, 0, 0);
+	struct bkey_s_c k = bch2_btree_iter_peek_slot(&extent_iter);
+	ret = bkey_err(k);
+	if (ret)
+		goto err;
+
+	if (k.k && extent_matches_bp(trans->c, bp->v.btree_id, 0, k, bucket, bp->v))
+		ret =   check_bp_exists(trans, b->s, bucket, bp->v, k) ?:
+			bch2_trans_commit(trans, NULL, NULL, BCH_TRANS_COMMIT_no_enospc);
+err:
+	bch2_trans_iter_exit(trans, &extent_iter);
+	return ret;
+}
+
+static int bp_expected_batch_flush(struct btree_trans *trans, struct bp_expected_batch *b)
+{
+	int ret = 0;
+
+	sort(b->bps.data, b->bps.nr, sizeof(b->bps.data[0]), bp_expected_cmp, NULL);
+
+	darray_for_each(b->bps, i) {
+		ret = darray_push(&b->pos, i->k.p);
+		if (ret)
+			goto out;
+	}
+
+	ret = bch2_btree_lookup_batch(trans, BTREE_ID_backpointers,
+				      b->pos.data, b->pos.nr, 0,
+				      bp_expected_check, b);
+out:
+	b->bps.nr = 0;
+	b->pos.nr = 0;
+	return ret;
+}
+
 static int check_extent_to_backpointers(struct btree_trans *trans,
 					struct extents_to_bp_state *s,
+					struct bp_expected_batch *batch,
 					enum btree_id btree, unsigned level,
 					struct bkey_s_c k)
 {
@@ -672,21 +817,37 @@ static int check_extent_to_backpointers(struct btree_trans *trans,
 		if (p.ptr.cached)
 			continue;
 
+		struct bkey_i_backpointer bp_k;
+		bool batched = false;
+
 		rcu_read_lock();
 		struct bch_dev *ca = bch2_dev_rcu(c, p.ptr.dev);
-		if (ca)
+		if (ca) {
 			bch2_extent_ptr_to_bp(c, ca, btree, level, k, p, entry, &bucket_pos, &bp);
+
+			batched = batch &&
+				bucket_valid(ca, bucket_pos.offset) &&
+				!bpos_lt(bucket_pos, s->bucket_start) &&
+				!bpos_gt(bucket_pos, s->bucket_end);
+			if (batched) {
+				bkey_backpointer_init(&bp_k.k_i);
+				bp_k.k.p = bucket_pos_to_bp(ca, bucket_pos, bp.bucket_offset);
+				bp_k.v = bp;
+			}
+		}
 		rcu_read_unlock();
 
 		if (!ca)
 			continue;
 
-		ret = check_bp_exists(trans, s, bucket_pos, bp, k);
+		ret = batched
+			? darray_push(&batch->bps, bp_k)
+			: check_bp_exists(trans, s, bucket_pos, bp, k);
 		if (ret)
 			return ret;
 	}
 
-	return 0;
+	return batch && batch->bps.nr >= BP_LOOKUP_BATCH;
 }
 
 static int check_btree_root_to_backpointers(struct btree_trans *trans,
@@ -715,7 +876,7 @@ retry:
 	*level = b->c.level;
 
 	k = bkey_i_to_s_c(&b->key);
-	ret = check_extent_to_backpointers(trans, s, btree_id, b->c.level + 1, k);
+	ret = check_extent_to_backpointers(trans, s, NULL, btree_id, b->c.level + 1, k);
 err:
 	bch2_trans_iter_exit(trans, &iter);
 	return ret;
@@ -793,6 +954,7 @@ static int bch2_check_extents_to_backpointers_pass(struct btree_trans *trans,
 						   struct extents_to_bp_state *s)
 {
 	struct bch_fs *c = trans->c;
+	struct bp_expected_batch batch = { .s = s };
 	int ret = 0;
 
 	for (enum btree_id btree_id = 0;
@@ -807,22 +969,43 @@ static int bch2_check_extents_to_backpointers_pass(struct btree_trans *trans,
 			return ret;
 
 		while (level >= depth) {
-			struct btree_iter iter;
-			bch2_trans_node_iter_init(trans, &iter, btree_id, POS_MIN, 0, level,
-						  BTREE_ITER_prefetch);
-
-			ret = for_each_btree_key_continue(trans, iter, 0, k, ({
-				check_extent_to_backpointers(trans, s, btree_id, level, k) ?:
-				bch2_trans_commit(trans, NULL, NULL, BCH_TRANS_COMMIT_no_enospc);
-			}));
-			if (ret)
-				return ret;
+			struct bpos pos = POS_MIN;
+			bool more;
+
+			do {
+				struct btree_iter iter;
+				bch2_trans_node_iter_init(trans, &iter, btree_id, pos, 0, level,
+							  BTREE_ITER_prefetch);
+
+				/* returns 1 when the batch is full: */
+				ret = for_each_btree_key_continue(trans, iter, 0, k, ({
+					pos = k.k->p;
+					int ret2 = check_extent_to_backpointers(trans, s,
+								!level ? &batch : NULL,
+								btree_id, level, k);
+					ret2 < 0 ? ret2 :
+					bch2_trans_commit(trans, NULL, NULL, BCH_TRANS_COMMIT_no_enospc) ?: ret2;
+				}));
+				if (ret < 0)
+					goto err;
+
+				more = ret == 1 && !bpos_eq(pos, SPOS_MAX);
+
+				ret = bp_expected_batch_flush(trans, &batch);
+				if (ret)
+					goto err;
+
+				if (more)
+					pos = bpos_successor(pos);
+			} while (more);
 
 			--level;
 		}
 	}
-
-	return 0;
+err:
+	darray_exit(&batch.pos);
+	darray_exit(&batch.bps);
+	return ret;
 }
 
 int bch2_check_extents_to_backpointers(struct bch_fs *c)
@@ -879,23 +1062,37 @@ int bch2_check_extents_to_backpointers(struct bch_fs *c)
 	return ret;
 }
 
+static int backpointer_to_missing_ptr(struct btree_trans *trans,
+				      struct bkey_s_c_backpointer bp,
+				      struct bkey_buf *last_flushed)
+{
+	struct bch_fs *c = trans->c;
+	struct printbuf buf = PRINTBUF;
+	int ret;
+
+	ret = bch2_btree_write_buffer_maybe_flush(trans, bp.s_c, last_flushed);
+	if (ret)
+		goto out;
+
+	if (fsck_err(trans, backpointer_to_missing_ptr,
+		     "backpointer for missing %s\n  %s",
+		     bp.v->level ? "btree node" : "extent",
+		     (bch2_bkey_val_to_text(&buf, c, bp.s_c), buf.buf)))
+		ret = bch2_btree_delete_at_buffered(trans, BTREE_ID_backpointers, bp.k->p);
+out:
+fsck_err:
+	printbuf_exit(&buf);
+	return ret;
+}
+
 static int check_one_backpointer(struct btree_trans *trans,
-				 struct bbpos start,
-				 struct bbpos end,
 				 struct bkey_s_c_backpointer bp,
 				 struct bkey_buf *last_flushed)
 {
-	struct bch_fs *c = trans->c;
 	struct btree_iter iter;
-	struct bbpos pos = bp_to_bbpos(*bp.v);
 	struct bkey_s_c k;
-	struct printbuf buf = PRINTBUF;
 	int ret;
 
-	if (bbpos_cmp(pos, start) < 0 ||
-	    bbpos_cmp(pos, end) > 0)
-		return 0;
-
 	k = bch2_backpointer_get_key(trans, &iter, bp.k->p, *bp.v, 0);
 	ret = bkey_err(k);
 	if (ret == -BCH_ERR_backpointer_to_overwritten_btree_node)
@@ -903,23 +1100,83 @@ static int check_one_backpointer(struct btree_trans *trans,
 	if (ret)
 		return ret;
 
-	if (!k.k) {
-		ret = bch2_btree_write_buffer_maybe_flush(trans, bp.s_c, last_flushed);
+	if (!k.k)
+		ret = backpointer_to_missing_ptr(trans, bp, last_flushed);
+
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+/*
+ * Backpointers to extents are checked in batches: the extents they point to
+ * are looked up in sorted order with bch2_btree_lookup_batch(), instead of one
+ * random lookup from the root for each backpointer:
+ */
+
+struct bp_lookup_batch {
+	struct bkey_buf				*last_flushed;
+	DARRAY(struct bkey_i_backpointer)	bps;
+	DARRAY(struct bpos)			pos;
+	struct bkey_i_backpointer		*run;
+};
+
+static int bp_lookup_cmp(const void *_l, const void *_r)
+{
+	const struct bkey_i_backpointer *l = _l;
+	const struct bkey_i_backpointer *r = _r;
+
+	return  cmp_int(l->v.btree_id, r->v.btree_id) ?:
+		bpos_cmp(l->v.pos, r->v.pos);
+}
+
+static int bp_lookup_check(struct btree_trans *trans, struct btree_iter *iter,
+			   struct bkey_s_c k, size_t idx, void *arg)
+{
+	struct bp_lookup_batch *b = arg;
+	struct bkey_i_backpointer *bp = b->run + idx;
+	struct bpos bucket;
+
+	if (!bp_pos_to_bucket_nodev(trans->c, bp->k.p, &bucket))
+		return -EIO;
+
+	if (k.k && extent_matches_bp(trans->c, bp->v.btree_id, 0, k, bucket, bp->v))
+		return 0;
+
+	backpointer_not_found(trans, bp->k.p, bp->v, k);
+
+	return  backpointer_to_missing_ptr(trans, backpointer_i_to_s_c(bp),
+					   b->last_flushed) ?:
+		bch2_trans_commit(trans, NULL, NULL, BCH_TRANS_COMMIT_no_enospc);
+}
+
+static int bp_lookup_batch_flush(struct btree_trans *trans, struct bp_lookup_batch *b)
+{
+	int ret = 0;
+
+	sort(b->bps.data, b->bps.nr, sizeof(b->bps.data[0]), bp_lookup_cmp, NULL);
+
+	darray_for_each(b->bps, i) {
+		ret = darray_push(&b->pos, i->v.pos);
 		if (ret)
 			goto out;
+	}
 
-		if (fsck_err(trans, backpointer_to_missing_ptr,
-			     "backpointer for missing %s\n  %s",
-			     bp.v->level ? "btree node" : "extent",
-			     (bch2_bkey_val_to_text(&buf, c, bp.s_c), buf.buf))) {
-			ret = bch2_btree_delete_at_buffered(trans, BTREE_ID_backpointers, bp.k->p);
-			goto out;
-		}
+	for (size_t i = 0, j; i < b->bps.nr && !ret; i = j) {
+		enum btree_id btree = b->bps.data[i].v.btree_id;
+
+		for (j = i; j < b->bps.nr && b->bps.data[j].v.btree_id == btree; j++)
+			;
+
+		b->run = b->bps.data + i;
+		ret = bch2_btree_lookup_batch(trans, btree, b->pos.data + i, j - i,
+					      BTREE_ITER_not_extents|
+					      BTREE_ITER_snapshot_field|
+					      BTREE_ITER_all_snapshots,
+					      bp_lookup_check, b);
 	}
 out:
-fsck_err:
-	bch2_trans_iter_exit(trans, &iter);
-	printbuf_exit(&buf);
+	b->bps.nr = 0;
+	b->pos.nr = 0;
 	return ret;
 }
 
@@ -928,17 +1185,52 @@ static int bch2_check_backpointers_to_extents_pass(struct btree_trans *trans,
 						   struct bbpos end)
 {
 	struct bkey_buf last_flushed;
+	struct bp_lookup_batch b = { .last_flushed = &last_flushed };
+	struct bpos pos = POS_MIN;
+	int ret;
 
 	bch2_bkey_buf_init(&last_flushed);
 	bkey_init(&last_flushed.k->k);
 
-	int ret = for_each_btree_key_commit(trans, iter, BTREE_ID_backpointers,
-				  POS_MIN, BTREE_ITER_prefetch, k,
-				  NULL, NULL, BCH_TRANS_COMMIT_no_enospc,
-		check_one_backpointer(trans, start, end,
-				      bkey_s_c_to_backpointer(k),
-				      &last_flushed));
-
+	do {
+		ret = for_each_btree_key_commit(trans, iter, BTREE_ID_backpointers,
+					  pos, BTREE_ITER_prefetch, k,
+					  NULL, NULL, BCH_TRANS_COMMIT_no_enospc, ({
+			struct bkey_s_c_backpointer bp = bkey_s_c_to_backpointer(k);
+			struct bbpos bp_pos = bp_to_bbpos(*bp.v);
+			int ret2 = 0;
+
+			pos = k.k->p;
+
+			if (bbpos_cmp(bp_pos, start) < 0 ||
+			    bbpos_cmp(bp_pos, end) > 0) {
+				ret2 = 0;
+			} else if (bp.v->level) {
+				ret2 = check_one_backpointer(trans, bp, &last_flushed);
+			} else {
+				struct bkey_i_backpointer bp_k;
+
+				bkey_backpointer_init(&bp_k.k_i);
+				bp_k.k.p = bp.k->p;
+				bp_k.v = *bp.v;
+
+				ret2 = darray_push(&b.bps, bp_k) ?:
+					(b.bps.nr >= BP_LOOKUP_BATCH);
+			}
+			ret2;
+		}));
+
+		/* ret == 1: batch is full, continue after it's been checked */
+		if (ret >= 0)
+			ret = bp_lookup_batch_flush(trans, &b) ?: ret;
+		if (ret == 1 && bpos_eq(pos, SPOS_MAX))
+			ret = 0;
+		if (ret == 1)
+			pos = bpos_successor(pos);
+	} while (ret == 1);
+
+	darray_exit(&b.pos);
+	darray_exit(&b.bps);
 	bch2_bkey_buf_exit(&last_flushed, trans->c);
 	return ret;
 }
@@ -159,6 +159,18 @@ static inline void bch2_extent_ptr_to_bp(struct bch_fs *c, struct bch_dev *ca,
 
 int bch2_get_next_backpointer(struct btree_trans *, struct bch_dev *ca, struct bpos, int,
 			      struct bpos *, struct bch_backpointer *, unsigned);
+
+struct bucket_backpointer {
+	struct bpos		pos;
+	struct bch_backpointer	bp;
+};
+
+typedef DARRAY(struct bucket_backpointer) darray_bucket_backpointers;
+
+int bch2_bucket_backpointers_get(struct btree_trans *, struct bch_dev *, struct bpos, int,
+				 darray_bucket_backpointers *, unsigned);
+struct bkey_s_c bch2_backpointer_get_key_iter(struct btree_trans *, struct btree_iter *,
+					      struct bpos, struct bch_backpointer);
 struct bkey_s_c bch2_backpointer_get_key(struct btree_trans *, struct btree_iter *,
 					 struct bpos, struct bch_backpointer,
 					 unsigned);
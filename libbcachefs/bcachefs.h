@@ -205,14 +205,19 @@
 #include <linux/zstd.h>
 
 #include "bcachefs_format.h"
+#include "btree_trace_types.h"
 #include "disk_accounting_types.h"
 #include "errcode.h"
 #include "fifo.h"
+#include "io_attrib_types.h"
+#include "io_sched_types.h"
+#include "lock_profile_types.h"
 #include "nocow_locking_types.h"
 #include "opts.h"
 #include "recovery_passes_types.h"
 #include "sb-errors_types.h"
 #include "seqmutex.h"
+#include "slow_ops_types.h"
 #include "time_stats.h"
 #include "util.h"
 
@@ -449,6 +454,13 @@ BCH_DEBUG_PARAMS_DEBUG()
 	x(blocked_journal_max_in_flight)	\
 	x(blocked_allocate)			\
 	x(blocked_allocate_open_bucket)		\
+	x(blocked_allocate_open_bucket_stripe)	\
+	x(blocked_allocate_open_bucket_normal)	\
+	x(blocked_allocate_open_bucket_copygc)	\
+	x(blocked_allocate_open_bucket_btree)	\
+	x(blocked_allocate_open_bucket_btree_copygc) \
+	x(blocked_allocate_open_bucket_reclaim)	\
+	x(blocked_allocate_open_bucket_interior_updates) \
 	x(blocked_write_buffer_full)		\
 	x(nocow_lock_contended)
 
@@ -543,6 +555,7 @@ struct bch_dev {
 	 */
 	struct bucket_array __rcu *buckets_gc;
 	struct bucket_gens __rcu *bucket_gens;
+	struct bucket_free_summary __rcu *free_summary;
 	u8			*oldest_gen;
 	unsigned long		*buckets_nouse;
 	struct rw_semaphore	bucket_lock;
@@ -562,17 +575,38 @@ struct bch_dev {
 
 	struct work_struct	invalidate_work;
 	struct work_struct	discard_work;
+	struct work_struct	freespace_init_work;
+	struct closure		freespace_init_cl;
+	int			freespace_init_ret;
 	struct mutex		discard_buckets_in_flight_lock;
 	DARRAY(struct discard_in_flight)	discard_buckets_in_flight;
 	struct work_struct	discard_fast_work;
 
+	/* discard pipeline: bios in flight, rate limits: */
+	atomic_t		discard_bios_in_flight;
+	wait_queue_head_t	discard_wait;
+	spinlock_t		discard_ratelimit_lock;
+	struct bch_ratelimit	discard_bytes_ratelimit;
+	struct bch_ratelimit	discard_iops_ratelimit;
+	atomic64_t		discard_sectors_issued;
+
 	atomic64_t		rebalance_work;
 
+	struct task_struct	*copygc_thread;
+	s64			copygc_wait_at;
+	s64			copygc_wait;
+	bool			copygc_running;
+
+	/* last background scrub, in seconds: */
+	u64			scrub_last;
+
 	struct journal_device	journal;
 	u64			prev_journal_sector;
 
 	struct work_struct	io_error_work;
 
+	struct bch_dev_io_sched	io_sched;
+
 	/* The rest of this all shows up in sysfs */
 	atomic64_t		cur_latency[2];
 	struct bch2_time_stats_quantiles io_latency[2];
@@ -624,6 +658,17 @@ struct btree_debug {
 
 #define BCH_TRANSACTIONS_NR 128
 
+/* Number of distinct restart call sites tracked per transaction fn: */
+#define BTREE_TRANS_RESTART_SITES	8
+
+struct btree_trans_restart_site {
+	unsigned long		ip;
+	u16			reason;
+	u32			nr;
+	u64			wasted_ns;
+	u64			wasted_paths;
+};
+
 struct btree_transaction_stats {
 	struct bch2_time_stats	duration;
 	struct bch2_time_stats	lock_hold_times;
@@ -632,12 +677,36 @@ struct btree_transaction_stats {
 	unsigned		journal_entries_size;
 	unsigned		max_mem;
 	char			*max_paths_text;
+
+	/*
+	 * Restart profiling: what restarted, why, and how much work (time
+	 * since bch2_trans_begin(), paths allocated) was thrown away:
+	 */
+	atomic64_t		nr_restarts;
+	atomic64_t		restart_wasted_ns;
+	atomic64_t		restart_reasons[BCH_ERR_transaction_restart_NR];
+	struct btree_trans_restart_site restart_sites[BTREE_TRANS_RESTART_SITES];
+};
+
+/* Time spent blocked on btree node locks, by btree and level: */
+struct btree_lock_wait_stats {
+	atomic64_t		nr;
+	atomic64_t		ns;
 };
 
 struct bch_fs_pcpu {
 	u64			sectors_available;
 };
 
+/*
+ * Inode number allocation state for one shard (cpu) of the inode number space:
+ * @reserved is the end of the range recorded in that shard's on disk cursor
+ */
+struct inode_alloc_shard {
+	u64			hint;
+	u64			reserved;
+};
+
 struct journal_seq_blacklist_table {
 	size_t			nr;
 	struct journal_seq_blacklist_table_entry {
@@ -667,12 +736,32 @@ struct journal_keys {
 	size_t			gap;
 	atomic_t		ref;
 	bool			initial_ref_held;
+
+	/*
+	 * Eytzinger ordered copies of the positions of every
+	 * JOURNAL_KEYS_INDEX_STRIDE'th key, for narrowing down searches:
+	 */
+	struct journal_keys_index {
+		size_t		nr;
+		size_t		size;
+		size_t		nr_keys;
+		size_t		nr_inserted;
+		struct journal_key_sep {
+			enum btree_id	btree_id:8;
+			unsigned	level:8;
+			struct bpos	pos;
+			size_t		idx;
+		}		*d;
+	}			index;
 };
 
 struct btree_trans_buf {
 	struct btree_trans	*trans;
 };
 
+/* Userspace has no real percpu variables, we shard by thread instead: */
+#define BTREE_TRANS_BUF_SHARDS		16
+
 #define BCACHEFS_ROOT_SUBVOL_INUM					\
 	((subvol_inum) { BCACHEFS_ROOT_SUBVOL,	BCACHEFS_ROOT_INO })
 
@@ -692,7 +781,9 @@ struct btree_trans_buf {
 	x(invalidate)							\
 	x(delete_dead_snapshots)					\
 	x(gc_gens)							\
+	x(freespace_init)						\
 	x(snapshot_delete_pagecache)					\
+	x(inode_rm)							\
 	x(sysfs)							\
 	x(btree_write_buffer)
 
@@ -788,10 +879,15 @@ struct bch_fs {
 
 	struct closure		sb_write;
 	struct mutex		sb_lock;
+	/* bch2_write_super_async(): */
+	struct delayed_work	sb_write_work;
+	bool			sb_write_pending;
 
 	/* snapshot.c: */
 	struct snapshot_table __rcu *snapshots;
 	struct mutex		snapshot_table_lock;
+	seqcount_t		snapshot_labels_seq;
+	bool			snapshot_labels_valid;
 	struct rw_semaphore	snapshot_create_lock;
 
 	struct work_struct	snapshot_delete_work;
@@ -799,10 +895,18 @@ struct bch_fs {
 	snapshot_id_list	snapshots_unlinked;
 	struct mutex		snapshots_unlinked_lock;
 
+	/* inode.c: */
+	struct work_struct	inode_rm_work;
+	subvol_inum_list	inode_rm_queue;
+	struct mutex		inode_rm_lock;
+
 	/* BTREE CACHE */
 	struct bio_set		btree_bio;
 	struct workqueue_struct	*btree_read_complete_wq;
+	struct workqueue_struct	*btree_read_csum_wq;
 	struct workqueue_struct	*btree_write_submit_wq;
+	struct llist_head	btree_write_submit_list;
+	struct work_struct	btree_write_submit_work;
 
 	struct btree_root	btree_roots_known[BTREE_ID_NR];
 	DARRAY(struct btree_root) btree_roots_extra;
@@ -907,20 +1011,26 @@ struct bch_fs {
 
 	open_bucket_idx_t	open_buckets_freelist;
 	open_bucket_idx_t	open_buckets_nr_free;
+	/* number of open buckets in the table, including the sentinal: */
+	unsigned		open_buckets_nr;
 	struct closure_waitlist	open_buckets_wait;
-	struct open_bucket	open_buckets[OPEN_BUCKETS_COUNT];
-	open_bucket_idx_t	open_buckets_hash[OPEN_BUCKETS_COUNT];
+	struct work_struct	open_buckets_grow_work;
+	struct open_bucket	*open_bucket_chunks[OPEN_BUCKETS_CHUNKS];
+	struct open_bucket	open_buckets_initial[OPEN_BUCKETS_COUNT];
+	open_bucket_idx_t	open_buckets_hash[OPEN_BUCKETS_MAX];
 
-	open_bucket_idx_t	open_buckets_partial[OPEN_BUCKETS_COUNT];
+	open_bucket_idx_t	open_buckets_partial[OPEN_BUCKETS_MAX];
 	open_bucket_idx_t	open_buckets_partial_nr;
 
 	struct write_point	btree_write_point;
 	struct write_point	rebalance_write_point;
 
-	struct write_point	write_points[WRITE_POINT_MAX];
-	struct hlist_head	write_points_hash[WRITE_POINT_HASH_NR];
+	struct write_point	*write_points;
+	struct hlist_head	*write_points_hash;
 	struct mutex		write_points_hash_lock;
 	unsigned		write_points_nr;
+	/* size of write_points and write_points_hash, a power of two: */
+	unsigned		write_points_max;
 
 	struct buckets_waiting_for_journal buckets_waiting_for_journal;
 
@@ -961,11 +1071,17 @@ struct bch_fs {
 	struct bucket_nocow_lock_table
 				nocow_locks;
 	struct rhashtable	promote_table;
+	u8			*promote_sketch;
+	atomic_t		promote_sketch_reads;
 
 	mempool_t		compression_bounce[2];
 	mempool_t		compress_workspace[BCH_COMPRESSION_TYPE_NR];
+	size_t			compress_workspace_size[BCH_COMPRESSION_TYPE_NR];
+	struct compress_workspace_pcpu __percpu *compress_workspace_pcpu;
+	struct workqueue_struct	*compress_wq;
 	mempool_t		decompress_workspace;
 	size_t			zstd_workspace_size;
+	struct bch_zstd_dict	*zstd_dict;
 
 	struct crypto_shash	*sha256;
 	struct crypto_sync_skcipher *chacha20;
@@ -983,13 +1099,17 @@ struct bch_fs {
 	struct bch_fs_rebalance	rebalance;
 
 	/* COPYGC */
-	struct task_struct	*copygc_thread;
+	bool			copygc_started;
 	struct write_point	copygc_write_point;
-	s64			copygc_wait_at;
-	s64			copygc_wait;
-	bool			copygc_running;
+	struct write_point	copygc_cold_write_point;
+	atomic_t		copygc_buckets_in_flight;
+	atomic_t		copygc_running;
 	wait_queue_head_t	copygc_running_wq;
 
+	/* SCRUB */
+	struct task_struct	*scrub_thread;
+	struct task_struct	*bg_fsck_thread;
+
 	/* STRIPES: */
 	GENRADIX(struct stripe) stripes;
 	GENRADIX(struct gc_stripe) gc_stripes;
@@ -1013,6 +1133,10 @@ struct bch_fs {
 
 	struct work_struct	ec_stripe_delete_work;
 
+	struct task_struct	*ec_compact_thread;
+	struct write_point	ec_compact_write_point;
+	struct bch_ratelimit	ec_compact_ratelimit;
+
 	struct bio_set		ec_bioset;
 
 	/* REFLINK */
@@ -1050,6 +1174,8 @@ struct bch_fs {
 	u64			recovery_passes_complete;
 	/* never rewinds version of curr_recovery_pass */
 	enum bch_recovery_pass	recovery_pass_done;
+	/* for passes that run concurrently: */
+	spinlock_t		recovery_pass_lock;
 	struct semaphore	online_fsck_mutex;
 
 	/* DEBUG JUNK */
@@ -1060,7 +1186,7 @@ struct bch_fs {
 	struct btree_node	*verify_ondisk;
 	struct mutex		verify_lock;
 
-	u64			*unused_inode_hints;
+	struct inode_alloc_shard *inode_alloc_shards;
 	unsigned		inode_shard_bits;
 
 	/*
@@ -1089,6 +1215,11 @@ struct bch_fs {
 	struct bch2_time_stats	times[BCH_TIME_STAT_NR];
 
 	struct btree_transaction_stats btree_transaction_stats[BCH_TRANSACTIONS_NR];
+	struct btree_lock_wait_stats btree_lock_wait[BTREE_ID_NR][BTREE_MAX_DEPTH];
+	struct bch_lock_profile	lock_profile;
+	struct bch_slow_ops	slow_ops;
+	struct bch_io_attrib	io_attrib;
+	struct bch_btree_trace	btree_trace;
 
 	/* ERRORS */
 	struct list_head	fsck_error_msgs;
@@ -1163,11 +1294,20 @@ static inline void bch2_ro_ref_put(struct bch_fs *c)
 		wake_up(&c->ro_ref_wait);
 }
 
+/*
+ * Readahead window is the sum of our member devices' windows, so a single
+ * sequential stream can keep all of them busy; io_pages too, so that large
+ * reads aren't trimmed back to a single device's worth:
+ */
 static inline void bch2_set_ra_pages(struct bch_fs *c, unsigned ra_pages)
 {
 #ifndef NO_BCACHEFS_FS
-	if (c->vfs_sb)
+	if (c->vfs_sb) {
+		ra_pages = max_t(unsigned, ra_pages, VM_READAHEAD_PAGES);
+
 		c->vfs_sb->s_bdi->ra_pages = ra_pages;
+		c->vfs_sb->s_bdi->io_pages = ra_pages;
+	}
 #endif
 }
 
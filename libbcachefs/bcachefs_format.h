@@ -418,7 +418,9 @@ static inline void bkey_init(struct bkey *k)
 	x(snapshot_tree,	31)			\
 	x(logged_op_truncate,	32)			\
 	x(logged_op_finsert,	33)			\
-	x(accounting,		34)
+	x(accounting,		34)			\
+	x(logged_op_data_job,	35)			\
+	x(inode_alloc_cursor,	36)
 
 enum bch_bkey_type {
 #define x(name, nr) KEY_TYPE_##name	= nr,
@@ -491,7 +493,8 @@ struct bch_sb_field {
 	x(members_v2,			11)	\
 	x(errors,			12)	\
 	x(ext,				13)	\
-	x(downgrade,			14)
+	x(downgrade,			14)	\
+	x(zstd_dict,			15)
 
 #include "alloc_background_format.h"
 #include "dirent_format.h"
@@ -595,6 +598,23 @@ LE64_BITMASK(BCH_KDF_SCRYPT_N,	struct bch_sb_field_crypt, kdf_flags,  0, 16);
 LE64_BITMASK(BCH_KDF_SCRYPT_R,	struct bch_sb_field_crypt, kdf_flags, 16, 32);
 LE64_BITMASK(BCH_KDF_SCRYPT_P,	struct bch_sb_field_crypt, kdf_flags, 32, 48);
 
+/* BCH_SB_FIELD_zstd_dict: */
+
+/*
+ * Trained zstd dictionary, for BCH_COMPRESSION_TYPE_zstd_dict: data compressed
+ * with it can't be read without it, so it's never replaced once set.
+ */
+#define BCH_ZSTD_DICT_MAX_BYTES		(64 << 10)
+
+struct bch_sb_field_zstd_dict {
+	struct bch_sb_field	field;
+	__le32			dict_id;
+	__le32			dict_bytes;
+	__u8			level;
+	__u8			pad[7];
+	__u8			data[];
+} __packed __aligned(8);
+
 /*
  * On clean shutdown, store btree roots and current journal sequence number in
  * the superblock:
@@ -675,7 +695,10 @@ struct bch_sb_field_ext {
 	x(btree_subvolume_children,	BCH_VERSION(1,  6))		\
 	x(mi_btree_bitmap,		BCH_VERSION(1,  7))		\
 	x(bucket_stripe_sectors,	BCH_VERSION(1,  8))		\
-	x(disk_accounting_v2,		BCH_VERSION(1,  9))
+	x(disk_accounting_v2,		BCH_VERSION(1,  9))		\
+	x(rebalance_work_target_acct,	BCH_VERSION(1, 10))		\
+	x(inode_alloc_cursors,		BCH_VERSION(1, 11))		\
+	x(background_fsck_cursor,	BCH_VERSION(1, 12))
 
 enum bcachefs_metadata_version {
 	bcachefs_metadata_version_min = 9,
@@ -840,6 +863,11 @@ LE64_BITMASK(BCH_SB_VERSION_UPGRADE_COMPLETE,
 					struct bch_sb, flags[5],  0, 16);
 LE64_BITMASK(BCH_SB_ALLOCATOR_STUCK_TIMEOUT,
 					struct bch_sb, flags[5], 16, 32);
+LE64_BITMASK(BCH_SB_JOURNAL_COMPRESSION,
+					struct bch_sb, flags[5], 32, 40);
+LE64_BITMASK(BCH_SB_JOURNAL_TARGET,	struct bch_sb, flags[5], 40, 52);
+LE64_BITMASK(BCH_SB_JOURNAL_GROUP_COMMIT_TARGET,
+					struct bch_sb, flags[5], 52, 64);
 
 static inline __u64 BCH_SB_COMPRESSION_TYPE(const struct bch_sb *sb)
 {
@@ -872,6 +900,7 @@ static inline void SET_BCH_SB_BACKGROUND_COMPRESSION_TYPE(struct bch_sb *sb, __u
  * inline_data:			gates KEY_TYPE_inline_data
  * new_siphash:			gates BCH_STR_HASH_siphash
  * new_extent_overwrite:	gates BTREE_NODE_NEW_EXTENT_OVERWRITE
+ * journal_compression:		gates JSET_COMPRESSION_TYPE
  */
 #define BCH_SB_FEATURES()			\
 	x(lz4,				0)	\
@@ -892,7 +921,9 @@ static inline void SET_BCH_SB_BACKGROUND_COMPRESSION_TYPE(struct bch_sb *sb, __u
 	x(new_varint,			15)	\
 	x(journal_no_flush,		16)	\
 	x(alloc_v2,			17)	\
-	x(extents_across_btree_nodes,	18)
+	x(extents_across_btree_nodes,	18)	\
+	x(journal_compression,		19)	\
+	x(zstd_dict,			20)
 
 #define BCH_SB_FEATURES_ALWAYS				\
 	((1ULL << BCH_FEATURE_new_extent_overwrite)|	\
@@ -1041,7 +1072,8 @@ enum bch_csum_opts {
 	x(gzip,			2)	\
 	x(lz4,			3)	\
 	x(zstd,			4)	\
-	x(incompressible,	5)
+	x(incompressible,	5)	\
+	x(zstd_dict,		6)
 
 enum bch_compression_type {
 #define x(t, n) BCH_COMPRESSION_TYPE_##t = n,
@@ -1054,7 +1086,8 @@ enum bch_compression_type {
 	x(none,		0)		\
 	x(lz4,		1)		\
 	x(gzip,		2)		\
-	x(zstd,		3)
+	x(zstd,		3)		\
+	x(zstd_dict,	4)
 
 enum bch_compression_opts {
 #define x(t, n) BCH_COMPRESSION_OPT_##t = n,
@@ -1258,6 +1291,17 @@ struct jset {
 LE32_BITMASK(JSET_CSUM_TYPE,	struct jset, flags, 0, 4);
 LE32_BITMASK(JSET_BIG_ENDIAN,	struct jset, flags, 4, 5);
 LE32_BITMASK(JSET_NO_FLUSH,	struct jset, flags, 5, 6);
+LE32_BITMASK(JSET_COMPRESSION_TYPE,	struct jset, flags, 6, 10);
+
+/*
+ * If JSET_COMPRESSION_TYPE is set, jset->start is a struct jset_compressed
+ * holding the compressed entries; jset->u64s is the compressed size:
+ */
+struct jset_compressed {
+	__le32			u64s; /* uncompressed size of d[] in u64s */
+	__le32			bytes; /* size of data[] */
+	__u8			data[];
+} __packed __aligned(8);
 
 #define BCH_JOURNAL_BUCKETS_MIN		8
 
@@ -1268,6 +1312,7 @@ enum btree_id_flags {
 	BTREE_ID_SNAPSHOTS	= BIT(1),
 	BTREE_ID_SNAPSHOT_FIELD	= BIT(2),
 	BTREE_ID_DATA		= BIT(3),
+	BTREE_ID_SMALL_NODES	= BIT(4),
 };
 
 #define BCH_BTREE_IDS()								\
@@ -1294,7 +1339,7 @@ enum btree_id_flags {
 	  BIT_ULL(KEY_TYPE_cookie)|						\
 	  BIT_ULL(KEY_TYPE_hash_whiteout)|					\
 	  BIT_ULL(KEY_TYPE_xattr))						\
-	x(alloc,		4,	0,					\
+	x(alloc,		4,	BTREE_ID_SMALL_NODES,			\
 	  BIT_ULL(KEY_TYPE_alloc)|						\
 	  BIT_ULL(KEY_TYPE_alloc_v2)|						\
 	  BIT_ULL(KEY_TYPE_alloc_v3)|						\
@@ -1311,11 +1356,11 @@ enum btree_id_flags {
 	  BIT_ULL(KEY_TYPE_subvolume))						\
 	x(snapshots,		9,	0,					\
 	  BIT_ULL(KEY_TYPE_snapshot))						\
-	x(lru,			10,	0,					\
+	x(lru,			10,	BTREE_ID_SMALL_NODES,			\
 	  BIT_ULL(KEY_TYPE_set))						\
-	x(freespace,		11,	BTREE_ID_EXTENTS,			\
+	x(freespace,		11,	BTREE_ID_EXTENTS|BTREE_ID_SMALL_NODES,	\
 	  BIT_ULL(KEY_TYPE_set))						\
-	x(need_discard,		12,	0,					\
+	x(need_discard,		12,	BTREE_ID_SMALL_NODES,			\
 	  BIT_ULL(KEY_TYPE_set))						\
 	x(backpointers,		13,	0,					\
 	  BIT_ULL(KEY_TYPE_backpointer))					\
@@ -1327,12 +1372,15 @@ enum btree_id_flags {
 	  BIT_ULL(KEY_TYPE_set))						\
 	x(logged_ops,		17,	0,					\
 	  BIT_ULL(KEY_TYPE_logged_op_truncate)|					\
-	  BIT_ULL(KEY_TYPE_logged_op_finsert))					\
+	  BIT_ULL(KEY_TYPE_logged_op_finsert)|					\
+	  BIT_ULL(KEY_TYPE_logged_op_data_job)|					\
+	  BIT_ULL(KEY_TYPE_inode_alloc_cursor)|					\
+	  BIT_ULL(KEY_TYPE_cookie))						\
 	x(rebalance_work,	18,	BTREE_ID_SNAPSHOT_FIELD,		\
 	  BIT_ULL(KEY_TYPE_set)|BIT_ULL(KEY_TYPE_cookie))			\
 	x(subvolume_children,	19,	0,					\
 	  BIT_ULL(KEY_TYPE_set))						\
-	x(accounting,		20,	BTREE_ID_SNAPSHOT_FIELD,		\
+	x(accounting,		20,	BTREE_ID_SNAPSHOT_FIELD|BTREE_ID_SMALL_NODES,\
 	  BIT_ULL(KEY_TYPE_accounting))						\
 
 enum btree_id {
@@ -87,6 +87,8 @@ struct bch_ioctl_incremental {
 #define BCH_IOCTL_FSCK_OFFLINE	_IOW(0xbc,	19,  struct bch_ioctl_fsck_offline)
 #define BCH_IOCTL_FSCK_ONLINE	_IOW(0xbc,	20,  struct bch_ioctl_fsck_online)
 #define BCH_IOCTL_QUERY_ACCOUNTING _IOW(0xbc,	21,  struct bch_ioctl_query_accounting)
+#define BCH_IOCTL_QUERY_STATS	_IOWR(0xbc,	22,  struct bch_ioctl_query_stats)
+#define BCH_IOCTL_QUERY_ACCOUNTING_V2 _IOWR(0xbc, 23, struct bch_ioctl_query_accounting_v2)
 
 /* ioctl below act on a particular file, not the filesystem as a whole: */
 
@@ -185,7 +187,10 @@ struct bch_ioctl_disk_set_state {
 	x(rereplicate,		1)	\
 	x(migrate,		2)	\
 	x(rewrite_old_nodes,	3)	\
-	x(drop_extra_replicas,	4)
+	x(drop_extra_replicas,	4)	\
+	x(dedup,		5)	\
+	x(btree_defrag,		6)	\
+	x(defrag,		7)
 
 enum bch_data_ops {
 #define x(t, n) BCH_DATA_OP_##t = n,
@@ -217,6 +222,17 @@ struct bch_ioctl_data {
 		__u32		dev;
 		__u32		pad;
 	}			migrate;
+	struct {
+		__u32		dev;
+		__u32		pad;
+	}			scrub;
+	struct {
+		/* extents smaller than this are rewritten: */
+		__u32		extent_sectors;
+		__u32		pad;
+		/* bytes per second, 0 for no limit: */
+		__u64		max_rate;
+	}			defrag;
 	struct {
 		__u64		pad[8];
 	};
@@ -443,4 +459,90 @@ struct bch_ioctl_query_accounting {
 	struct bkey_i_accounting accounting[];
 };
 
+/*
+ * BCH_IOCTL_QUERY_STATS: snapshot of filesystem counters, for monitoring tools
+ *
+ * Returns, in a single call, the persistent event counters, a summary of each
+ * time_stats entry, and sectors read/written per device, so that userspace
+ * can compute rates by diffing two snapshots.
+ *
+ * @nr_counters, @nr_time_stats, @nr_devs - number of entries allocated in @d;
+ * on return, the number of entries filled in. @d contains @nr_counters u64s
+ * (indexed by enum bch_persistent_counters), then @nr_time_stats struct
+ * bch_ioctl_time_stat (indexed by enum bch_time_stats), then @nr_devs struct
+ * bch_ioctl_dev_io.
+ *
+ * Returns -ERANGE if any of the arrays were too small, with the number of
+ * entries required filled in.
+ */
+struct bch_ioctl_time_stat {
+	__u64			count;
+	__u64			total_ns;
+	__u64			max_ns;
+	__u64			p50_ns;
+	__u64			p99_ns;
+	__u64			p999_ns;
+};
+
+struct bch_ioctl_dev_io {
+	__u32			dev;
+	__u32			pad;
+	__u64			sectors[2];	/* read, write */
+};
+
+/* Return counters since mount, instead of totals for the filesystem's lifetime */
+#define BCH_QUERY_STATS_SINCE_MOUNT	(1U << 0)
+
+struct bch_ioctl_query_stats {
+	__u32			flags;
+	__u32			pad;
+
+	__u64			capacity;
+	__u64			used;
+	__u64			online_reserved;
+
+	__u32			nr_counters;
+	__u32			nr_time_stats;
+	__u32			nr_devs;
+	__u32			pad2;
+
+	__u64			d[];
+};
+
+/*
+ * BCH_IOCTL_QUERY_ACCOUNTING_V2: filtered, paginated accounting query
+ *
+ * Like BCH_IOCTL_QUERY_ACCOUNTING, but only returns accounting keys of the
+ * types in @accounting_types_mask, optionally restricted to a single device
+ * (replicas and dev_data_type keys) and a range of snapshot IDs (snapshot
+ * keys).
+ *
+ * Keys are returned in sorted order, starting from @pos, for as many as fit in
+ * @accounting_u64s; on return, @accounting_u64s is the number of u64s used and
+ * @pos is where the next call should start, or SPOS_MAX if there are no more.
+ *
+ * Returns -ERANGE if @accounting_u64s was too small for a single key.
+ */
+#define BCH_ACCOUNTING_QUERY_DEV	(1U << 0)
+#define BCH_ACCOUNTING_QUERY_SNAPSHOT	(1U << 1)
+
+struct bch_ioctl_query_accounting_v2 {
+	__u64			capacity;
+	__u64			used;
+	__u64			online_reserved;
+
+	__u32			accounting_u64s; /* input/output parameter */
+	__u32			accounting_types_mask; /* input parameter */
+
+	__u32			flags;
+	__u32			dev;
+	__u32			snapshot_start;
+	__u32			snapshot_end;
+
+	struct bpos		pos;
+	__u32			pad;
+
+	struct bkey_i_accounting accounting[];
+};
+
 #endif /* _BCACHEFS_IOCTL_H */
@@ -287,6 +287,36 @@ struct bkey __bch2_bkey_unpack_key(const struct bkey_format *format,
 	return out;
 }
 
+void bch2_bkey_unpack_plan_init(struct bkey_unpack_plan *plan,
+				const struct bkey_format *format)
+{
+	unsigned i, bit = high_bit_offset;
+
+	for (i = 0; i < BKEY_NR_FIELDS; i++) {
+		struct bkey_unpack_field *f = &plan->f[i];
+		unsigned bits = format->bits_per_field[i];
+		unsigned word = bit / 64, shift = bit % 64;
+
+		/*
+		 * Empty fields may start past the end of the key, and invalid
+		 * formats are rejected before we ever unpack with them:
+		 */
+		if (!bits || bit + bits > format->key_u64s * 64)
+			word = shift = bits = 0;
+
+		f->hi		= nth_word(high_word_offset(format), word);
+		f->spans	= shift + bits > 64;
+		f->lo		= f->spans
+			? nth_word(high_word_offset(format), word + 1)
+			: f->hi;
+		f->shift	= shift;
+		f->rshift	= bits ? 64 - bits : 0;
+		f->nonzero	= bits != 0;
+
+		bit += format->bits_per_field[i];
+	}
+}
+
 #ifndef HAVE_BCACHEFS_COMPILED_UNPACK
 struct bpos __bkey_unpack_pos(const struct bkey_format *format,
 				     const struct bkey_packed *in)
@@ -394,6 +394,57 @@ bool bch2_bkey_pack(struct bkey_packed *, const struct bkey_i *,
 
 typedef void (*compiled_unpack_fn)(struct bkey *, const struct bkey_packed *);
 
+void bch2_bkey_unpack_plan_init(struct bkey_unpack_plan *,
+				const struct bkey_format *);
+
+/*
+ * Portable fast path for when we don't have compiled unpack: each field is
+ * extracted from at most two words at precomputed positions, with no
+ * dependency on the previous field and no data dependent branches:
+ */
+static __always_inline u64
+bkey_unpack_plan_field(const struct bkey_unpack_field *f,
+		       const u64 *w, __le64 offset)
+{
+	/* avoid shift by 64 if shift is 0 - spans is never set then: */
+	u64 v = (w[f->hi] << f->shift) |
+		(((w[f->lo] & -(u64) f->spans) >> 1) >> (63 - f->shift));
+
+	return ((v >> f->rshift) & -(u64) f->nonzero) + le64_to_cpu(offset);
+}
+
+#define bkey_plan_field(_b, _k, _field)					\
+	bkey_unpack_plan_field(&(_b)->unpack_plan.f[_field],		\
+			       (_k)->_data,				\
+			       (_b)->format.field_offset[_field])
+
+static __always_inline struct bpos
+bkey_unpack_pos_plan(const struct btree *b, const struct bkey_packed *src)
+{
+	return (struct bpos) {
+		.inode		= bkey_plan_field(b, src, BKEY_FIELD_INODE),
+		.offset		= bkey_plan_field(b, src, BKEY_FIELD_OFFSET),
+		.snapshot	= bkey_plan_field(b, src, BKEY_FIELD_SNAPSHOT),
+	};
+}
+
+static __always_inline void
+bkey_unpack_key_plan(const struct btree *b, struct bkey *dst,
+		     const struct bkey_packed *src)
+{
+	dst->u64s	= BKEY_U64s + src->u64s - b->format.key_u64s;
+	dst->format	= KEY_FORMAT_CURRENT;
+	dst->needs_whiteout = src->needs_whiteout;
+	dst->type	= src->type;
+	dst->pad[0]	= 0;
+	dst->p		= bkey_unpack_pos_plan(b, src);
+	dst->size	= bkey_plan_field(b, src, BKEY_FIELD_SIZE);
+	dst->version.hi	= bkey_plan_field(b, src, BKEY_FIELD_VERSION_HI);
+	dst->version.lo	= bkey_plan_field(b, src, BKEY_FIELD_VERSION_LO);
+}
+
+#undef bkey_plan_field
+
 static inline void
 __bkey_unpack_key_format_checked(const struct btree *b,
 			       struct bkey *dst,
@@ -402,15 +453,15 @@ __bkey_unpack_key_format_checked(const struct btree *b,
 	if (IS_ENABLED(HAVE_BCACHEFS_COMPILED_UNPACK)) {
 		compiled_unpack_fn unpack_fn = b->aux_data;
 		unpack_fn(dst, src);
+	} else {
+		bkey_unpack_key_plan(b, dst, src);
+	}
 
-		if (IS_ENABLED(CONFIG_BCACHEFS_DEBUG) &&
-		    bch2_expensive_debug_checks) {
-			struct bkey dst2 = __bch2_bkey_unpack_key(&b->format, src);
+	if (IS_ENABLED(CONFIG_BCACHEFS_DEBUG) &&
+	    bch2_expensive_debug_checks) {
+		struct bkey dst2 = __bch2_bkey_unpack_key(&b->format, src);
 
-			BUG_ON(memcmp(dst, &dst2, sizeof(*dst)));
-		}
-	} else {
-		*dst = __bch2_bkey_unpack_key(&b->format, src);
+		BUG_ON(memcmp(dst, &dst2, sizeof(*dst)));
 	}
 }
 
@@ -452,7 +503,7 @@ bkey_unpack_pos_format_checked(const struct btree *b,
 #ifdef HAVE_BCACHEFS_COMPILED_UNPACK
 	return bkey_unpack_key_format_checked(b, src).p;
 #else
-	return __bkey_unpack_pos(&b->format, src);
+	return bkey_unpack_pos_plan(b, src);
 #endif
 }
 
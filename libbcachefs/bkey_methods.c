@@ -14,6 +14,7 @@
 #include "inode.h"
 #include "io_misc.h"
 #include "lru.h"
+#include "move.h"
 #include "quota.h"
 #include "reflink.h"
 #include "snapshot.h"
@@ -194,7 +194,11 @@ unsigned bch2_sort_keys_keep_unwritten_whiteouts(struct bkey_packed *dst, struct
 /*
  * Main sort routine for compacting a btree node in memory: we always drop
  * whiteouts because any whiteouts that need to be written are in the unwritten
- * whiteouts area:
+ * whiteouts area.
+ *
+ * Keys are never unpacked here: every bset in a node shares the node's format,
+ * so comparisons are done directly on the packed key bits and the output is
+ * just a copy of the input keys. Only bch2_sort_repack() changes format.
  */
 unsigned bch2_sort_keys(struct bkey_packed *dst, struct sort_iter *iter)
 {
@@ -842,6 +842,23 @@ void bch2_bset_init_next(struct btree *b, struct btree_node_entry *bne)
 	set_btree_bset(b, t, i);
 }
 
+bool __bch2_btree_node_aux_trees_ready(struct btree *b)
+{
+	if (test_and_set_bit_lock(BTREE_NODE_aux_tree_building, &b->flags))
+		return false;
+
+	if (btree_node_aux_tree_lazy(b)) {
+		/* lazy nodes were just read, all their bsets are written: */
+		for_each_bset(b, t)
+			bch2_bset_build_aux_tree(b, t, false);
+
+		clear_bit_unlock(BTREE_NODE_aux_tree_lazy, &b->flags);
+	}
+
+	clear_bit_unlock(BTREE_NODE_aux_tree_building, &b->flags);
+	return true;
+}
+
 /*
  * find _some_ key in the same bset as @k that precedes @k - not necessarily the
  * immediate predecessor:
@@ -859,6 +876,9 @@ static struct bkey_packed *__bkey_prev(struct btree *b, struct bset_tree *t,
 	if (k == btree_bkey_first(b, t))
 		return NULL;
 
+	if (unlikely(!bch2_btree_node_aux_trees_ready(b)))
+		return btree_bkey_first(b, t);
+
 	switch (bset_aux_tree_type(t)) {
 	case BSET_NO_AUX_TREE:
 		p = btree_bkey_first(b, t);
@@ -998,6 +1018,20 @@ static void bch2_bset_fix_lookup_table(struct btree *b,
 	bset_aux_tree_verify(b);
 }
 
+void bch2_btree_node_build_inode_filter(struct btree *b)
+{
+	struct bkey_packed *k;
+
+	memset(b->inode_filter, 0, sizeof(b->inode_filter));
+
+	if (!btree_node_has_inode_filter(b))
+		return;
+
+	for_each_bset(b, t)
+		bset_tree_for_each_key(b, t, k)
+			btree_node_inode_filter_add(b, bkey_unpack_pos(b, k).inode);
+}
+
 void bch2_bset_insert(struct btree *b,
 		      struct btree_node_iter *iter,
 		      struct bkey_packed *where,
@@ -1017,6 +1051,9 @@ void bch2_bset_insert(struct btree *b,
 	if (!bkey_deleted(&insert->k))
 		btree_keys_account_key_add(&b->nr, t - b->set, src);
 
+	if (btree_node_has_inode_filter(b))
+		btree_node_inode_filter_add(b, insert->k.p.inode);
+
 	if (src->u64s != clobber_u64s) {
 		u64 *src_p = (u64 *) where->_data + clobber_u64s;
 		u64 *dst_p = (u64 *) where->_data + src->u64s;
@@ -1112,44 +1149,56 @@ static inline bool bkey_mantissa_bits_dropped(const struct btree *b,
 #endif
 }
 
-__flatten
-static struct bkey_packed *bset_search_tree(const struct btree *b,
+/*
+ * One level of descent in the auxiliary search tree: returns the key if we
+ * found an exact match, otherwise advances *_n to the child we recurse to:
+ */
+static __always_inline
+struct bkey_packed *bset_search_tree_step(const struct btree *b,
 				const struct bset_tree *t,
+				struct ro_aux_tree *base,
+				unsigned *_n,
 				const struct bpos *search,
 				const struct bkey_packed *packed_search)
 {
-	struct ro_aux_tree *base = ro_aux_tree_base(b, t);
 	struct bkey_float *f;
 	struct bkey_packed *k;
-	unsigned inorder, n = 1, l, r;
+	unsigned n = *_n, l, r;
 	int cmp;
 
-	do {
-		if (likely(n << 4 < t->size))
-			prefetch(&base->f[n << 4]);
+	if (likely(n << 4 < t->size))
+		prefetch(&base->f[n << 4]);
 
-		f = &base->f[n];
-		if (unlikely(f->exponent >= BFLOAT_FAILED))
-			goto slowpath;
+	f = &base->f[n];
+	if (unlikely(f->exponent >= BFLOAT_FAILED))
+		goto slowpath;
 
-		l = f->mantissa;
-		r = bkey_mantissa(packed_search, f, n);
+	l = f->mantissa;
+	r = bkey_mantissa(packed_search, f, n);
 
-		if (unlikely(l == r) && bkey_mantissa_bits_dropped(b, f, n))
-			goto slowpath;
+	if (unlikely(l == r) && bkey_mantissa_bits_dropped(b, f, n))
+		goto slowpath;
 
-		n = n * 2 + (l < r);
-		continue;
+	*_n = n * 2 + (l < r);
+	return NULL;
 slowpath:
-		k = tree_to_bkey(b, t, n);
-		cmp = bkey_cmp_p_or_unp(b, k, packed_search, search);
-		if (!cmp)
-			return k;
+	k = tree_to_bkey(b, t, n);
+	cmp = bkey_cmp_p_or_unp(b, k, packed_search, search);
+	if (!cmp)
+		return k;
 
-		n = n * 2 + (cmp < 0);
-	} while (n < t->size);
+	*_n = n * 2 + (cmp < 0);
+	return NULL;
+}
 
-	inorder = __eytzinger1_to_inorder(n >> 1, t->size - 1, t->extra);
+static __always_inline
+struct bkey_packed *bset_search_tree_end(const struct btree *b,
+				const struct bset_tree *t,
+				struct ro_aux_tree *base,
+				unsigned n)
+{
+	struct bkey_float *f = &base->f[n >> 1];
+	unsigned inorder = __eytzinger1_to_inorder(n >> 1, t->size - 1, t->extra);
 
 	/*
 	 * n would have been the node we recursed to - the low bit tells us if
@@ -1166,6 +1215,25 @@ slowpath:
 	return cacheline_to_bkey(b, t, inorder, f->key_offset);
 }
 
+__flatten
+static struct bkey_packed *bset_search_tree(const struct btree *b,
+				const struct bset_tree *t,
+				const struct bpos *search,
+				const struct bkey_packed *packed_search)
+{
+	struct ro_aux_tree *base = ro_aux_tree_base(b, t);
+	struct bkey_packed *k;
+	unsigned n = 1;
+
+	do {
+		k = bset_search_tree_step(b, t, base, &n, search, packed_search);
+		if (k)
+			return k;
+	} while (n < t->size);
+
+	return bset_search_tree_end(b, t, base, n);
+}
+
 static __always_inline __flatten
 struct bkey_packed *__bch2_bset_search(struct btree *b,
 				struct bset_tree *t,
@@ -1200,6 +1268,49 @@ struct bkey_packed *__bch2_bset_search(struct btree *b,
 	}
 }
 
+/*
+ * Search every bset in the node: the auxiliary search trees are descended in
+ * lockstep, one level of each per iteration, so that the cache misses of
+ * different trees overlap instead of being taken one tree at a time.
+ */
+__flatten
+static void bset_search_all(struct btree *b,
+			    struct bpos *search,
+			    const struct bkey_packed *lossy_packed_search,
+			    struct bkey_packed **k)
+{
+	struct ro_aux_tree *base[MAX_BSETS];
+	unsigned n[MAX_BSETS], live = 0, i;
+
+	for (i = 0; i < b->nsets; i++) {
+		struct bset_tree *t = b->set + i;
+
+		if (bset_aux_tree_type(t) == BSET_RO_AUX_TREE) {
+			base[i]	= ro_aux_tree_base(b, t);
+			n[i]	= 1;
+			live	|= BIT(i);
+		} else {
+			k[i] = __bch2_bset_search(b, t, search, lossy_packed_search);
+		}
+	}
+
+	while (live)
+		for (i = 0; i < b->nsets; i++) {
+			struct bset_tree *t = b->set + i;
+
+			if (!(live & BIT(i)))
+				continue;
+
+			k[i] = bset_search_tree_step(b, t, base[i], &n[i], search,
+						     lossy_packed_search);
+			if (k[i] || n[i] >= t->size) {
+				if (!k[i])
+					k[i] = bset_search_tree_end(b, t, base[i], n[i]);
+				live &= ~BIT(i);
+			}
+		}
+}
+
 static __always_inline __flatten
 struct bkey_packed *bch2_bset_search_linear(struct btree *b,
 				struct bset_tree *t,
@@ -1260,14 +1371,11 @@ void bch2_btree_node_iter_push(struct btree_node_iter *iter,
 	bch2_btree_node_iter_sort(iter, b);
 }
 
-noinline __flatten __cold
-static void btree_node_iter_init_pack_failed(struct btree_node_iter *iter,
-			      struct btree *b, struct bpos *search)
+static void btree_node_iter_init_linear(struct btree_node_iter *iter,
+					struct btree *b, struct bpos *search)
 {
 	struct bkey_packed *k;
 
-	trace_bkey_pack_pos_fail(search);
-
 	bch2_btree_node_iter_init_from_start(iter, b);
 
 	while ((k = bch2_btree_node_iter_peek(iter, b)) &&
@@ -1275,6 +1383,30 @@ static void btree_node_iter_init_pack_failed(struct btree_node_iter *iter,
 		bch2_btree_node_iter_advance(iter, b);
 }
 
+noinline __flatten __cold
+static void btree_node_iter_init_pack_failed(struct btree_node_iter *iter,
+			      struct btree *b, struct bpos *search)
+{
+	trace_bkey_pack_pos_fail(search);
+	btree_node_iter_init_linear(iter, b, search);
+}
+
+/*
+ * No aux search tree yet: a scan entering the node at its start doesn't need
+ * one, otherwise build it now (unless another thread already is):
+ */
+noinline __flatten
+static bool btree_node_iter_init_lazy(struct btree_node_iter *iter,
+				      struct btree *b, struct bpos *search)
+{
+	if (!bpos_le(*search, b->data->min_key) &&
+	    bch2_btree_node_aux_trees_ready(b))
+		return false;
+
+	btree_node_iter_init_linear(iter, b, search);
+	return true;
+}
+
 /**
  * bch2_btree_node_iter_init - initialize a btree node iterator, starting from a
  * given position
@@ -1330,6 +1462,11 @@ void bch2_btree_node_iter_init(struct btree_node_iter *iter,
 
 	EBUG_ON(bpos_lt(*search, b->data->min_key));
 	EBUG_ON(bpos_gt(*search, b->data->max_key));
+
+	if (unlikely(btree_node_aux_tree_lazy(b)) &&
+	    btree_node_iter_init_lazy(iter, b, search))
+		return;
+
 	bset_aux_tree_verify(b);
 
 	memset(iter, 0, sizeof(*iter));
@@ -1346,10 +1483,10 @@ void bch2_btree_node_iter_init(struct btree_node_iter *iter,
 		return;
 	}
 
-	for (i = 0; i < b->nsets; i++) {
-		k[i] = __bch2_bset_search(b, b->set + i, search, &p);
+	bset_search_all(b, search, &p, k);
+
+	for (i = 0; i < b->nsets; i++)
 		prefetch_four_cachelines(k[i]);
-	}
 
 	for (i = 0; i < b->nsets; i++) {
 		struct bset_tree *t = b->set + i;
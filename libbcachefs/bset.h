@@ -2,6 +2,7 @@
 #ifndef _BCACHEFS_BSET_H
 #define _BCACHEFS_BSET_H
 
+#include <linux/hash.h>
 #include <linux/kernel.h>
 #include <linux/types.h>
 
@@ -245,6 +246,7 @@ static inline void btree_node_set_format(struct btree *b,
 
 	b->format	= f;
 	b->nr_key_bits	= bkey_format_key_bits(&f);
+	bch2_bkey_unpack_plan_init(&b->unpack_plan, &b->format);
 
 	len = bch2_compile_bkey_format(&b->format, b->aux_data);
 	BUG_ON(len < 0 || len > U8_MAX);
@@ -270,6 +272,61 @@ void bch2_bset_init_first(struct btree *, struct bset *);
 void bch2_bset_init_next(struct btree *, struct btree_node_entry *);
 void bch2_bset_build_aux_tree(struct btree *, struct bset_tree *, bool);
 
+/* Inode filter: */
+
+#define BTREE_NODE_INODE_FILTER_BTREES		\
+	(BIT_ULL(BTREE_ID_extents)|		\
+	 BIT_ULL(BTREE_ID_dirents)|		\
+	 BIT_ULL(BTREE_ID_xattrs))
+
+static inline bool btree_node_has_inode_filter(const struct btree *b)
+{
+	return !b->c.level &&
+		(BIT_ULL(b->c.btree_id) & BTREE_NODE_INODE_FILTER_BTREES);
+}
+
+static inline unsigned btree_node_inode_filter_bit(u64 inum, unsigned n)
+{
+	u64 h = inum * GOLDEN_RATIO_64;
+
+	return (h >> (64 - BTREE_NODE_INODE_FILTER_SHIFT * (n + 1))) &
+		(BTREE_NODE_INODE_FILTER_BITS - 1);
+}
+
+static inline void btree_node_inode_filter_add(struct btree *b, u64 inum)
+{
+	__set_bit(btree_node_inode_filter_bit(inum, 0), b->inode_filter);
+	__set_bit(btree_node_inode_filter_bit(inum, 1), b->inode_filter);
+}
+
+/*
+ * Returns false if @b definitely has no keys (including whiteouts) for @inum:
+ * the filter is rebuilt whenever the node is read or rewritten, and only ever
+ * gains bits on insert, so it's always a superset of the keys in the node.
+ */
+static inline bool bch2_btree_node_may_have_inode(const struct btree *b, u64 inum)
+{
+	return !btree_node_has_inode_filter(b) ||
+		(test_bit(btree_node_inode_filter_bit(inum, 0), b->inode_filter) &&
+		 test_bit(btree_node_inode_filter_bit(inum, 1), b->inode_filter));
+}
+
+void bch2_btree_node_build_inode_filter(struct btree *);
+
+bool __bch2_btree_node_aux_trees_ready(struct btree *);
+
+/*
+ * Nodes that were just read don't get their aux search trees until the first
+ * lookup that needs one - nodes a scan only iterates over never do: returns
+ * false if another thread is building them right now, in which case the
+ * caller has to do a linear search instead.
+ */
+static inline bool bch2_btree_node_aux_trees_ready(struct btree *b)
+{
+	return likely(!(smp_load_acquire(&b->flags) & BIT(BTREE_NODE_aux_tree_lazy))) ||
+		__bch2_btree_node_aux_trees_ready(b);
+}
+
 void bch2_bset_insert(struct btree *, struct btree_node_iter *,
 		     struct bkey_packed *, struct bkey_i *, unsigned);
 void bch2_bset_delete(struct btree *, struct bkey_packed *, unsigned);
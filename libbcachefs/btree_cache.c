@@ -7,12 +7,14 @@
 #include "btree_io.h"
 #include "btree_iter.h"
 #include "btree_locking.h"
+#include "btree_update_interior.h"
 #include "debug.h"
 #include "errcode.h"
 #include "error.h"
 #include "journal.h"
 #include "trace.h"
 
+#include <linux/lz4.h>
 #include <linux/prefetch.h>
 #include <linux/sched/mm.h>
 
@@ -59,6 +61,99 @@ static void btree_node_to_freedlist(struct btree_cache *bc, struct btree *b)
 		list_move(&b->list, &bc->freed_nonpcpu);
 }
 
+#ifndef __KERNEL__
+/*
+ * In userspace, malloc() gives each btree node buffer its own mmap() of small
+ * pages; with the very large btree caches fsck can use that means a lot of
+ * TLB misses. Instead, carve node buffers out of 2MB chunks that we ask to be
+ * backed by transparent hugepages. Freed buffers are kept for reuse until
+ * shutdown.
+ *
+ * Node buffers get swapped with btree_io.c bounce buffers, so those come from
+ * here too:
+ */
+#define BTREE_BUF_ARENA_CHUNK	(2UL << 20)
+
+void *bch2_btree_buf_alloc(struct bch_fs *c, gfp_t gfp)
+{
+	struct btree_cache *bc = &c->btree_cache;
+	size_t size = c->opts.btree_node_size;
+	void *p = NULL;
+
+	if (size > BTREE_BUF_ARENA_CHUNK)
+		return kvmalloc(size, gfp);
+
+	mutex_lock(&bc->arena_lock);
+	if (!bc->arena_free.nr) {
+		void *chunk = aligned_alloc(BTREE_BUF_ARENA_CHUNK, BTREE_BUF_ARENA_CHUNK);
+		if (!chunk)
+			goto out;
+
+		madvise(chunk, BTREE_BUF_ARENA_CHUNK, MADV_HUGEPAGE);
+
+		if (darray_push(&bc->arena_chunks, chunk) ||
+		    darray_make_room(&bc->arena_free, BTREE_BUF_ARENA_CHUNK / size)) {
+			if (bc->arena_chunks.nr && darray_last(bc->arena_chunks) == chunk)
+				bc->arena_chunks.nr--;
+			free(chunk);
+			goto out;
+		}
+
+		for (size_t i = 0; i + size <= BTREE_BUF_ARENA_CHUNK; i += size)
+			bc->arena_free.data[bc->arena_free.nr++] = chunk + i;
+	}
+
+	p = darray_pop(&bc->arena_free);
+out:
+	mutex_unlock(&bc->arena_lock);
+	return p;
+}
+
+void bch2_btree_buf_free(struct bch_fs *c, void *p)
+{
+	struct btree_cache *bc = &c->btree_cache;
+
+	if (!p)
+		return;
+
+	if (c->opts.btree_node_size > BTREE_BUF_ARENA_CHUNK) {
+		kvfree(p);
+		return;
+	}
+
+	mutex_lock(&bc->arena_lock);
+	/* we reserved room for every buffer when allocating the chunk: */
+	BUG_ON(darray_push(&bc->arena_free, p));
+	mutex_unlock(&bc->arena_lock);
+}
+
+void bch2_fs_btree_buf_exit(struct bch_fs *c)
+{
+	struct btree_cache *bc = &c->btree_cache;
+
+	darray_for_each(bc->arena_chunks, i)
+		free(*i);
+	darray_exit(&bc->arena_chunks);
+	darray_exit(&bc->arena_free);
+}
+#endif
+
+static void *btree_bounce_pool_alloc(gfp_t gfp, void *c)
+{
+	return bch2_btree_buf_alloc(c, gfp);
+}
+
+static void btree_bounce_pool_free(void *p, void *c)
+{
+	bch2_btree_buf_free(c, p);
+}
+
+int bch2_fs_btree_bounce_pool_init(struct bch_fs *c)
+{
+	return mempool_init(&c->btree_bounce_pool, 1,
+			    btree_bounce_pool_alloc, btree_bounce_pool_free, c);
+}
+
 static void btree_node_data_free(struct bch_fs *c, struct btree *b)
 {
 	struct btree_cache *bc = &c->btree_cache;
@@ -67,7 +162,7 @@ static void btree_node_data_free(struct bch_fs *c, struct btree *b)
 
 	clear_btree_node_just_written(b);
 
-	kvfree(b->data);
+	bch2_btree_buf_free(c, b->data);
 	b->data = NULL;
 #ifdef __KERNEL__
 	kvfree(b->aux_data);
@@ -102,7 +197,7 @@ static int btree_node_data_alloc(struct bch_fs *c, struct btree *b, gfp_t gfp)
 {
 	BUG_ON(b->data || b->aux_data);
 
-	b->data = kvmalloc(btree_buf_bytes(b), gfp);
+	b->data = bch2_btree_buf_alloc(c, gfp);
 	if (!b->data)
 		return -BCH_ERR_ENOMEM_btree_node_mem_alloc;
 #ifdef __KERNEL__
@@ -115,7 +210,7 @@ static int btree_node_data_alloc(struct bch_fs *c, struct btree *b, gfp_t gfp)
 		b->aux_data = NULL;
 #endif
 	if (!b->aux_data) {
-		kvfree(b->data);
+		bch2_btree_buf_free(c, b->data);
 		b->data = NULL;
 		return -BCH_ERR_ENOMEM_btree_node_mem_alloc;
 	}
@@ -172,6 +267,7 @@ void bch2_btree_node_hash_remove(struct btree_cache *bc, struct btree *b)
 
 	if (b->c.btree_id < BTREE_ID_NR)
 		--bc->used_by_btree[b->c.btree_id];
+	--bc->used_by_level[b->c.level];
 }
 
 int __bch2_btree_node_hash_insert(struct btree_cache *bc, struct btree *b)
@@ -183,6 +279,8 @@ int __bch2_btree_node_hash_insert(struct btree_cache *bc, struct btree *b)
 						bch_btree_cache_params);
 	if (!ret && b->c.btree_id < BTREE_ID_NR)
 		bc->used_by_btree[b->c.btree_id]++;
+	if (!ret)
+		bc->used_by_level[b->c.level]++;
 	return ret;
 }
 
@@ -364,6 +462,299 @@ static int btree_node_write_and_reclaim(struct bch_fs *c, struct btree *b)
 	return __btree_node_reclaim(c, b, true, false);
 }
 
+/*
+ * Replacement policy:
+ *
+ * The live list is a CLOCK: the shrinker walks it from the head, giving nodes
+ * with the accessed bit set a second chance. Normal fills are added at the
+ * tail with the accessed bit set, i.e. as far from the hand as possible, but
+ * nodes read in by a scan (readahead, or a path that's scanning) are added at
+ * the head without it, and scanning paths don't set the accessed bit: a node
+ * only touched by a scan is the first thing to go, so a full btree scan can't
+ * push out the working set.
+ *
+ * Interior nodes are pinned by level: a node at level l is only evictable once
+ * leaves are less than 1/2^l of the cache.
+ */
+static inline bool btree_node_level_evictable(struct btree_cache *bc, struct btree *b)
+{
+	return !b->c.level ||
+		bc->used_by_level[0] < (bc->used >> b->c.level);
+}
+
+static inline void btree_cache_lookup_count(struct btree_cache *bc,
+					    enum btree_id btree, unsigned level,
+					    bool hit)
+{
+	if (!bc->lookups || btree >= BTREE_ID_NR)
+		return;
+
+	if (hit)
+		this_cpu_inc(bc->lookups->hit[btree][level]);
+	else
+		this_cpu_inc(bc->lookups->miss[btree][level]);
+}
+
+static inline void btree_node_touch(struct btree_cache *bc, struct btree *b,
+				    struct btree_path *path)
+{
+	btree_cache_lookup_count(bc, b->c.btree_id, b->c.level, true);
+
+	/* avoid atomic set bit if it's not needed: */
+	if (!btree_node_accessed(b) &&
+	    !(path && btree_path_scanning(path)))
+		set_btree_node_accessed(b);
+}
+
+static void btree_node_make_cold(struct btree_cache *bc, struct btree *b)
+{
+	clear_btree_node_accessed(b);
+
+	mutex_lock(&bc->lock);
+	list_move(&b->list, &bc->live);
+	mutex_unlock(&bc->lock);
+}
+
+/* Compressed tier: */
+
+/*
+ * A clean btree node's in memory contents, compressed - along with just enough
+ * of struct btree to reconstruct it without redoing bch2_btree_node_read_done()
+ * (the bsets are already sorted and validated):
+ */
+struct btree_compressed {
+	struct rhash_head	hash;
+	u64			hash_val;
+	struct list_head	list;
+
+	u16			written;
+	u8			nsets;
+	bool			need_rewrite;
+	u16			version_ondisk;
+	u16			whiteout_u64s;
+	struct btree_nr_keys	nr;
+	u16			data_offset[MAX_BSETS];
+	u16			end_offset[MAX_BSETS];
+	unsigned		bytes;
+	unsigned		compressed_bytes;
+	__BKEY_PADDED(key, BKEY_BTREE_PTR_VAL_U64s_MAX);
+
+	u8			data[];
+};
+
+static const struct rhashtable_params bch_btree_compressed_params = {
+	.head_offset		= offsetof(struct btree_compressed, hash),
+	.key_offset		= offsetof(struct btree_compressed, hash_val),
+	.key_len		= sizeof(u64),
+	.automatic_shrinking	= true,
+};
+
+static void btree_compressed_free(struct btree_cache *bc, struct btree_compressed *n)
+{
+	lockdep_assert_held(&bc->lock);
+
+	rhashtable_remove_fast(&bc->compressed_table, &n->hash,
+			       bch_btree_compressed_params);
+	list_del(&n->list);
+	bc->compressed_nr--;
+	bc->compressed_bytes -= n->compressed_bytes;
+	kvfree(n);
+}
+
+/* Called from the shrinker, with the node write locked and clean: */
+static void btree_node_compress(struct bch_fs *c, struct btree *b)
+{
+	struct btree_cache *bc = &c->btree_cache;
+	struct btree_compressed *n;
+
+	lockdep_assert_held(&bc->lock);
+
+	if (!bc->compress_buf ||
+	    !b->hash_val ||
+	    !b->written ||
+	    btree_node_read_error(b))
+		return;
+
+	unsigned bytes = (void *) btree_bkey_last(b, bset_tree_last(b)) - (void *) b->data;
+	int compressed_bytes = LZ4_compress_default((void *) b->data, bc->compress_buf,
+						    bytes, LZ4_compressBound(btree_buf_bytes(b)),
+						    bc->compress_workspace);
+	/* not worth keeping if it doesn't compress well: */
+	if (compressed_bytes <= 0 || compressed_bytes > bytes / 2)
+		return;
+
+	n = kvmalloc(sizeof(*n) + compressed_bytes, GFP_NOWAIT|__GFP_NOWARN);
+	if (!n)
+		return;
+
+	n->hash_val		= b->hash_val;
+	n->written		= b->written;
+	n->nsets		= b->nsets;
+	n->need_rewrite		= btree_node_need_rewrite(b);
+	n->version_ondisk	= b->version_ondisk;
+	n->whiteout_u64s	= b->whiteout_u64s;
+	n->nr			= b->nr;
+	for (unsigned i = 0; i < b->nsets; i++) {
+		n->data_offset[i]	= b->set[i].data_offset;
+		n->end_offset[i]	= b->set[i].end_offset;
+	}
+	n->bytes		= bytes;
+	n->compressed_bytes	= compressed_bytes;
+	bkey_copy(&n->key, &b->key);
+	memcpy(n->data, bc->compress_buf, compressed_bytes);
+
+	/* a stale entry for the same node can't be left behind: */
+	struct btree_compressed *old =
+		rhashtable_lookup_fast(&bc->compressed_table, &n->hash_val,
+				       bch_btree_compressed_params);
+	if (old)
+		btree_compressed_free(bc, old);
+
+	if (rhashtable_lookup_insert_fast(&bc->compressed_table, &n->hash,
+					  bch_btree_compressed_params)) {
+		kvfree(n);
+		return;
+	}
+
+	list_add(&n->list, &bc->compressed);
+	bc->compressed_nr++;
+	bc->compressed_bytes += compressed_bytes;
+}
+
+/*
+ * On a btree node fill, check for a compressed copy of the node: returns true
+ * if @b was reconstructed from it, and doesn't need to be read:
+ */
+static bool btree_node_decompress(struct bch_fs *c, struct btree *b)
+{
+	struct btree_cache *bc = &c->btree_cache;
+	struct btree_compressed *n;
+	bool ret = false;
+
+	if (!bc->compressed_nr)
+		return false;
+
+	mutex_lock(&bc->lock);
+	n = rhashtable_lookup_fast(&bc->compressed_table, &b->hash_val,
+				   bch_btree_compressed_params);
+	if (!n)
+		goto out;
+
+	/* the hash is only the seq or first pointer, check that it's the same node: */
+	if (!bkey_and_val_eq(bkey_i_to_s_c(&n->key), bkey_i_to_s_c(&b->key)))
+		goto free;
+
+	if (LZ4_decompress_safe((void *) n->data, (void *) b->data,
+				n->compressed_bytes, btree_buf_bytes(b)) != n->bytes)
+		goto free;
+
+	btree_node_set_format(b, b->data->format);
+
+	b->written		= n->written;
+	b->nsets		= n->nsets;
+	b->version_ondisk	= n->version_ondisk;
+	b->whiteout_u64s	= n->whiteout_u64s;
+	b->nr			= n->nr;
+	for (unsigned i = 0; i < n->nsets; i++) {
+		b->set[i].data_offset	= n->data_offset[i];
+		b->set[i].end_offset	= n->end_offset[i];
+	}
+	if (n->need_rewrite)
+		set_btree_node_need_rewrite(b);
+
+	bch2_btree_build_aux_trees(b);
+	btree_node_reset_sib_u64s(b);
+
+	bc->compressed_hits++;
+	ret = true;
+free:
+	btree_compressed_free(bc, n);
+out:
+	mutex_unlock(&bc->lock);
+	return ret;
+}
+
+static unsigned long bch2_btree_compressed_scan(struct shrinker *shrink,
+						struct shrink_control *sc)
+{
+	struct bch_fs *c = shrink->private_data;
+	struct btree_cache *bc = &c->btree_cache;
+	unsigned long freed = 0;
+
+	mutex_lock(&bc->lock);
+	while (freed < sc->nr_to_scan && !list_empty(&bc->compressed)) {
+		btree_compressed_free(bc, list_last_entry(&bc->compressed,
+							  struct btree_compressed, list));
+		freed++;
+	}
+	mutex_unlock(&bc->lock);
+
+	return freed;
+}
+
+static unsigned long bch2_btree_compressed_count(struct shrinker *shrink,
+						 struct shrink_control *sc)
+{
+	struct bch_fs *c = shrink->private_data;
+
+	return c->btree_cache.compressed_nr;
+}
+
+static void bch2_fs_btree_cache_compressed_exit(struct btree_cache *bc)
+{
+	if (bc->compressed_shrink)
+		shrinker_free(bc->compressed_shrink);
+
+	mutex_lock(&bc->lock);
+	while (!list_empty(&bc->compressed))
+		btree_compressed_free(bc, list_first_entry(&bc->compressed,
+							   struct btree_compressed, list));
+	mutex_unlock(&bc->lock);
+
+	if (bc->compressed_table_init_done)
+		rhashtable_destroy(&bc->compressed_table);
+
+	kvfree(bc->compress_workspace);
+	kvfree(bc->compress_buf);
+}
+
+static int bch2_fs_btree_cache_compressed_init(struct bch_fs *c)
+{
+	struct btree_cache *bc = &c->btree_cache;
+	struct shrinker *shrink;
+
+	if (!c->opts.btree_cache_compressed)
+		return 0;
+
+	int ret = rhashtable_init(&bc->compressed_table, &bch_btree_compressed_params);
+	if (ret)
+		return ret;
+
+	bc->compressed_table_init_done = true;
+
+	bc->compress_buf = kvmalloc(LZ4_compressBound(c->opts.btree_node_size), GFP_KERNEL);
+	if (!bc->compress_buf)
+		return -ENOMEM;
+
+	if (LZ4_MEM_COMPRESS) {
+		bc->compress_workspace = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+		if (!bc->compress_workspace)
+			return -ENOMEM;
+	}
+
+	shrink = shrinker_alloc(0, "%s-btree_cache_compressed", c->name);
+	if (!shrink)
+		return -ENOMEM;
+	bc->compressed_shrink = shrink;
+	shrink->count_objects	= bch2_btree_compressed_count;
+	shrink->scan_objects	= bch2_btree_compressed_scan;
+	shrink->seeks		= 2;
+	shrink->private_data	= c;
+	shrinker_register(shrink);
+
+	return 0;
+}
+
 static unsigned long bch2_btree_cache_scan(struct shrinker *shrink,
 					   struct shrink_control *sc)
 {
@@ -421,11 +812,14 @@ restart:
 	list_for_each_entry_safe(b, t, &bc->live, list) {
 		touched++;
 
-		if (btree_node_accessed(b)) {
+		if (!btree_node_level_evictable(bc, b)) {
+			bc->not_freed_interior++;
+		} else if (btree_node_accessed(b)) {
 			clear_btree_node_accessed(b);
 			bc->not_freed_access_bit++;
 		} else if (!btree_node_reclaim(c, b, true)) {
 			freed++;
+			btree_node_compress(c, b);
 			btree_node_data_free(c, b);
 			bc->freed++;
 
@@ -484,6 +878,8 @@ void bch2_fs_btree_cache_exit(struct bch_fs *c)
 	unsigned i, flags;
 
 	shrinker_free(bc->shrink);
+	bch2_fs_btree_cache_compressed_exit(bc);
+	free_percpu(bc->lookups);
 
 	/* vfree() can allocate memory: */
 	flags = memalloc_nofs_save();
@@ -544,6 +940,10 @@ int bch2_fs_btree_cache_init(struct bch_fs *c)
 
 	bc->table_init_done = true;
 
+	bc->lookups = alloc_percpu(struct btree_cache_lookups);
+	if (!bc->lookups)
+		goto err;
+
 	bch2_recalc_btree_reserve(c);
 
 	for (i = 0; i < bc->reserve; i++)
@@ -564,6 +964,9 @@ int bch2_fs_btree_cache_init(struct bch_fs *c)
 	shrink->private_data	= c;
 	shrinker_register(shrink);
 
+	if (bch2_fs_btree_cache_compressed_init(c))
+		goto err;
+
 	return 0;
 err:
 	return -BCH_ERR_ENOMEM_fs_btree_cache_init;
@@ -576,6 +979,11 @@ void bch2_fs_btree_cache_init_early(struct btree_cache *bc)
 	INIT_LIST_HEAD(&bc->freeable);
 	INIT_LIST_HEAD(&bc->freed_pcpu);
 	INIT_LIST_HEAD(&bc->freed_nonpcpu);
+	INIT_LIST_HEAD(&bc->compressed);
+
+#ifndef __KERNEL__
+	mutex_init(&bc->arena_lock);
+#endif
 }
 
 /*
@@ -629,11 +1037,17 @@ success:
 	return 0;
 }
 
-static struct btree *btree_node_cannibalize(struct bch_fs *c)
+static struct btree *btree_node_cannibalize(struct bch_fs *c, bool pcpu_read_locks)
 {
 	struct btree_cache *bc = &c->btree_cache;
 	struct btree *b;
 
+	/* Prefer a node whose lock is already in the mode we want: */
+	list_for_each_entry_reverse(b, &bc->live, list)
+		if (!b->c.lock.readers == !pcpu_read_locks &&
+		    !btree_node_reclaim(c, b, false))
+			return b;
+
 	list_for_each_entry_reverse(b, &bc->live, list)
 		if (!btree_node_reclaim(c, b, false))
 			return b;
@@ -742,7 +1156,7 @@ err:
 
 	/* Try to cannibalize another cached btree node: */
 	if (bc->alloc_lock == current) {
-		b2 = btree_node_cannibalize(c);
+		b2 = btree_node_cannibalize(c, pcpu_read_locks);
 		clear_btree_node_just_written(b2);
 		bch2_btree_node_hash_remove(bc, b2);
 
@@ -814,7 +1228,7 @@ static noinline struct btree *bch2_btree_node_fill(struct btree_trans *trans,
 		return ERR_PTR(btree_trans_restart(trans, BCH_ERR_transaction_restart_fill_relock));
 	}
 
-	b = bch2_btree_node_mem_alloc(trans, level != 0);
+	b = bch2_btree_node_mem_alloc(trans, btree_node_pcpu_read_locks(btree_id, level));
 
 	if (bch2_err_matches(PTR_ERR_OR_ZERO(b), ENOMEM)) {
 		if (!path)
@@ -844,6 +1258,25 @@ static noinline struct btree *bch2_btree_node_fill(struct btree_trans *trans,
 		return NULL;
 	}
 
+	if (sync)
+		btree_cache_lookup_count(bc, btree_id, level, false);
+
+	if (!sync || (path && btree_path_scanning(path)))
+		btree_node_make_cold(bc, b);
+
+	if (btree_node_decompress(c, b)) {
+		six_unlock_write(&b->c.lock);
+
+		if (!sync) {
+			six_unlock_intent(&b->c.lock);
+			return NULL;
+		}
+
+		if (lock_type == SIX_LOCK_read)
+			six_lock_downgrade(&b->c.lock);
+		return b;
+	}
+
 	set_btree_node_read_in_flight(b);
 	six_unlock_write(&b->c.lock);
 
@@ -960,9 +1393,7 @@ retry:
 			return ERR_PTR(btree_trans_restart(trans, BCH_ERR_transaction_restart_lock_node_reused));
 		}
 
-		/* avoid atomic set bit if it's not needed: */
-		if (!btree_node_accessed(b))
-			set_btree_node_accessed(b);
+		btree_node_touch(bc, b, path);
 	}
 
 	if (unlikely(btree_node_read_in_flight(b))) {
@@ -1087,9 +1518,7 @@ struct btree *bch2_btree_node_get(struct btree_trans *trans, struct btree_path *
 		prefetch(p + L1_CACHE_BYTES * 2);
 	}
 
-	/* avoid atomic set bit if it's not needed: */
-	if (!btree_node_accessed(b))
-		set_btree_node_accessed(b);
+	btree_node_touch(&c->btree_cache, b, path);
 
 	if (unlikely(btree_node_read_error(b))) {
 		six_unlock_type(&b->c.lock, lock_type);
@@ -1169,9 +1598,7 @@ lock_node:
 		prefetch(p + L1_CACHE_BYTES * 2);
 	}
 
-	/* avoid atomic set bit if it's not needed: */
-	if (!btree_node_accessed(b))
-		set_btree_node_accessed(b);
+	btree_node_touch(bc, b, NULL);
 
 	if (unlikely(btree_node_read_error(b))) {
 		six_unlock_read(&b->c.lock);
@@ -1336,6 +1763,14 @@ void bch2_btree_cache_to_text(struct printbuf *out, const struct btree_cache *bc
 	prt_printf(out, "cannibalize lock:\t%p\n",	bc->alloc_lock);
 	prt_newline(out);
 
+	if (bc->compress_buf) {
+		prt_printf(out, "compressed:\t");
+		prt_human_readable_u64(out, bc->compressed_bytes);
+		prt_printf(out, " (%zu)\n", bc->compressed_nr);
+		prt_printf(out, "compressed hits:\t%u\n", bc->compressed_hits);
+		prt_newline(out);
+	}
+
 	for (unsigned i = 0; i < ARRAY_SIZE(bc->used_by_btree); i++)
 		prt_btree_cache_line(out, c, bch2_btree_id_str(i), bc->used_by_btree[i]);
 
@@ -1351,4 +1786,36 @@ void bch2_btree_cache_to_text(struct printbuf *out, const struct btree_cache *bc
 	prt_printf(out, "  no evict failed\t%u\n", bc->not_freed_noevict);
 	prt_printf(out, "  write blocked\t%u\n", bc->not_freed_write_blocked);
 	prt_printf(out, "  will make reachable\t%u\n", bc->not_freed_will_make_reachable);
+	prt_printf(out, "  interior pinned\t%u\n", bc->not_freed_interior);
+}
+
+void bch2_btree_cache_lookups_to_text(struct printbuf *out, const struct btree_cache *bc)
+{
+	if (!bc->lookups)
+		return;
+
+	if (!out->nr_tabstops)
+		printbuf_tabstop_push(out, 24);
+
+	prt_printf(out, "btree\tlevel\thits\tmisses\thit rate\n");
+
+	for (unsigned btree = 0; btree < BTREE_ID_NR; btree++)
+		for (unsigned level = 0; level < BTREE_MAX_DEPTH; level++) {
+			u64 hit = 0, miss = 0;
+			int cpu;
+
+			for_each_possible_cpu(cpu) {
+				struct btree_cache_lookups *l = per_cpu_ptr(bc->lookups, cpu);
+
+				hit	+= l->hit[btree][level];
+				miss	+= l->miss[btree][level];
+			}
+
+			if (!hit && !miss)
+				continue;
+
+			prt_printf(out, "%s\t%u\t%llu\t%llu\t%llu%%\n",
+				   bch2_btree_id_str(btree), level, hit, miss,
+				   div64_u64(hit * 100, hit + miss));
+		}
 }
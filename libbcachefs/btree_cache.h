@@ -38,10 +38,52 @@ int bch2_btree_node_prefetch(struct btree_trans *, struct btree_path *,
 
 void bch2_btree_node_evict(struct btree_trans *, const struct bkey_i *);
 
+#ifdef __KERNEL__
+static inline void *bch2_btree_buf_alloc(struct bch_fs *c, gfp_t gfp)
+{
+	return kvmalloc(c->opts.btree_node_size, gfp);
+}
+
+static inline void bch2_btree_buf_free(struct bch_fs *c, void *p)
+{
+	kvfree(p);
+}
+
+static inline void bch2_fs_btree_buf_exit(struct bch_fs *c) {}
+#else
+void *bch2_btree_buf_alloc(struct bch_fs *, gfp_t);
+void bch2_btree_buf_free(struct bch_fs *, void *);
+void bch2_fs_btree_buf_exit(struct bch_fs *);
+#endif
+int bch2_fs_btree_bounce_pool_init(struct bch_fs *);
+
 void bch2_fs_btree_cache_exit(struct bch_fs *);
 int bch2_fs_btree_cache_init(struct bch_fs *);
 void bch2_fs_btree_cache_init_early(struct btree_cache *);
 
+/*
+ * Leaves of these btrees are looked up by nearly every operation (subvolume
+ * and snapshot lookups on every path walk) but almost never written:
+ */
+#define BTREE_PCPU_READ_LOCK_LEAVES		\
+	(BIT_ULL(BTREE_ID_subvolumes)|		\
+	 BIT_ULL(BTREE_ID_snapshots)|		\
+	 BIT_ULL(BTREE_ID_snapshot_trees))
+
+/*
+ * Which nodes get percpu reader counts: those that are read locked by many
+ * threads and rarely write locked, since taking a write lock has to sum the
+ * reader counts of every cpu. That's interior nodes - every traversal goes
+ * through the root - and the leaves of a few small read-mostly btrees.
+ *
+ * This is fixed when the node is allocated: a lock's reader mode can't be
+ * switched while other threads may be sampling it without holding it.
+ */
+static inline bool btree_node_pcpu_read_locks(enum btree_id btree, unsigned level)
+{
+	return level || (BIT_ULL(btree) & BTREE_PCPU_READ_LOCK_LEAVES);
+}
+
 static inline u64 btree_ptr_hash_val(const struct bkey_i *k)
 {
 	switch (k->k.type) {
@@ -109,6 +151,41 @@ static inline unsigned btree_blocks(const struct bch_fs *c)
 	(BTREE_FOREGROUND_MERGE_THRESHOLD(c) +			\
 	 (BTREE_FOREGROUND_MERGE_THRESHOLD(c) >> 2))
 
+/*
+ * Leaves of btrees that see heavy random updates (alloc, lru, accounting) are
+ * kept smaller than btree_node_size, to reduce the cost of compacting and
+ * rewriting them: they're still allocated and buffered at the full node size,
+ * but split and merged against btree_node_size_small - existing nodes converge
+ * on the new size as they're rewritten:
+ */
+static inline bool btree_node_small(const struct bch_fs *c, const struct btree *b)
+{
+	return !b->c.level &&
+		btree_id_small_nodes(b->c.btree_id) &&
+		c->opts.btree_node_size_small < c->opts.btree_node_size;
+}
+
+static inline size_t btree_node_max_u64s(const struct bch_fs *c, const struct btree *b)
+{
+	return unlikely(btree_node_small(c, b))
+		? (c->opts.btree_node_size_small - sizeof(struct btree_node)) / sizeof(u64)
+		: btree_max_u64s(c);
+}
+
+#define BTREE_NODE_SPLIT_THRESHOLD(c, b)	(btree_node_max_u64s(c, b) * 2 / 3)
+
+static inline size_t btree_node_foreground_merge_threshold(const struct bch_fs *c,
+							   const struct btree *b)
+{
+	return unlikely(btree_node_small(c, b))
+		? btree_node_max_u64s(c, b) * 1 / 3
+		: c->btree_foreground_merge_threshold;
+}
+
+#define BTREE_NODE_FOREGROUND_MERGE_HYSTERESIS(c, b)		\
+	(btree_node_foreground_merge_threshold(c, b) +		\
+	 (btree_node_foreground_merge_threshold(c, b) >> 2))
+
 static inline unsigned btree_id_nr_alive(struct bch_fs *c)
 {
 	return BTREE_ID_NR + c->btree_roots_extra.nr;
@@ -137,5 +214,6 @@ void bch2_btree_id_to_text(struct printbuf *, enum btree_id);
 void bch2_btree_pos_to_text(struct printbuf *, struct bch_fs *, const struct btree *);
 void bch2_btree_node_to_text(struct printbuf *, struct bch_fs *, const struct btree *);
 void bch2_btree_cache_to_text(struct printbuf *, const struct btree_cache *);
+void bch2_btree_cache_lookups_to_text(struct printbuf *, const struct btree_cache *);
 
 #endif /* _BCACHEFS_BTREE_CACHE_H */
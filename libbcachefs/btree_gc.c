@@ -38,8 +38,10 @@
 #include <linux/freezer.h>
 #include <linux/kthread.h>
 #include <linux/preempt.h>
+#include <linux/random.h>
 #include <linux/rcupdate.h>
 #include <linux/sched/task.h>
+#include <linux/sort.h>
 
 #define DROP_THIS_NODE		10
 #define DROP_PREV_NODE		11
@@ -570,6 +572,113 @@ fsck_err:
 	return ret;
 }
 
+/* Quick check: */
+
+static int bch2_fsck_sample_leaf(struct btree_trans *trans, enum btree_id btree,
+				 struct bpos pos, struct bch_fsck_sample *s)
+{
+	struct btree_iter iter;
+
+	bch2_trans_node_iter_init(trans, &iter, btree, pos, 0, 0, 0);
+
+	struct btree *b = bch2_btree_iter_peek_node(&iter);
+	int ret = PTR_ERR_OR_ZERO(b);
+
+	bch2_trans_iter_exit(trans, &iter);
+
+	if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+		return ret;
+
+	if (ret || b) {
+		s->nr_sampled++;
+		s->nr_errors += ret || btree_node_read_error(b);
+	}
+	return 0;
+}
+
+/*
+ * Read a uniform random sample of @nr leaf nodes from each btree: reading a
+ * node validates every key in it, and the interior nodes we pick leaves from
+ * have already been walked by check_topology.
+ *
+ * If none of the leaves sampled had errors then by the rule of three, with
+ * 95% confidence fewer than 3/nr_sampled of all leaves do.
+ */
+int bch2_fsck_sample_leaves(struct bch_fs *c, unsigned nr,
+			    struct bch_fsck_sample *s)
+{
+	struct btree_trans *trans = bch2_trans_get(c);
+	DARRAY(struct bpos) sample = {};
+	int ret = 0;
+
+	memset(s, 0, sizeof(*s));
+
+	for (unsigned i = 0; i < btree_id_nr_alive(c) && !ret; i++) {
+		struct btree_root *r = bch2_btree_id_root(c, i);
+		struct btree_iter iter;
+		struct btree *b;
+		u64 nr_leaves = 0;
+
+		/* A root that's a leaf was read and checked at startup: */
+		if (!r->b || !r->b->c.level)
+			continue;
+
+		sample.nr = 0;
+
+		__for_each_btree_node(trans, iter, i, POS_MIN, 0, 1, 0, b, ret) {
+			struct btree_node_iter node_iter;
+			struct bkey unpacked;
+			struct bkey_s_c k;
+
+			/* Reservoir sampling over the child pointers: */
+			for_each_btree_node_key_unpack(b, k, &node_iter, &unpacked) {
+				nr_leaves++;
+
+				if (sample.nr < nr) {
+					ret = darray_push(&sample, k.k->p);
+					if (ret)
+						break;
+				} else {
+					u32 j = get_random_u32_below(min_t(u64, nr_leaves, U32_MAX));
+
+					if (j < nr)
+						sample.data[j] = k.k->p;
+				}
+			}
+
+			if (ret)
+				break;
+		}
+		bch2_trans_iter_exit(trans, &iter);
+
+		s->nr_leaves += nr_leaves;
+
+		darray_for_each(sample, pos) {
+			if (ret)
+				break;
+			ret = lockrestart_do(trans, bch2_fsck_sample_leaf(trans, i, *pos, s));
+		}
+	}
+
+	darray_exit(&sample);
+	bch2_trans_put(trans);
+	bch_err_fn(c, ret);
+	return ret;
+}
+
+void bch2_fsck_sample_to_text(struct printbuf *out, struct bch_fsck_sample *s)
+{
+	prt_printf(out, "sampled %llu of %llu leaf nodes, %llu with errors\n",
+		   s->nr_sampled, s->nr_leaves, s->nr_errors);
+
+	if (s->nr_sampled && !s->nr_errors) {
+		u64 bound = div64_u64(30000, s->nr_sampled);
+
+		prt_printf(out, "95%% confidence that fewer than %llu.%02llu%% of leaf nodes have errors\n",
+			   bound / 100, bound % 100);
+	}
+}
+
 /* marking of btree keys/nodes: */
 
 static int bch2_gc_mark_key(struct btree_trans *trans, enum btree_id btree_id,
@@ -1111,12 +1220,170 @@ static int bch2_gc_stripes_done(struct bch_fs *c)
  *    move around - if references move backwards in the ordering GC
  *    uses, GC could skip past them
  */
+/*
+ * Incremental check_allocations, with fsck_incremental:
+ *
+ * Any bucket whose counts changed since the last clean shutdown has an alloc
+ * key in the journal we're about to replay; buckets pointed to by keys in the
+ * journal are included as well. Only those buckets are checked, by recounting
+ * their sectors from backpointers - and if any of them are wrong, we fall back
+ * to the full check.
+ *
+ * Buckets whose sectors aren't all described by backpointers (superblock,
+ * journal, erasure coded) are skipped.
+ */
+static struct journal_key *journal_keys_idx_to_key(struct journal_keys *keys, size_t idx)
+{
+	if (idx >= keys->gap)
+		idx += keys->size - keys->nr;
+	return keys->data + idx;
+}
+
+static int check_bucket_incremental(struct btree_trans *trans, struct bpos bucket,
+				    bool *ok)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter iter;
+	struct bch_alloc_v4 a_convert;
+	int ret = 0;
+
+	struct bch_dev *ca = bch2_dev_tryget_noerror(c, bucket.inode);
+	if (!ca)
+		return 0;
+
+	if (!bucket_valid(ca, bucket.offset))
+		goto out;
+
+	struct bkey_s_c k = bch2_bkey_get_iter(trans, &iter, BTREE_ID_alloc, bucket, 0);
+	ret = bkey_err(k);
+	if (ret)
+		goto out;
+
+	const struct bch_alloc_v4 *a = bch2_alloc_to_v4(k, &a_convert);
+	a_convert = *a;
+	a = &a_convert;
+	bch2_trans_iter_exit(trans, &iter);
+
+	if (a->stripe ||
+	    a->data_type == BCH_DATA_sb ||
+	    a->data_type == BCH_DATA_journal ||
+	    a->data_type == BCH_DATA_parity ||
+	    a->data_type == BCH_DATA_stripe)
+		goto out;
+
+	enum bch_data_type data_type = BCH_DATA_free;
+	u32 dirty_sectors = 0;
+
+	struct bpos bp_end = bucket_pos_to_bp(ca, bpos_nosnap_successor(bucket), 0);
+	for_each_btree_key_upto_norestart(trans, iter, BTREE_ID_backpointers,
+				bucket_pos_to_bp(ca, bucket, 0), bpos_predecessor(bp_end),
+				0, k, ret) {
+		if (k.k->type != KEY_TYPE_backpointer)
+			continue;
+
+		const struct bch_backpointer *bp = bkey_s_c_to_backpointer(k).v;
+		if (bp->data_type != BCH_DATA_user &&
+		    bp->data_type != BCH_DATA_btree)
+			continue;
+
+		dirty_sectors	+= bp->bucket_len;
+		data_type	= bp->data_type;
+	}
+	bch2_trans_iter_exit(trans, &iter);
+	if (ret)
+		goto out;
+
+	bool type_ok = dirty_sectors
+		? a->data_type == data_type
+		: a->data_type != BCH_DATA_user && a->data_type != BCH_DATA_btree;
+
+	if (a->dirty_sectors != dirty_sectors || !type_ok) {
+		bch_info(c, "bucket %llu:%llu: %s %u sectors, backpointers have %s %u sectors",
+			 bucket.inode, bucket.offset,
+			 bch2_data_type_str(a->data_type), a->dirty_sectors,
+			 bch2_data_type_str(data_type), dirty_sectors);
+		*ok = false;
+	}
+out:
+	bch2_dev_put(ca);
+	return ret;
+}
+
+static int bucket_pos_cmp(const void *l, const void *r)
+{
+	return bpos_cmp(*(const struct bpos *) l, *(const struct bpos *) r);
+}
+
+static int bch2_check_allocations_incremental(struct bch_fs *c, bool *ok)
+{
+	struct journal_keys *keys = &c->journal_keys;
+	DARRAY(struct bpos) buckets = {};
+	int ret = 0;
+
+	*ok = true;
+
+	for (size_t idx = 0; idx < keys->nr; idx++) {
+		struct journal_key *i = journal_keys_idx_to_key(keys, idx);
+
+		if (i->btree_id == BTREE_ID_alloc && !i->level) {
+			ret = darray_push(&buckets, i->k->k.p);
+		} else if (btree_type_has_ptrs(i->btree_id) || i->level) {
+			struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(bkey_i_to_s_c(i->k));
+
+			rcu_read_lock();
+			bkey_for_each_ptr(ptrs, ptr) {
+				struct bch_dev *ca = bch2_dev_rcu(c, ptr->dev);
+				if (ca) {
+					ret = darray_push_gfp(&buckets, PTR_BUCKET_POS(ca, ptr),
+							      GFP_NOWAIT);
+					if (ret)
+						break;
+				}
+			}
+			rcu_read_unlock();
+		}
+
+		if (ret)
+			goto err;
+	}
+
+	sort(buckets.data, buckets.nr, sizeof(buckets.data[0]), bucket_pos_cmp, NULL);
+
+	struct btree_trans *trans = bch2_trans_get(c);
+	struct bpos *last = NULL;
+	darray_for_each(buckets, i) {
+		if (last && bpos_eq(*last, *i))
+			continue;
+		last = i;
+
+		ret = lockrestart_do(trans, check_bucket_incremental(trans, *i, ok));
+		if (ret || !*ok)
+			break;
+	}
+	bch2_trans_put(trans);
+err:
+	darray_exit(&buckets);
+	return ret;
+}
+
 int bch2_check_allocations(struct bch_fs *c)
 {
 	int ret;
 
 	lockdep_assert_held(&c->state_lock);
 
+	if (c->opts.fsck_incremental &&
+	    !(c->recovery_passes_explicit & BIT_ULL(BCH_RECOVERY_PASS_check_allocations))) {
+		bool ok;
+
+		ret = bch2_check_allocations_incremental(c, &ok);
+		bch_err_msg(c, ret, "incremental check_allocations");
+		if (!ret && ok)
+			return 0;
+
+		bch_info(c, "incremental check_allocations failed, checking all buckets");
+	}
+
 	down_write(&c->gc_lock);
 
 	bch2_btree_interior_updates_flush(c);
@@ -1166,7 +1433,8 @@ out:
 
 static int gc_btree_gens_key(struct btree_trans *trans,
 			     struct btree_iter *iter,
-			     struct bkey_s_c k)
+			     struct bkey_s_c k,
+			     u8 **oldest_gen)
 {
 	struct bch_fs *c = trans->c;
 	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
@@ -1195,7 +1463,10 @@ static int gc_btree_gens_key(struct btree_trans *trans,
 		if (!ca)
 			continue;
 
-		u8 *gen = &ca->oldest_gen[PTR_BUCKET_NR(ca, ptr)];
+		if (!oldest_gen[ca->dev_idx])
+			continue;
+
+		u8 *gen = &oldest_gen[ca->dev_idx][PTR_BUCKET_NR(ca, ptr)];
 		if (gen_after(*gen, ptr->gen))
 			*gen = ptr->gen;
 	}
@@ -1234,6 +1505,170 @@ static int bch2_alloc_write_oldest_gen(struct btree_trans *trans, struct bch_dev
 	return bch2_trans_update(trans, iter, &a_mut->k_i, 0);
 }
 
+/*
+ * gc_gens walks every btree with pointers, split into ranges by inode number,
+ * on up to GC_GENS_THREADS threads; each thread computes oldest gens into its
+ * own arrays, and since that's just a min() they're merged at the end:
+ */
+#define GC_GENS_THREADS		8
+#define GC_GENS_RANGES_PER_BTREE	GC_GENS_THREADS
+
+struct gc_gens_range {
+	enum btree_id		btree;
+	struct bpos		start;
+	struct bpos		end;
+};
+
+struct gc_gens_thread {
+	struct closure		cl;
+	struct bch_fs		*c;
+	struct gc_gens_range	*ranges;
+	unsigned		nr_ranges;
+	atomic_t		*next_range;
+	u8			*oldest_gen[BCH_SB_MEMBERS_MAX];
+	int			ret;
+};
+
+static int gc_gens_thread_run(struct btree_trans *trans, struct gc_gens_thread *t)
+{
+	struct bch_fs *c = trans->c;
+	unsigned i;
+	int ret = 0;
+
+	while (!ret && (i = atomic_inc_return(t->next_range) - 1) < t->nr_ranges) {
+		struct gc_gens_range *r = t->ranges + i;
+
+		c->gc_gens_btree = r->btree;
+
+		ret = for_each_btree_key_upto_commit(trans, iter, r->btree,
+					r->start, r->end,
+					BTREE_ITER_prefetch|BTREE_ITER_all_snapshots,
+					k,
+					NULL, NULL,
+					BCH_TRANS_COMMIT_no_enospc,
+				gc_btree_gens_key(trans, &iter, k, t->oldest_gen));
+	}
+
+	return ret;
+}
+
+static CLOSURE_CALLBACK(gc_gens_thread_work)
+{
+	closure_type(t, struct gc_gens_thread, cl);
+
+	t->ret = bch2_trans_run(t->c, gc_gens_thread_run(trans, t));
+	closure_return(cl);
+}
+
+static unsigned gc_gens_ranges_init(struct btree_trans *trans,
+				    struct gc_gens_range *ranges)
+{
+	unsigned nr_ranges = 0;
+
+	for (unsigned btree = 0; btree < BTREE_ID_NR; btree++) {
+		if (!btree_type_has_ptrs(btree))
+			continue;
+
+		u64 last = bch2_btree_last_inum(trans, btree);
+		unsigned nr = last != U64_MAX
+			? min_t(u64, GC_GENS_RANGES_PER_BTREE, last + 1)
+			: 1;
+		u64 step = div_u64(last, nr) + 1;
+
+		for (unsigned i = 0; i < nr; i++) {
+			struct gc_gens_range *r = ranges + nr_ranges++;
+
+			r->btree	= btree;
+			r->start	= i ? POS(i * step, 0) : POS_MIN;
+			r->end		= i + 1 < nr
+				? SPOS((i + 1) * step - 1, U64_MAX, U32_MAX)
+				: SPOS_MAX;
+		}
+	}
+
+	return nr_ranges;
+}
+
+static int gc_gens_btrees(struct bch_fs *c)
+{
+	unsigned nr_threads = min_t(unsigned, num_online_cpus(), GC_GENS_THREADS);
+	unsigned nr_ranges = 0;
+	atomic_t next_range;
+	struct closure cl;
+	int ret = 0;
+
+	struct gc_gens_range *ranges =
+		kcalloc(BTREE_ID_NR * GC_GENS_RANGES_PER_BTREE, sizeof(*ranges), GFP_KERNEL);
+	struct gc_gens_thread *threads =
+		kcalloc(nr_threads, sizeof(*threads), GFP_KERNEL);
+	if (!ranges || !threads) {
+		ret = -BCH_ERR_ENOMEM_gc_gens;
+		goto err;
+	}
+
+	atomic_set(&next_range, 0);
+
+	nr_ranges = bch2_trans_run(c, gc_gens_ranges_init(trans, ranges));
+	nr_threads = min(nr_threads, nr_ranges);
+
+	/* The first thread marks directly into ca->oldest_gen: */
+	for (struct gc_gens_thread *t = threads; t < threads + nr_threads; t++) {
+		t->c		= c;
+		t->ranges	= ranges;
+		t->nr_ranges	= nr_ranges;
+		t->next_range	= &next_range;
+
+		for_each_member_device(c, ca) {
+			u8 *gens = ca->oldest_gen;
+
+			if (t != threads) {
+				size_t nbuckets = bucket_gens(ca)->nbuckets;
+
+				gens = kvmalloc(nbuckets, GFP_KERNEL);
+				if (!gens) {
+					bch2_dev_put(ca);
+					ret = -BCH_ERR_ENOMEM_gc_gens;
+					goto err;
+				}
+				memcpy(gens, ca->oldest_gen, nbuckets);
+			}
+
+			t->oldest_gen[ca->dev_idx] = gens;
+		}
+	}
+
+	closure_init_stack(&cl);
+
+	for (struct gc_gens_thread *t = threads + 1; t < threads + nr_threads; t++)
+		closure_call(&t->cl, gc_gens_thread_work, system_unbound_wq, &cl);
+
+	if (nr_threads)
+		threads->ret = bch2_trans_run(c, gc_gens_thread_run(trans, threads));
+
+	closure_sync(&cl);
+
+	for (struct gc_gens_thread *t = threads; t < threads + nr_threads; t++)
+		ret = ret ?: t->ret;
+
+	if (!ret)
+		for (struct gc_gens_thread *t = threads + 1; t < threads + nr_threads; t++)
+			for_each_member_device(c, ca) {
+				u8 *dst = ca->oldest_gen, *src = t->oldest_gen[ca->dev_idx];
+
+				for (size_t b = 0; b < bucket_gens(ca)->nbuckets; b++)
+					if (gen_after(dst[b], src[b]))
+						dst[b] = src[b];
+			}
+err:
+	if (threads)
+		for (struct gc_gens_thread *t = threads + 1; t < threads + nr_threads; t++)
+			for (unsigned i = 0; i < ARRAY_SIZE(t->oldest_gen); i++)
+				kvfree(t->oldest_gen[i]);
+	kfree(threads);
+	kfree(ranges);
+	return ret;
+}
+
 int bch2_gc_gens(struct bch_fs *c)
 {
 	u64 b, start_time = local_clock();
@@ -1268,22 +1703,9 @@ int bch2_gc_gens(struct bch_fs *c)
 			ca->oldest_gen[b] = gens->b[b];
 	}
 
-	for (unsigned i = 0; i < BTREE_ID_NR; i++)
-		if (btree_type_has_ptrs(i)) {
-			c->gc_gens_btree = i;
-			c->gc_gens_pos = POS_MIN;
-
-			ret = bch2_trans_run(c,
-				for_each_btree_key_commit(trans, iter, i,
-						POS_MIN,
-						BTREE_ITER_prefetch|BTREE_ITER_all_snapshots,
-						k,
-						NULL, NULL,
-						BCH_TRANS_COMMIT_no_enospc,
-					gc_btree_gens_key(trans, &iter, k)));
-			if (ret)
-				goto err;
-		}
+	ret = gc_gens_btrees(c);
+	if (ret)
+		goto err;
 
 	struct bch_dev *ca = NULL;
 	ret = bch2_trans_run(c,
@@ -7,6 +7,8 @@
 #include "btree_types.h"
 
 int bch2_check_topology(struct bch_fs *);
+int bch2_fsck_sample_leaves(struct bch_fs *, unsigned, struct bch_fsck_sample *);
+void bch2_fsck_sample_to_text(struct printbuf *, struct bch_fsck_sample *);
 int bch2_check_allocations(struct bch_fs *);
 
 /*
@@ -31,4 +31,10 @@ struct reflink_gc {
 
 typedef GENRADIX(struct reflink_gc) reflink_gc_table;
 
+struct bch_fsck_sample {
+	u64		nr_leaves;
+	u64		nr_sampled;
+	u64		nr_errors;
+};
+
 #endif /* _BCACHEFS_BTREE_GC_TYPES_H */
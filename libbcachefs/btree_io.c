@@ -21,7 +21,9 @@
 #include "super-io.h"
 #include "trace.h"
 
+#include <linux/blkdev.h>
 #include <linux/sched/mm.h>
+#include <linux/sort.h>
 
 static void bch2_btree_node_header_to_text(struct printbuf *out, struct btree_node *bn)
 {
@@ -108,6 +110,8 @@ static void btree_bounce_free(struct bch_fs *c, size_t size,
 {
 	if (used_mempool)
 		mempool_free(p, &c->btree_bounce_pool);
+	else if (size == c->opts.btree_node_size)
+		bch2_btree_buf_free(c, p);
 	else
 		kvfree(p);
 }
@@ -121,7 +125,10 @@ static void *btree_bounce_alloc(struct bch_fs *c, size_t size,
 	BUG_ON(size > c->opts.btree_node_size);
 
 	*used_mempool = false;
-	p = kvmalloc(size, __GFP_NOWARN|GFP_NOWAIT);
+	/* full size bounce buffers may be swapped with a node's buffer: */
+	p = size == c->opts.btree_node_size
+		? bch2_btree_buf_alloc(c, __GFP_NOWARN|GFP_NOWAIT)
+		: kvmalloc(size, __GFP_NOWARN|GFP_NOWAIT);
 	if (!p) {
 		*used_mempool = true;
 		p = mempool_alloc(&c->btree_bounce_pool, GFP_NOFS);
@@ -448,6 +455,9 @@ void bch2_btree_build_aux_trees(struct btree *b)
 		bch2_bset_build_aux_tree(b, t,
 				!bset_written(b, bset(b, t)) &&
 				t == bset_tree_last(b));
+	clear_btree_node_aux_tree_lazy(b);
+
+	bch2_btree_node_build_inode_filter(b);
 }
 
 /*
@@ -987,21 +997,183 @@ fsck_err:
 	return ret;
 }
 
-int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
-			      struct btree *b, bool have_retry, bool *saw_error)
+/*
+ * Checksum verification and decryption of a bset only depend on the bset
+ * itself, and bset boundaries only on their (unencrypted) headers: so for nodes
+ * with multiple bsets we find them all up front, and verify and decrypt them in
+ * parallel on btree_read_csum_wq before the serial validate and sort pass.
+ * Results are consumed in order by bch2_btree_node_read_done(), which does any
+ * bset that wasn't precomputed itself:
+ */
+#define BTREE_READ_CSUM_PARALLEL_MIN_SECTORS	16
+
+struct btree_read_bset {
+	struct closure		cl;
+	struct bch_fs		*c;
+	struct btree		*b;
+	unsigned		offset;
+	bool			async;
+	bool			done;
+	struct bch_csum		csum;
+	int			ret;
+};
+
+struct btree_read_bsets {
+	unsigned		nr;
+	unsigned		idx;
+	struct btree_read_bset	s[];
+};
+
+static struct bset *btree_read_bset_i(struct btree *b, unsigned offset)
+{
+	return !offset
+		? &b->data->keys
+		: &((struct btree_node_entry *) ((void *) b->data + (offset << 9)))->keys;
+}
+
+static void btree_read_bset_do(struct btree_read_bset *s)
+{
+	struct bch_fs *c = s->c;
+	struct btree *b = s->b;
+	struct bset *i = btree_read_bset_i(b, s->offset);
+	struct nonce nonce = btree_nonce(i, s->offset << 9);
+
+	if (!bch2_checksum_type_valid(c, BSET_CSUM_TYPE(i)))
+		return;
+
+	if (!s->offset) {
+		s->csum = csum_vstruct(c, BSET_CSUM_TYPE(i), nonce, b->data);
+	} else {
+		struct btree_node_entry *bne = container_of(i, struct btree_node_entry, keys);
+
+		s->csum = csum_vstruct(c, BSET_CSUM_TYPE(i), nonce, bne);
+	}
+
+	s->ret	= bset_encrypt(c, i, s->offset << 9);
+	s->done	= true;
+}
+
+static CLOSURE_CALLBACK(btree_read_bset_work)
+{
+	closure_type(s, struct btree_read_bset, cl);
+
+	btree_read_bset_do(s);
+	closure_return(cl);
+}
+
+static struct btree_read_bsets *btree_read_bsets_start(struct bch_fs *c, struct btree *b)
+{
+	unsigned ptr_written = btree_ptr_sectors_written(bkey_i_to_s_c(&b->key));
+	unsigned end = ptr_written ?: btree_sectors(c);
+	unsigned offset = 0, nr = 0, big = 0;
+
+	/* find the bsets: */
+	while (offset < end) {
+		struct bset *i = btree_read_bset_i(b, offset);
+		unsigned sectors = !offset
+			? vstruct_sectors(b->data, c->block_bits)
+			: vstruct_sectors(container_of(i, struct btree_node_entry, keys),
+					  c->block_bits);
+
+		if ((offset && i->seq != b->data->keys.seq) ||
+		    !sectors ||
+		    offset + sectors > btree_sectors(c))
+			break;
+
+		big += offset && sectors >= BTREE_READ_CSUM_PARALLEL_MIN_SECTORS;
+		offset += sectors;
+		nr++;
+	}
+
+	/* not worth fanning out unless there's more than one big bset: */
+	if (!big)
+		return NULL;
+
+	struct btree_read_bsets *r = kzalloc(struct_size(r, s, nr), GFP_NOFS);
+	if (!r)
+		return NULL;
+
+	struct closure cl;
+	closure_init_stack(&cl);
+
+	r->nr = nr;
+	offset = 0;
+	for (unsigned j = 0; j < nr; j++) {
+		struct btree_read_bset *s = r->s + j;
+		struct bset *i = btree_read_bset_i(b, offset);
+		unsigned sectors = !offset
+			? vstruct_sectors(b->data, c->block_bits)
+			: vstruct_sectors(container_of(i, struct btree_node_entry, keys),
+					  c->block_bits);
+
+		s->c		= c;
+		s->b		= b;
+		s->offset	= offset;
+
+		s->async	= offset && sectors >= BTREE_READ_CSUM_PARALLEL_MIN_SECTORS;
+
+		if (s->async)
+			closure_call(&s->cl, btree_read_bset_work, c->btree_read_csum_wq, &cl);
+		offset += sectors;
+	}
+
+	/* the first bset and the small ones we do ourselves: */
+	for (unsigned j = 0; j < nr; j++)
+		if (!r->s[j].async)
+			btree_read_bset_do(r->s + j);
+
+	closure_sync(&cl);
+	return r;
+}
+
+/*
+ * Checksum and decrypt the bset at @offset, or return the result if it was
+ * precomputed: returns false if the checksum type is invalid, for the caller to
+ * report:
+ */
+static bool btree_read_bset_csum(struct bch_fs *c, struct btree *b,
+				 struct btree_read_bsets *r,
+				 struct btree_read_bset *tmp,
+				 struct btree_read_bset **ret)
+{
+	if (r && r->idx < r->nr && r->s[r->idx].offset == b->written) {
+		*ret = r->s + r->idx++;
+	} else {
+		*tmp = (struct btree_read_bset) {
+			.c	= c,
+			.b	= b,
+			.offset	= b->written,
+		};
+		btree_read_bset_do(tmp);
+		*ret = tmp;
+	}
+
+	return (*ret)->done;
+}
+
+/*
+ * If @dst is non NULL, the node was read somewhere other than its buffer, e.g. a
+ * device mapping: the bsets are sorted into @dst, which becomes the node's
+ * buffer.
+ */
+static int __bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
+				       struct btree *b, bool have_retry,
+				       bool *saw_error, struct btree_node *dst)
 {
 	struct btree_node_entry *bne;
 	struct sort_iter *iter;
 	struct btree_node *sorted;
 	struct bkey_packed *k;
 	struct bset *i;
-	bool used_mempool, blacklisted;
+	bool used_mempool = false, blacklisted;
 	bool updated_range = b->key.k.type == KEY_TYPE_btree_ptr_v2 &&
 		BTREE_PTR_RANGE_UPDATED(&bkey_i_to_btree_ptr_v2(&b->key)->v);
 	unsigned u64s;
 	unsigned ptr_written = btree_ptr_sectors_written(bkey_i_to_s_c(&b->key));
 	u64 max_journal_seq = 0;
 	struct printbuf buf = PRINTBUF;
+	struct btree_read_bsets *bsets = NULL;
+	struct btree_read_bset bset_tmp, *bset_r;
 	int ret = 0, retry_read = 0, write = READ;
 	u64 start_time = local_clock();
 
@@ -1025,6 +1197,8 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 		     "bad magic: want %llx, got %llx",
 		     bset_magic(c), le64_to_cpu(b->data->magic));
 
+	bsets = btree_read_bsets_start(c, b);
+
 	if (b->key.k.type == KEY_TYPE_btree_ptr_v2) {
 		struct bch_btree_ptr_v2 *bp =
 			&bkey_i_to_btree_ptr_v2(&b->key)->v;
@@ -1054,22 +1228,19 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 
 	while (b->written < (ptr_written ?: btree_sectors(c))) {
 		unsigned sectors;
-		struct nonce nonce;
 		bool first = !b->written;
 		bool csum_bad;
 
 		if (!b->written) {
 			i = &b->data->keys;
 
-			btree_err_on(!bch2_checksum_type_valid(c, BSET_CSUM_TYPE(i)),
+			btree_err_on(!btree_read_bset_csum(c, b, bsets, &bset_tmp, &bset_r),
 				     -BCH_ERR_btree_node_read_err_want_retry,
 				     c, ca, b, i, NULL,
 				     bset_unknown_csum,
 				     "unknown checksum type %llu", BSET_CSUM_TYPE(i));
 
-			nonce = btree_nonce(i, b->written << 9);
-
-			struct bch_csum csum = csum_vstruct(c, BSET_CSUM_TYPE(i), nonce, b->data);
+			struct bch_csum csum = bset_r->csum;
 			csum_bad = bch2_crc_cmp(b->data->csum, csum);
 			if (csum_bad)
 				bch2_io_error(ca, BCH_MEMBER_ERROR_checksum);
@@ -1083,7 +1254,7 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 				      bch2_csum_err_msg(&buf, BSET_CSUM_TYPE(i), b->data->csum, csum),
 				      buf.buf));
 
-			ret = bset_encrypt(c, i, b->written << 9);
+			ret = bset_r->ret;
 			if (bch2_fs_fatal_err_on(ret, c,
 					"decrypting btree node: %s", bch2_err_str(ret)))
 				goto fsck_err;
@@ -1103,14 +1274,13 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 			if (i->seq != b->data->keys.seq)
 				break;
 
-			btree_err_on(!bch2_checksum_type_valid(c, BSET_CSUM_TYPE(i)),
+			btree_err_on(!btree_read_bset_csum(c, b, bsets, &bset_tmp, &bset_r),
 				     -BCH_ERR_btree_node_read_err_want_retry,
 				     c, ca, b, i, NULL,
 				     bset_unknown_csum,
 				     "unknown checksum type %llu", BSET_CSUM_TYPE(i));
 
-			nonce = btree_nonce(i, b->written << 9);
-			struct bch_csum csum = csum_vstruct(c, BSET_CSUM_TYPE(i), nonce, bne);
+			struct bch_csum csum = bset_r->csum;
 			csum_bad = bch2_crc_cmp(bne->csum, csum);
 			if (ca && csum_bad)
 				bch2_io_error(ca, BCH_MEMBER_ERROR_checksum);
@@ -1124,7 +1294,7 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 				      bch2_csum_err_msg(&buf, BSET_CSUM_TYPE(i), bne->csum, csum),
 				      buf.buf));
 
-			ret = bset_encrypt(c, i, b->written << 9);
+			ret = bset_r->ret;
 			if (bch2_fs_fatal_err_on(ret, c,
 					"decrypting btree node: %s", bch2_err_str(ret)))
 				goto fsck_err;
@@ -1201,7 +1371,7 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 				     "found bset signature after last bset");
 	}
 
-	sorted = btree_bounce_alloc(c, btree_buf_bytes(b), &used_mempool);
+	sorted = dst ?: btree_bounce_alloc(c, btree_buf_bytes(b), &used_mempool);
 	sorted->keys.u64s = 0;
 
 	set_btree_bset(b, b->set, &b->data->keys);
@@ -1218,7 +1388,8 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 
 	BUG_ON(b->nr.live_u64s != u64s);
 
-	btree_bounce_free(c, btree_buf_bytes(b), used_mempool, sorted);
+	if (!dst)
+		btree_bounce_free(c, btree_buf_bytes(b), used_mempool, sorted);
 
 	if (updated_range)
 		bch2_btree_node_drop_keys_outside_node(b);
@@ -1263,7 +1434,9 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 		k = bkey_p_next(k);
 	}
 
-	bch2_bset_build_aux_tree(b, b->set, false);
+	/* the aux search tree is built on first use: */
+	set_btree_node_aux_tree_lazy(b);
+	bch2_btree_node_build_inode_filter(b);
 
 	set_needs_whiteout(btree_bset_first(b), true);
 
@@ -1281,6 +1454,7 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 	if (!ptr_written)
 		set_btree_node_need_rewrite(b);
 out:
+	kfree(bsets);
 	mempool_free(iter, &c->fill_iter);
 	printbuf_exit(&buf);
 	bch2_time_stats_update(&c->times[BCH_TIME_btree_node_read_done], start_time);
@@ -1296,6 +1470,12 @@ fsck_err:
 	goto out;
 }
 
+int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
+			      struct btree *b, bool have_retry, bool *saw_error)
+{
+	return __bch2_btree_node_read_done(c, ca, b, have_retry, saw_error, NULL);
+}
+
 static void btree_node_read_work(struct work_struct *work)
 {
 	struct btree_read_bio *rb =
@@ -1663,6 +1843,57 @@ static int btree_node_read_all_replicas(struct bch_fs *c, struct btree *b, bool
 	return 0;
 }
 
+#ifndef __KERNEL__
+/*
+ * Offline tools can have devices mapped into memory (the mmap_devices option):
+ * then we skip the read bio and sort the bsets straight from the mapping into
+ * the node's buffer, instead of first copying the whole node into it.
+ *
+ * Encrypted nodes are decrypted in place, so they take the normal path, as does
+ * a read that needs retrying - on the normal path, which can also try other
+ * replicas.
+ */
+static bool btree_node_read_mapped(struct bch_fs *c, struct btree *b,
+				   struct extent_ptr_decoded *pick)
+{
+	struct btree_node *buf = b->data;
+	bool saw_error = false, ret = false;
+
+	if (bch2_sb_field_get(c->disk_sb.sb, crypt))
+		return false;
+
+	struct bch_dev *ca = bch2_dev_get_ioref(c, pick->ptr.dev, READ);
+	if (!ca)
+		return false;
+
+	void *map = bdev_mmap_addr(ca->disk_sb.bdev, pick->ptr.offset << 9,
+				   btree_buf_bytes(b));
+	if (!map)
+		goto out;
+
+	this_cpu_add(ca->io_done->sectors[READ][BCH_DATA_btree],
+		     btree_sectors(c));
+
+	b->data = map;
+	ret = !__bch2_btree_node_read_done(c, ca, b, true, &saw_error, buf);
+	/* a retry before we got to sorting: */
+	if (b->data == map)
+		b->data = buf;
+
+	/* validation may have fixed up keys in place: */
+	bdev_mmap_release(ca->disk_sb.bdev, map, btree_buf_bytes(b));
+
+	if (ret &&
+	    saw_error &&
+	    !btree_node_read_error(b) &&
+	    c->curr_recovery_pass != BCH_RECOVERY_PASS_scan_for_btree_nodes)
+		bch2_btree_node_rewrite_async(c, b);
+out:
+	percpu_ref_put(&ca->io_ref);
+	return ret;
+}
+#endif
+
 void bch2_btree_node_read(struct btree_trans *trans, struct btree *b,
 			  bool sync)
 {
@@ -1701,6 +1932,17 @@ void bch2_btree_node_read(struct btree_trans *trans, struct btree *b,
 		return;
 	}
 
+#ifndef __KERNEL__
+	u64 start_time = local_clock();
+
+	if (btree_node_read_mapped(c, b, &pick)) {
+		bch2_time_stats_update(&c->times[BCH_TIME_btree_node_read], start_time);
+		clear_btree_node_read_in_flight(b);
+		wake_up_bit(&b->flags, BTREE_NODE_read_in_flight);
+		return;
+	}
+#endif
+
 	ca = bch2_dev_get_ioref(c, pick.ptr.dev, READ);
 
 	bio = bio_alloc_bioset(NULL,
@@ -1757,7 +1999,7 @@ static int __bch2_btree_root_read(struct btree_trans *trans, enum btree_id id,
 		closure_sync(&cl);
 	} while (ret);
 
-	b = bch2_btree_node_mem_alloc(trans, level != 0);
+	b = bch2_btree_node_mem_alloc(trans, btree_node_pcpu_read_locks(id, level));
 	bch2_btree_cache_cannibalize_unlock(trans);
 
 	BUG_ON(IS_ERR(b));
@@ -1975,9 +2217,24 @@ static int validate_bset_for_write(struct bch_fs *c, struct btree *b,
 	return ret;
 }
 
-static void btree_write_submit(struct work_struct *work)
+static struct bpos btree_write_bio_pos(struct btree_write_bio *wbio)
+{
+	const struct bch_extent_ptr *ptr =
+		&bch2_bkey_ptrs_c(bkey_i_to_s_c(&wbio->key)).start->ptr;
+
+	return POS(ptr->dev, ptr->offset + wbio->sector_offset);
+}
+
+static int btree_write_bio_cmp(const void *_l, const void *_r)
+{
+	struct btree_write_bio * const *l = _l;
+	struct btree_write_bio * const *r = _r;
+
+	return bpos_cmp(btree_write_bio_pos(*l), btree_write_bio_pos(*r));
+}
+
+static void btree_write_submit_one(struct btree_write_bio *wbio)
 {
-	struct btree_write_bio *wbio = container_of(work, struct btree_write_bio, work);
 	BKEY_PADDED_ONSTACK(k, BKEY_BTREE_PTR_VAL_U64s_MAX) tmp;
 
 	bkey_copy(&tmp.k, &wbio->key);
@@ -1989,6 +2246,49 @@ static void btree_write_submit(struct work_struct *work)
 				  &tmp.k, false);
 }
 
+/*
+ * Node writes are queued up on c->btree_write_submit_list and submitted in
+ * batches: when journal reclaim or a node split dirties many nodes at once we
+ * want them to go out sorted by device and offset, under a single plug, so
+ * that neighbouring nodes get merged and rotating disks don't seek between
+ * every one:
+ */
+#define BTREE_WRITE_SUBMIT_BATCH	64
+
+static void btree_write_submit(struct work_struct *work)
+{
+	struct bch_fs *c = container_of(work, struct bch_fs, btree_write_submit_work);
+	struct btree_write_bio *batch[BTREE_WRITE_SUBMIT_BATCH];
+	struct llist_node *list;
+	struct blk_plug plug;
+
+	while ((list = llist_del_all(&c->btree_write_submit_list))) {
+		list = llist_reverse_order(list);
+
+		while (list) {
+			unsigned nr = 0;
+
+			while (list && nr < ARRAY_SIZE(batch)) {
+				batch[nr++] = container_of(list, struct btree_write_bio, list);
+				list = list->next;
+			}
+
+			sort(batch, nr, sizeof(batch[0]), btree_write_bio_cmp, NULL);
+
+			blk_start_plug(&plug);
+			for (unsigned i = 0; i < nr; i++)
+				btree_write_submit_one(batch[i]);
+			blk_finish_plug(&plug);
+		}
+	}
+}
+
+void bch2_fs_btree_io_init_early(struct bch_fs *c)
+{
+	init_llist_head(&c->btree_write_submit_list);
+	INIT_WORK(&c->btree_write_submit_work, btree_write_submit);
+}
+
 void __bch2_btree_node_write(struct bch_fs *c, struct btree *b, unsigned flags)
 {
 	struct btree_write_bio *wbio;
@@ -2231,8 +2531,8 @@ do_write:
 	atomic64_inc(&c->btree_write_stats[type].nr);
 	atomic64_add(bytes_to_write, &c->btree_write_stats[type].bytes);
 
-	INIT_WORK(&wbio->work, btree_write_submit);
-	queue_work(c->btree_write_submit_wq, &wbio->work);
+	if (llist_add(&wbio->list, &c->btree_write_submit_list))
+		queue_work(c->btree_write_submit_wq, &c->btree_write_submit_work);
 	return;
 err:
 	set_btree_node_noevict(b);
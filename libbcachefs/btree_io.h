@@ -48,6 +48,7 @@ struct btree_read_bio {
 
 struct btree_write_bio {
 	struct work_struct	work;
+	struct llist_node	list;
 	__BKEY_PADDED(key, BKEY_BTREE_PTR_VAL_U64s_MAX);
 	void			*data;
 	unsigned		data_bytes;
@@ -220,4 +221,6 @@ static inline void compat_btree_node(unsigned level, enum btree_id btree_id,
 
 void bch2_btree_write_stats_to_text(struct printbuf *, struct bch_fs *);
 
+void bch2_fs_btree_io_init_early(struct bch_fs *);
+
 #endif /* _BCACHEFS_BTREE_IO_H */
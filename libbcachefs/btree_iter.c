@@ -15,6 +15,7 @@
 #include "journal.h"
 #include "journal_io.h"
 #include "replicas.h"
+#include "slow_ops.h"
 #include "snapshot.h"
 #include "trace.h"
 
@@ -84,6 +85,29 @@ static inline struct bpos bkey_predecessor(struct btree_iter *iter, struct bpos
 	return p;
 }
 
+/*
+ * For skipping over keys not visible in iter->snapshot: keys at the same
+ * position are sorted by snapshot ID, and ancestors always have bigger IDs than
+ * their descendents - so the next key that could be visible is in the next
+ * ancestor of iter->snapshot, or failing that at the next position.
+ *
+ * This lets us skip over runs of keys in sibling snapshots with a single seek,
+ * instead of visiting them one by one:
+ */
+static inline struct bpos btree_iter_snapshot_skip(struct btree_iter *iter, struct bpos p)
+{
+	u32 next = bch2_snapshot_ancestor_above(iter->trans->c, iter->snapshot, p.snapshot);
+
+	if (next) {
+		p.snapshot = next;
+	} else {
+		p = bpos_nosnap_successor(p);
+		p.snapshot = iter->snapshot;
+	}
+
+	return p;
+}
+
 static inline struct bpos btree_iter_search_key(struct btree_iter *iter)
 {
 	struct bpos pos = iter->pos;
@@ -774,6 +798,35 @@ static inline int btree_path_lock_root(struct btree_trans *trans,
 	}
 }
 
+/*
+ * How many nodes to prefetch after the one we're descending into:
+ *
+ * For leaves, the window starts small and doubles each time the same path
+ * descends to another leaf, so a sequential scan ramps up to
+ * btree_node_readahead nodes in flight while short lookups stay cheap. It's
+ * also capped to a fraction of the btree node cache, so that readahead can't
+ * evict nodes the scan hasn't gotten to yet.
+ *
+ * Interior nodes only get prefetched when we're scanning (or before the
+ * filesystem has started, i.e. recovery):
+ */
+static unsigned btree_path_prefetch_nr(struct bch_fs *c, struct btree_path *path)
+{
+	bool started = test_bit(BCH_FS_started, &c->flags);
+
+	if (path->level > 1)
+		return !started || btree_path_scanning(path);
+
+	unsigned max = min_t(unsigned, c->opts.btree_node_readahead,
+			     READ_ONCE(c->btree_cache.used) / 8);
+	unsigned nr = path->readahead
+		? path->readahead * 2
+		: (started ? 2 : 16);
+
+	path->readahead = clamp(nr, 2U, max(max, 2U));
+	return path->readahead;
+}
+
 noinline
 static int btree_path_prefetch(struct btree_trans *trans, struct btree_path *path)
 {
@@ -782,9 +835,7 @@ static int btree_path_prefetch(struct btree_trans *trans, struct btree_path *pat
 	struct btree_node_iter node_iter = l->iter;
 	struct bkey_packed *k;
 	struct bkey_buf tmp;
-	unsigned nr = test_bit(BCH_FS_started, &c->flags)
-		? (path->level > 1 ? 0 :  2)
-		: (path->level > 1 ? 1 : 16);
+	unsigned nr = btree_path_prefetch_nr(c, path);
 	bool was_locked = btree_node_locked(path, path->level);
 	int ret = 0;
 
@@ -817,9 +868,7 @@ static int btree_path_prefetch_j(struct btree_trans *trans, struct btree_path *p
 	struct bch_fs *c = trans->c;
 	struct bkey_s_c k;
 	struct bkey_buf tmp;
-	unsigned nr = test_bit(BCH_FS_started, &c->flags)
-		? (path->level > 1 ? 0 :  2)
-		: (path->level > 1 ? 1 : 16);
+	unsigned nr = btree_path_prefetch_nr(c, path);
 	bool was_locked = btree_node_locked(path, path->level);
 	int ret = 0;
 
@@ -1743,6 +1792,7 @@ btree_path_idx_t bch2_path_get(struct btree_trans *trans,
 		path->level			= level;
 		path->locks_want		= locks_want;
 		path->nodes_locked		= 0;
+		path->readahead			= 0;
 		for (unsigned i = 0; i < ARRAY_SIZE(path->l); i++)
 			path->l[i].b		= ERR_PTR(-BCH_ERR_no_btree_node_init);
 #ifdef TRACK_PATH_ALLOCATED
@@ -1804,6 +1854,9 @@ struct bkey_s_c bch2_btree_path_peek_slot(struct btree_path *path, struct bkey *
 	EBUG_ON(!btree_node_locked(path, path->level));
 
 	if (!path->cached) {
+		if (!bch2_btree_node_may_have_inode(l->b, path->pos.inode))
+			goto hole;
+
 		_k = bch2_btree_node_iter_peek_all(&l->iter, l->b);
 		k = _k ? bkey_disassemble(l->b, _k, u) : bkey_s_c_null;
 
@@ -2328,7 +2381,7 @@ struct bkey_s_c bch2_btree_iter_peek_upto(struct btree_iter *iter, struct bpos e
 			struct bpos pos = k.k->p;
 
 			if (pos.snapshot < iter->snapshot) {
-				search_key = bpos_successor(k.k->p);
+				search_key = btree_iter_snapshot_skip(iter, k.k->p);
 				continue;
 			}
 
@@ -2360,7 +2413,7 @@ struct bkey_s_c bch2_btree_iter_peek_upto(struct btree_iter *iter, struct bpos e
 		    !bch2_snapshot_is_ancestor(trans->c,
 					       iter->snapshot,
 					       k.k->p.snapshot)) {
-			search_key = bpos_successor(k.k->p);
+			search_key = btree_iter_snapshot_skip(iter, k.k->p);
 			continue;
 		}
 
@@ -2738,6 +2791,118 @@ struct bkey_s_c bch2_btree_iter_peek_and_restart_outlined(struct btree_iter *ite
 	return k;
 }
 
+/* Batched lookups: */
+
+/*
+ * Start reads for the leaves that upcoming lookups will land in, as long as
+ * they're under the same parent node as the current leaf:
+ */
+static void btree_path_prefetch_lookups(struct btree_trans *trans,
+					struct btree_path *path,
+					const struct bpos *pos, size_t nr)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_path_level *l = &path->l[1];
+	struct btree_node_iter node_iter;
+	struct bkey_packed *k, *prev = NULL;
+	struct bkey_buf tmp;
+	unsigned nr_prefetch = c->opts.btree_node_readahead;
+	bool was_locked;
+
+	if (path->level || !is_btree_node(path, 1))
+		return;
+
+	was_locked = btree_node_locked(path, 1);
+	if (!bch2_btree_node_relock(trans, path, 1))
+		return;
+
+	bch2_bkey_buf_init(&tmp);
+
+	for (; nr && nr_prefetch; pos++, --nr) {
+		struct bpos p = *pos;
+
+		if (bpos_gt(p, l->b->key.k.p))
+			break;
+
+		bch2_btree_node_iter_init(&node_iter, l->b, &p);
+		k = bch2_btree_node_iter_peek(&node_iter, l->b);
+		if (!k || k == prev)
+			continue;
+		prev = k;
+
+		bch2_bkey_buf_unpack(&tmp, c, l->b, k);
+		if (bpos_eq(tmp.k->k.p, path->l[0].b->key.k.p))
+			continue;
+
+		if (bch2_btree_node_prefetch(trans, path, tmp.k, path->btree_id, 0))
+			break;
+		nr_prefetch--;
+	}
+
+	if (!was_locked)
+		btree_node_unlock(trans, path, 1);
+
+	bch2_bkey_buf_exit(&tmp, c);
+}
+
+/**
+ * bch2_btree_lookup_batch() - look up many keys with a single iterator
+ * @trans:	btree transaction object
+ * @btree_id:	btree to search
+ * @pos:	positions to look up, in ascending order
+ * @nr:		number of positions
+ * @flags:	BTREE_ITER flags
+ * @fn:		called with the key at each position (as with
+ *		bch2_btree_iter_peek_slot()) and its index in @pos
+ * @arg:	passed to @fn
+ *
+ * Because positions are sorted, successive lookups only re-traverse from the
+ * lowest node that doesn't cover the next position, instead of from the root;
+ * and when a lookup moves to a new leaf, reads are started for the leaves the
+ * following lookups will need.
+ *
+ * Each lookup and its callback are run in their own transaction restart loop,
+ * as with for_each_btree_key(): @fn may commit.
+ *
+ * Returns: 0 on success, or the first error from a lookup or @fn.
+ */
+int bch2_btree_lookup_batch(struct btree_trans *trans, enum btree_id btree_id,
+			    const struct bpos *pos, size_t nr, unsigned flags,
+			    btree_lookup_batch_fn fn, void *arg)
+{
+	struct btree_iter iter;
+	struct btree *leaf = NULL;
+	int ret = 0;
+
+	if (!nr)
+		return 0;
+
+	bch2_trans_iter_init(trans, &iter, btree_id, pos[0], flags);
+
+	for (size_t i = 0; i < nr && !ret; i++) {
+		EBUG_ON(i && bpos_lt(pos[i], pos[i - 1]));
+
+		ret = lockrestart_do(trans, ({
+			bch2_btree_iter_set_pos(&iter, pos[i]);
+
+			struct bkey_s_c k = bch2_btree_iter_peek_slot(&iter);
+			bkey_err(k) ?: fn(trans, &iter, k, i, arg);
+		}));
+
+		struct btree_path *path = btree_iter_path(trans, &iter);
+		if (!ret &&
+		    !path->cached &&
+		    path->l[0].b != leaf &&
+		    trans->c->opts.btree_node_prefetch) {
+			leaf = path->l[0].b;
+			btree_path_prefetch_lookups(trans, path, pos + i + 1, nr - i - 1);
+		}
+	}
+
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
 /* new transactional stuff: */
 
 #ifdef CONFIG_BCACHEFS_DEBUG
@@ -3052,12 +3217,134 @@ static void bch2_trans_srcu_lock(struct btree_trans *trans)
  * may return BCH_ERR_transaction_restart when the trylock fails. When this
  * occurs bch2_trans_begin() should be called and the transaction retried.
  */
+static noinline void btree_trans_restart_account(struct btree_trans *trans)
+{
+	struct btree_transaction_stats *s = btree_trans_stats(trans);
+	unsigned reason = trans->restarted - BCH_ERR_transaction_restart;
+	unsigned long ip = trans->last_restarted_ip;
+	u64 now = local_clock();
+	u64 wasted_ns = time_after64(now, trans->last_begin_time)
+		? now - trans->last_begin_time : 0;
+	unsigned wasted_paths = bitmap_weight(trans->paths_allocated, trans->nr_paths) - 1;
+
+	trans->phase_ns[BCH_TRANS_PHASE_restart] += wasted_ns;
+
+	if (!s)
+		return;
+
+	atomic64_inc(&s->nr_restarts);
+	atomic64_add(wasted_ns, &s->restart_wasted_ns);
+	if (reason < ARRAY_SIZE(s->restart_reasons))
+		atomic64_inc(&s->restart_reasons[reason]);
+
+	/*
+	 * Per call site: a small table, where a new site replaces the one
+	 * that's restarted least - good enough to find the hot ones:
+	 */
+	if (!mutex_trylock(&s->lock))
+		return;
+
+	struct btree_trans_restart_site *site = NULL, *min = s->restart_sites;
+
+	for (struct btree_trans_restart_site *i = s->restart_sites;
+	     i < s->restart_sites + ARRAY_SIZE(s->restart_sites);
+	     i++) {
+		if (i->ip == ip && i->reason == reason) {
+			site = i;
+			break;
+		}
+		if (i->nr < min->nr)
+			min = i;
+	}
+
+	if (!site) {
+		site = min;
+		memset(site, 0, sizeof(*site));
+		site->ip	= ip;
+		site->reason	= reason;
+	}
+
+	site->nr++;
+	site->wasted_ns		+= wasted_ns;
+	site->wasted_paths	+= wasted_paths;
+
+	mutex_unlock(&s->lock);
+}
+
+void bch2_btree_trans_restarts_to_text(struct printbuf *out,
+				       struct btree_transaction_stats *s)
+{
+	u64 nr = atomic64_read(&s->nr_restarts);
+
+	prt_printf(out, "Restarts:\t%llu\n", nr);
+	if (!nr)
+		return;
+
+	prt_printf(out, "Time lost to restarts:\t");
+	bch2_pr_time_units(out, atomic64_read(&s->restart_wasted_ns));
+	prt_newline(out);
+
+	printbuf_indent_add(out, 2);
+	for (unsigned i = 1; i < ARRAY_SIZE(s->restart_reasons); i++) {
+		u64 v = atomic64_read(&s->restart_reasons[i]);
+
+		if (v)
+			prt_printf(out, "%s:\t%llu\n",
+				   bch2_err_str(BCH_ERR_transaction_restart + i), v);
+	}
+	printbuf_indent_sub(out, 2);
+
+	prt_printf(out, "Restart sites:\n");
+	printbuf_indent_add(out, 2);
+	for (struct btree_trans_restart_site *i = s->restart_sites;
+	     i < s->restart_sites + ARRAY_SIZE(s->restart_sites);
+	     i++) {
+		if (!i->nr)
+			continue;
+
+		prt_printf(out, "%pS %s: %u, ",
+			   (void *) i->ip,
+			   bch2_err_str(BCH_ERR_transaction_restart + i->reason),
+			   i->nr);
+		bch2_pr_time_units(out, i->wasted_ns);
+		prt_printf(out, ", %llu paths\n", i->wasted_paths);
+	}
+	printbuf_indent_sub(out, 2);
+}
+
+void bch2_fs_btree_trans_restarts_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	for (unsigned i = 0; i < ARRAY_SIZE(c->btree_transaction_stats); i++) {
+		struct btree_transaction_stats *s = &c->btree_transaction_stats[i];
+
+		if (!bch2_btree_transaction_fns[i])
+			break;
+		if (!atomic64_read(&s->nr_restarts))
+			continue;
+
+		prt_printf(out, "%s:\n", bch2_btree_transaction_fns[i]);
+		printbuf_indent_add(out, 2);
+		mutex_lock(&s->lock);
+		bch2_btree_trans_restarts_to_text(out, s);
+		mutex_unlock(&s->lock);
+		printbuf_indent_sub(out, 2);
+	}
+
+	prt_printf(out, "Lock waits:\n");
+	printbuf_indent_add(out, 2);
+	bch2_btree_lock_wait_to_text(out, c);
+	printbuf_indent_sub(out, 2);
+}
+
 u32 bch2_trans_begin(struct btree_trans *trans)
 {
 	struct btree_path *path;
 	unsigned i;
 	u64 now;
 
+	if (unlikely(trans->restarted))
+		btree_trans_restart_account(trans);
+
 	bch2_trans_reset_updates(trans);
 
 	trans->restart_count++;
@@ -3072,7 +3359,9 @@ u32 bch2_trans_begin(struct btree_trans *trans)
 		 * doing something new: dont keep iterators excpt the ones that
 		 * are in use - except for the subvolumes btree:
 		 */
-		if (!trans->restarted && path->btree_id != BTREE_ID_subvolumes)
+		if (!trans->restarted &&
+		    !trans->paths_warm &&
+		    path->btree_id != BTREE_ID_subvolumes)
 			path->preserve = false;
 
 		/*
@@ -3085,6 +3374,7 @@ u32 bch2_trans_begin(struct btree_trans *trans)
 		else
 			path->preserve = false;
 	}
+	trans->paths_warm = false;
 
 	now = local_clock();
 
@@ -3134,23 +3424,46 @@ unsigned bch2_trans_get_fn_idx(const char *fn)
 	return 0;
 }
 
+#ifdef __KERNEL__
+static inline struct btree_trans *btree_trans_buf_xchg(struct bch_fs *c,
+						       struct btree_trans *trans)
+{
+	return this_cpu_xchg(c->btree_trans_bufs->trans, trans);
+}
+#else
+static __thread int btree_trans_buf_this_shard = -1;
+static atomic_t btree_trans_buf_next_shard;
+
+static inline struct btree_trans *btree_trans_buf_xchg(struct bch_fs *c,
+						       struct btree_trans *trans)
+{
+	if (unlikely(btree_trans_buf_this_shard < 0))
+		btree_trans_buf_this_shard = atomic_inc_return(&btree_trans_buf_next_shard) %
+			BTREE_TRANS_BUF_SHARDS;
+
+	return xchg(&c->btree_trans_bufs[btree_trans_buf_this_shard].trans, trans);
+}
+#endif
+
 struct btree_trans *__bch2_trans_get(struct bch_fs *c, unsigned fn_idx)
 	__acquires(&c->btree_trans_barrier)
 {
 	struct btree_trans *trans;
 
-	if (IS_ENABLED(__KERNEL__)) {
-		trans = this_cpu_xchg(c->btree_trans_bufs->trans, NULL);
-		if (trans) {
-			memset(trans, 0, offsetof(struct btree_trans, list));
-			goto got_trans;
-		}
+	trans = btree_trans_buf_xchg(c, NULL);
+	if (trans) {
+		/* Paths kept by bch2_trans_put() live after @list: */
+		btree_path_idx_t nr_sorted = trans->nr_sorted;
+
+		memset(trans, 0, offsetof(struct btree_trans, list));
+		trans->nr_sorted = nr_sorted;
+		goto got_trans;
 	}
 
 	trans = mempool_alloc(&c->btree_trans_pool, GFP_NOFS);
 	memset(trans, 0, sizeof(*trans));
 
-	seqmutex_lock(&c->btree_trans_lock);
+	bch2_seqmutex_lock_profiled(c, &c->btree_trans_lock, BCH_LOCK_btree_trans_list);
 	if (IS_ENABLED(CONFIG_BCACHEFS_DEBUG)) {
 		struct btree_trans *pos;
 		pid_t pid = current->pid;
@@ -3176,6 +3489,7 @@ struct btree_trans *__bch2_trans_get(struct bch_fs *c, unsigned fn_idx)
 got_trans:
 	trans->c		= c;
 	trans->last_begin_time	= local_clock();
+	trans->start_time	= trans->last_begin_time;
 	trans->fn_idx		= fn_idx;
 	trans->locking_wait.task = current;
 	trans->journal_replay_not_finished =
@@ -3189,7 +3503,10 @@ got_trans:
 
 	*trans_paths_nr(trans->paths) = BTREE_ITER_INITIAL;
 
-	trans->paths_allocated[0] = 1;
+	if (!trans->nr_sorted)
+		trans->paths_allocated[0] = 1;
+	else
+		trans->paths_warm = true;
 
 	static struct lock_class_key lockdep_key;
 	lockdep_init_map(&trans->dep_map, "bcachefs_btree", &lockdep_key, 0);
@@ -3243,11 +3560,33 @@ leaked:
 #endif
 }
 
+static noinline void bch2_trans_slow_check(struct btree_trans *trans)
+{
+	struct bch_fs *c = trans->c;
+	u64 now = local_clock();
+
+	if (!time_after64(now, trans->start_time) ||
+	    !bch2_slow_op_is_slow(c, now - trans->start_time))
+		return;
+
+	struct bch_slow_op s = {
+		.type		= BCH_SLOW_OP_trans,
+		.duration	= now - trans->start_time,
+		.fn		= trans->fn,
+	};
+
+	memcpy(s.phase_ns, trans->phase_ns, sizeof(trans->phase_ns));
+	bch2_slow_op_record(c, &s);
+}
+
 void bch2_trans_put(struct btree_trans *trans)
 	__releases(&c->btree_trans_barrier)
 {
 	struct bch_fs *c = trans->c;
 
+	if (bch2_slow_op_tracking(c))
+		bch2_trans_slow_check(trans);
+
 	bch2_trans_unlock(trans);
 
 	trans_for_each_update(trans, i)
@@ -3256,6 +3595,32 @@ void bch2_trans_put(struct btree_trans *trans)
 
 	check_btree_paths_leaked(trans);
 
+	/*
+	 * Keep unreferenced paths for the next transaction that gets this
+	 * btree_trans from the cache: btree nodes are only freed at shutdown,
+	 * so as after bch2_trans_srcu_unlock() the node pointers stay valid
+	 * and are revalidated on traverse by lock sequence number. A small
+	 * transaction looking up keys near the last one then only has to
+	 * relock, instead of traversing from the root.
+	 *
+	 * Key cache paths can't be kept - those pointers are only good with
+	 * srcu held:
+	 */
+	if (trans->paths == trans->_paths) {
+		struct btree_path *path;
+		unsigned i;
+
+		trans_for_each_path(trans, path, i)
+			if (path->ref || path->cached) {
+				__bch2_path_free(trans, i);
+			} else {
+				path->should_be_locked	= false;
+				path->preserve		= true;
+			}
+	} else {
+		trans->nr_sorted = 0;
+	}
+
 	if (trans->srcu_held) {
 		check_srcu_held_too_long(trans);
 		srcu_read_unlock(&c->btree_trans_barrier, trans->srcu_idx);
@@ -3283,9 +3648,7 @@ void bch2_trans_put(struct btree_trans *trans)
 	else
 		kfree(trans->mem);
 
-	/* Userspace doesn't have a real percpu implementation: */
-	if (IS_ENABLED(__KERNEL__))
-		trans = this_cpu_xchg(c->btree_trans_bufs->trans, trans);
+	trans = btree_trans_buf_xchg(c, trans);
 
 	if (trans) {
 		seqmutex_lock(&c->btree_trans_lock);
@@ -3402,6 +3765,7 @@ void bch2_fs_btree_iter_exit(struct bch_fs *c)
 	struct btree_trans *trans;
 	int cpu;
 
+#ifdef __KERNEL__
 	if (c->btree_trans_bufs)
 		for_each_possible_cpu(cpu) {
 			struct btree_trans *trans =
@@ -3415,6 +3779,20 @@ void bch2_fs_btree_iter_exit(struct bch_fs *c)
 			kfree(trans);
 		}
 	free_percpu(c->btree_trans_bufs);
+#else
+	if (c->btree_trans_bufs)
+		for (cpu = 0; cpu < BTREE_TRANS_BUF_SHARDS; cpu++) {
+			struct btree_trans *trans = c->btree_trans_bufs[cpu].trans;
+
+			if (trans) {
+				seqmutex_lock(&c->btree_trans_lock);
+				list_del(&trans->list);
+				seqmutex_unlock(&c->btree_trans_lock);
+			}
+			kfree(trans);
+		}
+	kfree(c->btree_trans_bufs);
+#endif
 
 	trans = list_first_entry_or_null(&c->btree_trans_list, struct btree_trans, list);
 	if (trans)
@@ -3455,7 +3833,12 @@ int bch2_fs_btree_iter_init(struct bch_fs *c)
 {
 	int ret;
 
+#ifdef __KERNEL__
 	c->btree_trans_bufs = alloc_percpu(struct btree_trans_buf);
+#else
+	c->btree_trans_bufs = kcalloc(BTREE_TRANS_BUF_SHARDS,
+				      sizeof(struct btree_trans_buf), GFP_KERNEL);
+#endif
 	if (!c->btree_trans_bufs)
 		return -ENOMEM;
 
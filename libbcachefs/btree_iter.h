@@ -399,6 +399,12 @@ struct bkey_s_c bch2_btree_iter_peek_slot(struct btree_iter *);
 struct bkey_s_c bch2_btree_iter_next_slot(struct btree_iter *);
 struct bkey_s_c bch2_btree_iter_prev_slot(struct btree_iter *);
 
+typedef int (*btree_lookup_batch_fn)(struct btree_trans *, struct btree_iter *,
+				     struct bkey_s_c, size_t, void *);
+int bch2_btree_lookup_batch(struct btree_trans *, enum btree_id,
+			    const struct bpos *, size_t, unsigned,
+			    btree_lookup_batch_fn, void *);
+
 bool bch2_btree_iter_advance(struct btree_iter *);
 bool bch2_btree_iter_rewind(struct btree_iter *);
 
@@ -895,6 +901,8 @@ unsigned bch2_trans_get_fn_idx(const char *);
 })
 
 void bch2_btree_trans_to_text(struct printbuf *, struct btree_trans *);
+void bch2_btree_trans_restarts_to_text(struct printbuf *, struct btree_transaction_stats *);
+void bch2_fs_btree_trans_restarts_to_text(struct printbuf *, struct bch_fs *);
 
 void bch2_fs_btree_iter_exit(struct bch_fs *);
 void bch2_fs_btree_iter_init_early(struct bch_fs *);
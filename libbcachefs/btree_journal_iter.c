@@ -5,8 +5,10 @@
 #include "bset.h"
 #include "btree_cache.h"
 #include "btree_journal_iter.h"
+#include "eytzinger.h"
 #include "journal_io.h"
 
+#include <linux/min_heap.h>
 #include <linux/sort.h>
 
 /*
@@ -30,12 +32,108 @@ static inline struct journal_key *idx_to_key(struct journal_keys *keys, size_t i
 	return keys->data + idx_to_pos(keys, idx);
 }
 
+/*
+ * Searching journal keys:
+ *
+ * A binary search over journal keys dereferences a key (and misses the cache)
+ * at every step; with millions of keys in a big replay that adds up, since
+ * every btree lookup during recovery has to check for a journal key
+ * overlaying it. So we also keep an index, with copies of the positions of
+ * every JOURNAL_KEYS_INDEX_STRIDE'th key in eytzinger order, which gets us
+ * down to a short range of the journal keys array cheaply.
+ *
+ * Insertions only shift keys up, so after @nr_inserted insertions the key an
+ * index entry was built from is somewhere in [idx, idx + nr_inserted], and
+ * we rebuild the index once that gets too wide. Anything else that changes
+ * the journal keys array must call bch2_journal_keys_index_build().
+ */
+
+#define JOURNAL_KEYS_INDEX_STRIDE	64
+
+static int journal_key_sep_cmp(const void *_l, const void *_r)
+{
+	const struct journal_key_sep *l = _l;
+	const struct journal_key_sep *r = _r;
+
+	return  cmp_int(l->btree_id,	r->btree_id) ?:
+		cmp_int(l->level,	r->level) ?:
+		bpos_cmp(l->pos,	r->pos);
+}
+
+void bch2_journal_keys_index_build(struct journal_keys *keys)
+{
+	struct journal_keys_index *index = &keys->index;
+	size_t nr = DIV_ROUND_UP(keys->nr, JOURNAL_KEYS_INDEX_STRIDE);
+
+	index->nr		= 0;
+	index->nr_keys		= keys->nr;
+	index->nr_inserted	= 0;
+
+	if (nr > index->size) {
+		size_t new_size = roundup_pow_of_two(nr);
+		void *d = kvmalloc_array(new_size, sizeof(index->d[0]), GFP_KERNEL);
+
+		/* Searches work without it, just slower: */
+		if (!d)
+			return;
+
+		kvfree(index->d);
+		index->d	= d;
+		index->size	= new_size;
+	}
+
+	size_t idx = 0;
+	eytzinger0_for_each(i, nr) {
+		struct journal_key *k = idx_to_key(keys, idx);
+
+		index->d[i] = (struct journal_key_sep) {
+			.btree_id	= k->btree_id,
+			.level		= k->level,
+			.pos		= k->k->k.p,
+			.idx		= idx,
+		};
+		idx += JOURNAL_KEYS_INDEX_STRIDE;
+	}
+
+	index->nr = nr;
+}
+
+static void bch2_journal_keys_index_exit(struct journal_keys *keys)
+{
+	kvfree(keys->index.d);
+	memset(&keys->index, 0, sizeof(keys->index));
+}
+
+static void journal_keys_index_inserted(struct journal_keys *keys)
+{
+	if (++keys->index.nr_inserted >= JOURNAL_KEYS_INDEX_STRIDE)
+		bch2_journal_keys_index_build(keys);
+}
+
 static size_t __bch2_journal_key_search(struct journal_keys *keys,
 					enum btree_id id, unsigned level,
 					struct bpos pos)
 {
+	struct journal_keys_index *index = &keys->index;
 	size_t l = 0, r = keys->nr, m;
 
+	if (index->nr &&
+	    index->nr_keys + index->nr_inserted == keys->nr) {
+		struct journal_key_sep search = {
+			.btree_id	= id,
+			.level		= level,
+			.pos		= pos,
+		};
+		int i = eytzinger0_find_le(index->d, index->nr, sizeof(index->d[0]),
+					   journal_key_sep_cmp, &search);
+		int next = eytzinger0_next(i, index->nr);
+
+		if (i >= 0)
+			l = index->d[i].idx;
+		if (next >= 0)
+			r = min(r, index->d[next].idx + index->nr_inserted);
+	}
+
 	while (l < r) {
 		m = l + ((r - l) >> 1);
 		if (__journal_key_cmp(id, level, pos, idx_to_key(keys, m)) > 0)
@@ -237,6 +335,7 @@ int bch2_journal_key_insert_take(struct bch_fs *c, enum btree_id id,
 	keys->data[keys->gap++] = n;
 
 	journal_iters_fix(c);
+	journal_keys_index_inserted(keys);
 
 	return 0;
 }
@@ -522,31 +621,145 @@ void bch2_journal_keys_put(struct bch_fs *c)
 	kvfree(keys->data);
 	keys->data = NULL;
 	keys->nr = keys->gap = keys->size = 0;
+	bch2_journal_keys_index_exit(keys);
 
 	bch2_journal_entries_free(c);
 }
 
-static void __journal_keys_sort(struct journal_keys *keys)
+/*
+ * Append @k to the sorted output, dropping the key it overwrites: @k sorts after
+ * every other version of the same key, so it's the newest so far.
+ *
+ * We don't accumulate accounting keys here because we have to compare each
+ * individual accounting key against the version in the btree during replay:
+ */
+static inline void journal_keys_sort_emit(struct journal_key *dst, size_t *nr,
+					  struct journal_key *k)
 {
-	sort(keys->data, keys->nr, sizeof(keys->data[0]), journal_sort_key_cmp, NULL);
+	if (*nr &&
+	    dst[*nr - 1].k->k.type != KEY_TYPE_accounting &&
+	    !journal_key_cmp(&dst[*nr - 1], k))
+		dst[*nr - 1] = *k;
+	else
+		dst[(*nr)++] = *k;
+}
 
-	struct journal_key *dst = keys->data;
+/*
+ * With big journals sorting is a good chunk of mount time, so we sort chunks in
+ * parallel and then merge them, deduplicating as we go:
+ */
+#define JOURNAL_KEYS_SORT_CHUNK_MIN	(1U << 16)
 
-	darray_for_each(*keys, src) {
-		/*
-		 * We don't accumulate accounting keys here because we have to
-		 * compare each individual accounting key against the version in
-		 * the btree during replay:
-		 */
-		if (src->k->k.type != KEY_TYPE_accounting &&
-		    src + 1 < &darray_top(*keys) &&
-		    !journal_key_cmp(src, src + 1))
-			continue;
+struct journal_keys_sort_chunk {
+	struct closure		cl;
+	struct journal_key	*d;
+	size_t			nr;
+};
+
+typedef DEFINE_MIN_HEAP(struct journal_keys_sort_chunk *, journal_keys_sort_heap)
+	journal_keys_sort_heap;
+
+static bool journal_keys_sort_chunk_less(const void *l, const void *r, void *args)
+{
+	const struct journal_keys_sort_chunk *_l = *((struct journal_keys_sort_chunk **) l);
+	const struct journal_keys_sort_chunk *_r = *((struct journal_keys_sort_chunk **) r);
+
+	return journal_sort_key_cmp(_l->d, _r->d) < 0;
+}
+
+static void journal_keys_sort_chunk_swp(void *l, void *r, void *args)
+{
+	struct journal_keys_sort_chunk **_l = l;
+	struct journal_keys_sort_chunk **_r = r;
+
+	swap(*_l, *_r);
+}
 
-		*dst++ = *src;
+static const struct min_heap_callbacks journal_keys_sort_heap_callbacks = {
+	.less	= journal_keys_sort_chunk_less,
+	.swp	= journal_keys_sort_chunk_swp,
+};
+
+static CLOSURE_CALLBACK(journal_keys_sort_chunk_thread)
+{
+	closure_type(chunk, struct journal_keys_sort_chunk, cl);
+
+	sort(chunk->d, chunk->nr, sizeof(chunk->d[0]), journal_sort_key_cmp, NULL);
+	closure_return(cl);
+}
+
+static int journal_keys_sort_parallel(struct journal_keys *keys, unsigned nr_chunks)
+{
+	struct journal_keys_sort_chunk *chunks = kcalloc(nr_chunks, sizeof(chunks[0]), GFP_KERNEL);
+	struct journal_keys_sort_chunk **heap_data = kcalloc(nr_chunks, sizeof(heap_data[0]), GFP_KERNEL);
+	struct journal_key *dst = kvmalloc_array(keys->size, sizeof(keys->data[0]), GFP_KERNEL);
+	journal_keys_sort_heap heap;
+	struct closure cl;
+	size_t nr = 0;
+	int ret = 0;
+
+	if (!chunks || !heap_data || !dst) {
+		ret = -BCH_ERR_ENOMEM_journal_keys_sort;
+		goto err;
 	}
 
-	keys->nr = dst - keys->data;
+	closure_init_stack(&cl);
+
+	for (unsigned i = 0; i < nr_chunks; i++) {
+		size_t start	= keys->nr * i / nr_chunks;
+		size_t end	= keys->nr * (i + 1) / nr_chunks;
+
+		chunks[i].d	= keys->data + start;
+		chunks[i].nr	= end - start;
+
+		closure_call(&chunks[i].cl, journal_keys_sort_chunk_thread,
+			     system_unbound_wq, &cl);
+	}
+
+	closure_sync(&cl);
+
+	min_heap_init(&heap, heap_data, nr_chunks);
+	for (unsigned i = 0; i < nr_chunks; i++)
+		heap.data[heap.nr++] = &chunks[i];
+	min_heapify_all(&heap, &journal_keys_sort_heap_callbacks, NULL);
+
+	while (heap.nr) {
+		struct journal_keys_sort_chunk *chunk = heap.data[0];
+
+		journal_keys_sort_emit(dst, &nr, chunk->d);
+
+		chunk->d++;
+		if (--chunk->nr)
+			min_heap_sift_down(&heap, 0, &journal_keys_sort_heap_callbacks, NULL);
+		else
+			min_heap_pop(&heap, &journal_keys_sort_heap_callbacks, NULL);
+	}
+
+	swap(keys->data, dst);
+	keys->nr = nr;
+err:
+	kvfree(dst);
+	kfree(heap_data);
+	kfree(chunks);
+	return ret;
+}
+
+static void __journal_keys_sort(struct journal_keys *keys)
+{
+	unsigned nr_chunks = min_t(size_t, num_online_cpus(),
+				   keys->nr / JOURNAL_KEYS_SORT_CHUNK_MIN);
+
+	/* If we can't allocate the merge buffer, fall back to sorting in place: */
+	if (nr_chunks > 1 &&
+	    !journal_keys_sort_parallel(keys, nr_chunks))
+		return;
+
+	sort(keys->data, keys->nr, sizeof(keys->data[0]), journal_sort_key_cmp, NULL);
+
+	size_t nr = 0;
+	darray_for_each(*keys, src)
+		journal_keys_sort_emit(keys->data, &nr, src);
+	keys->nr = nr;
 }
 
 int bch2_journal_keys_sort(struct bch_fs *c)
@@ -591,6 +804,7 @@ int bch2_journal_keys_sort(struct bch_fs *c)
 
 	__journal_keys_sort(keys);
 	keys->gap = keys->nr;
+	bch2_journal_keys_index_build(keys);
 
 	bch_verbose(c, "Journal keys: %zu read, %zu after sorting and compacting", nr_read, keys->nr);
 	return 0;
@@ -613,6 +827,7 @@ void bch2_shoot_down_journal_keys(struct bch_fs *c, enum btree_id btree,
 		      bpos_le(i->k->k.p, end)))
 			keys->data[dst++] = *i;
 	keys->nr = keys->gap = dst;
+	bch2_journal_keys_index_build(keys);
 }
 
 void bch2_journal_keys_dump(struct bch_fs *c)
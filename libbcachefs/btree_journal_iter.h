@@ -81,6 +81,7 @@ static inline void bch2_journal_keys_put_initial(struct bch_fs *c)
 
 void bch2_journal_entries_free(struct bch_fs *);
 
+void bch2_journal_keys_index_build(struct journal_keys *);
 int bch2_journal_keys_sort(struct bch_fs *);
 
 void bch2_shoot_down_journal_keys(struct bch_fs *, enum btree_id,
@@ -12,6 +12,8 @@
 #include "journal_reclaim.h"
 #include "trace.h"
 
+#include <linux/jhash.h>
+#include <linux/sort.h>
 #include <linux/sched/mm.h>
 
 static inline bool btree_uses_pcpu_readers(enum btree_id id)
@@ -21,6 +23,47 @@ static inline bool btree_uses_pcpu_readers(enum btree_id id)
 
 static struct kmem_cache *bch2_key_cache;
 
+/*
+ * Freelists of bkey_cached objects for !pcpu_readers btrees: the fast paths
+ * only touch the local freelist, and go to the global lists under bc->lock
+ * in batches of half a freelist:
+ */
+#ifdef __KERNEL__
+static inline struct btree_key_cache_freelist *
+bkey_cached_freelist_get(struct btree_key_cache *bc)
+{
+	preempt_disable();
+	return this_cpu_ptr(bc->pcpu_freed);
+}
+
+static inline void bkey_cached_freelist_put(struct btree_key_cache_freelist *f)
+{
+	preempt_enable();
+}
+#else
+static __thread int bkey_cached_this_shard = -1;
+static atomic_t bkey_cached_next_shard;
+
+static inline struct btree_key_cache_freelist *
+bkey_cached_freelist_get(struct btree_key_cache *bc)
+{
+	struct btree_key_cache_freelist *f;
+
+	if (unlikely(bkey_cached_this_shard < 0))
+		bkey_cached_this_shard = atomic_inc_return(&bkey_cached_next_shard) %
+			BTREE_KEY_CACHE_FREELIST_SHARDS;
+
+	f = bc->pcpu_freed + bkey_cached_this_shard;
+	spin_lock(&f->lock);
+	return f;
+}
+
+static inline void bkey_cached_freelist_put(struct btree_key_cache_freelist *f)
+{
+	spin_unlock(&f->lock);
+}
+#endif
+
 static int bch2_btree_key_cache_cmp_fn(struct rhashtable_compare_arg *arg,
 				       const void *obj)
 {
@@ -39,6 +82,77 @@ static const struct rhashtable_params bch2_btree_key_cache_params = {
 	.automatic_shrinking	= true,
 };
 
+/* Admission: */
+
+static inline u64 bkey_cached_sketch_hash(const struct bkey_cached_key *key)
+{
+	return (u64) jhash2((const u32 *) key, sizeof(*key) / sizeof(u32), 0) *
+		GOLDEN_RATIO_64;
+}
+
+#define for_each_sketch_idx(_h, _i, _idx)				\
+	for (_i = 0;							\
+	     _i < BTREE_KEY_CACHE_SKETCH_ROWS &&				\
+	     ((_idx = ((_h) >> (64 - BTREE_KEY_CACHE_SKETCH_BITS * (_i + 1))) &\
+	       ((1U << BTREE_KEY_CACHE_SKETCH_BITS) - 1)), true);	\
+	     _i++)
+
+/*
+ * Count this key as brought in, and return true if it's been brought in
+ * before recently enough to get a second chance from the shrinker.
+ *
+ * Updates are racy, which is fine - it's an estimate either way:
+ */
+static bool bkey_cached_admit(struct btree_key_cache *bc,
+			      const struct bkey_cached_key *key)
+{
+	struct btree_key_cache_sketch *sk = &bc->sketch;
+	u64 h = bkey_cached_sketch_hash(key);
+	unsigned i, idx, freq = U8_MAX;
+
+	for_each_sketch_idx(h, i, idx) {
+		u8 v = READ_ONCE(sk->c[idx]);
+
+		freq = min_t(unsigned, freq, v);
+		if (v < 15)
+			WRITE_ONCE(sk->c[idx], v + 1);
+	}
+
+	/* Age the sketch, so that old popularity doesn't stick around: */
+	if (!(atomic_inc_return(&sk->nr_incs) % (ARRAY_SIZE(sk->c) * 8)))
+		for (i = 0; i < ARRAY_SIZE(sk->c); i++)
+			WRITE_ONCE(sk->c[i], READ_ONCE(sk->c[i]) >> 1);
+
+	return freq > 0;
+}
+
+/* Per btree budgets: */
+
+static u64 bkey_cached_budget(struct bch_fs *c, enum btree_id btree)
+{
+	switch (btree) {
+	case BTREE_ID_alloc:
+		return c->opts.key_cache_alloc_max;
+	case BTREE_ID_inodes:
+		return c->opts.key_cache_inodes_max;
+	default:
+		return 0;
+	}
+}
+
+static inline bool bkey_cached_over_budget(struct bch_fs *c, enum btree_id btree)
+{
+	u64 budget = bkey_cached_budget(c, btree);
+
+	return budget &&
+		atomic_long_read(&c->btree_key_cache.nr_bytes[btree]) > budget;
+}
+
+static inline long bkey_cached_bytes(struct bkey_cached *ck)
+{
+	return sizeof(*ck) + ck->u64s * sizeof(u64);
+}
+
 static inline void btree_path_cached_set(struct btree_trans *trans, struct btree_path *path,
 					 struct bkey_cached *ck,
 					 enum btree_node_locked_type lock_held)
@@ -84,12 +198,34 @@ static void bkey_cached_evict(struct btree_key_cache *c,
 {
 	BUG_ON(rhashtable_remove_fast(&c->table, &ck->hash,
 				      bch2_btree_key_cache_params));
+	atomic_long_sub(bkey_cached_bytes(ck), &c->nr_bytes[ck->key.btree_id]);
 	memset(&ck->key, ~0, sizeof(ck->key));
 
 	atomic_long_dec(&c->nr_keys);
 }
 
+/*
+ * State for one pass of the shrinker: objects are freed onto private lists,
+ * and spliced onto the global freelists under bc->lock in one go at the end:
+ */
+struct bkey_cached_scan {
+	struct list_head	freed_pcpu;
+	size_t			nr_freed_pcpu;
+	struct list_head	freed_nonpcpu;
+	size_t			nr_freed_nonpcpu;
+
+	size_t			scanned;
+	size_t			nr_to_scan;
+	u64			btree_mask;	/* 0 for all btrees */
+
+	unsigned long		moved_to_freelist;
+	unsigned long		skipped_dirty;
+	unsigned long		skipped_accessed;
+	unsigned long		skipped_lock_fail;
+};
+
 static void bkey_cached_free(struct btree_key_cache *bc,
+			     struct bkey_cached_scan *s,
 			     struct bkey_cached *ck)
 {
 	struct bch_fs *c = container_of(bc, struct bch_fs, btree_key_cache);
@@ -100,11 +236,11 @@ static void bkey_cached_free(struct btree_key_cache *bc,
 		start_poll_synchronize_srcu(&c->btree_trans_barrier);
 
 	if (ck->c.lock.readers) {
-		list_move_tail(&ck->list, &bc->freed_pcpu);
-		bc->nr_freed_pcpu++;
+		list_move_tail(&ck->list, &s->freed_pcpu);
+		s->nr_freed_pcpu++;
 	} else {
-		list_move_tail(&ck->list, &bc->freed_nonpcpu);
-		bc->nr_freed_nonpcpu++;
+		list_move_tail(&ck->list, &s->freed_nonpcpu);
+		s->nr_freed_nonpcpu++;
 	}
 	atomic_long_inc(&bc->nr_freed);
 
@@ -116,7 +252,6 @@ static void bkey_cached_free(struct btree_key_cache *bc,
 	six_unlock_intent(&ck->c.lock);
 }
 
-#ifdef __KERNEL__
 static void __bkey_cached_move_to_freelist_ordered(struct btree_key_cache *bc,
 						   struct bkey_cached *ck)
 {
@@ -134,7 +269,6 @@ static void __bkey_cached_move_to_freelist_ordered(struct btree_key_cache *bc,
 
 	list_move(&ck->list, &bc->freed_nonpcpu);
 }
-#endif
 
 static void bkey_cached_move_to_freelist(struct btree_key_cache *bc,
 					 struct bkey_cached *ck)
@@ -142,40 +276,30 @@ static void bkey_cached_move_to_freelist(struct btree_key_cache *bc,
 	BUG_ON(test_bit(BKEY_CACHED_DIRTY, &ck->flags));
 
 	if (!ck->c.lock.readers) {
-#ifdef __KERNEL__
 		struct btree_key_cache_freelist *f;
 		bool freed = false;
 
-		preempt_disable();
-		f = this_cpu_ptr(bc->pcpu_freed);
-
+		f = bkey_cached_freelist_get(bc);
 		if (f->nr < ARRAY_SIZE(f->objs)) {
 			f->objs[f->nr++] = ck;
 			freed = true;
 		}
-		preempt_enable();
+		bkey_cached_freelist_put(f);
 
 		if (!freed) {
 			mutex_lock(&bc->lock);
-			preempt_disable();
-			f = this_cpu_ptr(bc->pcpu_freed);
+			f = bkey_cached_freelist_get(bc);
 
 			while (f->nr > ARRAY_SIZE(f->objs) / 2) {
 				struct bkey_cached *ck2 = f->objs[--f->nr];
 
 				__bkey_cached_move_to_freelist_ordered(bc, ck2);
 			}
-			preempt_enable();
+			bkey_cached_freelist_put(f);
 
 			__bkey_cached_move_to_freelist_ordered(bc, ck);
 			mutex_unlock(&bc->lock);
 		}
-#else
-		mutex_lock(&bc->lock);
-		list_move_tail(&ck->list, &bc->freed_nonpcpu);
-		bc->nr_freed_nonpcpu++;
-		mutex_unlock(&bc->lock);
-#endif
 	} else {
 		mutex_lock(&bc->lock);
 		list_move_tail(&ck->list, &bc->freed_pcpu);
@@ -229,19 +353,16 @@ bkey_cached_alloc(struct btree_trans *trans, struct btree_path *path, unsigned k
 	int ret;
 
 	if (!pcpu_readers) {
-#ifdef __KERNEL__
 		struct btree_key_cache_freelist *f;
 
-		preempt_disable();
-		f = this_cpu_ptr(bc->pcpu_freed);
+		f = bkey_cached_freelist_get(bc);
 		if (f->nr)
 			ck = f->objs[--f->nr];
-		preempt_enable();
+		bkey_cached_freelist_put(f);
 
 		if (!ck) {
 			mutex_lock(&bc->lock);
-			preempt_disable();
-			f = this_cpu_ptr(bc->pcpu_freed);
+			f = bkey_cached_freelist_get(bc);
 
 			while (!list_empty(&bc->freed_nonpcpu) &&
 			       f->nr < ARRAY_SIZE(f->objs) / 2) {
@@ -252,18 +373,9 @@ bkey_cached_alloc(struct btree_trans *trans, struct btree_path *path, unsigned k
 			}
 
 			ck = f->nr ? f->objs[--f->nr] : NULL;
-			preempt_enable();
+			bkey_cached_freelist_put(f);
 			mutex_unlock(&bc->lock);
 		}
-#else
-		mutex_lock(&bc->lock);
-		if (!list_empty(&bc->freed_nonpcpu)) {
-			ck = list_last_entry(&bc->freed_nonpcpu, struct bkey_cached, list);
-			list_del_init(&ck->list);
-			bc->nr_freed_nonpcpu--;
-		}
-		mutex_unlock(&bc->lock);
-#endif
 	} else {
 		mutex_lock(&bc->lock);
 		if (!list_empty(&bc->freed_pcpu)) {
@@ -378,7 +490,14 @@ static int btree_key_cache_create(struct btree_trans *trans, struct btree_path *
 	ck->c.btree_id		= path->btree_id;
 	ck->key.btree_id	= path->btree_id;
 	ck->key.pos		= path->pos;
-	ck->flags		= 1U << BKEY_CACHED_ACCESSED;
+	ck->flags		= 0;
+
+	if (bkey_cached_admit(bc, &ck->key)) {
+		ck->flags |= 1U << BKEY_CACHED_ACCESSED;
+		atomic_long_inc(&bc->admitted);
+	} else {
+		atomic_long_inc(&bc->probation);
+	}
 
 	if (unlikely(key_u64s > ck->u64s)) {
 		mark_btree_node_locked_noreset(path, 0, BTREE_NODE_UNLOCKED);
@@ -406,6 +525,10 @@ static int btree_key_cache_create(struct btree_trans *trans, struct btree_path *
 		goto err;
 
 	atomic_long_inc(&bc->nr_keys);
+	atomic_long_add(bkey_cached_bytes(ck), &bc->nr_bytes[ck->key.btree_id]);
+	if (unlikely(bkey_cached_over_budget(c, ck->key.btree_id)))
+		queue_work(system_unbound_wq, &bc->budget_work);
+
 	six_unlock_write(&ck->c.lock);
 
 	enum six_lock_type lock_want = __btree_lock_want(path, 0);
@@ -625,6 +748,164 @@ out:
 	return ret;
 }
 
+/*
+ * Key cache pins are cheap to flush, but each one is a separate btree update:
+ * when flushing one, also flush other dirty keys pinning the same journal
+ * sequence number, sorted so that keys going to the same btree leaf are
+ * flushed with a single transaction commit:
+ */
+#define KEY_CACHE_FLUSH_BATCH	32
+#define KEY_CACHE_FLUSH_LEAF	16
+
+static int bkey_cached_key_cmp(const void *_l, const void *_r)
+{
+	const struct bkey_cached_key *l = _l, *r = _r;
+
+	return  cmp_int(l->btree_id, r->btree_id) ?:
+		bpos_cmp(l->pos, r->pos);
+}
+
+/*
+ * Flush a run of sorted keys, stopping at the first key past the end of the
+ * leaf the first dirty key goes to; *nr_done is set to the number of keys
+ * consumed:
+ */
+static int btree_key_cache_flush_leaf(struct btree_trans *trans,
+				      struct bkey_cached_key *keys, unsigned nr,
+				      u64 seq, unsigned *nr_done)
+{
+	struct bch_fs *c = trans->c;
+	struct journal *j = &c->journal;
+	struct btree_iter c_iter[KEY_CACHE_FLUSH_LEAF];
+	struct btree_iter b_iter[KEY_CACHE_FLUSH_LEAF];
+	struct bkey_cached *ck[KEY_CACHE_FLUSH_LEAF];
+	struct bpos leaf_end = SPOS_MAX;
+	unsigned commit_flags = BCH_TRANS_COMMIT_journal_reclaim;
+	unsigned i, nr_iters = 0, nr_flush = 0;
+	int ret = 0;
+
+	nr = min_t(unsigned, nr, KEY_CACHE_FLUSH_LEAF);
+
+	for (i = 0; i < nr; i++) {
+		if (keys[i].btree_id != keys[0].btree_id ||
+		    bpos_gt(keys[i].pos, leaf_end))
+			break;
+
+		bch2_trans_iter_init(trans, &b_iter[i], keys[i].btree_id, keys[i].pos,
+				     BTREE_ITER_slots|
+				     BTREE_ITER_intent|
+				     BTREE_ITER_all_snapshots);
+		bch2_trans_iter_init(trans, &c_iter[i], keys[i].btree_id, keys[i].pos,
+				     BTREE_ITER_cached|
+				     BTREE_ITER_intent);
+		b_iter[i].flags &= ~BTREE_ITER_with_key_cache;
+		nr_iters++;
+
+		ret = bch2_btree_iter_traverse(&c_iter[i]);
+		if (ret)
+			goto out;
+
+		ck[i] = (void *) btree_iter_path(trans, &c_iter[i])->l[0].b;
+		if (!ck[i] ||
+		    !test_bit(BKEY_CACHED_DIRTY, &ck[i]->flags) ||
+		    ck[i]->journal.seq != seq) {
+			ck[i] = NULL;
+			continue;
+		}
+
+		ret = bch2_btree_iter_traverse(&b_iter[i]);
+		if (ret)
+			goto out;
+
+		if (!nr_flush)
+			leaf_end = btree_iter_path(trans, &b_iter[i])->l[0].b->key.k.p;
+
+		ret = bch2_trans_update(trans, &b_iter[i], ck[i]->k,
+					BTREE_UPDATE_key_cache_reclaim|
+					BTREE_UPDATE_internal_snapshot_node|
+					BTREE_TRIGGER_norun);
+		if (ret)
+			goto out;
+		nr_flush++;
+	}
+
+	if (nr_flush) {
+		/* See btree_key_cache_flush_pos(): */
+		trans->journal_res.seq = seq;
+
+		if (seq == journal_last_seq(j))
+			commit_flags |= BCH_WATERMARK_reclaim;
+
+		if (seq != journal_last_seq(j) ||
+		    !test_bit(JOURNAL_space_low, &c->journal.flags))
+			commit_flags |= BCH_TRANS_COMMIT_no_journal_res;
+
+		ret = bch2_trans_commit(trans, NULL, NULL,
+					BCH_TRANS_COMMIT_no_check_rw|
+					BCH_TRANS_COMMIT_no_enospc|
+					commit_flags);
+
+		bch2_fs_fatal_err_on(ret &&
+				     !bch2_err_matches(ret, BCH_ERR_transaction_restart) &&
+				     !bch2_err_matches(ret, BCH_ERR_journal_reclaim_would_deadlock) &&
+				     !bch2_journal_error(j), c,
+				     "flushing key cache: %s", bch2_err_str(ret));
+		if (ret)
+			goto out;
+
+		for (unsigned k = 0; k < nr_iters; k++) {
+			if (!ck[k])
+				continue;
+
+			BUG_ON(!btree_node_locked(btree_iter_path(trans, &c_iter[k]), 0));
+
+			bch2_journal_pin_drop(j, &ck[k]->journal);
+
+			if (test_bit(BKEY_CACHED_DIRTY, &ck[k]->flags)) {
+				clear_bit(BKEY_CACHED_DIRTY, &ck[k]->flags);
+				atomic_long_dec(&c->btree_key_cache.nr_dirty);
+			}
+		}
+	}
+
+	*nr_done = i;
+out:
+	while (nr_iters--) {
+		bch2_trans_iter_exit(trans, &b_iter[nr_iters]);
+		bch2_trans_iter_exit(trans, &c_iter[nr_iters]);
+	}
+	return ret;
+}
+
+static void btree_key_cache_flush_batch(struct btree_trans *trans,
+					struct journal_entry_pin *pin, u64 seq)
+{
+	struct journal *j = &trans->c->journal;
+	struct bkey_cached_key keys[KEY_CACHE_FLUSH_BATCH];
+	struct journal_entry_pin *i;
+	unsigned nr = 0;
+
+	spin_lock(&j->lock);
+	if (seq >= j->pin.front && seq < j->pin.back)
+		list_for_each_entry(i, &journal_seq_pin(j, seq)->list[JOURNAL_PIN_key_cache], list) {
+			if (i == pin)
+				continue;
+			if (nr == ARRAY_SIZE(keys))
+				break;
+			keys[nr++] = container_of(i, struct bkey_cached, journal)->key;
+		}
+	spin_unlock(&j->lock);
+
+	/* btree_key_cache_flush_pos() rechecks that the key is still dirty at @seq: */
+	sort(keys, nr, sizeof(keys[0]), bkey_cached_key_cmp, NULL);
+
+	for (unsigned k = 0, done; k < nr; k += done)
+		if (lockrestart_do(trans,
+				btree_key_cache_flush_leaf(trans, keys + k, nr - k,
+							   seq, &done)))
+			break;
+}
+
 int bch2_btree_key_cache_journal_flush(struct journal *j,
 				struct journal_entry_pin *pin, u64 seq)
 {
@@ -656,6 +937,8 @@ int bch2_btree_key_cache_journal_flush(struct journal *j,
 	ret = lockrestart_do(trans,
 		btree_key_cache_flush_pos(trans, key, seq,
 				BCH_TRANS_COMMIT_journal_reclaim, false));
+	if (!ret)
+		btree_key_cache_flush_batch(trans, pin, seq);
 unlock:
 	srcu_read_unlock(&c->btree_trans_barrier, srcu_idx);
 
@@ -733,23 +1016,90 @@ void bch2_btree_key_cache_drop(struct btree_trans *trans,
 	btree_path_set_dirty(path, BTREE_ITER_NEED_TRAVERSE);
 }
 
-static unsigned long bch2_btree_key_cache_scan(struct shrinker *shrink,
-					   struct shrink_control *sc)
+static void bch2_btree_key_cache_scan_part(struct btree_key_cache *bc,
+					   struct bkey_cached_scan *s,
+					   unsigned part_idx)
 {
-	struct bch_fs *c = shrink->private_data;
-	struct btree_key_cache *bc = &c->btree_key_cache;
+	struct btree_key_cache_shrink_part *part = bc->shrink_parts + part_idx;
 	struct bucket_table *tbl;
+	struct bkey_cached *ck;
+	unsigned start, end, iter_start;
+
+	rcu_read_lock();
+	tbl = rht_dereference_rcu(bc->table.tbl, &bc->table);
+
+	/* Partitions are fractions of the table, since it may be resized: */
+	start	= div_u64((u64) tbl->size * part_idx, BTREE_KEY_CACHE_SHRINK_PARTS);
+	end	= div_u64((u64) tbl->size * (part_idx + 1), BTREE_KEY_CACHE_SHRINK_PARTS);
+	if (start == end)
+		goto out;
+
+	if (part->iter < start || part->iter >= end)
+		part->iter = start;
+	iter_start = part->iter;
+
+	do {
+		struct rhash_head *pos, *next;
+
+		pos = rht_ptr_rcu(rht_bucket(tbl, part->iter));
+
+		while (!rht_is_a_nulls(pos)) {
+			next = rht_dereference_bucket_rcu(pos->next, tbl, part->iter);
+			ck = container_of(pos, struct bkey_cached, hash);
+
+			if (s->btree_mask &&
+			    !(s->btree_mask & BIT_ULL(ck->key.btree_id))) {
+				/* not the btree we're trimming */
+			} else if (test_bit(BKEY_CACHED_DIRTY, &ck->flags)) {
+				s->skipped_dirty++;
+			} else if (test_bit(BKEY_CACHED_ACCESSED, &ck->flags)) {
+				clear_bit(BKEY_CACHED_ACCESSED, &ck->flags);
+				s->skipped_accessed++;
+			} else if (!bkey_cached_lock_for_evict(ck)) {
+				s->skipped_lock_fail++;
+			} else {
+				bkey_cached_evict(bc, ck);
+				bkey_cached_free(bc, s, ck);
+				s->moved_to_freelist++;
+			}
+
+			s->scanned++;
+			if (s->scanned >= s->nr_to_scan)
+				break;
+
+			pos = next;
+		}
+
+		part->iter++;
+		if (part->iter >= end)
+			part->iter = start;
+	} while (s->scanned < s->nr_to_scan && part->iter != iter_start);
+out:
+	rcu_read_unlock();
+}
+
+static unsigned long __bch2_btree_key_cache_scan(struct btree_key_cache *bc,
+						 size_t nr_to_scan,
+						 u64 btree_mask)
+{
+	struct bch_fs *c = container_of(bc, struct bch_fs, btree_key_cache);
 	struct bkey_cached *ck, *t;
-	size_t scanned = 0, freed = 0, nr = sc->nr_to_scan;
-	unsigned start, flags;
+	struct bkey_cached_scan s = {
+		.freed_pcpu	= LIST_HEAD_INIT(s.freed_pcpu),
+		.freed_nonpcpu	= LIST_HEAD_INIT(s.freed_nonpcpu),
+		.nr_to_scan	= nr_to_scan,
+		.btree_mask	= btree_mask,
+	};
+	unsigned i, start, flags;
 	int srcu_idx;
 
-	mutex_lock(&bc->lock);
-	bc->requested_to_free += sc->nr_to_scan;
-
 	srcu_idx = srcu_read_lock(&c->btree_trans_barrier);
 	flags = memalloc_nofs_save();
 
+	mutex_lock(&bc->lock);
+	if (!btree_mask)
+		bc->requested_to_free += nr_to_scan;
+
 	/*
 	 * Newest freed entries are at the end of the list - once we hit one
 	 * that's too new to be freed, we can bail out:
@@ -779,54 +1129,83 @@ static unsigned long bch2_btree_key_cache_scan(struct shrinker *shrink,
 		bc->nr_freed_pcpu--;
 		bc->freed++;
 	}
+	mutex_unlock(&bc->lock);
 
-	rcu_read_lock();
-	tbl = rht_dereference_rcu(bc->table.tbl, &bc->table);
-	if (bc->shrink_iter >= tbl->size)
-		bc->shrink_iter = 0;
-	start = bc->shrink_iter;
+	/*
+	 * Walking the hash table doesn't need bc->lock: each partition has its
+	 * own cursor and lock, and if another scan has the partition we'd
+	 * start with we move on to the next one:
+	 */
+	start = atomic_inc_return(&bc->shrink_next_part);
 
-	do {
-		struct rhash_head *pos, *next;
+	for (i = 0;
+	     i < BTREE_KEY_CACHE_SHRINK_PARTS && s.scanned < s.nr_to_scan;
+	     i++) {
+		unsigned idx = (start + i) % BTREE_KEY_CACHE_SHRINK_PARTS;
+		struct btree_key_cache_shrink_part *part = bc->shrink_parts + idx;
 
-		pos = rht_ptr_rcu(rht_bucket(tbl, bc->shrink_iter));
+		if (!mutex_trylock(&part->lock))
+			continue;
 
-		while (!rht_is_a_nulls(pos)) {
-			next = rht_dereference_bucket_rcu(pos->next, tbl, bc->shrink_iter);
-			ck = container_of(pos, struct bkey_cached, hash);
+		bch2_btree_key_cache_scan_part(bc, &s, idx);
+		mutex_unlock(&part->lock);
+	}
 
-			if (test_bit(BKEY_CACHED_DIRTY, &ck->flags)) {
-				bc->skipped_dirty++;
-			} else if (test_bit(BKEY_CACHED_ACCESSED, &ck->flags)) {
-				clear_bit(BKEY_CACHED_ACCESSED, &ck->flags);
-				bc->skipped_accessed++;
-			} else if (!bkey_cached_lock_for_evict(ck)) {
-				bc->skipped_lock_fail++;
-			} else {
-				bkey_cached_evict(bc, ck);
-				bkey_cached_free(bc, ck);
-				bc->moved_to_freelist++;
-				freed++;
-			}
+	mutex_lock(&bc->lock);
+	list_splice_tail(&s.freed_pcpu,		&bc->freed_pcpu);
+	list_splice_tail(&s.freed_nonpcpu,	&bc->freed_nonpcpu);
+	bc->nr_freed_pcpu	+= s.nr_freed_pcpu;
+	bc->nr_freed_nonpcpu	+= s.nr_freed_nonpcpu;
+
+	bc->moved_to_freelist	+= s.moved_to_freelist;
+	bc->skipped_dirty	+= s.skipped_dirty;
+	bc->skipped_accessed	+= s.skipped_accessed;
+	bc->skipped_lock_fail	+= s.skipped_lock_fail;
+	if (btree_mask)
+		bc->evicted_over_budget += s.moved_to_freelist;
+	mutex_unlock(&bc->lock);
 
-			scanned++;
-			if (scanned >= nr)
-				break;
+	memalloc_nofs_restore(flags);
+	srcu_read_unlock(&c->btree_trans_barrier, srcu_idx);
 
-			pos = next;
-		}
+	return s.moved_to_freelist;
+}
 
-		bc->shrink_iter++;
-		if (bc->shrink_iter >= tbl->size)
-			bc->shrink_iter = 0;
-	} while (scanned < nr && bc->shrink_iter != start);
+static unsigned long bch2_btree_key_cache_scan(struct shrinker *shrink,
+					   struct shrink_control *sc)
+{
+	struct bch_fs *c = shrink->private_data;
 
-	rcu_read_unlock();
-	memalloc_nofs_restore(flags);
-	srcu_read_unlock(&c->btree_trans_barrier, srcu_idx);
-	mutex_unlock(&bc->lock);
+	return __bch2_btree_key_cache_scan(&c->btree_key_cache, sc->nr_to_scan, 0);
+}
+
+/*
+ * Trim btrees that are over their budget, independently of memory pressure:
+ * keys are only evicted on the shrinker's second visit, so this may take a
+ * couple of passes:
+ */
+static void bch2_btree_key_cache_budget_work(struct work_struct *work)
+{
+	struct btree_key_cache *bc =
+		container_of(work, struct btree_key_cache, budget_work);
+	struct bch_fs *c = container_of(bc, struct bch_fs, btree_key_cache);
+	unsigned passes = 0;
+
+	while (passes++ < 4) {
+		u64 btree_mask = 0;
+		unsigned i;
+
+		for (i = 0; i < BTREE_ID_NR; i++)
+			if (bkey_cached_over_budget(c, i))
+				btree_mask |= BIT_ULL(i);
+
+		if (!btree_mask)
+			break;
 
-	return freed;
+		__bch2_btree_key_cache_scan(bc, atomic_long_read(&bc->nr_keys),
+					    btree_mask);
+		cond_resched();
+	}
 }
 
 static unsigned long bch2_btree_key_cache_count(struct shrinker *shrink,
@@ -856,11 +1235,10 @@ void bch2_fs_btree_key_cache_exit(struct btree_key_cache *bc)
 	struct rhash_head *pos;
 	LIST_HEAD(items);
 	unsigned i;
-#ifdef __KERNEL__
 	int cpu;
-#endif
 
 	shrinker_free(bc->shrink);
+	cancel_work_sync(&bc->budget_work);
 
 	mutex_lock(&bc->lock);
 
@@ -885,6 +1263,17 @@ void bch2_fs_btree_key_cache_exit(struct btree_key_cache *bc)
 			struct btree_key_cache_freelist *f =
 				per_cpu_ptr(bc->pcpu_freed, cpu);
 
+			for (i = 0; i < f->nr; i++) {
+				ck = f->objs[i];
+				list_add(&ck->list, &items);
+			}
+		}
+	}
+#else
+	if (bc->pcpu_freed) {
+		for (cpu = 0; cpu < BTREE_KEY_CACHE_FREELIST_SHARDS; cpu++) {
+			struct btree_key_cache_freelist *f = bc->pcpu_freed + cpu;
+
 			for (i = 0; i < f->nr; i++) {
 				ck = f->objs[i];
 				list_add(&ck->list, &items);
@@ -923,14 +1312,25 @@ void bch2_fs_btree_key_cache_exit(struct btree_key_cache *bc)
 	if (bc->table_init_done)
 		rhashtable_destroy(&bc->table);
 
+#ifdef __KERNEL__
 	free_percpu(bc->pcpu_freed);
+#else
+	kfree(bc->pcpu_freed);
+#endif
 }
 
 void bch2_fs_btree_key_cache_init_early(struct btree_key_cache *c)
 {
+	unsigned i;
+
 	mutex_init(&c->lock);
 	INIT_LIST_HEAD(&c->freed_pcpu);
 	INIT_LIST_HEAD(&c->freed_nonpcpu);
+
+	for (i = 0; i < ARRAY_SIZE(c->shrink_parts); i++)
+		mutex_init(&c->shrink_parts[i].lock);
+
+	INIT_WORK(&c->budget_work, bch2_btree_key_cache_budget_work);
 }
 
 int bch2_fs_btree_key_cache_init(struct btree_key_cache *bc)
@@ -942,6 +1342,14 @@ int bch2_fs_btree_key_cache_init(struct btree_key_cache *bc)
 	bc->pcpu_freed = alloc_percpu(struct btree_key_cache_freelist);
 	if (!bc->pcpu_freed)
 		return -BCH_ERR_ENOMEM_fs_btree_cache_init;
+#else
+	bc->pcpu_freed = kcalloc(BTREE_KEY_CACHE_FREELIST_SHARDS,
+				 sizeof(*bc->pcpu_freed), GFP_KERNEL);
+	if (!bc->pcpu_freed)
+		return -BCH_ERR_ENOMEM_fs_btree_cache_init;
+
+	for (unsigned i = 0; i < BTREE_KEY_CACHE_FREELIST_SHARDS; i++)
+		spin_lock_init(&bc->pcpu_freed[i].lock);
 #endif
 
 	if (rhashtable_init(&bc->table, &bch2_btree_key_cache_params))
@@ -977,6 +1385,27 @@ void bch2_btree_key_cache_to_text(struct printbuf *out, struct btree_key_cache *
 	prt_printf(out, "nonpcpu freelist:\t%zu\r\n",	bc->nr_freed_nonpcpu);
 	prt_printf(out, "pcpu freelist:\t%zu\r\n",	bc->nr_freed_pcpu);
 
+	prt_printf(out, "\nmemory by btree:\n");
+	for (unsigned i = 0; i < BTREE_ID_NR; i++) {
+		long bytes = atomic_long_read(&bc->nr_bytes[i]);
+		u64 budget = bkey_cached_budget(c, i);
+
+		if (!bytes && !budget)
+			continue;
+
+		prt_printf(out, "%s:\t", bch2_btree_id_str(i));
+		prt_human_readable_u64(out, bytes);
+		if (budget) {
+			prt_str(out, " / ");
+			prt_human_readable_u64(out, budget);
+		}
+		prt_printf(out, "\r\n");
+	}
+
+	prt_printf(out, "\nadmission:\n");
+	prt_printf(out, "admitted:\t%lu\r\n",		atomic_long_read(&bc->admitted));
+	prt_printf(out, "probation:\t%lu\r\n",		atomic_long_read(&bc->probation));
+
 	prt_printf(out, "\nshrinker:\n");
 	prt_printf(out, "requested_to_free:\t%lu\r\n",	bc->requested_to_free);
 	prt_printf(out, "freed:\t%lu\r\n",		bc->freed);
@@ -984,6 +1413,7 @@ void bch2_btree_key_cache_to_text(struct printbuf *out, struct btree_key_cache *
 	prt_printf(out, "skipped_dirty:\t%lu\r\n",	bc->skipped_dirty);
 	prt_printf(out, "skipped_accessed:\t%lu\r\n",	bc->skipped_accessed);
 	prt_printf(out, "skipped_lock_fail:\t%lu\r\n",	bc->skipped_lock_fail);
+	prt_printf(out, "evicted_over_budget:\t%lu\r\n", bc->evicted_over_budget);
 
 	prt_printf(out, "srcu seq:\t%lu\r\n",		get_state_synchronize_srcu(&c->btree_trans_barrier));
 
@@ -3,8 +3,43 @@
 #define _BCACHEFS_BTREE_KEY_CACHE_TYPES_H
 
 struct btree_key_cache_freelist {
+#ifndef __KERNEL__
+	/*
+	 * Userspace has no preempt_disable(): freelists are per thread shard
+	 * instead of per cpu, each with its own lock:
+	 */
+	spinlock_t		lock;
+#endif
 	struct bkey_cached	*objs[16];
 	unsigned		nr;
+} ____cacheline_aligned;
+
+#define BTREE_KEY_CACHE_FREELIST_SHARDS	16
+
+/*
+ * The shrinker walks the hash table in independent partitions, each covering
+ * a fixed fraction of the buckets with its own cursor, so concurrent scans
+ * don't serialize on each other or on @lock:
+ */
+#define BTREE_KEY_CACHE_SHRINK_PARTS	8
+
+struct btree_key_cache_shrink_part {
+	struct mutex		lock;
+	unsigned		iter;
+};
+
+/*
+ * Frequency sketch for admission: a small count-min sketch of how often each
+ * key has been brought into the cache recently, aged by halving. Keys seen
+ * for the first time are admitted on probation, so that one-off scans don't
+ * push out the working set:
+ */
+#define BTREE_KEY_CACHE_SKETCH_BITS	12
+#define BTREE_KEY_CACHE_SKETCH_ROWS	4
+
+struct btree_key_cache_sketch {
+	u8			c[1U << BTREE_KEY_CACHE_SKETCH_BITS];
+	atomic_t		nr_incs;
 };
 
 struct btree_key_cache {
@@ -18,13 +53,22 @@ struct btree_key_cache {
 	size_t			nr_freed_nonpcpu;
 
 	struct shrinker		*shrink;
-	unsigned		shrink_iter;
+	atomic_t		shrink_next_part;
+	struct btree_key_cache_shrink_part shrink_parts[BTREE_KEY_CACHE_SHRINK_PARTS];
 	struct btree_key_cache_freelist __percpu *pcpu_freed;
 
 	atomic_long_t		nr_freed;
 	atomic_long_t		nr_keys;
 	atomic_long_t		nr_dirty;
 
+	/* memory used per btree, checked against the key_cache_*_max options */
+	atomic_long_t		nr_bytes[BTREE_ID_NR];
+	struct work_struct	budget_work;
+
+	struct btree_key_cache_sketch sketch;
+	atomic_long_t		admitted;
+	atomic_long_t		probation;
+
 	/* shrinker stats */
 	unsigned long		requested_to_free;
 	unsigned long		freed;
@@ -32,6 +76,7 @@ struct btree_key_cache {
 	unsigned long		skipped_dirty;
 	unsigned long		skipped_accessed;
 	unsigned long		skipped_lock_fail;
+	unsigned long		evicted_over_budget;
 };
 
 struct bkey_cached_key {
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0
 
 #include "bcachefs.h"
+#include "btree_cache.h"
 #include "btree_locking.h"
 #include "btree_types.h"
 
@@ -401,6 +402,56 @@ int bch2_six_check_for_deadlock(struct six_lock *lock, void *p)
 	return bch2_check_for_deadlock(trans, NULL);
 }
 
+/* Lock wait time accounting: */
+
+noinline
+void bch2_btree_lock_wait_account(struct btree_trans *trans,
+				  struct btree_bkey_cached_common *b,
+				  enum six_lock_type type, unsigned long ip)
+{
+	u64 now = local_clock();
+	u64 start = trans->locking_wait.start_time;
+
+	if (b->btree_id >= BTREE_ID_NR ||
+	    b->level >= BTREE_MAX_DEPTH ||
+	    time_before64(now, start))
+		return;
+
+	trans->phase_ns[BCH_TRANS_PHASE_lock_wait] += now - start;
+
+	struct btree_lock_wait_stats *s = &trans->c->btree_lock_wait[b->btree_id][b->level];
+
+	atomic64_inc(&s->nr);
+	atomic64_add(now - start, &s->ns);
+
+	bch2_btree_lock_profile_contended(trans->c, b->btree_id, b->cached,
+					  b->level, type, now - start, ip);
+}
+
+void bch2_btree_lock_wait_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	printbuf_tabstops_reset(out);
+	printbuf_tabstop_push(out, 20);
+	printbuf_tabstop_push(out, 8);
+	printbuf_tabstop_push(out, 16);
+	printbuf_tabstop_push(out, 16);
+
+	prt_printf(out, "btree\tlevel\rwaits\rtotal\r\n");
+
+	for (unsigned btree = 0; btree < BTREE_ID_NR; btree++)
+		for (unsigned level = 0; level < BTREE_MAX_DEPTH; level++) {
+			struct btree_lock_wait_stats *s = &c->btree_lock_wait[btree][level];
+			u64 nr = atomic64_read(&s->nr);
+
+			if (!nr)
+				continue;
+
+			prt_printf(out, "%s\t%u\r%llu\r", bch2_btree_id_str(btree), level, nr);
+			bch2_pr_time_units(out, atomic64_read(&s->ns));
+			prt_printf(out, "\r\n");
+		}
+}
+
 int __bch2_btree_node_lock_write(struct btree_trans *trans, struct btree_path *path,
 				 struct btree_bkey_cached_common *b,
 				 bool lock_may_not_fail)
@@ -11,6 +11,7 @@
  */
 
 #include "btree_iter.h"
+#include "lock_profile.h"
 #include "six.h"
 
 void bch2_btree_lock_init(struct btree_bkey_cached_common *, enum six_lock_init_flags);
@@ -90,7 +91,13 @@ static inline void mark_btree_node_locked(struct btree_trans *trans,
 	mark_btree_node_locked_noreset(path, level, (enum btree_node_locked_type) type);
 #ifdef CONFIG_BCACHEFS_LOCK_TIME_STATS
 	path->l[level].lock_taken_time = local_clock();
+#else
+	if (bch2_lock_profiling(trans->c))
+		path->l[level].lock_taken_time = local_clock();
 #endif
+	if (type != BTREE_NODE_UNLOCKED)
+		bch2_btree_lock_profile_acquired(trans->c, path->btree_id, path->cached,
+						 level, (enum six_lock_type) type);
 }
 
 static inline enum six_lock_type __btree_lock_want(struct btree_path *path, int level)
@@ -113,13 +120,19 @@ btree_lock_want(struct btree_path *path, int level)
 }
 
 static void btree_trans_lock_hold_time_update(struct btree_trans *trans,
-					      struct btree_path *path, unsigned level)
+					      struct btree_path *path, unsigned level,
+					      enum six_lock_type type)
 {
 #ifdef CONFIG_BCACHEFS_LOCK_TIME_STATS
 	__bch2_time_stats_update(&btree_trans_stats(trans)->lock_hold_times,
 				 path->l[level].lock_taken_time,
 				 local_clock());
 #endif
+	if (bch2_lock_profiling(trans->c)) {
+		bch2_btree_lock_profile_held(trans->c, path->btree_id, path->cached,
+					     level, type, path->l[level].lock_taken_time);
+		path->l[level].lock_taken_time = 0;
+	}
 }
 
 /* unlock: */
@@ -134,7 +147,7 @@ static inline void btree_node_unlock(struct btree_trans *trans,
 
 	if (lock_type != BTREE_NODE_UNLOCKED) {
 		six_unlock_type(&path->l[level].b->c.lock, lock_type);
-		btree_trans_lock_hold_time_update(trans, path, level);
+		btree_trans_lock_hold_time_update(trans, path, level, lock_type);
 	}
 	mark_btree_node_unlocked(path, level);
 }
@@ -185,6 +198,10 @@ void bch2_btree_node_unlock_write(struct btree_trans *,
 			struct btree_path *, struct btree *);
 
 int bch2_six_check_for_deadlock(struct six_lock *lock, void *p);
+void bch2_btree_lock_wait_account(struct btree_trans *,
+				  struct btree_bkey_cached_common *,
+				  enum six_lock_type, unsigned long);
+void bch2_btree_lock_wait_to_text(struct printbuf *, struct bch_fs *);
 
 /* lock: */
 
@@ -226,6 +243,8 @@ static inline int __btree_node_lock_nopath(struct btree_trans *trans,
 
 	ret = six_lock_ip_waiter(&b->lock, type, &trans->locking_wait,
 				 bch2_six_check_for_deadlock, trans, ip);
+	if (trans->locking_wait.start_time)
+		bch2_btree_lock_wait_account(trans, b, type, ip);
 	WRITE_ONCE(trans->locking, NULL);
 	WRITE_ONCE(trans->locking_wait.start_time, 0);
 
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0
 
 #include "bcachefs.h"
+#include "alloc_background.h"
 #include "btree_cache.h"
 #include "btree_io.h"
 #include "btree_journal_iter.h"
@@ -14,10 +15,30 @@
 #include <linux/kthread.h>
 #include <linux/sort.h>
 
+/*
+ * Each device is split into BTREE_NODE_SCAN_WORKERS contiguous bucket ranges,
+ * each scanned by its own thread with BTREE_NODE_SCAN_READAHEAD reads in
+ * flight:
+ */
+#define BTREE_NODE_SCAN_WORKERS		4
+#define BTREE_NODE_SCAN_READAHEAD	16
+
 struct find_btree_nodes_worker {
 	struct closure		*cl;
 	struct find_btree_nodes	*f;
 	struct bch_dev		*ca;
+	u64			bucket_start;
+	u64			bucket_end;
+	bool			print_progress;
+	bool			alloc_info_trusted;
+};
+
+struct btree_node_scan_read {
+	struct bio		*bio;
+	void			*buf;
+	u64			sector;
+	bool			inflight;
+	struct completion	done;
 };
 
 static void found_btree_node_to_text(struct printbuf *out, struct bch_fs *c, const struct found_btree_node *n)
@@ -145,11 +166,6 @@ static void try_read_btree_node(struct find_btree_nodes *f, struct bch_dev *ca,
 {
 	struct bch_fs *c = container_of(f, struct bch_fs, found_btree_nodes);
 
-	bio_reset(bio, ca->disk_sb.bdev, REQ_OP_READ);
-	bio->bi_iter.bi_sector	= offset;
-	bch2_bio_map(bio, bn, PAGE_SIZE);
-
-	submit_bio_wait(bio);
 	if (bch2_dev_io_err_on(bio->bi_status, ca, BCH_MEMBER_ERROR_read,
 			       "IO error in try_read_btree_node() at %llu: %s",
 			       offset, bch2_blk_status_to_str(bio->bi_status)))
@@ -202,46 +218,180 @@ unlock:
 	}
 }
 
+static void btree_node_scan_read_endio(struct bio *bio)
+{
+	struct btree_node_scan_read *r = bio->bi_private;
+
+	complete(&r->done);
+}
+
+static void btree_node_scan_read_submit(struct bch_dev *ca,
+					struct btree_node_scan_read *r, u64 sector)
+{
+	bio_reset(r->bio, ca->disk_sb.bdev, REQ_OP_READ);
+	r->bio->bi_iter.bi_sector	= sector;
+	r->bio->bi_end_io		= btree_node_scan_read_endio;
+	r->bio->bi_private		= r;
+	bch2_bio_map(r->bio, r->buf, PAGE_SIZE);
+
+	r->sector	= sector;
+	r->inflight	= true;
+	reinit_completion(&r->done);
+	submit_bio(r->bio);
+}
+
+/*
+ * The alloc btree is only consulted if its root was read without errors and
+ * alloc info wasn't flagged as needing repair:
+ */
+static bool alloc_info_trusted(struct bch_fs *c)
+{
+	struct btree_root *r = bch2_btree_id_root(c, BTREE_ID_alloc);
+
+	return !c->opts.reconstruct_alloc &&
+		(c->sb.compat & BIT_ULL(BCH_COMPAT_alloc_info)) &&
+		r->b && !r->error;
+}
+
+static int bucket_data_type_get(struct btree_trans *trans, struct bch_dev *ca,
+				u64 bucket, enum bch_data_type *data_type)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k = bch2_bkey_get_iter(trans, &iter, BTREE_ID_alloc,
+					       POS(ca->dev_idx, bucket), 0);
+	int ret = bkey_err(k);
+	if (ret)
+		return ret;
+
+	struct bch_alloc_v4 a_convert;
+	*data_type = bch2_alloc_to_v4(k, &a_convert)->data_type;
+	bch2_trans_iter_exit(trans, &iter);
+	return 0;
+}
+
+static bool bucket_may_have_btree_nodes(struct bch_fs *c, struct bch_dev *ca, u64 bucket)
+{
+	enum bch_data_type data_type;
+
+	if (bch2_trans_run(c, lockrestart_do(trans,
+			bucket_data_type_get(trans, ca, bucket, &data_type))))
+		return true;
+
+	switch (data_type) {
+	case BCH_DATA_free:
+	case BCH_DATA_need_discard:
+	case BCH_DATA_user:
+	case BCH_DATA_cached:
+	case BCH_DATA_parity:
+	case BCH_DATA_stripe:
+	case BCH_DATA_unstriped:
+		return false;
+	default:
+		return true;
+	}
+}
+
+struct btree_node_scan_pos {
+	u64			bucket;
+	unsigned		bucket_offset;
+	bool			bucket_checked;
+};
+
+static bool btree_node_scan_next(struct find_btree_nodes_worker *w,
+				 struct btree_node_scan_pos *pos, u64 *sector)
+{
+	struct bch_fs *c = container_of(w->f, struct bch_fs, found_btree_nodes);
+	struct bch_dev *ca = w->ca;
+
+	for (;
+	     pos->bucket < w->bucket_end;
+	     pos->bucket++, pos->bucket_offset = 0, pos->bucket_checked = false) {
+		if (!pos->bucket_checked) {
+			pos->bucket_checked = true;
+
+			if (w->alloc_info_trusted &&
+			    !bucket_may_have_btree_nodes(c, ca, pos->bucket))
+				continue;
+		}
+
+		while (pos->bucket_offset + btree_sectors(c) <= ca->mi.bucket_size) {
+			*sector = pos->bucket * ca->mi.bucket_size + pos->bucket_offset;
+			pos->bucket_offset += btree_sectors(c);
+
+			if (c->sb.version_upgrade_complete >= bcachefs_metadata_version_mi_btree_bitmap &&
+			    !bch2_dev_btree_bitmap_marked_sectors(ca, *sector, btree_sectors(c)))
+				continue;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
 static int read_btree_nodes_worker(void *p)
 {
 	struct find_btree_nodes_worker *w = p;
 	struct bch_fs *c = container_of(w->f, struct bch_fs, found_btree_nodes);
 	struct bch_dev *ca = w->ca;
-	void *buf = (void *) __get_free_page(GFP_KERNEL);
-	struct bio *bio = bio_alloc(NULL, 1, 0, GFP_KERNEL);
+	struct btree_node_scan_read reads[BTREE_NODE_SCAN_READAHEAD] = {};
+	struct btree_node_scan_pos pos = { .bucket = w->bucket_start };
 	unsigned long last_print = jiffies;
+	unsigned i, nr_inflight = 0;
+	u64 sector;
 
-	if (!buf || !bio) {
-		bch_err(c, "read_btree_nodes_worker: error allocating bio/buf");
-		w->f->ret = -ENOMEM;
-		goto err;
+	for (i = 0; i < ARRAY_SIZE(reads); i++) {
+		reads[i].buf	= (void *) __get_free_page(GFP_KERNEL);
+		reads[i].bio	= bio_alloc(NULL, 1, 0, GFP_KERNEL);
+		init_completion(&reads[i].done);
+
+		if (!reads[i].buf || !reads[i].bio) {
+			bch_err(c, "read_btree_nodes_worker: error allocating bio/buf");
+			w->f->ret = -ENOMEM;
+			goto err;
+		}
 	}
 
-	for (u64 bucket = ca->mi.first_bucket; bucket < ca->mi.nbuckets; bucket++)
-		for (unsigned bucket_offset = 0;
-		     bucket_offset + btree_sectors(c) <= ca->mi.bucket_size;
-		     bucket_offset += btree_sectors(c)) {
-			if (time_after(jiffies, last_print + HZ * 30)) {
-				u64 cur_sector = bucket * ca->mi.bucket_size + bucket_offset;
-				u64 end_sector = ca->mi.nbuckets * ca->mi.bucket_size;
-
-				bch_info(ca, "%s: %2u%% done", __func__,
-					 (unsigned) div64_u64(cur_sector * 100, end_sector));
-				last_print = jiffies;
-			}
+	for (i = 0; i < ARRAY_SIZE(reads) && btree_node_scan_next(w, &pos, &sector); i++) {
+		btree_node_scan_read_submit(ca, &reads[i], sector);
+		nr_inflight++;
+	}
 
-			u64 sector = bucket * ca->mi.bucket_size + bucket_offset;
+	/* Reads are submitted and completed in ring order: */
+	for (i = 0; nr_inflight; i = (i + 1) % ARRAY_SIZE(reads)) {
+		struct btree_node_scan_read *r = &reads[i];
 
-			if (c->sb.version_upgrade_complete >= bcachefs_metadata_version_mi_btree_bitmap &&
-			    !bch2_dev_btree_bitmap_marked_sectors(ca, sector, btree_sectors(c)))
-				continue;
+		if (!r->inflight)
+			continue;
+
+		wait_for_completion(&r->done);
+		r->inflight = false;
+		nr_inflight--;
+
+		if (w->print_progress &&
+		    time_after(jiffies, last_print + HZ * 30)) {
+			u64 cur_sector = r->sector - w->bucket_start * ca->mi.bucket_size;
+			u64 end_sector = (w->bucket_end - w->bucket_start) * ca->mi.bucket_size;
 
-			try_read_btree_node(w->f, ca, bio, buf, sector);
+			bch_info(ca, "%s: %2u%% done", __func__,
+				 (unsigned) div64_u64(cur_sector * 100, end_sector));
+			last_print = jiffies;
 		}
+
+		try_read_btree_node(w->f, ca, r->bio, r->buf, r->sector);
+
+		if (btree_node_scan_next(w, &pos, &sector)) {
+			btree_node_scan_read_submit(ca, r, sector);
+			nr_inflight++;
+		}
+	}
 err:
-	bio_put(bio);
-	free_page((unsigned long) buf);
-	percpu_ref_get(&ca->io_ref);
+	for (i = 0; i < ARRAY_SIZE(reads); i++) {
+		if (reads[i].bio)
+			bio_put(reads[i].bio);
+		free_page((unsigned long) reads[i].buf);
+	}
+	percpu_ref_put(&ca->io_ref);
 	closure_put(w->cl);
 	kfree(w);
 	return 0;
@@ -250,6 +400,7 @@ err:
 static int read_btree_nodes(struct find_btree_nodes *f)
 {
 	struct bch_fs *c = container_of(f, struct bch_fs, found_btree_nodes);
+	bool trust_alloc = alloc_info_trusted(c);
 	struct closure cl;
 	int ret = 0;
 
@@ -259,29 +410,48 @@ static int read_btree_nodes(struct find_btree_nodes *f)
 		if (!(ca->mi.data_allowed & BIT(BCH_DATA_btree)))
 			continue;
 
-		struct find_btree_nodes_worker *w = kmalloc(sizeof(*w), GFP_KERNEL);
-		struct task_struct *t;
+		u64 nr_buckets = ca->mi.nbuckets - ca->mi.first_bucket;
 
-		if (!w) {
-			percpu_ref_put(&ca->io_ref);
-			ret = -ENOMEM;
-			goto err;
-		}
+		for (unsigned i = 0; i < BTREE_NODE_SCAN_WORKERS; i++) {
+			u64 start	= ca->mi.first_bucket +
+				div_u64(nr_buckets * i, BTREE_NODE_SCAN_WORKERS);
+			u64 end		= ca->mi.first_bucket +
+				div_u64(nr_buckets * (i + 1), BTREE_NODE_SCAN_WORKERS);
+
+			if (start == end)
+				continue;
+
+			struct find_btree_nodes_worker *w = kmalloc(sizeof(*w), GFP_KERNEL);
+			struct task_struct *t;
 
-		percpu_ref_get(&ca->io_ref);
-		closure_get(&cl);
-		w->cl		= &cl;
-		w->f		= f;
-		w->ca		= ca;
-
-		t = kthread_run(read_btree_nodes_worker, w, "read_btree_nodes/%s", ca->name);
-		ret = IS_ERR_OR_NULL(t);
-		if (ret) {
-			percpu_ref_put(&ca->io_ref);
-			closure_put(&cl);
-			f->ret = ret;
-			bch_err(c, "error starting kthread: %i", ret);
-			break;
+			if (!w) {
+				percpu_ref_put(&ca->io_ref);
+				ret = -ENOMEM;
+				goto err;
+			}
+
+			percpu_ref_get(&ca->io_ref);
+			closure_get(&cl);
+			w->cl			= &cl;
+			w->f			= f;
+			w->ca			= ca;
+			w->bucket_start		= start;
+			w->bucket_end		= end;
+			w->print_progress	= !i;
+			w->alloc_info_trusted	= trust_alloc;
+
+			t = kthread_run(read_btree_nodes_worker, w, "read_btree_nodes/%s/%u",
+					ca->name, i);
+			ret = IS_ERR_OR_NULL(t);
+			if (ret) {
+				percpu_ref_put(&ca->io_ref);
+				closure_put(&cl);
+				kfree(w);
+				f->ret = ret;
+				bch_err(c, "error starting kthread: %i", ret);
+				percpu_ref_put(&ca->io_ref);
+				goto err;
+			}
 		}
 	}
 err:
@@ -0,0 +1,126 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Btree workload capture: with the btree_trace option set, every committed
+ * transaction appends one fixed size record per update to a ring buffer,
+ * which is drained by reading debugfs btree_trace; the result can be replayed
+ * with bcachefs bench --replay.
+ *
+ * Only the shape of the workload is recorded - positions, key types and sizes,
+ * and timing - not key values. Updates that go through the btree write buffer
+ * never pass through a transaction commit's update list, and aren't captured.
+ */
+
+#include "bcachefs.h"
+#include "btree_trace.h"
+#include "btree_update.h"
+
+static enum btree_trace_op btree_trace_op(struct btree_insert_entry *i)
+{
+	if (bkey_deleted(&i->k->k))
+		return BTREE_TRACE_delete;
+	if (bkey_deleted(&i->old_k))
+		return BTREE_TRACE_insert;
+	return BTREE_TRACE_overwrite;
+}
+
+void __bch2_btree_trace_commit(struct btree_trans *trans)
+{
+	struct bch_fs *c = trans->c;
+	struct bch_btree_trace *t = &c->btree_trace;
+	u64 now = local_clock();
+	bool first = true;
+
+	spin_lock(&t->lock);
+	/* a transaction is recorded in full or not at all: */
+	if (fifo_free(&t->entries) < trans->nr_updates) {
+		t->dropped += trans->nr_updates;
+		goto out;
+	}
+
+	trans_for_each_update(trans, i) {
+		struct btree_trace_entry *e = fifo_push_back_ref(&t->entries);
+
+		*e = (struct btree_trace_entry) {
+			.time		= cpu_to_le64(time_after64(now, t->start_time)
+						      ? now - t->start_time : 0),
+			.inode		= cpu_to_le64(i->k->k.p.inode),
+			.offset		= cpu_to_le64(i->k->k.p.offset),
+			.snapshot	= cpu_to_le32(i->k->k.p.snapshot),
+			.trans_fn	= cpu_to_le16(trans->fn_idx),
+			.btree_id	= i->btree_id,
+			.level		= i->level,
+			.op		= btree_trace_op(i),
+			.flags		= (first ? BTREE_TRACE_FIRST : 0)|
+					  (i->cached ? BTREE_TRACE_CACHED : 0),
+			.u64s		= cpu_to_le16(i->k->k.u64s),
+			.old_u64s	= cpu_to_le16(i->old_k.u64s),
+			.key_type	= i->k->k.type,
+		};
+		first = false;
+	}
+out:
+	spin_unlock(&t->lock);
+}
+
+size_t bch2_btree_trace_pop(struct bch_fs *c, struct btree_trace_entry *dst, size_t nr)
+{
+	struct bch_btree_trace *t = &c->btree_trace;
+	size_t ret = 0;
+
+	spin_lock(&t->lock);
+	while (ret < nr && fifo_pop(&t->entries, dst[ret]))
+		ret++;
+	spin_unlock(&t->lock);
+
+	return ret;
+}
+
+void bch2_btree_trace_header(struct bch_fs *c, struct btree_trace_header *h)
+{
+	struct bch_btree_trace *t = &c->btree_trace;
+
+	memset(h, 0, sizeof(*h));
+	h->magic	= cpu_to_le64(BTREE_TRACE_MAGIC);
+	h->version	= cpu_to_le32(BTREE_TRACE_VERSION);
+	h->entry_size	= cpu_to_le32(sizeof(struct btree_trace_entry));
+
+	spin_lock(&t->lock);
+	h->dropped	= cpu_to_le64(t->dropped);
+	t->dropped	= 0;
+	spin_unlock(&t->lock);
+}
+
+void bch2_fs_btree_trace_exit(struct bch_fs *c)
+{
+	free_fifo(&c->btree_trace.entries);
+}
+
+/* Called at startup and when the btree_trace option is turned on: */
+int bch2_fs_btree_trace_init(struct bch_fs *c)
+{
+	struct bch_btree_trace *t = &c->btree_trace;
+	DECLARE_FIFO(struct btree_trace_entry, entries);
+
+	if (!c->opts.btree_trace || READ_ONCE(t->entries.data))
+		return 0;
+
+	if (!init_fifo(&entries, BTREE_TRACE_ENTRIES, GFP_KERNEL))
+		return -BCH_ERR_ENOMEM_fs_other_alloc;
+
+	spin_lock(&t->lock);
+	if (!t->entries.data) {
+		fifo_swap(&t->entries, &entries);
+		t->start_time	= local_clock();
+		t->dropped	= 0;
+	}
+	spin_unlock(&t->lock);
+
+	free_fifo(&entries);
+	return 0;
+}
+
+void bch2_fs_btree_trace_init_early(struct bch_fs *c)
+{
+	spin_lock_init(&c->btree_trace.lock);
+}
@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_BTREE_TRACE_H
+#define _BCACHEFS_BTREE_TRACE_H
+
+#include "btree_trace_types.h"
+
+void __bch2_btree_trace_commit(struct btree_trans *);
+
+static inline void bch2_btree_trace_commit(struct btree_trans *trans)
+{
+	struct bch_fs *c = trans->c;
+
+	if (unlikely(c->opts.btree_trace) &&
+	    c->btree_trace.entries.data &&
+	    trans->nr_updates)
+		__bch2_btree_trace_commit(trans);
+}
+
+size_t bch2_btree_trace_pop(struct bch_fs *, struct btree_trace_entry *, size_t);
+void bch2_btree_trace_header(struct bch_fs *, struct btree_trace_header *);
+
+void bch2_fs_btree_trace_exit(struct bch_fs *);
+int bch2_fs_btree_trace_init(struct bch_fs *);
+void bch2_fs_btree_trace_init_early(struct bch_fs *);
+
+#endif /* _BCACHEFS_BTREE_TRACE_H */
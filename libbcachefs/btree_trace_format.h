@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_BTREE_TRACE_FORMAT_H
+#define _BCACHEFS_BTREE_TRACE_FORMAT_H
+
+/*
+ * On the wire format of btree workload traces, as read from debugfs
+ * btree_trace and replayed by bcachefs bench --replay.
+ *
+ * A trace is a header record followed by one record per btree update; the
+ * updates of a single transaction commit are contiguous, and the first has
+ * BTREE_TRACE_FIRST set. The header may be repeated, e.g. when traces are
+ * concatenated - readers should skip records with the header magic.
+ */
+
+#define BTREE_TRACE_MAGIC	0xbcac7ace5a1f0001ULL
+#define BTREE_TRACE_VERSION	1
+
+#define BTREE_TRACE_OPS()	\
+	x(insert)		\
+	x(overwrite)		\
+	x(delete)
+
+enum btree_trace_op {
+#define x(n)	BTREE_TRACE_##n,
+	BTREE_TRACE_OPS()
+#undef x
+	BTREE_TRACE_OP_NR,
+};
+
+#define BTREE_TRACE_FIRST	(1U << 0)
+#define BTREE_TRACE_CACHED	(1U << 1)
+
+struct btree_trace_entry {
+	/* nanoseconds since tracing started: */
+	__le64			time;
+	__le64			inode;
+	__le64			offset;
+	__le32			snapshot;
+	/* index into bch2_btree_transaction_fns, for the kernel that took the trace */
+	__le16			trans_fn;
+	__u8			btree_id;
+	__u8			level;
+	__u8			op;
+	__u8			flags;
+	/* size of the new key, and of the key it overwrote: */
+	__le16			u64s;
+	__le16			old_u64s;
+	__u8			key_type;
+	__u8			pad;
+} __packed __aligned(8);
+
+struct btree_trace_header {
+	__le64			magic;
+	__le32			version;
+	__le32			entry_size;
+	/* updates dropped because the buffer was full, since the last read: */
+	__le64			dropped;
+	__le64			pad[2];
+} __packed __aligned(8);
+
+#endif /* _BCACHEFS_BTREE_TRACE_FORMAT_H */
@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_BTREE_TRACE_TYPES_H
+#define _BCACHEFS_BTREE_TRACE_TYPES_H
+
+#include "btree_trace_format.h"
+#include "fifo.h"
+
+/* 40 bytes per entry, 2.5MB: */
+#define BTREE_TRACE_ENTRIES	(1U << 16)
+
+struct bch_btree_trace {
+	spinlock_t		lock;
+	/* allocated when btree_trace is first enabled: */
+	DECLARE_FIFO(struct btree_trace_entry, entries);
+	u64			start_time;
+	u64			dropped;
+};
+
+#endif /* _BCACHEFS_BTREE_TRACE_TYPES_H */
@@ -7,16 +7,19 @@
 #include "btree_iter.h"
 #include "btree_journal_iter.h"
 #include "btree_key_cache.h"
+#include "btree_trace.h"
 #include "btree_update_interior.h"
 #include "btree_write_buffer.h"
 #include "buckets.h"
 #include "disk_accounting.h"
 #include "errcode.h"
 #include "error.h"
+#include "io_attrib.h"
 #include "journal.h"
 #include "journal_io.h"
 #include "journal_reclaim.h"
 #include "replicas.h"
+#include "slow_ops.h"
 #include "snapshot.h"
 
 #include <linux/prefetch.h>
@@ -114,6 +117,17 @@ static noinline int trans_lock_write_fail(struct btree_trans *trans, struct btre
 	return btree_trans_restart(trans, BCH_ERR_transaction_restart_would_deadlock_write);
 }
 
+/*
+ * Note that there's no point combining commits to the same leaf here: we
+ * already hold an intent lock on every node we're updating, and intent locks
+ * exclude each other, so at most one transaction can be committing to a given
+ * leaf at a time - contention between transactions updating the same leaf is
+ * on the intent lock, taken at traverse time, not the write lock.
+ *
+ * Updates that don't need to be read back within the transaction can avoid
+ * that contention by going through the btree write buffer, which is where
+ * commits are batched into a single locked insert per leaf:
+ */
 static inline int bch2_trans_lock_write(struct btree_trans *trans)
 {
 	EBUG_ON(trans->write_locked);
@@ -370,7 +384,7 @@ static noinline void journal_transaction_name(struct btree_trans *trans)
 static inline int btree_key_can_insert(struct btree_trans *trans,
 				       struct btree *b, unsigned u64s)
 {
-	if (!bch2_btree_node_insert_fits(b, u64s))
+	if (!bch2_btree_node_insert_fits(trans->c, b, u64s))
 		return -BCH_ERR_btree_insert_btree_node_full;
 
 	return 0;
@@ -408,6 +422,8 @@ btree_key_can_insert_cached_slowpath(struct btree_trans *trans, unsigned flags,
 			i->old_v = &new_k->v;
 
 	kfree(ck->k);
+	atomic_long_add((new_u64s - ck->u64s) * sizeof(u64),
+			&trans->c->btree_key_cache.nr_bytes[ck->key.btree_id]);
 	ck->u64s	= new_u64s;
 	ck->k		= new_k;
 	return 0;
@@ -569,6 +585,20 @@ static int bch2_trans_commit_run_triggers(struct btree_trans *trans)
 		       trans->updates[btree_id_start].btree_id < btree_id)
 			btree_id_start++;
 
+		/*
+		 * Updates are sorted by btree, and triggers only add updates to
+		 * btrees we haven't reached yet: skip straight to the next
+		 * btree that has updates, most transactions only touch one or
+		 * two:
+		 */
+		if (btree_id_start == trans->nr_updates)
+			break;
+
+		if (trans->updates[btree_id_start].btree_id > btree_id) {
+			btree_id = trans->updates[btree_id_start].btree_id - 1;
+			continue;
+		}
+
 		ret = run_btree_triggers(trans, btree_id, btree_id_start);
 		if (ret)
 			return ret;
@@ -671,6 +701,9 @@ bch2_trans_commit_write_locked(struct btree_trans *trans, unsigned flags,
 		if (ret)
 			return ret;
 
+		bch2_io_attrib_add(c, BCH_IO_ATTRIB_journal,
+				   trans->journal_u64s * sizeof(u64));
+
 		if (unlikely(trans->journal_transaction_names))
 			journal_transaction_name(trans);
 	}
@@ -700,26 +733,33 @@ bch2_trans_commit_write_locked(struct btree_trans *trans, unsigned flags,
 
 	struct jset_entry *entry = trans->journal_entries;
 
+	/*
+	 * Single key updates - inode updates, key cache updates to alloc keys -
+	 * usually have no accounting and no disk usage change, and we don't
+	 * want to take mark_lock twice for nothing:
+	 */
 	if (likely(!(flags & BCH_TRANS_COMMIT_skip_accounting_apply))) {
-		percpu_down_read(&c->mark_lock);
-
-		for (entry = trans->journal_entries;
-		     entry != (void *) ((u64 *) trans->journal_entries + trans->journal_entries_u64s);
-		     entry = vstruct_next(entry))
-			if (jset_entry_is_key(entry) && entry->start->k.type == KEY_TYPE_accounting) {
-				struct bkey_i_accounting *a = bkey_i_to_accounting(entry->start);
-
-				a->k.version = journal_pos_to_bversion(&trans->journal_res,
-								(u64 *) entry - (u64 *) trans->journal_entries);
-				BUG_ON(bversion_zero(a->k.version));
-				ret = bch2_accounting_mem_mod_locked(trans, accounting_i_to_s_c(a), false);
-				if (ret)
-					goto revert_fs_usage;
-			}
-		percpu_up_read(&c->mark_lock);
+		if (trans->journal_entries_u64s) {
+			percpu_down_read(&c->mark_lock);
+
+			for (entry = trans->journal_entries;
+			     entry != (void *) ((u64 *) trans->journal_entries + trans->journal_entries_u64s);
+			     entry = vstruct_next(entry))
+				if (jset_entry_is_key(entry) && entry->start->k.type == KEY_TYPE_accounting) {
+					struct bkey_i_accounting *a = bkey_i_to_accounting(entry->start);
+
+					a->k.version = journal_pos_to_bversion(&trans->journal_res,
+									(u64 *) entry - (u64 *) trans->journal_entries);
+					BUG_ON(bversion_zero(a->k.version));
+					ret = bch2_accounting_mem_mod_locked(trans, accounting_i_to_s_c(a), false);
+					if (ret)
+						goto revert_fs_usage;
+				}
+			percpu_up_read(&c->mark_lock);
+		}
 
-		/* XXX: we only want to run this if deltas are nonzero */
-		bch2_trans_account_disk_usage_change(trans);
+		if (memchr_inv(&trans->fs_usage_delta, 0, sizeof(trans->fs_usage_delta)))
+			bch2_trans_account_disk_usage_change(trans);
 	}
 
 	trans_for_each_update(trans, i)
@@ -941,6 +981,7 @@ int bch2_trans_commit_error(struct btree_trans *trans, unsigned flags,
 {
 	struct bch_fs *c = trans->c;
 	enum bch_watermark watermark = flags & BCH_WATERMARK_MASK;
+	u64 wait_start;
 
 	switch (ret) {
 	case -BCH_ERR_btree_insert_btree_node_full:
@@ -964,18 +1005,24 @@ int bch2_trans_commit_error(struct btree_trans *trans, unsigned flags,
 			break;
 		}
 
+		wait_start = local_clock();
 		ret = drop_locks_do(trans,
 			bch2_trans_journal_res_get(trans,
 					(flags & BCH_WATERMARK_MASK)|
 					JOURNAL_RES_GET_CHECK));
+		bch2_slow_op_phase_add(&trans->phase_ns[BCH_TRANS_PHASE_journal_res],
+				       &wait_start);
 		break;
 	case -BCH_ERR_btree_insert_need_journal_reclaim:
 		bch2_trans_unlock(trans);
 
 		trace_and_count(c, trans_blocked_journal_reclaim, trans, trace_ip);
 
+		wait_start = local_clock();
 		wait_event_freezable(c->journal.reclaim_wait,
 				     (ret = journal_reclaim_wait_done(c)));
+		bch2_slow_op_phase_add(&trans->phase_ns[BCH_TRANS_PHASE_journal_res],
+				       &wait_start);
 		if (ret < 0)
 			break;
 
@@ -1162,6 +1209,7 @@ retry:
 		goto err;
 
 	trace_and_count(c, transaction_commit, trans, _RET_IP_);
+	bch2_btree_trace_commit(trans);
 out:
 	if (likely(!(flags & BCH_TRANS_COMMIT_no_check_rw)))
 		bch2_write_ref_put(c, BCH_WRITE_REF_trans);
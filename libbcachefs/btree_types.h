@@ -13,6 +13,7 @@
 #include "journal_types.h"
 #include "replicas_types.h"
 #include "six.h"
+#include "slow_ops_types.h"
 
 struct open_bucket;
 struct btree_update;
@@ -69,6 +70,27 @@ struct btree_bkey_cached_common {
 	bool			cached;
 };
 
+/*
+ * Precomputed per-format unpack: where each field lives in the packed key, so
+ * that fields can be extracted independently and without branches - see
+ * bch2_bkey_unpack_plan_init():
+ */
+struct bkey_unpack_field {
+	u8			hi;		/* word holding the field's top bit */
+	u8			lo;		/* next word, if the field spans two */
+	u8			shift;		/* bit position of the top bit in @hi */
+	u8			rshift;		/* 64 - bits */
+	u8			spans;
+	u8			nonzero;
+};
+
+struct bkey_unpack_plan {
+	struct bkey_unpack_field f[BKEY_NR_FIELDS];
+};
+
+#define BTREE_NODE_INODE_FILTER_SHIFT	10
+#define BTREE_NODE_INODE_FILTER_BITS	(1U << BTREE_NODE_INODE_FILTER_SHIFT)
+
 struct btree {
 	struct btree_bkey_cached_common c;
 
@@ -82,10 +104,17 @@ struct btree {
 	u16			version_ondisk;
 
 	struct bkey_format	format;
+	struct bkey_unpack_plan	unpack_plan;
 
 	struct btree_node	*data;
 	void			*aux_data;
 
+	/*
+	 * Bloom filter of inode numbers of keys in this node, for leaf nodes
+	 * of btrees indexed by inode: see bch2_btree_node_may_have_inode()
+	 */
+	unsigned long		inode_filter[BTREE_NODE_INODE_FILTER_BITS / BITS_PER_LONG];
+
 	/*
 	 * Sets of sorted keys - the real btree node - plus a binary search tree
 	 *
@@ -138,6 +167,11 @@ struct btree {
 	struct list_head	list;
 };
 
+struct btree_cache_lookups {
+	u64			hit[BTREE_ID_NR][BTREE_MAX_DEPTH];
+	u64			miss[BTREE_ID_NR][BTREE_MAX_DEPTH];
+};
+
 struct btree_cache {
 	struct rhashtable	table;
 	bool			table_init_done;
@@ -173,10 +207,14 @@ struct btree_cache {
 	unsigned		not_freed_write_blocked;
 	unsigned		not_freed_will_make_reachable;
 	unsigned		not_freed_access_bit;
+	unsigned		not_freed_interior;
 	atomic_t		dirty;
 	struct shrinker		*shrink;
 
 	unsigned		used_by_btree[BTREE_ID_NR];
+	unsigned		used_by_level[BTREE_MAX_DEPTH];
+
+	struct btree_cache_lookups __percpu *lookups;
 
 	/*
 	 * If we need to allocate memory for a new btree node and that
@@ -191,6 +229,28 @@ struct btree_cache {
 	struct bbpos		pinned_nodes_end;
 	u64			pinned_nodes_leaf_mask;
 	u64			pinned_nodes_interior_mask;
+
+	/*
+	 * Second tier: clean nodes evicted by the shrinker are kept here lz4
+	 * compressed (if the btree_cache_compressed option is set), and
+	 * decompressed instead of reread on the next fill. Protected by @lock:
+	 */
+	struct rhashtable	compressed_table;
+	bool			compressed_table_init_done;
+	struct list_head	compressed;
+
+#ifndef __KERNEL__
+	/* btree node buffers, carved out of hugepage backed chunks: */
+	struct mutex		arena_lock;
+	DARRAY(void *)		arena_free;
+	DARRAY(void *)		arena_chunks;
+#endif
+	size_t			compressed_nr;
+	size_t			compressed_bytes;
+	unsigned		compressed_hits;
+	void			*compress_buf;
+	void			*compress_workspace;
+	struct shrinker		*compressed_shrink;
 };
 
 struct btree_node_iter {
@@ -315,14 +375,15 @@ struct btree_path {
 	unsigned		level:3,
 				locks_want:3;
 	u8			nodes_locked;
+	/* BTREE_ITER_prefetch: current leaf readahead window, in nodes */
+	u8			readahead;
 
 	struct btree_path_level {
 		struct btree	*b;
 		struct btree_node_iter iter;
 		u32		lock_seq;
-#ifdef CONFIG_BCACHEFS_LOCK_TIME_STATS
+		/* with CONFIG_BCACHEFS_LOCK_TIME_STATS or lock_profiling: */
 		u64             lock_taken_time;
-#endif
 	}			l[BTREE_MAX_DEPTH];
 #ifdef TRACK_PATH_ALLOCATED
 	unsigned long		ip_allocated;
@@ -334,6 +395,15 @@ static inline struct btree_path_level *path_l(struct btree_path *path)
 	return path->l + path->level;
 }
 
+/*
+ * A path doing a BTREE_ITER_prefetch scan that has ramped up leaf readahead,
+ * i.e. that has walked across several leaves in order:
+ */
+static inline bool btree_path_scanning(const struct btree_path *path)
+{
+	return path->readahead > 2;
+}
+
 static inline unsigned long btree_path_ip_allocated(struct btree_path *path)
 {
 #ifdef TRACK_PATH_ALLOCATED
@@ -488,6 +558,7 @@ struct btree_trans {
 	bool			used_mempool:1;
 	bool			in_traverse_all:1;
 	bool			paths_sorted:1;
+	bool			paths_warm:1;
 	bool			memory_allocation_failure:1;
 	bool			journal_transaction_names:1;
 	bool			journal_replay_not_finished:1;
@@ -501,6 +572,10 @@ struct btree_trans {
 	unsigned long		last_unlock_ip;
 	unsigned long		srcu_lock_time;
 
+	/* slow op accounting: */
+	u64			start_time;
+	u64			phase_ns[BCH_TRANS_PHASE_NR];
+
 	const char		*fn;
 	struct btree_bkey_cached_common *locking;
 	struct six_lock_waiter	locking_wait;
@@ -583,7 +658,9 @@ enum btree_write_type {
 	x(dying)							\
 	x(fake)								\
 	x(need_rewrite)							\
-	x(never_write)
+	x(never_write)							\
+	x(aux_tree_lazy)						\
+	x(aux_tree_building)
 
 enum btree_flags {
 	/* First bits for btree node write type */
@@ -747,7 +824,8 @@ const char *bch2_btree_node_type_str(enum btree_node_type);
 	 BIT_ULL(BKEY_TYPE_btree))
 
 #define BTREE_NODE_TYPE_HAS_ATOMIC_TRIGGERS		\
-	(BIT_ULL(BKEY_TYPE_alloc)|			\
+	(BIT_ULL(BKEY_TYPE_extents)|			\
+	 BIT_ULL(BKEY_TYPE_alloc)|			\
 	 BIT_ULL(BKEY_TYPE_inodes)|			\
 	 BIT_ULL(BKEY_TYPE_stripes)|			\
 	 BIT_ULL(BKEY_TYPE_snapshots))
@@ -820,6 +898,17 @@ static inline bool btree_type_has_ptrs(enum btree_id id)
 	return BIT_ULL(id) & mask;
 }
 
+static inline bool btree_id_small_nodes(enum btree_id id)
+{
+	const u64 mask = 0
+#define x(name, nr, flags, ...)	|((!!((flags) & BTREE_ID_SMALL_NODES)) << nr)
+	BCH_BTREE_IDS()
+#undef x
+	;
+
+	return BIT_ULL(id) & mask;
+}
+
 struct btree_root {
 	struct btree		*b;
 
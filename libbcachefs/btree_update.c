@@ -591,8 +591,12 @@ int bch2_bkey_get_empty_slot(struct btree_trans *trans, struct btree_iter *iter,
 	struct bkey_s_c k;
 	int ret = 0;
 
-	bch2_trans_iter_init(trans, iter, btree, POS_MAX, BTREE_ITER_intent);
-	k = bch2_btree_iter_prev(iter);
+	/*
+	 * Search back from @end, not POS_MAX: btrees may keep other keys past
+	 * the range slots are allocated from
+	 */
+	bch2_trans_iter_init(trans, iter, btree, end, BTREE_ITER_intent);
+	k = bch2_btree_iter_peek_prev(iter);
 	ret = bkey_err(k);
 	if (ret)
 		goto err;
@@ -616,6 +620,22 @@ err:
 	return ret;
 }
 
+/*
+ * Inode field of the last key in @btree, for splitting a btree walk into
+ * ranges: U64_MAX if unknown
+ */
+u64 bch2_btree_last_inum(struct btree_trans *trans, enum btree_id btree)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k;
+
+	bch2_trans_iter_init(trans, &iter, btree, SPOS_MAX, BTREE_ITER_all_snapshots);
+	int ret = lockrestart_do(trans, bkey_err(k = bch2_btree_iter_peek_prev(&iter)));
+	u64 inum = !ret && k.k ? k.k->p.inode : U64_MAX;
+	bch2_trans_iter_exit(trans, &iter);
+	return inum;
+}
+
 void bch2_trans_commit_hook(struct btree_trans *trans,
 			    struct btree_trans_commit_hook *h)
 {
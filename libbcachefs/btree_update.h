@@ -103,6 +103,7 @@ int bch2_trans_update_extent_overwrite(struct btree_trans *, struct btree_iter *
 
 int bch2_bkey_get_empty_slot(struct btree_trans *, struct btree_iter *,
 			     enum btree_id, struct bpos);
+u64 bch2_btree_last_inum(struct btree_trans *, enum btree_id);
 
 int __must_check bch2_trans_update(struct btree_trans *, struct btree_iter *,
 				   struct bkey_i *, enum btree_iter_update_trigger_flags);
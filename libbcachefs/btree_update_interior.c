@@ -267,7 +267,7 @@ static void bch2_btree_node_free_never_used(struct btree_update *as,
 					    struct btree *b)
 {
 	struct bch_fs *c = as->c;
-	struct prealloc_nodes *p = &as->prealloc_nodes[b->c.lock.readers != NULL];
+	struct prealloc_nodes *p = &as->prealloc_nodes[!!b->c.level];
 	struct btree_path *path;
 	unsigned i, level = b->c.level;
 
@@ -302,7 +302,7 @@ static void bch2_btree_node_free_never_used(struct btree_update *as,
 static struct btree *__bch2_btree_node_alloc(struct btree_trans *trans,
 					     struct disk_reservation *res,
 					     struct closure *cl,
-					     bool interior_node,
+					     bool pcpu_read_locks,
 					     unsigned flags)
 {
 	struct bch_fs *c = trans->c;
@@ -361,7 +361,7 @@ retry:
 	bch2_open_bucket_get(c, wp, &obs);
 	bch2_alloc_sectors_done(c, wp);
 mem_alloc:
-	b = bch2_btree_node_mem_alloc(trans, interior_node);
+	b = bch2_btree_node_mem_alloc(trans, pcpu_read_locks);
 	six_unlock_write(&b->c.lock);
 	six_unlock_intent(&b->c.lock);
 
@@ -545,7 +545,8 @@ static int bch2_btree_reserve_get(struct btree_trans *trans,
 
 		while (p->nr < nr_nodes[interior]) {
 			b = __bch2_btree_node_alloc(trans, &as->disk_res, cl,
-						    interior, flags);
+					btree_node_pcpu_read_locks(as->btree_id, interior),
+					flags);
 			if (IS_ERR(b)) {
 				ret = PTR_ERR(b);
 				goto err;
@@ -833,7 +834,7 @@ err:
 	}
 
 	for (i = 0; i < as->nr_open_buckets; i++)
-		bch2_open_bucket_put(c, c->open_buckets + as->open_buckets[i]);
+		bch2_open_bucket_put(c, ob_from_idx(c, as->open_buckets[i]));
 
 	bch2_btree_update_free(as, trans);
 	bch2_trans_put(trans);
@@ -1185,11 +1186,12 @@ bch2_btree_update_start(struct btree_trans *trans, struct btree_path *path,
 		 * Always check for space for two keys, even if we won't have to
 		 * split at prior level - it might have been a merge instead:
 		 */
-		if (bch2_btree_node_insert_fits(path->l[level_end].b,
+		if (bch2_btree_node_insert_fits(c, path->l[level_end].b,
 						BKEY_BTREE_PTR_U64s_MAX * 2))
 			break;
 
-		split = path->l[level_end].b->nr.live_u64s > BTREE_SPLIT_THRESHOLD(c);
+		split = path->l[level_end].b->nr.live_u64s >
+			BTREE_NODE_SPLIT_THRESHOLD(c, path->l[level_end].b);
 	}
 
 	if (!down_read_trylock(&c->gc_lock)) {
@@ -1439,10 +1441,29 @@ bch2_btree_insert_keys_interior(struct btree_update *as,
  * Move keys from n1 (original replacement node, now lower node) to n2 (higher
  * node)
  */
+/*
+ * Sequential ingest inserts past the last key in a leaf: splitting such a node
+ * down the middle leaves behind a node that's only ever going to be 60% full,
+ * and means twice as many splits - and interior node updates - as necessary.
+ * So when the insert that's forcing the split is an append, the new left node
+ * gets most of the keys:
+ */
+static bool btree_split_is_append(struct btree_path *path, struct btree *b)
+{
+	struct btree_node_iter iter;
+
+	if (b->c.level)
+		return false;
+
+	bch2_btree_node_iter_init(&iter, b, &path->pos);
+	return !bch2_btree_node_iter_peek(&iter, b);
+}
+
 static void __btree_split_node(struct btree_update *as,
 			       struct btree_trans *trans,
 			       struct btree *b,
-			       struct btree *n[2])
+			       struct btree *n[2],
+			       bool append)
 {
 	struct bkey_packed *k;
 	struct bpos n1_pos = POS_MIN;
@@ -1451,7 +1472,9 @@ static void __btree_split_node(struct btree_update *as,
 	struct bkey_format_state format[2];
 	struct bkey_packed *out[2];
 	struct bkey uk;
-	unsigned u64s, n1_u64s = (b->nr.live_u64s * 3) / 5;
+	unsigned u64s, n1_u64s = append
+		? (b->nr.live_u64s * 7) / 8
+		: (b->nr.live_u64s * 3) / 5;
 	struct { unsigned nr_keys, val_u64s; } nr_keys[2];
 	int i;
 
@@ -1596,7 +1619,7 @@ static int btree_split(struct btree_update *as, struct btree_trans *trans,
 
 	bch2_btree_interior_update_will_free_node(as, b);
 
-	if (b->nr.live_u64s > BTREE_SPLIT_THRESHOLD(c)) {
+	if (b->nr.live_u64s > BTREE_NODE_SPLIT_THRESHOLD(c, b)) {
 		struct btree *n[2];
 
 		trace_and_count(c, btree_node_split, trans, b);
@@ -1604,7 +1627,8 @@ static int btree_split(struct btree_update *as, struct btree_trans *trans,
 		n[0] = n1 = bch2_btree_node_alloc(as, trans, b->c.level);
 		n[1] = n2 = bch2_btree_node_alloc(as, trans, b->c.level);
 
-		__btree_split_node(as, trans, b, n);
+		__btree_split_node(as, trans, b, n,
+				   btree_split_is_append(trans->paths + path, b));
 
 		if (keys) {
 			btree_split_insert_keys(as, trans, path, n1, keys);
@@ -1789,7 +1813,7 @@ static int bch2_btree_insert_node(struct btree_update *as, struct btree_trans *t
 
 	bch2_btree_node_prep_for_write(trans, path, b);
 
-	if (!bch2_btree_node_insert_fits(b, bch2_keylist_u64s(keys))) {
+	if (!bch2_btree_node_insert_fits(c, b, bch2_keylist_u64s(keys))) {
 		bch2_btree_node_unlock_write(trans, path, b);
 		goto split;
 	}
@@ -2031,17 +2055,17 @@ int __bch2_foreground_maybe_merge(struct btree_trans *trans,
 	sib_u64s = btree_node_u64s_with_format(b->nr, &b->format, &new_f) +
 		btree_node_u64s_with_format(m->nr, &m->format, &new_f);
 
-	if (sib_u64s > BTREE_FOREGROUND_MERGE_HYSTERESIS(c)) {
-		sib_u64s -= BTREE_FOREGROUND_MERGE_HYSTERESIS(c);
+	if (sib_u64s > BTREE_NODE_FOREGROUND_MERGE_HYSTERESIS(c, b)) {
+		sib_u64s -= BTREE_NODE_FOREGROUND_MERGE_HYSTERESIS(c, b);
 		sib_u64s /= 2;
-		sib_u64s += BTREE_FOREGROUND_MERGE_HYSTERESIS(c);
+		sib_u64s += BTREE_NODE_FOREGROUND_MERGE_HYSTERESIS(c, b);
 	}
 
 	sib_u64s = min(sib_u64s, btree_max_u64s(c));
 	sib_u64s = min(sib_u64s, (size_t) U16_MAX - 1);
 	b->sib_u64s[sib] = sib_u64s;
 
-	if (b->sib_u64s[sib] > c->btree_foreground_merge_threshold)
+	if (b->sib_u64s[sib] > btree_node_foreground_merge_threshold(c, b))
 		goto out;
 
 	parent = btree_node_parent(trans->paths + path, b);
@@ -148,7 +148,7 @@ static inline int bch2_foreground_maybe_merge_sibling(struct btree_trans *trans,
 		return 0;
 
 	b = path->l[level].b;
-	if (b->sib_u64s[sib] > trans->c->btree_foreground_merge_threshold)
+	if (b->sib_u64s[sib] > btree_node_foreground_merge_threshold(trans->c, b))
 		return 0;
 
 	return __bch2_foreground_maybe_merge(trans, path_idx, level, flags, sib);
@@ -316,11 +316,16 @@ static inline void push_whiteout(struct btree *b, struct bpos pos)
  * write lock must be held on @b (else the dirty bset that we were going to
  * insert into could be written out from under us)
  */
-static inline bool bch2_btree_node_insert_fits(struct btree *b, unsigned u64s)
+static inline bool bch2_btree_node_insert_fits(struct bch_fs *c, struct btree *b,
+					       unsigned u64s)
 {
 	if (unlikely(btree_node_need_rewrite(b)))
 		return false;
 
+	if (unlikely(btree_node_small(c, b)) &&
+	    b->nr.live_u64s + u64s > btree_node_max_u64s(c, b))
+		return false;
+
 	return u64s <= bch2_btree_keys_u64s_remaining(b);
 }
 
@@ -114,6 +114,57 @@ static noinline void wb_sort(struct wb_key_ref *base, size_t num)
 	}
 }
 
+static inline unsigned wb_key_ref_digit(const struct wb_key_ref *k, unsigned d)
+{
+	/* skip idx, the low 24 bits: */
+	d += 3;
+
+	u64 w = d < 8 ? k->lo : d < 16 ? k->mi : k->hi;
+	return (w >> ((d & 7) * 8)) & 0xff;
+}
+
+/*
+ * LSD radix sort, one byte per pass, on everything above idx: wb_key_refs are
+ * built in idx order and each pass is stable, so this gives exactly the same
+ * order as wb_sort().
+ *
+ * Histograms for every digit are computed in a single pass up front, which
+ * lets us skip digits that are the same in every key - the btree id when
+ * flushing a single btree, high bytes of inode numbers, snapshot ids.
+ */
+static noinline void wb_sort_radix(struct btree_write_buffer *wb,
+				   struct wb_key_ref *base, size_t nr)
+{
+	struct wb_key_ref *src = base, *dst = wb->sorted_tmp.data;
+
+	memset(wb->sort_hist, 0, sizeof(wb->sort_hist));
+
+	for (struct wb_key_ref *i = base; i < base + nr; i++)
+		for (unsigned d = 0; d < WB_SORT_RADIX_DIGITS; d++)
+			wb->sort_hist[d][wb_key_ref_digit(i, d)]++;
+
+	for (unsigned d = 0; d < WB_SORT_RADIX_DIGITS; d++) {
+		u32 *h = wb->sort_hist[d], sum = 0;
+
+		if (h[wb_key_ref_digit(src, d)] == nr)
+			continue;
+
+		for (unsigned j = 0; j < 256; j++) {
+			u32 t = h[j];
+			h[j] = sum;
+			sum += t;
+		}
+
+		for (struct wb_key_ref *i = src; i < src + nr; i++)
+			dst[h[wb_key_ref_digit(i, d)]++] = *i;
+
+		swap(src, dst);
+	}
+
+	if (src != base)
+		memcpy(base, src, sizeof(*base) * nr);
+}
+
 static noinline int wb_flush_one_slowpath(struct btree_trans *trans,
 					  struct btree_iter *iter,
 					  struct btree_write_buffered_key *wb)
@@ -178,7 +229,7 @@ static inline int wb_flush_one(struct btree_trans *trans, struct btree_iter *ite
 		*write_locked = true;
 	}
 
-	if (unlikely(!bch2_btree_node_insert_fits(path->l[0].b, wb->k.k.u64s))) {
+	if (unlikely(!bch2_btree_node_insert_fits(trans->c, path->l[0].b, wb->k.k.u64s))) {
 		*write_locked = false;
 		return wb_flush_one_slowpath(trans, iter, wb);
 	}
@@ -230,6 +281,7 @@ static void move_keys_from_inc_to_flushing(struct btree_write_buffer *wb)
 
 	darray_resize(&wb->flushing.keys, min_t(size_t, 1U << 20, wb->flushing.keys.nr + wb->inc.keys.nr));
 	darray_resize(&wb->sorted, wb->flushing.keys.size);
+	darray_resize(&wb->sorted_tmp, wb->flushing.keys.size);
 
 	if (!wb->flushing.keys.nr && wb->sorted.size >= wb->inc.keys.nr) {
 		swap(wb->flushing.keys, wb->inc.keys);
@@ -266,62 +318,38 @@ out:
 	BUG_ON(wb->sorted.size < wb->flushing.keys.nr);
 }
 
-static int bch2_btree_write_buffer_flush_locked(struct btree_trans *trans)
+/*
+ * Fast path: insert directly into leaf nodes, in sorted order, skipping keys
+ * that were overwritten later in the same flush. Keys we can't insert without
+ * potentially blocking on the journal are left for the slowpath:
+ */
+static int wb_flush_part(struct btree_trans *trans,
+			 struct btree_write_buffer_flush_part *p)
 {
 	struct bch_fs *c = trans->c;
-	struct journal *j = &c->journal;
 	struct btree_write_buffer *wb = &c->btree_write_buffer;
 	struct btree_iter iter = { NULL };
-	size_t overwritten = 0, fast = 0, slowpath = 0, could_not_insert = 0;
 	bool write_locked = false;
 	bool accounting_replay_done = test_bit(BCH_FS_accounting_replay_done, &c->flags);
 	int ret = 0;
 
-	bch2_trans_unlock(trans);
 	bch2_trans_begin(trans);
 
-	mutex_lock(&wb->inc.lock);
-	move_keys_from_inc_to_flushing(wb);
-	mutex_unlock(&wb->inc.lock);
-
-	for (size_t i = 0; i < wb->flushing.keys.nr; i++) {
-		wb->sorted.data[i].idx = i;
-		wb->sorted.data[i].btree = wb->flushing.keys.data[i].btree;
-		memcpy(&wb->sorted.data[i].pos, &wb->flushing.keys.data[i].k.k.p, sizeof(struct bpos));
-	}
-	wb->sorted.nr = wb->flushing.keys.nr;
-
-	/*
-	 * We first sort so that we can detect and skip redundant updates, and
-	 * then we attempt to flush in sorted btree order, as this is most
-	 * efficient.
-	 *
-	 * However, since we're not flushing in the order they appear in the
-	 * journal we won't be able to drop our journal pin until everything is
-	 * flushed - which means this could deadlock the journal if we weren't
-	 * passing BCH_TRANS_COMMIT_journal_reclaim. This causes the update to fail
-	 * if it would block taking a journal reservation.
-	 *
-	 * If that happens, simply skip the key so we can optimistically insert
-	 * as many keys as possible in the fast path.
-	 */
-	wb_sort(wb->sorted.data, wb->sorted.nr);
-
-	darray_for_each(wb->sorted, i) {
+	for (struct wb_key_ref *i = p->start; i < p->end; i++) {
 		struct btree_write_buffered_key *k = &wb->flushing.keys.data[i->idx];
 
-		for (struct wb_key_ref *n = i + 1; n < min(i + 4, &darray_top(wb->sorted)); n++)
+		for (struct wb_key_ref *n = i + 1; n < min(i + 4, p->end); n++)
 			prefetch(&wb->flushing.keys.data[n->idx]);
 
 		BUG_ON(!k->journal_seq);
 
 		if (!accounting_replay_done &&
 		    k->k.k.type == KEY_TYPE_accounting) {
-			slowpath++;
+			p->slowpath++;
 			continue;
 		}
 
-		if (i + 1 < &darray_top(wb->sorted) &&
+		if (i + 1 < p->end &&
 		    wb_key_eq(i, i + 1)) {
 			struct btree_write_buffered_key *n = &wb->flushing.keys.data[i[1].idx];
 
@@ -330,7 +358,7 @@ static int bch2_btree_write_buffer_flush_locked(struct btree_trans *trans)
 				bch2_accounting_accumulate(bkey_i_to_accounting(&n->k),
 							   bkey_i_to_s_c_accounting(&k->k));
 
-			overwritten++;
+			p->overwritten++;
 			n->journal_seq = min_t(u64, n->journal_seq, k->journal_seq);
 			k->journal_seq = 0;
 			continue;
@@ -352,7 +380,7 @@ static int bch2_btree_write_buffer_flush_locked(struct btree_trans *trans)
 							BCH_TRANS_COMMIT_no_check_rw|
 							BCH_TRANS_COMMIT_no_enospc));
 				if (ret)
-					goto err;
+					goto out;
 			}
 		}
 
@@ -373,7 +401,7 @@ static int bch2_btree_write_buffer_flush_locked(struct btree_trans *trans)
 			}
 
 			ret = wb_flush_one(trans, &iter, k, &write_locked,
-					   &accounting_accumulated, &fast);
+					   &accounting_accumulated, &p->fast);
 			if (!write_locked)
 				bch2_trans_begin(trans);
 		} while (bch2_err_matches(ret, BCH_ERR_transaction_restart));
@@ -381,7 +409,7 @@ static int bch2_btree_write_buffer_flush_locked(struct btree_trans *trans)
 		if (!ret) {
 			k->journal_seq = 0;
 		} else if (ret == -BCH_ERR_journal_reclaim_would_deadlock) {
-			slowpath++;
+			p->slowpath++;
 			ret = 0;
 		} else
 			break;
@@ -391,8 +419,124 @@ static int bch2_btree_write_buffer_flush_locked(struct btree_trans *trans)
 		struct btree_path *path = btree_iter_path(trans, &iter);
 		bch2_btree_node_unlock_write(trans, path, path->l[0].b);
 	}
+out:
 	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+static CLOSURE_CALLBACK(wb_flush_part_work)
+{
+	closure_type(p, struct btree_write_buffer_flush_part, cl);
+
+	p->ret = bch2_trans_run(p->c, wb_flush_part(trans, p));
+	closure_return(cl);
+}
+
+/* Partitions smaller than this aren't worth handing off to another thread: */
+#define WB_FLUSH_PARALLEL_MIN		512
+
+static int wb_flush_sorted(struct btree_trans *trans,
+			   size_t *overwritten, size_t *fast, size_t *slowpath)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+	struct btree_write_buffer_flush_part *p;
+	struct wb_key_ref *i = wb->sorted.data;
+	unsigned nr_parts = 0, nr_async = 0;
+	struct closure cl;
+	int ret = 0;
+
+	closure_init_stack(&cl);
+
+	while (i < &darray_top(wb->sorted)) {
+		struct wb_key_ref *end = i;
+
+		while (end < &darray_top(wb->sorted) && end->btree == i->btree)
+			end++;
+
+		BUG_ON(nr_parts >= ARRAY_SIZE(wb->parts));
+		p = wb->parts + nr_parts++;
+		memset(p, 0, sizeof(*p));
+		p->c		= c;
+		p->start	= i;
+		p->end		= end;
+		i = end;
+	}
+
+	/*
+	 * The calling thread does the first partition and all the small ones,
+	 * other large partitions get their own thread:
+	 */
+	for (p = wb->parts; p < wb->parts + nr_parts; p++)
+		if (p != wb->parts &&
+		    p->end - p->start >= WB_FLUSH_PARALLEL_MIN) {
+			closure_call(&p->cl, wb_flush_part_work, system_unbound_wq, &cl);
+			nr_async++;
+		}
+
+	for (p = wb->parts; p < wb->parts + nr_parts; p++)
+		if (p == wb->parts ||
+		    p->end - p->start < WB_FLUSH_PARALLEL_MIN)
+			p->ret = wb_flush_part(trans, p);
+
+	if (nr_async)
+		closure_sync(&cl);
+
+	for (p = wb->parts; p < wb->parts + nr_parts; p++) {
+		*overwritten	+= p->overwritten;
+		*fast		+= p->fast;
+		*slowpath	+= p->slowpath;
+		ret = ret ?: p->ret;
+	}
+
+	return ret;
+}
+
+static int bch2_btree_write_buffer_flush_locked(struct btree_trans *trans)
+{
+	struct bch_fs *c = trans->c;
+	struct journal *j = &c->journal;
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+	size_t overwritten = 0, fast = 0, slowpath = 0, could_not_insert = 0;
+	bool accounting_replay_done = test_bit(BCH_FS_accounting_replay_done, &c->flags);
+	int ret = 0;
+
+	bch2_trans_unlock(trans);
+	bch2_trans_begin(trans);
+
+	mutex_lock(&wb->inc.lock);
+	move_keys_from_inc_to_flushing(wb);
+	mutex_unlock(&wb->inc.lock);
+
+	for (size_t i = 0; i < wb->flushing.keys.nr; i++) {
+		wb->sorted.data[i].idx = i;
+		wb->sorted.data[i].btree = wb->flushing.keys.data[i].btree;
+		memcpy(&wb->sorted.data[i].pos, &wb->flushing.keys.data[i].k.k.p, sizeof(struct bpos));
+	}
+	wb->sorted.nr = wb->flushing.keys.nr;
+
+	/*
+	 * We first sort so that we can detect and skip redundant updates, and
+	 * then we attempt to flush in sorted btree order, as this is most
+	 * efficient.
+	 *
+	 * However, since we're not flushing in the order they appear in the
+	 * journal we won't be able to drop our journal pin until everything is
+	 * flushed - which means this could deadlock the journal if we weren't
+	 * passing BCH_TRANS_COMMIT_journal_reclaim. This causes the update to fail
+	 * if it would block taking a journal reservation.
+	 *
+	 * If that happens, simply skip the key so we can optimistically insert
+	 * as many keys as possible in the fast path.
+	 */
+	/* heapsort is as fast for small flushes, and needs no scratch space: */
+	if (wb->sorted.nr >= 512 &&
+	    wb->sorted_tmp.size >= wb->sorted.nr)
+		wb_sort_radix(wb, wb->sorted.data, wb->sorted.nr);
+	else
+		wb_sort(wb->sorted.data, wb->sorted.nr);
 
+	ret = wb_flush_sorted(trans, &overwritten, &fast, &slowpath);
 	if (ret)
 		goto err;
 
@@ -801,6 +945,7 @@ void bch2_fs_btree_write_buffer_exit(struct bch_fs *c)
 	       !bch2_journal_error(&c->journal));
 
 	darray_exit(&wb->accounting);
+	darray_exit(&wb->sorted_tmp);
 	darray_exit(&wb->sorted);
 	darray_exit(&wb->flushing.keys);
 	darray_exit(&wb->inc.keys);
@@ -2,6 +2,8 @@
 #ifndef _BCACHEFS_BTREE_WRITE_BUFFER_TYPES_H
 #define _BCACHEFS_BTREE_WRITE_BUFFER_TYPES_H
 
+#include <linux/closure.h>
+
 #include "darray.h"
 #include "journal_types.h"
 
@@ -47,8 +49,32 @@ struct btree_write_buffer_keys {
 	struct mutex			lock;
 };
 
+/*
+ * The sorted flush set, split by btree: updates to different btrees never
+ * conflict, so partitions can be flushed in parallel, each in its own
+ * transaction:
+ */
+struct btree_write_buffer_flush_part {
+	struct closure			cl;
+	struct bch_fs			*c;
+	struct wb_key_ref		*start;
+	struct wb_key_ref		*end;
+
+	size_t				overwritten;
+	size_t				fast;
+	size_t				slowpath;
+	int				ret;
+};
+
+/* Sort digits of a wb_key_ref, excluding idx: */
+#define WB_SORT_RADIX_DIGITS		(sizeof(struct wb_key_ref) - 3)
+
 struct btree_write_buffer {
 	DARRAY(struct wb_key_ref)	sorted;
+	/* scratch space and histograms for wb_sort_radix(): */
+	DARRAY(struct wb_key_ref)	sorted_tmp;
+	u32				sort_hist[WB_SORT_RADIX_DIGITS][256];
+	struct btree_write_buffer_flush_part parts[BTREE_ID_NR];
 	struct btree_write_buffer_keys	inc;
 	struct btree_write_buffer_keys	flushing;
 	struct work_struct		flush_work;
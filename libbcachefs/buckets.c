@@ -18,6 +18,7 @@
 #include "error.h"
 #include "inode.h"
 #include "movinggc.h"
+#include "nocow_locking.h"
 #include "recovery.h"
 #include "reflink.h"
 #include "replicas.h"
@@ -808,13 +809,24 @@ static int __trigger_extent(struct btree_trans *trans,
 			return ret;
 	}
 
-	if (bch2_bkey_rebalance_opts(k)) {
+	const struct bch_extent_rebalance *r = bch2_bkey_rebalance_opts(k);
+	if (r) {
 		struct disk_accounting_pos acc = {
 			.type		= BCH_DISK_ACCOUNTING_rebalance_work,
 		};
 		ret = bch2_disk_accounting_mod(trans, &acc, &replicas_sectors, 1, gc);
 		if (ret)
 			return ret;
+
+		if (r->target) {
+			struct disk_accounting_pos acc_target = {
+				.type		= BCH_DISK_ACCOUNTING_rebalance_work_target,
+				.rebalance_work_target.target = r->target,
+			};
+			ret = bch2_disk_accounting_mod(trans, &acc_target, &replicas_sectors, 1, gc);
+			if (ret)
+				return ret;
+		}
 	}
 
 	return 0;
@@ -856,6 +868,26 @@ int bch2_trigger_extent(struct btree_trans *trans,
 	if (flags & (BTREE_TRIGGER_transactional|BTREE_TRIGGER_gc))
 		return trigger_run_overwrite_then_insert(__trigger_extent, trans, btree, level, old, new, flags);
 
+	/*
+	 * Invalidate cached nocow extent mappings (see bch_nocow_extent_cache)
+	 * that point to the extent we're overwriting: this runs with the leaf
+	 * node write locked, before the new key is visible:
+	 */
+	if ((flags & BTREE_TRIGGER_atomic) &&
+	    btree == BTREE_ID_extents &&
+	    old.k->type == KEY_TYPE_extent) {
+		struct bch_fs *c = trans->c;
+
+		rcu_read_lock();
+		bkey_for_each_ptr(old_ptrs, ptr) {
+			struct bch_dev *ca = bch2_dev_rcu(c, ptr->dev);
+			if (ca)
+				bch2_bucket_nocow_seq_bump(&c->nocow_locks,
+							   PTR_BUCKET_POS(ca, ptr));
+		}
+		rcu_read_unlock();
+	}
+
 	return 0;
 }
 
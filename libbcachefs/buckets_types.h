@@ -35,6 +35,28 @@ struct bucket_gens {
 	u8			b[];
 };
 
+/*
+ * Summary of free buckets (buckets in the freespace btree) per device region,
+ * so the allocator can skip over regions with no free buckets: regions are
+ * 1 << BUCKET_FREE_REGION_SHIFT buckets, and groups of BUCKET_FREE_GROUP
+ * regions are summarized again.
+ *
+ * This is only a hint: it's updated from the atomic alloc trigger and
+ * rebuilt from the freespace btree on mount, and the allocator falls back to
+ * a full scan if it finds nothing.
+ */
+#define BUCKET_FREE_REGION_SHIFT	10
+#define BUCKET_FREE_GROUP		64
+
+struct bucket_free_summary {
+	struct rcu_head		rcu;
+	size_t			nbuckets;
+	size_t			nr_regions;
+	size_t			nr_groups;
+	atomic_t		*groups;
+	atomic_t		regions[];
+};
+
 struct bch_dev_usage {
 	struct bch_dev_usage_type {
 		u64		buckets;
@@ -5,6 +5,9 @@
 #include <linux/hash.h>
 #include <linux/random.h>
 
+/* Number of entries migrated from the old table per insert, while resizing: */
+#define BUCKET_TABLE_MIGRATE_BATCH	64
+
 static inline struct bucket_hashed *
 bucket_hash(struct buckets_waiting_for_journal_table *t,
 	    unsigned hash_seed_idx, u64 dev_bucket)
@@ -22,28 +25,49 @@ static void bucket_table_init(struct buckets_waiting_for_journal_table *t, size_
 	memset(t->d, 0, sizeof(t->d[0]) << t->bits);
 }
 
-bool bch2_bucket_needs_journal_commit(struct buckets_waiting_for_journal *b,
-				      u64 flushed_seq,
-				      unsigned dev, u64 bucket)
+static struct buckets_waiting_for_journal_table *bucket_table_alloc(size_t bits)
 {
-	struct buckets_waiting_for_journal_table *t;
-	u64 dev_bucket = (u64) dev << 56 | bucket;
-	bool ret = false;
-	unsigned i;
+	return kvmalloc(sizeof(struct buckets_waiting_for_journal_table) +
+			(sizeof(struct bucket_hashed) << bits), GFP_KERNEL);
+}
 
-	mutex_lock(&b->lock);
-	t = b->t;
+static bool bucket_table_lookup(struct buckets_waiting_for_journal_table *t,
+				u64 flushed_seq, u64 dev_bucket, bool *ret)
+{
+	unsigned i;
 
 	for (i = 0; i < ARRAY_SIZE(t->hash_seeds); i++) {
 		struct bucket_hashed *h = bucket_hash(t, i, dev_bucket);
 
-		if (h->dev_bucket == dev_bucket) {
-			ret = h->journal_seq > flushed_seq;
-			break;
+		if (READ_ONCE(h->dev_bucket) == dev_bucket) {
+			*ret = READ_ONCE(h->journal_seq) > flushed_seq;
+			return true;
 		}
 	}
 
-	mutex_unlock(&b->lock);
+	return false;
+}
+
+bool bch2_bucket_needs_journal_commit(struct buckets_waiting_for_journal *b,
+				      u64 flushed_seq,
+				      unsigned dev, u64 bucket)
+{
+	struct buckets_waiting_for_journal_table *t;
+	u64 dev_bucket = (u64) dev << 56 | bucket;
+	bool ret;
+	unsigned seq;
+
+	rcu_read_lock();
+	do {
+		seq = read_seqcount_begin(&b->seq);
+		ret = false;
+
+		t = rcu_dereference(b->t);
+		if (!bucket_table_lookup(t, flushed_seq, dev_bucket, &ret) &&
+		    (t = rcu_dereference(b->old)))
+			bucket_table_lookup(t, flushed_seq, dev_bucket, &ret);
+	} while (read_seqcount_retry(&b->seq, seq));
+	rcu_read_unlock();
 
 	return ret;
 }
@@ -61,8 +85,16 @@ static bool bucket_table_insert(struct buckets_waiting_for_journal_table *t,
 		for (i = 0; i < ARRAY_SIZE(t->hash_seeds); i++) {
 			old = bucket_hash(t, i, new->dev_bucket);
 
-			if (old->dev_bucket == new->dev_bucket ||
-			    old->journal_seq <= flushed_seq) {
+			/*
+			 * While resizing, an entry being migrated may be older
+			 * than the one already in the new table:
+			 */
+			if (old->dev_bucket == new->dev_bucket) {
+				old->journal_seq = max(old->journal_seq, new->journal_seq);
+				return true;
+			}
+
+			if (old->journal_seq <= flushed_seq) {
 				*old = *new;
 				return true;
 			}
@@ -83,44 +115,67 @@ static bool bucket_table_insert(struct buckets_waiting_for_journal_table *t,
 	return false;
 }
 
-int bch2_set_bucket_needs_journal_commit(struct buckets_waiting_for_journal *b,
-					 u64 flushed_seq,
-					 unsigned dev, u64 bucket,
-					 u64 journal_seq)
+static size_t bucket_table_nr_live(struct buckets_waiting_for_journal_table *t,
+				   size_t start, u64 flushed_seq)
 {
-	struct buckets_waiting_for_journal_table *t, *n;
-	struct bucket_hashed tmp, new = {
-		.dev_bucket	= (u64) dev << 56 | bucket,
-		.journal_seq	= journal_seq,
-	};
-	size_t i, size, new_bits, nr_elements = 1, nr_rehashes = 0;
-	int ret = 0;
+	size_t i, nr = 0;
 
-	mutex_lock(&b->lock);
+	for (i = start; i < 1UL << t->bits; i++)
+		nr += t->d[i].journal_seq > flushed_seq;
+	return nr;
+}
 
-	if (likely(bucket_table_insert(b->t, &new, flushed_seq)))
-		goto out;
+static void bucket_tables_publish(struct buckets_waiting_for_journal *b,
+				  struct buckets_waiting_for_journal_table *t,
+				  struct buckets_waiting_for_journal_table *old)
+{
+	write_seqcount_begin(&b->seq);
+	rcu_assign_pointer(b->t, t);
+	rcu_assign_pointer(b->old, old);
+	b->migrate_idx = 0;
+	write_seqcount_end(&b->seq);
+}
 
-	t = b->t;
-	size = 1UL << t->bits;
-	for (i = 0; i < size; i++)
-		nr_elements += t->d[i].journal_seq > flushed_seq;
+/*
+ * Slowpath: an insert failed while a resize was already in progress, rebuild
+ * both tables into a new one synchronously. @new is the entry left over from
+ * the failed insert:
+ */
+static int bucket_tables_rehash(struct buckets_waiting_for_journal *b,
+				u64 flushed_seq,
+				struct bucket_hashed *new)
+{
+	struct buckets_waiting_for_journal_table *t =
+		rcu_dereference_protected(b->t, lockdep_is_held(&b->lock));
+	struct buckets_waiting_for_journal_table *old =
+		rcu_dereference_protected(b->old, lockdep_is_held(&b->lock));
+	struct buckets_waiting_for_journal_table *n;
+	struct bucket_hashed tmp;
+	size_t i, size = 1UL << t->bits, new_bits, nr_rehashes = 0;
+	size_t nr_elements = 1 + bucket_table_nr_live(t, 0, flushed_seq) +
+		(old ? bucket_table_nr_live(old, b->migrate_idx, flushed_seq) : 0);
 
 	new_bits = t->bits + (nr_elements * 3 > size);
 
-	n = kvmalloc(sizeof(*n) + (sizeof(n->d[0]) << new_bits), GFP_KERNEL);
-	if (!n) {
-		ret = -BCH_ERR_ENOMEM_buckets_waiting_for_journal_set;
-		goto out;
-	}
-
+	n = bucket_table_alloc(new_bits);
+	if (!n)
+		return -BCH_ERR_ENOMEM_buckets_waiting_for_journal_set;
 retry_rehash:
 	nr_rehashes++;
 	bucket_table_init(n, new_bits);
 
-	tmp = new;
+	tmp = *new;
 	BUG_ON(!bucket_table_insert(n, &tmp, flushed_seq));
 
+	for (i = old ? b->migrate_idx : 0; old && i < 1UL << old->bits; i++) {
+		if (old->d[i].journal_seq <= flushed_seq)
+			continue;
+
+		tmp = old->d[i];
+		if (!bucket_table_insert(n, &tmp, flushed_seq))
+			goto retry_rehash;
+	}
+
 	for (i = 0; i < 1UL << t->bits; i++) {
 		if (t->d[i].journal_seq <= flushed_seq)
 			continue;
@@ -130,11 +185,106 @@ retry_rehash:
 			goto retry_rehash;
 	}
 
-	b->t = n;
-	kvfree(t);
+	bucket_tables_publish(b, n, NULL);
+	kvfree_rcu(t, rcu);
+	if (old)
+		kvfree_rcu(old, rcu);
 
 	pr_debug("took %zu rehashes, table at %zu/%lu elements",
-		 nr_rehashes, nr_elements, 1UL << b->t->bits);
+		 nr_rehashes, nr_elements, 1UL << new_bits);
+	return 0;
+}
+
+/*
+ * Start a resize: publish a new table, into which @new (the entry left over
+ * from the failed insert) is inserted, and migrate the rest incrementally:
+ */
+static int bucket_table_resize_start(struct buckets_waiting_for_journal *b,
+				     u64 flushed_seq,
+				     struct bucket_hashed *new)
+{
+	struct buckets_waiting_for_journal_table *t =
+		rcu_dereference_protected(b->t, lockdep_is_held(&b->lock));
+	struct buckets_waiting_for_journal_table *n;
+	size_t size = 1UL << t->bits;
+	size_t nr_elements = 1 + bucket_table_nr_live(t, 0, flushed_seq);
+	size_t new_bits = t->bits + (nr_elements * 3 > size);
+
+	n = bucket_table_alloc(new_bits);
+	if (!n)
+		return -BCH_ERR_ENOMEM_buckets_waiting_for_journal_set;
+
+	bucket_table_init(n, new_bits);
+	BUG_ON(!bucket_table_insert(n, new, flushed_seq));
+
+	bucket_tables_publish(b, n, t);
+	return 0;
+}
+
+static int bucket_table_migrate(struct buckets_waiting_for_journal *b,
+				u64 flushed_seq)
+{
+	struct buckets_waiting_for_journal_table *t =
+		rcu_dereference_protected(b->t, lockdep_is_held(&b->lock));
+	struct buckets_waiting_for_journal_table *old =
+		rcu_dereference_protected(b->old, lockdep_is_held(&b->lock));
+	size_t end = min(b->migrate_idx + BUCKET_TABLE_MIGRATE_BATCH,
+			 1UL << old->bits);
+	struct bucket_hashed tmp;
+
+	write_seqcount_begin(&b->seq);
+	for (; b->migrate_idx < end; b->migrate_idx++) {
+		if (old->d[b->migrate_idx].journal_seq <= flushed_seq)
+			continue;
+
+		tmp = old->d[b->migrate_idx];
+		if (!bucket_table_insert(t, &tmp, flushed_seq)) {
+			write_seqcount_end(&b->seq);
+			return bucket_tables_rehash(b, flushed_seq, &tmp);
+		}
+	}
+
+	if (b->migrate_idx == 1UL << old->bits)
+		rcu_assign_pointer(b->old, NULL);
+	write_seqcount_end(&b->seq);
+
+	if (!rcu_access_pointer(b->old))
+		kvfree_rcu(old, rcu);
+	return 0;
+}
+
+int bch2_set_bucket_needs_journal_commit(struct buckets_waiting_for_journal *b,
+					 u64 flushed_seq,
+					 unsigned dev, u64 bucket,
+					 u64 journal_seq)
+{
+	struct bucket_hashed new = {
+		.dev_bucket	= (u64) dev << 56 | bucket,
+		.journal_seq	= journal_seq,
+	};
+	bool inserted;
+	int ret = 0;
+
+	mutex_lock(&b->lock);
+
+	if (rcu_access_pointer(b->old)) {
+		ret = bucket_table_migrate(b, flushed_seq);
+		if (ret)
+			goto out;
+	}
+
+	write_seqcount_begin(&b->seq);
+	inserted = bucket_table_insert(rcu_dereference_protected(b->t,
+					lockdep_is_held(&b->lock)),
+				       &new, flushed_seq);
+	write_seqcount_end(&b->seq);
+
+	if (likely(inserted))
+		goto out;
+
+	ret = rcu_access_pointer(b->old)
+		? bucket_tables_rehash(b, flushed_seq, &new)
+		: bucket_table_resize_start(b, flushed_seq, &new);
 out:
 	mutex_unlock(&b->lock);
 
@@ -145,7 +295,8 @@ void bch2_fs_buckets_waiting_for_journal_exit(struct bch_fs *c)
 {
 	struct buckets_waiting_for_journal *b = &c->buckets_waiting_for_journal;
 
-	kvfree(b->t);
+	kvfree(rcu_dereference_protected(b->old, 1));
+	kvfree(rcu_dereference_protected(b->t, 1));
 }
 
 #define INITIAL_TABLE_BITS		3
@@ -153,14 +304,16 @@ void bch2_fs_buckets_waiting_for_journal_exit(struct bch_fs *c)
 int bch2_fs_buckets_waiting_for_journal_init(struct bch_fs *c)
 {
 	struct buckets_waiting_for_journal *b = &c->buckets_waiting_for_journal;
+	struct buckets_waiting_for_journal_table *t;
 
 	mutex_init(&b->lock);
+	seqcount_init(&b->seq);
 
-	b->t = kvmalloc(sizeof(*b->t) +
-			(sizeof(b->t->d[0]) << INITIAL_TABLE_BITS), GFP_KERNEL);
-	if (!b->t)
+	t = bucket_table_alloc(INITIAL_TABLE_BITS);
+	if (!t)
 		return -BCH_ERR_ENOMEM_buckets_waiting_for_journal_init;
 
-	bucket_table_init(b->t, INITIAL_TABLE_BITS);
+	bucket_table_init(t, INITIAL_TABLE_BITS);
+	rcu_assign_pointer(b->t, t);
 	return 0;
 }
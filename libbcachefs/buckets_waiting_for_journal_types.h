@@ -2,6 +2,7 @@
 #ifndef _BUCKETS_WAITING_FOR_JOURNAL_TYPES_H
 #define _BUCKETS_WAITING_FOR_JOURNAL_TYPES_H
 
+#include <linux/seqlock.h>
 #include <linux/siphash.h>
 
 struct bucket_hashed {
@@ -10,14 +11,27 @@ struct bucket_hashed {
 };
 
 struct buckets_waiting_for_journal_table {
+	struct rcu_head		rcu;
 	unsigned		bits;
 	u64			hash_seeds[3];
 	struct bucket_hashed	d[];
 };
 
+/*
+ * Lookups are lockless: the tables are RCU protected, and cuckoo hashing moves
+ * entries between slots on insert, so inserts are done inside a seqcount write
+ * section that lookups retry on. Updates are serialized by @lock.
+ *
+ * When the table fills up, a new larger table is published immediately and
+ * entries are migrated from @old a batch at a time, on subsequent inserts;
+ * while a resize is in progress lookups check both tables, @t first.
+ */
 struct buckets_waiting_for_journal {
 	struct mutex		lock;
-	struct buckets_waiting_for_journal_table *t;
+	seqcount_t		seq;
+	struct buckets_waiting_for_journal_table __rcu *t;
+	struct buckets_waiting_for_journal_table __rcu *old;
+	size_t			migrate_idx;
 };
 
 #endif /* _BUCKETS_WAITING_FOR_JOURNAL_TYPES_H */
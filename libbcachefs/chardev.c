@@ -572,6 +572,129 @@ err:
 	return ret;
 }
 
+static long bch2_ioctl_query_accounting_v2(struct bch_fs *c,
+			struct bch_ioctl_query_accounting_v2 __user *user_arg)
+{
+	struct bch_ioctl_query_accounting_v2 arg;
+	darray_char accounting = {};
+	int ret = 0;
+
+	if (!test_bit(BCH_FS_started, &c->flags))
+		return -EINVAL;
+
+	ret = copy_from_user_errcode(&arg, user_arg, sizeof(arg));
+	if (ret)
+		return ret;
+
+	if ((arg.flags & ~(BCH_ACCOUNTING_QUERY_DEV|BCH_ACCOUNTING_QUERY_SNAPSHOT)) ||
+	    arg.pad)
+		return -EINVAL;
+
+	struct bch_accounting_filter f = {
+		.types_mask	= arg.accounting_types_mask,
+		.dev		= arg.flags & BCH_ACCOUNTING_QUERY_DEV ? arg.dev : -1,
+		.snapshot_start	= arg.flags & BCH_ACCOUNTING_QUERY_SNAPSHOT ? arg.snapshot_start : 0,
+		.snapshot_end	= arg.flags & BCH_ACCOUNTING_QUERY_SNAPSHOT ? arg.snapshot_end : U32_MAX,
+	};
+
+	ret   = bch2_fs_accounting_read_filtered(c, &accounting,
+				(size_t) arg.accounting_u64s * sizeof(u64), &f, &arg.pos) ?:
+		copy_to_user_errcode(&user_arg->accounting, accounting.data, accounting.nr);
+	if (ret)
+		goto err;
+
+	arg.capacity		= c->capacity;
+	arg.used		= bch2_fs_usage_read_short(c).used;
+	arg.online_reserved	= percpu_u64_get(c->online_reserved);
+	arg.accounting_u64s	= accounting.nr / sizeof(u64);
+
+	ret = copy_to_user_errcode(user_arg, &arg, sizeof(arg));
+err:
+	darray_exit(&accounting);
+	return ret;
+}
+
+static long bch2_ioctl_query_stats(struct bch_fs *c,
+			struct bch_ioctl_query_stats __user *user_arg)
+{
+	struct bch_ioctl_query_stats arg;
+	unsigned nr_devs = 0;
+	int ret = copy_from_user_errcode(&arg, user_arg, sizeof(arg));
+	if (ret)
+		return ret;
+
+	if ((arg.flags & ~BCH_QUERY_STATS_SINCE_MOUNT) ||
+	    arg.pad || arg.pad2)
+		return -EINVAL;
+
+	for_each_member_device(c, ca)
+		nr_devs++;
+
+	if (arg.nr_counters	< BCH_COUNTER_NR ||
+	    arg.nr_time_stats	< BCH_TIME_STAT_NR ||
+	    arg.nr_devs		< nr_devs) {
+		arg.nr_counters		= BCH_COUNTER_NR;
+		arg.nr_time_stats	= BCH_TIME_STAT_NR;
+		arg.nr_devs		= nr_devs;
+
+		return copy_to_user_errcode(user_arg, &arg, sizeof(arg)) ?: -ERANGE;
+	}
+
+	size_t bytes = BCH_COUNTER_NR * sizeof(u64) +
+		BCH_TIME_STAT_NR * sizeof(struct bch_ioctl_time_stat) +
+		nr_devs * sizeof(struct bch_ioctl_dev_io);
+	u64 *counters = kvzalloc(bytes, GFP_KERNEL);
+	if (!counters)
+		return -ENOMEM;
+
+	for (unsigned i = 0; i < BCH_COUNTER_NR; i++)
+		counters[i] = percpu_u64_get(&c->counters[i]) -
+			(arg.flags & BCH_QUERY_STATS_SINCE_MOUNT
+			 ? c->counters_on_mount[i] : 0);
+
+	struct bch_ioctl_time_stat *t = (void *) (counters + BCH_COUNTER_NR);
+	for (unsigned i = 0; i < BCH_TIME_STAT_NR; i++, t++) {
+		struct bch2_time_stats *stats = &c->times[i];
+
+		bch2_time_stats_flush(stats);
+
+		t->count	= stats->duration_stats.n;
+		t->total_ns	= stats->total_duration;
+		t->max_ns	= stats->max_duration;
+		t->p50_ns	= bch2_time_stats_quantile(stats, 500000);
+		t->p99_ns	= bch2_time_stats_quantile(stats, 990000);
+		t->p999_ns	= bch2_time_stats_quantile(stats, 999000);
+	}
+
+	struct bch_ioctl_dev_io *d = (void *) t;
+	unsigned dev_nr = 0;
+	for_each_member_device(c, ca) {
+		if (dev_nr == nr_devs) {
+			bch2_dev_put(ca);
+			break;
+		}
+
+		d->dev = ca->dev_idx;
+		for (unsigned rw = 0; rw < 2; rw++)
+			for (unsigned i = 0; i < BCH_DATA_NR; i++)
+				d->sectors[rw] += percpu_u64_get(&ca->io_done->sectors[rw][i]);
+		d++;
+		dev_nr++;
+	}
+
+	arg.capacity		= c->capacity;
+	arg.used		= bch2_fs_usage_read_short(c).used;
+	arg.online_reserved	= percpu_u64_get(c->online_reserved);
+	arg.nr_counters		= BCH_COUNTER_NR;
+	arg.nr_time_stats	= BCH_TIME_STAT_NR;
+	arg.nr_devs		= dev_nr;
+
+	ret   = copy_to_user_errcode(&user_arg->d, counters, (void *) d - (void *) counters) ?:
+		copy_to_user_errcode(user_arg, &arg, sizeof(arg));
+	kvfree(counters);
+	return ret;
+}
+
 /* obsolete, didn't allow for new data types: */
 static long bch2_ioctl_dev_usage(struct bch_fs *c,
 				 struct bch_ioctl_dev_usage __user *user_arg)
@@ -927,6 +1050,10 @@ long bch2_fs_ioctl(struct bch_fs *c, unsigned cmd, void __user *arg)
 		BCH_IOCTL(fsck_online, struct bch_ioctl_fsck_online);
 	case BCH_IOCTL_QUERY_ACCOUNTING:
 		return bch2_ioctl_query_accounting(c, arg);
+	case BCH_IOCTL_QUERY_STATS:
+		return bch2_ioctl_query_stats(c, arg);
+	case BCH_IOCTL_QUERY_ACCOUNTING_V2:
+		return bch2_ioctl_query_accounting_v2(c, arg);
 	default:
 		return -ENOTTY;
 	}
@@ -361,6 +361,79 @@ int __bch2_encrypt_bio(struct bch_fs *c, unsigned type,
 	return ret;
 }
 
+/*
+ * Encrypting and checksumming in one pass, a page at a time, so that each page
+ * is MACed while it's still in cache - the MAC is always over the ciphertext,
+ * so when decrypting we checksum first:
+ */
+static int __bch2_crypt_checksum_bio(struct bch_fs *c, unsigned type,
+				     struct nonce nonce, struct bio *bio,
+				     bool encrypt, struct bch_csum *csum)
+{
+	SHASH_DESC_ON_STACK(desc, c->poly1305);
+	u8 digest[POLY1305_DIGEST_SIZE];
+	struct bio_vec bv;
+	struct bvec_iter iter;
+	int ret;
+
+	ret = gen_poly_key(c, desc, nonce);
+	if (ret)
+		return ret;
+
+	bio_for_each_segment(bv, bio, iter) {
+		void *p = kmap_local_page(bv.bv_page) + bv.bv_offset;
+		struct scatterlist sg;
+
+		if (!encrypt)
+			crypto_shash_update(desc, p, bv.bv_len);
+
+		sg_init_table(&sg, 1);
+		sg_set_page(&sg, bv.bv_page, bv.bv_len, bv.bv_offset);
+
+		ret = do_encrypt_sg(c->chacha20, nonce, &sg, bv.bv_len);
+		if (ret) {
+			kunmap_local(p);
+			return ret;
+		}
+
+		if (encrypt)
+			crypto_shash_update(desc, p, bv.bv_len);
+		kunmap_local(p);
+
+		nonce = nonce_add(nonce, bv.bv_len);
+	}
+
+	crypto_shash_final(desc, digest);
+
+	*csum = (struct bch_csum) { 0 };
+	memcpy(csum, digest, bch_crc_bytes[type]);
+	return 0;
+}
+
+int bch2_encrypt_checksum_bio(struct bch_fs *c, unsigned type,
+			      struct nonce nonce, struct bio *bio,
+			      struct bch_csum *csum)
+{
+	if (!bch2_csum_type_is_encryption(type)) {
+		*csum = bch2_checksum_bio(c, type, nonce, bio);
+		return 0;
+	}
+
+	return __bch2_crypt_checksum_bio(c, type, nonce, bio, true, csum);
+}
+
+int bch2_checksum_decrypt_bio(struct bch_fs *c, unsigned type,
+			      struct nonce nonce, struct bio *bio,
+			      struct bch_csum *csum)
+{
+	if (!bch2_csum_type_is_encryption(type)) {
+		*csum = bch2_checksum_bio(c, type, nonce, bio);
+		return 0;
+	}
+
+	return __bch2_crypt_checksum_bio(c, type, nonce, bio, false, csum);
+}
+
 struct bch_csum bch2_checksum_merge(unsigned type, struct bch_csum a,
 				    struct bch_csum b, size_t b_len)
 {
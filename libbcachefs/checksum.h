@@ -90,6 +90,15 @@ int bch2_rechecksum_bio(struct bch_fs *, struct bio *, struct bversion,
 int __bch2_encrypt_bio(struct bch_fs *, unsigned,
 		       struct nonce, struct bio *);
 
+/*
+ * Single pass versions, for when we're encrypting or decrypting the whole bio,
+ * and checksumming it:
+ */
+int bch2_encrypt_checksum_bio(struct bch_fs *, unsigned, struct nonce,
+			      struct bio *, struct bch_csum *);
+int bch2_checksum_decrypt_bio(struct bch_fs *, unsigned, struct nonce,
+			      struct bio *, struct bch_csum *);
+
 static inline int bch2_encrypt_bio(struct bch_fs *c, unsigned type,
 				   struct nonce nonce, struct bio *bio)
 {
@@ -142,6 +142,119 @@ static void bio_unmap_or_unbounce(struct bch_fs *c, struct bbuf buf)
 	}
 }
 
+/*
+ * Compression workspaces: each cpu has its own, allocated on first use, so that
+ * concurrent writers don't contend on the mempool - the mempool is only used
+ * when this cpu's workspace is busy or couldn't be allocated:
+ */
+struct compress_workspace_pcpu {
+	struct mutex	lock;
+	void		*workspace[BCH_COMPRESSION_TYPE_NR];
+};
+
+struct compress_workspace {
+	struct compress_workspace_pcpu	*pcpu;
+	void				*ws;
+};
+
+static struct compress_workspace compress_workspace_get(struct bch_fs *c,
+						enum bch_compression_type type)
+{
+	struct compress_workspace_pcpu *p = c->compress_workspace_pcpu
+		? raw_cpu_ptr(c->compress_workspace_pcpu)
+		: NULL;
+
+	if (p && mutex_trylock(&p->lock)) {
+		if (!p->workspace[type])
+			p->workspace[type] = kvmalloc(c->compress_workspace_size[type],
+						      GFP_NOFS|__GFP_NOWARN);
+		if (p->workspace[type])
+			return (struct compress_workspace) { p, p->workspace[type] };
+
+		mutex_unlock(&p->lock);
+	}
+
+	return (struct compress_workspace) {
+		NULL, mempool_alloc(&c->compress_workspace[type], GFP_NOFS)
+	};
+}
+
+static void compress_workspace_put(struct bch_fs *c,
+				   enum bch_compression_type type,
+				   struct compress_workspace ws)
+{
+	if (ws.pcpu)
+		mutex_unlock(&ws.pcpu->lock);
+	else
+		mempool_free(ws.ws, &c->compress_workspace[type]);
+}
+
+/*
+ * Trained zstd dictionary, from the superblock: we keep our own copy, since the
+ * dictionaries reference it:
+ */
+struct bch_zstd_dict {
+	void			*data;
+	size_t			bytes;
+	zstd_cdict		*cdict;
+	zstd_ddict		*ddict;
+};
+
+static void bch2_zstd_dict_exit(struct bch_fs *c)
+{
+	struct bch_zstd_dict *d = c->zstd_dict;
+
+	if (!d)
+		return;
+
+	zstd_free_cdict(d->cdict);
+	zstd_free_ddict(d->ddict);
+	kvfree(d->data);
+	kfree(d);
+	c->zstd_dict = NULL;
+}
+
+static int bch2_zstd_dict_init(struct bch_fs *c)
+{
+	struct bch_sb_field_zstd_dict *f =
+		bch2_sb_field_get(c->disk_sb.sb, zstd_dict);
+	struct bch_zstd_dict *d;
+
+	if (c->zstd_dict)
+		return 0;
+
+	if (!f)
+		return -BCH_ERR_zstd_dict_missing;
+
+	d = kzalloc(sizeof(*d), GFP_KERNEL);
+	if (!d)
+		return -BCH_ERR_ENOMEM_zstd_dict_init;
+
+	c->zstd_dict = d;
+
+	d->bytes = le32_to_cpu(f->dict_bytes);
+	d->data = kvmalloc(d->bytes, GFP_KERNEL);
+	if (!d->data)
+		goto err;
+	memcpy(d->data, f->data, d->bytes);
+
+	/* level 0 means zstd's default, as with plain zstd: */
+	unsigned level = min_t(unsigned, f->level ?: 3, zstd_max_clevel());
+	ZSTD_parameters params = zstd_get_params(level, c->opts.encoded_extent_max);
+
+	d->cdict = zstd_create_cdict_byreference(d->data, d->bytes, params.cParams,
+						 (zstd_custom_mem) { NULL });
+	d->ddict = zstd_create_ddict_byreference(d->data, d->bytes,
+						 (zstd_custom_mem) { NULL });
+	if (!d->cdict || !d->ddict)
+		goto err;
+
+	return 0;
+err:
+	bch2_zstd_dict_exit(c);
+	return -BCH_ERR_ENOMEM_zstd_dict_init;
+}
+
 static inline void zlib_set_workspace(z_stream *strm, void *workspace)
 {
 #ifdef __KERNEL__
@@ -149,28 +262,24 @@ static inline void zlib_set_workspace(z_stream *strm, void *workspace)
 #endif
 }
 
-static int __bio_uncompress(struct bch_fs *c, struct bio *src,
-			    void *dst_data, struct bch_extent_crc_unpacked crc)
+static int __uncompress(struct bch_fs *c, enum bch_compression_type type,
+			void *dst_data, size_t dst_len,
+			void *src_data, size_t src_len)
 {
-	struct bbuf src_data = { NULL };
-	size_t src_len = src->bi_iter.bi_size;
-	size_t dst_len = crc.uncompressed_size << 9;
 	void *workspace;
 	int ret;
 
-	src_data = bio_map_or_bounce(c, src, READ);
-
-	switch (crc.compression_type) {
+	switch (type) {
 	case BCH_COMPRESSION_TYPE_lz4_old:
 	case BCH_COMPRESSION_TYPE_lz4:
-		ret = LZ4_decompress_safe_partial(src_data.b, dst_data,
+		ret = LZ4_decompress_safe_partial(src_data, dst_data,
 						  src_len, dst_len, dst_len);
 		if (ret != dst_len)
-			goto err;
+			return -EIO;
 		break;
 	case BCH_COMPRESSION_TYPE_gzip: {
 		z_stream strm = {
-			.next_in	= src_data.b,
+			.next_in	= src_data,
 			.avail_in	= src_len,
 			.next_out	= dst_data,
 			.avail_out	= dst_len,
@@ -185,39 +294,55 @@ static int __bio_uncompress(struct bch_fs *c, struct bio *src,
 		mempool_free(workspace, &c->decompress_workspace);
 
 		if (ret != Z_STREAM_END)
-			goto err;
+			return -EIO;
 		break;
 	}
-	case BCH_COMPRESSION_TYPE_zstd: {
+	case BCH_COMPRESSION_TYPE_zstd:
+	case BCH_COMPRESSION_TYPE_zstd_dict: {
 		ZSTD_DCtx *ctx;
-		size_t real_src_len = le32_to_cpup(src_data.b);
+		size_t real_src_len = le32_to_cpup(src_data);
 
 		if (real_src_len > src_len - 4)
-			goto err;
+			return -EIO;
+
+		if (type == BCH_COMPRESSION_TYPE_zstd_dict && !c->zstd_dict)
+			return -EIO;
 
 		workspace = mempool_alloc(&c->decompress_workspace, GFP_NOFS);
 		ctx = zstd_init_dctx(workspace, zstd_dctx_workspace_bound());
 
-		ret = zstd_decompress_dctx(ctx,
+		ret = type == BCH_COMPRESSION_TYPE_zstd
+			? zstd_decompress_dctx(ctx,
+				dst_data,	dst_len,
+				src_data + 4, real_src_len)
+			: zstd_decompress_using_ddict(ctx,
 				dst_data,	dst_len,
-				src_data.b + 4, real_src_len);
+				src_data + 4, real_src_len,
+				c->zstd_dict->ddict);
 
 		mempool_free(workspace, &c->decompress_workspace);
 
 		if (ret != dst_len)
-			goto err;
+			return -EIO;
 		break;
 	}
 	default:
 		BUG();
 	}
-	ret = 0;
-out:
+
+	return 0;
+}
+
+static int __bio_uncompress(struct bch_fs *c, struct bio *src,
+			    void *dst_data, struct bch_extent_crc_unpacked crc)
+{
+	struct bbuf src_data = bio_map_or_bounce(c, src, READ);
+	int ret = __uncompress(c, crc.compression_type,
+			       dst_data, crc.uncompressed_size << 9,
+			       src_data.b, src->bi_iter.bi_size);
+
 	bio_unmap_or_unbounce(c, src_data);
 	return ret;
-err:
-	ret = -EIO;
-	goto out;
 }
 
 int bch2_bio_uncompress_inplace(struct bch_fs *c, struct bio *bio,
@@ -377,37 +502,127 @@ static int attempt_compress(struct bch_fs *c,
 		*((__le32 *) dst) = cpu_to_le32(len);
 		return len + 4;
 	}
+	case BCH_COMPRESSION_TYPE_zstd_dict: {
+		/*
+		 * The level comes from the dictionary; same length prefix and
+		 * fudge factor as plain zstd:
+		 */
+		ZSTD_CCtx *ctx = zstd_init_cctx(workspace, c->zstd_workspace_size);
+		size_t len = zstd_compress_using_cdict(ctx,
+				dst + 4,	dst_len - 4 - 7,
+				src,		src_len,
+				c->zstd_dict->cdict);
+		if (zstd_is_error(len))
+			return 0;
+
+		*((__le32 *) dst) = cpu_to_le32(len);
+		return len + 4;
+	}
 	default:
 		BUG();
 	}
 }
 
-static unsigned __bio_compress(struct bch_fs *c,
-			       struct bio *dst, size_t *dst_len,
-			       struct bio *src, size_t *src_len,
-			       struct bch_compression_opt compression)
+/*
+ * Compression of flat buffers, for metadata:
+ */
+
+int bch2_uncompress_buf(struct bch_fs *c, enum bch_compression_type type,
+			void *dst, size_t dst_len,
+			void *src, size_t src_len)
 {
-	struct bbuf src_data = { NULL }, dst_data = { NULL };
-	void *workspace;
-	enum bch_compression_type compression_type =
-		__bch2_compression_opt_to_type[compression.type];
-	unsigned pad;
-	int ret = 0;
+	if (type == BCH_COMPRESSION_TYPE_none ||
+	    type == BCH_COMPRESSION_TYPE_incompressible ||
+	    type >= BCH_COMPRESSION_TYPE_NR ||
+	    !mempool_initialized(&c->decompress_workspace))
+		return -EIO;
 
-	BUG_ON(compression_type >= BCH_COMPRESSION_TYPE_NR);
-	BUG_ON(!mempool_initialized(&c->compress_workspace[compression_type]));
+	return __uncompress(c, type, dst, dst_len, src, src_len);
+}
 
-	/* If it's only one block, don't bother trying to compress: */
-	if (src->bi_iter.bi_size <= c->opts.block_size)
-		return BCH_COMPRESSION_TYPE_incompressible;
+/*
+ * Returns the compression type used, and the compressed size in @dst_len, or
+ * 0 if the data didn't compress:
+ */
+unsigned bch2_compress_buf(struct bch_fs *c, unsigned compression_opt,
+			   void *dst, size_t *dst_len,
+			   void *src, size_t src_len)
+{
+	struct bch_compression_opt opt = bch2_compression_decode(compression_opt);
+	enum bch_compression_type type = __bch2_compression_opt_to_type[opt.type];
 
-	dst_data = bio_map_or_bounce(c, dst, WRITE);
-	src_data = bio_map_or_bounce(c, src, READ);
+	if (!type ||
+	    !mempool_initialized(&c->compress_workspace[type]))
+		return 0;
 
-	workspace = mempool_alloc(&c->compress_workspace[compression_type], GFP_NOFS);
+	struct compress_workspace ws = compress_workspace_get(c, type);
+	int ret = attempt_compress(c, ws.ws, dst, *dst_len, src, src_len, opt);
+	compress_workspace_put(c, type, ws);
 
-	*src_len = src->bi_iter.bi_size;
-	*dst_len = dst->bi_iter.bi_size;
+	if (ret <= 0)
+		return 0;
+
+	*dst_len = ret;
+	return type;
+}
+
+/*
+ * Cheap check for data that isn't worth running the compressor on: sample it
+ * and estimate the entropy of the byte distribution, in quarter bits per byte.
+ * Data that's already compressed or encrypted comes out at very nearly 8 bits:
+ */
+#define COMPRESS_SAMPLE_BYTES		16
+#define COMPRESS_SAMPLES_MAX		512
+#define COMPRESS_ENTROPY_MAX		30	/* 7.5 bits per byte */
+
+static bool compress_sample_incompressible(const u8 *src, size_t len)
+{
+	size_t interval = max_t(size_t, 256, len / COMPRESS_SAMPLES_MAX);
+	u32 hist[256] = { 0 };
+	u64 n = 0, entropy = 0;
+	size_t i, j;
+
+	for (i = 0; i + COMPRESS_SAMPLE_BYTES <= len; i += interval)
+		for (j = 0; j < COMPRESS_SAMPLE_BYTES; j++) {
+			hist[src[i + j]]++;
+			n++;
+		}
+
+	/* Not enough samples to say: */
+	if (n < 256)
+		return false;
+
+	unsigned n_log = ilog2(n * n * n * n);
+
+	for (i = 0; i < ARRAY_SIZE(hist); i++)
+		if (hist[i]) {
+			u64 h = hist[i];
+
+			entropy += h * (n_log - ilog2(h * h * h * h));
+		}
+
+	return div64_u64(entropy, n) >= COMPRESS_ENTROPY_MAX;
+}
+
+/*
+ * Compress as much of @src as will fit in @dst; on success, @dst_len is padded
+ * out to a whole number of blocks:
+ */
+static int compress_fit(struct bch_fs *c, void *workspace,
+			void *dst, size_t *dst_len,
+			void *src, size_t *src_len,
+			struct bch_compression_opt compression)
+{
+	enum bch_compression_type compression_type =
+		__bch2_compression_opt_to_type[compression.type];
+	unsigned pad;
+	int ret = 0;
+
+	/* lz4 is cheap enough to just try: */
+	if ((compression_type != BCH_COMPRESSION_TYPE_lz4 ||
+	     compression.level >= LZ4HC_MIN_CLEVEL) &&
+	    compress_sample_incompressible(src, *src_len))
+		return -1;
 
 	/*
 	 * XXX: this algorithm sucks when the compression code doesn't tell us
@@ -420,8 +635,8 @@ static unsigned __bio_compress(struct bch_fs *c,
 		}
 
 		ret = attempt_compress(c, workspace,
-				       dst_data.b,	*dst_len,
-				       src_data.b,	*src_len,
+				       dst,	*dst_len,
+				       src,	*src_len,
 				       compression);
 		if (ret > 0) {
 			*dst_len = ret;
@@ -447,19 +662,53 @@ static unsigned __bio_compress(struct bch_fs *c,
 		*src_len = round_down(*src_len, block_bytes(c));
 	}
 
-	mempool_free(workspace, &c->compress_workspace[compression_type]);
-
 	if (ret)
-		goto err;
+		return ret;
 
 	/* Didn't get smaller: */
 	if (round_up(*dst_len, block_bytes(c)) >= *src_len)
-		goto err;
+		return -1;
 
 	pad = round_up(*dst_len, block_bytes(c)) - *dst_len;
 
-	memset(dst_data.b + *dst_len, 0, pad);
+	memset(dst + *dst_len, 0, pad);
 	*dst_len += pad;
+	return 0;
+}
+
+static unsigned __bio_compress(struct bch_fs *c,
+			       struct bio *dst, size_t *dst_len,
+			       struct bio *src, size_t *src_len,
+			       struct bch_compression_opt compression)
+{
+	struct bbuf src_data = { NULL }, dst_data = { NULL };
+	struct compress_workspace ws;
+	enum bch_compression_type compression_type =
+		__bch2_compression_opt_to_type[compression.type];
+	int ret = 0;
+
+	BUG_ON(compression_type >= BCH_COMPRESSION_TYPE_NR);
+	BUG_ON(!mempool_initialized(&c->compress_workspace[compression_type]));
+
+	/* If it's only one block, don't bother trying to compress: */
+	if (src->bi_iter.bi_size <= c->opts.block_size)
+		return BCH_COMPRESSION_TYPE_incompressible;
+
+	dst_data = bio_map_or_bounce(c, dst, WRITE);
+	src_data = bio_map_or_bounce(c, src, READ);
+
+	*src_len = src->bi_iter.bi_size;
+	*dst_len = dst->bi_iter.bi_size;
+
+	ws = compress_workspace_get(c, compression_type);
+	ret = compress_fit(c, ws.ws,
+			   dst_data.b,	dst_len,
+			   src_data.b,	src_len,
+			   compression);
+	compress_workspace_put(c, compression_type, ws);
+
+	if (ret)
+		goto err;
 
 	if (dst_data.type != BB_NONE &&
 	    dst_data.type != BB_VMAP)
@@ -503,6 +752,191 @@ unsigned bch2_bio_compress(struct bch_fs *c,
 	return compression_type;
 }
 
+/*
+ * Large writes: split @src into encoded_extent_max sized chunks and compress
+ * them in parallel, on c->compress_wq, before the write path consumes them one
+ * extent at a time with bch2_bio_compress_batch():
+ */
+
+#define BCH_COMPRESS_BATCH_MAX		16
+
+struct bch_compress_chunk {
+	struct work_struct		work;
+	struct bch_compress_batch	*batch;
+	struct bvec_iter		iter;
+	/* bytes left in @src, from the start of this chunk: */
+	unsigned			remaining;
+	bool				done;
+	unsigned			type;
+	void				*buf;
+	size_t				dst_len;
+	size_t				src_len;
+};
+
+struct bch_compress_batch {
+	struct bch_fs			*c;
+	struct bio			*src;
+	struct bch_compression_opt	opt;
+	struct closure			*cl;
+	unsigned			nr;
+	unsigned			next;
+	struct bch_compress_chunk	chunks[];
+};
+
+static void compress_chunk(struct bch_compress_chunk *ch)
+{
+	struct bch_compress_batch *b = ch->batch;
+	struct bch_fs *c = b->c;
+	enum bch_compression_type type = __bch2_compression_opt_to_type[b->opt.type];
+
+	ch->done = true;
+	ch->type = BCH_COMPRESSION_TYPE_incompressible;
+
+	if (ch->iter.bi_size <= c->opts.block_size)
+		return;
+
+	ch->buf = kvmalloc(ch->iter.bi_size, GFP_NOFS|__GFP_NOWARN);
+	if (!ch->buf) {
+		/* the write path will compress this chunk itself: */
+		ch->done = false;
+		return;
+	}
+
+	struct bbuf src_data = __bio_map_or_bounce(c, b->src, ch->iter, READ);
+	struct compress_workspace ws = compress_workspace_get(c, type);
+
+	ch->src_len = ch->iter.bi_size;
+	ch->dst_len = ch->iter.bi_size;
+
+	if (!compress_fit(c, ws.ws,
+			  ch->buf,	&ch->dst_len,
+			  src_data.b,	&ch->src_len,
+			  b->opt))
+		ch->type = type;
+
+	compress_workspace_put(c, type, ws);
+	bio_unmap_or_unbounce(c, src_data);
+}
+
+static void compress_chunk_work(struct work_struct *work)
+{
+	struct bch_compress_chunk *ch =
+		container_of(work, struct bch_compress_chunk, work);
+	struct closure *cl = ch->batch->cl;
+
+	compress_chunk(ch);
+	closure_put(cl);
+}
+
+struct bch_compress_batch *bch2_bio_compress_batch_start(struct bch_fs *c,
+							 struct bio *src,
+							 unsigned compression_opt)
+{
+	unsigned chunk_size = c->opts.encoded_extent_max;
+	unsigned nr = min_t(unsigned, BCH_COMPRESS_BATCH_MAX,
+			    DIV_ROUND_UP(src->bi_iter.bi_size, chunk_size));
+	struct bch_compress_batch *b;
+	struct bvec_iter iter = src->bi_iter;
+	struct closure cl;
+	unsigned i;
+
+	if (nr < 2 || !c->compress_wq)
+		return NULL;
+
+	b = kzalloc(struct_size(b, chunks, nr), GFP_NOFS|__GFP_NOWARN);
+	if (!b)
+		return NULL;
+
+	b->c	= c;
+	b->src	= src;
+	b->opt	= bch2_compression_decode(compression_opt);
+	b->cl	= &cl;
+	b->nr	= nr;
+
+	for (i = 0; i < nr; i++) {
+		struct bch_compress_chunk *ch = b->chunks + i;
+
+		ch->batch		= b;
+		ch->remaining		= iter.bi_size;
+		ch->iter		= iter;
+		ch->iter.bi_size	= min(iter.bi_size, chunk_size);
+		bio_advance_iter(src, &iter, ch->iter.bi_size);
+	}
+
+	closure_init_stack(&cl);
+
+	for (i = 1; i < nr; i++) {
+		closure_get(&cl);
+		INIT_WORK(&b->chunks[i].work, compress_chunk_work);
+		queue_work(c->compress_wq, &b->chunks[i].work);
+	}
+
+	compress_chunk(b->chunks);
+	closure_sync(&cl);
+
+	b->cl = NULL;
+	return b;
+}
+
+/*
+ * Like bch2_bio_compress(), but uses the result already computed for the chunk
+ * starting at @src's current position, if there is one:
+ */
+unsigned bch2_bio_compress_batch(struct bch_fs *c,
+				 struct bch_compress_batch *b,
+				 struct bio *dst, size_t *dst_len,
+				 struct bio *src, size_t *src_len,
+				 unsigned compression_opt)
+{
+	struct bch_compress_chunk *ch;
+	struct bvec_iter iter;
+
+	if (!b)
+		goto slowpath;
+
+	while (b->next < b->nr &&
+	       b->chunks[b->next].remaining > src->bi_iter.bi_size)
+		b->next++;
+
+	if (b->next == b->nr)
+		goto slowpath;
+
+	ch = b->chunks + b->next;
+
+	if (ch->remaining != src->bi_iter.bi_size ||
+	    !ch->done ||
+	    (ch->type != BCH_COMPRESSION_TYPE_incompressible &&
+	     ch->dst_len > dst->bi_iter.bi_size))
+		goto slowpath;
+
+	b->next++;
+
+	if (ch->type == BCH_COMPRESSION_TYPE_incompressible)
+		return ch->type;
+
+	iter = dst->bi_iter;
+	iter.bi_size = ch->dst_len;
+	memcpy_to_bio(dst, iter, ch->buf);
+
+	*dst_len = ch->dst_len;
+	*src_len = ch->src_len;
+	return ch->type;
+slowpath:
+	return bch2_bio_compress(c, dst, dst_len, src, src_len, compression_opt);
+}
+
+void bch2_bio_compress_batch_exit(struct bch_compress_batch *b)
+{
+	unsigned i;
+
+	if (!b)
+		return;
+
+	for (i = 0; i < b->nr; i++)
+		kvfree(b->chunks[i].buf);
+	kfree(b);
+}
+
 static int __bch2_fs_compress_init(struct bch_fs *, u64);
 
 #define BCH_FEATURE_none	0
@@ -558,6 +992,20 @@ int bch2_check_set_has_compressed_data(struct bch_fs *c,
 void bch2_fs_compress_exit(struct bch_fs *c)
 {
 	unsigned i;
+	int cpu;
+
+	if (c->compress_workspace_pcpu) {
+		for_each_possible_cpu(cpu) {
+			struct compress_workspace_pcpu *p =
+				per_cpu_ptr(c->compress_workspace_pcpu, cpu);
+
+			for (i = 0; i < ARRAY_SIZE(p->workspace); i++)
+				kvfree(p->workspace[i]);
+		}
+		free_percpu(c->compress_workspace_pcpu);
+	}
+
+	bch2_zstd_dict_exit(c);
 
 	mempool_exit(&c->decompress_workspace);
 	for (i = 0; i < ARRAY_SIZE(c->compress_workspace); i++)
@@ -589,8 +1037,12 @@ static int __bch2_fs_compress_init(struct bch_fs *c, u64 features)
 		{ BCH_FEATURE_zstd, BCH_COMPRESSION_TYPE_zstd,
 			c->zstd_workspace_size,
 			zstd_dctx_workspace_bound() },
+		{ BCH_FEATURE_zstd_dict, BCH_COMPRESSION_TYPE_zstd_dict,
+			c->zstd_workspace_size,
+			zstd_dctx_workspace_bound() },
 	}, *i;
 	bool have_compressed = false;
+	int ret;
 
 	for (i = compression_types;
 	     i < compression_types + ARRAY_SIZE(compression_types);
@@ -600,6 +1052,12 @@ static int __bch2_fs_compress_init(struct bch_fs *c, u64 features)
 	if (!have_compressed)
 		return 0;
 
+	if (features & BIT_ULL(BCH_FEATURE_zstd_dict)) {
+		ret = bch2_zstd_dict_init(c);
+		if (ret)
+			return ret;
+	}
+
 	if (!mempool_initialized(&c->compression_bounce[READ]) &&
 	    mempool_init_kvmalloc_pool(&c->compression_bounce[READ],
 				       1, c->opts.encoded_extent_max))
@@ -619,6 +1077,8 @@ static int __bch2_fs_compress_init(struct bch_fs *c, u64 features)
 		if (!(features & (1 << i->feature)))
 			continue;
 
+		c->compress_workspace_size[i->type] = i->compress_workspace;
+
 		if (mempool_initialized(&c->compress_workspace[i->type]))
 			continue;
 
@@ -628,6 +1088,17 @@ static int __bch2_fs_compress_init(struct bch_fs *c, u64 features)
 			return -BCH_ERR_ENOMEM_compression_workspace_init;
 	}
 
+	if (!c->compress_workspace_pcpu) {
+		int cpu;
+
+		c->compress_workspace_pcpu = alloc_percpu(struct compress_workspace_pcpu);
+		if (!c->compress_workspace_pcpu)
+			return -BCH_ERR_ENOMEM_compression_workspace_init;
+
+		for_each_possible_cpu(cpu)
+			mutex_init(&per_cpu_ptr(c->compress_workspace_pcpu, cpu)->lock);
+	}
+
 	if (!mempool_initialized(&c->decompress_workspace) &&
 	    mempool_init_kvmalloc_pool(&c->decompress_workspace,
 				       1, decompress_workspace_size))
@@ -649,6 +1120,7 @@ int bch2_fs_compress_init(struct bch_fs *c)
 
 	f |= compression_opt_to_feature(c->opts.compression);
 	f |= compression_opt_to_feature(c->opts.background_compression);
+	f |= compression_opt_to_feature(c->opts.journal_compression);
 
 	return __bch2_fs_compress_init(c, f);
 }
@@ -675,6 +1147,13 @@ int bch2_opt_compression_parse(struct bch_fs *c, const char *_val, u64 *res,
 
 	opt.type = ret;
 
+	/* zstd:dict is an alias for zstd_dict: */
+	if (opt.type == BCH_COMPRESSION_OPT_zstd &&
+	    level_str && !strcmp(level_str, "dict")) {
+		opt.type = BCH_COMPRESSION_OPT_zstd_dict;
+		level_str = NULL;
+	}
+
 	if (level_str) {
 		unsigned level;
 
@@ -726,3 +1205,42 @@ int bch2_opt_compression_validate(u64 v, struct printbuf *err)
 
 	return 0;
 }
+
+/* BCH_SB_FIELD_zstd_dict: */
+
+static int bch2_sb_zstd_dict_validate(struct bch_sb *sb, struct bch_sb_field *f,
+				      enum bch_validate_flags flags, struct printbuf *err)
+{
+	struct bch_sb_field_zstd_dict *d = field_to_type(f, zstd_dict);
+	unsigned bytes = le32_to_cpu(d->dict_bytes);
+
+	if (vstruct_bytes(&d->field) < sizeof(*d) + bytes) {
+		prt_printf(err, "wrong size (got %zu should be at least %zu)",
+			   vstruct_bytes(&d->field), sizeof(*d) + bytes);
+		return -BCH_ERR_invalid_sb_zstd_dict;
+	}
+
+	if (!bytes || bytes > BCH_ZSTD_DICT_MAX_BYTES) {
+		prt_printf(err, "invalid dictionary size %u", bytes);
+		return -BCH_ERR_invalid_sb_zstd_dict;
+	}
+
+	return 0;
+}
+
+static void bch2_sb_zstd_dict_to_text(struct printbuf *out, struct bch_sb *sb,
+				      struct bch_sb_field *f)
+{
+	struct bch_sb_field_zstd_dict *d = field_to_type(f, zstd_dict);
+
+	prt_printf(out, "Dictionary id:\t%u\n",	le32_to_cpu(d->dict_id));
+	prt_printf(out, "Size:\t");
+	prt_human_readable_u64(out, le32_to_cpu(d->dict_bytes));
+	prt_newline(out);
+	prt_printf(out, "Level:\t%u\n",		d->level);
+}
+
+const struct bch_sb_field_ops bch_sb_field_ops_zstd_dict = {
+	.validate	= bch2_sb_zstd_dict_validate,
+	.to_text	= bch2_sb_zstd_dict_to_text,
+};
@@ -54,6 +54,21 @@ int bch2_bio_uncompress(struct bch_fs *, struct bio *, struct bio *,
 unsigned bch2_bio_compress(struct bch_fs *, struct bio *, size_t *,
 			   struct bio *, size_t *, unsigned);
 
+struct bch_compress_batch;
+struct bch_compress_batch *bch2_bio_compress_batch_start(struct bch_fs *,
+							 struct bio *, unsigned);
+unsigned bch2_bio_compress_batch(struct bch_fs *, struct bch_compress_batch *,
+				 struct bio *, size_t *,
+				 struct bio *, size_t *, unsigned);
+void bch2_bio_compress_batch_exit(struct bch_compress_batch *);
+
+int bch2_uncompress_buf(struct bch_fs *, enum bch_compression_type,
+			void *, size_t, void *, size_t);
+unsigned bch2_compress_buf(struct bch_fs *, unsigned,
+			   void *, size_t *, void *, size_t);
+
+extern const struct bch_sb_field_ops bch_sb_field_ops_zstd_dict;
+
 int bch2_check_set_has_compressed_data(struct bch_fs *, unsigned);
 void bch2_fs_compress_exit(struct bch_fs *);
 int bch2_fs_compress_init(struct bch_fs *);
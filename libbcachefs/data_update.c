@@ -564,6 +564,8 @@ int bch2_data_update_init(struct btree_trans *trans,
 	m->stats	= ctxt ? ctxt->stats : NULL;
 
 	bch2_write_op_init(&m->op, c, io_opts);
+	if (ctxt)
+		m->op.io_class = ctxt->io_class;
 	m->op.pos	= bkey_start_pos(k.k);
 	m->op.version	= k.k->version;
 	m->op.target	= data_opts.target;
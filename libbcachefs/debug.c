@@ -12,6 +12,7 @@
 #include "btree_io.h"
 #include "btree_iter.h"
 #include "btree_locking.h"
+#include "btree_trace.h"
 #include "btree_update.h"
 #include "btree_update_interior.h"
 #include "buckets.h"
@@ -20,6 +21,8 @@
 #include "extents.h"
 #include "fsck.h"
 #include "inode.h"
+#include "lock_profile.h"
+#include "slow_ops.h"
 #include "super.h"
 
 #include <linux/console.h>
@@ -298,6 +301,181 @@ out:
 	percpu_ref_put(&ca->io_ref);
 }
 
+/*
+ * Btree shape analysis: per level node counts, how full nodes are, how many
+ * bsets they have, key packing and whiteouts, and how close together on disk
+ * consecutive nodes are - for deciding when to rewrite nodes or change
+ * btree_node_size:
+ */
+
+#define BTREE_SHAPE_FILL_BUCKETS	10
+
+struct btree_shape_level {
+	u64			nodes;
+	u64			fill[BTREE_SHAPE_FILL_BUCKETS];
+	u64			bsets[MAX_BSETS];
+	u64			live_u64s;
+	u64			buf_u64s;
+	u64			packed_keys;
+	u64			unpacked_keys;
+	u64			keys;
+	u64			whiteouts;
+	u64			written;
+
+	/* locality: */
+	struct bch_extent_ptr	prev;
+	bool			have_prev;
+	u64			adjacent;
+	u64			same_dev;
+	u64			distance;
+};
+
+static void btree_shape_node_add(struct bch_fs *c, struct btree_shape_level *s,
+				 struct btree *b)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(bkey_i_to_s_c(&b->key));
+	unsigned fill = div64_u64((u64) b->nr.live_u64s * sizeof(u64) * 100,
+				  btree_buf_bytes(b));
+
+	s->nodes++;
+	s->fill[min(fill / (100 / BTREE_SHAPE_FILL_BUCKETS), BTREE_SHAPE_FILL_BUCKETS - 1)]++;
+	s->bsets[clamp_t(unsigned, b->nsets, 1, MAX_BSETS) - 1]++;
+	s->live_u64s		+= b->nr.live_u64s;
+	s->buf_u64s		+= btree_buf_bytes(b) / sizeof(u64);
+	s->packed_keys		+= b->nr.packed_keys;
+	s->unpacked_keys	+= b->nr.unpacked_keys;
+	s->written		+= b->written;
+
+	struct bkey_packed *k;
+	for_each_bset(b, t)
+		bset_tree_for_each_key(b, t, k) {
+			s->keys++;
+			s->whiteouts += bkey_whiteout(k);
+		}
+
+	/* Distance from the end of the previous node, in key order: */
+	const struct bch_extent_ptr *ptr = &ptrs.start->ptr;
+	if (ptrs.start == ptrs.end || !extent_entry_is_ptr(ptrs.start))
+		return;
+
+	if (s->have_prev && s->prev.dev == ptr->dev) {
+		u64 prev_end = s->prev.offset + btree_sectors(c);
+
+		s->same_dev++;
+		s->adjacent += ptr->offset == prev_end;
+		s->distance += abs((s64) ptr->offset - (s64) prev_end);
+	}
+
+	s->prev		= *ptr;
+	s->have_prev	= true;
+}
+
+static void btree_shape_level_to_text(struct printbuf *out, struct bch_fs *c,
+				      unsigned level, struct btree_shape_level *s)
+{
+	u64 nodes = max_t(u64, s->nodes, 1);
+
+	prt_printf(out, "level %u:\n", level);
+	printbuf_indent_add(out, 2);
+
+	prt_printf(out, "nodes:\t%llu\n", s->nodes);
+	prt_printf(out, "fill:\t%llu%%\n",
+		   div64_u64(s->live_u64s * 100, max_t(u64, s->buf_u64s, 1)));
+
+	prt_printf(out, "fill distribution:\t");
+	for (unsigned i = 0; i < BTREE_SHAPE_FILL_BUCKETS; i++)
+		prt_printf(out, " %llu", s->fill[i]);
+	prt_printf(out, "\t(by %u%%)\n", 100 / BTREE_SHAPE_FILL_BUCKETS);
+
+	prt_printf(out, "bsets per node:\t");
+	for (unsigned i = 0; i < MAX_BSETS; i++)
+		prt_printf(out, " %u: %llu", i + 1, s->bsets[i]);
+	prt_newline(out);
+
+	prt_printf(out, "packed keys:\t%llu%%\n",
+		   div64_u64(s->packed_keys * 100,
+			     max_t(u64, s->packed_keys + s->unpacked_keys, 1)));
+	prt_printf(out, "whiteouts:\t%llu%%\n",
+		   div64_u64(s->whiteouts * 100, max_t(u64, s->keys, 1)));
+	prt_printf(out, "node size utilization:\t%llu%%\n",
+		   div64_u64(s->written * 100, nodes * btree_sectors(c)));
+
+	prt_printf(out, "adjacent on disk:\t%llu%%\n",
+		   div64_u64(s->adjacent * 100, max_t(u64, s->same_dev, 1)));
+	prt_printf(out, "mean distance:\t");
+	prt_human_readable_u64(out, div64_u64(s->distance, max_t(u64, s->same_dev, 1)) << 9);
+	prt_newline(out);
+
+	printbuf_indent_sub(out, 2);
+}
+
+void bch2_btree_shape_to_text(struct printbuf *out, struct btree_trans *trans,
+			      enum btree_id btree)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_root *r = bch2_btree_id_root(c, btree);
+	struct btree *root = r ? READ_ONCE(r->b) : NULL;
+	int ret = 0;
+
+	if (!root) {
+		prt_printf(out, "%s: no root\n", bch2_btree_id_str(btree));
+		return;
+	}
+
+	unsigned depth = root->c.level + 1;
+	struct btree_shape_level *levels = kcalloc(depth, sizeof(*levels), GFP_KERNEL);
+	if (!levels) {
+		prt_str(out, "(memory allocation failure)\n");
+		return;
+	}
+
+	for (unsigned level = 0; level < depth && !ret; level++) {
+		struct btree_shape_level *s = levels + level;
+		struct btree_iter iter;
+		struct btree *b;
+		struct bpos pos = POS_MIN;
+		bool done = false;
+
+		do {
+			bch2_trans_begin(trans);
+
+			__for_each_btree_node(trans, iter, btree, pos, 0, level,
+					      BTREE_ITER_prefetch, b, ret) {
+				if (b->c.level != level)
+					break;
+
+				btree_shape_node_add(c, s, b);
+
+				if (bpos_eq(b->key.k.p, SPOS_MAX)) {
+					done = true;
+					break;
+				}
+				pos = bpos_successor(b->key.k.p);
+			}
+			bch2_trans_iter_exit(trans, &iter);
+		} while (!done && bch2_err_matches(ret, BCH_ERR_transaction_restart));
+	}
+
+	prt_printf(out, "%s:\n", bch2_btree_id_str(btree));
+	printbuf_indent_add(out, 2);
+	printbuf_tabstops_reset(out);
+	printbuf_tabstop_push(out, 24);
+
+	prt_printf(out, "depth:\t%u\n", depth);
+	prt_printf(out, "btree_node_size:\t");
+	prt_human_readable_u64(out, btree_sectors(c) << 9);
+	prt_newline(out);
+
+	if (ret)
+		prt_printf(out, "error walking btree: %s\n", bch2_err_str(ret));
+
+	for (int level = depth - 1; level >= 0; --level)
+		btree_shape_level_to_text(out, c, level, levels + level);
+	printbuf_indent_sub(out, 2);
+
+	kfree(levels);
+}
+
 #ifdef CONFIG_DEBUG_FS
 
 /* XXX: bch_fs refcounting */
@@ -447,6 +625,37 @@ static const struct file_operations btree_format_debug_ops = {
 	.read		= bch2_read_btree_formats,
 };
 
+static ssize_t bch2_read_btree_shape(struct file *file, char __user *buf,
+				     size_t size, loff_t *ppos)
+{
+	struct dump_iter *i = file->private_data;
+	ssize_t ret = 0;
+
+	i->ubuf = buf;
+	i->size	= size;
+	i->ret	= 0;
+
+	if (!i->iter) {
+		bch2_trans_run(i->c, (bch2_btree_shape_to_text(&i->buf, trans, i->id), 0));
+		i->iter++;
+	}
+
+	if (i->buf.allocation_failure)
+		ret = -ENOMEM;
+
+	if (!ret)
+		ret = flush_buf(i);
+
+	return ret ?: i->ret;
+}
+
+static const struct file_operations btree_shape_debug_ops = {
+	.owner		= THIS_MODULE,
+	.open		= bch2_dump_open,
+	.release	= bch2_dump_release,
+	.read		= bch2_read_btree_shape,
+};
+
 static ssize_t bch2_read_bfloat_failed(struct file *file, char __user *buf,
 				       size_t size, loff_t *ppos)
 {
@@ -800,6 +1009,8 @@ static ssize_t btree_transaction_stats_read(struct file *file, char __user *buf,
 			printbuf_indent_sub(&i->buf, 2);
 		}
 
+		bch2_btree_trans_restarts_to_text(&i->buf, s);
+
 		if (s->max_paths_text) {
 			prt_printf(&i->buf, "Maximum allocated btree paths (%u):\n", s->nr_max_paths);
 
@@ -893,6 +1104,159 @@ static const struct file_operations btree_deadlock_ops = {
 	.read		= bch2_btree_deadlock_read,
 };
 
+static ssize_t bch2_btree_lock_wait_read(struct file *file, char __user *buf,
+					 size_t size, loff_t *ppos)
+{
+	struct dump_iter *i = file->private_data;
+	struct bch_fs *c = i->c;
+	ssize_t ret = 0;
+
+	i->ubuf = buf;
+	i->size	= size;
+	i->ret	= 0;
+
+	if (!i->iter) {
+		bch2_btree_lock_wait_to_text(&i->buf, c);
+		i->iter++;
+	}
+
+	if (i->buf.allocation_failure)
+		ret = -ENOMEM;
+
+	if (!ret)
+		ret = flush_buf(i);
+
+	return ret ?: i->ret;
+}
+
+static const struct file_operations btree_lock_wait_ops = {
+	.owner		= THIS_MODULE,
+	.open		= bch2_dump_open,
+	.release	= bch2_dump_release,
+	.read		= bch2_btree_lock_wait_read,
+};
+
+static ssize_t bch2_slow_ops_read(struct file *file, char __user *buf,
+				  size_t size, loff_t *ppos)
+{
+	struct dump_iter *i = file->private_data;
+	struct bch_fs *c = i->c;
+	ssize_t ret = 0;
+
+	i->ubuf = buf;
+	i->size	= size;
+	i->ret	= 0;
+
+	if (!i->iter) {
+		bch2_slow_ops_to_text(&i->buf, c);
+		i->iter++;
+	}
+
+	if (i->buf.allocation_failure)
+		ret = -ENOMEM;
+
+	if (!ret)
+		ret = flush_buf(i);
+
+	return ret ?: i->ret;
+}
+
+static const struct file_operations slow_ops_ops = {
+	.owner		= THIS_MODULE,
+	.open		= bch2_dump_open,
+	.release	= bch2_dump_release,
+	.read		= bch2_slow_ops_read,
+};
+
+static ssize_t bch2_lock_profile_read(struct file *file, char __user *buf,
+				      size_t size, loff_t *ppos)
+{
+	struct dump_iter *i = file->private_data;
+	struct bch_fs *c = i->c;
+	ssize_t ret = 0;
+
+	i->ubuf = buf;
+	i->size	= size;
+	i->ret	= 0;
+
+	if (!i->iter) {
+		bch2_lock_profile_to_text(&i->buf, c);
+		i->iter++;
+	}
+
+	if (i->buf.allocation_failure)
+		ret = -ENOMEM;
+
+	if (!ret)
+		ret = flush_buf(i);
+
+	return ret ?: i->ret;
+}
+
+/* Any write resets the profile: */
+static ssize_t bch2_lock_profile_write(struct file *file, const char __user *buf,
+				       size_t size, loff_t *ppos)
+{
+	struct dump_iter *i = file->private_data;
+
+	bch2_lock_profile_reset(i->c);
+	return size;
+}
+
+static const struct file_operations lock_profile_ops = {
+	.owner		= THIS_MODULE,
+	.open		= bch2_dump_open,
+	.release	= bch2_dump_release,
+	.read		= bch2_lock_profile_read,
+	.write		= bch2_lock_profile_write,
+};
+
+/*
+ * Binary: a struct btree_trace_header, then as many struct btree_trace_entry
+ * as are buffered; reading consumes them.
+ */
+static ssize_t bch2_btree_trace_read(struct file *file, char __user *buf,
+				     size_t size, loff_t *ppos)
+{
+	struct dump_iter *i = file->private_data;
+	struct bch_fs *c = i->c;
+	struct btree_trace_entry e[16];
+	size_t copied = 0;
+
+	if (!*ppos) {
+		struct btree_trace_header h;
+
+		if (size < sizeof(h))
+			return -EINVAL;
+
+		bch2_btree_trace_header(c, &h);
+		if (copy_to_user(buf, &h, sizeof(h)))
+			return -EFAULT;
+		copied += sizeof(h);
+	}
+
+	while (size - copied >= sizeof(e[0])) {
+		size_t nr = bch2_btree_trace_pop(c, e,
+				min(ARRAY_SIZE(e), (size - copied) / sizeof(e[0])));
+		if (!nr)
+			break;
+
+		if (copy_to_user(buf + copied, e, nr * sizeof(e[0])))
+			return copied ?: -EFAULT;
+		copied += nr * sizeof(e[0]);
+	}
+
+	*ppos += copied;
+	return copied;
+}
+
+static const struct file_operations btree_trace_ops = {
+	.owner		= THIS_MODULE,
+	.open		= bch2_dump_open,
+	.release	= bch2_dump_release,
+	.read		= bch2_btree_trace_read,
+};
+
 void bch2_fs_debug_exit(struct bch_fs *c)
 {
 	if (!IS_ERR_OR_NULL(c->fs_debug_dir))
@@ -909,6 +1273,8 @@ static void bch2_fs_debug_btree_init(struct bch_fs *c, struct btree_debug *bd)
 
 	debugfs_create_file("formats", 0400, d, bd, &btree_format_debug_ops);
 
+	debugfs_create_file("shape", 0400, d, bd, &btree_shape_debug_ops);
+
 	debugfs_create_file("bfloat-failed", 0400, d, bd,
 			    &bfloat_failed_debug_ops);
 }
@@ -944,6 +1310,18 @@ void bch2_fs_debug_init(struct bch_fs *c)
 	debugfs_create_file("btree_deadlock", 0400, c->fs_debug_dir,
 			    c->btree_debug, &btree_deadlock_ops);
 
+	debugfs_create_file("btree_lock_wait", 0400, c->fs_debug_dir,
+			    c->btree_debug, &btree_lock_wait_ops);
+
+	debugfs_create_file("slow_ops", 0400, c->fs_debug_dir,
+			    c->btree_debug, &slow_ops_ops);
+
+	debugfs_create_file("lock_profile", 0600, c->fs_debug_dir,
+			    c->btree_debug, &lock_profile_ops);
+
+	debugfs_create_file("btree_trace", 0400, c->fs_debug_dir,
+			    c->btree_debug, &btree_trace_ops);
+
 	c->btree_debug_dir = debugfs_create_dir("btrees", c->fs_debug_dir);
 	if (IS_ERR_OR_NULL(c->btree_debug_dir))
 		return;
@@ -11,6 +11,7 @@ struct bch_fs;
 void __bch2_btree_verify(struct bch_fs *, struct btree *);
 void bch2_btree_node_ondisk_to_text(struct printbuf *, struct bch_fs *,
 				    const struct btree *);
+void bch2_btree_shape_to_text(struct printbuf *, struct btree_trans *, enum btree_id);
 
 static inline void bch2_btree_verify(struct bch_fs *c, struct btree *b)
 {
@@ -0,0 +1,420 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Deduplication: find extents with identical contents, and convert them to
+ * reflink pointers to a single shared indirect extent.
+ *
+ * We don't hash data ourselves: checksummed extents already carry a checksum of
+ * their (compressed) data, so extents with the same checksum, checksum type,
+ * compression type and sizes are candidates. Candidates are read back and
+ * compared byte for byte before being deduplicated - a weak checksum type only
+ * costs us extra reads, never correctness.
+ *
+ * The fingerprint index is built in memory for the range being deduplicated,
+ * and sorted so that candidates are adjacent.
+ */
+
+#include "bcachefs.h"
+#include "alloc_foreground.h"
+#include "bkey_buf.h"
+#include "btree_iter.h"
+#include "btree_update.h"
+#include "checksum.h"
+#include "dedup.h"
+#include "errcode.h"
+#include "error.h"
+#include "extents.h"
+#include "move.h"
+#include "reflink.h"
+#include "scrub.h"
+#include "super-io.h"
+
+#include <linux/kthread.h>
+#include <linux/sort.h>
+
+/* Not worth the extra metadata for extents smaller than this: */
+#define DEDUP_MIN_SECTORS	8
+
+struct dedup_fingerprint {
+	struct bch_csum		csum;
+	u32			compressed_size;
+	u32			uncompressed_size;
+	u8			csum_type;
+	u8			compression_type;
+	u8			pad[6];
+};
+
+struct dedup_entry {
+	struct dedup_fingerprint fp;
+	struct bpos		pos;
+};
+
+typedef DARRAY(struct dedup_entry) dedup_entries;
+
+/*
+ * Only whole, unencrypted, checksummed extents are candidates: encrypted
+ * checksums depend on the nonce, so identical data never has the same
+ * checksum.
+ */
+static bool dedup_extent_fingerprint(struct bkey_s_c k, struct dedup_fingerprint *fp,
+				     struct extent_ptr_decoded *ret_p)
+{
+	if (k.k->type != KEY_TYPE_extent ||
+	    k.k->size < DEDUP_MIN_SECTORS ||
+	    bkey_extent_is_unwritten(k))
+		return false;
+
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const union bch_extent_entry *entry;
+	struct extent_ptr_decoded p;
+	bool found = false;
+
+	bkey_for_each_ptr_decode(k.k, ptrs, p, entry)
+		if (!p.ptr.cached) {
+			found = true;
+			break;
+		}
+
+	if (!found ||
+	    !p.crc.csum_type ||
+	    bch2_csum_type_is_encryption(p.crc.csum_type) ||
+	    p.crc.offset ||
+	    p.crc.live_size != p.crc.uncompressed_size)
+		return false;
+
+	memset(fp, 0, sizeof(*fp));
+	fp->csum		= p.crc.csum;
+	fp->compressed_size	= p.crc.compressed_size;
+	fp->uncompressed_size	= p.crc.uncompressed_size;
+	fp->csum_type		= p.crc.csum_type;
+	fp->compression_type	= p.crc.compression_type;
+
+	if (ret_p)
+		*ret_p = p;
+	return true;
+}
+
+static int dedup_entry_cmp(const void *_l, const void *_r)
+{
+	const struct dedup_entry *l = _l, *r = _r;
+
+	return memcmp(&l->fp, &r->fp, sizeof(l->fp)) ?:
+		bpos_cmp(l->pos, r->pos);
+}
+
+static int dedup_collect(struct btree_trans *trans, struct bpos start, struct bpos end,
+			 struct bch_move_stats *stats, dedup_entries *entries)
+{
+	return for_each_btree_key_upto(trans, iter, BTREE_ID_extents, start, end,
+				       BTREE_ITER_prefetch|BTREE_ITER_all_snapshots, k, ({
+		struct dedup_entry e = { .pos = k.k->p };
+
+		atomic64_add(k.k->size, &stats->sectors_seen);
+		stats->pos = BBPOS(BTREE_ID_extents, k.k->p);
+
+		dedup_extent_fingerprint(k, &e.fp, NULL)
+			? darray_push(entries, e)
+			: 0;
+	}));
+}
+
+/*
+ * Get the current key at @pos, and check that it's still a candidate with
+ * fingerprint @fp - and not in a nocow inode, where data is overwritten in
+ * place:
+ */
+static int dedup_get_key(struct btree_trans *trans, struct bpos pos,
+			 struct dedup_fingerprint *fp,
+			 struct bkey_buf *sk, struct extent_ptr_decoded *p)
+{
+	struct btree_iter iter;
+	struct dedup_fingerprint k_fp;
+	struct bch_io_opts io_opts;
+	struct bkey_s_c k = bch2_bkey_get_iter(trans, &iter, BTREE_ID_extents, pos,
+					       BTREE_ITER_all_snapshots|
+					       BTREE_ITER_not_extents);
+	int ret = bkey_err(k);
+	if (ret)
+		return ret;
+
+	if (!bpos_eq(k.k->p, pos) ||
+	    !dedup_extent_fingerprint(k, &k_fp, p) ||
+	    memcmp(&k_fp, fp, sizeof(k_fp))) {
+		ret = 1;
+		goto out;
+	}
+
+	ret = bch2_move_get_io_opts_one(trans, &io_opts, k);
+	if (ret)
+		goto out;
+
+	if (io_opts.nocow) {
+		ret = 1;
+		goto out;
+	}
+
+	bch2_bkey_buf_reassemble(sk, trans->c, k);
+out:
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+static int dedup_read(struct btree_trans *trans, struct extent_ptr_decoded *p, void *buf)
+{
+	struct bch_dev *ca = bch2_dev_get_ioref(trans->c, p->ptr.dev, READ);
+	if (!ca)
+		return 1;
+
+	/* Don't hold btree locks while we do IO: */
+	bch2_trans_unlock_long(trans);
+
+	int ret = bch2_dev_read_sync(ca, p->ptr.offset, buf, p->crc.compressed_size);
+	if (ret)
+		bch2_io_error(ca, BCH_MEMBER_ERROR_read);
+	percpu_ref_put(&ca->io_ref);
+	return ret ? 1 : 0;
+}
+
+/*
+ * Point @dup at the same data as @primary: the first time, @primary is made
+ * into an indirect extent; after that, it's a reflink_p to indirect extent
+ * @idx.
+ *
+ * Returns 1 if @primary has changed since we read it, 2 if @dup has:
+ */
+static int dedup_commit(struct btree_trans *trans,
+			struct bkey_i *primary, struct bkey_i *dup,
+			bool indirect, u64 *idx)
+{
+	struct btree_iter primary_iter, dup_iter = { NULL };
+	struct bkey_s_c k;
+	int ret;
+
+	k = bch2_bkey_get_iter(trans, &primary_iter, BTREE_ID_extents, primary->k.p,
+			       BTREE_ITER_intent|
+			       BTREE_ITER_all_snapshots|
+			       BTREE_ITER_not_extents);
+	ret = bkey_err(k);
+	if (ret)
+		return ret;
+
+	if (!indirect) {
+		if (!bkey_and_val_eq(k, bkey_i_to_s_c(primary))) {
+			ret = 1;
+			goto err;
+		}
+
+		struct bkey_i *n = bch2_trans_kmalloc(trans,
+				max_t(size_t, bkey_bytes(k.k), sizeof(struct bkey_i_reflink_p)));
+		ret = PTR_ERR_OR_ZERO(n);
+		if (ret)
+			goto err;
+
+		bkey_reassemble(n, k);
+
+		ret = bch2_make_extent_indirect(trans, &primary_iter, n);
+		if (ret)
+			goto err;
+
+		*idx = le64_to_cpu(bkey_i_to_reflink_p(n)->v.idx);
+	} else {
+		if (k.k->type != KEY_TYPE_reflink_p ||
+		    k.k->size != primary->k.size ||
+		    le64_to_cpu(bkey_s_c_to_reflink_p(k).v->idx) != *idx) {
+			ret = 1;
+			goto err;
+		}
+	}
+
+	k = bch2_bkey_get_iter(trans, &dup_iter, BTREE_ID_extents, dup->k.p,
+			       BTREE_ITER_intent|
+			       BTREE_ITER_all_snapshots|
+			       BTREE_ITER_not_extents);
+	ret = bkey_err(k);
+	if (ret)
+		goto err;
+
+	if (!bkey_and_val_eq(k, bkey_i_to_s_c(dup))) {
+		ret = 2;
+		goto err;
+	}
+
+	struct bkey_i_reflink_p *r_p = bch2_trans_kmalloc(trans, sizeof(*r_p));
+	ret = PTR_ERR_OR_ZERO(r_p);
+	if (ret)
+		goto err;
+
+	bkey_reflink_p_init(&r_p->k_i);
+	r_p->k.p	= dup->k.p;
+	bch2_key_resize(&r_p->k, dup->k.size);
+	r_p->v.idx	= cpu_to_le64(*idx);
+
+	ret = bch2_trans_update(trans, &dup_iter, &r_p->k_i,
+				BTREE_UPDATE_internal_snapshot_node);
+err:
+	bch2_trans_iter_exit(trans, &dup_iter);
+	bch2_trans_iter_exit(trans, &primary_iter);
+	return ret;
+}
+
+/*
+ * Deduplicate a group of extents with the same fingerprint: the first one we
+ * can read becomes the primary, and every other extent with identical contents
+ * is pointed at it.
+ */
+static int dedup_group(struct moving_context *ctxt,
+		       struct dedup_entry *start, struct dedup_entry *end)
+{
+	struct btree_trans *trans = ctxt->trans;
+	struct bch_fs *c = trans->c;
+	struct bch_move_stats *stats = ctxt->stats;
+	unsigned sectors = start->fp.compressed_size;
+	struct bkey_buf primary, dup;
+	struct extent_ptr_decoded p;
+	void *primary_buf = NULL, *dup_buf = NULL;
+	bool have_primary = false, indirect = false;
+	u64 idx = 0;
+	int ret = 0;
+
+	bch2_bkey_buf_init(&primary);
+	bch2_bkey_buf_init(&dup);
+
+	primary_buf	= kvmalloc(sectors << 9, GFP_KERNEL);
+	dup_buf		= kvmalloc(sectors << 9, GFP_KERNEL);
+	if (!primary_buf || !dup_buf) {
+		ret = -BCH_ERR_ENOMEM_dedup;
+		goto out;
+	}
+
+	for (struct dedup_entry *i = start; i < end; i++) {
+		ret = bch2_move_ratelimit(ctxt);
+		if (ret)
+			break;
+
+		stats->pos = BBPOS(BTREE_ID_extents, i->pos);
+
+		struct bkey_buf *sk = have_primary ? &dup : &primary;
+
+		ret = lockrestart_do(trans, dedup_get_key(trans, i->pos, &i->fp, sk, &p)) ?:
+			dedup_read(trans, &p, have_primary ? dup_buf : primary_buf);
+		if (ret < 0)
+			break;
+		if (ret) {
+			ret = 0;
+			continue;
+		}
+
+		if (ctxt->rate)
+			bch2_ratelimit_increment(ctxt->rate, sectors);
+
+		if (!have_primary) {
+			/* The primary's data is what everything else will point to: */
+			struct bch_csum csum = bch2_checksum(c, p.crc.csum_type,
+						extent_nonce(primary.k->k.version, p.crc),
+						primary_buf, sectors << 9);
+			have_primary = !bch2_crc_cmp(csum, p.crc.csum);
+			continue;
+		}
+
+		if (memcmp(primary_buf, dup_buf, sectors << 9))
+			continue;
+
+		u64 new_idx = idx;
+		ret = commit_do(trans, NULL, NULL, BCH_TRANS_COMMIT_no_enospc,
+				dedup_commit(trans, primary.k, dup.k, indirect, &new_idx));
+		if (ret < 0)
+			break;
+		if (ret) {
+			/* raced with a write: */
+			atomic64_add(dup.k->k.size, &stats->sectors_raced);
+
+			/* if it was the primary that changed, give up on this group: */
+			bool primary_raced = ret == 1;
+			ret = 0;
+			if (primary_raced)
+				break;
+			continue;
+		}
+
+		indirect = true;
+		idx = new_idx;
+		atomic64_inc(&stats->keys_moved);
+		atomic64_add(dup.k->k.size, &stats->sectors_deduped);
+	}
+out:
+	kvfree(dup_buf);
+	kvfree(primary_buf);
+	bch2_bkey_buf_exit(&dup, c);
+	bch2_bkey_buf_exit(&primary, c);
+	return ret;
+}
+
+int bch2_dedup(struct bch_fs *c, struct bbpos start, struct bbpos end,
+	       struct bch_move_stats *stats)
+{
+	bool is_kthread = current->flags & PF_KTHREAD;
+	struct bch_ratelimit rate;
+	struct moving_context ctxt;
+	dedup_entries entries = { 0 };
+	int ret = 0;
+
+	if (!bch2_write_ref_tryget(c, BCH_WRITE_REF_reflink))
+		return -BCH_ERR_erofs_no_writes;
+
+	bch2_check_set_feature(c, BCH_FEATURE_reflink);
+
+	u32 max_rate = READ_ONCE(c->opts.dedup_max_rate);
+	if (max_rate) {
+		rate.rate = max(max_rate >> 9, 1U);
+		bch2_ratelimit_reset(&rate);
+	}
+
+	bch2_moving_ctxt_init(&ctxt, c, max_rate ? &rate : NULL, stats,
+			      writepoint_hashed((unsigned long) current),
+			      false);
+	struct btree_trans *trans = ctxt.trans;
+
+	stats->data_type = BCH_DATA_user;
+
+	struct bpos start_pos	= start.btree == BTREE_ID_extents ? start.pos : POS_MIN;
+	struct bpos end_pos	= end.btree == BTREE_ID_extents ? end.pos : SPOS_MAX;
+
+	if (start.btree > BTREE_ID_extents || end.btree < BTREE_ID_extents)
+		goto out;
+
+	ret = dedup_collect(trans, start_pos, end_pos, stats, &entries);
+	bch_err_msg(c, ret, "building dedup index");
+	if (ret)
+		goto out;
+
+	sort(entries.data, entries.nr, sizeof(entries.data[0]), dedup_entry_cmp, NULL);
+
+	struct dedup_entry *i = entries.data;
+	while (i < &darray_top(entries)) {
+		struct dedup_entry *group_end = i + 1;
+
+		while (group_end < &darray_top(entries) &&
+		       !memcmp(&group_end->fp, &i->fp, sizeof(i->fp)))
+			group_end++;
+
+		if (is_kthread && kthread_should_stop())
+			break;
+
+		if (group_end - i > 1) {
+			ret = dedup_group(&ctxt, i, group_end);
+			if (ret)
+				break;
+		}
+
+		i = group_end;
+	}
+
+	/* kthread stopping: */
+	if (ret > 0)
+		ret = 0;
+out:
+	darray_exit(&entries);
+	bch2_moving_ctxt_exit(&ctxt);
+	bch2_write_ref_put(c, BCH_WRITE_REF_reflink);
+	bch_err_fn(c, ret);
+	return ret;
+}
@@ -0,0 +1,9 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_DEDUP_H
+#define _BCACHEFS_DEDUP_H
+
+struct bch_move_stats;
+
+int bch2_dedup(struct bch_fs *, struct bbpos, struct bbpos, struct bch_move_stats *);
+
+#endif /* _BCACHEFS_DEDUP_H */
@@ -12,6 +12,7 @@
 #include "subvolume.h"
 
 #include <linux/dcache.h>
+#include <linux/sort.h>
 
 static unsigned bch2_dirent_name_bytes(struct bkey_s_c_dirent d)
 {
@@ -40,13 +41,8 @@ struct qstr bch2_dirent_get_name(struct bkey_s_c_dirent d)
 static u64 bch2_dirent_hash(const struct bch_hash_info *info,
 			    const struct qstr *name)
 {
-	struct bch_str_hash_ctx ctx;
-
-	bch2_str_hash_init(&ctx, info);
-	bch2_str_hash_update(&ctx, info, name->name, name->len);
-
 	/* [0,2) reserved for dots */
-	return max_t(u64, bch2_str_hash_end(&ctx, info), 2);
+	return max_t(u64, bch2_str_hash(info, name->name, name->len), 2);
 }
 
 static u64 dirent_hash_key(const struct bch_hash_info *info, const void *key)
@@ -305,7 +301,7 @@ int bch2_dirent_rename(struct btree_trans *trans,
 	/* Lookup src: */
 	old_src = bch2_hash_lookup(trans, &src_iter, bch2_dirent_hash_desc,
 				   src_hash, src_dir, src_name,
-				   BTREE_ITER_intent);
+				   BTREE_ITER_intent|BTREE_ITER_with_updates);
 	ret = bkey_err(old_src);
 	if (ret)
 		goto out;
@@ -329,7 +325,7 @@ int bch2_dirent_rename(struct btree_trans *trans,
 	} else {
 		old_dst = bch2_hash_lookup(trans, &dst_iter, bch2_dirent_hash_desc,
 					    dst_hash, dst_dir, dst_name,
-					    BTREE_ITER_intent);
+					    BTREE_ITER_intent|BTREE_ITER_with_updates);
 		ret = bkey_err(old_dst);
 		if (ret)
 			goto out;
@@ -548,11 +544,55 @@ static int bch2_dir_emit(struct dir_context *ctx, struct bkey_s_c_dirent d, subv
 		      vfs_d_type(d.v->d_type));
 	if (ret)
 		ctx->pos = d.k->p.offset + 1;
-	return ret;
+	/* stop when the buffer is full: */
+	return !ret;
+}
+
+/*
+ * readdir is usually followed by a stat() of every entry: look up the inodes
+ * we're returning ahead of time, in inode number order, so that those stats
+ * find the btree nodes (or key cache entries) they need already in memory:
+ */
+#define READDIR_PREFETCH_INODES		32
+
+struct readdir_prefetch {
+	u32			snapshot;
+	unsigned		nr;
+	u64			inums[READDIR_PREFETCH_INODES];
+};
+
+static int readdir_inum_cmp(const void *_l, const void *_r)
+{
+	const u64 *l = _l, *r = _r;
+
+	return cmp_int(*l, *r);
+}
+
+static int readdir_prefetch_inodes(struct btree_trans *trans, struct readdir_prefetch *p)
+{
+	struct btree_iter iter;
+	int ret = 0;
+
+	sort(p->inums, p->nr, sizeof(p->inums[0]), readdir_inum_cmp, NULL);
+
+	bch2_trans_iter_init(trans, &iter, BTREE_ID_inodes, POS_MIN, BTREE_ITER_cached);
+	for (unsigned i = 0; i < p->nr && !ret; i++) {
+		bch2_btree_iter_set_pos(&iter, SPOS(0, p->inums[i], p->snapshot));
+		ret = bkey_err(bch2_btree_iter_peek_slot(&iter));
+	}
+	bch2_trans_iter_exit(trans, &iter);
+
+	/* Only a hint - but transaction restarts have to be passed up: */
+	if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+		return ret;
+
+	p->nr = 0;
+	return 0;
 }
 
 int bch2_readdir(struct bch_fs *c, subvol_inum inum, struct dir_context *ctx)
 {
+	struct readdir_prefetch prefetch = { .nr = 0 };
 	struct bkey_buf sk;
 	bch2_bkey_buf_init(&sk);
 
@@ -573,8 +613,20 @@ int bch2_readdir(struct bch_fs *c, subvol_inum inum, struct dir_context *ctx)
 			if (ret2 > 0)
 				continue;
 
-			ret2 ?: drop_locks_do(trans, bch2_dir_emit(ctx, dirent, target));
-		})));
+			/* before emitting, so that a restart here doesn't emit twice: */
+			if (!ret2 && prefetch.nr == ARRAY_SIZE(prefetch.inums))
+				ret2 = readdir_prefetch_inodes(trans, &prefetch);
+
+			ret2 = ret2 ?: drop_locks_do(trans, bch2_dir_emit(ctx, dirent, target));
+
+			/* subvolume roots are in a different snapshot, skip them: */
+			if (!ret2 && target.subvol == inum.subvol) {
+				prefetch.snapshot = iter.snapshot;
+				prefetch.inums[prefetch.nr++] = target.inum;
+			}
+			ret2;
+		})) ?:
+		lockrestart_do(trans, readdir_prefetch_inodes(trans, &prefetch)));
 
 	bch2_bkey_buf_exit(&sk, c);
 
@@ -79,6 +79,30 @@ static inline void accounting_key_init(struct bkey_i *k, struct disk_accounting_
 	memcpy_u64s_small(acc->v.d, d, nr);
 }
 
+/*
+ * A transaction often updates the same counters more than once (e.g. the same
+ * replicas entry for several extents): merge into the delta this transaction
+ * already has for that counter, instead of journalling - and applying at
+ * commit time - one delta per update:
+ */
+static bool accounting_trans_accumulate(struct btree_trans *trans,
+					struct bkey_i_accounting *a)
+{
+	for (struct jset_entry *i = trans->journal_entries;
+	     i != btree_trans_journal_entries_top(trans);
+	     i = vstruct_next(i))
+		if (i->type == BCH_JSET_ENTRY_write_buffer_keys &&
+		    i->btree_id == BTREE_ID_accounting &&
+		    i->start->k.type == KEY_TYPE_accounting &&
+		    bpos_eq(i->start->k.p, a->k.p)) {
+			bch2_accounting_accumulate(bkey_i_to_accounting(i->start),
+						   accounting_i_to_s_c(a));
+			return true;
+		}
+
+	return false;
+}
+
 int bch2_disk_accounting_mod(struct btree_trans *trans,
 			     struct disk_accounting_pos *k,
 			     s64 *d, unsigned nr, bool gc)
@@ -96,9 +120,13 @@ int bch2_disk_accounting_mod(struct btree_trans *trans,
 
 	accounting_key_init(&k_i.k, k, d, nr);
 
-	return likely(!gc)
-		? bch2_trans_update_buffered(trans, BTREE_ID_accounting, &k_i.k)
-		: bch2_accounting_mem_add(trans, bkey_i_to_s_c_accounting(&k_i.k), true);
+	if (unlikely(gc))
+		return bch2_accounting_mem_add(trans, bkey_i_to_s_c_accounting(&k_i.k), true);
+
+	if (accounting_trans_accumulate(trans, bkey_i_to_accounting(&k_i.k)))
+		return 0;
+
+	return bch2_trans_update_buffered(trans, BTREE_ID_accounting, &k_i.k);
 }
 
 int bch2_mod_dev_cached_sectors(struct btree_trans *trans,
@@ -153,6 +181,9 @@ void bch2_accounting_key_to_text(struct printbuf *out, struct disk_accounting_po
 	case BCH_DISK_ACCOUNTING_btree:
 		prt_printf(out, "btree=%s", bch2_btree_id_str(k->btree.id));
 		break;
+	case BCH_DISK_ACCOUNTING_rebalance_work_target:
+		prt_printf(out, "target=%u", k->rebalance_work_target.target);
+		break;
 	}
 }
 
@@ -218,43 +249,58 @@ int bch2_accounting_update_sb(struct btree_trans *trans)
 	return 0;
 }
 
-static int __bch2_accounting_mem_insert(struct bch_fs *c, struct bkey_s_c_accounting a)
+static int accounting_mem_entry_init(struct bch_accounting_mem *acc,
+				     struct accounting_mem_entry *n,
+				     struct bkey_s_c_accounting a)
 {
-	struct bch_accounting_mem *acc = &c->accounting;
-
-	/* raced with another insert, already present: */
-	if (eytzinger0_find(acc->k.data, acc->k.nr, sizeof(acc->k.data[0]),
-			    accounting_pos_cmp, &a.k->p) < acc->k.nr)
-		return 0;
-
-	struct accounting_mem_entry n = {
+	*n = (struct accounting_mem_entry) {
 		.pos		= a.k->p,
 		.version	= a.k->version,
 		.nr_counters	= bch2_accounting_counters(a.k),
-		.v[0]		= __alloc_percpu_gfp(n.nr_counters * sizeof(u64),
-						     sizeof(u64), GFP_KERNEL),
 	};
 
-	if (!n.v[0])
+	n->v[0] = __alloc_percpu_gfp(n->nr_counters * sizeof(u64),
+				     sizeof(u64), GFP_KERNEL);
+	if (!n->v[0])
 		goto err;
 
 	if (acc->gc_running) {
-		n.v[1] = __alloc_percpu_gfp(n.nr_counters * sizeof(u64),
-					    sizeof(u64), GFP_KERNEL);
-		if (!n.v[1])
+		n->v[1] = __alloc_percpu_gfp(n->nr_counters * sizeof(u64),
+					     sizeof(u64), GFP_KERNEL);
+		if (!n->v[1])
 			goto err;
 	}
 
-	if (darray_push(&acc->k, n))
-		goto err;
+	return 0;
+err:
+	free_percpu(n->v[1]);
+	free_percpu(n->v[0]);
+	return -BCH_ERR_ENOMEM_disk_accounting;
+}
+
+static int __bch2_accounting_mem_insert(struct bch_fs *c, struct bkey_s_c_accounting a)
+{
+	struct bch_accounting_mem *acc = &c->accounting;
+	struct accounting_mem_entry n;
+
+	/* raced with another insert, already present: */
+	if (eytzinger0_find(acc->k.data, acc->k.nr, sizeof(acc->k.data[0]),
+			    accounting_pos_cmp, &a.k->p) < acc->k.nr)
+		return 0;
+
+	int ret = accounting_mem_entry_init(acc, &n, a);
+	if (ret)
+		return ret;
+
+	if (darray_push(&acc->k, n)) {
+		free_percpu(n.v[1]);
+		free_percpu(n.v[0]);
+		return -BCH_ERR_ENOMEM_disk_accounting;
+	}
 
 	eytzinger0_sort(acc->k.data, acc->k.nr, sizeof(acc->k.data[0]),
 			accounting_pos_cmp, NULL);
 	return 0;
-err:
-	free_percpu(n.v[1]);
-	free_percpu(n.v[0]);
-	return -BCH_ERR_ENOMEM_disk_accounting;
 }
 
 int bch2_accounting_mem_insert(struct bch_fs *c, struct bkey_s_c_accounting a, bool gc)
@@ -387,6 +433,89 @@ int bch2_fs_accounting_read(struct bch_fs *c, darray_char *out_buf, unsigned acc
 	return ret;
 }
 
+static bool accounting_filter_match(const struct bch_accounting_filter *f,
+				    struct disk_accounting_pos *a_p)
+{
+	if (!(f->types_mask & BIT(a_p->type)))
+		return false;
+
+	switch (a_p->type) {
+	case BCH_DISK_ACCOUNTING_replicas:
+		if (f->dev < 0)
+			return true;
+		for (unsigned i = 0; i < a_p->replicas.nr_devs; i++)
+			if (a_p->replicas.devs[i] == f->dev)
+				return true;
+		return false;
+	case BCH_DISK_ACCOUNTING_dev_data_type:
+		return f->dev < 0 || a_p->dev_data_type.dev == f->dev;
+	case BCH_DISK_ACCOUNTING_snapshot:
+		return a_p->snapshot.id >= f->snapshot_start &&
+			a_p->snapshot.id <= f->snapshot_end;
+	default:
+		return true;
+	}
+}
+
+/*
+ * Read accounting keys matching @f, in sorted order from @pos, until
+ * @max_bytes would be exceeded: @pos is left where the next read should start,
+ * or SPOS_MAX when done. Returns -ERANGE if the first key doesn't fit.
+ */
+int bch2_fs_accounting_read_filtered(struct bch_fs *c, darray_char *out_buf,
+				     size_t max_bytes,
+				     const struct bch_accounting_filter *f,
+				     struct bpos *pos)
+{
+	struct bch_accounting_mem *acc = &c->accounting;
+	int ret = 0;
+
+	darray_init(out_buf);
+
+	percpu_down_read(&c->mark_lock);
+	unsigned idx = eytzinger0_find_ge(acc->k.data, acc->k.nr, sizeof(acc->k.data[0]),
+					  accounting_pos_cmp, pos);
+
+	for (; idx < acc->k.nr; idx = eytzinger0_next(idx, acc->k.nr)) {
+		struct accounting_mem_entry *i = acc->k.data + idx;
+		struct disk_accounting_pos a_p;
+		bpos_to_disk_accounting_pos(&a_p, i->pos);
+
+		if (!accounting_filter_match(f, &a_p))
+			continue;
+
+		size_t bytes = sizeof(struct bkey_i_accounting) + sizeof(u64) * i->nr_counters;
+		if (out_buf->nr + bytes > max_bytes) {
+			/* not even one key fits: */
+			if (!out_buf->nr)
+				ret = -ERANGE;
+			*pos = i->pos;
+			goto out;
+		}
+
+		ret = darray_make_room(out_buf, bytes);
+		if (ret)
+			goto out;
+
+		struct bkey_i_accounting *a_out =
+			bkey_accounting_init((void *) &darray_top(*out_buf));
+		set_bkey_val_u64s(&a_out->k, i->nr_counters);
+		a_out->k.p = i->pos;
+		bch2_accounting_mem_read_counters(acc, idx, a_out->v.d, i->nr_counters, false);
+
+		if (!bch2_accounting_key_is_zero(accounting_i_to_s_c(a_out)))
+			out_buf->nr += bkey_bytes(&a_out->k);
+	}
+
+	*pos = SPOS_MAX;
+out:
+	percpu_up_read(&c->mark_lock);
+
+	if (ret)
+		darray_exit(out_buf);
+	return ret;
+}
+
 void bch2_fs_accounting_to_text(struct printbuf *out, struct bch_fs *c)
 {
 	struct bch_accounting_mem *acc = &c->accounting;
@@ -521,17 +650,58 @@ fsck_err:
 	return ret;
 }
 
-static int accounting_read_key(struct btree_trans *trans, struct bkey_s_c k)
+/*
+ * Keys in the accounting btree are all distinct, and walked in order: instead
+ * of inserting them into the in memory table (resorting it each time) they're
+ * collected into @bulk, and added all at once when the walk is done.
+ */
+static int accounting_read_key_bulk(struct bch_fs *c, struct bkey_s_c_accounting a,
+				    darray_accounting_mem_entry *bulk)
+{
+	struct bch_replicas_padded r;
+	struct accounting_mem_entry n;
+
+	percpu_down_read(&c->mark_lock);
+	bool marked = !accounting_to_replicas(&r.e, a.k->p) ||
+		bch2_replicas_marked_locked(c, &r.e);
+	percpu_up_read(&c->mark_lock);
+
+	if (!marked)
+		return -BCH_ERR_btree_insert_need_mark_replicas;
+
+	int ret = accounting_mem_entry_init(&c->accounting, &n, a);
+	if (ret)
+		return ret;
+
+	for (unsigned i = 0; i < n.nr_counters; i++)
+		percpu_u64_set(n.v[0] + i, a.v->d[i]);
+
+	if (darray_push(bulk, n)) {
+		free_percpu(n.v[1]);
+		free_percpu(n.v[0]);
+		return -BCH_ERR_ENOMEM_disk_accounting;
+	}
+
+	return 0;
+}
+
+static int accounting_read_key(struct btree_trans *trans, struct bkey_s_c k,
+			       darray_accounting_mem_entry *bulk)
 {
 	struct bch_fs *c = trans->c;
 	struct printbuf buf = PRINTBUF;
+	int ret;
 
 	if (k.k->type != KEY_TYPE_accounting)
 		return 0;
 
-	percpu_down_read(&c->mark_lock);
-	int ret = __bch2_accounting_mem_mod(c, bkey_s_c_to_accounting(k), false);
-	percpu_up_read(&c->mark_lock);
+	if (bulk) {
+		ret = accounting_read_key_bulk(c, bkey_s_c_to_accounting(k), bulk);
+	} else {
+		percpu_down_read(&c->mark_lock);
+		ret = __bch2_accounting_mem_mod(c, bkey_s_c_to_accounting(k), false);
+		percpu_up_read(&c->mark_lock);
+	}
 
 	if (bch2_accounting_key_is_zero(bkey_s_c_to_accounting(k)) &&
 	    ret == -BCH_ERR_btree_insert_need_mark_replicas)
@@ -559,14 +729,42 @@ int bch2_accounting_read(struct bch_fs *c)
 {
 	struct bch_accounting_mem *acc = &c->accounting;
 	struct btree_trans *trans = bch2_trans_get(c);
+	darray_accounting_mem_entry bulk = {};
+	/* entries already in the table must be added to, not duplicated: */
+	darray_accounting_mem_entry *bulk_p = !acc->k.nr ? &bulk : NULL;
 
 	int ret = for_each_btree_key(trans, iter,
 				BTREE_ID_accounting, POS_MIN,
 				BTREE_ITER_prefetch|BTREE_ITER_all_snapshots, k, ({
 			struct bkey u;
 			struct bkey_s_c k = bch2_btree_path_peek_slot_exact(btree_iter_path(trans, &iter), &u);
-			accounting_read_key(trans, k);
+			accounting_read_key(trans, k, bulk_p);
 		}));
+	if (ret) {
+		darray_for_each(bulk, i) {
+			free_percpu(i->v[1]);
+			free_percpu(i->v[0]);
+		}
+		darray_exit(&bulk);
+		goto err;
+	}
+
+	percpu_down_write(&c->mark_lock);
+	ret = darray_make_room(&acc->k, bulk.nr);
+	if (!ret) {
+		memcpy(&darray_top(acc->k), bulk.data, bulk.nr * sizeof(bulk.data[0]));
+		acc->k.nr += bulk.nr;
+		eytzinger0_sort(acc->k.data, acc->k.nr, sizeof(acc->k.data[0]),
+				accounting_pos_cmp, NULL);
+	} else {
+		darray_for_each(bulk, i) {
+			free_percpu(i->v[1]);
+			free_percpu(i->v[0]);
+		}
+		ret = -BCH_ERR_ENOMEM_disk_accounting;
+	}
+	percpu_up_write(&c->mark_lock);
+	darray_exit(&bulk);
 	if (ret)
 		goto err;
 
@@ -599,7 +797,7 @@ int bch2_accounting_read(struct bch_fs *c)
 				continue;
 			}
 
-			ret = accounting_read_key(trans, k);
+			ret = accounting_read_key(trans, k, NULL);
 			if (ret)
 				goto err;
 		}
@@ -607,6 +805,7 @@ int bch2_accounting_read(struct bch_fs *c)
 		*dst++ = *i;
 	}
 	keys->gap = keys->nr = dst - keys->data;
+	bch2_journal_keys_index_build(keys);
 
 	percpu_down_read(&c->mark_lock);
 	preempt_disable();
@@ -201,6 +201,18 @@ static inline void bch2_accounting_mem_read(struct bch_fs *c, struct bpos p,
 
 int bch2_fs_replicas_usage_read(struct bch_fs *, darray_char *);
 int bch2_fs_accounting_read(struct bch_fs *, darray_char *, unsigned);
+
+struct bch_accounting_filter {
+	unsigned		types_mask;
+	/* -1 for all devices: */
+	int			dev;
+	u32			snapshot_start;
+	u32			snapshot_end;
+};
+
+int bch2_fs_accounting_read_filtered(struct bch_fs *, darray_char *, size_t,
+				     const struct bch_accounting_filter *,
+				     struct bpos *);
 void bch2_fs_accounting_to_text(struct printbuf *, struct bch_fs *);
 
 int bch2_gc_accounting_start(struct bch_fs *);
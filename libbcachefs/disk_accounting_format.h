@@ -103,7 +103,8 @@ static inline bool data_type_is_hidden(enum bch_data_type type)
 	x(compression,		4)		\
 	x(snapshot,		5)		\
 	x(btree,		6)		\
-	x(rebalance_work,	7)
+	x(rebalance_work,	7)		\
+	x(rebalance_work_target, 8)
 
 enum disk_accounting_type {
 #define x(f, nr)	BCH_DISK_ACCOUNTING_##f	= nr,
@@ -140,6 +141,14 @@ struct bch_acct_btree {
 	__u32			id;
 };
 
+/*
+ * Sectors waiting to be moved by rebalance, by the target they're being moved
+ * to - i.e. dirty data in a writeback cache:
+ */
+struct bch_acct_rebalance_work_target {
+	__u16			target;
+};
+
 struct disk_accounting_pos {
 	union {
 	struct {
@@ -153,6 +162,7 @@ struct disk_accounting_pos {
 		struct bch_acct_compression	compression;
 		struct bch_acct_snapshot	snapshot;
 		struct bch_acct_btree		btree;
+		struct bch_acct_rebalance_work_target rebalance_work_target;
 		};
 	};
 		struct bpos			_pad;
@@ -11,8 +11,10 @@ struct accounting_mem_entry {
 	u64 __percpu				*v[2];
 };
 
+typedef DARRAY(struct accounting_mem_entry) darray_accounting_mem_entry;
+
 struct bch_accounting_mem {
-	DARRAY(struct accounting_mem_entry)	k;
+	darray_accounting_mem_entry		k;
 	bool					gc_running;
 };
 
@@ -13,17 +13,22 @@
 #include "btree_write_buffer.h"
 #include "buckets.h"
 #include "checksum.h"
+#include "clock.h"
 #include "disk_accounting.h"
 #include "disk_groups.h"
 #include "ec.h"
 #include "error.h"
 #include "io_read.h"
 #include "keylist.h"
+#include "move.h"
 #include "recovery.h"
 #include "replicas.h"
 #include "super-io.h"
 #include "util.h"
 
+#include <linux/freezer.h>
+#include <linux/kthread.h>
+#include <linux/sched/task.h>
 #include <linux/sort.h>
 
 #ifdef __KERNEL__
@@ -50,17 +55,175 @@ static void raid5_recov(unsigned disks, unsigned failed_idx,
 	swap(data[0], data[failed_idx]);
 }
 
+/*
+ * Beyond P and Q, the userspace raid library (raid/raid.c) computes parity
+ * blocks from further rows of a Cauchy matrix whose first two rows are the
+ * RAID5/RAID6 coefficients. The kernel raid6 library stops at Q, so stripes
+ * with more parity blocks than that use a generic (bytewise, slow) GF(2^8)
+ * implementation with the same coefficients, keeping the on disk format the
+ * same between the two:
+ */
+static const u8 ec_gfcauchy[BCH_EC_PARITY_MAX - 2][BCH_BKEY_PTRS_MAX] = {
+	{ 0x01, 0xf5, 0xd2, 0xc4, 0x9a, 0x71, 0xf1, 0x7f,
+	  0xfc, 0x87, 0xc1, 0xc6, 0x19, 0x2f, 0x40, 0x55 },
+};
+
+static inline u8 ec_coef(unsigned p, unsigned d)
+{
+	switch (p) {
+	case 0:
+		return 1;
+	case 1:
+		return raid6_gfexp[d];
+	default:
+		return ec_gfcauchy[p - 2][d];
+	}
+}
+
+/* dst ^= coef * src */
+static void ec_gfmul_add(u8 *dst, const u8 *src, u8 coef, size_t size)
+{
+	const u8 *mul = raid6_gfmul[coef];
+
+	for (size_t i = 0; i < size; i++)
+		dst[i] ^= mul[src[i]];
+}
+
+static void ec_gen_parity(int nd, unsigned p, size_t size, void **v)
+{
+	u8 *dst = v[nd + p];
+
+	memset(dst, 0, size);
+	for (unsigned d = 0; d < nd; d++)
+		ec_gfmul_add(dst, v[d], ec_coef(p, d), size);
+}
+
+/* Gauss-Jordan elimination in GF(2^8); @m is destroyed */
+static void ec_gf_invert(u8 m[][BCH_EC_PARITY_MAX],
+			 u8 inv[][BCH_EC_PARITY_MAX], unsigned n)
+{
+	for (unsigned i = 0; i < n; i++)
+		for (unsigned j = 0; j < n; j++)
+			inv[i][j] = i == j;
+
+	for (unsigned col = 0; col < n; col++) {
+		unsigned pivot = col;
+
+		while (!m[pivot][col]) {
+			pivot++;
+			/* Cauchy submatrices are never singular */
+			BUG_ON(pivot >= n);
+		}
+
+		for (unsigned j = 0; j < n; j++) {
+			swap(m[col][j],		m[pivot][j]);
+			swap(inv[col][j],	inv[pivot][j]);
+		}
+
+		u8 f = raid6_gfinv[m[col][col]];
+		for (unsigned j = 0; j < n; j++) {
+			m[col][j]	= raid6_gfmul[f][m[col][j]];
+			inv[col][j]	= raid6_gfmul[f][inv[col][j]];
+		}
+
+		for (unsigned r = 0; r < n; r++) {
+			if (r == col || !m[r][col])
+				continue;
+
+			f = m[r][col];
+			for (unsigned j = 0; j < n; j++) {
+				m[r][j]		^= raid6_gfmul[f][m[col][j]];
+				inv[r][j]	^= raid6_gfmul[f][inv[col][j]];
+			}
+		}
+	}
+}
+
+static void ec_rec_generic(int nr, int *ir, int nd, int np, size_t size, void **v)
+{
+	u8 m[BCH_EC_PARITY_MAX][BCH_EC_PARITY_MAX];
+	u8 inv[BCH_EC_PARITY_MAX][BCH_EC_PARITY_MAX];
+	unsigned id[BCH_EC_PARITY_MAX], ip[BCH_EC_PARITY_MAX];
+	unsigned nrd = 0, nrp = 0, i, j, k, d;
+	unsigned long failed_parity = 0;
+
+	BUG_ON(nr > np);
+
+	for (i = 0; i < nr; i++)
+		if (ir[i] < nd)
+			id[nrd++] = ir[i];
+		else
+			__set_bit(ir[i] - nd, &failed_parity);
+
+	/* Pick the first parity blocks that we have to solve for the data: */
+	for (i = 0; i < np && nrp < nrd; i++)
+		if (!test_bit(i, &failed_parity))
+			ip[nrp++] = i;
+	BUG_ON(nrp < nrd);
+
+	/*
+	 * For each parity block used, the difference between it and the parity
+	 * of the data we have is a combination of just the missing data blocks;
+	 * compute those differences in place of the missing data:
+	 */
+	for (j = 0; j < nrd; j++) {
+		u8 *dst = v[id[j]];
+
+		memcpy(dst, v[nd + ip[j]], size);
+
+		for (d = 0, k = 0; d < nd; d++) {
+			if (k < nrd && id[k] == d) {
+				k++;
+				continue;
+			}
+			ec_gfmul_add(dst, v[d], ec_coef(ip[j], d), size);
+		}
+	}
+
+	for (j = 0; j < nrd; j++)
+		for (k = 0; k < nrd; k++)
+			m[j][k] = ec_coef(ip[j], id[k]);
+
+	ec_gf_invert(m, inv, nrd);
+
+	for (size_t b = 0; b < size; b++) {
+		u8 delta[BCH_EC_PARITY_MAX];
+
+		for (j = 0; j < nrd; j++)
+			delta[j] = ((u8 *) v[id[j]])[b];
+
+		for (k = 0; k < nrd; k++) {
+			u8 x = 0;
+
+			for (j = 0; j < nrd; j++)
+				x ^= raid6_gfmul[inv[k][j]][delta[j]];
+			((u8 *) v[id[k]])[b] = x;
+		}
+	}
+
+	for_each_set_bit(i, &failed_parity, np)
+		ec_gen_parity(nd, i, size, v);
+}
+
 static void raid_gen(int nd, int np, size_t size, void **v)
 {
+	BUG_ON(np > BCH_EC_PARITY_MAX);
+
 	if (np >= 1)
-		raid5_recov(nd + np, nd, size, v);
+		raid5_recov(nd + 1, nd, size, v);
 	if (np >= 2)
-		raid6_call.gen_syndrome(nd + np, size, v);
-	BUG_ON(np > 2);
+		raid6_call.gen_syndrome(nd + 2, size, v);
+	for (unsigned p = 2; p < np; p++)
+		ec_gen_parity(nd, p, size, v);
 }
 
 static void raid_rec(int nr, int *ir, int nd, int np, size_t size, void **v)
 {
+	if (np > 2) {
+		ec_rec_generic(nr, ir, nd, np, size, v);
+		return;
+	}
+
 	switch (nr) {
 	case 0:
 		break;
@@ -124,6 +287,13 @@ int bch2_stripe_invalid(struct bch_fs *c, struct bkey_s_c k,
 			 "incorrect value size (%zu < %u)",
 			 bkey_val_u64s(k.k), stripe_val_u64s(s));
 
+	bkey_fsck_err_on(!s->nr_redundant ||
+			 s->nr_redundant > BCH_EC_PARITY_MAX ||
+			 s->nr_redundant >= s->nr_blocks, c, err,
+			 stripe_redundancy_bad,
+			 "invalid redundancy %u (nr_blocks %u, max %u)",
+			 s->nr_redundant, s->nr_blocks, BCH_EC_PARITY_MAX);
+
 	ret = bch2_bkey_ptrs_invalid(c, k, flags, err);
 fsck_err:
 	return ret;
@@ -594,10 +764,10 @@ static struct bch_csum ec_block_checksum(struct ec_stripe_buf *buf,
 			     len << 9);
 }
 
-static void ec_generate_checksums(struct ec_stripe_buf *buf)
+static void ec_generate_block_checksums(struct ec_stripe_buf *buf, unsigned block)
 {
 	struct bch_stripe *v = &bkey_i_to_stripe(&buf->key)->v;
-	unsigned i, j, csums_per_device = stripe_csums_per_device(v);
+	unsigned j, csums_per_device = stripe_csums_per_device(v);
 
 	if (!v->csum_type)
 		return;
@@ -605,10 +775,29 @@ static void ec_generate_checksums(struct ec_stripe_buf *buf)
 	BUG_ON(buf->offset);
 	BUG_ON(buf->size != le16_to_cpu(v->sectors));
 
-	for (i = 0; i < v->nr_blocks; i++)
-		for (j = 0; j < csums_per_device; j++)
-			stripe_csum_set(v, i, j,
-				ec_block_checksum(buf, i, j << v->csum_granularity_bits));
+	for (j = 0; j < csums_per_device; j++)
+		stripe_csum_set(v, block, j,
+			ec_block_checksum(buf, block, j << v->csum_granularity_bits));
+}
+
+/* @start must be aligned to checksum granularity: */
+static void ec_generate_checksums(struct ec_stripe_buf *buf,
+				  unsigned start, unsigned end)
+{
+	struct bch_stripe *v = &bkey_i_to_stripe(&buf->key)->v;
+	unsigned csum_granularity = 1U << v->csum_granularity_bits;
+
+	if (!v->csum_type)
+		return;
+
+	BUG_ON(buf->offset);
+	BUG_ON(buf->size != le16_to_cpu(v->sectors));
+	BUG_ON(start & (csum_granularity - 1));
+
+	for (unsigned i = 0; i < v->nr_blocks; i++)
+		for (unsigned j = start; j < end; j += csum_granularity)
+			stripe_csum_set(v, i, j >> v->csum_granularity_bits,
+					ec_block_checksum(buf, i, j));
 }
 
 static void ec_validate_checksums(struct bch_fs *c, struct ec_stripe_buf *buf)
@@ -659,13 +848,67 @@ static void ec_validate_checksums(struct bch_fs *c, struct ec_stripe_buf *buf)
 
 /* Erasure coding: */
 
-static void ec_generate_ec(struct ec_stripe_buf *buf)
+/* Generate parity for sectors [@start, @end) of each block: */
+static void ec_generate_ec(struct ec_stripe_buf *buf, unsigned start, unsigned end)
 {
 	struct bch_stripe *v = &bkey_i_to_stripe(&buf->key)->v;
 	unsigned nr_data = v->nr_blocks - v->nr_redundant;
+	void *data[BCH_BKEY_PTRS_MAX];
+
+	if (start >= end)
+		return;
+
+	for (unsigned i = 0; i < v->nr_blocks; i++)
+		data[i] = buf->data[i] + (start << 9);
+
+	raid_gen(nr_data, v->nr_redundant, (end - start) << 9, data);
+}
+
+static void ec_block_xor(void *dst, const void *src, size_t bytes)
+{
+	unsigned long *d = dst;
+	const unsigned long *s = src;
+
+	for (size_t i = 0; i < bytes / sizeof(*d); i++)
+		d[i] ^= s[i];
+}
+
+/*
+ * Parity is linear in the data blocks, so when only some data blocks of a
+ * stripe change the new parity is the old parity plus the parity of just the
+ * differences: we don't need the contents of the blocks that stay the same.
+ *
+ * @old has the old parity and the old contents of the changed blocks, @new has
+ * the new contents of the changed blocks; both are clobbered, and the new
+ * parity is left in @new:
+ */
+static void ec_generate_ec_delta(struct ec_stripe_buf *new,
+				 struct ec_stripe_buf *old,
+				 unsigned long *changed)
+{
+	struct bch_stripe *v = &bkey_i_to_stripe(&new->key)->v;
+	unsigned nr_data = v->nr_blocks - v->nr_redundant;
 	unsigned bytes = le16_to_cpu(v->sectors) << 9;
+	void *delta[BCH_BKEY_PTRS_MAX];
+	unsigned i;
+
+	for (i = 0; i < nr_data; i++)
+		if (test_bit(i, changed)) {
+			ec_block_xor(old->data[i], new->data[i], bytes);
+			delta[i] = old->data[i];
+		} else {
+			/* unchanged blocks weren't read, buffer is scratch: */
+			memset(new->data[i], 0, bytes);
+			delta[i] = new->data[i];
+		}
 
-	raid_gen(nr_data, v->nr_redundant, bytes, buf->data);
+	for (i = nr_data; i < v->nr_blocks; i++)
+		delta[i] = new->data[i];
+
+	raid_gen(nr_data, v->nr_redundant, bytes, delta);
+
+	for (i = nr_data; i < v->nr_blocks; i++)
+		ec_block_xor(new->data[i], old->data[i], bytes);
 }
 
 static unsigned ec_nr_failed(struct ec_stripe_buf *buf)
@@ -688,7 +931,11 @@ static int ec_do_recov(struct bch_fs *c, struct ec_stripe_buf *buf)
 		return -1;
 	}
 
-	for (i = 0; i < nr_data; i++)
+	/*
+	 * Failed parity blocks have to be passed too, so that raid_rec() doesn't
+	 * use them for reconstructing data:
+	 */
+	for (i = 0; i < v->nr_blocks; i++)
 		if (!test_bit(i, buf->valid))
 			failed[nr_failed++] = i;
 
@@ -823,7 +1070,8 @@ int bch2_ec_read_extent(struct btree_trans *trans, struct bch_read_bio *rbio)
 	struct ec_stripe_buf *buf;
 	struct closure cl;
 	struct bch_stripe *v;
-	unsigned i, offset;
+	unsigned i, offset, nr_data, nr_good = 0, next = 0;
+	u8 order[BCH_BKEY_PTRS_MAX];
 	int ret = 0;
 
 	closure_init_stack(&cl);
@@ -863,20 +1111,44 @@ int bch2_ec_read_extent(struct btree_trans *trans, struct bch_read_bio *rbio)
 	if (ret)
 		goto err;
 
+	/*
+	 * Any nr_data good blocks are enough to reconstruct from: start with the
+	 * other data blocks and only as much parity as we need, and only read
+	 * more if some of those fail. The block we're reconstructing already
+	 * failed, so it goes last:
+	 */
+	nr_data = v->nr_blocks - v->nr_redundant;
+
 	for (i = 0; i < v->nr_blocks; i++)
-		ec_block_io(c, buf, REQ_OP_READ, i, &cl);
+		if (i != rbio->pick.ec.block)
+			order[next++] = i;
+	order[next] = rbio->pick.ec.block;
+	next = 0;
 
-	closure_sync(&cl);
+	memset(buf->valid, 0, sizeof(buf->valid));
 
-	if (ec_nr_failed(buf) > v->nr_redundant) {
+	while (nr_good < nr_data && next < v->nr_blocks) {
+		unsigned nr_read = nr_data - nr_good;
+
+		for (; nr_read && next < v->nr_blocks; nr_read--, next++) {
+			set_bit(order[next], buf->valid);
+			ec_block_io(c, buf, REQ_OP_READ, order[next], &cl);
+		}
+
+		closure_sync(&cl);
+
+		ec_validate_checksums(c, buf);
+
+		nr_good = bitmap_weight(buf->valid, v->nr_blocks);
+	}
+
+	if (nr_good < nr_data) {
 		bch_err_ratelimited(c,
 			"error doing reconstruct read: unable to read enough blocks");
 		ret = -EIO;
 		goto err;
 	}
 
-	ec_validate_checksums(c, buf);
-
 	ret = ec_do_recov(c, buf);
 	if (ret)
 		goto err;
@@ -1415,6 +1687,68 @@ void bch2_ec_stripe_new_free(struct bch_fs *c, struct ec_stripe_new *s)
 	kfree(s);
 }
 
+/*
+ * Blocks of an existing stripe that are being kept as is when reusing it - we
+ * only read these when doing a full parity recompute:
+ */
+static void ec_stripe_unchanged_blocks(struct ec_stripe_new *s, unsigned long *unchanged)
+{
+	struct bch_stripe *v = &bkey_i_to_stripe(&s->existing_stripe.key)->v;
+	unsigned nr_data = v->nr_blocks - v->nr_redundant;
+
+	bitmap_zero(unchanged, BCH_BKEY_PTRS_MAX);
+
+	for (unsigned i = 0; i < nr_data; i++)
+		if (stripe_blockcount_get(v, i))
+			__set_bit(i, unchanged);
+}
+
+static void ec_stripe_read_unchanged_blocks(struct bch_fs *c, struct ec_stripe_new *s)
+{
+	unsigned long unchanged[BITS_TO_LONGS(BCH_BKEY_PTRS_MAX)];
+	unsigned i;
+
+	ec_stripe_unchanged_blocks(s, unchanged);
+
+	for_each_set_bit(i, unchanged, BCH_BKEY_PTRS_MAX) {
+		__set_bit(i, s->existing_stripe.valid);
+		ec_block_io(c, &s->existing_stripe, READ, i, &s->iodone);
+	}
+	closure_sync(&s->iodone);
+}
+
+/*
+ * Reusing a stripe where we only read the old parity and the old contents of
+ * the blocks being replaced: returns false if any of those couldn't be read, in
+ * which case we fall back to reading the rest of the stripe and recomputing
+ * parity from scratch:
+ */
+static bool ec_stripe_delta_parity(struct bch_fs *c, struct ec_stripe_new *s)
+{
+	struct bch_stripe *v = &bkey_i_to_stripe(&s->new_stripe.key)->v;
+	unsigned long changed[BITS_TO_LONGS(BCH_BKEY_PTRS_MAX)];
+	unsigned i, nr_data = v->nr_blocks - v->nr_redundant;
+
+	ec_stripe_unchanged_blocks(s, changed);
+	bitmap_complement(changed, changed, nr_data);
+
+	ec_validate_checksums(c, &s->existing_stripe);
+
+	for (i = 0; i < v->nr_blocks; i++)
+		if ((i >= nr_data || test_bit(i, changed)) &&
+		    !test_bit(i, s->existing_stripe.valid))
+			return false;
+
+	ec_generate_ec_delta(&s->new_stripe, &s->existing_stripe, changed);
+
+	for (i = 0; i < v->nr_blocks; i++)
+		if (i >= nr_data || test_bit(i, changed))
+			ec_generate_block_checksums(&s->new_stripe, i);
+
+	ec_stripe_buf_exit(&s->existing_stripe);
+	return true;
+}
+
 /*
  * data buckets of new stripe all written: create the stripe
  */
@@ -1433,7 +1767,7 @@ static void ec_stripe_create(struct ec_stripe_new *s)
 	if (!s->err) {
 		for (i = 0; i < nr_data; i++)
 			if (s->blocks[i]) {
-				ob = c->open_buckets + s->blocks[i];
+				ob = ob_from_idx(c, s->blocks[i]);
 
 				if (ob->sectors_free)
 					zero_out_rest_of_ec_bucket(c, s, i, ob);
@@ -1446,7 +1780,13 @@ static void ec_stripe_create(struct ec_stripe_new *s)
 		goto err;
 	}
 
-	if (s->have_existing_stripe) {
+	if (s->delta_parity &&
+	    !ec_stripe_delta_parity(c, s)) {
+		ec_stripe_read_unchanged_blocks(c, s);
+		s->delta_parity = false;
+	}
+
+	if (s->have_existing_stripe && !s->delta_parity) {
 		ec_validate_checksums(c, &s->existing_stripe);
 
 		if (ec_do_recov(c, &s->existing_stripe)) {
@@ -1465,9 +1805,13 @@ static void ec_stripe_create(struct ec_stripe_new *s)
 	BUG_ON(!s->allocated);
 	BUG_ON(!s->idx);
 
-	ec_generate_ec(&s->new_stripe);
+	if (!s->delta_parity) {
+		unsigned sectors = le16_to_cpu(v->sectors);
 
-	ec_generate_checksums(&s->new_stripe);
+		/* parity for the start of the stripe may already be done: */
+		ec_generate_ec(&s->new_stripe, s->parity_done, sectors);
+		ec_generate_checksums(&s->new_stripe, s->parity_done, sectors);
+	}
 
 	/* write p/q: */
 	for (i = nr_data; i < v->nr_blocks; i++)
@@ -1499,7 +1843,7 @@ err:
 
 	for (i = 0; i < v->nr_blocks; i++)
 		if (s->blocks[i]) {
-			ob = c->open_buckets + s->blocks[i];
+			ob = ob_from_idx(c, s->blocks[i]);
 
 			if (i < nr_data) {
 				ob->ec = NULL;
@@ -1572,6 +1916,75 @@ static void ec_stripe_set_pending(struct bch_fs *c, struct ec_stripe_head *h)
 	ec_stripe_new_put(c, s, STRIPE_REF_io);
 }
 
+#define EC_PARITY_PIPELINE_CHUNKS	8
+
+/*
+ * Pipelined parity generation for new stripes: data blocks are filled from the
+ * start, so parity for the sectors that every data block has been filled up to
+ * can be generated while the rest of the stripe is still being written, leaving
+ * less to do when the stripe is created:
+ */
+static unsigned ec_stripe_parity_ready(struct ec_stripe_new *s)
+{
+	struct bch_stripe *v = &bkey_i_to_stripe(&s->new_stripe.key)->v;
+	unsigned sectors = le16_to_cpu(v->sectors);
+	unsigned ready = sectors;
+
+	for (unsigned i = 0; i < s->nr_data; i++)
+		ready = min(ready, READ_ONCE(s->block_ready[i]));
+
+	if (ready < sectors)
+		ready = round_down(ready, 1U << v->csum_granularity_bits);
+	return ready;
+}
+
+static void ec_stripe_parity_work(struct work_struct *work)
+{
+	struct ec_stripe_new *s = container_of(work, struct ec_stripe_new, parity_work);
+	struct bch_fs *c = s->c;
+
+	mutex_lock(&s->lock);
+	unsigned ready = ec_stripe_parity_ready(s);
+
+	if (ready > s->parity_done) {
+		ec_generate_ec(&s->new_stripe, s->parity_done, ready);
+		ec_generate_checksums(&s->new_stripe, s->parity_done, ready);
+		s->parity_done = ready;
+	}
+	mutex_unlock(&s->lock);
+
+	ec_stripe_new_put(c, s, STRIPE_REF_io);
+}
+
+/* Called after a write has copied its data into the stripe buffer: */
+void bch2_writepoint_ec_buf_done(struct bch_fs *c, struct write_point *wp)
+{
+	struct open_bucket *ob = ec_open_bucket(c, &wp->ptrs);
+	if (!ob)
+		return;
+
+	struct ec_stripe_new *s = ob->ec;
+	if (s->have_existing_stripe)
+		return;
+
+	struct bch_stripe *v = &bkey_i_to_stripe(&s->new_stripe.key)->v;
+	unsigned sectors = le16_to_cpu(v->sectors);
+	unsigned filled = min(ob_dev(c, ob)->mi.bucket_size - ob->sectors_free, sectors);
+
+	WRITE_ONCE(s->block_ready[ob->ec_idx], filled);
+
+	unsigned chunk = max(1U << v->csum_granularity_bits, sectors / EC_PARITY_PIPELINE_CHUNKS);
+	unsigned ready = ec_stripe_parity_ready(s);
+
+	if (ready == sectors ||
+	    ready >= READ_ONCE(s->parity_done) + chunk) {
+		/* the write holds an io ref, so this can't be the last one: */
+		ec_stripe_new_get(s, STRIPE_REF_io);
+		if (!queue_work(system_unbound_wq, &s->parity_work))
+			ec_stripe_new_put(c, s, STRIPE_REF_io);
+	}
+}
+
 void bch2_ec_bucket_cancel(struct bch_fs *c, struct open_bucket *ob)
 {
 	struct ec_stripe_new *s = ob->ec;
@@ -1676,6 +2089,7 @@ static int ec_new_stripe_alloc(struct bch_fs *c, struct ec_stripe_head *h)
 		return -BCH_ERR_ENOMEM_ec_new_stripe_alloc;
 
 	mutex_init(&s->lock);
+	INIT_WORK(&s->parity_work, ec_stripe_parity_work);
 	closure_init(&s->iodone, NULL);
 	atomic_set(&s->ref[STRIPE_REF_stripe], 1);
 	atomic_set(&s->ref[STRIPE_REF_io], 1);
@@ -1960,19 +2374,36 @@ static int __bch2_ec_stripe_head_reuse(struct btree_trans *trans, struct ec_stri
 	 * blocks from the stripe we're reusing:
 	 */
 	for_each_set_bit(i, h->s->blocks_gotten, new_v->nr_blocks) {
-		bch2_open_bucket_put(c, c->open_buckets + h->s->blocks[i]);
+		bch2_open_bucket_put(c, ob_from_idx(c, h->s->blocks[i]));
 		h->s->blocks[i] = 0;
 	}
 	memset(h->s->blocks_gotten, 0, sizeof(h->s->blocks_gotten));
 	memset(h->s->blocks_allocated, 0, sizeof(h->s->blocks_allocated));
 
+	/*
+	 * If fewer blocks are being replaced than kept, update parity with just
+	 * the difference between the old and new contents of the replaced
+	 * blocks, instead of reading every block in the stripe:
+	 */
+	unsigned nr_nonempty = 0;
+	for (i = 0; i < h->s->nr_data; i++)
+		nr_nonempty += stripe_blockcount_get(existing_v, i) != 0;
+
+	h->s->delta_parity = h->s->nr_data - nr_nonempty < nr_nonempty;
+
 	for (i = 0; i < existing_v->nr_blocks; i++) {
-		if (stripe_blockcount_get(existing_v, i)) {
+		bool nonempty = i < h->s->nr_data &&
+			stripe_blockcount_get(existing_v, i);
+
+		if (nonempty) {
 			__set_bit(i, h->s->blocks_gotten);
 			__set_bit(i, h->s->blocks_allocated);
 		}
 
-		ec_block_io(c, &h->s->existing_stripe, READ, i, &h->s->iodone);
+		if (nonempty && h->s->delta_parity)
+			__clear_bit(i, h->s->existing_stripe.valid);
+		else
+			ec_block_io(c, &h->s->existing_stripe, READ, i, &h->s->iodone);
 	}
 
 	bkey_copy(&h->s->new_stripe.key, &h->s->existing_stripe.key);
@@ -2146,7 +2577,7 @@ static void __bch2_ec_stop(struct bch_fs *c, struct bch_dev *ca)
 			if (!h->s->blocks[i])
 				continue;
 
-			ob = c->open_buckets + h->s->blocks[i];
+			ob = ob_from_idx(c, h->s->blocks[i]);
 			if (ob->dev == ca->dev_idx)
 				goto found;
 		}
@@ -2165,6 +2596,256 @@ void bch2_ec_stop_dev(struct bch_fs *c, struct bch_dev *ca)
 	__bch2_ec_stop(c, ca);
 }
 
+/*
+ * Stripe compaction:
+ *
+ * Stripes only free their buckets once every data block is empty; when most of
+ * the data in a stripe has been overwritten, move what's left into new stripes
+ * (via whatever erasure coding the data's io options ask for), doing several
+ * sparse stripes at a time so that their live data fills new stripes together.
+ * Runs in the background like copygc, paced by the write io clock and
+ * optionally rate limited by the stripe_compact_max_rate option.
+ */
+
+#define EC_COMPACT_BATCH	16
+
+struct ec_compact_candidate {
+	u64			idx;
+	/* live fraction of the stripe's data blocks, out of 1 << 16: */
+	u32			live;
+};
+
+typedef DARRAY(struct ec_compact_candidate) ec_compact_candidates;
+
+static int ec_compact_candidate_cmp(const void *_l, const void *_r)
+{
+	const struct ec_compact_candidate *l = _l;
+	const struct ec_compact_candidate *r = _r;
+
+	return cmp_int(l->live, r->live);
+}
+
+static int ec_compact_get_candidates(struct btree_trans *trans,
+				     ec_compact_candidates *candidates)
+{
+	struct bch_fs *c = trans->c;
+	unsigned threshold = READ_ONCE(c->opts.stripe_compact_threshold);
+
+	candidates->nr = 0;
+
+	return for_each_btree_key(trans, iter, BTREE_ID_stripes, POS_MIN,
+				  BTREE_ITER_prefetch, k, ({
+		if (k.k->type != KEY_TYPE_stripe)
+			continue;
+
+		const struct bch_stripe *s = bkey_s_c_to_stripe(k).v;
+		unsigned nr_data = s->nr_blocks - s->nr_redundant;
+		u64 capacity = (u64) nr_data * le16_to_cpu(s->sectors);
+		u64 live = 0;
+
+		for (unsigned i = 0; i < nr_data; i++)
+			live += stripe_blockcount_get(s, i);
+
+		/* empty stripes get deleted, stripes being reused are busy: */
+		if (!live ||
+		    !capacity ||
+		    live * 100 > capacity * threshold ||
+		    bch2_stripe_is_open(c, k.k->p.offset))
+			continue;
+
+		darray_push(candidates, ((struct ec_compact_candidate) {
+			.idx	= k.k->p.offset,
+			.live	= div64_u64(live << 16, capacity),
+		}));
+	}));
+}
+
+struct ec_compact_bucket {
+	struct bpos		bucket;
+	u8			gen;
+};
+
+static int ec_compact_stripe_buckets(struct btree_trans *trans, u64 idx,
+				     struct ec_compact_bucket *buckets,
+				     unsigned *nr)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	int ret;
+
+	*nr = 0;
+
+	k = bch2_bkey_get_iter(trans, &iter, BTREE_ID_stripes,
+			       POS(0, idx), BTREE_ITER_slots);
+	ret = bkey_err(k);
+	if (ret)
+		return ret;
+
+	if (k.k->type == KEY_TYPE_stripe) {
+		const struct bch_stripe *s = bkey_s_c_to_stripe(k).v;
+
+		rcu_read_lock();
+		for (unsigned i = 0; i < s->nr_blocks - s->nr_redundant; i++) {
+			const struct bch_extent_ptr *ptr = s->ptrs + i;
+			struct bch_dev *ca = bch2_dev_rcu(c, ptr->dev);
+
+			if (!ca || !stripe_blockcount_get(s, i))
+				continue;
+
+			buckets[*nr].bucket	= PTR_BUCKET_POS(ca, ptr);
+			buckets[*nr].gen	= ptr->gen;
+			(*nr)++;
+		}
+		rcu_read_unlock();
+	}
+
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+static int ec_compact(struct moving_context *ctxt,
+		      ec_compact_candidates *candidates,
+		      bool *did_work)
+{
+	struct btree_trans *trans = ctxt->trans;
+	struct bch_fs *c = trans->c;
+	struct data_update_opts data_opts = {
+		.btree_insert_flags = BCH_WATERMARK_copygc,
+	};
+	struct ec_compact_bucket buckets[BCH_BKEY_PTRS_MAX];
+	unsigned nr_buckets;
+	int ret;
+
+	ret = ec_compact_get_candidates(trans, candidates);
+	if (ret)
+		return ret;
+
+	sort(candidates->data, candidates->nr, sizeof(candidates->data[0]),
+	     ec_compact_candidate_cmp, NULL);
+
+	darray_for_each(*candidates, i) {
+		if (i - candidates->data >= EC_COMPACT_BATCH ||
+		    kthread_should_stop() ||
+		    freezing(current))
+			break;
+
+		if (bch2_stripe_is_open(c, i->idx))
+			continue;
+
+		ret = lockrestart_do(trans,
+				ec_compact_stripe_buckets(trans, i->idx, buckets, &nr_buckets));
+		if (ret)
+			break;
+
+		for (unsigned j = 0; j < nr_buckets; j++) {
+			ret = bch2_evacuate_bucket(ctxt, NULL, buckets[j].bucket,
+						   buckets[j].gen, data_opts);
+			if (ret)
+				goto err;
+		}
+
+		*did_work = true;
+	}
+err:
+	/* stripes are deleted once the moves out of them complete: */
+	bch2_moving_ctxt_flush_all(ctxt);
+	return ret;
+}
+
+static int bch2_ec_compact_thread(void *arg)
+{
+	struct bch_fs *c = arg;
+	struct moving_context ctxt;
+	struct bch_move_stats move_stats;
+	struct io_clock *clock = &c->io_clock[WRITE];
+	ec_compact_candidates candidates = {};
+	int ret = 0;
+
+	set_freezable();
+
+	bch2_move_stats_init(&move_stats, "stripe_compact");
+	bch2_moving_ctxt_init(&ctxt, c, NULL, &move_stats,
+			      writepoint_ptr(&c->ec_compact_write_point),
+			      true);
+	ctxt.io_class = BCH_IO_CLASS_copygc;
+
+	while (!kthread_should_stop()) {
+		bool did_work = false;
+
+		bch2_trans_unlock_long(ctxt.trans);
+		cond_resched();
+
+		if (unlikely(freezing(current))) {
+			__refrigerator(false);
+			continue;
+		}
+
+		u64 last = atomic64_read(&clock->now);
+		u32 max_rate = READ_ONCE(c->opts.stripe_compact_max_rate);
+
+		if (max_rate) {
+			if (!ctxt.rate)
+				bch2_ratelimit_reset(&c->ec_compact_ratelimit);
+			c->ec_compact_ratelimit.rate = max(max_rate >> 9, 1U);
+			ctxt.rate = &c->ec_compact_ratelimit;
+		} else {
+			ctxt.rate = NULL;
+		}
+
+		if (READ_ONCE(c->opts.stripe_compact_threshold)) {
+			ret = ec_compact(&ctxt, &candidates, &did_work);
+			if (ret && !bch2_err_matches(ret, EROFS))
+				bch_err_msg(c, ret, "compacting stripes");
+		}
+
+		if (!did_work) {
+			bch2_trans_unlock_long(ctxt.trans);
+			bch2_kthread_io_clock_wait(clock, last + (c->capacity >> 6),
+					MAX_SCHEDULE_TIMEOUT);
+		}
+	}
+
+	darray_exit(&candidates);
+	bch2_moving_ctxt_exit(&ctxt);
+	bch2_move_stats_exit(&move_stats, c);
+	return 0;
+}
+
+void bch2_ec_compact_stop(struct bch_fs *c)
+{
+	if (c->ec_compact_thread) {
+		kthread_stop(c->ec_compact_thread);
+		put_task_struct(c->ec_compact_thread);
+	}
+	c->ec_compact_thread = NULL;
+}
+
+int bch2_ec_compact_start(struct bch_fs *c)
+{
+	struct task_struct *t;
+	int ret;
+
+	if (c->ec_compact_thread)
+		return 0;
+
+	if (c->opts.nochanges)
+		return 0;
+
+	t = kthread_create(bch2_ec_compact_thread, c, "bch-stripe-compact/%s", c->name);
+	ret = PTR_ERR_OR_ZERO(t);
+	bch_err_msg(c, ret, "creating stripe compaction thread");
+	if (ret)
+		return ret;
+
+	get_task_struct(t);
+
+	c->ec_compact_thread = t;
+	wake_up_process(c->ec_compact_thread);
+
+	return 0;
+}
+
 void bch2_fs_ec_stop(struct bch_fs *c)
 {
 	__bch2_ec_stop(c, NULL);
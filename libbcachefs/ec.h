@@ -173,6 +173,19 @@ struct ec_stripe_new {
 	bool			allocated;
 	bool			pending;
 	bool			have_existing_stripe;
+	/*
+	 * Reusing an existing stripe by only reading the old parity and the
+	 * blocks being replaced, see ec_stripe_delta_parity():
+	 */
+	bool			delta_parity;
+
+	/*
+	 * Sectors each data block has been filled up to, and that parity has
+	 * been generated for, see ec_stripe_parity_work():
+	 */
+	unsigned		block_ready[BCH_BKEY_PTRS_MAX];
+	unsigned		parity_done;
+	struct work_struct	parity_work;
 
 	unsigned long		blocks_gotten[BITS_TO_LONGS(BCH_BKEY_PTRS_MAX)];
 	unsigned long		blocks_allocated[BITS_TO_LONGS(BCH_BKEY_PTRS_MAX)];
@@ -206,6 +219,7 @@ struct ec_stripe_head {
 int bch2_ec_read_extent(struct btree_trans *, struct bch_read_bio *);
 
 void *bch2_writepoint_ec_buf(struct bch_fs *, struct write_point *);
+void bch2_writepoint_ec_buf_done(struct bch_fs *, struct write_point *);
 
 void bch2_ec_bucket_cancel(struct bch_fs *, struct open_bucket *);
 
@@ -248,6 +262,9 @@ static inline void ec_stripe_new_put(struct bch_fs *c, struct ec_stripe_new *s,
 		}
 }
 
+void bch2_ec_compact_stop(struct bch_fs *);
+int bch2_ec_compact_start(struct bch_fs *);
+
 void bch2_ec_stop_dev(struct bch_fs *, struct bch_dev *);
 void bch2_fs_ec_stop(struct bch_fs *);
 void bch2_fs_ec_flush(struct bch_fs *);
@@ -4,6 +4,12 @@
 
 #include "bcachefs_format.h"
 
+/*
+ * Parity blocks per stripe: redundancy is nr_replicas - 1, so this is bounded
+ * by the number of replicas an extent can have:
+ */
+#define BCH_EC_PARITY_MAX		(BCH_REPLICAS_MAX - 1)
+
 struct bch_replicas_padded {
 	struct bch_replicas_entry_v1	e;
 	u8				pad[BCH_BKEY_PTRS_MAX];
@@ -40,6 +40,7 @@
 	x(ENOMEM,			ENOMEM_sb_journal_v2_validate)		\
 	x(ENOMEM,			ENOMEM_journal_entry_add)		\
 	x(ENOMEM,			ENOMEM_journal_read_buf_realloc)	\
+	x(ENOMEM,			ENOMEM_journal_uncompress)		\
 	x(ENOMEM,			ENOMEM_btree_interior_update_worker_init)\
 	x(ENOMEM,			ENOMEM_btree_interior_update_pool_init)	\
 	x(ENOMEM,			ENOMEM_bio_read_init)			\
@@ -56,6 +57,9 @@
 	x(ENOMEM,			ENOMEM_compression_workspace_init)	\
 	x(ENOMEM,			ENOMEM_decompression_workspace_init)	\
 	x(ENOMEM,			ENOMEM_bucket_gens)			\
+	x(ENOMEM,			ENOMEM_bucket_free_summary_init)	\
+	x(ENOMEM,			ENOMEM_fs_write_points_init)		\
+	x(ENOMEM,			ENOMEM_nocow_locking_init)		\
 	x(ENOMEM,			ENOMEM_buckets_nouse)			\
 	x(ENOMEM,			ENOMEM_usage_init)			\
 	x(ENOMEM,			ENOMEM_btree_node_read_all_replicas)	\
@@ -75,14 +79,21 @@
 	x(ENOMEM,			ENOMEM_gc_repair_key)			\
 	x(ENOMEM,			ENOMEM_fsck_extent_ends_at)		\
 	x(ENOMEM,			ENOMEM_fsck_add_nlink)			\
+	x(ENOMEM,			ENOMEM_fsck_nlink_refs)			\
 	x(ENOMEM,			ENOMEM_journal_key_insert)		\
 	x(ENOMEM,			ENOMEM_journal_keys_sort)		\
+	x(ENOMEM,			ENOMEM_journal_replay)			\
 	x(ENOMEM,			ENOMEM_read_superblock_clean)		\
 	x(ENOMEM,			ENOMEM_fs_alloc)			\
 	x(ENOMEM,			ENOMEM_fs_name_alloc)			\
 	x(ENOMEM,			ENOMEM_fs_other_alloc)			\
 	x(ENOMEM,			ENOMEM_dev_alloc)			\
 	x(ENOMEM,			ENOMEM_disk_accounting)			\
+	x(ENOMEM,			ENOMEM_scrub)				\
+	x(ENOMEM,			ENOMEM_zstd_dict_init)			\
+	x(ENOMEM,			ENOMEM_promote_sketch_init)		\
+	x(ENOMEM,			ENOMEM_delete_dead_snapshots)		\
+	x(ENOMEM,			ENOMEM_dedup)				\
 	x(ENOSPC,			ENOSPC_disk_reservation)		\
 	x(ENOSPC,			ENOSPC_bucket_alloc)			\
 	x(ENOSPC,			ENOSPC_disk_label_add)			\
@@ -120,6 +131,7 @@
 	x(EEXIST,			EEXIST_discard_in_flight_add)		\
 	x(EEXIST,			EEXIST_subvolume_create)		\
 	x(0,				open_buckets_empty)			\
+	x(BCH_ERR_open_buckets_empty,	open_buckets_dev_quota)			\
 	x(0,				freelist_empty)				\
 	x(BCH_ERR_freelist_empty,	no_buckets_found)			\
 	x(0,				transaction_restart)			\
@@ -183,6 +195,7 @@
 	x(EINVAL,			device_has_been_removed)		\
 	x(EINVAL,			device_splitbrain)			\
 	x(EINVAL,			device_already_online)			\
+	x(EINVAL,			device_zoned)				\
 	x(EINVAL,			insufficient_devices_to_start)		\
 	x(EINVAL,			invalid)				\
 	x(EINVAL,			internal_fsck_err)			\
@@ -190,6 +203,7 @@
 	x(EINVAL,			remove_with_metadata_missing_unimplemented)\
 	x(EINVAL,			remove_would_lose_data)			\
 	x(EINVAL,			btree_iter_with_journal_not_supported)	\
+	x(EINVAL,			zstd_dict_missing)			\
 	x(EROFS,			erofs_trans_commit)			\
 	x(EROFS,			erofs_no_writes)			\
 	x(EROFS,			erofs_journal_err)			\
@@ -235,6 +249,7 @@
 	x(BCH_ERR_invalid_sb,		invalid_sb_opt_compression)		\
 	x(BCH_ERR_invalid_sb,		invalid_sb_ext)				\
 	x(BCH_ERR_invalid_sb,		invalid_sb_downgrade)			\
+	x(BCH_ERR_invalid_sb,		invalid_sb_zstd_dict)			\
 	x(BCH_ERR_invalid,		invalid_bkey)				\
 	x(BCH_ERR_operation_blocked,    nocow_lock_blocked)			\
 	x(EIO,				btree_node_read_err)			\
@@ -243,6 +258,7 @@
 	x(EIO,				btree_node_read_error)			\
 	x(EIO,				btree_node_read_validate_error)		\
 	x(EIO,				btree_need_topology_repair)		\
+	x(EIO,				fsck_nlink_refs_short_read)		\
 	x(BCH_ERR_btree_node_read_err,	btree_node_read_err_fixable)		\
 	x(BCH_ERR_btree_node_read_err,	btree_node_read_err_want_retry)		\
 	x(BCH_ERR_btree_node_read_err,	btree_node_read_err_must_retry)		\
@@ -253,6 +269,8 @@
 	x(BCH_ERR_nopromote,		nopromote_already_promoted)		\
 	x(BCH_ERR_nopromote,		nopromote_unwritten)			\
 	x(BCH_ERR_nopromote,		nopromote_congested)			\
+	x(BCH_ERR_nopromote,		nopromote_cold)				\
+	x(BCH_ERR_nopromote,		nopromote_sequential)			\
 	x(BCH_ERR_nopromote,		nopromote_in_flight)			\
 	x(BCH_ERR_nopromote,		nopromote_no_writes)			\
 	x(BCH_ERR_nopromote,		nopromote_enomem)			\
@@ -268,6 +286,9 @@ enum bch_errcode {
 	BCH_ERR_MAX
 };
 
+/* Transaction restart errcodes are contiguous, starting at transaction_restart: */
+#define BCH_ERR_transaction_restart_NR	(BCH_ERR_no_btree_node - BCH_ERR_transaction_restart)
+
 const char *bch2_err_str(int);
 bool __bch2_err_matches(int, int);
 
@@ -0,0 +1,238 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "bcachefs.h"
+#include "btree_iter.h"
+#include "buckets.h"
+#include "extent_cache.h"
+#include "extents.h"
+#include "nocow_locking.h"
+
+/* first entry that ends after @offset: */
+static unsigned extent_cache_search(struct bch_extent_cache *cache, u64 offset)
+{
+	unsigned l = 0, r = min_t(unsigned, READ_ONCE(cache->nr), cache->size);
+
+	while (l < r) {
+		unsigned m = l + (r - l) / 2;
+
+		if (READ_ONCE(cache->idx[m].end) <= offset)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	return l;
+}
+
+static bool extent_cache_entry_valid(struct bch_fs *c, struct bch_extent_cache_entry *e)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(bkey_i_to_s_c(&e->k));
+	unsigned i = 0;
+	bool ret = true;
+
+	rcu_read_lock();
+	bkey_for_each_ptr(ptrs, ptr) {
+		struct bch_dev *ca = bch2_dev_rcu(c, ptr->dev);
+
+		if (!ca ||
+		    e->seq[i++] != bch2_bucket_nocow_seq(&c->nocow_locks,
+							 PTR_BUCKET_POS(ca, ptr))) {
+			ret = false;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+static bool extent_cache_lookup(struct bch_fs *c, struct bch_extent_cache *cache,
+				struct bpos pos, struct bch_extent_cache_entry *e)
+{
+	unsigned seq, i;
+	bool hit;
+
+	do {
+		seq = read_seqcount_begin(&cache->seq);
+		hit = false;
+
+		if (cache->snapshot != pos.snapshot)
+			continue;
+
+		i = extent_cache_search(cache, pos.offset);
+		if (i < cache->nr &&
+		    cache->idx[i].start <= pos.offset) {
+			unsigned slot = READ_ONCE(cache->idx[i].slot);
+
+			/* may be garbage if we raced with an update: */
+			if (slot < cache->size) {
+				memcpy(e, &cache->entries[slot], sizeof(*e));
+				hit = true;
+			}
+		}
+	} while (read_seqcount_retry(&cache->seq, seq));
+
+	if (!hit || !extent_cache_entry_valid(c, e))
+		return false;
+
+	if (!READ_ONCE(cache->idx[i].referenced))
+		WRITE_ONCE(cache->idx[i].referenced, 1);
+	return true;
+}
+
+static void extent_cache_remove(struct bch_extent_cache *cache, unsigned i)
+{
+	u16 slot = cache->idx[i].slot;
+
+	memmove(&cache->idx[i],
+		&cache->idx[i + 1],
+		sizeof(cache->idx[0]) * (cache->nr - i - 1));
+	cache->idx[--cache->nr].slot = slot;
+}
+
+/* evict with the clock algorithm: */
+static void extent_cache_evict(struct bch_extent_cache *cache)
+{
+	while (1) {
+		unsigned i = cache->hand++ % cache->nr;
+
+		if (!cache->idx[i].referenced) {
+			extent_cache_remove(cache, i);
+			break;
+		}
+
+		cache->idx[i].referenced = 0;
+	}
+}
+
+/* called with @k locked in the btree, so that we see any later seq bump: */
+static void extent_cache_add(struct bch_fs *c, struct bch_extent_cache *cache,
+			     struct bkey_s_c k)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	u32 seq[ARRAY_SIZE(cache->entries[0].seq)];
+	u64 start = bkey_start_offset(k.k), end = k.k->p.offset;
+	unsigned i, nr_ptrs = 0;
+
+	if (bkey_val_u64s(k.k) > BKEY_EXTENT_VAL_U64s_MAX)
+		return;
+
+	rcu_read_lock();
+	bkey_for_each_ptr(ptrs, ptr) {
+		struct bch_dev *ca = bch2_dev_rcu(c, ptr->dev);
+
+		if (!ca || nr_ptrs == ARRAY_SIZE(seq)) {
+			rcu_read_unlock();
+			return;
+		}
+
+		seq[nr_ptrs++] = bch2_bucket_nocow_seq(&c->nocow_locks,
+						       PTR_BUCKET_POS(ca, ptr));
+	}
+	rcu_read_unlock();
+
+	spin_lock(&cache->lock);
+	write_seqcount_begin(&cache->seq);
+
+	if (cache->snapshot != k.k->p.snapshot) {
+		cache->snapshot	= k.k->p.snapshot;
+		cache->nr	= 0;
+	}
+
+	/* anything we overlap with is stale: */
+	i = extent_cache_search(cache, start);
+	while (i < cache->nr && cache->idx[i].start < end)
+		extent_cache_remove(cache, i);
+
+	if (cache->nr == cache->size) {
+		extent_cache_evict(cache);
+		i = extent_cache_search(cache, start);
+	}
+
+	u16 slot = cache->idx[cache->nr].slot;
+
+	memmove(&cache->idx[i + 1],
+		&cache->idx[i],
+		sizeof(cache->idx[0]) * (cache->nr - i));
+	cache->idx[i] = (struct bch_extent_cache_idx) {
+		.start	= start,
+		.end	= end,
+		.slot	= slot,
+	};
+	cache->nr++;
+
+	struct bch_extent_cache_entry *e = &cache->entries[slot];
+	bkey_reassemble(&e->k, k);
+	memcpy(e->seq, seq, sizeof(seq[0]) * nr_ptrs);
+
+	write_seqcount_end(&cache->seq);
+	spin_unlock(&cache->lock);
+}
+
+/*
+ * Get the extent at @pos into @sk, from @cache if possible - otherwise from the
+ * btree with @iter (which should have its snapshot set), adding it to @cache:
+ */
+int bch2_extent_cache_peek(struct btree_trans *trans, struct btree_iter *iter,
+			   struct bch_extent_cache *cache, struct bpos pos,
+			   struct bkey_buf *sk)
+{
+	struct bch_fs *c = trans->c;
+	struct bkey_s_c k;
+	int ret;
+
+	if (cache) {
+		struct bch_extent_cache_entry e;
+
+		if (extent_cache_lookup(c, cache, pos, &e)) {
+			bch2_bkey_buf_copy(sk, c, &e.k);
+			return 0;
+		}
+	}
+
+	bch2_btree_iter_set_pos(iter, pos);
+
+	k = bch2_btree_iter_peek_slot(iter);
+	ret = bkey_err(k);
+	if (ret)
+		return ret;
+
+	if (cache &&
+	    k.k->type == KEY_TYPE_extent &&
+	    k.k->p.snapshot == pos.snapshot)
+		extent_cache_add(c, cache, k);
+
+	bch2_bkey_buf_reassemble(sk, c, k);
+	return 0;
+}
+
+struct bch_extent_cache *bch2_extent_cache_alloc(unsigned nr, gfp_t gfp)
+{
+	struct bch_extent_cache *cache;
+
+	nr = min(nr, U16_MAX);
+	if (!nr)
+		return NULL;
+
+	cache = kvzalloc(sizeof(*cache) +
+			 sizeof(cache->idx[0]) * nr +
+			 sizeof(cache->entries[0]) * nr, gfp);
+	if (!cache)
+		return NULL;
+
+	spin_lock_init(&cache->lock);
+	seqcount_init(&cache->seq);
+	cache->size	= nr;
+	cache->entries	= (void *) (cache + 1);
+	cache->idx	= (void *) (cache->entries + nr);
+
+	for (unsigned i = 0; i < nr; i++)
+		cache->idx[i].slot = i;
+
+	return cache;
+}
+
+void bch2_extent_cache_free(struct bch_extent_cache *cache)
+{
+	kvfree(cache);
+}
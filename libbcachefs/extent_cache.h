@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_EXTENT_CACHE_H
+#define _BCACHEFS_EXTENT_CACHE_H
+
+#include "bkey_buf.h"
+
+#include <linux/seqlock.h>
+
+/*
+ * Per inode cache of recently read extents, so that random reads to hot files
+ * can skip the extents btree lookup.
+ *
+ * Only extents (not holes, reservations or reflink pointers) from the inode's
+ * current snapshot are cached, and they're revalidated on every hit against the
+ * nocow lock table's per bucket sequence numbers, which the extents trigger
+ * bumps whenever an extent pointing into a bucket is overwritten.
+ */
+
+struct bch_extent_cache_entry {
+	u32			seq[BCH_REPLICAS_MAX + 1];
+	__BKEY_PADDED(k, BKEY_EXTENT_VAL_U64s_MAX);
+};
+
+struct bch_extent_cache_idx {
+	u64			start;
+	u64			end;
+	u16			slot;
+	u8			referenced;
+};
+
+struct bch_extent_cache {
+	spinlock_t		lock;
+	seqcount_t		seq;
+	u32			snapshot;
+	u16			nr;
+	u16			size;
+	u16			hand;
+	/*
+	 * idx[0..nr) is sorted by offset; the slots in idx[nr..size) are the
+	 * free entries:
+	 */
+	struct bch_extent_cache_idx	*idx;
+	struct bch_extent_cache_entry	*entries;
+};
+
+int bch2_extent_cache_peek(struct btree_trans *, struct btree_iter *,
+			   struct bch_extent_cache *, struct bpos,
+			   struct bkey_buf *);
+
+struct bch_extent_cache *bch2_extent_cache_alloc(unsigned, gfp_t);
+void bch2_extent_cache_free(struct bch_extent_cache *);
+
+#endif /* _BCACHEFS_EXTENT_CACHE_H */
@@ -102,6 +102,15 @@ static int count_iters_for_insert(struct btree_trans *trans,
 
 #define EXTENT_ITERS_MAX	(BTREE_ITER_INITIAL / 3)
 
+/*
+ * Inserts without pointers of their own - deletions (fpunch, truncate) and
+ * reservations (fallocate) - are batched: we overwrite many extents per
+ * transaction, so that the per commit costs (journal reservation, inode update,
+ * accounting deltas, alloc updates to buckets shared by several of the extents)
+ * are paid once per batch instead of once per extent:
+ */
+#define EXTENT_ITERS_MAX_BATCH	(BTREE_ITER_MAX / 4)
+
 int bch2_extent_atomic_end(struct btree_trans *trans,
 			   struct btree_iter *iter,
 			   struct bkey_i *insert,
@@ -110,6 +119,9 @@ int bch2_extent_atomic_end(struct btree_trans *trans,
 	struct btree_iter copy;
 	struct bkey_s_c k;
 	unsigned nr_iters = 0;
+	unsigned max_iters = !bch2_bkey_nr_ptrs(bkey_i_to_s_c(insert))
+		? EXTENT_ITERS_MAX_BATCH
+		: EXTENT_ITERS_MAX;
 	int ret;
 
 	ret = bch2_btree_iter_traverse(iter);
@@ -122,7 +134,7 @@ int bch2_extent_atomic_end(struct btree_trans *trans,
 	nr_iters += 1;
 
 	ret = count_iters_for_insert(trans, bkey_i_to_s_c(insert), 0, end,
-				     &nr_iters, EXTENT_ITERS_MAX / 2);
+				     &nr_iters, max_iters / 2);
 	if (ret < 0)
 		return ret;
 
@@ -148,7 +160,7 @@ int bch2_extent_atomic_end(struct btree_trans *trans,
 		}
 
 		ret = count_iters_for_insert(trans, k, offset, end,
-					&nr_iters, EXTENT_ITERS_MAX);
+					&nr_iters, max_iters);
 		if (ret)
 			break;
 	}
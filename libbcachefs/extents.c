@@ -71,10 +71,21 @@ void bch2_mark_io_failure(struct bch_io_failures *failed,
 	}
 }
 
+/*
+ * Expected time for a read to complete: the device's latency, scaled by the
+ * IO already in flight or queued to it - so that the concurrent reads from a
+ * single sequential stream spread out across replicas instead of piling up on
+ * the fastest device:
+ */
 static inline u64 dev_latency(struct bch_fs *c, unsigned dev)
 {
 	struct bch_dev *ca = bch2_dev_rcu(c, dev);
-	return ca ? atomic64_read(&ca->cur_latency[READ]) : S64_MAX;
+	if (!ca)
+		return S64_MAX;
+
+	return atomic64_read(&ca->cur_latency[READ]) *
+		(1 + atomic_read(&ca->io_sched.in_flight) +
+		 READ_ONCE(ca->io_sched.nr_queued));
 }
 
 /*
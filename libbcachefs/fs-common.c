@@ -42,7 +42,8 @@ int bch2_create_trans(struct btree_trans *trans,
 	if (ret)
 		goto err;
 
-	ret = bch2_inode_peek(trans, &dir_iter, dir_u, dir, BTREE_ITER_intent);
+	ret = bch2_inode_peek(trans, &dir_iter, dir_u, dir,
+			      BTREE_ITER_intent|BTREE_ITER_with_updates);
 	if (ret)
 		goto err;
 
@@ -78,7 +79,7 @@ int bch2_create_trans(struct btree_trans *trans,
 		}
 
 		ret = bch2_inode_peek(trans, &inode_iter, new_inode, snapshot_src,
-				      BTREE_ITER_intent);
+				      BTREE_ITER_intent|BTREE_ITER_with_updates);
 		if (ret)
 			goto err;
 
@@ -198,7 +199,8 @@ int bch2_link_trans(struct btree_trans *trans,
 	if (dir.subvol != inum.subvol)
 		return -EXDEV;
 
-	ret = bch2_inode_peek(trans, &inode_iter, inode_u, inum, BTREE_ITER_intent);
+	ret = bch2_inode_peek(trans, &inode_iter, inode_u, inum,
+			      BTREE_ITER_intent|BTREE_ITER_with_updates);
 	if (ret)
 		return ret;
 
@@ -207,7 +209,8 @@ int bch2_link_trans(struct btree_trans *trans,
 	if (ret)
 		goto err;
 
-	ret = bch2_inode_peek(trans, &dir_iter, dir_u, dir, BTREE_ITER_intent);
+	ret = bch2_inode_peek(trans, &dir_iter, dir_u, dir,
+			      BTREE_ITER_intent|BTREE_ITER_with_updates);
 	if (ret)
 		goto err;
 
@@ -255,19 +258,21 @@ int bch2_unlink_trans(struct btree_trans *trans,
 	struct bkey_s_c k;
 	int ret;
 
-	ret = bch2_inode_peek(trans, &dir_iter, dir_u, dir, BTREE_ITER_intent);
+	ret = bch2_inode_peek(trans, &dir_iter, dir_u, dir,
+			      BTREE_ITER_intent|BTREE_ITER_with_updates);
 	if (ret)
 		goto err;
 
 	dir_hash = bch2_hash_info_init(c, dir_u);
 
 	ret = bch2_dirent_lookup_trans(trans, &dirent_iter, dir, &dir_hash,
-				       name, &inum, BTREE_ITER_intent);
+				       name, &inum,
+				       BTREE_ITER_intent|BTREE_ITER_with_updates);
 	if (ret)
 		goto err;
 
 	ret = bch2_inode_peek(trans, &inode_iter, inode_u, inum,
-			      BTREE_ITER_intent);
+			      BTREE_ITER_intent|BTREE_ITER_with_updates);
 	if (ret)
 		goto err;
 
@@ -332,6 +337,104 @@ err:
 	return ret;
 }
 
+/*
+ * Several ops on the same directory can be done in one transaction: the lookups
+ * in the create, unlink and rename paths are all done with
+ * BTREE_ITER_with_updates, so each op sees the dirents and inodes the ops
+ * before it created or updated - and since the directory inode is updated at
+ * the same position each time, it's only written once, at commit.
+ *
+ * Stops at the first op that fails: *nr_done is set to the number of ops that
+ * succeeded, and the transaction must not be committed.
+ */
+int bch2_dirops_trans(struct btree_trans *trans,
+		      subvol_inum dir,
+		      struct bch_inode_unpacked *dir_u,
+		      struct bch_dirop *ops, unsigned nr,
+		      unsigned *nr_done)
+{
+	struct bch_inode_unpacked dst_inode_u;
+	int ret = 0;
+
+	for (*nr_done = 0; *nr_done < nr; (*nr_done)++) {
+		struct bch_dirop *op = ops + *nr_done;
+
+		switch (op->type) {
+		case BCH_DIROP_create:
+			bch2_inode_init_early(trans->c, &op->inode_u);
+
+			ret = bch2_create_trans(trans, dir, dir_u, &op->inode_u,
+						&op->name, op->uid, op->gid,
+						op->mode, op->rdev, NULL, NULL,
+						(subvol_inum) { 0 }, 0);
+			break;
+		case BCH_DIROP_unlink:
+			ret = bch2_unlink_trans(trans, dir, dir_u, &op->inode_u,
+						&op->name, false);
+			break;
+		case BCH_DIROP_rename:
+			ret = bch2_rename_trans(trans, dir, dir_u, dir, dir_u,
+						&op->inode_u, &dst_inode_u,
+						&op->name, &op->dst_name,
+						op->rename_mode);
+			break;
+		default:
+			ret = -EINVAL;
+		}
+
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
+
+/*
+ * Apply @ops to @dir in order, up to BCH_DIROPS_TRANS_MAX per transaction;
+ * each op's result is returned in op->ret, and an op failing doesn't stop the
+ * ops after it:
+ */
+void bch2_dirops(struct bch_fs *c, subvol_inum dir,
+		 struct bch_dirop *ops, unsigned nr)
+{
+	struct btree_trans *trans = bch2_trans_get(c);
+	struct bch_inode_unpacked dir_u;
+	unsigned done = 0, limit = BCH_DIROPS_TRANS_MAX;
+
+	while (done < nr) {
+		unsigned n = min(nr - done, limit), ok = 0;
+		unsigned flags = BCH_TRANS_COMMIT_no_enospc;
+
+		/* unlinks and renames must work on a full filesystem, creates needn't: */
+		for (unsigned i = 0; i < n; i++)
+			if (ops[done + i].type == BCH_DIROP_create)
+				flags = 0;
+
+		int ret = commit_do(trans, NULL, NULL, flags,
+				bch2_dirops_trans(trans, dir, &dir_u,
+						  ops + done, n, &ok));
+
+		limit = BCH_DIROPS_TRANS_MAX;
+
+		if (ret && ok && ok < n) {
+			/* commit the ops before the one that failed: */
+			limit = ok;
+			continue;
+		}
+
+		if (ret && ok < n) {
+			ops[done++].ret = ret;
+			continue;
+		}
+
+		/* all ops in a failed commit fail: */
+		while (n--)
+			ops[done++].ret = ret;
+	}
+
+	bch2_trans_put(trans);
+}
+
 bool bch2_reinherit_attrs(struct bch_inode_unpacked *dst_u,
 			  struct bch_inode_unpacked *src_u)
 {
@@ -394,7 +497,7 @@ int bch2_rename_trans(struct btree_trans *trans,
 	int ret;
 
 	ret = bch2_inode_peek(trans, &src_dir_iter, src_dir_u, src_dir,
-			      BTREE_ITER_intent);
+			      BTREE_ITER_intent|BTREE_ITER_with_updates);
 	if (ret)
 		goto err;
 
@@ -403,7 +506,7 @@ int bch2_rename_trans(struct btree_trans *trans,
 	if (dst_dir.inum	!= src_dir.inum ||
 	    dst_dir.subvol	!= src_dir.subvol) {
 		ret = bch2_inode_peek(trans, &dst_dir_iter, dst_dir_u, dst_dir,
-				      BTREE_ITER_intent);
+				      BTREE_ITER_intent|BTREE_ITER_with_updates);
 		if (ret)
 			goto err;
 
@@ -423,13 +526,13 @@ int bch2_rename_trans(struct btree_trans *trans,
 		goto err;
 
 	ret = bch2_inode_peek(trans, &src_inode_iter, src_inode_u, src_inum,
-			      BTREE_ITER_intent);
+			      BTREE_ITER_intent|BTREE_ITER_with_updates);
 	if (ret)
 		goto err;
 
 	if (dst_inum.inum) {
 		ret = bch2_inode_peek(trans, &dst_inode_iter, dst_inode_u, dst_inum,
-				      BTREE_ITER_intent);
+				      BTREE_ITER_intent|BTREE_ITER_with_updates);
 		if (ret)
 			goto err;
 	}
@@ -39,6 +39,43 @@ int bch2_rename_trans(struct btree_trans *,
 		      const struct qstr *,
 		      enum bch_rename_mode);
 
+enum bch_dirop_type {
+	BCH_DIROP_create,
+	BCH_DIROP_unlink,
+	BCH_DIROP_rename,
+};
+
+/* One create, unlink or rename in a batch of ops on the same directory: */
+struct bch_dirop {
+	enum bch_dirop_type	type;
+	struct qstr		name;
+
+	/* create: */
+	uid_t			uid;
+	gid_t			gid;
+	umode_t			mode;
+	dev_t			rdev;
+
+	/* rename, within the same directory: */
+	struct qstr		dst_name;
+	enum bch_rename_mode	rename_mode;
+
+	/*
+	 * The inode created, unlinked or renamed - as of this op, later ops in
+	 * the same batch may have updated it again:
+	 */
+	struct bch_inode_unpacked inode_u;
+	int			ret;
+};
+
+/* Bounds the size of the transaction, and how long we hold the dirent locks: */
+#define BCH_DIROPS_TRANS_MAX		16
+
+int bch2_dirops_trans(struct btree_trans *, subvol_inum,
+		      struct bch_inode_unpacked *,
+		      struct bch_dirop *, unsigned, unsigned *);
+void bch2_dirops(struct bch_fs *, subvol_inum, struct bch_dirop *, unsigned);
+
 bool bch2_reinherit_attrs(struct bch_inode_unpacked *,
 			  struct bch_inode_unpacked *);
 
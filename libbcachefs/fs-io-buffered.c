@@ -4,6 +4,7 @@
 #include "bcachefs.h"
 #include "alloc_foreground.h"
 #include "bkey_buf.h"
+#include "extent_cache.h"
 #include "fs-io.h"
 #include "fs-io-buffered.h"
 #include "fs-io-direct.h"
@@ -144,13 +145,15 @@ static int readpage_bio_extend(struct btree_trans *trans,
 static void bchfs_read(struct btree_trans *trans,
 		       struct bch_read_bio *rbio,
 		       subvol_inum inum,
-		       struct readpages_iter *readpages_iter)
+		       struct readpages_iter *readpages_iter,
+		       unsigned extra_flags)
 {
 	struct bch_fs *c = trans->c;
 	struct btree_iter iter;
 	struct bkey_buf sk;
 	int flags = BCH_READ_RETRY_IF_STALE|
-		BCH_READ_MAY_PROMOTE;
+		BCH_READ_MAY_PROMOTE|
+		extra_flags;
 	int ret = 0;
 
 	rbio->c = c;
@@ -176,20 +179,17 @@ static void bchfs_read(struct btree_trans *trans,
 
 		bch2_btree_iter_set_snapshot(&iter, snapshot);
 
-		bch2_btree_iter_set_pos(&iter,
-				POS(inum.inum, rbio->bio.bi_iter.bi_sector));
+		struct bpos pos = SPOS(inum.inum, rbio->bio.bi_iter.bi_sector, snapshot);
 
-		k = bch2_btree_iter_peek_slot(&iter);
-		ret = bkey_err(k);
+		ret = bch2_extent_cache_peek(trans, &iter, rbio->extent_cache, pos, &sk);
 		if (ret)
 			goto err;
 
-		offset_into_extent = iter.pos.offset -
+		k = bkey_i_to_s_c(sk.k);
+		offset_into_extent = pos.offset -
 			bkey_start_offset(k.k);
 		sectors = k.k->size - offset_into_extent;
 
-		bch2_bkey_buf_reassemble(&sk, c, k);
-
 		ret = bch2_read_indirect_extent(trans, &data_btree,
 					&offset_into_extent, &sk);
 		if (ret)
@@ -214,7 +214,7 @@ static void bchfs_read(struct btree_trans *trans,
 
 		bch2_bio_page_state_set(&rbio->bio, k);
 
-		bch2_read_extent(trans, rbio, iter.pos,
+		bch2_read_extent(trans, rbio, pos,
 				 data_btree, k, offset_into_extent, flags);
 
 		if (flags & BCH_READ_LAST_FRAGMENT)
@@ -251,6 +251,11 @@ void bch2_readahead(struct readahead_control *ractl)
 
 	bch2_inode_opts_get(&opts, c, &inode->ei_inode);
 
+	unsigned flags = bch2_read_is_sequential(c, inode,
+					readahead_pos(ractl) >> 9,
+					readahead_length(ractl) >> 9)
+		? BCH_READ_SEQUENTIAL : 0;
+
 	int ret = readpages_iter_init(&readpages_iter, ractl);
 	if (ret)
 		return;
@@ -270,12 +275,14 @@ void bch2_readahead(struct readahead_control *ractl)
 
 		readpage_iter_advance(&readpages_iter);
 
+		if (!(flags & BCH_READ_SEQUENTIAL))
+			rbio->extent_cache = bch2_inode_extent_cache(c, inode);
 		rbio->bio.bi_iter.bi_sector = folio_sector(folio);
 		rbio->bio.bi_end_io = bch2_readpages_end_io;
 		BUG_ON(!bio_add_folio(&rbio->bio, folio, folio_size(folio), 0));
 
 		bchfs_read(trans, rbio, inode_inum(inode),
-			   &readpages_iter);
+			   &readpages_iter, flags);
 		bch2_trans_unlock(trans);
 	}
 	bch2_trans_put(trans);
@@ -308,12 +315,13 @@ int bch2_read_single_folio(struct folio *folio, struct address_space *mapping)
 			 opts);
 	rbio->bio.bi_private = &done;
 	rbio->bio.bi_end_io = bch2_read_single_folio_end_io;
+	rbio->extent_cache = bch2_inode_extent_cache(c, inode);
 
 	rbio->bio.bi_opf = REQ_OP_READ|REQ_SYNC;
 	rbio->bio.bi_iter.bi_sector = folio_sector(folio);
 	BUG_ON(!bio_add_folio(&rbio->bio, folio, folio_size(folio), 0));
 
-	bch2_trans_run(c, (bchfs_read(trans, rbio, inode_inum(inode), NULL), 0));
+	bch2_trans_run(c, (bchfs_read(trans, rbio, inode_inum(inode), NULL, 0), 0));
 	wait_for_completion(&done);
 
 	ret = blk_status_to_errno(rbio->bio.bi_status);
@@ -337,6 +345,32 @@ int bch2_read_folio(struct file *file, struct folio *folio)
 
 /* writepages: */
 
+/*
+ * Writeback normally picks a write point hashed on the last task to dirty the
+ * file, so that files written together are allocated together. That's wrong
+ * for a task appending to many files slowly, over a long period (e.g. logs):
+ * the files end up interleaved within buckets. Once a file has seen enough
+ * consecutive appends it gets a write point of its own:
+ */
+#define WRITEPOINT_APPEND_STREAK	8
+
+static void bch2_inode_dirtied(struct bch_inode_info *inode, bool append)
+{
+	inode->ei_last_dirtied = (unsigned long) current;
+
+	if (!append)
+		inode->ei_append_streak = 0;
+	else if (inode->ei_append_streak < WRITEPOINT_APPEND_STREAK)
+		inode->ei_append_streak++;
+}
+
+static unsigned long bch2_inode_writepoint(struct bch_inode_info *inode)
+{
+	return inode->ei_append_streak >= WRITEPOINT_APPEND_STREAK
+		? (unsigned long) inode
+		: inode->ei_last_dirtied;
+}
+
 struct bch_writepage_io {
 	struct bch_inode_info		*inode;
 
@@ -349,6 +383,8 @@ struct bch_writepage_state {
 	struct bch_io_opts	opts;
 	struct bch_folio_sector	*tmp;
 	unsigned		tmp_sectors;
+	/* will bch2_write_extent() have to bounce this data? */
+	bool			bounce;
 };
 
 static inline struct bch_writepage_state bch_writepage_state_init(struct bch_fs *c,
@@ -357,22 +393,28 @@ static inline struct bch_writepage_state bch_writepage_state_init(struct bch_fs
 	struct bch_writepage_state ret = { 0 };
 
 	bch2_inode_opts_get(&ret.opts, c, &inode->ei_inode);
+
+	/* writeback doesn't set BCH_WRITE_PAGES_STABLE, so checksums bounce: */
+	ret.bounce = ret.opts.compression ||
+		ret.opts.erasure_code ||
+		bch2_data_checksum_type(c, ret.opts);
 	return ret;
 }
 
 /*
- * Determine when a writepage io is full. We have to limit writepage bios to a
- * single page per bvec (i.e. 1MB with 4k pages) because that is the limit to
- * what the bounce path in bch2_write_extent() can handle. In theory we could
- * loosen this restriction for non-bounce I/O, but we don't have that context
- * here. Ideally, we can up this limit and make it configurable in the future
- * when the bounce path can be enhanced to accommodate larger source bios.
+ * Determine when a writepage io is full. If bch2_write_extent() will bounce
+ * the data we have to limit writepage bios to a single page per bvec (i.e. 1MB
+ * with 4k pages) because that is the limit to what the bounce path can handle.
+ *
+ * Otherwise the only limit is the number of bvecs - with large folios, a
+ * single write op then covers up to BIO_MAX_VECS folios:
  */
-static inline bool bch_io_full(struct bch_writepage_io *io, unsigned len)
+static inline bool bch_io_full(struct bch_writepage_state *w, unsigned len)
 {
-	struct bio *bio = &io->op.wbio.bio;
+	struct bio *bio = &w->io->op.wbio.bio;
 	return bio_full(bio, len) ||
-		(bio->bi_iter.bi_size + len > BIO_MAX_VECS * PAGE_SIZE);
+		(w->bounce &&
+		 bio->bi_iter.bi_size + len > BIO_MAX_VECS * PAGE_SIZE);
 }
 
 static void bch2_writepage_io_done(struct bch_write_op *op)
@@ -474,11 +516,12 @@ static void bch2_writepage_io_alloc(struct bch_fs *c,
 	op->target		= w->opts.foreground_target;
 	op->nr_replicas		= nr_replicas;
 	op->res.nr_replicas	= nr_replicas;
-	op->write_point		= writepoint_hashed(inode->ei_last_dirtied);
+	op->write_point		= writepoint_hashed_stream(bch2_inode_writepoint(inode), sector);
 	op->subvol		= inode->ei_inum.subvol;
 	op->pos			= POS(inode->v.i_ino, sector);
 	op->end_io		= bch2_writepage_io_done;
 	op->devs_need_flush	= &inode->ei_devs_need_flush;
+	op->incompressible_streak = &inode->ei_incompressible_streak;
 	op->wbio.bio.bi_iter.bi_sector = sector;
 	op->wbio.bio.bi_opf	= wbc_to_write_flags(wbc);
 }
@@ -591,7 +634,7 @@ do_io:
 
 		if (w->io &&
 		    (w->io->op.res.nr_replicas != nr_replicas_this_write ||
-		     bch_io_full(w->io, sectors << 9) ||
+		     bch_io_full(w, sectors << 9) ||
 		     bio_end_sector(&w->io->op.wbio.bio) != sector))
 			bch2_writepage_do_io(w);
 
@@ -755,7 +798,8 @@ int bch2_write_end(struct file *file, struct address_space *mapping,
 	}
 
 	spin_lock(&inode->v.i_lock);
-	if (pos + copied > inode->v.i_size)
+	bool append = pos + copied > inode->v.i_size;
+	if (append)
 		i_size_write(&inode->v, pos + copied);
 	spin_unlock(&inode->v.i_lock);
 
@@ -765,7 +809,7 @@ int bch2_write_end(struct file *file, struct address_space *mapping,
 
 		bch2_set_folio_dirty(c, inode, folio, res, offset, copied);
 
-		inode->ei_last_dirtied = (unsigned long) current;
+		bch2_inode_dirtied(inode, append);
 	}
 
 	folio_unlock(folio);
@@ -792,7 +836,7 @@ static int __bch2_buffered_write(struct bch_inode_info *inode,
 				 struct address_space *mapping,
 				 struct iov_iter *iter,
 				 loff_t pos, unsigned len,
-				 bool inode_locked)
+				 bool inode_locked, bool nowait)
 {
 	struct bch_fs *c = inode->v.i_sb->s_fs_info;
 	struct bch2_folio_reservation res;
@@ -809,7 +853,8 @@ static int __bch2_buffered_write(struct bch_inode_info *inode,
 	darray_init(&fs);
 
 	ret = bch2_filemap_get_contig_folios_d(mapping, pos, end,
-					       FGP_WRITEBEGIN | fgf_set_order(len),
+					       FGP_WRITEBEGIN | fgf_set_order(len) |
+					       (nowait ? FGP_NOWAIT : 0),
 					       mapping_gfp_mask(mapping), &fs);
 	if (ret)
 		goto out;
@@ -827,7 +872,7 @@ static int __bch2_buffered_write(struct bch_inode_info *inode,
 
 	f = darray_first(fs);
 	if (pos != folio_pos(f) && !folio_test_uptodate(f)) {
-		ret = bch2_read_single_folio(f, mapping);
+		ret = !nowait ? bch2_read_single_folio(f, mapping) : -EAGAIN;
 		if (ret)
 			goto out;
 	}
@@ -839,7 +884,7 @@ static int __bch2_buffered_write(struct bch_inode_info *inode,
 		if (end >= inode->v.i_size) {
 			folio_zero_range(f, 0, folio_size(f));
 		} else {
-			ret = bch2_read_single_folio(f, mapping);
+			ret = !nowait ? bch2_read_single_folio(f, mapping) : -EAGAIN;
 			if (ret)
 				goto out;
 		}
@@ -921,7 +966,8 @@ static int __bch2_buffered_write(struct bch_inode_info *inode,
 	end = pos + copied;
 
 	spin_lock(&inode->v.i_lock);
-	if (end > inode->v.i_size) {
+	bool append = end > inode->v.i_size;
+	if (append) {
 		BUG_ON(!inode_locked);
 		i_size_write(&inode->v, end);
 	}
@@ -942,7 +988,7 @@ static int __bch2_buffered_write(struct bch_inode_info *inode,
 		f_offset = 0;
 	}
 
-	inode->ei_last_dirtied = (unsigned long) current;
+	bch2_inode_dirtied(inode, append);
 out:
 	darray_for_each(fs, fi) {
 		folio_unlock(*fi);
@@ -969,6 +1015,7 @@ static ssize_t bch2_buffered_write(struct kiocb *iocb, struct iov_iter *iter)
 	struct address_space *mapping = file->f_mapping;
 	struct bch_inode_info *inode = file_bch_inode(file);
 	loff_t pos;
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
 	bool inode_locked = false;
 	ssize_t written = 0, written2 = 0, ret = 0;
 
@@ -995,11 +1042,20 @@ static ssize_t bch2_buffered_write(struct kiocb *iocb, struct iov_iter *iter)
 	 * start, and then get an unrecoverable error, we _cannot_ claim to
 	 * userspace that we did not write data we actually did - so we must
 	 * track (written2) the most we ever wrote.
+	 *
+	 * For IOCB_NOWAIT (io_uring), anywhere we'd block on a lock or on
+	 * reading in a partial folio we return -EAGAIN (or a short write) and
+	 * the caller retries from a context that can block.
 	 */
 
 	if ((iocb->ki_flags & IOCB_APPEND) ||
 	    (iocb->ki_pos + iov_iter_count(iter) > i_size_read(&inode->v))) {
-		inode_lock(&inode->v);
+		if (nowait) {
+			if (!inode_trylock(&inode->v))
+				return -EAGAIN;
+		} else {
+			inode_lock(&inode->v);
+		}
 		inode_locked = true;
 	}
 
@@ -1009,7 +1065,7 @@ static ssize_t bch2_buffered_write(struct kiocb *iocb, struct iov_iter *iter)
 
 	ret = file_remove_privs_flags(file, !inode_locked ? IOCB_NOWAIT : 0);
 	if (ret) {
-		if (!inode_locked) {
+		if (!inode_locked && !nowait) {
 			inode_lock(&inode->v);
 			inode_locked = true;
 			ret = file_remove_privs_flags(file, 0);
@@ -1018,13 +1074,20 @@ static ssize_t bch2_buffered_write(struct kiocb *iocb, struct iov_iter *iter)
 			goto unlock;
 	}
 
-	ret = file_update_time(file);
+	ret = !nowait ? file_update_time(file) : kiocb_modified(iocb);
 	if (ret)
 		goto unlock;
 
 	pos = iocb->ki_pos;
 
-	bch2_pagecache_add_get(inode);
+	if (nowait) {
+		if (!bch2_pagecache_add_tryget(inode)) {
+			ret = -EAGAIN;
+			goto unlock;
+		}
+	} else {
+		bch2_pagecache_add_get(inode);
+	}
 
 	if (!inode_locked &&
 	    (iocb->ki_pos + iov_iter_count(iter) > i_size_read(&inode->v)))
@@ -1062,7 +1125,8 @@ again:
 			break;
 		}
 
-		ret = __bch2_buffered_write(inode, mapping, iter, pos, bytes, inode_locked);
+		ret = __bch2_buffered_write(inode, mapping, iter, pos, bytes,
+					    inode_locked, nowait);
 		if (ret == -BCH_ERR_need_inode_lock)
 			goto get_inode_lock;
 		if (unlikely(ret < 0))
@@ -1089,13 +1153,20 @@ again:
 
 		if (ret != bytes && !inode_locked)
 			goto get_inode_lock;
-		ret = 0;
-
-		balance_dirty_pages_ratelimited(mapping);
+		ret = balance_dirty_pages_ratelimited_flags(mapping,
+						nowait ? BDP_ASYNC : 0);
+		if (unlikely(ret))
+			break;
 
 		if (0) {
 get_inode_lock:
 			bch2_pagecache_add_put(inode);
+			if (nowait) {
+				/* keep what we've written, retry the rest: */
+				ret = !written ? -EAGAIN : 0;
+				goto unlock;
+			}
+
 			inode_lock(&inode->v);
 			inode_locked = true;
 			bch2_pagecache_add_get(inode);
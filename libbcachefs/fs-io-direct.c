@@ -72,6 +72,7 @@ static int bch2_direct_IO_read(struct kiocb *req, struct iov_iter *iter)
 	struct bio *bio;
 	loff_t offset = req->ki_pos;
 	bool sync = is_sync_kiocb(req);
+	unsigned flags;
 	size_t shorten;
 	ssize_t ret;
 
@@ -87,6 +88,10 @@ static int bch2_direct_IO_read(struct kiocb *req, struct iov_iter *iter)
 	if (!ret)
 		return ret;
 
+	flags = bch2_read_is_sequential(c, inode, offset >> 9,
+					DIV_ROUND_UP(ret, SECTOR_SIZE))
+		? BCH_READ_SEQUENTIAL : 0;
+
 	shorten = iov_iter_count(iter) - round_up(ret, block_bytes(c));
 	if (shorten >= iter->count)
 		shorten = 0;
@@ -157,7 +162,12 @@ start:
 		if (iter->count)
 			closure_get(&dio->cl);
 
-		bch2_read(c, rbio_init(bio, opts), inode_inum(inode));
+		struct bch_read_bio *rbio = rbio_init(bio, opts);
+
+		if (!(flags & BCH_READ_SEQUENTIAL))
+			rbio->extent_cache = bch2_inode_extent_cache(c, inode);
+
+		bch2_read(c, rbio, inode_inum(inode), flags);
 	}
 
 	iter->count += shorten;
@@ -188,6 +198,13 @@ ssize_t bch2_read_iter(struct kiocb *iocb, struct iov_iter *iter)
 		struct blk_plug plug;
 
 		if (unlikely(mapping->nrpages)) {
+			if ((iocb->ki_flags & IOCB_NOWAIT) &&
+			    filemap_range_needs_writeback(mapping, iocb->ki_pos,
+							  iocb->ki_pos + count - 1)) {
+				ret = -EAGAIN;
+				goto out;
+			}
+
 			ret = filemap_write_and_wait_range(mapping,
 						iocb->ki_pos,
 						iocb->ki_pos + count - 1);
@@ -204,7 +221,15 @@ ssize_t bch2_read_iter(struct kiocb *iocb, struct iov_iter *iter)
 		if (ret >= 0)
 			iocb->ki_pos += ret;
 	} else {
-		bch2_pagecache_add_get(inode);
+		if (iocb->ki_flags & IOCB_NOWAIT) {
+			if (!bch2_pagecache_add_tryget(inode)) {
+				ret = -EAGAIN;
+				goto out;
+			}
+		} else {
+			bch2_pagecache_add_get(inode);
+		}
+
 		ret = filemap_read(iocb, iter, ret);
 		bch2_pagecache_add_put(inode);
 	}
@@ -432,6 +457,28 @@ static __always_inline void bch2_dio_write_end(struct dio_write *dio)
 		set_bit(EI_INODE_ERROR, &inode->ei_flags);
 }
 
+static struct bch_nocow_extent_cache *bch2_inode_nocow_cache(struct bch_inode_info *inode)
+{
+	struct bch_nocow_extent_cache *e = READ_ONCE(inode->ei_nocow_cache), *old;
+
+	if (likely(e))
+		return e;
+
+	e = kzalloc(sizeof(*e), GFP_KERNEL);
+	if (!e)
+		return NULL;
+
+	spin_lock_init(&e->lock);
+
+	old = cmpxchg(&inode->ei_nocow_cache, NULL, e);
+	if (old) {
+		kfree(e);
+		e = old;
+	}
+
+	return e;
+}
+
 static __always_inline long bch2_dio_write_loop(struct dio_write *dio)
 {
 	struct bch_fs *c = dio->op.c;
@@ -503,6 +550,9 @@ static __always_inline long bch2_dio_write_loop(struct dio_write *dio)
 		dio->op.subvol		= inode->ei_inum.subvol;
 		dio->op.pos		= POS(inode->v.i_ino, (u64) req->ki_pos >> 9);
 		dio->op.devs_need_flush	= &inode->ei_devs_need_flush;
+		dio->op.incompressible_streak = &inode->ei_incompressible_streak;
+		if (dio->op.opts.nocow && c->opts.nocow_enabled)
+			dio->op.nocow_cache = bch2_inode_nocow_cache(inode);
 
 		if (sync)
 			dio->op.flags |= BCH_WRITE_SYNC;
@@ -584,6 +634,7 @@ ssize_t bch2_direct_write(struct kiocb *req, struct iov_iter *iter)
 	struct bch_fs *c = inode->v.i_sb->s_fs_info;
 	struct dio_write *dio;
 	struct bio *bio;
+	bool nowait = req->ki_flags & IOCB_NOWAIT;
 	bool locked = true, extending;
 	ssize_t ret;
 
@@ -595,17 +646,20 @@ ssize_t bch2_direct_write(struct kiocb *req, struct iov_iter *iter)
 	if (!bch2_write_ref_tryget(c, BCH_WRITE_REF_dio_write))
 		return -EROFS;
 
-	inode_lock(&inode->v);
+	if (nowait) {
+		if (!inode_trylock(&inode->v)) {
+			bch2_write_ref_put(c, BCH_WRITE_REF_dio_write);
+			return -EAGAIN;
+		}
+	} else {
+		inode_lock(&inode->v);
+	}
 
 	ret = generic_write_checks(req, iter);
 	if (unlikely(ret <= 0))
 		goto err_put_write_ref;
 
-	ret = file_remove_privs(file);
-	if (unlikely(ret))
-		goto err_put_write_ref;
-
-	ret = file_update_time(file);
+	ret = kiocb_modified(req);
 	if (unlikely(ret))
 		goto err_put_write_ref;
 
@@ -614,10 +668,33 @@ ssize_t bch2_direct_write(struct kiocb *req, struct iov_iter *iter)
 		goto err_put_write_ref;
 	}
 
+	extending = req->ki_pos + iter->count > inode->v.i_size;
+
+	/*
+	 * Extending writes are always completed synchronously, and flushing
+	 * dirty pagecache means waiting on writeback; punt both back to the
+	 * caller:
+	 */
+	if (nowait &&
+	    (extending ||
+	     filemap_range_has_page(mapping, req->ki_pos,
+				    req->ki_pos + iter->count - 1))) {
+		ret = -EAGAIN;
+		goto err_put_write_ref;
+	}
+
 	inode_dio_begin(&inode->v);
-	bch2_pagecache_block_get(inode);
 
-	extending = req->ki_pos + iter->count > inode->v.i_size;
+	if (nowait) {
+		if (!bch2_pagecache_block_tryget(inode)) {
+			inode_dio_end(&inode->v);
+			ret = -EAGAIN;
+			goto err_put_write_ref;
+		}
+	} else {
+		bch2_pagecache_block_get(inode);
+	}
+
 	if (!extending) {
 		inode_unlock(&inode->v);
 		locked = false;
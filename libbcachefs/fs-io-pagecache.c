@@ -29,8 +29,11 @@ int bch2_filemap_get_contig_folios_d(struct address_space *mapping,
 			break;
 
 		f = __filemap_get_folio(mapping, pos >> PAGE_SHIFT, fgp_flags, gfp);
-		if (IS_ERR_OR_NULL(f))
+		if (IS_ERR_OR_NULL(f)) {
+			if (PTR_ERR_OR_ZERO(f) == -EAGAIN)
+				ret = -EAGAIN;
 			break;
+		}
 
 		BUG_ON(fs->nr && folio_pos(f) != pos);
 
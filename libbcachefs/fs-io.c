@@ -9,6 +9,7 @@
 #include "clock.h"
 #include "error.h"
 #include "extents.h"
+#include "extent_cache.h"
 #include "extent_update.h"
 #include "fs.h"
 #include "fs-io.h"
@@ -102,6 +103,39 @@ static int bch2_inode_flush_nocow_writes(struct bch_fs *c,
 	return 0;
 }
 
+/* extent cache: */
+
+/* only files that have seen this many reads get an extent cache: */
+#define EXTENT_CACHE_HOT_READS		64
+
+struct bch_extent_cache *bch2_inode_extent_cache(struct bch_fs *c,
+						 struct bch_inode_info *inode)
+{
+	struct bch_extent_cache *cache = READ_ONCE(inode->ei_extent_cache), *old;
+	unsigned size = READ_ONCE(c->opts.extent_cache_size);
+
+	if (!size)
+		return NULL;
+
+	if (likely(cache))
+		return cache;
+
+	if (atomic_inc_return(&inode->ei_nr_reads) < EXTENT_CACHE_HOT_READS)
+		return NULL;
+
+	cache = bch2_extent_cache_alloc(size, GFP_NOFS|__GFP_NOWARN);
+	if (!cache)
+		return NULL;
+
+	old = cmpxchg(&inode->ei_extent_cache, NULL, cache);
+	if (old) {
+		bch2_extent_cache_free(cache);
+		cache = old;
+	}
+
+	return cache;
+}
+
 /* i_size updates: */
 
 struct inode_new_size {
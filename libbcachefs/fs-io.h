@@ -140,6 +140,28 @@ static inline void bch2_i_sectors_acct(struct bch_fs *c, struct bch_inode_info *
 	}
 }
 
+/*
+ * Detect reads continuing a long sequential stream, so they can skip being
+ * promoted; unlocked, as it's only a heuristic:
+ */
+static inline bool bch2_read_is_sequential(struct bch_fs *c,
+					   struct bch_inode_info *inode,
+					   u64 sector, u64 sectors)
+{
+	u64 cutoff = READ_ONCE(c->opts.promote_sequential_cutoff) >> 9;
+	u64 run = READ_ONCE(inode->ei_read_seq_end) == sector
+		? READ_ONCE(inode->ei_read_seq_sectors) + sectors
+		: sectors;
+
+	WRITE_ONCE(inode->ei_read_seq_end, sector + sectors);
+	WRITE_ONCE(inode->ei_read_seq_sectors, run);
+
+	return cutoff && run >= cutoff;
+}
+
+struct bch_extent_cache *bch2_inode_extent_cache(struct bch_fs *,
+						 struct bch_inode_info *);
+
 static inline struct address_space *faults_disabled_mapping(void)
 {
 	return (void *) (((unsigned long) current->faults_disabled_mapping) & ~1UL);
@@ -8,6 +8,7 @@
 #include "fs-common.h"
 #include "fs-ioctl.h"
 #include "quota.h"
+#include "rebalance.h"
 
 #include <linux/compat.h>
 #include <linux/fsnotify.h>
@@ -211,6 +212,7 @@ static int bch2_ioc_reinherit_attrs(struct bch_fs *c,
 				    const char __user *name)
 {
 	struct bch_hash_info hash = bch2_hash_info_init(c, &src->ei_inode);
+	struct bch_io_opts old_io_opts, new_io_opts;
 	struct bch_inode_info *dst;
 	struct inode *vinode = NULL;
 	char *kname = NULL;
@@ -245,6 +247,7 @@ static int bch2_ioc_reinherit_attrs(struct bch_fs *c,
 		goto err2;
 
 	bch2_lock_inodes(INODE_UPDATE_LOCK, src, dst);
+	bch2_inode_opts_get(&old_io_opts, c, &dst->ei_inode);
 
 	if (inode_attr_changing(src, dst, Inode_opt_project)) {
 		ret = bch2_fs_quota_transfer(c, dst,
@@ -256,9 +259,15 @@ static int bch2_ioc_reinherit_attrs(struct bch_fs *c,
 	}
 
 	ret = bch2_write_inode(c, dst, bch2_reinherit_attrs_fn, src, 0);
+	bch2_inode_opts_get(&new_io_opts, c, &dst->ei_inode);
 err3:
 	bch2_unlock_inodes(INODE_UPDATE_LOCK, src, dst);
 
+	if (!ret &&
+	    S_ISREG(dst->v.i_mode) &&
+	    bch2_rebalance_opts_changed(old_io_opts, new_io_opts))
+		bch2_set_rebalance_needs_scan(c, dst->ei_inode.bi_inum);
+
 	/* return true if we did work */
 	if (ret >= 0)
 		ret = !ret;
@@ -3,12 +3,14 @@
 
 #include "bcachefs.h"
 #include "acl.h"
+#include "alloc_background.h"
 #include "bkey_buf.h"
 #include "btree_update.h"
 #include "buckets.h"
 #include "chardev.h"
 #include "dirent.h"
 #include "errcode.h"
+#include "extent_cache.h"
 #include "extents.h"
 #include "fs.h"
 #include "fs-common.h"
@@ -281,6 +283,13 @@ static struct bch_inode_info *__bch2_new_inode(struct bch_fs *c)
 	inode->ei_flags = 0;
 	mutex_init(&inode->ei_quota_lock);
 	memset(&inode->ei_devs_need_flush, 0, sizeof(inode->ei_devs_need_flush));
+	atomic_set(&inode->ei_incompressible_streak, 0);
+	inode->ei_append_streak = 0;
+	inode->ei_nocow_cache		= NULL;
+	inode->ei_extent_cache		= NULL;
+	atomic_set(&inode->ei_nr_reads, 0);
+	inode->ei_read_seq_end		= 0;
+	inode->ei_read_seq_sectors	= 0;
 
 	if (unlikely(inode_init_always(c->vfs_sb, &inode->v))) {
 		kmem_cache_free(bch2_inode_cache, inode);
@@ -1203,7 +1212,7 @@ static int bch2_open(struct inode *vinode, struct file *file)
 			return ret;
 	}
 
-	file->f_mode |= FMODE_CAN_ODIRECT;
+	file->f_mode |= FMODE_CAN_ODIRECT|FMODE_NOWAIT|FMODE_BUF_RASYNC|FMODE_BUF_WASYNC;
 
 	return generic_file_open(vinode, file);
 }
@@ -1585,6 +1594,8 @@ static void bch2_vfs_inode_init(struct btree_trans *trans, subvol_inum inum,
 
 static void bch2_free_inode(struct inode *vinode)
 {
+	kfree(to_bch_ei(vinode)->ei_nocow_cache);
+	bch2_extent_cache_free(to_bch_ei(vinode)->ei_extent_cache);
 	kmem_cache_free(bch2_inode_cache, to_bch_ei(vinode));
 }
 
@@ -1635,7 +1646,7 @@ static void bch2_evict_inode(struct inode *vinode)
 				KEY_TYPE_QUOTA_WARN);
 		bch2_quota_acct(c, inode->ei_qid, Q_INO, -1,
 				KEY_TYPE_QUOTA_WARN);
-		bch2_inode_rm(c, inode_inum(inode));
+		bch2_inode_rm_async(c, inode_inum(inode));
 	}
 
 	mutex_lock(&c->vfs_inodes_lock);
@@ -2019,7 +2030,11 @@ got_sb:
 	if (ret)
 		goto err_put_super;
 
-	sb->s_bdi->ra_pages		= VM_READAHEAD_PAGES;
+	/*
+	 * bch2_recalc_capacity() ran before we had a vfs superblock, so the
+	 * readahead window hasn't been sized for our devices yet:
+	 */
+	bch2_set_ra_pages(c, bch2_fs_ra_pages(c));
 
 	for_each_online_member(c, ca) {
 		struct block_device *bdev = ca->disk_sb.bdev;
@@ -3,6 +3,7 @@
 #define _BCACHEFS_FS_H
 
 #include "inode.h"
+#include "lock_profile.h"
 #include "opts.h"
 #include "str_hash.h"
 #include "quota_types.h"
@@ -22,6 +23,8 @@ struct bch_inode_info {
 	struct mutex		ei_update_lock;
 	u64			ei_quota_reserved;
 	unsigned long		ei_last_dirtied;
+	/* consecutive buffered writes that extended i_size: */
+	unsigned		ei_append_streak;
 	two_state_lock_t	ei_pagecache_lock;
 
 	struct mutex		ei_quota_lock;
@@ -38,16 +41,43 @@ struct bch_inode_info {
 	 */
 	struct bch_devs_mask	ei_devs_need_flush;
 
+	/* see bch_write_op.incompressible_streak: */
+	atomic_t		ei_incompressible_streak;
+	/* allocated on first O_DIRECT write to a nocow file: */
+	struct bch_nocow_extent_cache *ei_nocow_cache;
+	/* allocated once the file has seen enough reads: */
+	struct bch_extent_cache	*ei_extent_cache;
+	atomic_t		ei_nr_reads;
+
+	/* see bch2_read_is_sequential(): */
+	u64			ei_read_seq_end;
+	u64			ei_read_seq_sectors;
+
 	/* copy of inode in btree: */
 	struct bch_inode_unpacked ei_inode;
 };
 
+static inline void bch2_pagecache_lock(struct bch_inode_info *inode, int s)
+{
+	struct bch_fs *c = inode->v.i_sb->s_fs_info;
+
+	if (likely(bch2_two_state_trylock(&inode->ei_pagecache_lock, s))) {
+		bch2_lock_profile_acquired(c, BCH_LOCK_pagecache);
+	} else {
+		u64 start = local_clock();
+
+		__bch2_two_state_lock(&inode->ei_pagecache_lock, s);
+		bch2_lock_profile_contended(c, BCH_LOCK_pagecache, start, _THIS_IP_);
+	}
+}
+
 #define bch2_pagecache_add_put(i)	bch2_two_state_unlock(&i->ei_pagecache_lock, 0)
 #define bch2_pagecache_add_tryget(i)	bch2_two_state_trylock(&i->ei_pagecache_lock, 0)
-#define bch2_pagecache_add_get(i)	bch2_two_state_lock(&i->ei_pagecache_lock, 0)
+#define bch2_pagecache_add_get(i)	bch2_pagecache_lock(i, 0)
 
 #define bch2_pagecache_block_put(i)	bch2_two_state_unlock(&i->ei_pagecache_lock, 1)
-#define bch2_pagecache_block_get(i)	bch2_two_state_lock(&i->ei_pagecache_lock, 1)
+#define bch2_pagecache_block_tryget(i)	bch2_two_state_trylock(&i->ei_pagecache_lock, 1)
+#define bch2_pagecache_block_get(i)	bch2_pagecache_lock(i, 1)
 
 static inline subvol_inum inode_inum(struct bch_inode_info *inode)
 {
@@ -19,6 +19,11 @@
 
 #include <linux/bsearch.h>
 #include <linux/dcache.h> /* struct qstr */
+#include <linux/file.h>
+#include <linux/kthread.h>
+#include <linux/min_heap.h>
+#include <linux/shmem_fs.h>
+#include <linux/sort.h>
 
 /*
  * XXX: this is handling transaction restarts without returning
@@ -635,10 +640,20 @@ struct inode_walker {
 	struct bpos			last_pos;
 
 	DARRAY(struct inode_walker_entry) inodes;
+
+	/*
+	 * The passes that use walk_inode() visit inode numbers in order, so
+	 * instead of a lookup for every new inode we keep an iterator on the
+	 * inodes btree that only moves forward:
+	 */
+	bool				iter_initialized;
+	struct btree_iter		iter;
 };
 
-static void inode_walker_exit(struct inode_walker *w)
+static void inode_walker_exit(struct btree_trans *trans, struct inode_walker *w)
 {
+	if (w->iter_initialized)
+		bch2_trans_iter_exit(trans, &w->iter);
 	darray_exit(&w->inodes);
 }
 
@@ -664,22 +679,28 @@ static int get_inodes_all_snapshots(struct btree_trans *trans,
 				    struct inode_walker *w, u64 inum)
 {
 	struct bch_fs *c = trans->c;
-	struct btree_iter iter;
 	struct bkey_s_c k;
 	int ret;
 
 	w->recalculate_sums = false;
 	w->inodes.nr = 0;
 
-	for_each_btree_key_norestart(trans, iter, BTREE_ID_inodes, POS(0, inum),
-				     BTREE_ITER_all_snapshots, k, ret) {
+	if (!w->iter_initialized) {
+		bch2_trans_iter_init(trans, &w->iter, BTREE_ID_inodes, POS(0, inum),
+				     BTREE_ITER_all_snapshots|BTREE_ITER_prefetch);
+		w->iter_initialized = true;
+	} else {
+		/* Usually a short step forward, within the same leaf: */
+		bch2_btree_iter_set_pos(&w->iter, POS(0, inum));
+	}
+
+	for_each_btree_key_continue_norestart(w->iter, BTREE_ITER_all_snapshots, k, ret) {
 		if (k.k->p.offset != inum)
 			break;
 
 		if (bkey_is_inode(k.k))
 			add_inode(c, w, k);
 	}
-	bch2_trans_iter_exit(trans, &iter);
 
 	if (ret)
 		return ret;
@@ -1634,11 +1655,140 @@ fsck_err:
 }
 
 /*
- * Walk extents: verify that extents have a corresponding S_ISREG inode, and
- * that i_size an i_sectors are consistent
+ * Sharded fsck passes:
+ *
+ * Passes that walk a btree keyed by inode number and only carry state from one
+ * inode to the next (extents, dirents, xattrs) can be split into ranges of
+ * whole inodes, each checked by its own thread with its own btree_trans.
+ *
+ * Shard boundaries are taken from the pivots of the level 1 btree nodes, which
+ * gives roughly equal numbers of leaf nodes per shard without reading leaves.
  */
-int bch2_check_extents(struct bch_fs *c)
+
+typedef int (*fsck_range_fn)(struct btree_trans *, struct bpos, struct bpos);
+
+struct fsck_shard {
+	struct closure		*cl;
+	struct bch_fs		*c;
+	fsck_range_fn		fn;
+	struct bpos		start;
+	struct bpos		end;
+	int			ret;
+};
+
+static int fsck_shard_boundaries(struct btree_trans *trans, enum btree_id btree,
+				 struct bpos start, unsigned nr_shards,
+				 darray_u64 *ret_bounds)
+{
+	darray_u64 pivots = {};
+	struct btree_iter iter;
+	struct btree *b;
+	int ret;
+
+	__for_each_btree_node(trans, iter, btree, start, 0, 1, 0, b, ret) {
+		if (b->c.level != 1 || bpos_eq(b->key.k.p, SPOS_MAX))
+			continue;
+
+		ret = darray_push(&pivots, b->key.k.p.inode);
+		if (ret)
+			break;
+	}
+	bch2_trans_iter_exit(trans, &iter);
+
+	if (ret)
+		goto err;
+
+	for (unsigned i = 1; i < nr_shards && pivots.nr; i++) {
+		u64 inum = pivots.data[div_u64((u64) i * pivots.nr, nr_shards)];
+
+		/* Shards must contain whole inodes: */
+		if (inum == U64_MAX ||
+		    (ret_bounds->nr && darray_last(*ret_bounds) >= inum))
+			continue;
+
+		ret = darray_push(ret_bounds, inum);
+		if (ret)
+			break;
+	}
+err:
+	darray_exit(&pivots);
+	return ret;
+}
+
+static int fsck_shard_thread(void *arg)
+{
+	struct fsck_shard *s = arg;
+
+	s->ret = bch2_trans_run(s->c, s->fn(trans, s->start, s->end));
+	closure_put(s->cl);
+	return 0;
+}
+
+static int fsck_run_sharded(struct bch_fs *c, enum btree_id btree,
+			    struct bpos start, fsck_range_fn fn)
+{
+	darray_u64 bounds = {};
+	struct fsck_shard *shards = NULL;
+	struct closure cl;
+	unsigned i, nr;
+	int ret = 0;
+
+	if (c->opts.fsck_threads > 1)
+		ret = bch2_trans_run(c,
+			fsck_shard_boundaries(trans, btree, start,
+					      c->opts.fsck_threads, &bounds));
+	if (ret)
+		goto err;
+
+	if (!bounds.nr) {
+		ret = bch2_trans_run(c, fn(trans, start, SPOS_MAX));
+		goto err;
+	}
+
+	nr = bounds.nr + 1;
+	shards = kcalloc(nr, sizeof(*shards), GFP_KERNEL);
+	if (!shards) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	closure_init_stack(&cl);
+
+	for (i = 0; i < nr; i++) {
+		struct fsck_shard *s = shards + i;
+		struct task_struct *t;
+
+		s->cl		= &cl;
+		s->c		= c;
+		s->fn		= fn;
+		s->start	= i ? POS(bounds.data[i - 1] + 1, 0) : start;
+		s->end		= i < bounds.nr
+			? SPOS(bounds.data[i], U64_MAX, U32_MAX)
+			: SPOS_MAX;
+
+		closure_get(&cl);
+		t = kthread_run(fsck_shard_thread, s, "bch-fsck/%u", i);
+		if (IS_ERR(t)) {
+			/* Run it synchronously instead: */
+			s->ret = bch2_trans_run(c, fn(trans, s->start, s->end));
+			closure_put(&cl);
+		}
+	}
+
+	closure_sync(&cl);
+
+	for (i = 0; i < nr && !ret; i++)
+		ret = shards[i].ret;
+err:
+	kfree(shards);
+	darray_exit(&bounds);
+	return ret;
+}
+
+static int check_extents_range(struct btree_trans *trans,
+			       struct bpos start, struct bpos end)
 {
+	struct bch_fs *c = trans->c;
 	struct inode_walker w = inode_walker_init();
 	struct snapshots_seen s;
 	struct extent_ends extent_ends;
@@ -1647,9 +1797,8 @@ int bch2_check_extents(struct bch_fs *c)
 	snapshots_seen_init(&s);
 	extent_ends_init(&extent_ends);
 
-	int ret = bch2_trans_run(c,
-		for_each_btree_key_commit(trans, iter, BTREE_ID_extents,
-				POS(BCACHEFS_ROOT_INO, 0),
+	int ret = for_each_btree_key_upto_commit(trans, iter, BTREE_ID_extents,
+				start, end,
 				BTREE_ITER_prefetch|BTREE_ITER_all_snapshots, k,
 				&res, NULL,
 				BCH_TRANS_COMMIT_no_enospc, ({
@@ -1657,13 +1806,23 @@ int bch2_check_extents(struct bch_fs *c)
 			check_extent(trans, &iter, k, &w, &s, &extent_ends) ?:
 			check_extent_overbig(trans, &iter, k);
 		})) ?:
-		check_i_sectors_notnested(trans, &w));
+		check_i_sectors_notnested(trans, &w);
 
 	bch2_disk_reservation_put(c, &res);
 	extent_ends_exit(&extent_ends);
-	inode_walker_exit(&w);
+	inode_walker_exit(trans, &w);
 	snapshots_seen_exit(&s);
+	return ret;
+}
 
+/*
+ * Walk extents: verify that extents have a corresponding S_ISREG inode, and
+ * that i_size an i_sectors are consistent
+ */
+int bch2_check_extents(struct bch_fs *c)
+{
+	int ret = fsck_run_sharded(c, BTREE_ID_extents, POS(BCACHEFS_ROOT_INO, 0),
+				   check_extents_range);
 	bch_err_fn(c, ret);
 	return ret;
 }
@@ -2133,11 +2292,8 @@ fsck_err:
 	return ret;
 }
 
-/*
- * Walk dirents: verify that they all have a corresponding S_ISDIR inode,
- * validate d_type
- */
-int bch2_check_dirents(struct bch_fs *c)
+static int check_dirents_range(struct btree_trans *trans,
+			       struct bpos start, struct bpos end)
 {
 	struct inode_walker dir = inode_walker_init();
 	struct inode_walker target = inode_walker_init();
@@ -2146,19 +2302,29 @@ int bch2_check_dirents(struct bch_fs *c)
 
 	snapshots_seen_init(&s);
 
-	int ret = bch2_trans_run(c,
-		for_each_btree_key_commit(trans, iter, BTREE_ID_dirents,
-				POS(BCACHEFS_ROOT_INO, 0),
+	int ret = for_each_btree_key_upto_commit(trans, iter, BTREE_ID_dirents,
+				start, end,
 				BTREE_ITER_prefetch|BTREE_ITER_all_snapshots,
 				k,
 				NULL, NULL,
 				BCH_TRANS_COMMIT_no_enospc,
 			check_dirent(trans, &iter, k, &hash_info, &dir, &target, &s)) ?:
-		check_subdir_count_notnested(trans, &dir));
+		check_subdir_count_notnested(trans, &dir);
 
 	snapshots_seen_exit(&s);
-	inode_walker_exit(&dir);
-	inode_walker_exit(&target);
+	inode_walker_exit(trans, &dir);
+	inode_walker_exit(trans, &target);
+	return ret;
+}
+
+/*
+ * Walk dirents: verify that they all have a corresponding S_ISDIR inode,
+ * validate d_type
+ */
+int bch2_check_dirents(struct bch_fs *c)
+{
+	int ret = fsck_run_sharded(c, BTREE_ID_dirents, POS(BCACHEFS_ROOT_INO, 0),
+				   check_dirents_range);
 	bch_err_fn(c, ret);
 	return ret;
 }
@@ -2199,23 +2365,31 @@ static int check_xattr(struct btree_trans *trans, struct btree_iter *iter,
 	return ret;
 }
 
-/*
- * Walk xattrs: verify that they all have a corresponding inode
- */
-int bch2_check_xattrs(struct bch_fs *c)
+static int check_xattrs_range(struct btree_trans *trans,
+			      struct bpos start, struct bpos end)
 {
 	struct inode_walker inode = inode_walker_init();
 	struct bch_hash_info hash_info;
-	int ret = 0;
 
-	ret = bch2_trans_run(c,
-		for_each_btree_key_commit(trans, iter, BTREE_ID_xattrs,
-			POS(BCACHEFS_ROOT_INO, 0),
+	int ret = for_each_btree_key_upto_commit(trans, iter, BTREE_ID_xattrs,
+			start, end,
 			BTREE_ITER_prefetch|BTREE_ITER_all_snapshots,
 			k,
 			NULL, NULL,
 			BCH_TRANS_COMMIT_no_enospc,
-		check_xattr(trans, &iter, k, &hash_info, &inode)));
+		check_xattr(trans, &iter, k, &hash_info, &inode));
+
+	inode_walker_exit(trans, &inode);
+	return ret;
+}
+
+/*
+ * Walk xattrs: verify that they all have a corresponding inode
+ */
+int bch2_check_xattrs(struct bch_fs *c)
+{
+	int ret = fsck_run_sharded(c, BTREE_ID_xattrs, POS(BCACHEFS_ROOT_INO, 0),
+				   check_xattrs_range);
 	bch_err_fn(c, ret);
 	return ret;
 }
@@ -2402,13 +2576,57 @@ static bool path_is_dup(pathbuf *p, u64 inum, u32 snapshot)
 	return false;
 }
 
+/*
+ * Directories we've already walked up to the root, so that we walk each one
+ * once instead of once per descendant:
+ */
+struct reachable_dir {
+	struct rhash_head	hash;
+	struct pathbuf_entry	key;
+};
+
+static const struct rhashtable_params reachable_dirs_params = {
+	.head_offset		= offsetof(struct reachable_dir, hash),
+	.key_offset		= offsetof(struct reachable_dir, key),
+	.key_len		= offsetof(struct pathbuf_entry, snapshot) + sizeof(u32),
+	.automatic_shrinking	= true,
+};
+
+static bool dir_is_reachable(struct rhashtable *reachable, u64 inum, u32 snapshot)
+{
+	struct pathbuf_entry key = { .inum = inum, .snapshot = snapshot };
+
+	return rhashtable_lookup_fast(reachable, &key, reachable_dirs_params) != NULL;
+}
+
+static void path_mark_reachable(struct rhashtable *reachable, pathbuf *p)
+{
+	darray_for_each(*p, i) {
+		struct reachable_dir *d = kmalloc(sizeof(*d), GFP_KERNEL);
+
+		/* It's only a cache: */
+		if (!d)
+			return;
+
+		d->key = *i;
+		if (rhashtable_lookup_insert_fast(reachable, &d->hash, reachable_dirs_params))
+			kfree(d);
+	}
+}
+
+static void reachable_dir_free(void *d, void *arg)
+{
+	kfree(d);
+}
+
 /*
  * Check that a given inode is reachable from its subvolume root - we already
  * verified subvolume connectivity:
  *
  * XXX: we should also be verifying that inodes are in the right subvolumes
  */
-static int check_path(struct btree_trans *trans, pathbuf *p, struct bkey_s_c inode_k)
+static int check_path(struct btree_trans *trans, pathbuf *p,
+		      struct rhashtable *reachable, struct bkey_s_c inode_k)
 {
 	struct bch_fs *c = trans->c;
 	struct btree_iter inode_iter = {};
@@ -2421,6 +2639,10 @@ static int check_path(struct btree_trans *trans, pathbuf *p, struct bkey_s_c ino
 
 	BUG_ON(bch2_inode_unpack(inode_k, &inode));
 
+	if (S_ISDIR(inode.bi_mode) &&
+	    dir_is_reachable(reachable, inode.bi_inum, snapshot))
+		return 0;
+
 	while (!inode.bi_subvol) {
 		struct btree_iter dirent_iter;
 		struct bkey_s_c_dirent d;
@@ -2476,6 +2698,11 @@ static int check_path(struct btree_trans *trans, pathbuf *p, struct bkey_s_c ino
 
 		snapshot = inode_k.k->p.snapshot;
 
+		if (dir_is_reachable(reachable, inode.bi_inum, snapshot)) {
+			path_mark_reachable(reachable, p);
+			break;
+		}
+
 		if (path_is_dup(p, inode.bi_inum, snapshot)) {
 			/* XXX print path */
 			bch_err(c, "directory structure loop");
@@ -2496,6 +2723,9 @@ static int check_path(struct btree_trans *trans, pathbuf *p, struct bkey_s_c ino
 			break;
 		}
 	}
+
+	if (!ret && inode.bi_subvol)
+		path_mark_reachable(reachable, p);
 out:
 fsck_err:
 	bch2_trans_iter_exit(trans, &inode_iter);
@@ -2512,8 +2742,13 @@ fsck_err:
 int bch2_check_directory_structure(struct bch_fs *c)
 {
 	pathbuf path = { 0, };
+	struct rhashtable reachable;
 	int ret;
 
+	ret = rhashtable_init(&reachable, &reachable_dirs_params);
+	if (ret)
+		return ret;
+
 	ret = bch2_trans_run(c,
 		for_each_btree_key_commit(trans, iter, BTREE_ID_inodes, POS_MIN,
 					  BTREE_ITER_intent|
@@ -2526,8 +2761,9 @@ int bch2_check_directory_structure(struct bch_fs *c)
 			if (bch2_inode_flags(k) & BCH_INODE_unlinked)
 				continue;
 
-			check_path(trans, &path, k);
+			check_path(trans, &path, &reachable, k);
 		})));
+	rhashtable_free_and_destroy(&reachable, reachable_dir_free, NULL);
 	darray_exit(&path);
 
 	bch_err_fn(c, ret);
@@ -2651,8 +2887,395 @@ static int check_nlinks_find_hardlinks(struct bch_fs *c,
 	return ret;
 }
 
+/*
+ * When the hardlink table doesn't fit in memory, instead of walking the dirents
+ * once per range of inodes that does fit we emit a reference for every dirent
+ * that points to a non directory, sort them in runs that fit in memory, spill
+ * the runs to a temporary file, and merge them while walking the inodes btree -
+ * two passes, however many hardlinks there are.
+ *
+ * Whether a dirent is visible in a given snapshot version of the inode depends
+ * on which snapshots it was overwritten in - that's the snapshots_seen state,
+ * which we no longer have when merging - so a reference is followed by a
+ * record for each other version of the dirent we'd seen at that position:
+ */
+struct nlink_ref {
+	u64		inum;
+	u32		snapshot;
+	u32		overwritten;	/* 0 for the reference itself */
+	u64		seq;
+};
+
+struct nlink_ref_run {
+	loff_t			pos;
+	loff_t			end;
+	struct nlink_ref	*d;
+	size_t			nr;
+	size_t			idx;
+};
+
+typedef DEFINE_MIN_HEAP(struct nlink_ref_run *, nlink_ref_heap) nlink_ref_heap;
+
+struct nlink_refs {
+	struct file		*file;
+	loff_t			file_size;
+	u64			seq;
+
+	size_t			nr;
+	size_t			size;
+	struct nlink_ref	*d;
+
+	DARRAY(struct nlink_ref_run) runs;
+	nlink_ref_heap		heap;
+
+	/* versions of the inode we're currently checking: */
+	u64			inum;
+	DARRAY(struct nlink)	inode;
+	snapshot_id_list	overwritten;
+};
+
+#define NLINK_REFS_RUN_NR	(1U << 22)
+#define NLINK_REFS_READ_NR	(1U << 12)
+
+static int nlink_ref_cmp(const void *_l, const void *_r)
+{
+	const struct nlink_ref *l = _l;
+	const struct nlink_ref *r = _r;
+
+	return  cmp_int(l->inum,	r->inum) ?:
+		cmp_int(l->snapshot,	r->snapshot) ?:
+		cmp_int(l->seq,		r->seq) ?:
+		cmp_int(l->overwritten,	r->overwritten);
+}
+
+static bool nlink_ref_run_less(const void *l, const void *r, void *args)
+{
+	const struct nlink_ref_run *_l = *((struct nlink_ref_run **) l);
+	const struct nlink_ref_run *_r = *((struct nlink_ref_run **) r);
+
+	return nlink_ref_cmp(&_l->d[_l->idx], &_r->d[_r->idx]) < 0;
+}
+
+static void nlink_ref_run_swp(void *l, void *r, void *args)
+{
+	struct nlink_ref_run **_l = l;
+	struct nlink_ref_run **_r = r;
+
+	swap(*_l, *_r);
+}
+
+static const struct min_heap_callbacks nlink_ref_heap_callbacks = {
+	.less	= nlink_ref_run_less,
+	.swp	= nlink_ref_run_swp,
+};
+
+static void nlink_refs_exit(struct nlink_refs *r)
+{
+	darray_exit(&r->overwritten);
+	darray_exit(&r->inode);
+	kvfree(r->heap.data);
+	darray_for_each(r->runs, run)
+		if (run->d != r->d)
+			kvfree(run->d);
+	darray_exit(&r->runs);
+	kvfree(r->d);
+	if (r->file)
+		fput(r->file);
+}
+
+static int nlink_refs_init(struct bch_fs *c, struct nlink_refs *r)
+{
+	memset(r, 0, sizeof(*r));
+
+	/* Runs are as big as we can allocate - fewer runs, fewer seeks when merging: */
+	r->size = NLINK_REFS_RUN_NR;
+	while (!(r->d = kvmalloc_array(r->size, sizeof(r->d[0]), GFP_KERNEL|__GFP_NOWARN))) {
+		if (r->size == NLINK_REFS_READ_NR) {
+			bch_err(c, "fsck: error allocating memory for nlink refs");
+			return -BCH_ERR_ENOMEM_fsck_nlink_refs;
+		}
+		r->size /= 2;
+	}
+
+	return 0;
+}
+
+static int nlink_refs_flush(struct bch_fs *c, struct nlink_refs *r)
+{
+	if (!r->nr)
+		return 0;
+
+	sort(r->d, r->nr, sizeof(r->d[0]), nlink_ref_cmp, NULL);
+
+	if (!r->file) {
+		struct file *file = shmem_file_setup("bcachefs_fsck_nlinks", 0, 0);
+
+		if (IS_ERR(file)) {
+			bch_err(c, "fsck: error creating temporary file for nlink refs: %s",
+				bch2_err_str(PTR_ERR(file)));
+			return PTR_ERR(file);
+		}
+		r->file = file;
+	}
+
+	struct nlink_ref_run run = { .pos = r->file_size };
+	const void *buf = r->d;
+	size_t bytes = r->nr * sizeof(r->d[0]);
+
+	while (bytes) {
+		ssize_t ret = kernel_write(r->file, buf, bytes, &r->file_size);
+
+		if (ret < 0) {
+			bch_err(c, "fsck: error writing nlink refs: %s", bch2_err_str(ret));
+			return ret;
+		}
+
+		buf	+= ret;
+		bytes	-= ret;
+	}
+
+	run.end = r->file_size;
+	r->nr = 0;
+	return darray_push(&r->runs, run);
+}
+
+static int nlink_refs_add(struct btree_trans *trans, struct nlink_refs *r,
+			  struct snapshots_seen *s, u64 inum, u32 snapshot)
+{
+	/*
+	 * Flush before adding anything, so that a restart from relocking can't
+	 * leave a partial group of records:
+	 */
+	if (r->nr + s->ids.nr > r->size) {
+		int ret = drop_locks_do(trans, nlink_refs_flush(trans->c, r));
+		if (ret)
+			return ret;
+	}
+
+	struct nlink_ref ref = {
+		.inum		= inum,
+		.snapshot	= snapshot,
+		.seq		= r->seq++,
+	};
+
+	r->d[r->nr++] = ref;
+
+	/* Versions at this position we've already seen are in descendants: */
+	for (ssize_t i = s->ids.nr - 2; i >= 0; --i) {
+		ref.overwritten = s->ids.data[i];
+		r->d[r->nr++] = ref;
+	}
+
+	return 0;
+}
+
+static int nlink_ref_run_fill(struct bch_fs *c, struct nlink_refs *r,
+			      struct nlink_ref_run *run)
+{
+	void *buf = run->d;
+	size_t bytes = min_t(loff_t, run->end - run->pos,
+			     NLINK_REFS_READ_NR * sizeof(run->d[0]));
+
+	run->nr		= bytes / sizeof(run->d[0]);
+	run->idx	= 0;
+
+	while (bytes) {
+		ssize_t ret = kernel_read(r->file, buf, bytes, &run->pos);
+
+		if (!ret)
+			ret = -BCH_ERR_fsck_nlink_refs_short_read;
+		if (ret < 0) {
+			bch_err(c, "fsck: error reading nlink refs: %s", bch2_err_str(ret));
+			return ret;
+		}
+
+		buf	+= ret;
+		bytes	-= ret;
+	}
+
+	return 0;
+}
+
+static int nlink_refs_merge_init(struct bch_fs *c, struct nlink_refs *r)
+{
+	int ret = 0;
+
+	if (!r->file) {
+		/* Everything fit in a single run, no need to go through the file: */
+		sort(r->d, r->nr, sizeof(r->d[0]), nlink_ref_cmp, NULL);
+
+		ret = darray_push(&r->runs, ((struct nlink_ref_run) {
+			.d	= r->d,
+			.nr	= r->nr,
+		}));
+		if (ret)
+			return ret;
+	} else {
+		ret = nlink_refs_flush(c, r);
+		if (ret)
+			return ret;
+
+		kvfree(r->d);
+		r->d = NULL;
+
+		darray_for_each(r->runs, run) {
+			run->d = kvmalloc_array(NLINK_REFS_READ_NR, sizeof(run->d[0]), GFP_KERNEL);
+			if (!run->d) {
+				bch_err(c, "fsck: error allocating memory for nlink refs");
+				return -BCH_ERR_ENOMEM_fsck_nlink_refs;
+			}
+
+			ret = nlink_ref_run_fill(c, r, run);
+			if (ret)
+				return ret;
+		}
+	}
+
+	struct nlink_ref_run **heap = kvmalloc_array(r->runs.nr, sizeof(heap[0]), GFP_KERNEL);
+	if (!heap) {
+		bch_err(c, "fsck: error allocating memory for nlink refs");
+		return -BCH_ERR_ENOMEM_fsck_nlink_refs;
+	}
+
+	min_heap_init(&r->heap, heap, r->runs.nr);
+
+	darray_for_each(r->runs, run)
+		if (run->nr)
+			r->heap.data[r->heap.nr++] = run;
+
+	min_heapify_all(&r->heap, &nlink_ref_heap_callbacks, NULL);
+	return 0;
+}
+
+static struct nlink_ref *nlink_refs_peek(struct nlink_refs *r)
+{
+	struct nlink_ref_run **run = min_heap_peek(&r->heap);
+
+	return run ? &(*run)->d[(*run)->idx] : NULL;
+}
+
+static int nlink_refs_advance(struct bch_fs *c, struct nlink_refs *r)
+{
+	struct nlink_ref_run *run = *min_heap_peek(&r->heap);
+
+	if (++run->idx == run->nr) {
+		if (run->pos == run->end) {
+			min_heap_pop(&r->heap, &nlink_ref_heap_callbacks, NULL);
+			return 0;
+		}
+
+		int ret = nlink_ref_run_fill(c, r, run);
+		if (ret)
+			return ret;
+	}
+
+	min_heap_sift_down(&r->heap, 0, &nlink_ref_heap_callbacks, NULL);
+	return 0;
+}
+
+/* ref_visible(), with the overwritten list standing in for snapshots_seen: */
+static bool nlink_ref_visible(struct bch_fs *c, u32 src,
+			      snapshot_id_list *overwritten, u32 dst)
+{
+	if (dst > src)
+		return bch2_snapshot_is_ancestor(c, src, dst);
+
+	if (dst == src)
+		return true;
+
+	if (!bch2_snapshot_is_ancestor(c, dst, src))
+		return false;
+
+	darray_for_each(*overwritten, i)
+		if (*i >= dst && bch2_snapshot_is_ancestor(c, dst, *i))
+			return false;
+
+	return true;
+}
+
+static int nlink_refs_count_refs(struct bch_fs *c, struct nlink_refs *r, u64 inum)
+{
+	struct nlink_ref *ref;
+	int ret = 0;
+
+	/* Refs to inodes that don't exist, or to directories: */
+	while ((ref = nlink_refs_peek(r)) && ref->inum < inum) {
+		ret = nlink_refs_advance(c, r);
+		if (ret)
+			return ret;
+	}
+
+	while ((ref = nlink_refs_peek(r)) && ref->inum == inum) {
+		u32 snapshot = ref->snapshot;
+		u64 seq = ref->seq;
+
+		r->overwritten.nr = 0;
+		ret = nlink_refs_advance(c, r);
+
+		while (!ret &&
+		       (ref = nlink_refs_peek(r)) &&
+		       ref->inum == inum &&
+		       ref->seq == seq)
+			ret =   darray_push(&r->overwritten, ref->overwritten) ?:
+				nlink_refs_advance(c, r);
+		if (ret)
+			return ret;
+
+		darray_for_each(r->inode, link)
+			if (nlink_ref_visible(c, snapshot, &r->overwritten, link->snapshot)) {
+				link->count++;
+				if (link->snapshot >= snapshot)
+					break;
+			}
+	}
+
+	r->inum = inum;
+	return 0;
+}
+
+/*
+ * Count the references to every version of @inum: all the refs for an inode
+ * are contiguous in the merged stream, and the stream only moves forward, so
+ * this has to be done for all versions at once, and once consumed we mustn't
+ * redo it after a transaction restart:
+ */
+static int nlink_refs_count_inode(struct btree_trans *trans, struct nlink_refs *r, u64 inum)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	int ret;
+
+	r->inode.nr = 0;
+
+	for_each_btree_key_upto_norestart(trans, iter, BTREE_ID_inodes,
+					  POS(0, inum), SPOS(0, inum, U32_MAX),
+					  BTREE_ITER_all_snapshots, k, ret) {
+		struct bch_inode_unpacked u;
+
+		if (!bkey_is_inode(k.k))
+			continue;
+
+		BUG_ON(bch2_inode_unpack(k, &u));
+
+		if (S_ISDIR(u.bi_mode) || !u.bi_nlink)
+			continue;
+
+		ret = darray_push(&r->inode, ((struct nlink) {
+			.inum		= inum,
+			.snapshot	= k.k->p.snapshot,
+		}));
+		if (ret)
+			break;
+	}
+	bch2_trans_iter_exit(trans, &iter);
+
+	/* Reading refs may block on IO: */
+	return ret ?: drop_locks_do(trans, nlink_refs_count_refs(trans->c, r, inum));
+}
+
 noinline_for_stack
 static int check_nlinks_walk_dirents(struct bch_fs *c, struct nlink_table *links,
+				     struct nlink_refs *refs,
 				     u64 range_start, u64 range_end)
 {
 	struct snapshots_seen s;
@@ -2671,10 +3294,19 @@ static int check_nlinks_walk_dirents(struct bch_fs *c, struct nlink_table *links
 			if (k.k->type == KEY_TYPE_dirent) {
 				struct bkey_s_c_dirent d = bkey_s_c_to_dirent(k);
 
-				if (d.v->d_type != DT_DIR &&
-				    d.v->d_type != DT_SUBVOL)
+				if (d.v->d_type == DT_DIR ||
+				    d.v->d_type == DT_SUBVOL)
+					continue;
+
+				if (refs) {
+					ret = nlink_refs_add(trans, refs, &s,
+							     le64_to_cpu(d.v->d_inum), d.k->p.snapshot);
+					if (ret)
+						break;
+				} else {
 					inc_link(c, &s, links, range_start, range_end,
 						 le64_to_cpu(d.v->d_inum), d.k->p.snapshot);
+				}
 			}
 			0;
 		})));
@@ -2747,6 +3379,72 @@ static int check_nlinks_update_hardlinks(struct bch_fs *c,
 	return 0;
 }
 
+static int check_nlinks_refs_update_inode(struct btree_trans *trans,
+					  struct btree_iter *iter,
+					  struct bkey_s_c k,
+					  struct nlink_refs *refs)
+{
+	struct bch_inode_unpacked u;
+	int ret = 0;
+
+	if (!bkey_is_inode(k.k))
+		return 0;
+
+	BUG_ON(bch2_inode_unpack(k, &u));
+
+	if (S_ISDIR(u.bi_mode))
+		return 0;
+
+	if (!u.bi_nlink)
+		return 0;
+
+	if (refs->inum != k.k->p.offset) {
+		ret = nlink_refs_count_inode(trans, refs, k.k->p.offset);
+		if (ret)
+			return ret;
+	}
+
+	struct nlink *link = NULL;
+	darray_for_each(refs->inode, i)
+		if (i->snapshot == k.k->p.snapshot) {
+			link = i;
+			break;
+		}
+	if (!link)
+		return 0;
+
+	if (fsck_err_on(bch2_inode_nlink_get(&u) != link->count,
+			trans, inode_wrong_nlink,
+			"inode %llu type %s has wrong i_nlink (%u, should be %u)",
+			u.bi_inum, bch2_d_types[mode_to_type(u.bi_mode)],
+			bch2_inode_nlink_get(&u), link->count)) {
+		bch2_inode_nlink_set(&u, link->count);
+		ret = __bch2_fsck_write_inode(trans, &u, k.k->p.snapshot);
+	}
+fsck_err:
+	return ret;
+}
+
+noinline_for_stack
+static int check_nlinks_sorted(struct bch_fs *c)
+{
+	struct nlink_refs refs;
+
+	bch_info(c, "hardlink table doesn't fit in memory, sorting dirent references externally");
+
+	int ret = nlink_refs_init(c, &refs) ?:
+		check_nlinks_walk_dirents(c, NULL, &refs, 0, U64_MAX) ?:
+		nlink_refs_merge_init(c, &refs) ?:
+		bch2_trans_run(c,
+			for_each_btree_key_commit(trans, iter, BTREE_ID_inodes, POS_MIN,
+					BTREE_ITER_intent|BTREE_ITER_prefetch|BTREE_ITER_all_snapshots, k,
+					NULL, NULL, BCH_TRANS_COMMIT_no_enospc,
+				check_nlinks_refs_update_inode(trans, &iter, k, &refs)));
+
+	nlink_refs_exit(&refs);
+	return ret;
+}
+
 int bch2_check_nlinks(struct bch_fs *c)
 {
 	struct nlink_table links = { 0 };
@@ -2761,7 +3459,16 @@ int bch2_check_nlinks(struct bch_fs *c)
 						  this_iter_range_start,
 						  &next_iter_range_start);
 
-		ret = check_nlinks_walk_dirents(c, &links,
+		if (!this_iter_range_start &&
+		    next_iter_range_start != U64_MAX) {
+			kvfree(links.d);
+			links = (struct nlink_table) { 0 };
+
+			ret = check_nlinks_sorted(c);
+			break;
+		}
+
+		ret = check_nlinks_walk_dirents(c, &links, NULL,
 					  this_iter_range_start,
 					  next_iter_range_start);
 		if (ret)
@@ -0,0 +1,326 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Background fsck: continuously re-check the filesystem while it's in use, one
+ * slice of the inode number space at a time.
+ *
+ * Each slice covers the next BG_FSCK_SLICE_INODES inode numbers after the
+ * cursor, and checks every key in the inodes, extents, dirents and xattrs
+ * btrees for those inodes: that the key is valid, that extents, dirents and
+ * xattrs belong to an inode that exists in their snapshot, and that dirents
+ * point to an inode that exists. The cursor is persisted in the logged ops
+ * btree, so coverage resumes where it left off after a remount.
+ *
+ * This only detects: the inode passes can't run online, so errors are
+ * reported and the corresponding fsck pass is marked required, to run on the
+ * next mount.
+ */
+
+#include "bcachefs.h"
+#include "bkey_methods.h"
+#include "btree_cache.h"
+#include "btree_iter.h"
+#include "btree_update.h"
+#include "dirent.h"
+#include "errcode.h"
+#include "fsck_background.h"
+#include "inode.h"
+#include "logged_ops_format.h"
+#include "recovery_passes.h"
+
+#include <linux/freezer.h>
+#include <linux/ioprio.h>
+#include <linux/kthread.h>
+#include <linux/sched/task.h>
+
+#define BG_FSCK_SLICE_INODES	1024
+
+/* How often the thread checks if background fsck has been enabled: */
+#define BG_FSCK_POLL_INTERVAL	(60 * HZ)
+
+struct bg_fsck_slice {
+	u64			start;
+	u64			end;
+	/* fsck passes that found errors here need to run: */
+	u64			passes;
+	u64			nr_errors;
+	bool			stopped;
+};
+
+static const struct {
+	enum btree_id		btree;
+	enum bch_recovery_pass	pass;
+} bg_fsck_btrees[] = {
+	{ BTREE_ID_inodes,	BCH_RECOVERY_PASS_check_inodes	},
+	{ BTREE_ID_extents,	BCH_RECOVERY_PASS_check_extents	},
+	{ BTREE_ID_dirents,	BCH_RECOVERY_PASS_check_dirents	},
+	{ BTREE_ID_xattrs,	BCH_RECOVERY_PASS_check_xattrs	},
+};
+
+static int bg_fsck_cursor_read(struct btree_trans *trans, u64 *cursor)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k = bch2_bkey_get_iter(trans, &iter, BTREE_ID_logged_ops,
+				POS(LOGGED_OPS_INUM_fsck_cursor, 0), 0);
+	int ret = bkey_err(k);
+	if (ret)
+		return ret;
+
+	*cursor = k.k->type == KEY_TYPE_cookie
+		? le64_to_cpu(bkey_s_c_to_cookie(k).v->cookie)
+		: 0;
+	bch2_trans_iter_exit(trans, &iter);
+	return 0;
+}
+
+static int bg_fsck_cursor_update(struct btree_trans *trans, u64 cursor)
+{
+	struct bkey_i_cookie *k = bch2_trans_kmalloc(trans, sizeof(*k));
+	int ret = PTR_ERR_OR_ZERO(k);
+	if (ret)
+		return ret;
+
+	bkey_cookie_init(&k->k_i);
+	k->k.p		= POS(LOGGED_OPS_INUM_fsck_cursor, 0);
+	k->v.cookie	= cpu_to_le64(cursor);
+
+	return bch2_btree_insert_trans(trans, BTREE_ID_logged_ops, &k->k_i, 0);
+}
+
+static int bg_fsck_count_inode(struct bg_fsck_slice *s, u64 inum, u64 *last, u64 *nr)
+{
+	if (inum == *last)
+		return 0;
+
+	if (++*nr > BG_FSCK_SLICE_INODES) {
+		s->end = inum;
+		return 1;
+	}
+
+	*last = inum;
+	return 0;
+}
+
+/* The slice ends after the next BG_FSCK_SLICE_INODES distinct inode numbers: */
+static int bg_fsck_slice_end(struct btree_trans *trans, struct bg_fsck_slice *s)
+{
+	u64 last = U64_MAX, nr = 0;
+
+	s->end = U64_MAX;
+
+	int ret = for_each_btree_key_upto(trans, iter, BTREE_ID_inodes,
+				POS(0, s->start), POS(0, U64_MAX),
+				BTREE_ITER_all_snapshots, k,
+		bg_fsck_count_inode(s, k.k->p.offset, &last, &nr));
+
+	return ret < 0 ? ret : 0;
+}
+
+__printf(4, 5)
+static void bg_fsck_err(struct bch_fs *c, struct bg_fsck_slice *s,
+			enum bch_recovery_pass pass, const char *fmt, ...)
+{
+	struct printbuf buf = PRINTBUF;
+	va_list args;
+
+	va_start(args, fmt);
+	prt_vprintf(&buf, fmt, args);
+	va_end(args);
+
+	bch_err_ratelimited(c, "background fsck: %s", buf.buf);
+	printbuf_exit(&buf);
+
+	s->passes |= BIT_ULL(pass);
+	s->nr_errors++;
+}
+
+static int bg_fsck_inode_exists(struct btree_trans *trans, u64 inum, u32 snapshot)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k = bch2_bkey_get_iter(trans, &iter, BTREE_ID_inodes,
+					       SPOS(0, inum, snapshot), 0);
+	int ret = bkey_err(k);
+	if (ret)
+		return ret;
+
+	ret = bkey_is_inode(k.k);
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+static int bg_fsck_key(struct btree_trans *trans, struct bg_fsck_slice *s,
+		       enum btree_id btree, enum bch_recovery_pass pass,
+		       struct bkey_s_c k)
+{
+	struct bch_fs *c = trans->c;
+	struct printbuf buf = PRINTBUF;
+	int ret = 0;
+
+	if (kthread_should_stop()) {
+		s->stopped = true;
+		return 1;
+	}
+
+	if (bkey_deleted(k.k) || k.k->type == KEY_TYPE_whiteout)
+		return 0;
+
+	if (bch2_bkey_invalid(c, k, __btree_node_type(0, btree), 0, &buf)) {
+		prt_str(&buf, "\n  ");
+		bch2_bkey_val_to_text(&buf, c, k);
+		bg_fsck_err(c, s, pass, "invalid key in %s: %s",
+			    bch2_btree_id_str(btree), buf.buf);
+		goto out;
+	}
+
+	if (btree == BTREE_ID_inodes)
+		goto out;
+
+	ret = bg_fsck_inode_exists(trans, k.k->p.inode, k.k->p.snapshot);
+	if (ret < 0)
+		goto out;
+	if (!ret) {
+		bch2_bkey_val_to_text(&buf, c, k);
+		bg_fsck_err(c, s, pass, "key in %s for missing inode:\n  %s",
+			    bch2_btree_id_str(btree), buf.buf);
+		ret = 0;
+		goto out;
+	}
+	ret = 0;
+
+	if (k.k->type == KEY_TYPE_dirent) {
+		struct bkey_s_c_dirent d = bkey_s_c_to_dirent(k);
+
+		if (d.v->d_type == DT_SUBVOL)
+			goto out;
+
+		ret = bg_fsck_inode_exists(trans, le64_to_cpu(d.v->d_inum), k.k->p.snapshot);
+		if (ret < 0)
+			goto out;
+		if (!ret) {
+			bch2_bkey_val_to_text(&buf, c, k);
+			bg_fsck_err(c, s, pass, "dirent to missing inode:\n  %s", buf.buf);
+		}
+		ret = 0;
+	}
+out:
+	printbuf_exit(&buf);
+	return ret;
+}
+
+static int bg_fsck_slice(struct btree_trans *trans, struct bg_fsck_slice *s)
+{
+	int ret = bg_fsck_slice_end(trans, s);
+	if (ret)
+		return ret;
+
+	u64 last = s->end - 1;
+
+	for (unsigned i = 0; i < ARRAY_SIZE(bg_fsck_btrees) && !s->stopped; i++) {
+		enum btree_id btree = bg_fsck_btrees[i].btree;
+		enum bch_recovery_pass pass = bg_fsck_btrees[i].pass;
+		struct bpos start = btree == BTREE_ID_inodes
+			? POS(0, s->start)
+			: POS(s->start, 0);
+		struct bpos end = btree == BTREE_ID_inodes
+			? SPOS(0, last, U32_MAX)
+			: SPOS(last, U64_MAX, U32_MAX);
+
+		ret = for_each_btree_key_upto(trans, iter, btree, start, end,
+				BTREE_ITER_all_snapshots|BTREE_ITER_prefetch, k,
+			bg_fsck_key(trans, s, btree, pass, k));
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int bch2_bg_fsck_thread(void *arg)
+{
+	struct bch_fs *c = arg;
+	u64 cursor = 0, nr_errors = 0;
+
+	set_freezable();
+	/* btree node reads are issued from this thread: */
+	set_task_ioprio(current, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
+
+	int ret = bch2_trans_run(c, bg_fsck_cursor_read(trans, &cursor));
+	bch_err_msg(c, ret, "reading background fsck cursor");
+
+	while (!kthread_should_stop()) {
+		u32 interval = READ_ONCE(c->opts.background_fsck_interval);
+
+		/* keys in deleted snapshots are expected until they're cleaned up: */
+		if (interval &&
+		    !test_bit(BCH_FS_need_delete_dead_snapshots, &c->flags)) {
+			struct bg_fsck_slice s = { .start = cursor };
+
+			ret = bch2_trans_run(c, bg_fsck_slice(trans, &s));
+			bch_err_msg(c, ret, "background fsck");
+
+			for (unsigned pass = 0; pass < BCH_RECOVERY_PASS_NR; pass++)
+				if (s.passes & BIT_ULL(pass))
+					bch2_recovery_pass_set_required(c, pass);
+
+			if (!ret && !s.stopped) {
+				nr_errors += s.nr_errors;
+				cursor = s.end == U64_MAX ? 0 : s.end;
+
+				if (!cursor) {
+					bch_info(c, "background fsck checked all inodes, %llu errors",
+						 nr_errors);
+					nr_errors = 0;
+				}
+
+				ret = bch2_trans_do(c, NULL, NULL, BCH_TRANS_COMMIT_no_enospc,
+						    bg_fsck_cursor_update(trans, cursor));
+				bch_err_msg(c, ret, "updating background fsck cursor");
+			}
+		}
+
+		try_to_freeze();
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop()) {
+			__set_current_state(TASK_RUNNING);
+			break;
+		}
+		schedule_timeout(interval ? (unsigned long) interval * HZ : BG_FSCK_POLL_INTERVAL);
+		__set_current_state(TASK_RUNNING);
+	}
+
+	return 0;
+}
+
+void bch2_bg_fsck_stop(struct bch_fs *c)
+{
+	if (c->bg_fsck_thread) {
+		kthread_stop(c->bg_fsck_thread);
+		put_task_struct(c->bg_fsck_thread);
+	}
+	c->bg_fsck_thread = NULL;
+}
+
+int bch2_bg_fsck_start(struct bch_fs *c)
+{
+	struct task_struct *t;
+	int ret;
+
+	if (c->bg_fsck_thread)
+		return 0;
+
+	if (c->opts.nochanges)
+		return 0;
+
+	t = kthread_create(bch2_bg_fsck_thread, c, "bch-fsck/%s", c->name);
+	ret = PTR_ERR_OR_ZERO(t);
+	bch_err_msg(c, ret, "creating background fsck thread");
+	if (ret)
+		return ret;
+
+	get_task_struct(t);
+
+	c->bg_fsck_thread = t;
+	wake_up_process(c->bg_fsck_thread);
+
+	return 0;
+}
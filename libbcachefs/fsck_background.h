@@ -0,0 +1,8 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_FSCK_BACKGROUND_H
+#define _BCACHEFS_FSCK_BACKGROUND_H
+
+void bch2_bg_fsck_stop(struct bch_fs *);
+int bch2_bg_fsck_start(struct bch_fs *);
+
+#endif /* _BCACHEFS_FSCK_BACKGROUND_H */
@@ -224,8 +224,73 @@ static int bch2_inode_unpack_v2(struct bch_inode_unpacked *unpacked,
 	return 0;
 }
 
+static inline void bch2_inode_unpack_v3_fixed(struct bkey_s_c_inode_v3 inode,
+					      struct bch_inode_unpacked *unpacked)
+{
+	unpacked->bi_inum	= inode.k->p.offset;
+	unpacked->bi_journal_seq= le64_to_cpu(inode.v->bi_journal_seq);
+	unpacked->bi_hash_seed	= inode.v->bi_hash_seed;
+	unpacked->bi_flags	= le64_to_cpu(inode.v->bi_flags);
+	unpacked->bi_sectors	= le64_to_cpu(inode.v->bi_sectors);
+	unpacked->bi_size	= le64_to_cpu(inode.v->bi_size);
+	unpacked->bi_version	= le64_to_cpu(inode.v->bi_version);
+	unpacked->bi_mode	= INODEv3_MODE(inode.v);
+}
+
+/* fields wider than 64 bits are stored as two varints: */
+#define INODE_V3_FIELD_VARINTS(_bits)	((_bits) > 64 ? 2 : 1)
+
+enum {
+	INODE_V3_VARINTS_MAX = 0
+#define x(_name, _bits)	+ INODE_V3_FIELD_VARINTS(_bits)
+	BCH_INODE_FIELDS_v3()
+#undef  x
+};
+
 static int bch2_inode_unpack_v3(struct bkey_s_c k,
 				struct bch_inode_unpacked *unpacked)
+{
+	struct bkey_s_c_inode_v3 inode = bkey_s_c_to_inode_v3(k);
+	unsigned nr_fields = INODEv3_NR_FIELDS(inode.v);
+	unsigned fieldnr = 0, nr_varints = 0, i = 0;
+	u64 v[INODE_V3_VARINTS_MAX] = {};
+	int ret;
+
+	bch2_inode_unpack_v3_fixed(inode, unpacked);
+
+#define x(_name, _bits)							\
+	if (fieldnr++ < nr_fields)					\
+		nr_varints += INODE_V3_FIELD_VARINTS(_bits);
+	BCH_INODE_FIELDS_v3()
+#undef  x
+
+	/* fields past the end of the key are zero: */
+	ret = bch2_varint_decode_fast_n(inode.v->fields, bkey_val_end(inode),
+					v, nr_varints);
+	if (ret < 0)
+		return ret;
+
+#define x(_name, _bits)							\
+	unpacked->_name = v[i];						\
+	if (v[i] != unpacked->_name ||					\
+	    (INODE_V3_FIELD_VARINTS(_bits) > 1 && v[i + 1]))		\
+		return -1;						\
+	i += INODE_V3_FIELD_VARINTS(_bits);
+
+	BCH_INODE_FIELDS_v3()
+#undef  x
+
+	/* XXX: signal if there were more fields than expected? */
+	return 0;
+}
+
+/*
+ * Only the varint fields in @fields are decoded (the rest are zeroed), and we
+ * stop after the last one wanted: for callers that don't need all of them.
+ */
+static int bch2_inode_unpack_v3_fields(struct bkey_s_c k,
+				       struct bch_inode_unpacked *unpacked,
+				       u64 fields)
 {
 	struct bkey_s_c_inode_v3 inode = bkey_s_c_to_inode_v3(k);
 	const u8 *in = inode.v->fields;
@@ -235,43 +300,37 @@ static int bch2_inode_unpack_v3(struct bkey_s_c k,
 	int ret;
 	u64 v[2];
 
-	unpacked->bi_inum	= inode.k->p.offset;
-	unpacked->bi_journal_seq= le64_to_cpu(inode.v->bi_journal_seq);
-	unpacked->bi_hash_seed	= inode.v->bi_hash_seed;
-	unpacked->bi_flags	= le64_to_cpu(inode.v->bi_flags);
-	unpacked->bi_sectors	= le64_to_cpu(inode.v->bi_sectors);
-	unpacked->bi_size	= le64_to_cpu(inode.v->bi_size);
-	unpacked->bi_version	= le64_to_cpu(inode.v->bi_version);
-	unpacked->bi_mode	= INODEv3_MODE(inode.v);
+	memset(unpacked, 0, sizeof(*unpacked));
+	bch2_inode_unpack_v3_fixed(inode, unpacked);
 
 #define x(_name, _bits)							\
-	if (fieldnr < nr_fields) {					\
-		ret = bch2_varint_decode_fast(in, end, &v[0]);		\
-		if (ret < 0)						\
-			return ret;					\
-		in += ret;						\
+	if (!(fields >> fieldnr) || fieldnr >= nr_fields)		\
+		return 0;						\
 									\
-		if (_bits > 64) {					\
-			ret = bch2_varint_decode_fast(in, end, &v[1]);	\
+	if (!(fields & BIT_ULL(fieldnr))) {				\
+		for (unsigned i = 0; i < INODE_V3_FIELD_VARINTS(_bits); i++) {\
+			ret = bch2_varint_skip_fast(in, end);		\
 			if (ret < 0)					\
 				return ret;				\
 			in += ret;					\
-		} else {						\
-			v[1] = 0;					\
 		}							\
 	} else {							\
-		v[0] = v[1] = 0;					\
-	}								\
+		ret = bch2_varint_decode_fast_n(in, end, v,		\
+					INODE_V3_FIELD_VARINTS(_bits));	\
+		if (ret < 0)						\
+			return ret;					\
+		in += ret;						\
 									\
-	unpacked->_name = v[0];						\
-	if (v[1] || v[0] != unpacked->_name)				\
-		return -1;						\
+		unpacked->_name = v[0];					\
+		if ((INODE_V3_FIELD_VARINTS(_bits) > 1 && v[1]) ||	\
+		    v[0] != unpacked->_name)				\
+			return -1;					\
+	}								\
 	fieldnr++;
 
 	BCH_INODE_FIELDS_v3()
 #undef  x
 
-	/* XXX: signal if there were more fields than expected? */
 	return 0;
 }
 
@@ -325,6 +384,20 @@ int bch2_inode_unpack(struct bkey_s_c k,
 	return bch2_inode_unpack_slowpath(k, unpacked);
 }
 
+/*
+ * Like bch2_inode_unpack(), but only the INODE_V3_FIELD()s in @fields are
+ * guaranteed to be unpacked - the fixed fields (mode, size, flags, etc.)
+ * always are:
+ */
+int bch2_inode_unpack_fields(struct bkey_s_c k,
+			     struct bch_inode_unpacked *unpacked,
+			     u64 fields)
+{
+	if (likely(k.k->type == KEY_TYPE_inode_v3))
+		return bch2_inode_unpack_v3_fields(k, unpacked, fields);
+	return bch2_inode_unpack_slowpath(k, unpacked);
+}
+
 int bch2_inode_peek_nowarn(struct btree_trans *trans,
 		    struct btree_iter *iter,
 		    struct bch_inode_unpacked *inode,
@@ -646,6 +719,14 @@ void bch2_inode_generation_to_text(struct printbuf *out, struct bch_fs *c,
 	prt_printf(out, "generation: %u", le32_to_cpu(gen.v->bi_generation));
 }
 
+void bch2_inode_alloc_cursor_to_text(struct printbuf *out, struct bch_fs *c,
+				     struct bkey_s_c k)
+{
+	struct bkey_s_c_inode_alloc_cursor i = bkey_s_c_to_inode_alloc_cursor(k);
+
+	prt_printf(out, "bits %u idx %llu", i.v->bits, le64_to_cpu(i.v->idx));
+}
+
 void bch2_inode_init_early(struct bch_fs *c,
 			   struct bch_inode_unpacked *inode_u)
 {
@@ -708,8 +789,75 @@ static inline u32 bkey_generation(struct bkey_s_c k)
 	}
 }
 
+/*
+ * Each shard's cursor is advanced INODE_ALLOC_CURSOR_RESERVE inode numbers at a
+ * time, so only one create in that many has to update it:
+ */
+#define INODE_ALLOC_CURSOR_RESERVE	1024
+
+static int inode_alloc_cursor_read(struct btree_trans *trans,
+				   struct inode_alloc_shard *s, u64 shard,
+				   unsigned bits, u64 min, u64 max)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k = bch2_bkey_get_iter(trans, &iter, BTREE_ID_logged_ops,
+				POS(LOGGED_OPS_INUM_inode_cursors, shard),
+				BTREE_ITER_cached);
+	int ret = bkey_err(k);
+	if (ret)
+		return ret;
+
+	u64 idx = min;
+	if (k.k->type == KEY_TYPE_inode_alloc_cursor) {
+		struct bkey_s_c_inode_alloc_cursor cursor = bkey_s_c_to_inode_alloc_cursor(k);
+
+		if (cursor.v->bits == bits)
+			idx = clamp(le64_to_cpu(cursor.v->idx), min, max);
+	}
+	bch2_trans_iter_exit(trans, &iter);
+
+	WRITE_ONCE(s->hint, idx);
+	WRITE_ONCE(s->reserved, idx);
+	return 0;
+}
+
+static int inode_alloc_cursor_update(struct btree_trans *trans,
+				     struct inode_alloc_shard *s, u64 shard,
+				     unsigned bits, u64 idx)
+{
+	struct bkey_i_inode_alloc_cursor *cursor =
+		bch2_trans_kmalloc(trans, sizeof(*cursor));
+	int ret = PTR_ERR_OR_ZERO(cursor);
+	if (ret)
+		return ret;
+
+	bkey_inode_alloc_cursor_init(&cursor->k_i);
+	cursor->k.p	= POS(LOGGED_OPS_INUM_inode_cursors, shard);
+	cursor->v.bits	= bits;
+	cursor->v.idx	= cpu_to_le64(idx);
+
+	ret = bch2_btree_insert_trans(trans, BTREE_ID_logged_ops, &cursor->k_i,
+				      BTREE_ITER_cached);
+	if (ret)
+		return ret;
+
+	/*
+	 * If this transaction doesn't commit the cursor on disk lags behind
+	 * ours: that only costs a rescan after the next mount, as the cursor
+	 * is just a starting point for finding an empty slot.
+	 */
+	WRITE_ONCE(s->reserved, idx);
+	return 0;
+}
+
 /*
  * This just finds an empty slot:
+ *
+ * With shard_inode_numbers, each cpu allocates from its own range of the inode
+ * number space, so that parallel creates land in different btree nodes. Where
+ * each shard left off is persisted in the logged ops btree, reserved a batch at
+ * a time - so that after a remount we don't restart from the bottom of the
+ * range, and rescan (and fill holes among) every inode created so far.
  */
 int bch2_inode_create(struct btree_trans *trans,
 		      struct btree_iter *iter,
@@ -717,33 +865,43 @@ int bch2_inode_create(struct btree_trans *trans,
 		      u32 snapshot, u64 cpu)
 {
 	struct bch_fs *c = trans->c;
+	struct inode_alloc_shard *s;
 	struct bkey_s_c k;
-	u64 min, max, start, pos, *hint;
+	u64 min, max, start, pos, shard = 0;
 	int ret = 0;
 	unsigned bits = (c->opts.inodes_32bit ? 31 : 63);
 
 	if (c->opts.shard_inode_numbers) {
 		bits -= c->inode_shard_bits;
+		shard = cpu;
 
 		min = (cpu << bits);
 		max = (cpu << bits) | ~(ULLONG_MAX << bits);
 
 		min = max_t(u64, min, BLOCKDEV_INODE_MAX);
-		hint = c->unused_inode_hints + cpu;
 	} else {
 		min = BLOCKDEV_INODE_MAX;
 		max = ~(ULLONG_MAX << bits);
-		hint = c->unused_inode_hints;
 	}
 
-	start = READ_ONCE(*hint);
+	s = c->inode_alloc_shards + shard;
+
+	if (unlikely(!READ_ONCE(s->reserved))) {
+		ret = inode_alloc_cursor_read(trans, s, shard, bits, min, max);
+		if (ret)
+			return ret;
+	}
+
+	start = READ_ONCE(s->hint);
 
 	if (start >= max || start < min)
 		start = min;
 
 	pos = start;
+	/* with_updates: we may have already created inodes in this transaction */
 	bch2_trans_iter_init(trans, iter, BTREE_ID_inodes, POS(0, pos),
 			     BTREE_ITER_all_snapshots|
+			     BTREE_ITER_with_updates|
 			     BTREE_ITER_intent);
 again:
 	while ((k = bch2_btree_iter_peek(iter)).k &&
@@ -784,18 +942,30 @@ found_slot:
 		return ret;
 	}
 
-	*hint			= k.k->p.offset;
+	if (k.k->p.offset >= READ_ONCE(s->reserved)) {
+		ret = inode_alloc_cursor_update(trans, s, shard, bits,
+				min(max, k.k->p.offset + INODE_ALLOC_CURSOR_RESERVE));
+		if (ret) {
+			bch2_trans_iter_exit(trans, iter);
+			return ret;
+		}
+	}
+
+	s->hint			= k.k->p.offset;
 	inode_u->bi_inum	= k.k->p.offset;
 	inode_u->bi_generation	= bkey_generation(k);
 	return 0;
 }
 
+/* Keys deleted per transaction commit when deleting an inode's contents: */
+#define INODE_DELETE_KEYS_BATCH		32
+
 static int bch2_inode_delete_keys(struct btree_trans *trans,
 				  subvol_inum inum, enum btree_id id)
 {
 	struct btree_iter iter;
 	struct bkey_s_c k;
-	struct bkey_i delete;
+	struct bpos pos = POS(inum.inum, 0);
 	struct bpos end = POS(inum.inum, U64_MAX);
 	u32 snapshot;
 	int ret = 0;
@@ -804,37 +974,61 @@ static int bch2_inode_delete_keys(struct btree_trans *trans,
 	 * We're never going to be deleting partial extents, no need to use an
 	 * extent iterator:
 	 */
-	bch2_trans_iter_init(trans, &iter, id, POS(inum.inum, 0),
-			     BTREE_ITER_intent);
+	bch2_trans_iter_init(trans, &iter, id, pos, BTREE_ITER_intent);
 
 	while (1) {
+		unsigned nr = 0;
+
 		bch2_trans_begin(trans);
 
 		ret = bch2_subvolume_get_snapshot(trans, inum.subvol, &snapshot);
 		if (ret)
 			goto err;
 
+		/* restart from the start of the batch if we didn't commit: */
 		bch2_btree_iter_set_snapshot(&iter, snapshot);
+		bch2_btree_iter_set_pos(&iter, SPOS(pos.inode, pos.offset, snapshot));
+
+		while (nr < INODE_DELETE_KEYS_BATCH) {
+			k = bch2_btree_iter_peek_upto(&iter, end);
+			ret = bkey_err(k);
+			if (ret)
+				goto err;
+
+			if (!k.k)
+				break;
+
+			struct bkey_i *delete = bch2_trans_kmalloc(trans, sizeof(*delete));
+			ret = PTR_ERR_OR_ZERO(delete);
+			if (ret)
+				goto err;
+
+			bkey_init(&delete->k);
+			delete->k.p = iter.pos;
+
+			if (iter.flags & BTREE_ITER_is_extents)
+				bch2_key_resize(&delete->k,
+						bpos_min(end, k.k->p).offset -
+						iter.pos.offset);
+
+			ret = bch2_trans_update(trans, &iter, delete, 0);
+			if (ret)
+				goto err;
+			nr++;
+
+			if (iter.flags & BTREE_ITER_is_extents)
+				bch2_btree_iter_set_pos(&iter, delete->k.p);
+			else
+				bch2_btree_iter_advance(&iter);
+		}
 
-		k = bch2_btree_iter_peek_upto(&iter, end);
-		ret = bkey_err(k);
-		if (ret)
-			goto err;
-
-		if (!k.k)
+		if (!nr)
 			break;
 
-		bkey_init(&delete.k);
-		delete.k.p = iter.pos;
-
-		if (iter.flags & BTREE_ITER_is_extents)
-			bch2_key_resize(&delete.k,
-					bpos_min(end, k.k->p).offset -
-					iter.pos.offset);
-
-		ret = bch2_trans_update(trans, &iter, &delete, 0) ?:
-		      bch2_trans_commit(trans, NULL, NULL,
+		ret = bch2_trans_commit(trans, NULL, NULL,
 					BCH_TRANS_COMMIT_no_enospc);
+		if (!ret)
+			pos = iter.pos;
 err:
 		if (ret && !bch2_err_matches(ret, BCH_ERR_transaction_restart))
 			break;
@@ -889,7 +1083,7 @@ retry:
 		goto err;
 	}
 
-	bch2_inode_unpack(k, &inode_u);
+	bch2_inode_unpack_fields(k, &inode_u, INODE_V3_FIELD(bi_generation));
 
 	bkey_inode_generation_init(&delete.k_i);
 	delete.k.p = iter.pos;
@@ -907,6 +1101,81 @@ err:
 	return ret;
 }
 
+/*
+ * Deleting an unlinked inode's contents can take a long time for large files,
+ * so on eviction it's done here, in the background, instead of in the final
+ * iput(). If we crash or go read-only first, the inode is still in the
+ * deleted_inodes btree and bch2_delete_dead_inodes() finishes it at the next
+ * mount:
+ */
+static void bch2_inode_rm_work(struct work_struct *work)
+{
+	struct bch_fs *c = container_of(work, struct bch_fs, inode_rm_work);
+	subvol_inum_list inums;
+
+	while (1) {
+		mutex_lock(&c->inode_rm_lock);
+		inums = c->inode_rm_queue;
+		darray_init(&c->inode_rm_queue);
+		mutex_unlock(&c->inode_rm_lock);
+
+		if (!inums.nr)
+			break;
+
+		darray_for_each(inums, i) {
+			struct bch_inode_unpacked inode;
+			int ret = bch2_trans_run(c,
+				lockrestart_do(trans,
+					bch2_inode_find_by_inum_nowarn_trans(trans, *i, &inode)));
+
+			/* Already deleted, or relinked since it was queued? */
+			if (!ret && (inode.bi_flags & BCH_INODE_unlinked))
+				ret = bch2_inode_rm(c, *i);
+			if (bch2_err_matches(ret, ENOENT))
+				ret = 0;
+			bch_err_msg(c, ret, "deleting unlinked inode %u:%llu", i->subvol, i->inum);
+
+			cond_resched();
+		}
+
+		darray_exit(&inums);
+	}
+
+	bch2_write_ref_put(c, BCH_WRITE_REF_inode_rm);
+}
+
+void bch2_inode_rm_async(struct bch_fs *c, subvol_inum inum)
+{
+	if (!bch2_write_ref_tryget(c, BCH_WRITE_REF_inode_rm))
+		goto sync;
+
+	mutex_lock(&c->inode_rm_lock);
+	int ret = darray_push(&c->inode_rm_queue, inum);
+	mutex_unlock(&c->inode_rm_lock);
+
+	if (ret) {
+		bch2_write_ref_put(c, BCH_WRITE_REF_inode_rm);
+		goto sync;
+	}
+
+	if (!queue_work(c->write_ref_wq, &c->inode_rm_work))
+		bch2_write_ref_put(c, BCH_WRITE_REF_inode_rm);
+	return;
+sync:
+	bch2_inode_rm(c, inum);
+}
+
+void bch2_fs_inode_exit(struct bch_fs *c)
+{
+	darray_exit(&c->inode_rm_queue);
+}
+
+void bch2_fs_inode_init_early(struct bch_fs *c)
+{
+	INIT_WORK(&c->inode_rm_work, bch2_inode_rm_work);
+	mutex_init(&c->inode_rm_lock);
+}
+
 int bch2_inode_find_by_inum_nowarn_trans(struct btree_trans *trans,
 				  subvol_inum inum,
 				  struct bch_inode_unpacked *inode)
@@ -1049,7 +1318,9 @@ retry:
 		goto err;
 	}
 
-	bch2_inode_unpack(k, &inode_u);
+	bch2_inode_unpack_fields(k, &inode_u,
+				 INODE_V3_FIELD(bi_generation)|
+				 INODE_V3_FIELD(bi_subvol));
 
 	/* Subvolume root? */
 	if (inode_u.bi_subvol)
@@ -59,6 +59,13 @@ void bch2_inode_generation_to_text(struct printbuf *, struct bch_fs *, struct bk
 	.min_val_size	= 8,					\
 })
 
+void bch2_inode_alloc_cursor_to_text(struct printbuf *, struct bch_fs *, struct bkey_s_c);
+
+#define bch2_bkey_ops_inode_alloc_cursor ((struct bkey_ops) {	\
+	.val_to_text	= bch2_inode_alloc_cursor_to_text,	\
+	.min_val_size	= 16,					\
+})
+
 #if 0
 typedef struct {
 	u64			lo;
@@ -82,6 +89,23 @@ struct bch_inode_unpacked {
 #undef  x
 };
 
+enum inode_v3_field {
+#define x(_name, _bits)	Inode_v3_##_name,
+	BCH_INODE_FIELDS_v3()
+#undef  x
+	Inode_v3_nr,
+};
+
+#define INODE_V3_FIELD(_name)	BIT_ULL(Inode_v3_##_name)
+
+/* Fields needed by bch2_inode_opts_get(): */
+enum {
+	INODE_V3_OPT_FIELDS = 0
+#define x(_name, _bits)	| INODE_V3_FIELD(bi_##_name)
+	BCH_INODE_OPTS()
+#undef  x
+};
+
 struct bkey_inode_buf {
 	struct bkey_i_inode_v3	inode;
 
@@ -92,6 +116,7 @@ struct bkey_inode_buf {
 
 void bch2_inode_pack(struct bkey_inode_buf *, const struct bch_inode_unpacked *);
 int bch2_inode_unpack(struct bkey_s_c, struct bch_inode_unpacked *);
+int bch2_inode_unpack_fields(struct bkey_s_c, struct bch_inode_unpacked *, u64);
 struct bkey_i *bch2_inode_to_v3(struct btree_trans *, struct bkey_i *);
 
 void bch2_inode_unpacked_to_text(struct printbuf *, struct bch_inode_unpacked *);
@@ -237,4 +262,8 @@ int bch2_inum_opts_get(struct btree_trans*, subvol_inum, struct bch_io_opts *);
 int bch2_inode_rm_snapshot(struct btree_trans *, u64, u32);
 int bch2_delete_dead_inodes(struct bch_fs *);
 
+void bch2_inode_rm_async(struct bch_fs *, subvol_inum);
+void bch2_fs_inode_exit(struct bch_fs *);
+void bch2_fs_inode_init_early(struct bch_fs *);
+
 #endif /* _BCACHEFS_INODE_H */
@@ -46,6 +46,20 @@ struct bch_inode_generation {
 	__le32			pad;
 } __packed __aligned(8);
 
+/*
+ * Per shard inode number allocation cursor, in the logged ops btree at
+ * POS(LOGGED_OPS_INUM_inode_cursors, shard): inode numbers below @idx in the
+ * shard have been handed out, so allocation resumes there after a remount.
+ * @bits is the width of the shard's range when the cursor was written;
+ * changing inodes_32bit or shard_inode_numbers invalidates the cursor.
+ */
+struct bch_inode_alloc_cursor {
+	struct bch_val		v;
+	__u8			bits;
+	__u8			pad[7];
+	__le64			idx;
+} __packed __aligned(8);
+
 /*
  * bi_subvol and bi_parent_subvol are only set for subvolume roots:
  */
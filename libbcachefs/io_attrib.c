@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "bcachefs.h"
+#include "io_attrib.h"
+
+#include <linux/cgroup.h>
+#include <linux/hash.h>
+
+static const char * const bch2_io_attrib_counters[] = {
+#define x(n)	#n,
+	BCH_IO_ATTRIB_COUNTERS()
+#undef x
+	NULL
+};
+
+static u64 bch2_io_attrib_id(void)
+{
+#ifdef CONFIG_CGROUPS
+	u64 id;
+
+	rcu_read_lock();
+	id = cgroup_id(task_dfl_cgroup(current));
+	rcu_read_unlock();
+	return id;
+#else
+	return current->pid;
+#endif
+}
+
+unsigned bch2_io_attrib_slot(struct bch_fs *c)
+{
+	u64 *ids = c->io_attrib.ids;
+	/* ids are never 0, so that 0 can mean a free slot: */
+	u64 id = bch2_io_attrib_id() + 1;
+	unsigned slot = hash_64(id, BCH_IO_ATTRIB_SLOTS_BITS);
+
+	for (unsigned i = 0; i < BCH_IO_ATTRIB_PROBE; i++) {
+		slot = (slot + i) & (BCH_IO_ATTRIB_SLOTS - 1);
+		if (!slot)
+			continue;
+
+		u64 v = READ_ONCE(ids[slot]);
+		if (v == id)
+			return slot;
+		if (!v) {
+			v = cmpxchg(&ids[slot], 0, id);
+			if (!v || v == id)
+				return slot;
+		}
+	}
+
+	return 0;
+}
+
+void bch2_io_attrib_reset(struct bch_fs *c)
+{
+	int cpu;
+
+	if (!c->io_attrib.pcpu)
+		return;
+
+	for (unsigned i = 0; i < BCH_IO_ATTRIB_SLOTS; i++)
+		WRITE_ONCE(c->io_attrib.ids[i], 0);
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(c->io_attrib.pcpu, cpu), 0,
+		       sizeof(struct bch_io_attrib_pcpu));
+}
+
+void bch2_io_attrib_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	int cpu;
+
+	if (!c->io_attrib.pcpu)
+		return;
+
+	if (!c->opts.io_attrib)
+		prt_str(out, "(io_attrib option not enabled)\n");
+
+	printbuf_tabstops_reset(out);
+	printbuf_tabstop_push(out, 24);
+	for (unsigned i = 0; i < BCH_IO_ATTRIB_NR; i++)
+		printbuf_tabstop_push(out, 12);
+
+	prt_str(out, IS_ENABLED(CONFIG_CGROUPS) ? "cgroup" : "pid");
+	for (unsigned i = 0; i < BCH_IO_ATTRIB_NR; i++)
+		prt_printf(out, "\r%s", bch2_io_attrib_counters[i]);
+	prt_printf(out, "\r\n");
+
+	for (unsigned slot = 0; slot < BCH_IO_ATTRIB_SLOTS; slot++) {
+		u64 id = READ_ONCE(c->io_attrib.ids[slot]);
+		u64 v[BCH_IO_ATTRIB_NR] = {};
+		bool nonzero = false;
+
+		for_each_possible_cpu(cpu)
+			for (unsigned i = 0; i < BCH_IO_ATTRIB_NR; i++)
+				v[i] += per_cpu_ptr(c->io_attrib.pcpu, cpu)->v[slot][i];
+
+		for (unsigned i = 0; i < BCH_IO_ATTRIB_NR; i++)
+			nonzero |= v[i] != 0;
+
+		if (!nonzero || (slot && !id))
+			continue;
+
+		if (slot)
+			prt_u64(out, id - 1);
+		else
+			prt_str(out, "other");
+
+		for (unsigned i = 0; i < BCH_IO_ATTRIB_NR; i++) {
+			prt_tab(out);
+			prt_human_readable_u64(out, v[i]);
+			prt_tab_rjust(out);
+		}
+		prt_newline(out);
+	}
+}
+
+void bch2_fs_io_attrib_exit(struct bch_fs *c)
+{
+	free_percpu(c->io_attrib.pcpu);
+}
+
+int bch2_fs_io_attrib_init(struct bch_fs *c)
+{
+	c->io_attrib.pcpu = alloc_percpu(struct bch_io_attrib_pcpu);
+	if (!c->io_attrib.pcpu)
+		return -BCH_ERR_ENOMEM_fs_other_alloc;
+	return 0;
+}
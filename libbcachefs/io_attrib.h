@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_IO_ATTRIB_H
+#define _BCACHEFS_IO_ATTRIB_H
+
+#include "io_attrib_types.h"
+
+unsigned bch2_io_attrib_slot(struct bch_fs *);
+
+/*
+ * Account @bytes of IO of type @type to the current task's cgroup; called from
+ * the submission path, so that the caller is the one doing the IO:
+ */
+static inline void bch2_io_attrib_add(struct bch_fs *c,
+				      enum bch_io_attrib_counter type,
+				      u64 bytes)
+{
+	if (likely(!c->opts.io_attrib) || !c->io_attrib.pcpu)
+		return;
+
+	this_cpu_add(c->io_attrib.pcpu->v[bch2_io_attrib_slot(c)][type], bytes);
+}
+
+void bch2_io_attrib_reset(struct bch_fs *);
+void bch2_io_attrib_to_text(struct printbuf *, struct bch_fs *);
+
+void bch2_fs_io_attrib_exit(struct bch_fs *);
+int bch2_fs_io_attrib_init(struct bch_fs *);
+
+#endif /* _BCACHEFS_IO_ATTRIB_H */
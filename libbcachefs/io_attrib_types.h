@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_IO_ATTRIB_TYPES_H
+#define _BCACHEFS_IO_ATTRIB_TYPES_H
+
+#include <linux/types.h>
+
+/*
+ * IO attribution: bytes of foreground IO, promotes and journal writes, broken
+ * out by the cgroup (or process, without cgroups) that caused them:
+ */
+#define BCH_IO_ATTRIB_COUNTERS()	\
+	x(read)				\
+	x(write)			\
+	x(promote)			\
+	x(journal)
+
+enum bch_io_attrib_counter {
+#define x(n)	BCH_IO_ATTRIB_##n,
+	BCH_IO_ATTRIB_COUNTERS()
+#undef x
+	BCH_IO_ATTRIB_NR,
+};
+
+/*
+ * Slot 0 is for IO we couldn't find a free slot for; slots are claimed on first
+ * use and only freed by writing to io_attrib_reset in sysfs:
+ */
+#define BCH_IO_ATTRIB_SLOTS_BITS	6
+#define BCH_IO_ATTRIB_SLOTS		(1U << BCH_IO_ATTRIB_SLOTS_BITS)
+#define BCH_IO_ATTRIB_PROBE		8
+
+struct bch_io_attrib_pcpu {
+	u64			v[BCH_IO_ATTRIB_SLOTS][BCH_IO_ATTRIB_NR];
+};
+
+struct bch_io_attrib {
+	u64			ids[BCH_IO_ATTRIB_SLOTS];
+	struct bch_io_attrib_pcpu __percpu *pcpu;
+};
+
+#endif /* _BCACHEFS_IO_ATTRIB_TYPES_H */
@@ -18,9 +18,13 @@
 #include "disk_groups.h"
 #include "ec.h"
 #include "error.h"
+#include "extent_cache.h"
+#include "io_attrib.h"
 #include "io_read.h"
+#include "io_sched.h"
 #include "io_misc.h"
 #include "io_write.h"
+#include "slow_ops.h"
 #include "subvolume.h"
 #include "trace.h"
 
@@ -32,8 +36,6 @@ static bool bch2_target_congested(struct bch_fs *c, u16 target)
 {
 	const struct bch_devs_mask *devs;
 	unsigned d, nr = 0, total = 0;
-	u64 now = local_clock(), last;
-	s64 congested;
 	struct bch_dev *ca;
 
 	if (!target)
@@ -48,12 +50,7 @@ static bool bch2_target_congested(struct bch_fs *c, u16 target)
 		if (!ca)
 			continue;
 
-		congested = atomic_read(&ca->congested);
-		last = READ_ONCE(ca->congested_last);
-		if (time_after64(now, last))
-			congested -= (now - last) >> 12;
-
-		total += max(congested, 0LL);
+		total += bch2_dev_congested(ca);
 		nr++;
 	}
 	rcu_read_unlock();
@@ -90,6 +87,47 @@ static const struct rhashtable_params bch_promote_params = {
 	.automatic_shrinking	= true,
 };
 
+/*
+ * Promote admission: recent reads of each extent are counted in a count-min
+ * sketch, and we only promote extents that have been read at least
+ * promote_min_reads times - so that a single pass over cold data (a backup, or
+ * rsync --checksum) doesn't flush the working set out of the cache.
+ *
+ * Counters are halved every PROMOTE_SKETCH_AGE reads, so old reads age out;
+ * updates are racy, which is fine for an estimate:
+ */
+#define PROMOTE_SKETCH_ROWS	4
+#define PROMOTE_SKETCH_BITS	12
+#define PROMOTE_SKETCH_WIDTH	(1U << PROMOTE_SKETCH_BITS)
+#define PROMOTE_SKETCH_AGE	(PROMOTE_SKETCH_WIDTH * 4)
+
+static unsigned promote_sketch_read(struct bch_fs *c, struct bkey_s_c k)
+{
+	struct bpos pos = bkey_start_pos(k.k);
+	u64 h = (pos.inode ^ rol64(pos.offset, 29) ^ k.k->type) * GOLDEN_RATIO_64;
+	unsigned i, est = U8_MAX;
+
+	for (i = 0; i < PROMOTE_SKETCH_ROWS; i++) {
+		u8 *ctr = c->promote_sketch + i * PROMOTE_SKETCH_WIDTH +
+			(h >> (64 - PROMOTE_SKETCH_BITS * (i + 1)) & (PROMOTE_SKETCH_WIDTH - 1));
+		u8 v = READ_ONCE(*ctr);
+
+		if (v < U8_MAX)
+			WRITE_ONCE(*ctr, ++v);
+		est = min_t(unsigned, est, v);
+	}
+
+	if (atomic_inc_return(&c->promote_sketch_reads) >= PROMOTE_SKETCH_AGE) {
+		atomic_set(&c->promote_sketch_reads, 0);
+
+		for (i = 0; i < PROMOTE_SKETCH_ROWS * PROMOTE_SKETCH_WIDTH; i++)
+			WRITE_ONCE(c->promote_sketch[i],
+				   READ_ONCE(c->promote_sketch[i]) >> 1);
+	}
+
+	return est;
+}
+
 static inline int should_promote(struct bch_fs *c, struct bkey_s_c k,
 				  struct bpos pos,
 				  struct bch_io_opts opts,
@@ -102,12 +140,31 @@ static inline int should_promote(struct bch_fs *c, struct bkey_s_c k,
 		if (!(flags & BCH_READ_MAY_PROMOTE))
 			return -BCH_ERR_nopromote_may_not;
 
-		if (bch2_bkey_has_target(c, k, opts.promote_target))
+		if (bch2_bkey_has_target(c, k, opts.promote_target)) {
+			this_cpu_inc(c->counters[BCH_COUNTER_io_read_promote_hit]);
 			return -BCH_ERR_nopromote_already_promoted;
+		}
+
+		this_cpu_inc(c->counters[BCH_COUNTER_io_read_promote_miss]);
 
 		if (bkey_extent_is_unwritten(k))
 			return -BCH_ERR_nopromote_unwritten;
 
+		/*
+		 * Large sequential scans (backups, etc.) are unlikely to be
+		 * reread; don't let them count towards admission either:
+		 */
+		if (flags & BCH_READ_SEQUENTIAL) {
+			this_cpu_inc(c->counters[BCH_COUNTER_io_read_promote_sequential]);
+			return -BCH_ERR_nopromote_sequential;
+		}
+
+		if (READ_ONCE(c->opts.promote_min_reads) > 1 &&
+		    promote_sketch_read(c, k) < READ_ONCE(c->opts.promote_min_reads)) {
+			this_cpu_inc(c->counters[BCH_COUNTER_io_read_promote_rejected]);
+			return -BCH_ERR_nopromote_cold;
+		}
+
 		if (bch2_target_congested(c, opts.promote_target))
 			return -BCH_ERR_nopromote_congested;
 	}
@@ -310,6 +367,10 @@ static struct promote_op *promote_alloc(struct btree_trans *trans,
 	if (ret)
 		goto nopromote;
 
+	/* charged to whoever's read caused the promote: */
+	if (!failed)
+		bch2_io_attrib_add(c, BCH_IO_ATTRIB_promote, (u64) sectors << 9);
+
 	*bounce		= true;
 	*read_full	= promote_full;
 	return promote;
@@ -350,10 +411,41 @@ static void bch2_rbio_punt(struct bch_read_bio *rbio, work_func_t fn,
 	}
 }
 
+/*
+ * Hedged reads:
+ *
+ * If a read from a replicated extent hasn't completed within
+ * opts.read_hedge_percentile of the device's observed read latency, we also
+ * issue the read to another replica, and take whichever completes first.
+ *
+ * Both reads are bounced, and the second read is fully set up when the first
+ * one is submitted, so that it can be submitted from the delayed work without
+ * touching the btree or the parent bio. The loser is discarded when it
+ * completes - the block layer gives us no way of cancelling a bio in flight.
+ */
+struct bch_read_hedge {
+	struct delayed_work	work;
+	struct bch_read_bio	*secondary;
+	/* refs: primary, secondary, work */
+	atomic_t		ref;
+	atomic_t		inflight;
+	atomic_t		done;
+};
+
+static void bch2_read_hedge_put(struct bch_read_hedge *h)
+{
+	if (atomic_dec_and_test(&h->ref))
+		kfree(h);
+}
+
 static inline struct bch_read_bio *bch2_rbio_free(struct bch_read_bio *rbio)
 {
 	BUG_ON(rbio->bounce && !rbio->split);
 
+	if (rbio->hedge)
+		bch2_read_hedge_put(rbio->hedge);
+	rbio->hedge = NULL;
+
 	if (rbio->promote)
 		promote_free(rbio->c, rbio->promote);
 	rbio->promote = NULL;
@@ -379,11 +471,44 @@ static inline struct bch_read_bio *bch2_rbio_free(struct bch_read_bio *rbio)
  * Only called on a top level bch_read_bio to complete an entire read request,
  * not a split:
  */
+static noinline void bch2_rbio_slow_check(struct bch_read_bio *rbio)
+{
+	struct bch_fs *c = rbio->c;
+	u64 now = local_clock();
+
+	if (!time_after64(now, rbio->start_time) ||
+	    !bch2_slow_op_is_slow(c, now - rbio->start_time))
+		return;
+
+	struct bch_slow_op s = {
+		.type		= BCH_SLOW_OP_read,
+		.duration	= now - rbio->start_time,
+		.inum		= rbio->read_pos.inode,
+		.offset		= rbio->read_pos.offset,
+		.sectors	= bio_sectors(&rbio->bio),
+	};
+
+	/*
+	 * Phases are only known if the read wasn't split: then submit_time and
+	 * endio_time are for the one IO we did:
+	 */
+	if (rbio->submit_time && rbio->endio_time) {
+		s.phase_ns[BCH_READ_PHASE_lookup] = rbio->submit_time - rbio->start_time;
+		s.phase_ns[BCH_READ_PHASE_io]	  = rbio->endio_time - rbio->submit_time;
+		s.phase_ns[BCH_READ_PHASE_endio]  = now - rbio->endio_time;
+	}
+
+	bch2_slow_op_record(c, &s);
+}
+
 static void bch2_rbio_done(struct bch_read_bio *rbio)
 {
-	if (rbio->start_time)
+	if (rbio->start_time) {
 		bch2_time_stats_update(&rbio->c->times[BCH_TIME_data_read],
 				       rbio->start_time);
+		if (bch2_slow_op_tracking(rbio->c))
+			bch2_rbio_slow_check(rbio);
+	}
 	bio_endio(&rbio->bio);
 }
 
@@ -498,6 +623,197 @@ static void bch2_rbio_error(struct bch_read_bio *rbio, int retry,
 	}
 }
 
+/* z scores (* 100) for selected percentiles of a normal distribution: */
+static const struct {
+	u8	percentile;
+	u16	z;
+} read_hedge_z[] = {
+	{ 50,	0 },
+	{ 75,	67 },
+	{ 90,	128 },
+	{ 95,	164 },
+	{ 99,	233 },
+};
+
+/*
+ * We don't keep latency histograms for devices (time_stats quantiles are
+ * deprecated) - estimate the percentile from the weighted mean and stddev:
+ */
+static u64 read_hedge_delay(struct bch_dev *ca, unsigned percentile)
+{
+	struct mean_and_variance_weighted s =
+		ca->io_latency[READ].stats.duration_stats_weighted;
+	s64 mean = mean_and_variance_weighted_get_mean(s, TIME_STATS_MV_WEIGHT);
+	u64 stddev = mean_and_variance_weighted_get_stddev(s, TIME_STATS_MV_WEIGHT);
+	unsigned i, z = read_hedge_z[0].z;
+
+	if (mean <= 0)
+		return 0;
+
+	for (i = 1; i < ARRAY_SIZE(read_hedge_z); i++) {
+		unsigned p0 = read_hedge_z[i - 1].percentile;
+		unsigned p1 = read_hedge_z[i].percentile;
+		unsigned z0 = read_hedge_z[i - 1].z;
+		unsigned z1 = read_hedge_z[i].z;
+
+		if (percentile <= p1) {
+			z = z0 + (z1 - z0) * (max(percentile, p0) - p0) / (p1 - p0);
+			break;
+		}
+		z = z1;
+	}
+
+	return mean + div_u64((u64) stddev * z, 100);
+}
+
+static void bch2_read_hedge_secondary_free(struct bch_fs *c, struct bch_read_hedge *h)
+{
+	struct bch_read_bio *s = h->secondary;
+
+	percpu_ref_put(&bch2_dev_have_ref(c, s->pick.ptr.dev)->io_ref);
+	bch2_rbio_free(s);
+}
+
+static void bch2_read_hedge_work(struct work_struct *work)
+{
+	struct bch_read_hedge *h = container_of(to_delayed_work(work),
+						struct bch_read_hedge, work);
+	struct bch_read_bio *s = h->secondary;
+	struct bch_fs *c = s->c;
+
+	atomic_inc(&h->inflight);
+
+	if (atomic_read(&h->done)) {
+		atomic_dec(&h->inflight);
+		bch2_read_hedge_secondary_free(c, h);
+	} else {
+		struct bch_dev *ca = bch2_dev_have_ref(c, s->pick.ptr.dev);
+
+		this_cpu_inc(c->counters[BCH_COUNTER_io_read_hedge]);
+		this_cpu_add(ca->io_done->sectors[READ][BCH_DATA_user],
+			     bio_sectors(&s->bio));
+
+		s->submit_time = local_clock();
+		submit_bio(&s->bio);
+	}
+
+	bch2_read_hedge_put(h);
+}
+
+/*
+ * Called on read completion: returns true if this read should complete the
+ * request - the first read to succeed, or the last to fail:
+ */
+static bool bch2_read_hedge_won(struct bch_read_bio *rbio, blk_status_t status)
+{
+	struct bch_read_hedge *h = rbio->hedge;
+	bool last = !atomic_dec_return(&h->inflight);
+	bool won = (!status || last) && !atomic_xchg(&h->done, 1);
+
+	if (won && cancel_delayed_work(&h->work)) {
+		bch2_read_hedge_secondary_free(rbio->c, h);
+		bch2_read_hedge_put(h);
+	}
+
+	if (won && rbio == h->secondary)
+		this_cpu_inc(rbio->c->counters[BCH_COUNTER_io_read_hedge_won]);
+
+	return won;
+}
+
+/*
+ * Pick a second replica to hedge a read to, if hedging is enabled and the read
+ * is eligible; takes an io ref on the second device:
+ */
+static struct bch_read_hedge *
+bch2_read_hedge_alloc(struct bch_fs *c, struct bkey_s_c k,
+		      struct bch_io_failures *failed,
+		      struct extent_ptr_decoded *pick,
+		      struct extent_ptr_decoded *hedge_pick,
+		      struct bch_dev *ca, unsigned flags)
+{
+	struct bch_io_failures hedge_failed = failed ? *failed : (struct bch_io_failures) { .nr = 0 };
+	struct bch_read_hedge *h;
+	struct bch_dev *ca2;
+
+	if (!c->opts.read_hedge_percentile ||
+	    c->opts.no_data_io ||
+	    !ca ||
+	    pick->idx ||
+	    (flags & (BCH_READ_NODECODE|BCH_READ_IN_RETRY)) ||
+	    bch2_bkey_nr_ptrs(k) < 2)
+		return NULL;
+
+	bch2_mark_io_failure(&hedge_failed, pick);
+
+	if (bch2_bkey_pick_read_device(c, k, &hedge_failed, hedge_pick) <= 0 ||
+	    hedge_pick->idx ||
+	    hedge_pick->ptr.dev == pick->ptr.dev ||
+	    hedge_pick->ptr.unwritten)
+		return NULL;
+
+	ca2 = bch2_dev_get_ioref(c, hedge_pick->ptr.dev, READ);
+	if (!ca2)
+		return NULL;
+
+	if (dev_ptr_stale(ca2, &hedge_pick->ptr) ||
+	    !read_hedge_delay(ca, c->opts.read_hedge_percentile))
+		goto err;
+
+	h = kzalloc(sizeof(*h), GFP_NOFS);
+	if (!h)
+		goto err;
+
+	INIT_DELAYED_WORK(&h->work, bch2_read_hedge_work);
+	atomic_set(&h->ref, 3);
+	atomic_set(&h->inflight, 1);
+	return h;
+err:
+	percpu_ref_put(&ca2->io_ref);
+	return NULL;
+}
+
+static void bch2_read_endio(struct bio *);
+
+/*
+ * Set up the second read as a copy of the primary, with its own bounce buffer,
+ * and arm the timer:
+ */
+static void bch2_read_hedge_arm(struct bch_fs *c, struct bch_read_bio *rbio,
+				struct bch_read_hedge *h,
+				struct extent_ptr_decoded *hedge_pick)
+{
+	struct bch_dev *ca = bch2_dev_have_ref(c, rbio->pick.ptr.dev);
+	struct bch_dev *ca2 = bch2_dev_have_ref(c, hedge_pick->ptr.dev);
+	unsigned sectors = hedge_pick->crc.compressed_size;
+	struct bch_read_bio *s =
+		to_rbio(bio_alloc_bioset(NULL,
+					 DIV_ROUND_UP(sectors, PAGE_SECTORS),
+					 0,
+					 GFP_NOFS,
+					 &c->bio_read_split));
+
+	memcpy(s, rbio, offsetof(struct bch_read_bio, bio));
+	bch2_bio_alloc_pages_pool(c, &s->bio, sectors << 9);
+
+	s->pick			= *hedge_pick;
+	s->have_ioref		= true;
+	s->hedge		= h;
+	INIT_WORK(&s->work, NULL);
+
+	s->bio.bi_opf		= rbio->bio.bi_opf;
+	s->bio.bi_iter.bi_sector = hedge_pick->ptr.offset;
+	s->bio.bi_end_io	= bch2_read_endio;
+	bio_set_dev(&s->bio, ca2->disk_sb.bdev);
+
+	h->secondary		= s;
+	rbio->hedge		= h;
+
+	queue_delayed_work(system_highpri_wq, &h->work,
+			   max(1UL, nsecs_to_jiffies(read_hedge_delay(ca,
+						c->opts.read_hedge_percentile))));
+}
+
 static int __bch2_rbio_narrow_crcs(struct btree_trans *trans,
 				   struct bch_read_bio *rbio)
 {
@@ -587,7 +903,27 @@ static void __bch2_read_endio(struct work_struct *work)
 		src->bi_iter			= rbio->bvec_iter;
 	}
 
-	csum = bch2_checksum_bio(c, crc.csum_type, nonce, src);
+	/*
+	 * If we'll be decrypting all of @src, do it in the same pass as
+	 * verifying the MAC - if the MAC is bad we retry the read, so it
+	 * doesn't matter that it's already been decrypted:
+	 */
+	bool decrypted = bch2_csum_type_is_encryption(crc.csum_type) &&
+		!rbio->narrow_crcs &&
+		!(rbio->flags & BCH_READ_NODECODE) &&
+		(crc_is_compressed(crc) ||
+		 (!crc.offset &&
+		  !rbio->offset_into_extent &&
+		  src->bi_iter.bi_size == dst_iter.bi_size));
+
+	if (decrypted) {
+		ret = bch2_checksum_decrypt_bio(c, crc.csum_type, nonce, src, &csum);
+		if (ret)
+			goto decrypt_err;
+	} else {
+		csum = bch2_checksum_bio(c, crc.csum_type, nonce, src);
+	}
+
 	if (bch2_crc_cmp(csum, rbio->pick.crc.csum) && !c->opts.no_data_io)
 		goto csum_err;
 
@@ -609,7 +945,7 @@ static void __bch2_read_endio(struct work_struct *work)
 	crc.live_size	= bvec_iter_sectors(rbio->bvec_iter);
 
 	if (crc_is_compressed(crc)) {
-		ret = bch2_encrypt_bio(c, crc.csum_type, nonce, src);
+		ret = !decrypted ? bch2_encrypt_bio(c, crc.csum_type, nonce, src) : 0;
 		if (ret)
 			goto decrypt_err;
 
@@ -624,7 +960,7 @@ static void __bch2_read_endio(struct work_struct *work)
 		BUG_ON(src->bi_iter.bi_size < dst_iter.bi_size);
 		src->bi_iter.bi_size = dst_iter.bi_size;
 
-		ret = bch2_encrypt_bio(c, crc.csum_type, nonce, src);
+		ret = !decrypted ? bch2_encrypt_bio(c, crc.csum_type, nonce, src) : 0;
 		if (ret)
 			goto decrypt_err;
 
@@ -708,11 +1044,21 @@ static void bch2_read_endio(struct bio *bio)
 
 	if (rbio->have_ioref) {
 		bch2_latency_acct(ca, rbio->submit_time, READ);
+		if (rbio->io_sched)
+			bch2_dev_io_done(ca, rbio->io_class);
 		percpu_ref_put(&ca->io_ref);
 	}
 
-	if (!rbio->split)
+	if (rbio->hedge && !bch2_read_hedge_won(rbio, bio->bi_status)) {
+		bch2_rbio_free(rbio);
+		return;
+	}
+
+	if (!rbio->split) {
 		rbio->bio.bi_end_io = rbio->end_io;
+		if (bch2_slow_op_tracking(c))
+			rbio->endio_time = local_clock();
+	}
 
 	if (bio->bi_status) {
 		if (ca) {
@@ -846,6 +1192,8 @@ int __bch2_read_extent(struct btree_trans *trans, struct bch_read_bio *orig,
 	struct extent_ptr_decoded pick;
 	struct bch_read_bio *rbio = NULL;
 	struct promote_op *promote = NULL;
+	struct bch_read_hedge *hedge = NULL;
+	struct extent_ptr_decoded hedge_pick;
 	bool bounce = false, read_full = false, narrow_crcs = false;
 	struct bpos data_pos = bkey_start_pos(k.k);
 	int pick_ret;
@@ -940,6 +1288,11 @@ retry_pick:
 		promote = promote_alloc(trans, iter, k, &pick, orig->opts, flags,
 					&rbio, &bounce, &read_full, failed);
 
+	/* Hedged reads must not read into the caller's buffer: */
+	if (!promote &&
+	    (hedge = bch2_read_hedge_alloc(c, k, failed, &pick, &hedge_pick, ca, flags)))
+		bounce = true;
+
 	if (!read_full) {
 		EBUG_ON(crc_is_compressed(pick.crc));
 		EBUG_ON(pick.crc.csum_type &&
@@ -948,6 +1301,15 @@ retry_pick:
 			 pick.crc.offset ||
 			 offset_into_extent));
 
+		if (hedge) {
+			hedge_pick.ptr.offset += hedge_pick.crc.offset +
+				offset_into_extent;
+			hedge_pick.crc.compressed_size	= bvec_iter_sectors(iter);
+			hedge_pick.crc.uncompressed_size = bvec_iter_sectors(iter);
+			hedge_pick.crc.offset		= 0;
+			hedge_pick.crc.live_size	= bvec_iter_sectors(iter);
+		}
+
 		data_pos.offset += offset_into_extent;
 		pick.ptr.offset += pick.crc.offset +
 			offset_into_extent;
@@ -1018,6 +1380,8 @@ get_bio:
 	rbio->hole		= 0;
 	rbio->retry		= 0;
 	rbio->context		= 0;
+	rbio->io_class		= orig->io_class;
+	rbio->io_sched		= 0;
 	/* XXX: only initialize this if needed */
 	rbio->devs_have		= bch2_bkey_devs(k);
 	rbio->pick		= pick;
@@ -1040,6 +1404,8 @@ get_bio:
 		trace_and_count(c, read_bounce, &rbio->bio);
 
 	this_cpu_add(c->counters[BCH_COUNTER_io_read], bio_sectors(&rbio->bio));
+	if (!(flags & BCH_READ_NODECODE))
+		bch2_io_attrib_add(c, BCH_IO_ATTRIB_read, rbio->bio.bi_iter.bi_size);
 	bch2_increment_clock(c, bio_sectors(&rbio->bio), READ);
 
 	/*
@@ -1073,10 +1439,15 @@ get_bio:
 			if (likely(!(flags & BCH_READ_IN_RETRY)))
 				bio_endio(&rbio->bio);
 		} else {
-			if (likely(!(flags & BCH_READ_IN_RETRY)))
-				submit_bio(&rbio->bio);
-			else
+			if (hedge)
+				bch2_read_hedge_arm(c, rbio, hedge, &hedge_pick);
+
+			if (likely(!(flags & BCH_READ_IN_RETRY))) {
+				rbio->io_sched = true;
+				bch2_dev_io_submit(ca, &rbio->bio, rbio->io_class);
+			} else {
 				submit_bio_wait(&rbio->bio);
+			}
 		}
 
 		/*
@@ -1170,20 +1541,17 @@ void __bch2_read(struct bch_fs *c, struct bch_read_bio *rbio,
 
 		bch2_btree_iter_set_snapshot(&iter, snapshot);
 
-		bch2_btree_iter_set_pos(&iter,
-				POS(inum.inum, bvec_iter.bi_sector));
+		struct bpos pos = SPOS(inum.inum, bvec_iter.bi_sector, snapshot);
 
-		k = bch2_btree_iter_peek_slot(&iter);
-		ret = bkey_err(k);
+		ret = bch2_extent_cache_peek(trans, &iter, rbio->extent_cache, pos, &sk);
 		if (ret)
 			goto err;
 
-		offset_into_extent = iter.pos.offset -
+		k = bkey_i_to_s_c(sk.k);
+		offset_into_extent = pos.offset -
 			bkey_start_offset(k.k);
 		sectors = k.k->size - offset_into_extent;
 
-		bch2_bkey_buf_reassemble(&sk, c, k);
-
 		ret = bch2_read_indirect_extent(trans, &data_btree,
 					&offset_into_extent, &sk);
 		if (ret)
@@ -1203,7 +1571,7 @@ void __bch2_read(struct bch_fs *c, struct bch_read_bio *rbio,
 		if (bvec_iter.bi_size == bytes)
 			flags |= BCH_READ_LAST_FRAGMENT;
 
-		ret = __bch2_read_extent(trans, rbio, bvec_iter, iter.pos,
+		ret = __bch2_read_extent(trans, rbio, bvec_iter, pos,
 					 data_btree, k,
 					 offset_into_extent, failed, flags);
 		if (ret)
@@ -1237,6 +1605,7 @@ err:
 
 void bch2_fs_io_read_exit(struct bch_fs *c)
 {
+	kvfree(c->promote_sketch);
 	if (c->promote_table.tbl)
 		rhashtable_destroy(&c->promote_table);
 	bioset_exit(&c->bio_read_split);
@@ -1256,5 +1625,10 @@ int bch2_fs_io_read_init(struct bch_fs *c)
 	if (rhashtable_init(&c->promote_table, &bch_promote_params))
 		return -BCH_ERR_ENOMEM_promote_table_init;
 
+	c->promote_sketch = kvzalloc(PROMOTE_SKETCH_ROWS * PROMOTE_SKETCH_WIDTH,
+				     GFP_KERNEL);
+	if (!c->promote_sketch)
+		return -BCH_ERR_ENOMEM_promote_sketch_init;
+
 	return 0;
 }
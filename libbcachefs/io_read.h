@@ -8,6 +8,8 @@ struct bch_read_bio {
 	struct bch_fs		*c;
 	u64			start_time;
 	u64			submit_time;
+	/* for slow op accounting: */
+	u64			endio_time;
 
 	/*
 	 * Reads will often have to be split, and if the extent being read from
@@ -41,7 +43,9 @@ struct bch_read_bio {
 				narrow_crcs:1,
 				hole:1,
 				retry:2,
-				context:2;
+				context:2,
+				io_class:BCH_IO_CLASS_BITS,
+				io_sched:1;
 	};
 	u16			_state;
 	};
@@ -65,6 +69,8 @@ struct bch_read_bio {
 	struct bversion		version;
 
 	struct promote_op	*promote;
+	struct bch_read_hedge	*hedge;
+	struct bch_extent_cache	*extent_cache;
 
 	struct bch_io_opts	opts;
 
@@ -100,11 +106,12 @@ enum bch_read_flags {
 	BCH_READ_USER_MAPPED		= 1 << 2,
 	BCH_READ_NODECODE		= 1 << 3,
 	BCH_READ_LAST_FRAGMENT		= 1 << 4,
+	BCH_READ_SEQUENTIAL		= 1 << 5,
 
 	/* internal: */
-	BCH_READ_MUST_BOUNCE		= 1 << 5,
-	BCH_READ_MUST_CLONE		= 1 << 6,
-	BCH_READ_IN_RETRY		= 1 << 7,
+	BCH_READ_MUST_BOUNCE		= 1 << 6,
+	BCH_READ_MUST_CLONE		= 1 << 7,
+	BCH_READ_IN_RETRY		= 1 << 8,
 };
 
 int __bch2_read_extent(struct btree_trans *, struct bch_read_bio *,
@@ -125,7 +132,7 @@ void __bch2_read(struct bch_fs *, struct bch_read_bio *, struct bvec_iter,
 		 subvol_inum, struct bch_io_failures *, unsigned flags);
 
 static inline void bch2_read(struct bch_fs *c, struct bch_read_bio *rbio,
-			     subvol_inum inum)
+			     subvol_inum inum, unsigned flags)
 {
 	struct bch_io_failures failed = { .nr = 0 };
 
@@ -133,12 +140,15 @@ static inline void bch2_read(struct bch_fs *c, struct bch_read_bio *rbio,
 
 	rbio->c = c;
 	rbio->start_time = local_clock();
+	rbio->submit_time = 0;
+	rbio->endio_time = 0;
 	rbio->subvol = inum.subvol;
 
 	__bch2_read(c, rbio, rbio->bio.bi_iter, inum, &failed,
 		    BCH_READ_RETRY_IF_STALE|
 		    BCH_READ_MAY_PROMOTE|
-		    BCH_READ_USER_MAPPED);
+		    BCH_READ_USER_MAPPED|
+		    flags);
 }
 
 static inline struct bch_read_bio *rbio_init(struct bio *bio,
@@ -148,6 +158,8 @@ static inline struct bch_read_bio *rbio_init(struct bio *bio,
 
 	rbio->_state	= 0;
 	rbio->promote	= NULL;
+	rbio->hedge	= NULL;
+	rbio->extent_cache = NULL;
 	rbio->opts	= opts;
 	return rbio;
 }
@@ -0,0 +1,206 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Per device IO dispatch, with weighted fair queueing between IO classes:
+ *
+ * Data reads and writes are submitted through bch2_dev_io_submit(); while a
+ * device has fewer than opts.io_sched_depth IOs in flight they go straight to
+ * the block layer, past that they're queued per class, and dispatched as IOs
+ * complete - the class with the lowest virtual time goes first, and each
+ * IO advances its class's virtual time by its cost divided by the class's
+ * weight. This is what keeps copygc and rebalance from starving foreground IO
+ * on the same device, even with a block layer scheduler that doesn't look at
+ * IO priorities.
+ *
+ * Journal and btree node IO isn't scheduled - it isn't queued, and isn't
+ * counted against the depth limit.
+ */
+
+#include "bcachefs.h"
+#include "io_sched.h"
+
+const char * const bch2_io_classes[] = {
+#define x(t) #t,
+	BCH_IO_CLASSES()
+#undef x
+	NULL
+};
+
+/* Small IOs are charged as if they were 4k, so that we also approximate IOPS: */
+#define IO_SCHED_MIN_COST_SECTORS	8
+
+static unsigned io_class_weight(struct bch_fs *c, enum bch_io_class class)
+{
+	unsigned weight = 1;
+
+	switch (class) {
+#define x(n)								\
+	case BCH_IO_CLASS_##n:						\
+		weight = c->opts.io_weight_##n;				\
+		break;
+	BCH_IO_CLASSES()
+#undef x
+	default:
+		BUG();
+	}
+
+	return max(weight, 1U);
+}
+
+static u64 io_cost(struct bch_fs *c, struct bio *bio, enum bch_io_class class)
+{
+	return div_u64((u64) max(bio_sectors(bio), IO_SCHED_MIN_COST_SECTORS) << 10,
+		       io_class_weight(c, class));
+}
+
+static void io_sched_account(struct bch_fs *c, struct bch_dev_io_sched *s,
+			     struct bio *bio, enum bch_io_class class)
+{
+	struct bch_dev_io_class *ic = &s->class[class];
+
+	atomic_inc(&s->in_flight);
+	atomic_inc(&ic->in_flight);
+	ic->nr_dispatched++;
+
+	s->vclock = ic->vtime;
+	ic->vtime += io_cost(c, bio, class);
+}
+
+static bool io_sched_may_dispatch(struct bch_fs *c, struct bch_dev_io_sched *s)
+{
+	unsigned depth = READ_ONCE(c->opts.io_sched_depth);
+
+	return !depth || atomic_read(&s->in_flight) < depth;
+}
+
+static void bch2_dev_io_dispatch_work(struct work_struct *work)
+{
+	struct bch_dev *ca = container_of(work, struct bch_dev, io_sched.dispatch_work);
+	struct bch_fs *c = ca->fs;
+	struct bch_dev_io_sched *s = &ca->io_sched;
+	struct bio_list bios;
+	struct bio *bio;
+
+	bio_list_init(&bios);
+
+	spin_lock(&s->lock);
+	while (s->nr_queued && io_sched_may_dispatch(c, s)) {
+		struct bch_dev_io_class *next = NULL;
+
+		for (struct bch_dev_io_class *ic = s->class;
+		     ic < s->class + ARRAY_SIZE(s->class);
+		     ic++)
+			if (ic->nr_queued &&
+			    (!next || ic->vtime < next->vtime))
+				next = ic;
+
+		bio = bio_list_pop(&next->queued);
+		next->nr_queued--;
+		s->nr_queued--;
+
+		io_sched_account(c, s, bio, next - s->class);
+		bio_list_add(&bios, bio);
+	}
+	spin_unlock(&s->lock);
+
+	while ((bio = bio_list_pop(&bios)))
+		submit_bio(bio);
+}
+
+void bch2_dev_io_submit(struct bch_dev *ca, struct bio *bio, enum bch_io_class class)
+{
+	struct bch_fs *c = ca->fs;
+	struct bch_dev_io_sched *s = &ca->io_sched;
+	struct bch_dev_io_class *ic = &s->class[class];
+
+	spin_lock(&s->lock);
+	if (!s->nr_queued && io_sched_may_dispatch(c, s)) {
+		io_sched_account(c, s, bio, class);
+		spin_unlock(&s->lock);
+
+		submit_bio(bio);
+		return;
+	}
+
+	/*
+	 * A class that's been idle doesn't get to bank credit for the time it
+	 * wasn't doing IO:
+	 */
+	if (!ic->nr_queued && !atomic_read(&ic->in_flight))
+		ic->vtime = max(ic->vtime, s->vclock);
+
+	bio_list_add(&ic->queued, bio);
+	ic->nr_queued++;
+	ic->nr_delayed++;
+	s->nr_queued++;
+	spin_unlock(&s->lock);
+
+	/* Pairs with smp_mb__after_atomic() in bch2_dev_io_done() */
+	smp_mb();
+	if (io_sched_may_dispatch(c, s))
+		queue_work(system_highpri_wq, &s->dispatch_work);
+}
+
+void bch2_dev_io_done(struct bch_dev *ca, enum bch_io_class class)
+{
+	struct bch_dev_io_sched *s = &ca->io_sched;
+
+	atomic_dec(&s->class[class].in_flight);
+	atomic_dec(&s->in_flight);
+
+	/* Pairs with the smp_mb() in bch2_dev_io_submit() */
+	smp_mb__after_atomic();
+	if (READ_ONCE(s->nr_queued))
+		queue_work(system_highpri_wq, &s->dispatch_work);
+}
+
+void bch2_dev_io_sched_to_text(struct printbuf *out, struct bch_dev *ca)
+{
+	struct bch_fs *c = ca->fs;
+	struct bch_dev_io_sched *s = &ca->io_sched;
+
+	printbuf_tabstops_reset(out);
+	printbuf_tabstop_push(out, 12);
+	printbuf_tabstop_push(out, 10);
+	printbuf_tabstop_push(out, 10);
+	printbuf_tabstop_push(out, 10);
+	printbuf_tabstop_push(out, 16);
+	printbuf_tabstop_push(out, 16);
+
+	prt_printf(out, "depth:\t%u\n",		c->opts.io_sched_depth);
+	prt_printf(out, "in flight:\t%u\n",	atomic_read(&s->in_flight));
+	prt_printf(out, "queued:\t%u\n",	READ_ONCE(s->nr_queued));
+	prt_newline(out);
+
+	prt_printf(out, "class\rweight\rin flight\rqueued\rdispatched\rdelayed\r\n");
+
+	spin_lock(&s->lock);
+	for (unsigned i = 0; i < BCH_IO_CLASS_NR; i++) {
+		struct bch_dev_io_class *ic = &s->class[i];
+
+		prt_printf(out, "%s\t%u\r%u\r%u\r%llu\r%llu\r\n",
+			   bch2_io_classes[i],
+			   io_class_weight(c, i),
+			   atomic_read(&ic->in_flight),
+			   ic->nr_queued,
+			   ic->nr_dispatched,
+			   ic->nr_delayed);
+	}
+	spin_unlock(&s->lock);
+}
+
+void bch2_dev_io_sched_exit(struct bch_dev *ca)
+{
+	cancel_work_sync(&ca->io_sched.dispatch_work);
+	BUG_ON(ca->io_sched.nr_queued);
+}
+
+void bch2_dev_io_sched_init(struct bch_dev *ca)
+{
+	struct bch_dev_io_sched *s = &ca->io_sched;
+
+	spin_lock_init(&s->lock);
+	INIT_WORK(&s->dispatch_work, bch2_dev_io_dispatch_work);
+
+	for (unsigned i = 0; i < BCH_IO_CLASS_NR; i++)
+		bio_list_init(&s->class[i].queued);
+}
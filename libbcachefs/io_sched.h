@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_IO_SCHED_H
+#define _BCACHEFS_IO_SCHED_H
+
+#include "io_sched_types.h"
+
+extern const char * const bch2_io_classes[];
+
+void bch2_dev_io_submit(struct bch_dev *, struct bio *, enum bch_io_class);
+void bch2_dev_io_done(struct bch_dev *, enum bch_io_class);
+
+void bch2_dev_io_sched_to_text(struct printbuf *, struct bch_dev *);
+
+void bch2_dev_io_sched_exit(struct bch_dev *);
+void bch2_dev_io_sched_init(struct bch_dev *);
+
+#endif /* _BCACHEFS_IO_SCHED_H */
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_IO_SCHED_TYPES_H
+#define _BCACHEFS_IO_SCHED_TYPES_H
+
+#include <linux/bio.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+/*
+ * IO classes for the per device dispatcher: foreground is normal user IO,
+ * move is data jobs (migrate, rereplicate) - each class gets a weight, the
+ * io_weight_<class> option:
+ */
+#define BCH_IO_CLASSES()		\
+	x(foreground)			\
+	x(copygc)			\
+	x(rebalance)			\
+	x(move)
+
+enum bch_io_class {
+#define x(n)	BCH_IO_CLASS_##n,
+	BCH_IO_CLASSES()
+#undef x
+	BCH_IO_CLASS_NR,
+};
+
+#define BCH_IO_CLASS_BITS	2
+
+struct bch_dev_io_sched {
+	spinlock_t		lock;
+	atomic_t		in_flight;
+	unsigned		nr_queued;
+	/* virtual time of the last dispatched IO: */
+	u64			vclock;
+	struct work_struct	dispatch_work;
+
+	struct bch_dev_io_class {
+		struct bio_list	queued;
+		unsigned	nr_queued;
+		atomic_t	in_flight;
+		u64		vtime;
+		u64		nr_dispatched;
+		u64		nr_delayed;
+	}			class[BCH_IO_CLASS_NR];
+};
+
+#endif /* _BCACHEFS_IO_SCHED_TYPES_H */
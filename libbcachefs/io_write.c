@@ -18,12 +18,15 @@
 #include "error.h"
 #include "extent_update.h"
 #include "inode.h"
+#include "io_attrib.h"
+#include "io_sched.h"
 #include "io_write.h"
 #include "journal.h"
 #include "keylist.h"
 #include "move.h"
 #include "nocow_locking.h"
 #include "rebalance.h"
+#include "slow_ops.h"
 #include "subvolume.h"
 #include "super.h"
 #include "super-io.h"
@@ -193,10 +196,10 @@ int bch2_sum_sector_overwrites(struct btree_trans *trans,
 	return ret;
 }
 
-static inline int bch2_extent_update_i_size_sectors(struct btree_trans *trans,
-						    struct btree_iter *extent_iter,
-						    u64 new_i_size,
-						    s64 i_sectors_delta)
+int bch2_extent_update_i_size_sectors(struct btree_trans *trans,
+				      struct btree_iter *extent_iter,
+				      u64 new_i_size,
+				      s64 i_sectors_delta)
 {
 	/*
 	 * Crazy performance optimization:
@@ -265,16 +268,21 @@ err:
 	return ret;
 }
 
-int bch2_extent_update(struct btree_trans *trans,
-		       subvol_inum inum,
-		       struct btree_iter *iter,
-		       struct bkey_i *k,
-		       struct disk_reservation *disk_res,
-		       u64 new_i_size,
-		       s64 *i_sectors_delta_total,
-		       bool check_enospc)
+/*
+ * Queue up an extent update without committing: the caller must also do the
+ * inode update with bch2_extent_update_i_size_sectors() before committing.
+ *
+ * @k is trimmed to what can be done atomically; @next_pos is set to where the
+ * next update should start.
+ */
+int bch2_extent_update_nocommit(struct btree_trans *trans,
+				struct btree_iter *iter,
+				struct bkey_i *k,
+				struct disk_reservation *disk_res,
+				s64 *i_sectors_delta_total,
+				struct bpos *next_pos,
+				bool check_enospc)
 {
-	struct bpos next_pos;
 	bool usage_increasing;
 	s64 i_sectors_delta = 0, disk_sectors_delta = 0;
 	int ret;
@@ -293,7 +301,7 @@ int bch2_extent_update(struct btree_trans *trans,
 	if (ret)
 		return ret;
 
-	next_pos = k->k.p;
+	*next_pos = k->k.p;
 
 	ret = bch2_sum_sector_overwrites(trans, iter, k,
 			&usage_increasing,
@@ -312,16 +320,38 @@ int bch2_extent_update(struct btree_trans *trans,
 			return ret;
 	}
 
+	ret = bch2_trans_update(trans, iter, k, 0);
+	if (unlikely(ret))
+		return ret;
+
+	*i_sectors_delta_total += i_sectors_delta;
+	return 0;
+}
+
+int bch2_extent_update(struct btree_trans *trans,
+		       subvol_inum inum,
+		       struct btree_iter *iter,
+		       struct bkey_i *k,
+		       struct disk_reservation *disk_res,
+		       u64 new_i_size,
+		       s64 *i_sectors_delta_total,
+		       bool check_enospc)
+{
+	struct bpos next_pos;
+	s64 i_sectors_delta = 0;
+
 	/*
 	 * Note:
 	 * We always have to do an inode update - even when i_size/i_sectors
 	 * aren't changing - for fsync to work properly; fsync relies on
 	 * inode->bi_journal_seq which is updated by the trigger code:
 	 */
-	ret =   bch2_extent_update_i_size_sectors(trans, iter,
-						  min(k->k.p.offset << 9, new_i_size),
+	int ret = bch2_extent_update_nocommit(trans, iter, k, disk_res,
+					      &i_sectors_delta, &next_pos,
+					      check_enospc) ?:
+		bch2_extent_update_i_size_sectors(trans, iter,
+						  min(next_pos.offset << 9, new_i_size),
 						  i_sectors_delta) ?:
-		bch2_trans_update(trans, iter, k, 0) ?:
 		bch2_trans_commit(trans, disk_res, NULL,
 				BCH_TRANS_COMMIT_no_check_rw|
 				BCH_TRANS_COMMIT_no_enospc);
@@ -419,6 +449,7 @@ void bch2_submit_wbio_replicas(struct bch_write_bio *wbio, struct bch_fs *c,
 			n->split		= true;
 			n->bounce		= false;
 			n->put_bio		= true;
+			n->io_class		= wbio->io_class;
 			n->bio.bi_opf		= wbio->bio.bi_opf;
 			bio_inc_remaining(&wbio->bio);
 		} else {
@@ -430,6 +461,7 @@ void bch2_submit_wbio_replicas(struct bch_write_bio *wbio, struct bch_fs *c,
 		n->dev			= ptr->dev;
 		n->have_ioref		= ca != NULL;
 		n->nocow		= nocow;
+		n->io_sched		= false;
 		n->submit_time		= local_clock();
 		n->inode_offset		= bkey_start_offset(&k->k);
 		if (nocow)
@@ -447,7 +479,12 @@ void bch2_submit_wbio_replicas(struct bch_write_bio *wbio, struct bch_fs *c,
 				continue;
 			}
 
-			submit_bio(&n->bio);
+			if (type != BCH_DATA_btree) {
+				n->io_sched = true;
+				bch2_dev_io_submit(ca, &n->bio, n->io_class);
+			} else {
+				submit_bio(&n->bio);
+			}
 		} else {
 			n->bio.bi_status	= BLK_STS_REMOVED;
 			bio_endio(&n->bio);
@@ -457,6 +494,35 @@ void bch2_submit_wbio_replicas(struct bch_write_bio *wbio, struct bch_fs *c,
 
 static void __bch2_write(struct bch_write_op *);
 
+static inline void bch2_write_op_phase(struct bch_write_op *op,
+				       enum bch_write_phase phase)
+{
+	if (unlikely(op->phase_start)) {
+		bch2_slow_op_phase_add(&op->phase_ns[op->phase], &op->phase_start);
+		op->phase = phase;
+	}
+}
+
+static noinline void bch2_write_op_slow_check(struct bch_write_op *op)
+{
+	struct bch_fs *c = op->c;
+	u64 duration = op->phase_start - op->start_time;
+
+	if (!bch2_slow_op_is_slow(c, duration))
+		return;
+
+	struct bch_slow_op s = {
+		.type		= BCH_SLOW_OP_write,
+		.duration	= duration,
+		.inum		= op->pos.inode,
+		.offset		= op->pos.offset,
+		.sectors	= op->written,
+	};
+
+	memcpy(s.phase_ns, op->phase_ns, sizeof(op->phase_ns));
+	bch2_slow_op_record(c, &s);
+}
+
 static void bch2_write_done(struct closure *cl)
 {
 	struct bch_write_op *op = container_of(cl, struct bch_write_op, cl);
@@ -465,6 +531,11 @@ static void bch2_write_done(struct closure *cl)
 	EBUG_ON(op->open_buckets.nr);
 
 	bch2_time_stats_update(&c->times[BCH_TIME_data_write], op->start_time);
+
+	if (unlikely(op->phase_start)) {
+		bch2_write_op_phase(op, op->phase);
+		bch2_write_op_slow_check(op);
+	}
 	bch2_disk_reservation_put(c, &op->res);
 
 	if (!(op->flags & BCH_WRITE_MOVE))
@@ -513,6 +584,8 @@ static void __bch2_write_index(struct bch_write_op *op)
 	unsigned dev;
 	int ret = 0;
 
+	bch2_write_op_phase(op, BCH_WRITE_PHASE_index_update);
+
 	if (unlikely(op->flags & BCH_WRITE_IO_ERROR)) {
 		ret = bch2_write_drop_io_error_ptrs(op);
 		if (ret)
@@ -589,6 +662,8 @@ static CLOSURE_CALLBACK(bch2_write_index)
 	struct workqueue_struct *wq = index_update_wq(op);
 	unsigned long flags;
 
+	bch2_write_op_phase(op, BCH_WRITE_PHASE_index_wait);
+
 	if ((op->flags & BCH_WRITE_SUBMITTED) &&
 	    (op->flags & BCH_WRITE_MOVE))
 		bch2_bio_free_pages_pool(op->c, &op->wbio.bio);
@@ -670,6 +745,8 @@ static void bch2_write_endio(struct bio *bio)
 
 	if (wbio->have_ioref) {
 		bch2_latency_acct(ca, wbio->submit_time, WRITE);
+		if (wbio->io_sched)
+			bch2_dev_io_done(ca, wbio->io_class);
 		percpu_ref_put(&ca->io_ref);
 	}
 
@@ -812,6 +889,17 @@ static int bch2_write_decrypt(struct bch_write_op *op)
 	return ret;
 }
 
+/* Can we write the existing encoded extent out as is, keeping its crc? */
+static bool bch2_write_encoded_as_is(struct bch_fs *c, struct bch_write_op *op,
+				     struct write_point *wp)
+{
+	return op->crc.uncompressed_size == op->crc.live_size &&
+		op->crc.uncompressed_size <= c->opts.encoded_extent_max >> 9 &&
+		op->crc.compressed_size <= wp->sectors_free &&
+		(op->crc.compression_type == bch2_compression_opt_to_type(op->compression_opt) ||
+		 op->incompressible);
+}
+
 static enum prep_encoded_ret {
 	PREP_ENCODED_OK,
 	PREP_ENCODED_ERR,
@@ -828,11 +916,7 @@ static enum prep_encoded_ret {
 	BUG_ON(bio_sectors(bio) != op->crc.compressed_size);
 
 	/* Can we just write the entire extent as is? */
-	if (op->crc.uncompressed_size == op->crc.live_size &&
-	    op->crc.uncompressed_size <= c->opts.encoded_extent_max >> 9 &&
-	    op->crc.compressed_size <= wp->sectors_free &&
-	    (op->crc.compression_type == bch2_compression_opt_to_type(op->compression_opt) ||
-	     op->incompressible)) {
+	if (bch2_write_encoded_as_is(c, op, wp)) {
 		if (!crc_is_compressed(op->crc) &&
 		    op->csum_type != op->crc.csum_type &&
 		    bch2_write_rechecksum(c, op, op->csum_type) &&
@@ -878,6 +962,15 @@ static enum prep_encoded_ret {
 	    !c->opts.no_data_io)
 		return PREP_ENCODED_CHECKSUM_ERR;
 
+	/*
+	 * The bio and crc now cover exactly the live data: if it's already in
+	 * the format we want, write it out directly, instead of checksumming it
+	 * again in bch2_write_extent():
+	 */
+	if (op->crc.csum_type == op->csum_type &&
+	    bch2_write_encoded_as_is(c, op, wp))
+		return PREP_ENCODED_DO_WRITE;
+
 	/*
 	 * If we want to compress the data, it has to be decrypted:
 	 */
@@ -890,12 +983,42 @@ static enum prep_encoded_ret {
 	return PREP_ENCODED_OK;
 }
 
+/*
+ * After this many extents in a row fail to compress, stop trying, apart from
+ * every BCH_WRITE_COMPRESS_RETRY extents in case the data has changed:
+ */
+#define BCH_WRITE_INCOMPRESSIBLE_STREAK	16
+#define BCH_WRITE_COMPRESS_RETRY	64
+
+static bool bch2_write_skip_compression(struct bch_write_op *op)
+{
+	int v = op->incompressible_streak
+		? atomic_read(op->incompressible_streak)
+		: 0;
+
+	return v >= BCH_WRITE_INCOMPRESSIBLE_STREAK &&
+		v % BCH_WRITE_COMPRESS_RETRY;
+}
+
+static void bch2_write_compress_done(struct bch_write_op *op,
+				     struct bch_extent_crc_unpacked crc)
+{
+	if (!op->incompressible_streak)
+		return;
+
+	if (crc_is_compressed(crc))
+		atomic_set(op->incompressible_streak, 0);
+	else
+		atomic_inc(op->incompressible_streak);
+}
+
 static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 			     struct bio **_dst)
 {
 	struct bch_fs *c = op->c;
 	struct bio *src = &op->wbio.bio, *dst = src;
 	struct bvec_iter saved_iter;
+	struct bch_compress_batch *batch = NULL;
 	void *ec_buf;
 	unsigned total_output = 0, total_input = 0;
 	bool bounce = false;
@@ -915,6 +1038,10 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 	case PREP_ENCODED_CHECKSUM_ERR:
 		goto csum_err;
 	case PREP_ENCODED_DO_WRITE:
+		if (op->flags & BCH_WRITE_MOVE)
+			this_cpu_add(c->counters[BCH_COUNTER_io_move_write_as_is],
+				     op->crc.compressed_size);
+
 		/* XXX look for bug here */
 		if (ec_buf) {
 			dst = bch2_write_bio_alloc(c, wp, src,
@@ -941,6 +1068,11 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 
 	saved_iter = dst->bi_iter;
 
+	if (op->compression_opt &&
+	    !op->incompressible &&
+	    !bch2_write_skip_compression(op))
+		batch = bch2_bio_compress_batch_start(c, src, op->compression_opt);
+
 	do {
 		struct bch_extent_crc_unpacked crc = { 0 };
 		struct bversion version = op->version;
@@ -956,12 +1088,16 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 		       bch2_csum_type_is_encryption(op->crc.csum_type));
 		BUG_ON(op->compression_opt && !bounce);
 
-		crc.compression_type = op->incompressible
+		crc.compression_type = op->incompressible ||
+			(op->compression_opt && bch2_write_skip_compression(op))
 			? BCH_COMPRESSION_TYPE_incompressible
 			: op->compression_opt
-			? bch2_bio_compress(c, dst, &dst_len, src, &src_len,
-					    op->compression_opt)
+			? bch2_bio_compress_batch(c, batch, dst, &dst_len,
+						  src, &src_len,
+						  op->compression_opt)
 			: 0;
+		if (op->compression_opt && !op->incompressible)
+			bch2_write_compress_done(op, crc);
 		if (!crc_is_compressed(crc)) {
 			dst_len = min(dst->bi_iter.bi_size, src->bi_iter.bi_size);
 			dst_len = min_t(unsigned, dst_len, wp->sectors_free << 9);
@@ -1035,13 +1171,11 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 			crc.live_size		= src_len >> 9;
 
 			swap(dst->bi_iter.bi_size, dst_len);
-			ret = bch2_encrypt_bio(c, op->csum_type,
-					       extent_nonce(version, crc), dst);
+			ret = bch2_encrypt_checksum_bio(c, op->csum_type,
+					extent_nonce(version, crc), dst, &crc.csum);
 			if (ret)
 				goto err;
 
-			crc.csum = bch2_checksum_bio(c, op->csum_type,
-					 extent_nonce(version, crc), dst);
 			crc.csum_type = op->csum_type;
 			swap(dst->bi_iter.bi_size, dst_len);
 		}
@@ -1061,6 +1195,9 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 				      ARRAY_SIZE(op->inline_keys),
 				      BKEY_EXTENT_U64s_MAX));
 
+	bch2_bio_compress_batch_exit(batch);
+	batch = NULL;
+
 	more = src->bi_iter.bi_size != 0;
 
 	dst->bi_iter = saved_iter;
@@ -1087,6 +1224,8 @@ csum_err:
 		op->flags & BCH_WRITE_MOVE ? "move" : "user");
 	ret = -EIO;
 err:
+	bch2_bio_compress_batch_exit(batch);
+
 	if (to_wbio(dst)->bounce)
 		bch2_bio_free_pages_pool(c, dst);
 	if (to_wbio(dst)->put_bio)
@@ -1210,9 +1349,59 @@ static CLOSURE_CALLBACK(bch2_nocow_write_done)
 struct bucket_to_lock {
 	struct bpos		b;
 	unsigned		gen;
+	u32			seq;
 	struct nocow_lock_bucket *l;
 };
 
+#define NOCOW_EXTENT_CACHE_TIMEOUT	HZ
+
+static bool bch2_nocow_cache_get(struct bch_write_op *op, u32 snapshot,
+				 struct bkey_i *k, u32 *seq)
+{
+	struct bch_nocow_extent_cache *e = op->nocow_cache;
+	bool ret = false;
+
+	spin_lock(&e->lock);
+	if (e->k.k.type == KEY_TYPE_extent &&
+	    bpos_eq(e->k.k.p, SPOS(op->pos.inode, e->k.k.p.offset, snapshot)) &&
+	    bkey_start_offset(&e->k.k) <= op->pos.offset &&
+	    e->k.k.p.offset > op->pos.offset &&
+	    time_before(jiffies, e->expires)) {
+		bkey_copy(k, &e->k);
+		memcpy(seq, e->seq, sizeof(e->seq));
+		ret = true;
+	}
+	spin_unlock(&e->lock);
+
+	return ret;
+}
+
+static void bch2_nocow_cache_set(struct bch_write_op *op, struct bkey_s_c k,
+				 struct bucket_to_lock *b, unsigned nr)
+{
+	struct bch_nocow_extent_cache *e = op->nocow_cache;
+
+	if (nr > ARRAY_SIZE(e->seq) ||
+	    bkey_val_u64s(k.k) > BKEY_EXTENT_VAL_U64s_MAX)
+		return;
+
+	spin_lock(&e->lock);
+	bkey_reassemble(&e->k, k);
+	for (unsigned i = 0; i < nr; i++)
+		e->seq[i] = b[i].seq;
+	e->expires = jiffies + NOCOW_EXTENT_CACHE_TIMEOUT;
+	spin_unlock(&e->lock);
+}
+
+static void bch2_nocow_cache_invalidate(struct bch_write_op *op)
+{
+	struct bch_nocow_extent_cache *e = op->nocow_cache;
+
+	spin_lock(&e->lock);
+	e->k.k.type = KEY_TYPE_deleted;
+	spin_unlock(&e->lock);
+}
+
 static void bch2_nocow_write(struct bch_write_op *op)
 {
 	struct bch_fs *c = op->c;
@@ -1220,6 +1409,9 @@ static void bch2_nocow_write(struct bch_write_op *op)
 	struct btree_iter iter;
 	struct bkey_s_c k;
 	DARRAY_PREALLOCATED(struct bucket_to_lock, 3) buckets;
+	BKEY_PADDED_ONSTACK(k, BKEY_EXTENT_VAL_U64s_MAX) cached;
+	u32 cached_seq[ARRAY_SIZE(op->nocow_cache->seq)];
+	bool cache_hit;
 	u32 snapshot;
 	struct bucket_to_lock *stale_at;
 	int stale, ret;
@@ -1243,15 +1435,23 @@ retry:
 		struct bio *bio = &op->wbio.bio;
 
 		buckets.nr = 0;
+		cache_hit = false;
 
 		ret = bch2_trans_relock(trans);
 		if (ret)
 			break;
 
-		k = bch2_btree_iter_peek_slot(&iter);
-		ret = bkey_err(k);
-		if (ret)
-			break;
+		if (op->nocow_cache &&
+		    bch2_nocow_cache_get(op, snapshot, &cached.k, cached_seq)) {
+			k = bkey_i_to_s_c(&cached.k);
+			cache_hit = true;
+		} else {
+			bch2_btree_iter_set_pos(&iter, SPOS(op->pos.inode, op->pos.offset, snapshot));
+			k = bch2_btree_iter_peek_slot(&iter);
+			ret = bkey_err(k);
+			if (ret)
+				break;
+		}
 
 		/* fall back to normal cow write path? */
 		if (unlikely(k.k->p.snapshot != snapshot ||
@@ -1279,12 +1479,17 @@ retry:
 			/* XXX allocating memory with btree locks held - rare */
 			darray_push_gfp(&buckets, ((struct bucket_to_lock) {
 						   .b = b, .gen = ptr->gen, .l = l,
+						   .seq = atomic_read(&l->seq),
 						   }), GFP_KERNEL|__GFP_NOFAIL);
 
 			if (ptr->unwritten)
 				op->flags |= BCH_WRITE_CONVERT_UNWRITTEN;
 		}
 
+		if (op->nocow_cache && !cache_hit &&
+		    !(op->flags & BCH_WRITE_CONVERT_UNWRITTEN))
+			bch2_nocow_cache_set(op, k, buckets.data, buckets.nr);
+
 		/* Unlock before taking nocow locks, doing IO: */
 		bkey_reassemble(op->insert_keys.top, k);
 		bch2_trans_unlock(trans);
@@ -1311,6 +1516,16 @@ retry:
 			}
 		}
 
+		/* extent overwritten since we cached it? redo the lookup: */
+		if (cache_hit)
+			darray_for_each(buckets, i)
+				if (unlikely(atomic_read(&i->l->seq) !=
+					     cached_seq[i - buckets.data])) {
+					stale_at = &darray_last(buckets);
+					stale = 1;
+					goto err_bucket_stale;
+				}
+
 		bio = &op->wbio.bio;
 		if (k.k->p.offset < op->pos.offset + bio_sectors(bio)) {
 			bio = bio_split(bio, k.k->p.offset - op->pos.offset,
@@ -1328,13 +1543,13 @@ retry:
 		bio->bi_private	= &op->cl;
 		bio->bi_opf |= REQ_OP_WRITE;
 		closure_get(&op->cl);
+		to_wbio(bio)->io_class = op->io_class;
 		bch2_submit_wbio_replicas(to_wbio(bio), c, BCH_DATA_user,
 					  op->insert_keys.top, true);
 
 		bch2_keylist_push(&op->insert_keys);
 		if (op->flags & BCH_WRITE_SUBMITTED)
 			break;
-		bch2_btree_iter_advance(&iter);
 	}
 out:
 	bch2_trans_iter_exit(trans, &iter);
@@ -1377,6 +1592,9 @@ err_get_ioref:
 	/* Fall back to COW path: */
 	goto out;
 err_bucket_stale:
+	if (cache_hit)
+		bch2_nocow_cache_invalidate(op);
+
 	darray_for_each(buckets, i) {
 		bch2_bucket_nocow_unlock(&c->nocow_locks, i->b, BUCKET_NOCOW_LOCK_UPDATE);
 		if (i == stale_at)
@@ -1432,6 +1650,8 @@ again:
 					BKEY_EXTENT_U64s_MAX))
 			break;
 
+		bch2_write_op_phase(op, BCH_WRITE_PHASE_alloc);
+
 		/*
 		 * The copygc thread is now global, which means it's no longer
 		 * freeing up space on specific disks, which means that
@@ -1459,9 +1679,12 @@ again:
 
 		EBUG_ON(!wp);
 
+		bch2_write_op_phase(op, BCH_WRITE_PHASE_encode);
+
 		bch2_open_bucket_get(c, wp, &op->open_buckets);
 		ret = bch2_write_extent(op, wp, &bio);
 
+		bch2_writepoint_ec_buf_done(c, wp);
 		bch2_alloc_sectors_done_inlined(c, wp);
 err:
 		if (ret <= 0) {
@@ -1489,8 +1712,11 @@ err:
 		key_to_write = (void *) (op->insert_keys.keys_p +
 					 key_to_write_offset);
 
+		to_wbio(bio)->io_class = op->io_class;
 		bch2_submit_wbio_replicas(to_wbio(bio), c, BCH_DATA_user,
 					  key_to_write, false);
+
+		bch2_write_op_phase(op, BCH_WRITE_PHASE_io);
 	} while (ret);
 
 	/*
@@ -1594,6 +1820,12 @@ CLOSURE_CALLBACK(bch2_write)
 
 	op->nr_replicas_required = min_t(unsigned, op->nr_replicas_required, op->nr_replicas);
 	op->start_time = local_clock();
+	op->phase_start = 0;
+	if (bch2_slow_op_tracking(c)) {
+		op->phase_start	= op->start_time;
+		op->phase	= BCH_WRITE_PHASE_alloc;
+		memset(op->phase_ns, 0, sizeof(op->phase_ns));
+	}
 	bch2_keylist_init(&op->insert_keys, op->inline_keys);
 	wbio_init(bio)->put_bio = false;
 
@@ -1619,13 +1851,23 @@ CLOSURE_CALLBACK(bch2_write)
 	}
 
 	this_cpu_add(c->counters[BCH_COUNTER_io_write], bio_sectors(bio));
+	if (!(op->flags & BCH_WRITE_MOVE)) {
+		this_cpu_add(c->counters[BCH_COUNTER_io_write_foreground], bio_sectors(bio));
+		bch2_io_attrib_add(c, BCH_IO_ATTRIB_write, bio->bi_iter.bi_size);
+	}
 	bch2_increment_clock(c, bio_sectors(bio), WRITE);
 
 	data_len = min_t(u64, bio->bi_iter.bi_size,
 			 op->new_i_size - (op->pos.offset << 9));
 
+	/*
+	 * Small files are stored inline: rewriting the tail block of a file
+	 * that's still under the threshold (e.g. an append) replaces the inline
+	 * extent, and once it's grown past it the write goes out as a normal
+	 * extent:
+	 */
 	if (c->opts.inline_data &&
-	    data_len <= min(block_bytes(c) / 2, 1024U)) {
+	    data_len <= min_t(unsigned, block_bytes(c) / 2, c->opts.inline_data_max)) {
 		bch2_write_data_inline(op, data_len);
 		return;
 	}
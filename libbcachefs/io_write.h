@@ -13,8 +13,24 @@ void bch2_bio_alloc_pages_pool(struct bch_fs *, struct bio *, size_t);
 
 #ifndef CONFIG_BCACHEFS_NO_LATENCY_ACCT
 void bch2_latency_acct(struct bch_dev *, u64, int);
+
+/*
+ * How congested a device currently is - how far past the latency it's capable
+ * of recent IOs have been, decaying since the last slow IO:
+ */
+static inline u64 bch2_dev_congested(struct bch_dev *ca)
+{
+	u64 now = local_clock(), last = READ_ONCE(ca->congested_last);
+	s64 congested = atomic_read(&ca->congested);
+
+	if (time_after64(now, last))
+		congested -= (now - last) >> 12;
+
+	return max(congested, 0LL);
+}
 #else
 static inline void bch2_latency_acct(struct bch_dev *ca, u64 submit_time, int rw) {}
+static inline u64 bch2_dev_congested(struct bch_dev *ca) { return 0; }
 #endif
 
 void bch2_submit_wbio_replicas(struct bch_write_bio *, struct bch_fs *,
@@ -58,6 +74,11 @@ static inline struct workqueue_struct *index_update_wq(struct bch_write_op *op)
 
 int bch2_sum_sector_overwrites(struct btree_trans *, struct btree_iter *,
 			       struct bkey_i *, bool *, s64 *, s64 *);
+int bch2_extent_update_i_size_sectors(struct btree_trans *, struct btree_iter *,
+				      u64, s64);
+int bch2_extent_update_nocommit(struct btree_trans *, struct btree_iter *,
+				struct bkey_i *, struct disk_reservation *,
+				s64 *, struct bpos *, bool);
 int bch2_extent_update(struct btree_trans *, subvol_inum,
 		       struct btree_iter *, struct bkey_i *,
 		       struct disk_reservation *, u64, s64 *, bool);
@@ -76,6 +97,7 @@ static inline void bch2_write_op_init(struct bch_write_op *op, struct bch_fs *c,
 	op->nr_replicas_required = c->opts.data_replicas_required;
 	op->watermark		= BCH_WATERMARK_normal;
 	op->incompressible	= 0;
+	op->io_class		= BCH_IO_CLASS_foreground;
 	op->open_buckets.nr	= 0;
 	op->devs_have.nr	= 0;
 	op->target		= 0;
@@ -88,6 +110,8 @@ static inline void bch2_write_op_init(struct bch_write_op *op, struct bch_fs *c,
 	op->new_i_size		= U64_MAX;
 	op->i_sectors_delta	= 0;
 	op->devs_need_flush	= NULL;
+	op->incompressible_streak = NULL;
+	op->nocow_cache		= NULL;
 }
 
 CLOSURE_CALLBACK(bch2_write);
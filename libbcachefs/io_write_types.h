@@ -8,6 +8,7 @@
 #include "extents_types.h"
 #include "keylist_types.h"
 #include "opts.h"
+#include "slow_ops_types.h"
 #include "super_types.h"
 
 #include <linux/llist.h>
@@ -31,18 +32,40 @@ struct bch_write_bio {
 				have_ioref:1,
 				nocow:1,
 				used_mempool:1,
-				first_btree_write:1;
+				first_btree_write:1,
+				io_class:BCH_IO_CLASS_BITS,
+				io_sched:1;
 	);
 
 	struct bio		bio;
 };
 
+/*
+ * The most recently used nocow extent for a file, so that O_DIRECT overwrites
+ * of already allocated ranges (database page writes) can skip the extents btree
+ * lookup. Entries are validated after taking the nocow locks, against the
+ * nocow lock table's per slot sequence numbers - which are bumped whenever an
+ * extent pointing into that bucket is overwritten (truncate, fpunch, reflink,
+ * data moves):
+ */
+struct bch_nocow_extent_cache {
+	spinlock_t		lock;
+	unsigned long		expires;
+	u32			seq[BCH_REPLICAS_MAX + 1];
+	__BKEY_PADDED(k, BKEY_EXTENT_VAL_U64s_MAX);
+};
+
 struct bch_write_op {
 	struct closure		cl;
 	struct bch_fs		*c;
 	void			(*end_io)(struct bch_write_op *);
 	u64			start_time;
 
+	/* slow op phase accounting, if slow_op_threshold_ms is set: */
+	u64			phase_start;
+	u64			phase_ns[BCH_WRITE_PHASE_NR];
+	enum bch_write_phase	phase;
+
 	unsigned		written; /* sectors */
 	u16			flags;
 	s16			error; /* dio write path expects it to hold -ERESTARTSYS... */
@@ -54,6 +77,7 @@ struct bch_write_op {
 	unsigned		watermark:3;
 	unsigned		incompressible:1;
 	unsigned		stripe_waited:1;
+	unsigned		io_class:BCH_IO_CLASS_BITS;
 
 	struct bch_devs_list	devs_have;
 	u16			target;
@@ -90,6 +114,14 @@ struct bch_write_op {
 	 */
 	struct bch_devs_mask	*devs_need_flush;
 
+	/*
+	 * Number of extents in a row, for this file, that didn't compress - used
+	 * to stop trying on files that keep proving incompressible:
+	 */
+	atomic_t		*incompressible_streak;
+
+	struct bch_nocow_extent_cache *nocow_cache;
+
 	/* Must be last: */
 	struct bch_write_bio	wbio;
 };
@@ -20,6 +20,8 @@
 #include "journal_seq_blacklist.h"
 #include "trace.h"
 
+#include <linux/delay.h>
+
 static const char * const bch2_journal_errors[] = {
 #define x(n)	#n,
 	JOURNAL_ERRORS()
@@ -219,6 +221,157 @@ void bch2_journal_buf_put_final(struct journal *j, u64 seq)
 	bch2_journal_do_writes(j);
 }
 
+/* Journal reservation slabs: */
+
+#ifdef __KERNEL__
+static inline struct journal_res_slab *journal_res_slab(struct journal *j)
+{
+	return j->res_slabs + raw_smp_processor_id() % JOURNAL_RES_SLABS;
+}
+#else
+static __thread int journal_res_slab_this_shard = -1;
+static atomic_t journal_res_slab_next_shard;
+
+static inline struct journal_res_slab *journal_res_slab(struct journal *j)
+{
+	if (unlikely(journal_res_slab_this_shard < 0))
+		journal_res_slab_this_shard = atomic_inc_return(&journal_res_slab_next_shard) %
+			JOURNAL_RES_SLABS;
+
+	return j->res_slabs + journal_res_slab_this_shard;
+}
+#endif
+
+void bch2_journal_res_slab_put(struct journal *j, struct journal_res_slab *s,
+			       unsigned idx, u64 seq, bool locked)
+{
+	if (!atomic_dec_and_test(&s->ref[idx]))
+		return;
+
+	if (locked)
+		__bch2_journal_buf_put(j, idx, seq);
+	else
+		bch2_journal_buf_put(j, idx, seq);
+}
+
+/*
+ * Give back the unused part of a slab - fill it with empty entries, as
+ * bch2_journal_res_put() does - and return whether the caller now has to drop
+ * the slab's ref with bch2_journal_res_slab_put(), after dropping the slab
+ * lock:
+ */
+static bool journal_res_slab_retire(struct journal *j, struct journal_res_slab *s)
+{
+	lockdep_assert_held(&s->lock);
+
+	if (!s->open)
+		return false;
+
+	memset(j->buf[s->idx].data->_data + s->offset, 0,
+	       (s->end - s->offset) * sizeof(u64));
+	s->open = false;
+	return true;
+}
+
+/* Take a new range of the current journal buf for a slab: */
+static bool journal_res_slab_refill(struct journal *j, struct journal_res_slab *s,
+				    unsigned flags)
+{
+	union journal_res_state old, new;
+
+	old.v = atomic64_read(&j->reservations.counter);
+	do {
+		new.v = old.v;
+
+		if (new.cur_entry_offset + JOURNAL_RES_SLAB_U64S > j->cur_entry_u64s)
+			return false;
+
+		if ((flags & BCH_WATERMARK_MASK) < j->watermark)
+			return false;
+
+		new.cur_entry_offset += JOURNAL_RES_SLAB_U64S;
+		journal_state_inc(&new);
+
+		if (!journal_state_count(new, new.idx))
+			return false;
+	} while (!atomic64_try_cmpxchg(&j->reservations.counter,
+				       &old.v, new.v));
+
+	s->open		= true;
+	s->idx		= old.idx;
+	s->offset	= old.cur_entry_offset;
+	s->end		= old.cur_entry_offset + JOURNAL_RES_SLAB_U64S;
+	s->seq		= le64_to_cpu(j->buf[old.idx].data->seq);
+	atomic_inc(&s->ref[s->idx]);
+	return true;
+}
+
+bool bch2_journal_res_get_slab(struct journal *j, struct journal_res *res,
+			       unsigned flags)
+{
+	struct journal_res_slab *s = journal_res_slab(j);
+	unsigned retired_idx = 0;
+	u64 retired_seq = 0;
+	bool retired = false, ret = false;
+
+	if ((flags & BCH_WATERMARK_MASK) < j->watermark)
+		return false;
+
+	spin_lock(&s->lock);
+	if (s->open &&
+	    s->end - s->offset < res->u64s) {
+		retired_idx	= s->idx;
+		retired_seq	= s->seq;
+		retired		= journal_res_slab_retire(j, s);
+	}
+
+	if (!s->open &&
+	    !journal_res_slab_refill(j, s, flags))
+		goto out;
+
+	ret = true;
+	if (flags & JOURNAL_RES_GET_CHECK)
+		goto out;
+
+	res->ref	= true;
+	res->idx	= s->idx;
+	res->slab	= s - j->res_slabs + 1;
+	res->offset	= s->offset;
+	res->seq	= s->seq;
+
+	s->offset += res->u64s;
+	atomic_inc(&s->ref[s->idx]);
+out:
+	spin_unlock(&s->lock);
+
+	if (retired)
+		bch2_journal_res_slab_put(j, s, retired_idx, retired_seq, false);
+	return ret;
+}
+
+/* When closing a journal entry, slabs give back what they haven't used: */
+static void journal_res_slabs_retire(struct journal *j, unsigned idx)
+{
+	lockdep_assert_held(&j->lock);
+
+	for (struct journal_res_slab *s = j->res_slabs;
+	     s < j->res_slabs + ARRAY_SIZE(j->res_slabs);
+	     s++) {
+		u64 seq = 0;
+		bool retired = false;
+
+		spin_lock(&s->lock);
+		if (s->open && s->idx == idx) {
+			seq	= s->seq;
+			retired	= journal_res_slab_retire(j, s);
+		}
+		spin_unlock(&s->lock);
+
+		if (retired)
+			bch2_journal_res_slab_put(j, s, idx, seq, true);
+	}
+}
+
 /*
  * Returns true if journal entry is now closed:
  *
@@ -298,6 +451,7 @@ static void __journal_entry_close(struct journal *j, unsigned closed_val, bool t
 
 	bch2_journal_space_available(j);
 
+	journal_res_slabs_retire(j, old.idx);
 	__bch2_journal_buf_put(j, old.idx, le64_to_cpu(buf->data->seq));
 }
 
@@ -411,6 +565,7 @@ static int journal_entry_open(struct journal *j)
 	buf->must_flush		= false;
 	buf->separate_flush	= false;
 	buf->flush_time		= 0;
+	buf->nr_flush_waiters	= 0;
 	buf->need_flush_to_write_buffer = true;
 	buf->write_started	= false;
 	buf->write_allocated	= false;
@@ -738,13 +893,69 @@ recheck_need_open:
 	if (parent && !closure_wait(&buf->wait, parent))
 		BUG();
 want_write:
-	if (seq == journal_cur_seq(j))
+	/* Don't close it if a group commit is gathering fsyncs: */
+	if (seq == journal_cur_seq(j) &&
+	    seq != j->group_commit_seq)
 		journal_entry_want_write(j);
 out:
 	spin_unlock(&j->lock);
 	return ret;
 }
 
+/*
+ * Adaptive group commit:
+ *
+ * With fsyncs coming in from many threads, a flush issued as soon as the first
+ * fsync arrives only covers that one, and the rest wait for the next flush
+ * write. If we've been seeing multiple fsyncs per flush write, the first fsync
+ * to arrive holds the journal entry open for up to the average flush write
+ * latency, capped by journal_group_commit_target, so that the others can join:
+ */
+static u64 journal_group_commit_window(struct journal *j)
+{
+	struct bch_fs *c = container_of(j, struct bch_fs, journal);
+	u64 target = (u64) c->opts.journal_group_commit_target * NSEC_PER_USEC;
+
+	if (!target ||
+	    READ_ONCE(j->flush_waiters_avg) <= 1U << JOURNAL_FLUSH_WAITERS_SHIFT)
+		return 0;
+
+	s64 mean = mean_and_variance_weighted_get_mean(j->flush_write_time->duration_stats_weighted,
+						       TIME_STATS_MV_WEIGHT);
+	return clamp_t(s64, mean, 0, target);
+}
+
+static void journal_group_commit(struct journal *j, u64 seq)
+{
+	u64 window = journal_group_commit_window(j);
+	bool leader = false;
+
+	spin_lock(&j->lock);
+	seq = max(seq, journal_last_unwritten_seq(j));
+	if (seq <= journal_cur_seq(j))
+		journal_seq_to_buf(j, seq)->nr_flush_waiters++;
+
+	/* Only if we'd otherwise be kicking off a new write: */
+	if (window &&
+	    seq == journal_cur_seq(j) &&
+	    seq == journal_last_unwritten_seq(j) &&
+	    journal_entry_is_open(j) &&
+	    seq != j->group_commit_seq) {
+		j->group_commit_seq = seq;
+		leader = true;
+	}
+	spin_unlock(&j->lock);
+
+	if (!leader)
+		return;
+
+	fsleep(div_u64(window, NSEC_PER_USEC) ?: 1);
+
+	spin_lock(&j->lock);
+	j->group_commit_seq = 0;
+	spin_unlock(&j->lock);
+}
+
 int bch2_journal_flush_seq(struct journal *j, u64 seq)
 {
 	u64 start_time = local_clock();
@@ -756,6 +967,8 @@ int bch2_journal_flush_seq(struct journal *j, u64 seq)
 	if (seq <= j->flushed_seq_ondisk)
 		return 0;
 
+	journal_group_commit(j, seq);
+
 	ret = wait_event_interruptible(j->wait, (ret2 = bch2_journal_flush_seq_async(j, seq, NULL)));
 
 	if (!ret)
@@ -1360,6 +1573,7 @@ void bch2_fs_journal_exit(struct journal *j)
 
 	for (unsigned i = 0; i < ARRAY_SIZE(j->buf); i++)
 		kvfree(j->buf[i].data);
+	kvfree(j->compress_buf);
 	free_fifo(&j->pin);
 }
 
@@ -1368,6 +1582,8 @@ int bch2_fs_journal_init(struct journal *j)
 	static struct lock_class_key res_key;
 
 	mutex_init(&j->buf_lock);
+	for (unsigned i = 0; i < ARRAY_SIZE(j->res_slabs); i++)
+		spin_lock_init(&j->res_slabs[i].lock);
 	spin_lock_init(&j->lock);
 	spin_lock_init(&j->err_lock);
 	init_waitqueue_head(&j->wait);
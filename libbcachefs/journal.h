@@ -288,6 +288,9 @@ static inline void bch2_journal_buf_put(struct journal *j, unsigned idx, u64 seq
 	}
 }
 
+void bch2_journal_res_slab_put(struct journal *, struct journal_res_slab *,
+			       unsigned, u64, bool);
+
 /*
  * This function releases the journal write structure so other threads can
  * then proceed to add their keys as well.
@@ -305,7 +308,11 @@ static inline void bch2_journal_res_put(struct journal *j,
 				       BCH_JSET_ENTRY_btree_keys,
 				       0, 0, 0);
 
-	bch2_journal_buf_put(j, res->idx, res->seq);
+	if (res->slab)
+		bch2_journal_res_slab_put(j, j->res_slabs + res->slab - 1,
+					  res->idx, res->seq, false);
+	else
+		bch2_journal_buf_put(j, res->idx, res->seq);
 
 	res->ref = 0;
 }
@@ -322,12 +329,18 @@ enum journal_res_flags {
 #define JOURNAL_RES_GET_NONBLOCK	(1 << __JOURNAL_RES_GET_NONBLOCK)
 #define JOURNAL_RES_GET_CHECK		(1 << __JOURNAL_RES_GET_CHECK)
 
+bool bch2_journal_res_get_slab(struct journal *, struct journal_res *, unsigned);
+
 static inline int journal_res_get_fast(struct journal *j,
 				       struct journal_res *res,
 				       unsigned flags)
 {
 	union journal_res_state old, new;
 
+	if (res->u64s <= JOURNAL_RES_SLAB_MAX_RES &&
+	    bch2_journal_res_get_slab(j, res, flags))
+		return 1;
+
 	old.v = atomic64_read(&j->reservations.counter);
 	do {
 		new.v = old.v;
@@ -361,6 +374,7 @@ static inline int journal_res_get_fast(struct journal *j,
 
 	res->ref	= true;
 	res->idx	= old.idx;
+	res->slab	= 0;
 	res->offset	= old.cur_entry_offset;
 	res->seq	= le64_to_cpu(j->buf[old.idx].data->seq);
 	return 1;
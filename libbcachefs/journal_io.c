@@ -7,6 +7,7 @@
 #include "btree_write_buffer.h"
 #include "buckets.h"
 #include "checksum.h"
+#include "compress.h"
 #include "disk_groups.h"
 #include "error.h"
 #include "journal.h"
@@ -857,6 +858,62 @@ void bch2_journal_entry_to_text(struct printbuf *out, struct bch_fs *c,
 	}
 }
 
+void bch2_journal_entry_stats_account(struct journal_entry_stats *s,
+				      struct jset *jset)
+{
+	s->nr_jsets++;
+	s->jset_bytes += vstruct_bytes(jset);
+
+	vstruct_for_each(jset, entry) {
+		unsigned bytes = vstruct_bytes(entry);
+
+		if (!entry->u64s || entry->type >= BCH_JSET_ENTRY_NR)
+			continue;
+
+		s->type_bytes[entry->type] += bytes;
+
+		if (entry->type == BCH_JSET_ENTRY_btree_keys &&
+		    entry->btree_id < BTREE_ID_NR)
+			s->btree_keys_bytes[entry->btree_id] += bytes;
+	}
+}
+
+void bch2_journal_entry_stats_to_text(struct printbuf *out,
+				      struct journal_entry_stats *s)
+{
+	printbuf_tabstop_push(out, 24);
+	printbuf_tabstop_push(out, 16);
+
+	prt_printf(out, "jsets:\t%llu\r\n", s->nr_jsets);
+	prt_printf(out, "bytes:\t");
+	prt_human_readable_u64(out, s->jset_bytes);
+	prt_printf(out, "\r\n");
+
+	for (unsigned i = 0; i < BCH_JSET_ENTRY_NR; i++) {
+		if (!s->type_bytes[i])
+			continue;
+
+		bch2_prt_jset_entry_type(out, i);
+		prt_tab(out);
+		prt_human_readable_u64(out, s->type_bytes[i]);
+		prt_printf(out, "\r\n");
+
+		if (i != BCH_JSET_ENTRY_btree_keys)
+			continue;
+
+		printbuf_indent_add(out, 2);
+		for (unsigned btree = 0; btree < BTREE_ID_NR; btree++) {
+			if (!s->btree_keys_bytes[btree])
+				continue;
+
+			prt_printf(out, "%s\t", bch2_btree_id_str(btree));
+			prt_human_readable_u64(out, s->btree_keys_bytes[btree]);
+			prt_printf(out, "\r\n");
+		}
+		printbuf_indent_sub(out, 2);
+	}
+}
+
 static int jset_validate_entries(struct bch_fs *c, struct jset *jset,
 				 enum bch_validate_flags flags)
 {
@@ -977,8 +1034,15 @@ fsck_err:
 struct journal_read_buf {
 	void		*data;
 	size_t		size;
+
+	/* read of the start of the next bucket, issued ahead of time: */
+	struct bio	*bio;
+	struct completion done;
 };
 
+/* Number of buckets per device we keep reads in flight for: */
+#define JOURNAL_READ_DEPTH	4
+
 static int journal_read_buf_realloc(struct journal_read_buf *b,
 				    size_t new_size)
 {
@@ -999,6 +1063,183 @@ static int journal_read_buf_realloc(struct journal_read_buf *b,
 	return 0;
 }
 
+/*
+ * Returns a newly allocated, uncompressed copy of a compressed jset; the
+ * header (and checksum) is that of the version on disk:
+ */
+static int jset_uncompress(struct bch_fs *c, struct jset *j, struct jset **ret_j)
+{
+	struct jset_compressed *src = (void *) j->start;
+	size_t u64s, bytes;
+
+	if (vstruct_bytes(j) < sizeof(*j) + sizeof(*src))
+		return -EIO;
+
+	u64s	= le32_to_cpu(src->u64s);
+	bytes	= le32_to_cpu(src->bytes);
+
+	if (bytes > vstruct_bytes(j) - sizeof(*j) - sizeof(*src) ||
+	    sizeof(*j) + u64s * sizeof(u64) > JOURNAL_ENTRY_SIZE_MAX)
+		return -EIO;
+
+	struct jset *n = kvmalloc(sizeof(*j) + u64s * sizeof(u64), GFP_KERNEL);
+	if (!n)
+		return -BCH_ERR_ENOMEM_journal_uncompress;
+
+	*n = *j;
+
+	int ret = bch2_uncompress_buf(c, JSET_COMPRESSION_TYPE(j),
+				      n->start, u64s * sizeof(u64),
+				      src->data, bytes);
+	if (ret) {
+		kvfree(n);
+		return ret;
+	}
+
+	n->u64s = cpu_to_le32(u64s);
+	SET_JSET_COMPRESSION_TYPE(n, 0);
+	*ret_j = n;
+	return 0;
+}
+
+/*
+ * For tools that walk the journal directly instead of going through
+ * bch2_journal_read(): check the checksum of, decrypt, decompress and validate
+ * a jset that's been read into memory. *ret_j is either @j or a newly
+ * allocated uncompressed copy, which the caller must kvfree():
+ */
+int bch2_journal_jset_read(struct bch_fs *c, struct bch_dev *ca,
+			   struct jset *j, u64 sector,
+			   struct jset **ret_j, bool *csum_good)
+{
+	struct bch_csum csum;
+	int ret;
+
+	*ret_j = j;
+
+	if (le64_to_cpu(j->magic) != jset_magic(c))
+		return -EINVAL;
+
+	*csum_good = jset_csum_good(c, j, &csum);
+
+	ret = bch2_encrypt(c, JSET_CSUM_TYPE(j), journal_nonce(j),
+			   j->encrypted_start,
+			   vstruct_end(j) - (void *) j->encrypted_start);
+	if (ret)
+		return ret;
+
+	if (JSET_COMPRESSION_TYPE(j)) {
+		ret = jset_uncompress(c, j, ret_j);
+		if (ret)
+			return ret;
+	}
+
+	ret = jset_validate(c, ca, *ret_j, sector, READ);
+	if (ret < 0) {
+		if (*ret_j != j)
+			kvfree(*ret_j);
+		*ret_j = j;
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Compress the entries of a jset we're about to write, in place - only if it
+ * saves space on disk:
+ */
+static void jset_compress(struct bch_fs *c, struct jset *jset)
+{
+	struct journal *j = &c->journal;
+	size_t src_bytes = vstruct_bytes(jset) - sizeof(*jset);
+	size_t dst_bytes = src_bytes - sizeof(struct jset_compressed);
+	unsigned sectors = vstruct_sectors(jset, c->block_bits);
+
+	lockdep_assert_held(&j->buf_lock);
+
+	if (src_bytes <= block_bytes(c))
+		return;
+
+	if (j->compress_buf_size < src_bytes) {
+		void *n = kvmalloc(roundup_pow_of_two(src_bytes), GFP_NOFS);
+		if (!n)
+			return;
+
+		kvfree(j->compress_buf);
+		j->compress_buf		= n;
+		j->compress_buf_size	= roundup_pow_of_two(src_bytes);
+	}
+
+	struct jset_compressed *dst = j->compress_buf;
+	unsigned type = bch2_compress_buf(c, c->opts.journal_compression,
+					  dst->data, &dst_bytes,
+					  jset->start, src_bytes);
+	if (!type)
+		return;
+
+	size_t u64s = DIV_ROUND_UP(sizeof(*dst) + dst_bytes, sizeof(u64));
+
+	if (round_up(sizeof(*jset) + u64s * sizeof(u64), block_bytes(c)) >> 9 >= sectors)
+		return;
+
+	dst->u64s	= jset->u64s;
+	dst->bytes	= cpu_to_le32(dst_bytes);
+	memset(dst->data + dst_bytes, 0, u64s * sizeof(u64) - sizeof(*dst) - dst_bytes);
+	memcpy(jset->start, dst, u64s * sizeof(u64));
+
+	jset->u64s = cpu_to_le32(u64s);
+	SET_JSET_COMPRESSION_TYPE(jset, type);
+}
+
+static void journal_read_endio(struct bio *bio)
+{
+	complete(bio->bi_private);
+}
+
+static void journal_read_submit(struct bch_dev *ca,
+				struct journal_read_buf *buf,
+				u64 offset, unsigned sectors)
+{
+	unsigned nr_bvecs = buf_pages(buf->data, sectors << 9);
+	struct bio *bio = bio_kmalloc(nr_bvecs, GFP_KERNEL);
+
+	bio_init(bio, ca->disk_sb.bdev, bio->bi_inline_vecs, nr_bvecs, REQ_OP_READ);
+	bio->bi_iter.bi_sector	= offset;
+	bio->bi_end_io		= journal_read_endio;
+	bio->bi_private		= &buf->done;
+	bch2_bio_map(bio, buf->data, sectors << 9);
+
+	init_completion(&buf->done);
+	buf->bio = bio;
+	submit_bio(bio);
+}
+
+static int journal_read_wait(struct journal_read_buf *buf)
+{
+	wait_for_completion(&buf->done);
+
+	int ret = blk_status_to_errno(buf->bio->bi_status);
+	kfree(buf->bio);
+	buf->bio = NULL;
+	return ret;
+}
+
+static inline unsigned journal_read_bucket_sectors(struct bch_dev *ca,
+						   struct journal_read_buf *buf)
+{
+	return min_t(unsigned, ca->mi.bucket_size, buf->size >> 9);
+}
+
+static void journal_read_bucket_prefetch(struct bch_dev *ca,
+					 struct journal_read_buf *buf,
+					 unsigned bucket)
+{
+	journal_read_submit(ca, buf,
+			    bucket_to_sector(ca, ca->journal.buckets[bucket]),
+			    journal_read_bucket_sectors(ca, buf));
+}
+
 static int journal_read_bucket(struct bch_dev *ca,
 			       struct journal_read_buf *buf,
 			       struct journal_list *jlist,
@@ -1018,21 +1259,20 @@ static int journal_read_bucket(struct bch_dev *ca,
 
 	while (offset < end) {
 		if (!sectors_read) {
-			struct bio *bio;
-			unsigned nr_bvecs;
 reread:
 			sectors_read = min_t(unsigned,
 				end - offset, buf->size >> 9);
-			nr_bvecs = buf_pages(buf->data, sectors_read << 9);
-
-			bio = bio_kmalloc(nr_bvecs, GFP_KERNEL);
-			bio_init(bio, ca->disk_sb.bdev, bio->bi_inline_vecs, nr_bvecs, REQ_OP_READ);
 
-			bio->bi_iter.bi_sector = offset;
-			bch2_bio_map(bio, buf->data, sectors_read << 9);
+			/*
+			 * The start of the bucket may have already been read
+			 * by journal_read_bucket_prefetch():
+			 */
+			if (!buf->bio)
+				journal_read_submit(ca, buf, offset, sectors_read);
+			else
+				BUG_ON(sectors_read != journal_read_bucket_sectors(ca, buf));
 
-			ret = submit_bio_wait(bio);
-			kfree(bio);
+			ret = journal_read_wait(buf);
 
 			if (bch2_dev_io_err_on(ret, ca, BCH_MEMBER_ERROR_read,
 					       "journal read error: sector %llu",
@@ -1113,6 +1353,20 @@ reread:
 			     vstruct_end(j) - (void *) j->encrypted_start);
 		bch2_fs_fatal_err_on(ret, c, "decrypting journal entry: %s", bch2_err_str(ret));
 
+		struct jset *uncompressed = NULL;
+		if (JSET_COMPRESSION_TYPE(j)) {
+			ret = jset_uncompress(c, j, &uncompressed);
+			if (bch2_err_matches(ret, ENOMEM))
+				goto err;
+			if (ret) {
+				bch_err_dev_offset(ca, offset,
+						   "journal entry seq %llu: error decompressing",
+						   le64_to_cpu(j->seq));
+				saw_bad = true;
+				goto next_block;
+			}
+		}
+
 		mutex_lock(&jlist->lock);
 		ret = journal_entry_add(c, ca, (struct journal_ptr) {
 					.csum_good	= csum_good,
@@ -1121,8 +1375,9 @@ reread:
 					.bucket_offset	= offset -
 						bucket_to_sector(ca, ja->buckets[bucket]),
 					.sector		= offset,
-					}, jlist, j);
+					}, jlist, uncompressed ?: j);
 		mutex_unlock(&jlist->lock);
+		kvfree(uncompressed);
 
 		switch (ret) {
 		case JOURNAL_ENTRY_ADD_OK:
@@ -1153,23 +1408,37 @@ static CLOSURE_CALLBACK(bch2_journal_read_device)
 	struct bch_fs *c = ca->fs;
 	struct journal_list *jlist =
 		container_of(cl->parent, struct journal_list, cl);
-	struct journal_read_buf buf = { NULL, 0 };
+	struct journal_read_buf buf[JOURNAL_READ_DEPTH] = {};
 	unsigned i;
 	int ret = 0;
 
 	if (!ja->nr)
 		goto out;
 
-	ret = journal_read_buf_realloc(&buf, PAGE_SIZE);
-	if (ret)
-		goto err;
+	for (i = 0; i < ARRAY_SIZE(buf); i++) {
+		ret = journal_read_buf_realloc(&buf[i], PAGE_SIZE);
+		if (ret)
+			goto err;
+	}
 
 	pr_debug("%u journal buckets", ja->nr);
 
+	/*
+	 * Keep reads of the next few buckets in flight while we're validating
+	 * the current one:
+	 */
+	for (i = 0; i < min_t(unsigned, ja->nr, ARRAY_SIZE(buf)); i++)
+		journal_read_bucket_prefetch(ca, &buf[i], i);
+
 	for (i = 0; i < ja->nr; i++) {
-		ret = journal_read_bucket(ca, &buf, jlist, i);
+		struct journal_read_buf *b = &buf[i % ARRAY_SIZE(buf)];
+
+		ret = journal_read_bucket(ca, b, jlist, i);
 		if (ret)
 			goto err;
+
+		if (i + ARRAY_SIZE(buf) < ja->nr)
+			journal_read_bucket_prefetch(ca, b, i + ARRAY_SIZE(buf));
 	}
 
 	/*
@@ -1181,7 +1450,11 @@ static CLOSURE_CALLBACK(bch2_journal_read_device)
 		ja->dirty_idx = (ja->cur_idx + 1) % ja->nr;
 out:
 	bch_verbose(c, "journal read done on device %s, ret %i", ca->name, ret);
-	kvfree(buf.data);
+	for (i = 0; i < ARRAY_SIZE(buf); i++) {
+		if (buf[i].bio)
+			journal_read_wait(&buf[i]);
+		kvfree(buf[i].data);
+	}
 	percpu_ref_put(&ca->io_ref);
 	closure_return(cl);
 	return;
@@ -1192,6 +1465,93 @@ err:
 	goto out;
 }
 
+/*
+ * Full validation of every key in the journal is independent per entry, and
+ * is most of the CPU time of journal read - do it on multiple threads:
+ */
+#define JOURNAL_VALIDATE_PARTS		8
+#define JOURNAL_VALIDATE_PART_MIN	32
+
+struct journal_validate_part {
+	struct closure		cl;
+	struct bch_fs		*c;
+	struct journal_replay	**start, **end;
+	int			ret;
+};
+
+static int journal_validate_entries(struct bch_fs *c,
+				    struct journal_replay **start,
+				    struct journal_replay **end)
+{
+	for (struct journal_replay **_i = start; _i < end; _i++) {
+		struct journal_replay *i = *_i;
+		int ret = jset_validate(c,
+				bch2_dev_have_ref(c, i->ptrs.data[0].dev),
+				&i->j,
+				i->ptrs.data[0].sector,
+				READ);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static CLOSURE_CALLBACK(journal_validate_part_work)
+{
+	closure_type(p, struct journal_validate_part, cl);
+
+	p->ret = journal_validate_entries(p->c, p->start, p->end);
+	closure_return(cl);
+}
+
+static int journal_validate_all(struct bch_fs *c)
+{
+	struct journal_validate_part parts[JOURNAL_VALIDATE_PARTS];
+	DARRAY(struct journal_replay *) entries = {};
+	struct genradix_iter radix_iter;
+	struct journal_replay **_i;
+	struct closure cl;
+	unsigned nr_parts;
+	int ret = 0;
+
+	genradix_for_each(&c->journal_entries, radix_iter, _i)
+		if (!journal_replay_ignore(*_i)) {
+			ret = darray_push(&entries, *_i);
+			if (ret)
+				goto err;
+		}
+
+	nr_parts = clamp_t(size_t, entries.nr / JOURNAL_VALIDATE_PART_MIN,
+			   1, ARRAY_SIZE(parts));
+
+	closure_init_stack(&cl);
+
+	for (unsigned i = 0; i < nr_parts; i++) {
+		struct journal_validate_part *p = &parts[i];
+
+		memset(p, 0, sizeof(*p));
+		p->c		= c;
+		p->start	= entries.data + entries.nr * i / nr_parts;
+		p->end		= entries.data + entries.nr * (i + 1) / nr_parts;
+
+		if (i)
+			closure_call(&p->cl, journal_validate_part_work,
+				     system_unbound_wq, &cl);
+	}
+
+	parts[0].ret = journal_validate_entries(c, parts[0].start, parts[0].end);
+
+	if (nr_parts > 1)
+		closure_sync(&cl);
+
+	for (unsigned i = 0; i < nr_parts; i++)
+		ret = ret ?: parts[i].ret;
+err:
+	darray_exit(&entries);
+	return ret;
+}
+
 int bch2_journal_read(struct bch_fs *c,
 		      u64 *last_seq,
 		      u64 *blacklist_seq,
@@ -1364,6 +1724,10 @@ int bch2_journal_read(struct bch_fs *c,
 		seq++;
 	}
 
+	ret = journal_validate_all(c);
+	if (ret)
+		goto err;
+
 	genradix_for_each(&c->journal_entries, radix_iter, _i) {
 		struct bch_replicas_padded replicas = {
 			.e.data_type = BCH_DATA_journal,
@@ -1384,14 +1748,6 @@ int bch2_journal_read(struct bch_fs *c,
 						   i->csum_good ? " (had good copy on another device)" : "");
 		}
 
-		ret = jset_validate(c,
-				    bch2_dev_have_ref(c, i->ptrs.data[0].dev),
-				    &i->j,
-				    i->ptrs.data[0].sector,
-				    READ);
-		if (ret)
-			goto err;
-
 		darray_for_each(i->ptrs, ptr)
 			replicas.e.devs[replicas.e.nr_devs++] = ptr->dev;
 
@@ -1489,7 +1845,8 @@ static int journal_write_alloc(struct journal *j, struct journal_buf *w)
 	struct bch_dev *ca;
 	struct dev_alloc_list devs_sorted;
 	unsigned sectors = vstruct_sectors(w->data, c->block_bits);
-	unsigned target = c->opts.metadata_target ?:
+	unsigned target = c->opts.journal_target ?:
+		c->opts.metadata_target ?:
 		c->opts.foreground_target;
 	unsigned i, replicas = 0, replicas_want =
 		READ_ONCE(c->opts.metadata_replicas);
@@ -1617,6 +1974,11 @@ static CLOSURE_CALLBACK(journal_write_done)
 		j->err_seq	= seq;
 	w->write_done = true;
 
+	/* Moving average of fsyncs per flush write, for group commit: */
+	if (!JSET_NO_FLUSH(w->data) && w->nr_flush_waiters)
+		j->flush_waiters_avg = (j->flush_waiters_avg * 7 +
+					(w->nr_flush_waiters << JOURNAL_FLUSH_WAITERS_SHIFT)) / 8;
+
 	bool completed = false;
 
 	for (seq = journal_last_unwritten_seq(j);
@@ -1916,10 +2278,24 @@ static int bch2_journal_write_prep(struct journal *j, struct journal_buf *w)
 	if (le32_to_cpu(jset->version) < bcachefs_metadata_version_current)
 		validate_before_checksum = true;
 
+	bch2_journal_entry_stats_account(&j->entry_stats, jset);
+
+	bool compress = c->opts.journal_compression &&
+		(c->sb.features & BIT_ULL(BCH_FEATURE_journal_compression));
+	if (compress)
+		validate_before_checksum = true;
+
 	if (validate_before_checksum &&
 	    (ret = jset_validate(c, NULL, jset, 0, WRITE)))
 		return ret;
 
+	if (compress) {
+		jset_compress(c, jset);
+
+		sectors = vstruct_sectors(jset, c->block_bits);
+		bytes	= vstruct_bytes(jset);
+	}
+
 	ret = bch2_encrypt(c, JSET_CSUM_TYPE(jset), journal_nonce(jset),
 		    jset->encrypted_start,
 		    vstruct_end(jset) - (void *) jset->encrypted_start);
@@ -66,10 +66,16 @@ int bch2_journal_entry_validate(struct bch_fs *, struct jset *,
 				enum bch_validate_flags);
 void bch2_journal_entry_to_text(struct printbuf *, struct bch_fs *,
 				struct jset_entry *);
+void bch2_journal_entry_stats_account(struct journal_entry_stats *,
+				      struct jset *);
+void bch2_journal_entry_stats_to_text(struct printbuf *,
+				      struct journal_entry_stats *);
 
 void bch2_journal_ptrs_to_text(struct printbuf *, struct bch_fs *,
 			       struct journal_replay *);
 
+int bch2_journal_jset_read(struct bch_fs *, struct bch_dev *, struct jset *,
+			   u64, struct jset **, bool *);
 int bch2_journal_read(struct bch_fs *, u64 *, u64 *, u64 *);
 
 CLOSURE_CALLBACK(bch2_journal_write);
@@ -1,10 +1,12 @@
 // SPDX-License-Identifier: GPL-2.0
 
 #include "bcachefs.h"
+#include "alloc_background.h"
 #include "btree_key_cache.h"
 #include "btree_update.h"
 #include "btree_write_buffer.h"
 #include "buckets.h"
+#include "disk_groups.h"
 #include "errcode.h"
 #include "error.h"
 #include "journal.h"
@@ -131,6 +133,31 @@ journal_dev_space_available(struct journal *j, struct bch_dev *ca,
 	};
 }
 
+/*
+ * With journal_target set, journal writes only spill over to other devices
+ * when the target is full: compute available journal space from the target's
+ * devices, so that reclaim runs before that happens and fsyncs stay on the
+ * fast devices:
+ */
+static struct bch_devs_mask journal_space_devs(struct bch_fs *c, unsigned nr_devs_want)
+{
+	struct bch_devs_mask devs = c->rw_devs[BCH_DATA_journal];
+
+	if (c->opts.journal_target) {
+		struct bch_devs_mask t =
+			target_rw_devs(c, BCH_DATA_journal, c->opts.journal_target);
+		unsigned nr = 0;
+
+		for_each_member_device_rcu(c, ca, &t)
+			nr += ca->journal.nr != 0;
+
+		if (nr >= nr_devs_want)
+			devs = t;
+	}
+
+	return devs;
+}
+
 static struct journal_space __journal_space_available(struct journal *j, unsigned nr_devs_want,
 			    enum journal_space_from from)
 {
@@ -141,7 +168,9 @@ static struct journal_space __journal_space_available(struct journal *j, unsigne
 	BUG_ON(nr_devs_want > ARRAY_SIZE(dev_space));
 
 	rcu_read_lock();
-	for_each_member_device_rcu(c, ca, &c->rw_devs[BCH_DATA_journal]) {
+	struct bch_devs_mask devs = journal_space_devs(c, nr_devs_want);
+
+	for_each_member_device_rcu(c, ca, &devs) {
 		if (!ca->journal.nr)
 			continue;
 
@@ -265,11 +294,13 @@ static bool should_discard_bucket(struct journal *j, struct journal_device *ja)
 
 /*
  * Advance ja->discard_idx as long as it points to buckets that are no longer
- * dirty, issuing discards if necessary:
+ * dirty, issuing discards if necessary - all buckets that are ready are
+ * discarded together, so that adjacent journal buckets are merged:
  */
 void bch2_journal_do_discards(struct journal *j)
 {
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
+	darray_u64 buckets = {};
 
 	mutex_lock(&j->discard_lock);
 
@@ -277,16 +308,24 @@ void bch2_journal_do_discards(struct journal *j)
 		struct journal_device *ja = &ca->journal;
 
 		while (should_discard_bucket(j, ja)) {
-			if (!c->opts.nochanges &&
-			    ca->mi.discard &&
-			    bdev_max_discard_sectors(ca->disk_sb.bdev))
-				blkdev_issue_discard(ca->disk_sb.bdev,
-					bucket_to_sector(ca,
-						ja->buckets[ja->discard_idx]),
-					ca->mi.bucket_size, GFP_NOFS);
+			unsigned idx, end;
 
 			spin_lock(&j->lock);
-			ja->discard_idx = (ja->discard_idx + 1) % ja->nr;
+			end = ja->dirty_idx_ondisk;
+			spin_unlock(&j->lock);
+
+			buckets.nr = 0;
+			for (idx = ja->discard_idx; idx != end; idx = (idx + 1) % ja->nr)
+				if (darray_push(&buckets, ja->buckets[idx]))
+					break;
+
+			if (idx == ja->discard_idx)
+				break;
+
+			bch2_dev_discard_buckets(ca, buckets.data, buckets.nr);
+
+			spin_lock(&j->lock);
+			ja->discard_idx = idx;
 
 			bch2_journal_space_available(j);
 			spin_unlock(&j->lock);
@@ -294,6 +333,7 @@ void bch2_journal_do_discards(struct journal *j)
 	}
 
 	mutex_unlock(&j->discard_lock);
+	darray_exit(&buckets);
 }
 
 /*
@@ -481,6 +521,17 @@ void bch2_journal_pin_flush(struct journal *j, struct journal_entry_pin *pin)
  * data off of a specific device:
  */
 
+/*
+ * Within a sequence number, flush key cache and write buffer pins before btree
+ * node pins: flushing them dirties btree nodes, which then get written once
+ * instead of once for the btree node pin and again for the updates:
+ */
+static const u8 journal_pin_flush_order[] = {
+	JOURNAL_PIN_key_cache,
+	JOURNAL_PIN_other,
+	JOURNAL_PIN_btree,
+};
+
 static struct journal_entry_pin *
 journal_get_next_pin(struct journal *j,
 		     u64 seq_to_flush,
@@ -490,13 +541,16 @@ journal_get_next_pin(struct journal *j,
 {
 	struct journal_entry_pin_list *pin_list;
 	struct journal_entry_pin *ret = NULL;
-	unsigned i;
+
+	BUILD_BUG_ON(ARRAY_SIZE(journal_pin_flush_order) != JOURNAL_PIN_NR);
 
 	fifo_for_each_entry_ptr(pin_list, &j->pin, *seq) {
 		if (*seq > seq_to_flush && !allowed_above_seq)
 			break;
 
-		for (i = 0; i < JOURNAL_PIN_NR; i++)
+		for (unsigned o = 0; o < ARRAY_SIZE(journal_pin_flush_order); o++) {
+			unsigned i = journal_pin_flush_order[o];
+
 			if ((((1U << i) & allowed_below_seq) && *seq <= seq_to_flush) ||
 			    ((1U << i) & allowed_above_seq)) {
 				ret = list_first_entry_or_null(&pin_list->list[i],
@@ -504,6 +558,7 @@ journal_get_next_pin(struct journal *j,
 				if (ret)
 					return ret;
 			}
+		}
 	}
 
 	return NULL;
@@ -13,6 +13,17 @@
 #define JOURNAL_BUF_NR		(1U << JOURNAL_BUF_BITS)
 #define JOURNAL_BUF_MASK	(JOURNAL_BUF_NR - 1)
 
+/*
+ * Bytes written to the journal, broken out by jset_entry type (and for
+ * btree_keys entries, by btree), including the jset_entry header:
+ */
+struct journal_entry_stats {
+	u64			nr_jsets;
+	u64			jset_bytes;
+	u64			type_bytes[BCH_JSET_ENTRY_NR];
+	u64			btree_keys_bytes[BTREE_ID_NR];
+};
+
 /*
  * We put JOURNAL_BUF_NR of these in struct journal; we used them for writes to
  * the journal that are being staged or in flight.
@@ -34,6 +45,7 @@ struct journal_buf {
 	unsigned		disk_sectors;	/* maximum size entry could have been, if
 						   buf_size was bigger */
 	unsigned		u64s_reserved;
+	unsigned		nr_flush_waiters; /* fsyncs waiting on this entry */
 	bool			noflush:1;	/* write has already been kicked off, and was noflush */
 	bool			must_flush:1;	/* something wants a flush */
 	bool			separate_flush:1;
@@ -77,6 +89,7 @@ struct journal_entry_pin {
 struct journal_res {
 	bool			ref;
 	u8			idx;
+	u8			slab;	/* journal_res_slab + 1, if from a slab */
 	u16			u64s;
 	u32			offset;
 	u64			seq;
@@ -102,6 +115,26 @@ union journal_res_state {
 	};
 };
 
+/*
+ * Small reservations are handed out from per-cpu (in userspace, per thread
+ * shard) slabs, so that they don't all cmpxchg j->reservations: each slab
+ * holds one ref on a journal buf and a range of it, and counts the refs of
+ * the reservations it hands out.
+ */
+#define JOURNAL_RES_SLABS		16
+#define JOURNAL_RES_SLAB_U64S		128
+#define JOURNAL_RES_SLAB_MAX_RES	32
+
+struct journal_res_slab {
+	spinlock_t		lock;
+	bool			open;
+	u8			idx;
+	u32			offset;
+	u32			end;
+	u64			seq;
+	atomic_t		ref[JOURNAL_BUF_NR];
+} ____cacheline_aligned_in_smp;
+
 /* bytes: */
 #define JOURNAL_ENTRY_SIZE_MIN		(64U << 10) /* 64k */
 #define JOURNAL_ENTRY_SIZE_MAX		(4U  << 20) /* 4M */
@@ -207,6 +240,13 @@ struct journal {
 	 * and the journal write path:
 	 */
 	struct mutex		buf_lock;
+
+	struct journal_res_slab	res_slabs[JOURNAL_RES_SLABS];
+
+	/* Scratch space for compressing journal writes, protected by buf_lock: */
+	void			*compress_buf;
+	size_t			compress_buf_size;
+
 	/*
 	 * Two journal entries -- one is currently open for new entries, the
 	 * other is possibly being written out.
@@ -288,11 +328,18 @@ struct journal {
 
 	unsigned long		last_flush_write;
 
+	/* Group commit: */
+	u64			group_commit_seq;
+#define JOURNAL_FLUSH_WAITERS_SHIFT	8
+	unsigned		flush_waiters_avg;
+
 	u64			write_start_time;
 
 	u64			nr_flush_writes;
 	u64			nr_noflush_writes;
 	u64			entry_bytes_written;
+	/* protected by buf_lock: */
+	struct journal_entry_stats entry_stats;
 
 	struct bch2_time_stats	*flush_write_time;
 	struct bch2_time_stats	*noflush_write_time;
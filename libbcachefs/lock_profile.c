@@ -0,0 +1,241 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "bcachefs.h"
+#include "btree_cache.h"
+#include "lock_profile.h"
+
+static const char * const bch2_lock_classes[] = {
+#define x(n)	#n,
+	BCH_LOCK_CLASSES()
+#undef x
+	NULL
+};
+
+/*
+ * Per call site: a small table, where a new site replaces the one that's been
+ * contended least - good enough to find the hot ones:
+ */
+static void lock_profile_site_add(struct bch_fs *c, enum bch_lock_class class,
+				  enum btree_id btree, unsigned level,
+				  u64 wait_ns, unsigned long ip)
+{
+	struct bch_lock_profile *p = &c->lock_profile;
+
+	if (!mutex_trylock(&p->sites_lock))
+		return;
+
+	struct bch_lock_profile_site *site = NULL, *min = p->sites;
+
+	for (struct bch_lock_profile_site *i = p->sites;
+	     i < p->sites + ARRAY_SIZE(p->sites);
+	     i++) {
+		if (i->ip == ip &&
+		    i->class == class &&
+		    i->btree_id == btree &&
+		    i->level == level) {
+			site = i;
+			break;
+		}
+		if (i->contended < min->contended)
+			min = i;
+	}
+
+	if (!site) {
+		site = min;
+		memset(site, 0, sizeof(*site));
+		site->ip	= ip;
+		site->class	= class;
+		site->btree_id	= btree;
+		site->level	= level;
+	}
+
+	site->contended++;
+	site->wait_ns += wait_ns;
+
+	mutex_unlock(&p->sites_lock);
+}
+
+noinline
+void bch2_lock_profile_contended(struct bch_fs *c, enum bch_lock_class class,
+				 u64 start, unsigned long ip)
+{
+	u64 now = local_clock();
+	u64 wait_ns = time_after64(now, start) ? now - start : 0;
+
+	if (!bch2_lock_profiling(c))
+		return;
+
+	u64 *v = this_cpu_ptr(c->lock_profile.pcpu)->classes[class];
+
+	/* preemption isn't disabled, but these are only statistics: */
+	v[BCH_LOCK_PROFILE_acquired]++;
+	v[BCH_LOCK_PROFILE_contended]++;
+	v[BCH_LOCK_PROFILE_wait_ns] += wait_ns;
+
+	lock_profile_site_add(c, class, 0, 0, wait_ns, ip);
+}
+
+noinline
+void bch2_btree_lock_profile_contended(struct bch_fs *c, enum btree_id btree,
+				       bool cached, unsigned level,
+				       enum six_lock_type type,
+				       u64 wait_ns, unsigned long ip)
+{
+	if (!bch2_lock_profiling(c) || btree >= BTREE_ID_NR)
+		return;
+
+	level = bch2_lock_profile_level(cached, level);
+
+	u64 *v = this_cpu_ptr(c->lock_profile.pcpu)->btree[btree][level][type];
+
+	v[BCH_LOCK_PROFILE_contended]++;
+	v[BCH_LOCK_PROFILE_wait_ns] += wait_ns;
+
+	lock_profile_site_add(c, (enum bch_lock_class) type, btree, level, wait_ns, ip);
+}
+
+void bch2_lock_profile_reset(struct bch_fs *c)
+{
+	struct bch_lock_profile *p = &c->lock_profile;
+	int cpu;
+
+	if (!p->pcpu)
+		return;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(p->pcpu, cpu), 0, sizeof(struct bch_lock_profile_pcpu));
+
+	mutex_lock(&p->sites_lock);
+	memset(p->sites, 0, sizeof(p->sites));
+	mutex_unlock(&p->sites_lock);
+}
+
+static void lock_profile_stats_to_text(struct printbuf *out, u64 *v)
+{
+	prt_printf(out, "\r%llu\r%llu\r", v[BCH_LOCK_PROFILE_acquired], v[BCH_LOCK_PROFILE_contended]);
+	bch2_pr_time_units(out, v[BCH_LOCK_PROFILE_wait_ns]);
+	prt_str(out, "\r");
+	if (v[BCH_LOCK_PROFILE_hold_ns])
+		bch2_pr_time_units(out, v[BCH_LOCK_PROFILE_hold_ns]);
+	prt_str(out, "\r\n");
+}
+
+static void lock_profile_level_to_text(struct printbuf *out, unsigned level)
+{
+	if (level == BTREE_MAX_DEPTH)
+		prt_str(out, "key cache");
+	else
+		prt_printf(out, "level %u", level);
+}
+
+void bch2_lock_profile_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	struct bch_lock_profile *p = &c->lock_profile;
+	struct bch_lock_profile_pcpu *sum;
+	int cpu;
+
+	if (!p->pcpu) {
+		prt_str(out, "(lock_profiling option not enabled)\n");
+		return;
+	}
+
+	sum = kvzalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum) {
+		prt_str(out, "(memory allocation failure)\n");
+		return;
+	}
+
+	for_each_possible_cpu(cpu) {
+		u64 *src = (u64 *) per_cpu_ptr(p->pcpu, cpu);
+		u64 *dst = (u64 *) sum;
+
+		for (unsigned i = 0; i < sizeof(*sum) / sizeof(u64); i++)
+			dst[i] += src[i];
+	}
+
+	/* btree node lock totals, by lock type: */
+	for (unsigned btree = 0; btree < BTREE_ID_NR; btree++)
+		for (unsigned level = 0; level < BCH_LOCK_PROFILE_LEVELS; level++)
+			for (unsigned type = 0; type < 3; type++)
+				for (unsigned i = 0; i < BCH_LOCK_PROFILE_STAT_NR; i++)
+					sum->classes[type][i] += sum->btree[btree][level][type][i];
+
+	printbuf_tabstops_reset(out);
+	printbuf_tabstop_push(out, 32);
+	printbuf_tabstop_push(out, 14);
+	printbuf_tabstop_push(out, 12);
+	printbuf_tabstop_push(out, 12);
+	printbuf_tabstop_push(out, 12);
+
+	prt_printf(out, "class\racquired\rcontended\rwait\rhold\r\n");
+	for (unsigned class = 0; class < BCH_LOCK_CLASS_NR; class++) {
+		prt_str(out, bch2_lock_classes[class]);
+		lock_profile_stats_to_text(out, sum->classes[class]);
+	}
+	prt_newline(out);
+
+	prt_printf(out, "btree node locks:\n");
+	for (unsigned btree = 0; btree < BTREE_ID_NR; btree++)
+		for (unsigned level = 0; level < BCH_LOCK_PROFILE_LEVELS; level++)
+			for (unsigned type = 0; type < 3; type++) {
+				u64 *v = sum->btree[btree][level][type];
+
+				if (!v[BCH_LOCK_PROFILE_acquired] &&
+				    !v[BCH_LOCK_PROFILE_contended])
+					continue;
+
+				prt_printf(out, "%s ", bch2_btree_id_str(btree));
+				lock_profile_level_to_text(out, level);
+				prt_printf(out, " %s", bch2_lock_classes[type] + strlen("btree_node_"));
+				lock_profile_stats_to_text(out, v);
+			}
+	prt_newline(out);
+
+	prt_printf(out, "most contended call sites:\n");
+	mutex_lock(&p->sites_lock);
+	for (struct bch_lock_profile_site *i = p->sites;
+	     i < p->sites + ARRAY_SIZE(p->sites);
+	     i++) {
+		if (!i->contended)
+			continue;
+
+		prt_printf(out, "%pS %s", (void *) i->ip, bch2_lock_classes[i->class]);
+		if (i->class <= BCH_LOCK_btree_node_write) {
+			prt_printf(out, " %s ", bch2_btree_id_str(i->btree_id));
+			lock_profile_level_to_text(out, i->level);
+		}
+		prt_printf(out, ": %llu, ", i->contended);
+		bch2_pr_time_units(out, i->wait_ns);
+		prt_newline(out);
+	}
+	mutex_unlock(&p->sites_lock);
+
+	kvfree(sum);
+}
+
+void bch2_fs_lock_profile_exit(struct bch_fs *c)
+{
+	free_percpu(c->lock_profile.pcpu);
+}
+
+/* Called at startup and when the lock_profiling option is turned on: */
+int bch2_fs_lock_profile_init(struct bch_fs *c)
+{
+	struct bch_lock_profile_pcpu __percpu *pcpu;
+
+	if (!c->opts.lock_profiling || c->lock_profile.pcpu)
+		return 0;
+
+	pcpu = alloc_percpu(struct bch_lock_profile_pcpu);
+	if (!pcpu)
+		return -BCH_ERR_ENOMEM_fs_other_alloc;
+
+	if (cmpxchg(&c->lock_profile.pcpu, NULL, pcpu))
+		free_percpu(pcpu);
+	return 0;
+}
+
+void bch2_fs_lock_profile_init_early(struct bch_fs *c)
+{
+	mutex_init(&c->lock_profile.sites_lock);
+}
@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_LOCK_PROFILE_H
+#define _BCACHEFS_LOCK_PROFILE_H
+
+#include "lock_profile_types.h"
+#include "seqmutex.h"
+
+static inline bool bch2_lock_profiling(struct bch_fs *c)
+{
+	return unlikely(c->opts.lock_profiling) && c->lock_profile.pcpu;
+}
+
+static inline unsigned bch2_lock_profile_level(bool cached, unsigned level)
+{
+	return cached ? BTREE_MAX_DEPTH : min(level, BTREE_MAX_DEPTH - 1);
+}
+
+static inline void bch2_lock_profile_acquired(struct bch_fs *c, enum bch_lock_class class)
+{
+	if (bch2_lock_profiling(c))
+		this_cpu_inc(c->lock_profile.pcpu->classes[class][BCH_LOCK_PROFILE_acquired]);
+}
+
+void bch2_lock_profile_contended(struct bch_fs *, enum bch_lock_class,
+				 u64, unsigned long);
+
+static inline void bch2_btree_lock_profile_acquired(struct bch_fs *c,
+						    enum btree_id btree, bool cached,
+						    unsigned level,
+						    enum six_lock_type type)
+{
+	if (bch2_lock_profiling(c) && btree < BTREE_ID_NR)
+		this_cpu_inc(c->lock_profile.pcpu->btree[btree][bch2_lock_profile_level(cached, level)]
+			     [type][BCH_LOCK_PROFILE_acquired]);
+}
+
+static inline void bch2_btree_lock_profile_held(struct bch_fs *c,
+						enum btree_id btree, bool cached,
+						unsigned level,
+						enum six_lock_type type,
+						u64 start)
+{
+	u64 now = local_clock();
+
+	if (bch2_lock_profiling(c) && btree < BTREE_ID_NR &&
+	    start && time_after64(now, start))
+		this_cpu_add(c->lock_profile.pcpu->btree[btree][bch2_lock_profile_level(cached, level)]
+			     [type][BCH_LOCK_PROFILE_hold_ns], now - start);
+}
+
+void bch2_btree_lock_profile_contended(struct bch_fs *, enum btree_id, bool,
+				       unsigned, enum six_lock_type,
+				       u64, unsigned long);
+
+/* seqmutex_lock(), for filesystem wide seqmutexes: */
+static inline void bch2_seqmutex_lock_profiled(struct bch_fs *c, struct seqmutex *lock,
+					       enum bch_lock_class class)
+{
+	if (likely(!bch2_lock_profiling(c))) {
+		seqmutex_lock(lock);
+		return;
+	}
+
+	if (mutex_trylock(&lock->lock)) {
+		bch2_lock_profile_acquired(c, class);
+	} else {
+		u64 start = local_clock();
+
+		mutex_lock(&lock->lock);
+		bch2_lock_profile_contended(c, class, start, _THIS_IP_);
+	}
+	lock->seq++;
+}
+
+void bch2_lock_profile_reset(struct bch_fs *);
+void bch2_lock_profile_to_text(struct printbuf *, struct bch_fs *);
+
+void bch2_fs_lock_profile_exit(struct bch_fs *);
+int bch2_fs_lock_profile_init(struct bch_fs *);
+void bch2_fs_lock_profile_init_early(struct bch_fs *);
+
+#endif /* _BCACHEFS_LOCK_PROFILE_H */
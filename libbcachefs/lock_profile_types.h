@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_LOCK_PROFILE_TYPES_H
+#define _BCACHEFS_LOCK_PROFILE_TYPES_H
+
+#include <linux/mutex.h>
+#include <linux/types.h>
+
+/*
+ * Lock profiling (lock_profiling option): acquisitions, contended
+ * acquisitions, wait and hold times: btree node locks by btree, level and lock
+ * type, everything else by lock class, and the most contended call sites.
+ *
+ * The first three classes are btree node locks, in enum six_lock_type order:
+ */
+#define BCH_LOCK_CLASSES()		\
+	x(btree_node_read)		\
+	x(btree_node_intent)		\
+	x(btree_node_write)		\
+	x(nocow)			\
+	x(pagecache)			\
+	x(btree_trans_list)
+
+enum bch_lock_class {
+#define x(n)	BCH_LOCK_##n,
+	BCH_LOCK_CLASSES()
+#undef x
+	BCH_LOCK_CLASS_NR,
+};
+
+#define BCH_LOCK_PROFILE_STATS()	\
+	x(acquired)			\
+	x(contended)			\
+	x(wait_ns)			\
+	x(hold_ns)
+
+enum bch_lock_profile_stat {
+#define x(n)	BCH_LOCK_PROFILE_##n,
+	BCH_LOCK_PROFILE_STATS()
+#undef x
+	BCH_LOCK_PROFILE_STAT_NR,
+};
+
+/* Btree node lock levels, plus one for key cache locks: */
+#define BCH_LOCK_PROFILE_LEVELS		(BTREE_MAX_DEPTH + 1)
+
+struct bch_lock_profile_pcpu {
+	u64			btree[BTREE_ID_NR][BCH_LOCK_PROFILE_LEVELS]
+				     [3][BCH_LOCK_PROFILE_STAT_NR];
+	u64			classes[BCH_LOCK_CLASS_NR][BCH_LOCK_PROFILE_STAT_NR];
+};
+
+struct bch_lock_profile_site {
+	unsigned long		ip;
+	u8			class;
+	u8			btree_id;
+	u8			level;
+	u64			contended;
+	u64			wait_ns;
+};
+
+#define BCH_LOCK_PROFILE_SITES		32
+
+struct bch_lock_profile {
+	/* allocated when lock_profiling is first enabled: */
+	struct bch_lock_profile_pcpu __percpu *pcpu;
+
+	struct mutex		sites_lock;
+	struct bch_lock_profile_site sites[BCH_LOCK_PROFILE_SITES];
+};
+
+#endif /* _BCACHEFS_LOCK_PROFILE_TYPES_H */
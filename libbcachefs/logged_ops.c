@@ -6,6 +6,7 @@
 #include "error.h"
 #include "io_misc.h"
 #include "logged_ops.h"
+#include "move.h"
 #include "super.h"
 
 struct bch_logged_op_fn {
@@ -67,7 +68,8 @@ static int __bch2_logged_op_start(struct btree_trans *trans, struct bkey_i *k)
 	struct btree_iter iter;
 	int ret;
 
-	ret = bch2_bkey_get_empty_slot(trans, &iter, BTREE_ID_logged_ops, POS_MAX);
+	ret = bch2_bkey_get_empty_slot(trans, &iter, BTREE_ID_logged_ops,
+				       POS(LOGGED_OPS_INUM_logged_ops, U64_MAX));
 	if (ret)
 		return ret;
 
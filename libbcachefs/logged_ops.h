@@ -6,7 +6,8 @@
 
 #define BCH_LOGGED_OPS()			\
 	x(truncate)				\
-	x(finsert)
+	x(finsert)				\
+	x(data_job)
 
 static inline int bch2_logged_op_update(struct btree_trans *trans, struct bkey_i *op)
 {
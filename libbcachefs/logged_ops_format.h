@@ -2,6 +2,17 @@
 #ifndef _BCACHEFS_LOGGED_OPS_FORMAT_H
 #define _BCACHEFS_LOGGED_OPS_FORMAT_H
 
+/*
+ * The logged ops btree is split by inode field: logged operations live in
+ * LOGGED_OPS_INUM_logged_ops, small bits of persistent allocator state in the
+ * other inode numbers:
+ */
+enum logged_ops_inums {
+	LOGGED_OPS_INUM_logged_ops,
+	LOGGED_OPS_INUM_inode_cursors,
+	LOGGED_OPS_INUM_fsck_cursor,
+};
+
 struct bch_logged_op_truncate {
 	struct bch_val		v;
 	__le32			subvol;
@@ -27,4 +38,23 @@ struct bch_logged_op_finsert {
 	__le64			pos;
 };
 
+/*
+ * Cursor for a data job (BCH_IOCTL_DATA), so that it can be resumed after
+ * being interrupted: @data_type is the phase the job was in (btree or user),
+ * and everything before @btree_id:@pos_* in that phase has been done.
+ */
+struct bch_logged_op_data_job {
+	struct bch_val		v;
+	__u8			op;
+	__u8			data_type;
+	__u8			btree_id;
+	__u8			pad;
+	__le32			migrate_dev;
+	__le64			pos_inode;
+	__le64			pos_offset;
+	__le32			pos_snapshot;
+	__le32			pad2;
+	__le64			sectors_done;
+};
+
 #endif /* _BCACHEFS_LOGGED_OPS_FORMAT_H */
@@ -11,6 +11,7 @@
 #include "btree_update_interior.h"
 #include "btree_write_buffer.h"
 #include "compress.h"
+#include "dedup.h"
 #include "disk_groups.h"
 #include "ec.h"
 #include "errcode.h"
@@ -20,14 +21,17 @@
 #include "io_write.h"
 #include "journal_reclaim.h"
 #include "keylist.h"
+#include "logged_ops.h"
 #include "move.h"
 #include "replicas.h"
+#include "scrub.h"
 #include "snapshot.h"
 #include "super-io.h"
 #include "trace.h"
 
 #include <linux/ioprio.h>
 #include <linux/kthread.h>
+#include <linux/sort.h>
 
 const char * const bch2_data_ops_strs[] = {
 #define x(t, n, ...) [n] = #t,
@@ -68,6 +72,7 @@ struct moving_io {
 	struct move_bucket_in_flight	*b;
 	struct closure			cl;
 	bool				read_completed;
+	u64				read_start;
 
 	unsigned			read_sectors;
 	unsigned			write_sectors;
@@ -141,11 +146,58 @@ struct moving_io *bch2_moving_ctxt_next_pending_write(struct moving_context *ctx
 	return io && io->read_completed ? io : NULL;
 }
 
+#define MOVE_WINDOW_MAX		1024
+
+static unsigned move_ctxt_window(struct bch_fs *c, struct moving_context *ctxt)
+{
+	return c->opts.move_target_latency
+		? READ_ONCE(ctxt->window)
+		: c->opts.move_ios_in_flight;
+}
+
+static unsigned move_ctxt_sectors_limit(struct bch_fs *c, struct moving_context *ctxt)
+{
+	return div_u64((u64) (c->opts.move_bytes_in_flight >> 9) * move_ctxt_window(c, ctxt),
+		       c->opts.move_ios_in_flight);
+}
+
+/*
+ * Additive increase, multiplicative decrease: once per window's worth of
+ * completed reads, grow the window by one IO if none of them were slower than
+ * the target, otherwise shrink it by a quarter:
+ */
+static void move_ctxt_window_update(struct moving_context *ctxt, u64 latency)
+{
+	struct bch_fs *c = ctxt->trans->c;
+	u64 target = (u64) READ_ONCE(c->opts.move_target_latency) * NSEC_PER_USEC;
+	unsigned long flags;
+
+	if (!target)
+		return;
+
+	spin_lock_irqsave(&ctxt->window_lock, flags);
+	ctxt->window_slow += latency > target;
+
+	if (++ctxt->window_reads >= ctxt->window) {
+		unsigned window = ctxt->window_slow
+			? ctxt->window - ctxt->window / 4
+			: ctxt->window + 1;
+
+		WRITE_ONCE(ctxt->window, clamp(window, 1U, MOVE_WINDOW_MAX));
+		ctxt->window_reads	= 0;
+		ctxt->window_slow	= 0;
+	}
+	spin_unlock_irqrestore(&ctxt->window_lock, flags);
+}
+
 static void move_read_endio(struct bio *bio)
 {
 	struct moving_io *io = container_of(bio, struct moving_io, rbio.bio);
 	struct moving_context *ctxt = io->write.ctxt;
 
+	if (!bio->bi_status)
+		move_ctxt_window_update(ctxt, local_clock() - io->read_start);
+
 	atomic_sub(io->read_sectors, &ctxt->read_sectors);
 	atomic_dec(&ctxt->read_ios);
 	io->read_completed = true;
@@ -215,8 +267,11 @@ void bch2_moving_ctxt_init(struct moving_context *ctxt,
 	ctxt->stats	= stats;
 	ctxt->wp	= wp;
 	ctxt->wait_on_copygc = wait_on_copygc;
+	ctxt->io_class	= BCH_IO_CLASS_move;
+	ctxt->window	= c->opts.move_ios_in_flight;
 
 	closure_init_stack(&ctxt->cl);
+	spin_lock_init(&ctxt->window_lock);
 
 	mutex_init(&ctxt->lock);
 	INIT_LIST_HEAD(&ctxt->reads);
@@ -237,6 +292,7 @@ void bch2_move_stats_init(struct bch_move_stats *stats, const char *name)
 {
 	memset(stats, 0, sizeof(*stats));
 	stats->data_type = BCH_DATA_user;
+	stats->start_time = local_clock();
 	scnprintf(stats->name, sizeof(stats->name), "%s", name);
 }
 
@@ -301,6 +357,7 @@ int bch2_move_extent(struct moving_context *ctxt,
 
 	io->rbio.c		= c;
 	io->rbio.opts		= io_opts;
+	io->rbio.io_class	= ctxt->io_class;
 	bio_init(&io->rbio.bio, NULL, io->bi_inline_vecs, pages, 0);
 	io->rbio.bio.bi_vcnt = pages;
 	bio_set_prio(&io->rbio.bio, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
@@ -347,6 +404,7 @@ int bch2_move_extent(struct moving_context *ctxt,
 	 * ctxt when doing wakeup
 	 */
 	closure_get(&ctxt->cl);
+	io->read_start = local_clock();
 	bch2_read_extent(trans, &io->rbio,
 			 bkey_start_pos(k.k),
 			 iter->btree_id, k, 0,
@@ -399,7 +457,7 @@ struct bch_io_opts *bch2_move_get_io_opts(struct btree_trans *trans,
 				continue;
 
 			struct bch_inode_unpacked inode;
-			BUG_ON(bch2_inode_unpack(k, &inode));
+			BUG_ON(bch2_inode_unpack_fields(k, &inode, INODE_V3_OPT_FIELDS));
 
 			struct snapshot_io_opts_entry e = { .snapshot = k.k->p.snapshot };
 			bch2_inode_opts_get(&e.io_opts, trans->c, &inode);
@@ -444,7 +502,7 @@ int bch2_move_get_io_opts_one(struct btree_trans *trans,
 
 	if (!ret && bkey_is_inode(k.k)) {
 		struct bch_inode_unpacked inode;
-		bch2_inode_unpack(k, &inode);
+		bch2_inode_unpack_fields(k, &inode, INODE_V3_OPT_FIELDS);
 		bch2_inode_opts_get(io_opts, trans->c, &inode);
 	} else {
 		*io_opts = bch2_opts_to_inode_opts(trans->c->opts);
@@ -460,10 +518,10 @@ int bch2_move_ratelimit(struct moving_context *ctxt)
 	bool is_kthread = current->flags & PF_KTHREAD;
 	u64 delay;
 
-	if (ctxt->wait_on_copygc && c->copygc_running) {
+	if (ctxt->wait_on_copygc && atomic_read(&c->copygc_running)) {
 		bch2_moving_ctxt_flush_all(ctxt);
 		wait_event_killable(c->copygc_running_wq,
-				    !c->copygc_running ||
+				    !atomic_read(&c->copygc_running) ||
 				    (is_kthread && kthread_should_stop()));
 	}
 
@@ -486,18 +544,48 @@ int bch2_move_ratelimit(struct moving_context *ctxt)
 	} while (delay);
 
 	/*
-	 * XXX: these limits really ought to be per device, SSDs and hard drives
-	 * will want different limits
+	 * Without move_target_latency these are fixed limits, which ought to be
+	 * per device: SSDs and hard drives want different limits
 	 */
 	move_ctxt_wait_event(ctxt,
-		atomic_read(&ctxt->write_sectors) < c->opts.move_bytes_in_flight >> 9 &&
-		atomic_read(&ctxt->read_sectors) < c->opts.move_bytes_in_flight >> 9 &&
-		atomic_read(&ctxt->write_ios) < c->opts.move_ios_in_flight &&
-		atomic_read(&ctxt->read_ios) < c->opts.move_ios_in_flight);
+		atomic_read(&ctxt->write_sectors) < move_ctxt_sectors_limit(c, ctxt) &&
+		atomic_read(&ctxt->read_sectors) < move_ctxt_sectors_limit(c, ctxt) &&
+		atomic_read(&ctxt->write_ios) < move_ctxt_window(c, ctxt) &&
+		atomic_read(&ctxt->read_ios) < move_ctxt_window(c, ctxt));
 
 	return 0;
 }
 
+/* How often data jobs persist their position: */
+#define DATA_JOB_CHECKPOINT_INTERVAL	(30 * HZ)
+
+int bch2_data_job_checkpoint(struct moving_context *ctxt)
+{
+	struct bch_move_stats *stats = ctxt->stats;
+	struct bkey_i_logged_op_data_job *op = stats ? stats->checkpoint : NULL;
+
+	if (!op || time_before(jiffies, stats->checkpoint_next))
+		return 0;
+
+	/*
+	 * Everything before our current position has to be done before we can
+	 * record it:
+	 */
+	bch2_moving_ctxt_flush_all(ctxt);
+
+	op->v.data_type		= stats->data_type;
+	op->v.btree_id		= stats->pos.btree;
+	op->v.pos_inode		= cpu_to_le64(stats->pos.pos.inode);
+	op->v.pos_offset	= cpu_to_le64(stats->pos.pos.offset);
+	op->v.pos_snapshot	= cpu_to_le32(stats->pos.pos.snapshot);
+	op->v.sectors_done	= cpu_to_le64(atomic64_read(&stats->sectors_seen));
+
+	stats->checkpoint_next = jiffies + DATA_JOB_CHECKPOINT_INTERVAL;
+
+	return commit_do(ctxt->trans, NULL, NULL, BCH_TRANS_COMMIT_no_enospc,
+			 bch2_logged_op_update(ctxt->trans, &op->k_i));
+}
+
 static int bch2_move_data_btree(struct moving_context *ctxt,
 				struct bpos start,
 				struct bpos end,
@@ -531,6 +619,10 @@ static int bch2_move_data_btree(struct moving_context *ctxt,
 		bch2_ratelimit_reset(ctxt->rate);
 
 	while (!bch2_move_ratelimit(ctxt)) {
+		ret = bch2_data_job_checkpoint(ctxt);
+		if (ret)
+			break;
+
 		bch2_trans_begin(trans);
 
 		k = bch2_btree_iter_peek(&iter);
@@ -645,6 +737,22 @@ int bch2_move_data(struct bch_fs *c,
 	return ret;
 }
 
+static int bucket_backpointer_cmp(const void *_l, const void *_r)
+{
+	const struct bucket_backpointer *l = _l;
+	const struct bucket_backpointer *r = _r;
+
+	return  cmp_int(l->bp.level,	r->bp.level) ?:
+		cmp_int(l->bp.btree_id,	r->bp.btree_id) ?:
+		bpos_cmp(l->bp.pos,	r->bp.pos);
+}
+
+/*
+ * All of a bucket's backpointers are read up front and sorted by the key they
+ * point to, so that evacuating a bucket full of small extents walks each btree
+ * in order with one iterator (and one btree_path), instead of a lookup from the
+ * root for every backpointer:
+ */
 int bch2_evacuate_bucket(struct moving_context *ctxt,
 			   struct move_bucket_in_flight *bucket_in_flight,
 			   struct bpos bucket, int gen,
@@ -654,16 +762,16 @@ int bch2_evacuate_bucket(struct moving_context *ctxt,
 	struct bch_fs *c = trans->c;
 	bool is_kthread = current->flags & PF_KTHREAD;
 	struct bch_io_opts io_opts = bch2_opts_to_inode_opts(c->opts);
-	struct btree_iter iter;
+	struct btree_iter iter, extent_iter = {};
 	struct bkey_buf sk;
-	struct bch_backpointer bp;
+	darray_bucket_backpointers bps = {};
 	struct bch_alloc_v4 a_convert;
 	const struct bch_alloc_v4 *a;
 	struct bkey_s_c k;
 	struct data_update_opts data_opts;
 	unsigned dirty_sectors, bucket_size;
 	u64 fragmentation;
-	struct bpos bp_pos = POS_MIN;
+	size_t idx = 0;
 	int ret = 0;
 
 	struct bch_dev *ca = bch2_dev_tryget(c, bucket.inode);
@@ -699,24 +807,34 @@ int bch2_evacuate_bucket(struct moving_context *ctxt,
 	if (ret)
 		goto err;
 
-	while (!(ret = bch2_move_ratelimit(ctxt))) {
+	ret = lockrestart_do(trans,
+			bch2_bucket_backpointers_get(trans, ca, bucket, gen,
+						     &bps, BTREE_ITER_cached));
+	bch_err_msg(c, ret, "reading backpointers");
+	if (ret)
+		goto err;
+
+	sort(bps.data, bps.nr, sizeof(bps.data[0]), bucket_backpointer_cmp, NULL);
+
+	while (idx < bps.nr &&
+	       !(ret = bch2_move_ratelimit(ctxt))) {
+		struct bpos bp_pos = bps.data[idx].pos;
+		struct bch_backpointer bp = bps.data[idx].bp;
+
 		if (is_kthread && kthread_should_stop())
 			break;
 
 		bch2_trans_begin(trans);
 
-		ret = bch2_get_next_backpointer(trans, ca, bucket, gen,
-						&bp_pos, &bp,
-						BTREE_ITER_cached);
-		if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
-			continue;
-		if (ret)
-			goto err;
-		if (bkey_eq(bp_pos, POS_MAX))
-			break;
-
 		if (!bp.level) {
-			k = bch2_backpointer_get_key(trans, &iter, bp_pos, bp, 0);
+			if (extent_iter.path &&
+			    extent_iter.btree_id != bp.btree_id)
+				bch2_trans_iter_exit(trans, &extent_iter);
+			if (!extent_iter.path)
+				bch2_trans_node_iter_init(trans, &extent_iter, bp.btree_id,
+							  bp.pos, 0, 0, 0);
+
+			k = bch2_backpointer_get_key_iter(trans, &extent_iter, bp_pos, bp);
 			ret = bkey_err(k);
 			if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
 				continue;
@@ -729,10 +847,8 @@ int bch2_evacuate_bucket(struct moving_context *ctxt,
 			k = bkey_i_to_s_c(sk.k);
 
 			ret = bch2_move_get_io_opts_one(trans, &io_opts, k);
-			if (ret) {
-				bch2_trans_iter_exit(trans, &iter);
+			if (ret)
 				continue;
-			}
 
 			data_opts = _data_opts;
 			data_opts.target	= io_opts.background_target;
@@ -742,17 +858,14 @@ int bch2_evacuate_bucket(struct moving_context *ctxt,
 			bkey_for_each_ptr(bch2_bkey_ptrs_c(k), ptr) {
 				if (ptr->dev == bucket.inode) {
 					data_opts.rewrite_ptrs |= 1U << i;
-					if (ptr->cached) {
-						bch2_trans_iter_exit(trans, &iter);
+					if (ptr->cached)
 						goto next;
-					}
 				}
 				i++;
 			}
 
 			ret = bch2_move_extent(ctxt, bucket_in_flight,
-					       &iter, k, io_opts, data_opts);
-			bch2_trans_iter_exit(trans, &iter);
+					       &extent_iter, k, io_opts, data_opts);
 
 			if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
 				continue;
@@ -798,16 +911,97 @@ int bch2_evacuate_bucket(struct moving_context *ctxt,
 			}
 		}
 next:
-		bp_pos = bpos_nosnap_successor(bp_pos);
+		idx++;
 	}
 
 	trace_evacuate_bucket(c, &bucket, dirty_sectors, bucket_size, fragmentation, ret);
 err:
+	bch2_trans_iter_exit(trans, &extent_iter);
+	darray_exit(&bps);
 	bch2_dev_put(ca);
 	bch2_bkey_buf_exit(&sk, c);
 	return ret;
 }
 
+/*
+ * Evacuate a device by walking its buckets in order and finding what lives in
+ * each one via backpointers: reads from the source device are then close to
+ * sequential, where walking the extents btree in key order seeks all over it:
+ */
+static int bch2_move_data_phys(struct bch_fs *c, unsigned dev,
+			       struct bpos start,
+			       struct bch_move_stats *stats)
+{
+	bool is_kthread = current->flags & PF_KTHREAD;
+	struct moving_context ctxt;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	int ret = 0;
+
+	struct bch_dev *ca = bch2_dev_tryget(c, dev);
+	if (!ca)
+		return -EINVAL;
+
+
+	bch2_moving_ctxt_init(&ctxt, c, NULL, stats,
+			      writepoint_hashed((unsigned long) current),
+			      true);
+	struct btree_trans *trans = ctxt.trans;
+
+	struct bpos bucket	= bpos_max(start, POS(dev, ca->mi.first_bucket));
+	struct bpos end		= POS(dev, ca->mi.nbuckets - 1);
+
+	stats->data_type = BCH_DATA_user;
+
+	while (!bch2_move_ratelimit(&ctxt)) {
+		if (is_kthread && kthread_should_stop())
+			break;
+
+		stats->pos = BBPOS(BTREE_ID_alloc, bucket);
+
+		ret = bch2_data_job_checkpoint(&ctxt);
+		if (ret)
+			break;
+
+		bch2_trans_begin(trans);
+
+		bch2_trans_iter_init(trans, &iter, BTREE_ID_alloc, bucket,
+				     BTREE_ITER_prefetch);
+		k = bch2_btree_iter_peek_upto(&iter, end);
+		ret = bkey_err(k);
+		if (bch2_err_matches(ret, BCH_ERR_transaction_restart)) {
+			bch2_trans_iter_exit(trans, &iter);
+			continue;
+		}
+		if (ret || !k.k) {
+			bch2_trans_iter_exit(trans, &iter);
+			break;
+		}
+
+		struct bch_alloc_v4 a_convert;
+		const struct bch_alloc_v4 *a = bch2_alloc_to_v4(k, &a_convert);
+		bool movable	= data_type_movable(a->data_type) &&
+			bch2_bucket_sectors_dirty(*a);
+		u8 gen		= a->gen;
+
+		bucket = k.k->p;
+		bch2_trans_iter_exit(trans, &iter);
+
+		if (movable) {
+			ret = bch2_evacuate_bucket(&ctxt, NULL, bucket, gen,
+						   (struct data_update_opts) { 0 });
+			if (ret)
+				break;
+		}
+
+		bucket = bpos_nosnap_successor(bucket);
+	}
+
+	bch2_moving_ctxt_exit(&ctxt);
+	bch2_dev_put(ca);
+	return ret;
+}
+
 typedef bool (*move_btree_pred)(struct bch_fs *, void *,
 				struct btree *, struct bch_io_opts *,
 				struct data_update_opts *);
@@ -840,6 +1034,10 @@ static int bch2_move_btree(struct bch_fs *c,
 	     btree ++) {
 		stats->pos = BBPOS(btree, POS_MIN);
 
+		ret = bch2_data_job_checkpoint(&ctxt);
+		if (ret)
+			break;
+
 		if (!bch2_btree_id_root(c, btree)->b)
 			continue;
 
@@ -886,6 +1084,243 @@ next:
 	return ret;
 }
 
+/*
+ * Btree defrag: walk the leaves of each btree in key order, merging underfull
+ * siblings and rewriting nodes that aren't physically adjacent to their
+ * predecessor - rewrites go through the btree write point, so rewriting in key
+ * order lays nodes out sequentially:
+ */
+static bool btree_defrag_node_adjacent(struct bch_fs *c, struct btree *b,
+				       struct bch_extent_ptr *prev, bool *have_prev)
+{
+	const struct bch_extent_ptr *ptr =
+		&bch2_bkey_ptrs_c(bkey_i_to_s_c(&b->key)).start->ptr;
+	bool ret = true;
+
+	if (*have_prev) {
+		rcu_read_lock();
+		struct bch_dev *ca = bch2_dev_rcu(c, ptr->dev);
+
+		/* A node at the start of a bucket is as good as we can do: */
+		ret = !ca ||
+			(ptr->dev == prev->dev &&
+			 ptr->offset == prev->offset + btree_sectors(c)) ||
+			!bucket_remainder(ca, ptr->offset);
+		rcu_read_unlock();
+	}
+
+	*prev = *ptr;
+	*have_prev = true;
+	return ret;
+}
+
+static int bch2_defrag_btree(struct bch_fs *c,
+			     struct bbpos start,
+			     struct bbpos end,
+			     struct bch_move_stats *stats)
+{
+	bool kthread = (current->flags & PF_KTHREAD) != 0;
+	struct bch_ratelimit rate;
+	struct moving_context ctxt;
+	struct btree_trans *trans;
+	struct btree_iter iter;
+	struct btree *b;
+	enum btree_id btree;
+	int ret = 0;
+
+	u32 max_rate = READ_ONCE(c->opts.btree_defrag_max_rate);
+	if (max_rate) {
+		rate.rate = max(max_rate >> 9, 1U);
+		bch2_ratelimit_reset(&rate);
+	}
+
+	bch2_moving_ctxt_init(&ctxt, c, max_rate ? &rate : NULL, stats,
+			      writepoint_ptr(&c->btree_write_point),
+			      true);
+	trans = ctxt.trans;
+
+	stats->data_type = BCH_DATA_btree;
+
+	for (btree = start.btree;
+	     btree <= min_t(unsigned, end.btree, btree_id_nr_alive(c) - 1);
+	     btree++) {
+		struct bch_extent_ptr prev;
+		bool have_prev = false;
+		struct bpos rewrote = SPOS_MAX;
+
+		if (!bch2_btree_id_root(c, btree)->b)
+			continue;
+
+		bch2_trans_node_iter_init(trans, &iter, btree,
+					  btree == start.btree ? start.pos : POS_MIN,
+					  0, 0, BTREE_ITER_prefetch);
+retry:
+		ret = 0;
+		while (!(ret = bch2_move_ratelimit(&ctxt)) &&
+		       (bch2_trans_begin(trans),
+			(b = bch2_btree_iter_peek_node(&iter)) &&
+			!(ret = PTR_ERR_OR_ZERO(b)))) {
+			if ((cmp_int(btree, end.btree) ?:
+			     bpos_cmp(b->key.k.p, end.pos)) > 0)
+				break;
+
+			stats->pos = BBPOS(iter.btree_id, iter.pos);
+
+			ret = bch2_data_job_checkpoint(&ctxt);
+			if (ret)
+				break;
+
+			/* Merge with the next node until it's full: */
+			if (b->sib_u64s[btree_next_sib] <=
+			    btree_node_foreground_merge_threshold(c, b)) {
+				ret = __bch2_foreground_maybe_merge(trans, iter.path, 0, 0,
+								    btree_next_sib);
+				if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+					continue;
+				if (ret)
+					break;
+
+				if (max_rate)
+					bch2_ratelimit_increment(&rate, btree_sectors(c));
+				continue;
+			}
+
+			if (!bpos_eq(rewrote, b->key.k.p) &&
+			    !btree_defrag_node_adjacent(c, b, &prev, &have_prev)) {
+				ret = bch2_btree_node_rewrite(trans, &iter, b, 0);
+				if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+					continue;
+				if (ret)
+					break;
+
+				atomic64_add(btree_sectors(c), &stats->sectors_moved);
+				if (max_rate)
+					bch2_ratelimit_increment(&rate, btree_sectors(c));
+
+				/* Go around again, to record where it went: */
+				rewrote = b->key.k.p;
+				continue;
+			}
+
+			bch2_btree_iter_next_node(&iter);
+		}
+		if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+			goto retry;
+
+		bch2_trans_iter_exit(trans, &iter);
+
+		if (ret > 0)
+			ret = 0;
+		if (ret || (kthread && kthread_should_stop()))
+			break;
+	}
+
+	bch_err_fn(c, ret);
+	bch2_moving_ctxt_exit(&ctxt);
+	bch2_btree_interior_updates_flush(c);
+
+	return ret;
+}
+
+/*
+ * File defrag: rewrite extents smaller than the target size, in key order and
+ * through one write point, so that the new extents are physically contiguous
+ * and get merged with their neighbours when they're inserted.
+ *
+ * Extents that already start where their predecessor ends on disk are left
+ * alone - unless the predecessor was just rewritten, so that we don't break
+ * up a run:
+ */
+#define DEFRAG_EXTENT_SECTORS_DEFAULT	((8U << 20) >> 9)
+
+struct defrag_state {
+	unsigned		extent_sectors;
+	bool			have_prev;
+	bool			prev_rewritten;
+	struct bpos		prev_end;
+	unsigned		prev_dev;
+	u64			prev_offset_end;
+};
+
+static bool defrag_pred(struct bch_fs *c, void *arg,
+			struct bkey_s_c k,
+			struct bch_io_opts *io_opts,
+			struct data_update_opts *data_opts)
+{
+	struct defrag_state *d = arg;
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const union bch_extent_entry *entry;
+	struct extent_ptr_decoded p;
+	bool have_ptr = false, contiguous;
+	unsigned dev = 0, i = 0;
+	u64 offset = 0;
+
+	if (k.k->type != KEY_TYPE_extent)
+		return false;
+
+	bkey_for_each_ptr_decode(k.k, ptrs, p, entry) {
+		if (!p.ptr.cached) {
+			if (!have_ptr && !crc_is_compressed(p.crc)) {
+				dev	= p.ptr.dev;
+				offset	= p.ptr.offset + p.crc.offset;
+			}
+			have_ptr = true;
+			data_opts->rewrite_ptrs |= BIT(i);
+		}
+		i++;
+	}
+
+	if (!have_ptr)
+		return false;
+
+	contiguous = d->have_prev &&
+		!d->prev_rewritten &&
+		bpos_eq(d->prev_end, bkey_start_pos(k.k)) &&
+		offset &&
+		dev == d->prev_dev &&
+		offset == d->prev_offset_end;
+
+	d->have_prev		= true;
+	d->prev_rewritten	= !contiguous && k.k->size < d->extent_sectors;
+	d->prev_end		= k.k->p;
+	d->prev_dev		= dev;
+	d->prev_offset_end	= offset ? offset + k.k->size : 0;
+
+	if (!d->prev_rewritten) {
+		data_opts->rewrite_ptrs = 0;
+		return false;
+	}
+
+	data_opts->target		= io_opts->background_target;
+	data_opts->extra_replicas	= 0;
+	data_opts->btree_insert_flags	= 0;
+	return true;
+}
+
+static int bch2_defrag(struct bch_fs *c,
+		       struct bbpos start,
+		       struct bbpos end,
+		       struct bch_ioctl_data *op,
+		       struct bch_move_stats *stats)
+{
+	struct defrag_state d = {
+		.extent_sectors	= op->defrag.extent_sectors ?: DEFRAG_EXTENT_SECTORS_DEFAULT,
+	};
+	struct bch_ratelimit rate;
+
+	if (op->defrag.max_rate) {
+		rate.rate = clamp_t(u64, op->defrag.max_rate >> 9, 1, U32_MAX);
+		bch2_ratelimit_reset(&rate);
+	}
+
+	return bch2_move_data(c, start, end,
+			      op->defrag.max_rate ? &rate : NULL,
+			      stats,
+			      writepoint_hashed((unsigned long) current),
+			      true,
+			      defrag_pred, &d);
+}
+
 static bool rereplicate_pred(struct bch_fs *c, void *arg,
 			     struct bkey_s_c k,
 			     struct bch_io_opts *io_opts,
@@ -988,12 +1423,13 @@ static bool rewrite_old_nodes_pred(struct bch_fs *c, void *arg,
 	return false;
 }
 
-int bch2_scan_old_btree_nodes(struct bch_fs *c, struct bch_move_stats *stats)
+int bch2_scan_old_btree_nodes(struct bch_fs *c, struct bbpos start,
+			      struct bch_move_stats *stats)
 {
 	int ret;
 
 	ret = bch2_move_btree(c,
-			      BBPOS_MIN,
+			      start,
 			      BBPOS_MAX,
 			      rewrite_old_nodes_pred, c, stats);
 	if (!ret) {
@@ -1046,12 +1482,157 @@ static bool drop_extra_replicas_btree_pred(struct bch_fs *c, void *arg,
 	return drop_extra_replicas_pred(c, arg, bkey_i_to_s_c(&b->key), io_opts, data_opts);
 }
 
+void bch2_logged_op_data_job_to_text(struct printbuf *out, struct bch_fs *c, struct bkey_s_c k)
+{
+	struct bkey_s_c_logged_op_data_job op = bkey_s_c_to_logged_op_data_job(k);
+
+	prt_str(out, "op=");
+	if (op.v->op < BCH_DATA_OP_NR)
+		prt_str(out, bch2_data_ops_strs[op.v->op]);
+	else
+		prt_printf(out, "(unknown data op %u)", op.v->op);
+
+	prt_printf(out, " dev=%u", le32_to_cpu(op.v->migrate_dev));
+	prt_str(out, " phase=");
+	bch2_prt_data_type(out, op.v->data_type);
+	prt_printf(out, " pos=%s:%llu:%llu:%u",
+		   bch2_btree_id_str(op.v->btree_id),
+		   le64_to_cpu(op.v->pos_inode),
+		   le64_to_cpu(op.v->pos_offset),
+		   le32_to_cpu(op.v->pos_snapshot));
+	prt_printf(out, " sectors_done=%llu", le64_to_cpu(op.v->sectors_done));
+}
+
+/*
+ * Data jobs are started from userspace, so we can't restart them ourselves -
+ * the cursor is left for the next run of the same job to pick up:
+ */
+int bch2_resume_logged_op_data_job(struct btree_trans *trans, struct bkey_i *k)
+{
+	struct bch_fs *c = trans->c;
+	struct printbuf buf = PRINTBUF;
+
+	bch2_bkey_val_to_text(&buf, c, bkey_i_to_s_c(k));
+	bch_info(c, "interrupted data job, will resume when restarted: %s", buf.buf);
+	printbuf_exit(&buf);
+	return 0;
+}
+
+static unsigned data_job_dev(struct bch_ioctl_data *op)
+{
+	switch (op->op) {
+	case BCH_DATA_OP_scrub:
+		return op->scrub.dev;
+	case BCH_DATA_OP_migrate:
+		return op->migrate.dev;
+	default:
+		return 0;
+	}
+}
+
+/* Look for a checkpoint left by a previous, interrupted run of this job: */
+static int bch2_data_job_lookup(struct btree_trans *trans,
+				struct bch_ioctl_data *op,
+				struct bkey_i_logged_op_data_job *job,
+				bool *found)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	int ret;
+
+	for_each_btree_key_norestart(trans, iter, BTREE_ID_logged_ops, POS_MIN, 0, k, ret) {
+		if (k.k->type != KEY_TYPE_logged_op_data_job)
+			continue;
+
+		struct bkey_s_c_logged_op_data_job j = bkey_s_c_to_logged_op_data_job(k);
+
+		if (j.v->op != op->op ||
+		    le32_to_cpu(j.v->migrate_dev) != data_job_dev(op))
+			continue;
+
+		job->k.p	= k.k->p;
+		job->v		= *j.v;
+		*found		= true;
+		break;
+	}
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+static int bch2_data_job_checkpoint_init(struct bch_fs *c,
+					 struct bch_move_stats *stats,
+					 struct bch_ioctl_data *op,
+					 struct bkey_i_logged_op_data_job *job,
+					 struct bbpos *resume,
+					 enum bch_data_type *resume_type)
+{
+	bool found = false;
+	int ret;
+
+	bkey_logged_op_data_job_init(&job->k_i);
+
+	ret = bch2_trans_run(c, lockrestart_do(trans,
+			bch2_data_job_lookup(trans, op, job, &found)));
+	if (ret)
+		return ret;
+
+	if (found) {
+		*resume_type	= job->v.data_type;
+		*resume		= BBPOS(job->v.btree_id,
+					SPOS(le64_to_cpu(job->v.pos_inode),
+					     le64_to_cpu(job->v.pos_offset),
+					     le32_to_cpu(job->v.pos_snapshot)));
+
+		atomic64_set(&stats->sectors_seen, le64_to_cpu(job->v.sectors_done));
+
+		struct printbuf buf = PRINTBUF;
+		bch2_bbpos_to_text(&buf, *resume);
+		bch_info(c, "resuming %s from %s", stats->name, buf.buf);
+		printbuf_exit(&buf);
+	} else {
+		job->v.op		= op->op;
+		job->v.data_type	= BCH_DATA_btree;
+		job->v.btree_id		= op->start_btree;
+		job->v.migrate_dev	= cpu_to_le32(data_job_dev(op));
+		job->v.pos_inode	= cpu_to_le64(op->start_pos.inode);
+		job->v.pos_offset	= cpu_to_le64(op->start_pos.offset);
+		job->v.pos_snapshot	= cpu_to_le32(op->start_pos.snapshot);
+
+		ret = bch2_trans_run(c, bch2_logged_op_start(trans, &job->k_i));
+		if (ret)
+			return ret;
+	}
+
+	stats->checkpoint	= job;
+	stats->checkpoint_next	= jiffies + DATA_JOB_CHECKPOINT_INTERVAL;
+	return 0;
+}
+
+/*
+ * Jobs of the same type share a checkpoint: only resume from it if it's within
+ * the range this job was asked to cover:
+ */
+static struct bbpos data_job_start(struct bbpos start, struct bbpos end,
+				   struct bbpos resume, enum bch_data_type resume_type,
+				   enum bch_data_type phase)
+{
+	return resume_type == phase &&
+		bbpos_cmp(resume, start) > 0 &&
+		bbpos_cmp(resume, end) < 0
+		? resume
+		: start;
+}
+
 int bch2_data_job(struct bch_fs *c,
 		  struct bch_move_stats *stats,
 		  struct bch_ioctl_data op)
 {
 	struct bbpos start	= BBPOS(op.start_btree, op.start_pos);
 	struct bbpos end	= BBPOS(op.end_btree, op.end_pos);
+	struct bkey_i_logged_op_data_job job;
+	struct bbpos resume	= start;
+	enum bch_data_type resume_type = BCH_DATA_btree;
+	bool is_kthread = current->flags & PF_KTHREAD;
 	int ret = 0;
 
 	if (op.op >= BCH_DATA_OP_NR)
@@ -1059,13 +1640,40 @@ int bch2_data_job(struct bch_fs *c,
 
 	bch2_move_stats_init(stats, bch2_data_ops_strs[op.op]);
 
+	ret = bch2_data_job_checkpoint_init(c, stats, &op, &job,
+					    &resume, &resume_type);
+	if (ret)
+		goto err;
+
+	/*
+	 * If we were interrupted in the data phase, the btree phase has already
+	 * completed and is skipped:
+	 */
+	struct bbpos btree_start = data_job_start(start, end, resume, resume_type, BCH_DATA_btree);
+	struct bbpos data_start  = data_job_start(start, end, resume, resume_type, BCH_DATA_user);
+	bool btree_done = resume_type == BCH_DATA_user;
+
 	switch (op.op) {
+	case BCH_DATA_OP_scrub:
+		if (op.scrub.dev >= c->sb.nr_devices) {
+			ret = -EINVAL;
+			break;
+		}
+
+		/* scrub walks the device's backpointers: */
+		ret = bch2_dev_scrub(c, op.scrub.dev,
+				     resume_type == BCH_DATA_user &&
+				     resume.btree == BTREE_ID_backpointers
+				     ? resume.pos : POS_MIN,
+				     stats);
+		break;
 	case BCH_DATA_OP_rereplicate:
 		stats->data_type = BCH_DATA_journal;
 		ret = bch2_journal_flush_device_pins(&c->journal, -1);
-		ret = bch2_move_btree(c, start, end,
-				      rereplicate_btree_pred, c, stats) ?: ret;
-		ret = bch2_move_data(c, start, end,
+		if (!btree_done)
+			ret = bch2_move_btree(c, btree_start, end,
+					      rereplicate_btree_pred, c, stats) ?: ret;
+		ret = bch2_move_data(c, data_start, end,
 				     NULL,
 				     stats,
 				     writepoint_hashed((unsigned long) current),
@@ -1079,9 +1687,30 @@ int bch2_data_job(struct bch_fs *c,
 
 		stats->data_type = BCH_DATA_journal;
 		ret = bch2_journal_flush_device_pins(&c->journal, op.migrate.dev);
-		ret = bch2_move_btree(c, start, end,
-				      migrate_btree_pred, &op, stats) ?: ret;
-		ret = bch2_move_data(c, start, end,
+
+		/*
+		 * Migrating the whole device: evacuate it in bucket order,
+		 * which moves btree nodes and data in one pass.
+		 *
+		 * A range restricted to part of the keyspace can only be
+		 * walked logically:
+		 */
+		if (!bbpos_cmp(start, BBPOS_MIN) &&
+		    end.btree >= BTREE_ID_NR - 1 &&
+		    (resume_type != BCH_DATA_user ||
+		     resume.btree == BTREE_ID_alloc)) {
+			ret = bch2_move_data_phys(c, op.migrate.dev,
+					resume_type == BCH_DATA_user
+					? resume.pos : POS_MIN,
+					stats) ?: ret;
+			ret = bch2_replicas_gc2(c) ?: ret;
+			break;
+		}
+
+		if (!btree_done)
+			ret = bch2_move_btree(c, btree_start, end,
+					      migrate_btree_pred, &op, stats) ?: ret;
+		ret = bch2_move_data(c, data_start, end,
 				     NULL,
 				     stats,
 				     writepoint_hashed((unsigned long) current),
@@ -1090,21 +1719,40 @@ int bch2_data_job(struct bch_fs *c,
 		ret = bch2_replicas_gc2(c) ?: ret;
 		break;
 	case BCH_DATA_OP_rewrite_old_nodes:
-		ret = bch2_scan_old_btree_nodes(c, stats);
+		ret = bch2_scan_old_btree_nodes(c, btree_start, stats);
 		break;
 	case BCH_DATA_OP_drop_extra_replicas:
-		ret = bch2_move_btree(c, start, end,
-				drop_extra_replicas_btree_pred, c, stats) ?: ret;
-		ret = bch2_move_data(c, start, end, NULL, stats,
+		if (!btree_done)
+			ret = bch2_move_btree(c, btree_start, end,
+					drop_extra_replicas_btree_pred, c, stats) ?: ret;
+		ret = bch2_move_data(c, data_start, end, NULL, stats,
 				writepoint_hashed((unsigned long) current),
 				true,
 				drop_extra_replicas_pred, c) ?: ret;
 		ret = bch2_replicas_gc2(c) ?: ret;
 		break;
+	case BCH_DATA_OP_dedup:
+		ret = bch2_dedup(c, start, end, stats);
+		break;
+	case BCH_DATA_OP_btree_defrag:
+		ret = bch2_defrag_btree(c, btree_start, end, stats);
+		break;
+	case BCH_DATA_OP_defrag:
+		ret = bch2_defrag(c, data_start, end, &op, stats);
+		break;
 	default:
 		ret = -EINVAL;
 	}
 
+	stats->checkpoint = NULL;
+
+	/* Only drop the checkpoint if we ran to completion: */
+	if (!ret && !(is_kthread && kthread_should_stop())) {
+		struct btree_trans *trans = bch2_trans_get(c);
+		bch2_logged_op_finish(trans, &job.k_i);
+		bch2_trans_put(trans);
+	}
+err:
 	bch2_move_stats_exit(stats, c);
 	return ret;
 }
@@ -1128,10 +1776,37 @@ void bch2_move_stats_to_text(struct printbuf *out, struct bch_move_stats *stats)
 	prt_human_readable_u64(out, atomic64_read(&stats->sectors_moved) << 9);
 	prt_newline(out);
 
+	u64 elapsed = max_t(u64, 1, div_u64(local_clock() - stats->start_time,
+					    NSEC_PER_SEC));
+	prt_printf(out, "rate:        ");
+	prt_human_readable_u64(out, div64_u64(atomic64_read(&stats->sectors_moved) << 9,
+					      elapsed));
+	prt_str(out, "/sec");
+	prt_newline(out);
+
 	prt_printf(out, "bytes raced: ");
 	prt_human_readable_u64(out, atomic64_read(&stats->sectors_raced) << 9);
 	prt_newline(out);
 
+	u64 deduped	= atomic64_read(&stats->sectors_deduped);
+	if (deduped) {
+		prt_printf(out, "bytes deduplicated: ");
+		prt_human_readable_u64(out, deduped << 9);
+		prt_newline(out);
+	}
+
+	u64 corrected	= atomic64_read(&stats->sectors_error_corrected);
+	u64 uncorrected	= atomic64_read(&stats->sectors_error_uncorrected);
+
+	if (corrected || uncorrected) {
+		prt_printf(out, "errors corrected:   ");
+		prt_human_readable_u64(out, corrected << 9);
+		prt_newline(out);
+		prt_printf(out, "errors uncorrected: ");
+		prt_human_readable_u64(out, uncorrected << 9);
+		prt_newline(out);
+	}
+
 	printbuf_indent_sub(out, 2);
 }
 
@@ -1144,15 +1819,15 @@ static void bch2_moving_ctxt_to_text(struct printbuf *out, struct bch_fs *c, str
 
 	prt_printf(out, "reads: ios %u/%u sectors %u/%u\n",
 		   atomic_read(&ctxt->read_ios),
-		   c->opts.move_ios_in_flight,
+		   move_ctxt_window(c, ctxt),
 		   atomic_read(&ctxt->read_sectors),
-		   c->opts.move_bytes_in_flight >> 9);
+		   move_ctxt_sectors_limit(c, ctxt));
 
 	prt_printf(out, "writes: ios %u/%u sectors %u/%u\n",
 		   atomic_read(&ctxt->write_ios),
-		   c->opts.move_ios_in_flight,
+		   move_ctxt_window(c, ctxt),
 		   atomic_read(&ctxt->write_sectors),
-		   c->opts.move_bytes_in_flight >> 9);
+		   move_ctxt_sectors_limit(c, ctxt));
 
 	printbuf_indent_add(out, 2);
 
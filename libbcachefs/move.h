@@ -21,6 +21,7 @@ struct moving_context {
 	struct write_point_specifier wp;
 	bool			wait_on_copygc;
 	bool			write_error;
+	enum bch_io_class	io_class;
 
 	/* For waiting on outstanding reads and writes: */
 	struct closure		cl;
@@ -35,6 +36,15 @@ struct moving_context {
 	atomic_t		read_ios;
 	atomic_t		write_ios;
 
+	/*
+	 * With move_target_latency set, IOs in flight are limited by an AIMD
+	 * window, adjusted once per window's worth of completed reads:
+	 */
+	spinlock_t		window_lock;
+	unsigned		window;
+	unsigned		window_reads;
+	unsigned		window_slow;
+
 	wait_queue_head_t	wait;
 };
 
@@ -86,6 +96,7 @@ void bch2_moving_ctxt_do_pending_writes(struct moving_context *);
 void bch2_moving_ctxt_flush_all(struct moving_context *);
 void bch2_move_ctxt_wait_for_io(struct moving_context *);
 int bch2_move_ratelimit(struct moving_context *);
+int bch2_data_job_checkpoint(struct moving_context *);
 
 /* Inodes in different snapshots may have different IO options: */
 struct snapshot_io_opts_entry {
@@ -114,7 +125,7 @@ struct bch_io_opts *bch2_move_get_io_opts(struct btree_trans *,
 				struct per_snapshot_io_opts *, struct bkey_s_c);
 int bch2_move_get_io_opts_one(struct btree_trans *, struct bch_io_opts *, struct bkey_s_c);
 
-int bch2_scan_old_btree_nodes(struct bch_fs *, struct bch_move_stats *);
+int bch2_scan_old_btree_nodes(struct bch_fs *, struct bbpos, struct bch_move_stats *);
 
 int bch2_move_extent(struct moving_context *,
 		     struct move_bucket_in_flight *,
@@ -144,6 +155,15 @@ int bch2_data_job(struct bch_fs *,
 		  struct bch_move_stats *,
 		  struct bch_ioctl_data);
 
+void bch2_logged_op_data_job_to_text(struct printbuf *, struct bch_fs *, struct bkey_s_c);
+
+#define bch2_bkey_ops_logged_op_data_job ((struct bkey_ops) {	\
+	.val_to_text	= bch2_logged_op_data_job_to_text,	\
+	.min_val_size	= 40,					\
+})
+
+int bch2_resume_logged_op_data_job(struct btree_trans *, struct bkey_i *);
+
 void bch2_move_stats_to_text(struct printbuf *, struct bch_move_stats *);
 void bch2_move_stats_exit(struct bch_move_stats *, struct bch_fs *);
 void bch2_move_stats_init(struct bch_move_stats *, const char *);
@@ -4,16 +4,28 @@
 
 #include "bbpos_types.h"
 
+struct bkey_i_logged_op_data_job;
+
 struct bch_move_stats {
 	enum bch_data_type	data_type;
 	struct bbpos		pos;
 	char			name[32];
+	u64			start_time;
+
+	/* For data jobs: where we checkpoint our position */
+	struct bkey_i_logged_op_data_job *checkpoint;
+	unsigned long		checkpoint_next;
 
 	atomic64_t		keys_moved;
 	atomic64_t		keys_raced;
 	atomic64_t		sectors_seen;
 	atomic64_t		sectors_moved;
 	atomic64_t		sectors_raced;
+	/* scrub: */
+	atomic64_t		sectors_error_corrected;
+	atomic64_t		sectors_error_uncorrected;
+	/* dedup: */
+	atomic64_t		sectors_deduped;
 };
 
 struct move_bucket_key {
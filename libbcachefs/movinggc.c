@@ -24,6 +24,7 @@
 #include <linux/kthread.h>
 #include <linux/math64.h>
 #include <linux/sched/task.h>
+#include <linux/sort.h>
 #include <linux/wait.h>
 
 struct buckets_in_flight {
@@ -71,7 +72,8 @@ move_bucket_in_flight_add(struct buckets_in_flight *list, struct move_bucket b)
 }
 
 static int bch2_bucket_is_movable(struct btree_trans *trans,
-				  struct move_bucket *b, u64 time)
+				  struct move_bucket *b, u64 time,
+				  u64 *write_time)
 {
 	struct btree_iter iter;
 	struct bkey_s_c k;
@@ -93,6 +95,7 @@ static int bch2_bucket_is_movable(struct btree_trans *trans,
 	a = bch2_alloc_to_v4(k, &_a);
 	b->k.gen	= a->gen;
 	b->sectors	= bch2_bucket_sectors_dirty(*a);
+	*write_time	= a->io_time[WRITE];
 
 	ret = data_type_movable(a->data_type) &&
 		a->fragmentation_lru &&
@@ -122,6 +125,7 @@ static void move_buckets_wait(struct moving_context *ctxt,
 
 		list->nr--;
 		list->sectors -= i->bucket.sectors;
+		atomic_dec(&ctxt->trans->c->copygc_buckets_in_flight);
 
 		ret = rhashtable_remove_fast(&list->table, &i->hash,
 					     bch_move_bucket_params);
@@ -132,26 +136,119 @@ static void move_buckets_wait(struct moving_context *ctxt,
 	bch2_trans_unlock_long(ctxt->trans);
 }
 
+/*
+ * Every device's copygc thread writes into the same allocator reserve - the
+ * buckets between the copygc and normal watermarks - so the number of buckets
+ * being evacuated at once, across all devices, is limited to the size of that
+ * reserve:
+ */
+static s64 copygc_buckets_budget(struct bch_fs *c)
+{
+	s64 budget = 0;
+
+	for_each_rw_member(c, ca)
+		budget += bch2_dev_buckets_reserved(ca, BCH_WATERMARK_normal) -
+			bch2_dev_buckets_reserved(ca, BCH_WATERMARK_copygc);
+
+	return budget - atomic_read(&c->copygc_buckets_in_flight);
+}
+
+static size_t copygc_nr_to_get(struct moving_context *ctxt,
+			       struct buckets_in_flight *list)
+{
+	struct bch_fs *c = ctxt->trans->c;
+	size_t nr = max_t(size_t, 16U, list->nr / 4);
+	s64 budget = copygc_buckets_budget(c);
+
+	if (budget < (s64) nr && list->nr) {
+		/* Over budget: let our own evacuations finish first */
+		move_buckets_wait(ctxt, list, true);
+		budget = copygc_buckets_budget(c);
+	}
+
+	/* Always allow one bucket through, so that we make forward progress: */
+	return clamp_t(s64, budget, 1, nr);
+}
+
 static bool bucket_in_flight(struct buckets_in_flight *list,
 			     struct move_bucket_key k)
 {
 	return rhashtable_lookup_fast(&list->table, &k, bch_move_bucket_params);
 }
 
-typedef DARRAY(struct move_bucket) move_buckets;
+struct copygc_bucket {
+	struct move_bucket	b;
+	u64			age;
+	u64			score;
+};
+
+typedef DARRAY(struct copygc_bucket) move_buckets;
+
+/*
+ * With the cost_benefit policy we look at this many times more candidates
+ * than we're going to evacuate, and take the best of them:
+ */
+#define COPYGC_CANDIDATES_RATIO		4
+
+/*
+ * Cost-benefit bucket selection, as in LFS: evacuating a bucket with
+ * utilization u costs reading it and rewriting u of it (1 + u), and gains 1 - u
+ * of free space. Weight that by the age of the data, since the longer data has
+ * gone without being overwritten the longer it's likely to stay live, and the
+ * more stable the space we free is:
+ *
+ *	benefit / cost = (1 - u) * age / (1 + u)
+ *
+ * @frag is the bucket's fragmentation LRU index, i.e. utilization scaled to
+ * 1 << 31, and @age is in units of the write io clock.
+ */
+static u64 copygc_bucket_score(u64 frag, u64 age)
+{
+	u64 u = min_t(u64, frag >> 15, 1U << 16);
+
+	age = min_t(u64, age, LRU_TIME_MAX);
+
+	return div64_u64(age * ((1U << 16) - u), (1U << 16) + u);
+}
+
+/*
+ * Data that has survived half the filesystem's capacity being written is cold;
+ * evacuate it to its own write point so that it isn't mixed in with data that
+ * will soon be overwritten:
+ */
+static bool copygc_bucket_is_cold(struct bch_fs *c, struct copygc_bucket *b)
+{
+	return c->opts.copygc_policy == BCH_COPYGC_POLICY_cost_benefit &&
+		b->age >= c->capacity >> 1;
+}
+
+static int copygc_bucket_score_cmp(const void *_l, const void *_r)
+{
+	const struct copygc_bucket *l = _l, *r = _r;
+
+	return cmp_int(r->score, l->score);
+}
 
 static int bch2_copygc_get_buckets(struct moving_context *ctxt,
+			struct bch_dev *ca,
 			struct buckets_in_flight *buckets_in_flight,
 			move_buckets *buckets)
 {
 	struct btree_trans *trans = ctxt->trans;
 	struct bch_fs *c = trans->c;
-	size_t nr_to_get = max_t(size_t, 16U, buckets_in_flight->nr / 4);
+	bool cost_benefit = c->opts.copygc_policy == BCH_COPYGC_POLICY_cost_benefit;
+	size_t nr_to_get, nr_to_scan;
 	size_t saw = 0, in_flight = 0, not_movable = 0, sectors = 0;
+	u64 now = bch2_current_io_time(c, WRITE);
 	int ret;
 
 	move_buckets_wait(ctxt, buckets_in_flight, false);
 
+	nr_to_get = copygc_nr_to_get(ctxt, buckets_in_flight);
+	nr_to_scan = cost_benefit
+		? nr_to_get * COPYGC_CANDIDATES_RATIO
+		: nr_to_get;
+
 	ret = bch2_btree_write_buffer_tryflush(trans);
 	if (bch2_err_matches(ret, EROFS))
 		return ret;
@@ -165,33 +262,53 @@ static int bch2_copygc_get_buckets(struct moving_context *ctxt,
 				  lru_pos(BCH_LRU_FRAGMENTATION_START, 0, 0),
 				  lru_pos(BCH_LRU_FRAGMENTATION_START, U64_MAX, LRU_TIME_MAX),
 				  0, k, ({
-		struct move_bucket b = { .k.bucket = u64_to_bucket(k.k->p.offset) };
+		struct copygc_bucket b = { .b.k.bucket = u64_to_bucket(k.k->p.offset) };
+		u64 frag = lru_pos_time(k.k->p), write_time = 0;
 		int ret2 = 0;
 
+		/* The fragmentation LRU is shared by all devices: */
+		if (b.b.k.bucket.inode != ca->dev_idx)
+			goto err;
+
 		saw++;
 
-		ret2 = bch2_bucket_is_movable(trans, &b, lru_pos_time(k.k->p));
+		ret2 = bch2_bucket_is_movable(trans, &b.b, frag, &write_time);
 		if (ret2 < 0)
 			goto err;
 
 		if (!ret2)
 			not_movable++;
-		else if (bucket_in_flight(buckets_in_flight, b.k))
+		else if (bucket_in_flight(buckets_in_flight, b.b.k))
 			in_flight++;
 		else {
+			b.age	= now > write_time ? now - write_time : 0;
+			b.score	= copygc_bucket_score(frag, b.age);
+
 			ret2 = darray_push(buckets, b);
 			if (ret2)
 				goto err;
-			sectors += b.sectors;
+			sectors += b.b.sectors;
 		}
 
-		ret2 = buckets->nr >= nr_to_get;
+		ret2 = buckets->nr >= nr_to_scan;
 err:
 		ret2;
 	}));
 
-	pr_debug("have: %zu (%zu) saw %zu in flight %zu not movable %zu got %zu (%zu)/%zu buckets ret %i",
-		 buckets_in_flight->nr, buckets_in_flight->sectors,
+	/*
+	 * The LRU walk gives us the emptiest buckets first; with cost_benefit,
+	 * reorder that window by score and keep the best:
+	 */
+	if (ret >= 0 && cost_benefit && buckets->nr > nr_to_get) {
+		sort(buckets->data, buckets->nr, sizeof(buckets->data[0]),
+		     copygc_bucket_score_cmp, NULL);
+
+		while (buckets->nr > nr_to_get)
+			sectors -= darray_pop(buckets).b.sectors;
+	}
+
+	pr_debug("%s: have: %zu (%zu) saw %zu in flight %zu not movable %zu got %zu (%zu)/%zu buckets ret %i",
+		 ca->name, buckets_in_flight->nr, buckets_in_flight->sectors,
 		 saw, in_flight, not_movable, buckets->nr, sectors, nr_to_get, ret);
 
 	return ret < 0 ? ret : 0;
@@ -199,6 +316,7 @@ err:
 
 noinline
 static int bch2_copygc(struct moving_context *ctxt,
+		       struct bch_dev *ca,
 		       struct buckets_in_flight *buckets_in_flight,
 		       bool *did_work)
 {
@@ -212,7 +330,7 @@ static int bch2_copygc(struct moving_context *ctxt,
 	u64 moved = atomic64_read(&ctxt->stats->sectors_moved);
 	int ret = 0;
 
-	ret = bch2_copygc_get_buckets(ctxt, buckets_in_flight, &buckets);
+	ret = bch2_copygc_get_buckets(ctxt, ca, buckets_in_flight, &buckets);
 	if (ret)
 		goto err;
 
@@ -220,7 +338,7 @@ static int bch2_copygc(struct moving_context *ctxt,
 		if (kthread_should_stop() || freezing(current))
 			break;
 
-		f = move_bucket_in_flight_add(buckets_in_flight, *i);
+		f = move_bucket_in_flight_add(buckets_in_flight, i->b);
 		ret = PTR_ERR_OR_ZERO(f);
 		if (ret == -EEXIST) { /* rare race: copygc_get_buckets returned same bucket more than once */
 			ret = 0;
@@ -231,6 +349,12 @@ static int bch2_copygc(struct moving_context *ctxt,
 			break;
 		}
 
+		atomic_inc(&c->copygc_buckets_in_flight);
+
+		ctxt->wp = copygc_bucket_is_cold(c, i)
+			? writepoint_ptr(&c->copygc_cold_write_point)
+			: writepoint_ptr(&c->copygc_write_point);
+
 		ret = bch2_evacuate_bucket(ctxt, f, f->bucket.k.bucket,
 					     f->bucket.k.gen, data_opts);
 		if (ret)
@@ -267,53 +391,62 @@ err:
  * often and continually reduce the amount of fragmented space as the device
  * fills up. So, we increase the threshold by half the current free space.
  */
-unsigned long bch2_copygc_wait_amount(struct bch_fs *c)
+unsigned long bch2_copygc_dev_wait_amount(struct bch_dev *ca)
 {
-	s64 wait = S64_MAX, fragmented_allowed, fragmented;
-
-	for_each_rw_member(c, ca) {
-		struct bch_dev_usage usage = bch2_dev_usage_read(ca);
-
-		fragmented_allowed = ((__dev_buckets_available(ca, usage, BCH_WATERMARK_stripe) *
-				       ca->mi.bucket_size) >> 1);
-		fragmented = 0;
-
-		for (unsigned i = 0; i < BCH_DATA_NR; i++)
-			if (data_type_movable(i))
-				fragmented += usage.d[i].fragmented;
+	struct bch_dev_usage usage = bch2_dev_usage_read(ca);
+	s64 fragmented_allowed = ((__dev_buckets_available(ca, usage, BCH_WATERMARK_stripe) *
+				   ca->mi.bucket_size) >> 1);
+	s64 fragmented = 0;
 
-		wait = min(wait, max(0LL, fragmented_allowed - fragmented));
-	}
+	for (unsigned i = 0; i < BCH_DATA_NR; i++)
+		if (data_type_movable(i))
+			fragmented += usage.d[i].fragmented;
 
-	return wait;
+	return max(0LL, fragmented_allowed - fragmented);
 }
 
-void bch2_copygc_wait_to_text(struct printbuf *out, struct bch_fs *c)
+static void bch2_dev_copygc_wait_to_text(struct printbuf *out, struct bch_dev *ca)
 {
-	printbuf_tabstop_push(out, 32);
-	prt_printf(out, "running:\t%u\n",		c->copygc_running);
-	prt_printf(out, "copygc_wait:\t%llu\n",		c->copygc_wait);
-	prt_printf(out, "copygc_wait_at:\t%llu\n",	c->copygc_wait_at);
+	struct bch_fs *c = ca->fs;
+
+	prt_printf(out, "running:\t%u\n",		ca->copygc_running);
+	prt_printf(out, "copygc_wait:\t%llu\n",		ca->copygc_wait);
+	prt_printf(out, "copygc_wait_at:\t%llu\n",	ca->copygc_wait_at);
 
 	prt_printf(out, "Currently waiting for:\t");
-	prt_human_readable_u64(out, max(0LL, c->copygc_wait -
+	prt_human_readable_u64(out, max(0LL, ca->copygc_wait -
 					atomic64_read(&c->io_clock[WRITE].now)) << 9);
 	prt_newline(out);
 
 	prt_printf(out, "Currently waiting since:\t");
 	prt_human_readable_u64(out, max(0LL,
 					atomic64_read(&c->io_clock[WRITE].now) -
-					c->copygc_wait_at) << 9);
+					ca->copygc_wait_at) << 9);
 	prt_newline(out);
 
 	prt_printf(out, "Currently calculated wait:\t");
-	prt_human_readable_u64(out, bch2_copygc_wait_amount(c));
+	prt_human_readable_u64(out, bch2_copygc_dev_wait_amount(ca));
 	prt_newline(out);
 }
 
+void bch2_copygc_wait_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	printbuf_tabstop_push(out, 32);
+	prt_printf(out, "buckets in flight:\t%u\n",
+		   atomic_read(&c->copygc_buckets_in_flight));
+
+	for_each_rw_member(c, ca) {
+		prt_printf(out, "%s:\n", ca->name);
+		printbuf_indent_add(out, 2);
+		bch2_dev_copygc_wait_to_text(out, ca);
+		printbuf_indent_sub(out, 2);
+	}
+}
+
 static int bch2_copygc_thread(void *arg)
 {
-	struct bch_fs *c = arg;
+	struct bch_dev *ca = arg;
+	struct bch_fs *c = ca->fs;
 	struct moving_context ctxt;
 	struct bch_move_stats move_stats;
 	struct io_clock *clock = &c->io_clock[WRITE];
@@ -337,6 +470,7 @@ static int bch2_copygc_thread(void *arg)
 	bch2_moving_ctxt_init(&ctxt, c, NULL, &move_stats,
 			      writepoint_ptr(&c->copygc_write_point),
 			      false);
+	ctxt.io_class = BCH_IO_CLASS_copygc;
 
 	while (!ret && !kthread_should_stop()) {
 		bool did_work = false;
@@ -357,11 +491,11 @@ static int bch2_copygc_thread(void *arg)
 		}
 
 		last = atomic64_read(&clock->now);
-		wait = bch2_copygc_wait_amount(c);
+		wait = bch2_copygc_dev_wait_amount(ca);
 
 		if (wait > clock->max_slop) {
-			c->copygc_wait_at = last;
-			c->copygc_wait = last + wait;
+			ca->copygc_wait_at = last;
+			ca->copygc_wait = last + wait;
 			move_buckets_wait(&ctxt, buckets, true);
 			trace_and_count(c, copygc_wait, c, wait, last + wait);
 			bch2_kthread_io_clock_wait(clock, last + wait,
@@ -369,22 +503,20 @@ static int bch2_copygc_thread(void *arg)
 			continue;
 		}
 
-		c->copygc_wait = 0;
+		ca->copygc_wait = 0;
 
-		c->copygc_running = true;
-		ret = bch2_copygc(&ctxt, buckets, &did_work);
-		c->copygc_running = false;
+		ca->copygc_running = true;
+		atomic_inc(&c->copygc_running);
+		ret = bch2_copygc(&ctxt, ca, buckets, &did_work);
+		atomic_dec(&c->copygc_running);
+		ca->copygc_running = false;
 
 		wake_up(&c->copygc_running_wq);
 
 		if (!wait && !did_work) {
-			u64 min_member_capacity = bch2_min_rw_member_capacity(c);
-
-			if (min_member_capacity == U64_MAX)
-				min_member_capacity = 128 * 2048;
-
 			bch2_trans_unlock_long(ctxt.trans);
-			bch2_kthread_io_clock_wait(clock, last + (min_member_capacity >> 6),
+			bch2_kthread_io_clock_wait(clock, last + (ca->mi.nbuckets *
+							ca->mi.bucket_size >> 6),
 					MAX_SCHEDULE_TIMEOUT);
 		}
 	}
@@ -399,21 +531,61 @@ static int bch2_copygc_thread(void *arg)
 	return 0;
 }
 
-void bch2_copygc_stop(struct bch_fs *c)
+void bch2_copygc_wakeup(struct bch_fs *c)
+{
+	rcu_read_lock();
+	for_each_member_device_rcu(c, ca, NULL)
+		if (ca->copygc_thread)
+			wake_up_process(ca->copygc_thread);
+	rcu_read_unlock();
+}
+
+void bch2_dev_copygc_stop(struct bch_dev *ca)
 {
-	if (c->copygc_thread) {
-		kthread_stop(c->copygc_thread);
-		put_task_struct(c->copygc_thread);
+	if (ca->copygc_thread) {
+		kthread_stop(ca->copygc_thread);
+		put_task_struct(ca->copygc_thread);
 	}
-	c->copygc_thread = NULL;
+	ca->copygc_thread = NULL;
 }
 
-int bch2_copygc_start(struct bch_fs *c)
+int bch2_dev_copygc_start(struct bch_fs *c, struct bch_dev *ca)
 {
 	struct task_struct *t;
 	int ret;
 
-	if (c->copygc_thread)
+	if (ca->copygc_thread || !c->copygc_started)
+		return 0;
+
+	t = kthread_create(bch2_copygc_thread, ca, "bch-copygc/%s", ca->name);
+	ret = PTR_ERR_OR_ZERO(t);
+	bch_err_msg(c, ret, "creating copygc thread for %s", ca->name);
+	if (ret)
+		return ret;
+
+	get_task_struct(t);
+
+	ca->copygc_thread = t;
+	wake_up_process(ca->copygc_thread);
+
+	return 0;
+}
+
+void bch2_copygc_stop(struct bch_fs *c)
+{
+	c->copygc_started = false;
+
+	for_each_member_device(c, ca)
+		bch2_dev_copygc_stop(ca);
+}
+
+/*
+ * Copygc runs one thread per device, each with its own moving_context and IO
+ * in flight, so that a slow device doesn't hold up copygc on the others:
+ */
+int bch2_copygc_start(struct bch_fs *c)
+{
+	if (c->copygc_started)
 		return 0;
 
 	if (c->opts.nochanges)
@@ -422,16 +594,16 @@ int bch2_copygc_start(struct bch_fs *c)
 	if (bch2_fs_init_fault("copygc_start"))
 		return -ENOMEM;
 
-	t = kthread_create(bch2_copygc_thread, c, "bch-copygc/%s", c->name);
-	ret = PTR_ERR_OR_ZERO(t);
-	bch_err_msg(c, ret, "creating copygc thread");
-	if (ret)
-		return ret;
-
-	get_task_struct(t);
+	c->copygc_started = true;
 
-	c->copygc_thread = t;
-	wake_up_process(c->copygc_thread);
+	for_each_rw_member(c, ca) {
+		int ret = bch2_dev_copygc_start(c, ca);
+		if (ret) {
+			percpu_ref_put(&ca->io_ref);
+			bch2_copygc_stop(c);
+			return ret;
+		}
+	}
 
 	return 0;
 }
@@ -439,5 +611,6 @@ int bch2_copygc_start(struct bch_fs *c)
 void bch2_fs_copygc_init(struct bch_fs *c)
 {
 	init_waitqueue_head(&c->copygc_running_wq);
-	c->copygc_running = false;
+	atomic_set(&c->copygc_running, 0);
+	atomic_set(&c->copygc_buckets_in_flight, 0);
 }
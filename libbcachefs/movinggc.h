@@ -2,9 +2,14 @@
 #ifndef _BCACHEFS_MOVINGGC_H
 #define _BCACHEFS_MOVINGGC_H
 
-unsigned long bch2_copygc_wait_amount(struct bch_fs *);
+unsigned long bch2_copygc_dev_wait_amount(struct bch_dev *);
 void bch2_copygc_wait_to_text(struct printbuf *, struct bch_fs *);
 
+void bch2_copygc_wakeup(struct bch_fs *);
+
+void bch2_dev_copygc_stop(struct bch_dev *);
+int bch2_dev_copygc_start(struct bch_fs *, struct bch_dev *);
+
 void bch2_copygc_stop(struct bch_fs *);
 int bch2_copygc_start(struct bch_fs *);
 void bch2_fs_copygc_init(struct bch_fs *);
@@ -2,6 +2,7 @@
 
 #include "bcachefs.h"
 #include "bkey_methods.h"
+#include "lock_profile.h"
 #include "nocow_locking.h"
 #include "util.h"
 
@@ -11,16 +12,54 @@ bool bch2_bucket_nocow_is_locked(struct bucket_nocow_lock_table *t, struct bpos
 {
 	u64 dev_bucket = bucket_to_u64(bucket);
 	struct nocow_lock_bucket *l = bucket_nocow_lock(t, dev_bucket);
+	struct nocow_lock_overflow *o;
+	bool ret = false;
 	unsigned i;
 
 	for (i = 0; i < ARRAY_SIZE(l->b); i++)
 		if (l->b[i] == dev_bucket && atomic_read(&l->l[i]))
 			return true;
-	return false;
+
+	if (likely(!READ_ONCE(l->overflow)))
+		return false;
+
+	spin_lock(&l->lock);
+	for (o = l->overflow; o; o = o->next)
+		if (o->b == dev_bucket && atomic_read(&o->l)) {
+			ret = true;
+			break;
+		}
+	spin_unlock(&l->lock);
+	return ret;
 }
 
 #define sign(v)		(v < 0 ? -1 : v > 0 ? 1 : 0)
 
+static void bucket_nocow_overflow_unlock(struct nocow_lock_bucket *l,
+					 u64 dev_bucket, int lock_val)
+{
+	struct nocow_lock_overflow **p, *o;
+	int v;
+
+	spin_lock(&l->lock);
+	for (p = &l->overflow; (o = *p); p = &o->next)
+		if (o->b == dev_bucket)
+			goto found;
+	BUG();
+found:
+	v = atomic_sub_return(lock_val, &o->l);
+	BUG_ON(v && sign(v) != lock_val);
+
+	if (!v)
+		*p = o->next;
+	spin_unlock(&l->lock);
+
+	if (!v) {
+		kfree(o);
+		closure_wake_up(&l->wait);
+	}
+}
+
 void bch2_bucket_nocow_unlock(struct bucket_nocow_lock_table *t, struct bpos bucket, int flags)
 {
 	u64 dev_bucket = bucket_to_u64(bucket);
@@ -38,13 +77,31 @@ void bch2_bucket_nocow_unlock(struct bucket_nocow_lock_table *t, struct bpos buc
 			return;
 		}
 
-	BUG();
+	bucket_nocow_overflow_unlock(l, dev_bucket, lock_val);
+}
+
+static bool nocow_lock_take(atomic_t *l, int lock_val)
+{
+	int v = atomic_read(l);
+
+	/* Held in the other mode? */
+	if (lock_val > 0 ? v < 0 : v > 0)
+		return false;
+
+	/* Overflow? */
+	if (v && sign(v + lock_val) != sign(v))
+		return false;
+
+	atomic_add(lock_val, l);
+	return true;
 }
 
 bool __bch2_bucket_nocow_trylock(struct nocow_lock_bucket *l,
 				 u64 dev_bucket, int flags)
 {
-	int v, lock_val = flags ? 1 : -1;
+	struct nocow_lock_overflow *o;
+	int lock_val = flags ? 1 : -1;
+	bool ret;
 	unsigned i;
 
 	spin_lock(&l->lock);
@@ -53,55 +110,106 @@ bool __bch2_bucket_nocow_trylock(struct nocow_lock_bucket *l,
 		if (l->b[i] == dev_bucket)
 			goto got_entry;
 
+	/*
+	 * An overflow entry for this bucket has to be found before we reuse an
+	 * inline entry - a bucket must never have two entries at once:
+	 */
+	for (o = l->overflow; o; o = o->next)
+		if (o->b == dev_bucket)
+			goto got_overflow;
+
 	for (i = 0; i < ARRAY_SIZE(l->b); i++)
 		if (!atomic_read(&l->l[i])) {
 			l->b[i] = dev_bucket;
-			goto take_lock;
+			goto got_entry;
 		}
-fail:
-	spin_unlock(&l->lock);
-	return false;
-got_entry:
-	v = atomic_read(&l->l[i]);
-	if (lock_val > 0 ? v < 0 : v > 0)
-		goto fail;
-take_lock:
-	v = atomic_read(&l->l[i]);
-	/* Overflow? */
-	if (v && sign(v + lock_val) != sign(v))
-		goto fail;
 
-	atomic_add(lock_val, &l->l[i]);
+	o = kmalloc(sizeof(*o), GFP_NOWAIT|__GFP_NOWARN);
+	if (!o) {
+		ret = false;
+		goto out;
+	}
+
+	o->b = dev_bucket;
+	atomic_set(&o->l, 0);
+	o->next = l->overflow;
+	l->overflow = o;
+	l->nr_overflowed++;
+got_overflow:
+	ret = nocow_lock_take(&o->l, lock_val);
+	goto out;
+got_entry:
+	ret = nocow_lock_take(&l->l[i], lock_val);
+out:
 	spin_unlock(&l->lock);
-	return true;
+	return ret;
 }
 
 void __bch2_bucket_nocow_lock(struct bucket_nocow_lock_table *t,
 			      struct nocow_lock_bucket *l,
 			      u64 dev_bucket, int flags)
 {
-	if (!__bch2_bucket_nocow_trylock(l, dev_bucket, flags)) {
-		struct bch_fs *c = container_of(t, struct bch_fs, nocow_locks);
+	struct bch_fs *c = container_of(t, struct bch_fs, nocow_locks);
+
+	if (likely(__bch2_bucket_nocow_trylock(l, dev_bucket, flags))) {
+		bch2_lock_profile_acquired(c, BCH_LOCK_nocow);
+	} else {
 		u64 start_time = local_clock();
 
 		__closure_wait_event(&l->wait, __bch2_bucket_nocow_trylock(l, dev_bucket, flags));
 		bch2_time_stats_update(&c->times[BCH_TIME_nocow_lock_contended], start_time);
+		bch2_lock_profile_contended(c, BCH_LOCK_nocow, start_time, _RET_IP_);
+
+		spin_lock(&l->lock);
+		l->nr_contended++;
+		l->contended_ns += local_clock() - start_time;
+		l->last_contended = dev_bucket;
+		spin_unlock(&l->lock);
 	}
 }
 
+static void nocow_lock_holder_to_text(struct printbuf *out, u64 dev_bucket, int v)
+{
+	bch2_bpos_to_text(out, u64_to_bucket(dev_bucket));
+	prt_printf(out, ": %s %u ", v < 0 ? "copy" : "update", abs(v));
+}
+
+#define NOCOW_LOCKS_MOST_CONTENDED	8
+
 void bch2_nocow_locks_to_text(struct printbuf *out, struct bucket_nocow_lock_table *t)
 
 {
-	unsigned i, nr_zero = 0;
+	struct nocow_lock_bucket *most_contended[NOCOW_LOCKS_MOST_CONTENDED] = {};
 	struct nocow_lock_bucket *l;
+	struct nocow_lock_overflow *o;
+	unsigned i, j, nr_zero = 0, nr_overflow = 0;
+	u64 nr_contended = 0, nr_overflowed = 0, contended_ns = 0;
 
-	for (l = t->l; l < t->l + ARRAY_SIZE(t->l); l++) {
+	out->atomic++;
+
+	for (l = t->l; l < t->l + (1U << t->bits); l++) {
 		unsigned v = 0;
 
+		spin_lock(&l->lock);
+
+		nr_contended	+= l->nr_contended;
+		nr_overflowed	+= l->nr_overflowed;
+		contended_ns	+= l->contended_ns;
+
+		for (i = 0; i < ARRAY_SIZE(most_contended); i++)
+			if (!most_contended[i] ||
+			    l->nr_contended > most_contended[i]->nr_contended) {
+				for (j = ARRAY_SIZE(most_contended) - 1; j > i; --j)
+					most_contended[j] = most_contended[j - 1];
+				most_contended[i] = l;
+				break;
+			}
+
 		for (i = 0; i < ARRAY_SIZE(l->l); i++)
 			v |= atomic_read(&l->l[i]);
 
-		if (!v) {
+		if (!v && !l->overflow) {
+			spin_unlock(&l->lock);
 			nr_zero++;
 			continue;
 		}
@@ -112,32 +220,86 @@ void bch2_nocow_locks_to_text(struct printbuf *out, struct bucket_nocow_lock_tab
 
 		for (i = 0; i < ARRAY_SIZE(l->l); i++) {
 			int v = atomic_read(&l->l[i]);
-			if (v) {
-				bch2_bpos_to_text(out, u64_to_bucket(l->b[i]));
-				prt_printf(out, ": %s %u ", v < 0 ? "copy" : "update", abs(v));
-			}
+			if (v)
+				nocow_lock_holder_to_text(out, l->b[i], v);
+		}
+
+		for (o = l->overflow; o; o = o->next) {
+			nocow_lock_holder_to_text(out, o->b, atomic_read(&o->l));
+			nr_overflow++;
 		}
+		spin_unlock(&l->lock);
 		prt_newline(out);
 	}
 
 	if (nr_zero)
 		prt_printf(out, "(%u empty entries)\n", nr_zero);
+
+	printbuf_tabstops_reset(out);
+	printbuf_tabstop_push(out, 24);
+
+	prt_newline(out);
+	prt_printf(out, "slots\t%u\n",			1U << t->bits);
+	prt_printf(out, "overflow entries\t%u\n",	nr_overflow);
+	prt_printf(out, "overflowed\t%llu\n",		nr_overflowed);
+	prt_printf(out, "contended\t%llu\n",		nr_contended);
+	prt_printf(out, "contended time\t");
+	bch2_pr_time_units(out, contended_ns);
+	prt_newline(out);
+
+	prt_printf(out, "most contended slots:\n");
+	printbuf_indent_add(out, 2);
+	for (i = 0; i < ARRAY_SIZE(most_contended); i++) {
+		l = most_contended[i];
+		if (!l || !l->nr_contended)
+			break;
+
+		spin_lock(&l->lock);
+		prt_printf(out, "%zu: contended %u overflowed %u time ",
+			   l - t->l, l->nr_contended, l->nr_overflowed);
+		bch2_pr_time_units(out, l->contended_ns);
+		prt_str(out, " last ");
+		bch2_bpos_to_text(out, u64_to_bucket(l->last_contended));
+		spin_unlock(&l->lock);
+		prt_newline(out);
+	}
+	printbuf_indent_sub(out, 2);
+
+	--out->atomic;
 }
 
 void bch2_fs_nocow_locking_exit(struct bch_fs *c)
 {
 	struct bucket_nocow_lock_table *t = &c->nocow_locks;
 
-	for (struct nocow_lock_bucket *l = t->l; l < t->l + ARRAY_SIZE(t->l); l++)
+	if (!t->l)
+		return;
+
+	for (struct nocow_lock_bucket *l = t->l; l < t->l + (1U << t->bits); l++) {
 		for (unsigned j = 0; j < ARRAY_SIZE(l->l); j++)
 			BUG_ON(atomic_read(&l->l[j]));
+		BUG_ON(l->overflow);
+	}
+
+	kvfree(t->l);
+	t->l = NULL;
 }
 
 int bch2_fs_nocow_locking_init(struct bch_fs *c)
 {
 	struct bucket_nocow_lock_table *t = &c->nocow_locks;
 
-	for (struct nocow_lock_bucket *l = t->l; l < t->l + ARRAY_SIZE(t->l); l++)
+	t->bits = clamp_t(unsigned,
+			  ilog2(roundup_pow_of_two(num_possible_cpus() *
+						   BUCKET_NOCOW_LOCKS_PER_CPU)),
+			  BUCKET_NOCOW_LOCKS_BITS_MIN,
+			  BUCKET_NOCOW_LOCKS_BITS_MAX);
+
+	t->l = kvzalloc(sizeof(t->l[0]) << t->bits, GFP_KERNEL);
+	if (!t->l)
+		return -BCH_ERR_ENOMEM_nocow_locking_init;
+
+	for (struct nocow_lock_bucket *l = t->l; l < t->l + (1U << t->bits); l++)
 		spin_lock_init(&l->lock);
 
 	return 0;
@@ -11,9 +11,7 @@
 static inline struct nocow_lock_bucket *bucket_nocow_lock(struct bucket_nocow_lock_table *t,
 							  u64 dev_bucket)
 {
-	unsigned h = hash_64(dev_bucket, BUCKET_NOCOW_LOCKS_BITS);
-
-	return t->l + (h & (BUCKET_NOCOW_LOCKS - 1));
+	return t->l + hash_64(dev_bucket, t->bits);
 }
 
 #define BUCKET_NOCOW_LOCK_UPDATE	(1 << 0)
@@ -42,6 +40,18 @@ static inline bool bch2_bucket_nocow_trylock(struct bucket_nocow_lock_table *t,
 	return __bch2_bucket_nocow_trylock(l, dev_bucket, flags);
 }
 
+static inline u32 bch2_bucket_nocow_seq(struct bucket_nocow_lock_table *t,
+					struct bpos bucket)
+{
+	return atomic_read(&bucket_nocow_lock(t, bucket_to_u64(bucket))->seq);
+}
+
+static inline void bch2_bucket_nocow_seq_bump(struct bucket_nocow_lock_table *t,
+					      struct bpos bucket)
+{
+	atomic_inc(&bucket_nocow_lock(t, bucket_to_u64(bucket))->seq);
+}
+
 void bch2_nocow_locks_to_text(struct printbuf *, struct bucket_nocow_lock_table *);
 
 void bch2_fs_nocow_locking_exit(struct bch_fs *);
@@ -2,19 +2,49 @@
 #ifndef _BCACHEFS_NOCOW_LOCKING_TYPES_H
 #define _BCACHEFS_NOCOW_LOCKING_TYPES_H
 
-#define BUCKET_NOCOW_LOCKS_BITS		10
-#define BUCKET_NOCOW_LOCKS		(1U << BUCKET_NOCOW_LOCKS_BITS)
+/*
+ * The table is sized by the number of CPUs, between BUCKET_NOCOW_LOCKS_BITS_MIN
+ * and BUCKET_NOCOW_LOCKS_BITS_MAX:
+ */
+#define BUCKET_NOCOW_LOCKS_BITS_MIN	10
+#define BUCKET_NOCOW_LOCKS_BITS_MAX	14
+#define BUCKET_NOCOW_LOCKS_PER_CPU	64
+
+/*
+ * When all the inline entries in a slot are held for other buckets, further
+ * buckets that hash to the same slot are chained off of it, instead of waiting
+ * for an entry to be freed:
+ */
+struct nocow_lock_overflow {
+	struct nocow_lock_overflow	*next;
+	u64				b;
+	atomic_t			l;
+};
 
 struct nocow_lock_bucket {
 	struct closure_waitlist		wait;
 	spinlock_t			lock;
 	u64				b[4];
 	atomic_t			l[4];
+	struct nocow_lock_overflow	*overflow;
+
+	/*
+	 * Bumped when an extent pointing into a bucket in this slot is
+	 * overwritten: lets cached extent mappings be revalidated without a
+	 * btree lookup:
+	 */
+	atomic_t			seq;
+
+	/* contention accounting, protected by lock: */
+	u32				nr_contended;
+	u32				nr_overflowed;
+	u64				contended_ns;
+	u64				last_contended;
 } __aligned(SMP_CACHE_BYTES);
 
 struct bucket_nocow_lock_table {
-	struct nocow_lock_bucket	l[BUCKET_NOCOW_LOCKS];
+	struct nocow_lock_bucket	*l;
+	unsigned			bits;
 };
 
 #endif /* _BCACHEFS_NOCOW_LOCKING_TYPES_H */
-
@@ -23,6 +23,11 @@ const char * const bch2_fsck_fix_opts[] = {
 	NULL
 };
 
+const char * const bch2_copygc_policies[] = {
+	BCH_COPYGC_POLICIES()
+	NULL
+};
+
 const char * const bch2_version_upgrade_opts[] = {
 	BCH_VERSION_UPGRADE_OPTS()
 	NULL
@@ -449,6 +454,11 @@ int bch2_opt_check_may_set(struct bch_fs *c, int id, u64 v)
 	case Opt_background_compression:
 		ret = bch2_check_set_has_compressed_data(c, v);
 		break;
+	case Opt_journal_compression:
+		ret = bch2_check_set_has_compressed_data(c, v);
+		if (!ret && v)
+			bch2_check_set_feature(c, BCH_FEATURE_journal_compression);
+		break;
 	case Opt_erasure_code:
 		if (v)
 			bch2_check_set_feature(c, BCH_FEATURE_ec);
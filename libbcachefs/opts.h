@@ -12,6 +12,7 @@ struct bch_fs;
 
 extern const char * const bch2_error_actions[];
 extern const char * const bch2_fsck_fix_opts[];
+extern const char * const bch2_copygc_policies[];
 extern const char * const bch2_version_upgrade_opts[];
 extern const char * const bch2_sb_features[];
 extern const char * const bch2_sb_compat[];
@@ -124,6 +125,16 @@ enum fsck_err_opts {
 #undef x
 };
 
+#define BCH_COPYGC_POLICIES()		\
+	x(greedy,	0)		\
+	x(cost_benefit,	1)
+
+enum bch_copygc_policy {
+#define x(t, n)	BCH_COPYGC_POLICY_##t = n,
+	BCH_COPYGC_POLICIES()
+#undef x
+};
+
 #define BCH_OPTS()							\
 	x(block_size,			u16,				\
 	  OPT_FS|OPT_FORMAT|						\
@@ -137,6 +148,13 @@ enum fsck_err_opts {
 	  OPT_UINT(512, 1U << 20),					\
 	  BCH_SB_BTREE_NODE_SIZE,	512,				\
 	  "size",	"Btree node size, default 256k")		\
+	x(btree_node_size_small,	u32,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME|					\
+	  OPT_HUMAN_READABLE|OPT_MUST_BE_POW_2,				\
+	  OPT_UINT(4096, 1U << 20),					\
+	  BCH2_NO_SB_OPT,		64 << 10,			\
+	  "size",	"Target leaf node size for btrees with heavy\n"\
+	  " random updates (alloc, lru, accounting), default 64k")	\
 	x(errors,			u8,				\
 	  OPT_FS|OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,			\
 	  OPT_STR(bch2_error_actions),					\
@@ -188,6 +206,11 @@ enum fsck_err_opts {
 	  OPT_FN(bch2_opt_compression),					\
 	  BCH_SB_BACKGROUND_COMPRESSION_TYPE,BCH_COMPRESSION_OPT_none,	\
 	  NULL,		NULL)						\
+	x(journal_compression,		u8,				\
+	  OPT_FS|OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,			\
+	  OPT_FN(bch2_opt_compression),					\
+	  BCH_SB_JOURNAL_COMPRESSION,	BCH_COMPRESSION_OPT_none,	\
+	  NULL,		"Compression for journal entries")		\
 	x(str_hash,			u8,				\
 	  OPT_FS|OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,			\
 	  OPT_STR(bch2_str_hash_opts),					\
@@ -198,6 +221,11 @@ enum fsck_err_opts {
 	  OPT_FN(bch2_opt_target),					\
 	  BCH_SB_METADATA_TARGET,	0,				\
 	  "(target)",	"Device or label for metadata writes")		\
+	x(journal_target,		u16,				\
+	  OPT_FS|OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,			\
+	  OPT_FN(bch2_opt_target),					\
+	  BCH_SB_JOURNAL_TARGET,	0,				\
+	  "(target)",	"Device or label for journal writes")		\
 	x(foreground_target,		u16,				\
 	  OPT_FS|OPT_INODE|OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,		\
 	  OPT_FN(bch2_opt_target),					\
@@ -208,6 +236,28 @@ enum fsck_err_opts {
 	  OPT_FN(bch2_opt_target),					\
 	  BCH_SB_BACKGROUND_TARGET,	0,				\
 	  "(target)",	"Device or label to move data to in the background")\
+	x(writeback_high_watermark,	u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, 100),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  "percent",	"Hold data on foreground_target until it's this\n"\
+			"full, then move it to background_target at\n"\
+			"foreground priority; 0 to always move it\n"\
+			"immediately")					\
+	x(writeback_low_watermark,	u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, 100),						\
+	  BCH2_NO_SB_OPT,		50,				\
+	  "percent",	"Once writeback_high_watermark is hit, keep\n"\
+			"moving data until foreground_target is only\n"\
+			"this full")					\
+	x(writeback_idle_delay,		u32,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, U32_MAX),						\
+	  BCH2_NO_SB_OPT,		30,				\
+	  "seconds",	"With writeback_high_watermark set, also move\n"\
+			"data when there have been no foreground writes\n"\
+			"for this long; 0 to disable")			\
 	x(promote_target,		u16,				\
 	  OPT_FS|OPT_INODE|OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,		\
 	  OPT_FN(bch2_opt_target),					\
@@ -233,6 +283,47 @@ enum fsck_err_opts {
 	  OPT_BOOL(),							\
 	  BCH_SB_INODES_USE_KEY_CACHE,	true,				\
 	  NULL,		"Use the btree key cache for the inodes btree")	\
+	x(key_cache_alloc_max,		u64,				\
+	  OPT_HUMAN_READABLE|OPT_FS|OPT_MOUNT|OPT_RUNTIME,		\
+	  OPT_UINT(0, U64_MAX),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  "size",	"Memory budget for cached alloc keys, 0 for no limit")\
+	x(key_cache_inodes_max,		u64,				\
+	  OPT_HUMAN_READABLE|OPT_FS|OPT_MOUNT|OPT_RUNTIME,		\
+	  OPT_UINT(0, U64_MAX),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  "size",	"Memory budget for cached inode keys, 0 for no limit")\
+	x(slow_op_threshold_ms,		u32,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, U32_MAX),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  "ms",		"Log data reads and writes and btree transactions\n"\
+			"slower than this, with a breakdown of where the\n"\
+			"time went (debugfs slow_ops); 0 to disable")	\
+	x(io_attrib,			u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,		false,				\
+	  NULL,		"Account IO to the cgroup that issued it\n"	\
+			"(sysfs internal/io_attrib)")			\
+	x(lock_profiling,		u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,		false,				\
+	  NULL,		"Count lock acquisitions, contention, wait and\n"\
+			"hold times (debugfs lock_profile)")		\
+	x(btree_trace,			u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,		false,				\
+	  NULL,		"Record btree updates for later replay\n"	\
+			"(debugfs btree_trace)")			\
+	x(lazy_freespace_init,		u8,				\
+	  OPT_FS|OPT_MOUNT,						\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,		false,				\
+	  NULL,		"Build the freespace btree for new devices in the\n"\
+			"background instead of at mount time")		\
 	x(btree_node_mem_ptr_optimization, u8,				\
 	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
 	  OPT_BOOL(),							\
@@ -265,6 +356,11 @@ enum fsck_err_opts {
 	  OPT_BOOL(),							\
 	  BCH2_NO_SB_OPT,		true,				\
 	  NULL,		"Enable inline data extents")			\
+	x(inline_data_max,		u16,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME|OPT_HUMAN_READABLE,		\
+	  OPT_UINT(0, (BKEY_VAL_U64s_MAX - 1) * sizeof(u64)),		\
+	  BCH2_NO_SB_OPT,		1024,				\
+	  "size",	"Largest file (in bytes) stored as an inline data extent (at most half the block size)")\
 	x(promote_whole_extents,	u8,				\
 	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
 	  OPT_BOOL(),							\
@@ -310,6 +406,126 @@ enum fsck_err_opts {
 	  OPT_BOOL(),							\
 	  BCH2_NO_SB_OPT,		true,				\
 	  NULL,		"Enable discard/TRIM support")			\
+	x(discard_max_rate,		u32,				\
+	  OPT_HUMAN_READABLE|OPT_FS|OPT_MOUNT|OPT_RUNTIME,		\
+	  OPT_UINT(0, U32_MAX),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  "bytes",	"Maximum rate at which discards are issued per\n"\
+			"device, in bytes per second, 0 for no limit")	\
+	x(discard_max_iops,		u32,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, U32_MAX),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  NULL,		"Maximum number of discards issued per second\n"\
+			"per device, 0 for no limit")			\
+	x(read_hedge_percentile,	u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, 99),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  NULL,		"If a replicated read hasn't completed within\n"\
+			"this percentile of the device's read latency,\n"\
+			"also read from another replica; 0 to disable")	\
+	x(promote_min_reads,		u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(1, 16),						\
+	  BCH2_NO_SB_OPT,		2,				\
+	  NULL,		"Only promote extents that have recently been\n"\
+			"read at least this many times")		\
+	x(promote_sequential_cutoff,	u32,				\
+	  OPT_HUMAN_READABLE|OPT_FS|OPT_MOUNT|OPT_RUNTIME,		\
+	  OPT_UINT(0, U32_MAX),						\
+	  BCH2_NO_SB_OPT,		4U << 20,			\
+	  "bytes",	"Don't promote reads from a file once it has\n"\
+			"been read sequentially for this many bytes,\n"\
+			"0 to disable")					\
+	x(extent_cache_size,		u32,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, 4096),						\
+	  BCH2_NO_SB_OPT,		64,				\
+	  NULL,		"Number of extents to cache in memory for\n"\
+			"frequently read files, so reads can skip\n"\
+			"the extents btree; 0 to disable")		\
+	x(io_sched_depth,		u32,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, U32_MAX),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  NULL,		"Number of data IOs in flight per device before\n"\
+			"IO is queued and scheduled by class weight;\n"\
+			"0 to disable")					\
+	x(io_weight_foreground,		u16,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(1, U16_MAX),						\
+	  BCH2_NO_SB_OPT,		100,				\
+	  NULL,		"Scheduling weight of foreground IO")		\
+	x(io_weight_copygc,		u16,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(1, U16_MAX),						\
+	  BCH2_NO_SB_OPT,		10,				\
+	  NULL,		"Scheduling weight of copygc IO")		\
+	x(io_weight_rebalance,		u16,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(1, U16_MAX),						\
+	  BCH2_NO_SB_OPT,		10,				\
+	  NULL,		"Scheduling weight of rebalance IO")		\
+	x(io_weight_move,		u16,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(1, U16_MAX),						\
+	  BCH2_NO_SB_OPT,		10,				\
+	  NULL,		"Scheduling weight of data job IO (migrate,\n"\
+			"rereplicate)")					\
+	x(copygc_policy,		u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_STR(bch2_copygc_policies),				\
+	  BCH2_NO_SB_OPT,		BCH_COPYGC_POLICY_greedy,	\
+	  NULL,		"How copygc picks buckets to evacuate:\n"	\
+			"greedy: least live data first\n"		\
+			"cost_benefit: weigh free space and data age\n"\
+			"against the cost of moving, and segregate\n"	\
+			"cold data")					\
+	x(stripe_compact_threshold,	u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, 100),						\
+	  BCH2_NO_SB_OPT,		50,				\
+	  NULL,		"Move data out of erasure coded stripes with at\n"\
+			"most this percentage of live data, so they can\n"\
+			"be freed; 0 to disable")			\
+	x(stripe_compact_max_rate,	u32,				\
+	  OPT_HUMAN_READABLE|OPT_FS|OPT_MOUNT|OPT_RUNTIME,		\
+	  OPT_UINT(0, U32_MAX),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  "bytes",	"Maximum rate of stripe compaction, in bytes per\n"\
+			"second, 0 for no limit")			\
+	x(scrub_interval,		u32,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, U32_MAX),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  "seconds",	"Scrub each device in the background every this\n"\
+			"many seconds, 0 to disable")			\
+	x(background_fsck_interval,	u32,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, U32_MAX),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  "seconds",	"Check the next slice of inodes, with their extents\n"\
+			"and dirents, in the background every this many\n"\
+			"seconds, 0 to disable")			\
+	x(scrub_max_rate,		u32,				\
+	  OPT_HUMAN_READABLE|OPT_FS|OPT_MOUNT|OPT_RUNTIME,		\
+	  OPT_UINT(0, U32_MAX),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  "bytes",	"Maximum rate at which scrub reads each device, in\n"\
+			"bytes per second, 0 for no limit")		\
+	x(dedup_max_rate,		u32,				\
+	  OPT_HUMAN_READABLE|OPT_FS|OPT_MOUNT|OPT_RUNTIME,		\
+	  OPT_UINT(0, U32_MAX),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  "bytes",	"Maximum rate at which dedup reads data to compare,\n"\
+			"in bytes per second, 0 for no limit")		\
+	x(btree_defrag_max_rate,	u32,				\
+	  OPT_HUMAN_READABLE|OPT_FS|OPT_MOUNT|OPT_RUNTIME,		\
+	  OPT_UINT(0, U32_MAX),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  "bytes",	"Maximum rate at which btree defrag rewrites nodes,\n"\
+			"in bytes per second, 0 for no limit")		\
 	x(verbose,			u8,				\
 	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
 	  OPT_BOOL(),							\
@@ -320,6 +536,12 @@ enum fsck_err_opts {
 	  OPT_UINT(1, U32_MAX),						\
 	  BCH_SB_JOURNAL_FLUSH_DELAY,	1000,				\
 	  NULL,		"Delay in milliseconds before automatic journal commits")\
+	x(journal_group_commit_target,	u32,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, 4095),						\
+	  BCH_SB_JOURNAL_GROUP_COMMIT_TARGET, 1000,			\
+	  NULL,		"Maximum time in microseconds a journal flush\n"\
+			"is held open to batch concurrent fsyncs")	\
 	x(journal_flush_disabled,	u8,				\
 	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
 	  OPT_BOOL(),							\
@@ -342,6 +564,14 @@ enum fsck_err_opts {
 	  OPT_UINT(1, 1024),						\
 	  BCH2_NO_SB_OPT,		32,				\
 	  NULL,		"Maximum number of IOs to keep in flight by the move path")\
+	x(move_target_latency,		u32,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, U32_MAX),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  "us",		"Target read latency for the move path, in\n"\
+			"microseconds: if set, move_ios_in_flight and\n"\
+			"move_bytes_in_flight are only the starting point,\n"\
+			"and are adjusted to keep reads at this latency")\
 	x(fsck,				u8,				\
 	  OPT_FS|OPT_MOUNT,						\
 	  OPT_BOOL(),							\
@@ -352,6 +582,18 @@ enum fsck_err_opts {
 	  OPT_UINT(20, 70),						\
 	  BCH2_NO_SB_OPT,		50,				\
 	  NULL,		"Maximum percentage of system ram fsck is allowed to pin")\
+	x(fsck_threads,			u8,				\
+	  OPT_FS|OPT_MOUNT,						\
+	  OPT_UINT(0, 64),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  NULL,		"Number of threads to split fsck passes across,\n"\
+			"by inode number range")			\
+	x(fsck_incremental,		u8,				\
+	  OPT_FS|OPT_MOUNT,						\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,		false,				\
+	  NULL,		"Only check allocation info for buckets the journal\n"\
+			"being replayed touched, unless errors are found")\
 	x(fix_errors,			u8,				\
 	  OPT_FS|OPT_MOUNT,						\
 	  OPT_FN(bch2_opt_fix_errors),					\
@@ -413,6 +655,12 @@ enum fsck_err_opts {
 	  OPT_BOOL(),							\
 	  BCH2_NO_SB_OPT,			true,			\
 	  NULL,		"Use O_DIRECT (userspace only)")		\
+	x(mmap_devices,			u8,				\
+	  OPT_FS|OPT_MOUNT,						\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,			false,			\
+	  NULL,		"Map devices into memory and read metadata from the\n"\
+			"mapping, with nochanges (userspace only)")	\
 	x(sb,				u64,				\
 	  OPT_MOUNT,							\
 	  OPT_UINT(0, S64_MAX),						\
@@ -494,7 +742,19 @@ enum fsck_err_opts {
 	  OPT_BOOL(),							\
 	  BCH2_NO_SB_OPT,		true,				\
 	  NULL,		"BTREE_ITER_prefetch casuse btree nodes to be\n"\
-	  " prefetched sequentially")
+	  " prefetched sequentially")				\
+	x(btree_cache_compressed,	u8,				\
+	  OPT_FS|OPT_MOUNT,						\
+	  OPT_BOOL(),							\
+	  BCH2_NO_SB_OPT,		false,				\
+	  NULL,		"Keep clean btree nodes evicted from the btree\n"\
+	  " node cache in memory, lz4 compressed")			\
+	x(btree_node_readahead,		u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(2, 128),						\
+	  BCH2_NO_SB_OPT,		32,				\
+	  "nodes",	"Maximum number of leaf nodes to read ahead of a\n"\
+	  " sequential BTREE_ITER_prefetch scan")
 
 #define BCH_DEV_OPT_SETTERS()						\
 	x(discard,		BCH_MEMBER_DISCARD)			\
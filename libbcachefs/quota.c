@@ -227,7 +227,7 @@ static int bch2_quota_check_limit(struct bch_fs *c,
 {
 	struct bch_memquota_type *q = &c->quotas[qtype];
 	struct memquota_counter *qc = &mq->c[counter];
-	u64 n = qc->v + v;
+	u64 n = atomic64_read(&qc->v) + v;
 
 	BUG_ON((s64) n < 0);
 
@@ -273,6 +273,43 @@ static int bch2_quota_check_limit(struct bch_fs *c,
 	return 0;
 }
 
+/*
+ * Fast path: if the new value doesn't cross a limit and there's no warning
+ * state to update, the counter can be updated without q->lock - that's
+ * only needed for enforcing limits and the warning/grace period state.
+ *
+ * This means a slowpath update racing with fastpath updates to the same qid
+ * can overshoot a hard limit by the amount of those concurrent updates -
+ * similar to the slack of a percpu_counter based scheme:
+ */
+static bool bch2_quota_acct_fast(struct memquota_counter *qc, s64 v,
+				 enum quota_acct_mode mode)
+{
+	s64 old = atomic64_read(&qc->v), new;
+
+	do {
+		new = old + v;
+
+		BUG_ON(new < 0);
+
+		if (mode == KEY_TYPE_QUOTA_NOCHECK)
+			continue;
+
+		if (v > 0) {
+			u64 hardlimit = READ_ONCE(qc->hardlimit);
+			u64 softlimit = READ_ONCE(qc->softlimit);
+
+			if ((hardlimit && hardlimit < new) ||
+			    (softlimit && softlimit < new))
+				return false;
+		} else if (READ_ONCE(qc->warning_issued)) {
+			return false;
+		}
+	} while (!atomic64_try_cmpxchg(&qc->v, &old, new));
+
+	return true;
+}
+
 int bch2_quota_acct(struct bch_fs *c, struct bch_qid qid,
 		    enum quota_counters counter, s64 v,
 		    enum quota_acct_mode mode)
@@ -292,6 +329,20 @@ int bch2_quota_acct(struct bch_fs *c, struct bch_qid qid,
 			return -ENOMEM;
 	}
 
+	unsigned done = 0;
+
+	for_each_set_qtype(c, i, q, qtypes) {
+		if (!bch2_quota_acct_fast(&mq[i]->c[counter], v, mode))
+			break;
+		done |= BIT(i);
+	}
+
+	if (done == qtypes)
+		return 0;
+
+	for_each_set_qtype(c, i, q, done)
+		atomic64_sub(v, &mq[i]->c[counter].v);
+
 	for_each_set_qtype(c, i, q, qtypes)
 		mutex_lock_nested(&q->lock, i);
 
@@ -302,7 +353,7 @@ int bch2_quota_acct(struct bch_fs *c, struct bch_qid qid,
 	}
 
 	for_each_set_qtype(c, i, q, qtypes)
-		mq[i]->c[counter].v += v;
+		atomic64_add(v, &mq[i]->c[counter].v);
 err:
 	for_each_set_qtype(c, i, q, qtypes)
 		mutex_unlock(&q->lock);
@@ -316,11 +367,11 @@ static void __bch2_quota_transfer(struct bch_memquota *src_q,
 				  struct bch_memquota *dst_q,
 				  enum quota_counters counter, s64 v)
 {
-	BUG_ON(v > src_q->c[counter].v);
-	BUG_ON(v + dst_q->c[counter].v < v);
+	BUG_ON(v > atomic64_read(&src_q->c[counter].v));
+	BUG_ON(v + atomic64_read(&dst_q->c[counter].v) < v);
 
-	src_q->c[counter].v -= v;
-	dst_q->c[counter].v += v;
+	atomic64_sub(v, &src_q->c[counter].v);
+	atomic64_add(v, &dst_q->c[counter].v);
 }
 
 int bch2_quota_transfer(struct bch_fs *c, unsigned qtypes,
@@ -350,13 +401,13 @@ int bch2_quota_transfer(struct bch_fs *c, unsigned qtypes,
 
 	for_each_set_qtype(c, i, q, qtypes) {
 		ret = bch2_quota_check_limit(c, i, dst_q[i], &msgs, Q_SPC,
-					     dst_q[i]->c[Q_SPC].v + space,
+					     atomic64_read(&dst_q[i]->c[Q_SPC].v) + space,
 					     mode);
 		if (ret)
 			goto err;
 
 		ret = bch2_quota_check_limit(c, i, dst_q[i], &msgs, Q_INO,
-					     dst_q[i]->c[Q_INO].v + 1,
+					     atomic64_read(&dst_q[i]->c[Q_INO].v) + 1,
 					     mode);
 		if (ret)
 			goto err;
@@ -759,13 +810,13 @@ unlock:
 
 static void __bch2_quota_get(struct qc_dqblk *dst, struct bch_memquota *src)
 {
-	dst->d_space		= src->c[Q_SPC].v << 9;
+	dst->d_space		= atomic64_read(&src->c[Q_SPC].v) << 9;
 	dst->d_spc_hardlimit	= src->c[Q_SPC].hardlimit << 9;
 	dst->d_spc_softlimit	= src->c[Q_SPC].softlimit << 9;
 	dst->d_spc_timer	= src->c[Q_SPC].timer;
 	dst->d_spc_warns	= src->c[Q_SPC].warns;
 
-	dst->d_ino_count	= src->c[Q_INO].v;
+	dst->d_ino_count	= atomic64_read(&src->c[Q_INO].v);
 	dst->d_ino_hardlimit	= src->c[Q_INO].hardlimit;
 	dst->d_ino_softlimit	= src->c[Q_INO].softlimit;
 	dst->d_ino_timer	= src->c[Q_INO].timer;
@@ -15,7 +15,11 @@ enum quota_acct_mode {
 };
 
 struct memquota_counter {
-	u64				v;
+	/*
+	 * Updated locklessly when no limit is being crossed, see
+	 * bch2_quota_acct():
+	 */
+	atomic64_t			v;
 	u64				hardlimit;
 	u64				softlimit;
 	s64				timer;
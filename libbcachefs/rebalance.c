@@ -9,6 +9,7 @@
 #include "buckets.h"
 #include "clock.h"
 #include "compress.h"
+#include "disk_accounting.h"
 #include "disk_groups.h"
 #include "errcode.h"
 #include "error.h"
@@ -314,6 +315,88 @@ static void rebalance_wait(struct bch_fs *c)
 	bch2_kthread_io_clock_wait(clock, r->wait_iotime_end, MAX_SCHEDULE_TIMEOUT);
 }
 
+/*
+ * Writeback cache policy: with writeback_high_watermark set, data written to
+ * foreground_target is held there rather than moved to background_target as
+ * soon as possible. It's moved once foreground_target passes the high
+ * watermark, at foreground priority, until it's back down to the low
+ * watermark - or whenever there haven't been any foreground writes for
+ * writeback_idle_delay seconds:
+ */
+static unsigned rebalance_foreground_percent_full(struct bch_fs *c, u64 *capacity)
+{
+	u16 target = READ_ONCE(c->opts.foreground_target);
+	u64 avail = 0, total = 0;
+
+	for_each_rw_member(c, ca)
+		if (bch2_dev_in_target(c, ca->dev_idx, target)) {
+			avail += dev_buckets_available(ca, BCH_WATERMARK_normal) *
+				ca->mi.bucket_size;
+			total += ca->mi.nbuckets_minus_first * ca->mi.bucket_size;
+		}
+
+	*capacity = total;
+	return total ? 100 - div64_u64(avail * 100, total) : 0;
+}
+
+static bool rebalance_foreground_idle(struct bch_fs *c)
+{
+	struct bch_fs_rebalance *r = &c->rebalance;
+	unsigned delay = READ_ONCE(c->opts.writeback_idle_delay);
+	u64 writes = percpu_u64_get(&c->counters[BCH_COUNTER_io_write_foreground]);
+
+	if (writes != r->foreground_writes) {
+		r->foreground_writes		= writes;
+		r->foreground_last_write	= jiffies;
+	}
+
+	return delay &&
+		time_after_eq(jiffies, r->foreground_last_write + delay * HZ);
+}
+
+static bool rebalance_should_hold(struct bch_fs *c, u64 *capacity)
+{
+	struct bch_fs_rebalance *r = &c->rebalance;
+	unsigned high	= READ_ONCE(c->opts.writeback_high_watermark);
+	unsigned low	= min_t(unsigned, READ_ONCE(c->opts.writeback_low_watermark), high);
+
+	*capacity = 0;
+
+	if (!high || !READ_ONCE(c->opts.foreground_target)) {
+		r->writeback_urgent = false;
+		return false;
+	}
+
+	r->foreground_percent_full = rebalance_foreground_percent_full(c, capacity);
+
+	if (r->foreground_percent_full >= high)
+		r->writeback_urgent = true;
+	else if (r->foreground_percent_full <= low)
+		r->writeback_urgent = false;
+
+	return !r->writeback_urgent && !rebalance_foreground_idle(c);
+}
+
+static void rebalance_hold(struct bch_fs *c, u64 capacity)
+{
+	struct bch_fs_rebalance *r = &c->rebalance;
+	struct io_clock *clock = &c->io_clock[WRITE];
+	u64 now = atomic64_read(&clock->now);
+	unsigned delay = READ_ONCE(c->opts.writeback_idle_delay);
+
+	/* recheck after every 1% of foreground_target is written: */
+	r->wait_iotime_end = now + max_t(u64, div_u64(capacity, 100), 2048);
+
+	if (r->state != BCH_REBALANCE_holding) {
+		r->wait_iotime_start	= now;
+		r->wait_wallclock_start	= ktime_get_real_ns();
+		r->state		= BCH_REBALANCE_holding;
+	}
+
+	bch2_kthread_io_clock_wait(clock, r->wait_iotime_end,
+				   min(delay ?: 10, 10U) * HZ);
+}
+
 static int do_rebalance(struct moving_context *ctxt)
 {
 	struct btree_trans *trans = ctxt->trans;
@@ -350,6 +433,18 @@ static int do_rebalance(struct moving_context *ctxt)
 		if (ret || !k.k)
 			break;
 
+		u64 capacity;
+		if (rebalance_should_hold(c, &capacity)) {
+			bch2_moving_ctxt_flush_all(ctxt);
+			bch2_trans_unlock_long(trans);
+			rebalance_hold(c, capacity);
+			continue;
+		}
+
+		ctxt->io_class = r->writeback_urgent
+			? BCH_IO_CLASS_foreground
+			: BCH_IO_CLASS_rebalance;
+
 		ret = k.k->type == KEY_TYPE_cookie
 			? do_rebalance_scan(ctxt, k.k->p.inode,
 					    le64_to_cpu(bkey_s_c_to_cookie(k).v->cookie))
@@ -392,6 +487,7 @@ static int bch2_rebalance_thread(void *arg)
 	bch2_moving_ctxt_init(&ctxt, c, NULL, &r->work_stats,
 			      writepoint_ptr(&c->rebalance_write_point),
 			      true);
+	ctxt.io_class = BCH_IO_CLASS_rebalance;
 
 	while (!kthread_should_stop() && !do_rebalance(&ctxt))
 		;
@@ -406,10 +502,28 @@ void bch2_rebalance_status_to_text(struct printbuf *out, struct bch_fs *c)
 	struct bch_fs_rebalance *r = &c->rebalance;
 
 	prt_str(out, bch2_rebalance_state_strs[r->state]);
+	if (r->writeback_urgent)
+		prt_str(out, " (foreground target over high watermark)");
 	prt_newline(out);
 	printbuf_indent_add(out, 2);
 
+	if (c->opts.writeback_high_watermark) {
+		struct disk_accounting_pos acc = {
+			.type = BCH_DISK_ACCOUNTING_rebalance_work_target,
+			.rebalance_work_target.target = c->opts.background_target,
+		};
+		u64 dirty;
+
+		bch2_accounting_mem_read(c, disk_accounting_pos_to_bpos(&acc), &dirty, 1);
+
+		prt_printf(out, "foreground full:   %u%%\n", r->foreground_percent_full);
+		prt_str(out, "dirty:             ");
+		bch2_prt_human_readable_s64(out, dirty << 9);
+		prt_newline(out);
+	}
+
 	switch (r->state) {
+	case BCH_REBALANCE_holding:
 	case BCH_REBALANCE_waiting: {
 		u64 now = atomic64_read(&c->io_clock[WRITE].now);
 
@@ -7,6 +7,18 @@
 int bch2_set_rebalance_needs_scan(struct bch_fs *, u64 inum);
 int bch2_set_fs_needs_rebalance(struct bch_fs *);
 
+/*
+ * New writes are added to the rebalance_work btree as they're written; existing
+ * extents only need to be rescanned when the options that determine where and
+ * how they're stored change:
+ */
+static inline bool bch2_rebalance_opts_changed(struct bch_io_opts old,
+					       struct bch_io_opts new)
+{
+	return old.background_target != new.background_target ||
+		background_compression(old) != background_compression(new);
+}
+
 static inline void rebalance_wakeup(struct bch_fs *c)
 {
 	struct task_struct *p;
@@ -8,7 +8,8 @@
 #define BCH_REBALANCE_STATES()		\
 	x(waiting)			\
 	x(working)			\
-	x(scanning)
+	x(scanning)			\
+	x(holding)
 
 enum bch_rebalance_states {
 #define x(t)	BCH_REBALANCE_##t,
@@ -31,7 +32,13 @@ struct bch_fs_rebalance {
 	struct bbpos			scan_end;
 	struct bch_move_stats		scan_stats;
 
+	/* writeback cache policy, see rebalance_should_hold(): */
+	unsigned			foreground_percent_full;
+	u64				foreground_writes;
+	unsigned long			foreground_last_write;
+
 	unsigned			enabled:1;
+	unsigned			writeback_urgent:1;
 };
 
 #endif /* _BCACHEFS_REBALANCE_TYPES_H */
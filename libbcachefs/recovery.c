@@ -244,6 +244,117 @@ static int journal_sort_seq_cmp(const void *_l, const void *_r)
 	return cmp_int(l->journal_seq, r->journal_seq);
 }
 
+/* Btrees with fewer journal keys than this are replayed by the main thread: */
+#define REPLAY_PARALLEL_MIN	512
+
+struct journal_replay_part {
+	struct closure		cl;
+	struct bch_fs		*c;
+	struct journal_key	*start, *end;
+	DARRAY(struct journal_key *) failed;
+	bool			immediate_flush;
+	int			ret;
+};
+
+/*
+ * Replay keys in sorted order - better locality of btree access - but some
+ * might fail if that would cause a journal deadlock; those are collected to
+ * be replayed later in journal order:
+ */
+static int journal_replay_part_sorted(struct btree_trans *trans,
+				      struct journal_replay_part *p)
+{
+	struct bch_fs *c = trans->c;
+
+	for (struct journal_key *k = p->start; k < p->end; k++) {
+		cond_resched();
+
+		/*
+		 * k->allocated means the key wasn't read in from the journal,
+		 * rather it was from early repair code
+		 */
+		if (k->allocated)
+			p->immediate_flush = true;
+
+		/* Skip fastpath if we're low on space in the journal */
+		int ret = c->journal.watermark ? -1 :
+			commit_do(trans, NULL, NULL,
+				  BCH_TRANS_COMMIT_no_enospc|
+				  BCH_TRANS_COMMIT_journal_reclaim|
+				  BCH_TRANS_COMMIT_skip_accounting_apply|
+				  (!k->allocated ? BCH_TRANS_COMMIT_no_journal_res : 0),
+			     bch2_journal_replay_key(trans, k));
+		BUG_ON(!ret && !k->overwritten && k->k->k.type != KEY_TYPE_accounting);
+		if (ret) {
+			ret = darray_push(&p->failed, k);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+static CLOSURE_CALLBACK(journal_replay_part_work)
+{
+	closure_type(p, struct journal_replay_part, cl);
+
+	p->ret = bch2_trans_run(p->c, journal_replay_part_sorted(trans, p));
+	closure_return(cl);
+}
+
+/*
+ * Journal keys are sorted by btree; different btrees are replayed on
+ * different threads:
+ */
+static int journal_replay_sorted(struct btree_trans *trans,
+				 struct journal_replay_part *parts,
+				 unsigned *nr_parts)
+{
+	struct bch_fs *c = trans->c;
+	struct journal_keys *keys = &c->journal_keys;
+	struct journal_key *k = keys->data;
+	struct closure cl;
+	bool async = false;
+
+	*nr_parts = 0;
+	closure_init_stack(&cl);
+
+	while (k < &darray_top(*keys)) {
+		struct journal_key *end = k;
+
+		while (end < &darray_top(*keys) && end->btree_id == k->btree_id)
+			end++;
+
+		BUG_ON(*nr_parts >= BTREE_ID_NR);
+		struct journal_replay_part *p = parts + (*nr_parts)++;
+		memset(p, 0, sizeof(*p));
+		p->c		= c;
+		p->start	= k;
+		p->end		= end;
+		k = end;
+
+		if (*nr_parts > 1 &&
+		    p->end - p->start >= REPLAY_PARALLEL_MIN) {
+			closure_call(&p->cl, journal_replay_part_work, system_unbound_wq, &cl);
+			async = true;
+		}
+	}
+
+	for (struct journal_replay_part *p = parts; p < parts + *nr_parts; p++)
+		if (p == parts ||
+		    p->end - p->start < REPLAY_PARALLEL_MIN)
+			p->ret = journal_replay_part_sorted(trans, p);
+
+	if (async)
+		closure_sync(&cl);
+
+	int ret = 0;
+	for (struct journal_replay_part *p = parts; p < parts + *nr_parts; p++)
+		ret = ret ?: p->ret;
+	return ret;
+}
+
 int bch2_journal_replay(struct bch_fs *c)
 {
 	struct journal_keys *keys = &c->journal_keys;
@@ -252,6 +363,8 @@ int bch2_journal_replay(struct bch_fs *c)
 	u64 start_seq	= c->journal_replay_seq_start;
 	u64 end_seq	= c->journal_replay_seq_start;
 	struct btree_trans *trans = NULL;
+	struct journal_replay_part *parts = NULL;
+	unsigned nr_parts = 0;
 	bool immediate_flush = false;
 	int ret = 0;
 
@@ -296,31 +409,24 @@ int bch2_journal_replay(struct bch_fs *c)
 	 * efficient - better locality of btree access -  but some might fail if
 	 * that would cause a journal deadlock.
 	 */
-	darray_for_each(*keys, k) {
-		cond_resched();
+	parts = kcalloc(BTREE_ID_NR, sizeof(*parts), GFP_KERNEL);
+	if (!parts) {
+		ret = -BCH_ERR_ENOMEM_journal_replay;
+		goto err;
+	}
 
-		/*
-		 * k->allocated means the key wasn't read in from the journal,
-		 * rather it was from early repair code
-		 */
-		if (k->allocated)
-			immediate_flush = true;
+	ret = journal_replay_sorted(trans, parts, &nr_parts);
 
-		/* Skip fastpath if we're low on space in the journal */
-		ret = c->journal.watermark ? -1 :
-			commit_do(trans, NULL, NULL,
-				  BCH_TRANS_COMMIT_no_enospc|
-				  BCH_TRANS_COMMIT_journal_reclaim|
-				  BCH_TRANS_COMMIT_skip_accounting_apply|
-				  (!k->allocated ? BCH_TRANS_COMMIT_no_journal_res : 0),
-			     bch2_journal_replay_key(trans, k));
-		BUG_ON(!ret && !k->overwritten && k->k->k.type != KEY_TYPE_accounting);
-		if (ret) {
-			ret = darray_push(&keys_sorted, k);
-			if (ret)
-				goto err;
-		}
+	for (struct journal_replay_part *p = parts; p < parts + nr_parts; p++) {
+		immediate_flush |= p->immediate_flush;
+		darray_for_each(p->failed, k)
+			ret = ret ?: darray_push(&keys_sorted, *k);
+		darray_exit(&p->failed);
 	}
+	kfree(parts);
+
+	if (ret)
+		goto err;
 
 	/*
 	 * Now, replay any remaining keys in the order in which they appear in
@@ -952,7 +1058,7 @@ use_clean:
 		printbuf_exit(&buf);
 
 		ret =   bch2_fs_read_write_early(c) ?:
-			bch2_scan_old_btree_nodes(c, &stats);
+			bch2_scan_old_btree_nodes(c, BBPOS_MIN, &stats);
 		if (ret)
 			goto err;
 		bch_info(c, "scanning for old btree nodes done");
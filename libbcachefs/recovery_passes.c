@@ -56,6 +56,20 @@ static struct recovery_pass_fn recovery_pass_fns[] = {
 #undef x
 };
 
+/*
+ * Passes listed here don't depend on the passes immediately before them, and
+ * may be run concurrently with them - each entry is the set of (earlier)
+ * passes that must have completed first. Passes not listed depend on every
+ * pass before them.
+ */
+static const u64 recovery_pass_deps[BCH_RECOVERY_PASS_NR] = {
+	[BCH_RECOVERY_PASS_check_btree_backpointers]	=
+		BIT_ULL(BCH_RECOVERY_PASS_check_alloc_info),
+	[BCH_RECOVERY_PASS_check_xattrs]		=
+		BIT_ULL(BCH_RECOVERY_PASS_check_inodes)|
+		BIT_ULL(BCH_RECOVERY_PASS_check_extents),
+};
+
 static const u8 passes_to_stable_map[] = {
 #define x(n, id, ...)	[BCH_RECOVERY_PASS_##n] = BCH_RECOVERY_PASS_STABLE_##n,
 	BCH_RECOVERY_PASSES()
@@ -97,8 +111,11 @@ u64 bch2_recovery_passes_from_stable(u64 v)
 int bch2_run_explicit_recovery_pass(struct bch_fs *c,
 				    enum bch_recovery_pass pass)
 {
+	int ret = 0;
+
+	spin_lock(&c->recovery_pass_lock);
 	if (c->recovery_passes_explicit & BIT_ULL(pass))
-		return 0;
+		goto out;
 
 	bch_info(c, "running explicit recovery pass %s (%u), currently at %s (%u)",
 		 bch2_recovery_passes[pass], pass,
@@ -109,14 +126,19 @@ int bch2_run_explicit_recovery_pass(struct bch_fs *c,
 	if (c->curr_recovery_pass >= pass) {
 		c->curr_recovery_pass = pass;
 		c->recovery_passes_complete &= (1ULL << pass) >> 1;
-		return -BCH_ERR_restart_recovery;
-	} else {
-		return 0;
+		ret = -BCH_ERR_restart_recovery;
 	}
+out:
+	spin_unlock(&c->recovery_pass_lock);
+	return ret;
 }
 
-int bch2_run_explicit_recovery_pass_persistent(struct bch_fs *c,
-					       enum bch_recovery_pass pass)
+/*
+ * Only mark a pass as required in the superblock, for it to run on the next
+ * mount - for errors found online by passes that can't run online:
+ */
+void bch2_recovery_pass_set_required(struct bch_fs *c,
+				     enum bch_recovery_pass pass)
 {
 	enum bch_recovery_pass_stable s = bch2_recovery_pass_to_stable(pass);
 
@@ -128,7 +150,12 @@ int bch2_run_explicit_recovery_pass_persistent(struct bch_fs *c,
 		bch2_write_super(c);
 	}
 	mutex_unlock(&c->sb_lock);
+}
 
+int bch2_run_explicit_recovery_pass_persistent(struct bch_fs *c,
+					       enum bch_recovery_pass pass)
+{
+	bch2_recovery_pass_set_required(c, pass);
 	return bch2_run_explicit_recovery_pass(c, pass);
 }
 
@@ -142,7 +169,7 @@ static void bch2_clear_recovery_pass_required(struct bch_fs *c,
 
 	if (test_bit_le64(s, ext->recovery_passes_required)) {
 		__clear_bit_le64(s, ext->recovery_passes_required);
-		bch2_write_super(c);
+		bch2_write_super_async(c);
 	}
 	mutex_unlock(&c->sb_lock);
 }
@@ -189,6 +216,91 @@ static int bch2_run_recovery_pass(struct bch_fs *c, enum bch_recovery_pass pass)
 	return 0;
 }
 
+/*
+ * Returns the end of the group of passes starting at @start that may be run
+ * concurrently:
+ */
+static unsigned recovery_pass_group_end(struct bch_fs *c, unsigned start)
+{
+	u64 group = BIT_ULL(start);
+	unsigned end = start + 1;
+
+	/* Interleaved prompts would be unreadable: */
+	if (c->opts.fix_errors == FSCK_FIX_ask)
+		return end;
+
+	while (end < BCH_RECOVERY_PASS_NR &&
+	       recovery_pass_deps[end] &&
+	       !(recovery_pass_deps[end] & group) &&
+	       !(c->opts.recovery_pass_last && end > c->opts.recovery_pass_last))
+		group |= BIT_ULL(end++);
+
+	return end;
+}
+
+struct recovery_pass_worker {
+	struct work_struct	work;
+	struct bch_fs		*c;
+	enum bch_recovery_pass	pass;
+	int			ret;
+};
+
+static void recovery_pass_work(struct work_struct *work)
+{
+	struct recovery_pass_worker *w =
+		container_of(work, struct recovery_pass_worker, work);
+	struct bch_fs *c = w->c;
+	struct recovery_pass_fn *p = recovery_pass_fns + w->pass;
+
+	w->ret = p->fn(c);
+
+	if (!w->ret && !(p->when & PASS_SILENT))
+		bch2_print(c, KERN_INFO bch2_log_msg(c, "%s done\n"),
+			   bch2_recovery_passes[w->pass]);
+}
+
+/*
+ * Run a set of passes from one group concurrently, each on its own worker -
+ * passes use their own btree transactions, so beyond that there's nothing to
+ * set up:
+ */
+static int bch2_run_recovery_passes_concurrent(struct bch_fs *c, u64 passes)
+{
+	if (is_power_of_2(passes))
+		return bch2_run_recovery_pass(c, __ffs64(passes));
+
+	struct recovery_pass_worker *w = kcalloc(hweight64(passes), sizeof(*w), GFP_KERNEL);
+	if (!w)
+		return -ENOMEM;
+
+	unsigned nr = 0;
+	for (unsigned i = 0; i < BCH_RECOVERY_PASS_NR; i++)
+		if (passes & BIT_ULL(i)) {
+			if (!(recovery_pass_fns[i].when & PASS_SILENT))
+				bch2_print(c, KERN_INFO bch2_log_msg(c, "%s...\n"),
+					   bch2_recovery_passes[i]);
+
+			INIT_WORK(&w[nr].work, recovery_pass_work);
+			w[nr].c		= c;
+			w[nr].pass	= i;
+			queue_work(system_unbound_wq, &w[nr].work);
+			nr++;
+		}
+
+	int ret = 0;
+	for (unsigned i = 0; i < nr; i++) {
+		flush_work(&w[i].work);
+
+		if (bch2_err_matches(w[i].ret, BCH_ERR_restart_recovery))
+			ret = w[i].ret;
+		else if (w[i].ret && !ret)
+			ret = w[i].ret;
+	}
+
+	kfree(w);
+	return ret;
+}
+
 int bch2_run_online_recovery_passes(struct bch_fs *c)
 {
 	int ret = 0;
@@ -224,10 +336,21 @@ int bch2_run_recovery_passes(struct bch_fs *c)
 		    c->curr_recovery_pass > c->opts.recovery_pass_last)
 			break;
 
-		if (should_run_recovery_pass(c, c->curr_recovery_pass)) {
-			unsigned pass = c->curr_recovery_pass;
+		unsigned pass = c->curr_recovery_pass, end = pass + 1;
+
+		if (should_run_recovery_pass(c, pass)) {
+			u64 passes = 0;
+
+			/*
+			 * curr_recovery_pass stays at the start of the group
+			 * until every pass in it has finished:
+			 */
+			end = recovery_pass_group_end(c, pass);
+			for (unsigned i = pass; i < end; i++)
+				if (should_run_recovery_pass(c, i))
+					passes |= BIT_ULL(i);
 
-			ret =   bch2_run_recovery_pass(c, c->curr_recovery_pass) ?:
+			ret =   bch2_run_recovery_passes_concurrent(c, passes) ?:
 				bch2_journal_flush(&c->journal);
 			if (bch2_err_matches(ret, BCH_ERR_restart_recovery) ||
 			    (ret && c->curr_recovery_pass < pass))
@@ -235,15 +358,15 @@ int bch2_run_recovery_passes(struct bch_fs *c)
 			if (ret)
 				break;
 
-			c->recovery_passes_complete |= BIT_ULL(c->curr_recovery_pass);
+			c->recovery_passes_complete |= passes;
 		}
 
-		c->recovery_pass_done = max(c->recovery_pass_done, c->curr_recovery_pass);
+		for (; c->curr_recovery_pass < end; c->curr_recovery_pass++) {
+			c->recovery_pass_done = max(c->recovery_pass_done, c->curr_recovery_pass);
 
-		if (!test_bit(BCH_FS_error, &c->flags))
-			bch2_clear_recovery_pass_required(c, c->curr_recovery_pass);
-
-		c->curr_recovery_pass++;
+			if (!test_bit(BCH_FS_error, &c->flags))
+				bch2_clear_recovery_pass_required(c, c->curr_recovery_pass);
+		}
 	}
 
 	return ret;
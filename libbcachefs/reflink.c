@@ -1,6 +1,5 @@
 // SPDX-License-Identifier: GPL-2.0
 #include "bcachefs.h"
-#include "bkey_buf.h"
 #include "btree_update.h"
 #include "buckets.h"
 #include "error.h"
@@ -339,9 +338,9 @@ int bch2_trigger_indirect_inline_data(struct btree_trans *trans,
 	return 0;
 }
 
-static int bch2_make_extent_indirect(struct btree_trans *trans,
-				     struct btree_iter *extent_iter,
-				     struct bkey_i *orig)
+int bch2_make_extent_indirect(struct btree_trans *trans,
+			      struct btree_iter *extent_iter,
+			      struct bkey_i *orig)
 {
 	struct bch_fs *c = trans->c;
 	struct btree_iter reflink_iter = { NULL };
@@ -354,8 +353,10 @@ static int bch2_make_extent_indirect(struct btree_trans *trans,
 	if (orig->k.type == KEY_TYPE_inline_data)
 		bch2_check_set_feature(c, BCH_FEATURE_reflink_inline_data);
 
+	/* with_updates: we may have already created indirect extents in this transaction */
 	bch2_trans_iter_init(trans, &reflink_iter, BTREE_ID_reflink, POS_MAX,
-			     BTREE_ITER_intent);
+			     BTREE_ITER_intent|
+			     BTREE_ITER_with_updates);
 	k = bch2_btree_iter_peek_prev(&reflink_iter);
 	ret = bkey_err(k);
 	if (ret)
@@ -382,10 +383,7 @@ static int bch2_make_extent_indirect(struct btree_trans *trans,
 	if (ret)
 		goto err;
 
-	/*
-	 * orig is in a bkey_buf which statically allocates 5 64s for the val,
-	 * so we know it will be big enough:
-	 */
+	/* orig was allocated with room for a reflink_p: */
 	orig->k.type = KEY_TYPE_reflink_p;
 	r_p = bkey_i_to_reflink_p(orig);
 	set_bkey_val_bytes(&r_p->k, sizeof(r_p->v));
@@ -425,6 +423,13 @@ static struct bkey_s_c get_next_src(struct btree_iter *iter, struct bpos end)
 	return ret ? bkey_s_c_err(ret) : bkey_s_c_null;
 }
 
+/*
+ * Maximum number of extents remapped per transaction commit - the limit is
+ * transaction size, each remapped extent may also split existing extents in
+ * the destination:
+ */
+#define REMAP_BATCH_MAX		32
+
 s64 bch2_remap_range(struct bch_fs *c,
 		     subvol_inum dst_inum, u64 dst_offset,
 		     subvol_inum src_inum, u64 src_offset,
@@ -434,10 +439,10 @@ s64 bch2_remap_range(struct bch_fs *c,
 	struct btree_trans *trans;
 	struct btree_iter dst_iter, src_iter;
 	struct bkey_s_c src_k;
-	struct bkey_buf new_dst, new_src;
 	struct bpos dst_start = POS(dst_inum.inum, dst_offset);
 	struct bpos src_start = POS(src_inum.inum, src_offset);
 	struct bpos dst_end = dst_start, src_end = src_start;
+	struct bpos dst_pos = dst_start;
 	struct bch_io_opts opts;
 	struct bpos src_want;
 	u64 dst_done = 0;
@@ -452,8 +457,6 @@ s64 bch2_remap_range(struct bch_fs *c,
 	dst_end.offset += remap_sectors;
 	src_end.offset += remap_sectors;
 
-	bch2_bkey_buf_init(&new_dst);
-	bch2_bkey_buf_init(&new_src);
 	trans = bch2_trans_get(c);
 
 	ret = bch2_inum_opts_get(trans, src_inum, &opts);
@@ -465,12 +468,20 @@ s64 bch2_remap_range(struct bch_fs *c,
 	bch2_trans_iter_init(trans, &dst_iter, BTREE_ID_extents, dst_start,
 			     BTREE_ITER_intent);
 
+	/*
+	 * Each transaction remaps up to REMAP_BATCH_MAX extents, with a single
+	 * inode update and commit; on transaction restart we go back to where
+	 * the last commit left off:
+	 */
 	while ((ret == 0 ||
 		bch2_err_matches(ret, BCH_ERR_transaction_restart)) &&
-	       bkey_lt(dst_iter.pos, dst_end)) {
+	       bkey_lt(dst_pos, dst_end)) {
 		struct disk_reservation disk_res = { 0 };
+		s64 batch_i_sectors_delta = 0;
+		unsigned nr = 0;
 
 		bch2_trans_begin(trans);
+		bch2_btree_iter_set_pos(&dst_iter, dst_pos);
 
 		if (fatal_signal_pending(current)) {
 			ret = -EINTR;
@@ -498,65 +509,112 @@ s64 bch2_remap_range(struct bch_fs *c,
 				continue;
 		}
 
-		dst_done = dst_iter.pos.offset - dst_start.offset;
-		src_want = POS(src_start.inode, src_start.offset + dst_done);
-		bch2_btree_iter_set_pos(&src_iter, src_want);
-
-		src_k = get_next_src(&src_iter, src_end);
-		ret = bkey_err(src_k);
-		if (ret)
-			continue;
-
-		if (bkey_lt(src_want, src_iter.pos)) {
-			ret = bch2_fpunch_at(trans, &dst_iter, dst_inum,
-					min(dst_end.offset,
-					    dst_iter.pos.offset +
-					    src_iter.pos.offset - src_want.offset),
-					i_sectors_delta);
-			continue;
-		}
-
-		if (src_k.k->type != KEY_TYPE_reflink_p) {
-			bch2_btree_iter_set_pos_to_extent_start(&src_iter);
-
-			bch2_bkey_buf_reassemble(&new_src, c, src_k);
-			src_k = bkey_i_to_s_c(new_src.k);
+		while (nr < REMAP_BATCH_MAX &&
+		       bkey_lt(dst_iter.pos, dst_end)) {
+			dst_done = dst_iter.pos.offset - dst_start.offset;
+			src_want = POS(src_start.inode, src_start.offset + dst_done);
+			bch2_btree_iter_set_pos(&src_iter, src_want);
 
-			ret = bch2_make_extent_indirect(trans, &src_iter,
-						new_src.k);
+			src_k = get_next_src(&src_iter, src_end);
+			ret = bkey_err(src_k);
 			if (ret)
-				continue;
-
-			BUG_ON(src_k.k->type != KEY_TYPE_reflink_p);
-		}
-
-		if (src_k.k->type == KEY_TYPE_reflink_p) {
-			struct bkey_s_c_reflink_p src_p =
-				bkey_s_c_to_reflink_p(src_k);
+				break;
+
+			if (bkey_lt(src_want, src_iter.pos)) {
+				/* bch2_fpunch_at() commits, finish the current batch first: */
+				if (nr)
+					break;
+
+				ret = bch2_fpunch_at(trans, &dst_iter, dst_inum,
+						min(dst_end.offset,
+						    dst_iter.pos.offset +
+						    src_iter.pos.offset - src_want.offset),
+						i_sectors_delta);
+				dst_pos = dst_iter.pos;
+				goto next;
+			}
+
+			bool made_indirect = false;
+
+			if (src_k.k->type != KEY_TYPE_reflink_p) {
+				bch2_btree_iter_set_pos_to_extent_start(&src_iter);
+
+				struct bkey_i *new_src =
+					bch2_trans_kmalloc(trans, max(bkey_bytes(src_k.k),
+								      sizeof(struct bkey_i_reflink_p)));
+				ret = PTR_ERR_OR_ZERO(new_src);
+				if (ret)
+					break;
+
+				bkey_reassemble(new_src, src_k);
+				src_k = bkey_i_to_s_c(new_src);
+
+				ret = bch2_make_extent_indirect(trans, &src_iter, new_src);
+				if (ret)
+					break;
+
+				BUG_ON(src_k.k->type != KEY_TYPE_reflink_p);
+				made_indirect = true;
+			}
+
+			struct bkey_s_c_reflink_p src_p = bkey_s_c_to_reflink_p(src_k);
 			struct bkey_i_reflink_p *dst_p =
-				bkey_reflink_p_init(new_dst.k);
+				bch2_trans_kmalloc(trans, sizeof(*dst_p));
+			ret = PTR_ERR_OR_ZERO(dst_p);
+			if (ret)
+				break;
+
+			bkey_reflink_p_init(&dst_p->k_i);
 
 			u64 offset = le64_to_cpu(src_p.v->idx) +
 				(src_want.offset -
 				 bkey_start_offset(src_k.k));
 
 			dst_p->v.idx = cpu_to_le64(offset);
-		} else {
-			BUG();
-		}
 
-		new_dst.k->k.p = dst_iter.pos;
-		bch2_key_resize(&new_dst.k->k,
-				min(src_k.k->p.offset - src_want.offset,
-				    dst_end.offset - dst_iter.pos.offset));
+			dst_p->k.p = dst_iter.pos;
+			bch2_key_resize(&dst_p->k,
+					min(src_k.k->p.offset - src_want.offset,
+					    dst_end.offset - dst_iter.pos.offset));
+
+			struct bpos next_pos;
+			ret =   bch2_bkey_set_needs_rebalance(c, &dst_p->k_i, &opts) ?:
+				bch2_extent_update_nocommit(trans, &dst_iter, &dst_p->k_i,
+							    &disk_res, &batch_i_sectors_delta,
+							    &next_pos, true);
+			if (ret)
+				break;
+
+			bch2_btree_iter_set_pos(&dst_iter, next_pos);
+			nr++;
+
+			/*
+			 * If we didn't remap all of an extent we just made
+			 * indirect, the rest of it is only a reflink_p in this
+			 * transaction's updates - commit before looking at it
+			 * again:
+			 */
+			if (made_indirect &&
+			    next_pos.offset - dst_start.offset + src_start.offset < src_k.k->p.offset)
+				break;
+		}
 
-		ret =   bch2_bkey_set_needs_rebalance(c, new_dst.k, &opts) ?:
-			bch2_extent_update(trans, dst_inum, &dst_iter,
-					new_dst.k, &disk_res,
-					new_i_size, i_sectors_delta,
-					true);
+		if (nr)
+			ret = ret ?:
+				bch2_extent_update_i_size_sectors(trans, &dst_iter,
+						min(dst_iter.pos.offset << 9, new_i_size),
+						batch_i_sectors_delta) ?:
+				bch2_trans_commit(trans, &disk_res, NULL,
+						  BCH_TRANS_COMMIT_no_check_rw|
+						  BCH_TRANS_COMMIT_no_enospc);
+		if (!ret) {
+			*i_sectors_delta += batch_i_sectors_delta;
+			dst_pos = dst_iter.pos;
+		}
+next:
 		bch2_disk_reservation_put(c, &disk_res);
 	}
+	bch2_btree_iter_set_pos(&dst_iter, dst_pos);
 	bch2_trans_iter_exit(trans, &dst_iter);
 	bch2_trans_iter_exit(trans, &src_iter);
 
@@ -587,8 +645,6 @@ s64 bch2_remap_range(struct bch_fs *c,
 	} while (bch2_err_matches(ret2, BCH_ERR_transaction_restart));
 err:
 	bch2_trans_put(trans);
-	bch2_bkey_buf_exit(&new_src, c);
-	bch2_bkey_buf_exit(&new_dst, c);
 
 	bch2_write_ref_put(c, BCH_WRITE_REF_reflink);
 
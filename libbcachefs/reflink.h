@@ -77,6 +77,8 @@ static inline __le64 *bkey_refcount(struct bkey_s k)
 	}
 }
 
+int bch2_make_extent_indirect(struct btree_trans *, struct btree_iter *,
+			      struct bkey_i *);
 s64 bch2_remap_range(struct bch_fs *, subvol_inum, u64,
 		     subvol_inum, u64, u64, u64, s64 *);
 
@@ -7,6 +7,7 @@
 #include "replicas.h"
 #include "super-io.h"
 
+#include <linux/jhash.h>
 #include <linux/sort.h>
 
 static int bch2_cpu_replicas_to_sb_replicas(struct bch_fs *,
@@ -39,10 +40,55 @@ void bch2_replicas_entry_sort(struct bch_replicas_entry_v1 *e)
 	bubble_sort(e->devs, e->nr_devs, u8_cmp);
 }
 
-static void bch2_cpu_replicas_sort(struct bch_replicas_cpu *r)
+static inline u32 replicas_entry_hash(struct bch_replicas_entry_v1 *e)
+{
+	return jhash(e, replicas_entry_bytes(e), 0);
+}
+
+/*
+ * Filesystems with many devices can have thousands of replicas entries; the
+ * hash table lets lookups skip the memcmp()s of an eytzinger search. It's
+ * optional - if we can't allocate it we just search the eytzinger tree:
+ */
+static void bch2_cpu_replicas_hash_build(struct bch_replicas_cpu *r, gfp_t gfp)
+{
+	kfree(r->hash);
+	r->hash		= NULL;
+	r->hash_mask	= 0;
+
+	if (!r->nr)
+		return;
+
+	unsigned size = roundup_pow_of_two(r->nr * 2);
+
+	r->hash = kcalloc(size, sizeof(r->hash[0]), gfp);
+	if (!r->hash)
+		return;
+
+	r->hash_mask = size - 1;
+
+	for (unsigned i = 0; i < r->nr; i++) {
+		u32 h = replicas_entry_hash(cpu_replicas_entry(r, i));
+
+		while (r->hash[h & r->hash_mask])
+			h++;
+		r->hash[h & r->hash_mask] = i + 1;
+	}
+}
+
+static void bch2_cpu_replicas_sort(struct bch_replicas_cpu *r, gfp_t gfp)
 {
 	eytzinger0_sort_r(r->entries, r->nr, r->entry_size,
 			  bch2_memcmp, NULL, (void *)(size_t)r->entry_size);
+	bch2_cpu_replicas_hash_build(r, gfp);
+}
+
+static void bch2_cpu_replicas_free(struct bch_replicas_cpu *r)
+{
+	kfree(r->hash);
+	kfree(r->entries);
+	r->hash		= NULL;
+	r->entries	= NULL;
 }
 
 static void bch2_replicas_entry_v0_to_text(struct printbuf *out,
@@ -210,7 +256,7 @@ cpu_replicas_add_entry(struct bch_fs *c,
 	       new_entry,
 	       replicas_entry_bytes(new_entry));
 
-	bch2_cpu_replicas_sort(&new);
+	bch2_cpu_replicas_sort(&new, GFP_KERNEL);
 	return new;
 }
 
@@ -222,6 +268,16 @@ static inline int __replicas_entry_idx(struct bch_replicas_cpu *r,
 	if (unlikely(entry_size > r->entry_size))
 		return -1;
 
+	if (likely(r->hash))
+		for (u32 h = replicas_entry_hash(search);; h++) {
+			u32 i = r->hash[h & r->hash_mask];
+
+			if (!i)
+				return -1;
+			if (!memcmp(cpu_replicas_entry(r, i - 1), search, entry_size))
+				return i - 1;
+		}
+
 #define entry_cmp(_l, _r)	memcmp(_l, _r, entry_size)
 	idx = eytzinger0_find(r->entries, r->nr, r->entry_size,
 			      entry_cmp, search);
@@ -319,8 +375,8 @@ static int bch2_mark_replicas_slowpath(struct bch_fs *c,
 out:
 	mutex_unlock(&c->sb_lock);
 
-	kfree(new_r.entries);
-	kfree(new_gc.entries);
+	bch2_cpu_replicas_free(&new_r);
+	bch2_cpu_replicas_free(&new_gc);
 
 	return ret;
 err:
@@ -351,8 +407,7 @@ int bch2_replicas_gc_end(struct bch_fs *c, int ret)
 	if (!ret)
 		swap(c->replicas, c->replicas_gc);
 
-	kfree(c->replicas_gc.entries);
-	c->replicas_gc.entries = NULL;
+	bch2_cpu_replicas_free(&c->replicas_gc);
 
 	percpu_up_write(&c->mark_lock);
 
@@ -403,7 +458,7 @@ int bch2_replicas_gc_start(struct bch_fs *c, unsigned typemask)
 			memcpy(cpu_replicas_entry(&c->replicas_gc, i++),
 			       e, c->replicas_gc.entry_size);
 
-	bch2_cpu_replicas_sort(&c->replicas_gc);
+	bch2_cpu_replicas_sort(&c->replicas_gc, GFP_KERNEL);
 	mutex_unlock(&c->sb_lock);
 
 	return 0;
@@ -465,14 +520,15 @@ retry:
 			       e, new.entry_size);
 	}
 
-	bch2_cpu_replicas_sort(&new);
+	/* under mark_lock: */
+	bch2_cpu_replicas_sort(&new, GFP_NOWAIT|__GFP_NOWARN);
 
 	ret = bch2_cpu_replicas_to_sb_replicas(c, &new);
 
 	if (!ret)
 		swap(c->replicas, new);
 
-	kfree(new.entries);
+	bch2_cpu_replicas_free(&new);
 
 	percpu_up_write(&c->mark_lock);
 
@@ -505,6 +561,8 @@ __bch2_sb_replicas_to_cpu_replicas(struct bch_sb_field_replicas *sb_r,
 
 	cpu_r->nr		= nr;
 	cpu_r->entry_size	= entry_size;
+	cpu_r->hash		= NULL;
+	cpu_r->hash_mask	= 0;
 
 	for_each_replicas_entry(sb_r, e) {
 		dst = cpu_replicas_entry(cpu_r, idx++);
@@ -537,6 +595,8 @@ __bch2_sb_replicas_v0_to_cpu_replicas(struct bch_sb_field_replicas_v0 *sb_r,
 
 	cpu_r->nr		= nr;
 	cpu_r->entry_size	= entry_size;
+	cpu_r->hash		= NULL;
+	cpu_r->hash_mask	= 0;
 
 	for_each_replicas_entry(sb_r, e) {
 		struct bch_replicas_entry_v1 *dst =
@@ -556,7 +616,7 @@ int bch2_sb_replicas_to_cpu_replicas(struct bch_fs *c)
 {
 	struct bch_sb_field_replicas *sb_v1;
 	struct bch_sb_field_replicas_v0 *sb_v0;
-	struct bch_replicas_cpu new_r = { 0, 0, NULL };
+	struct bch_replicas_cpu new_r = { 0 };
 	int ret = 0;
 
 	if ((sb_v1 = bch2_sb_field_get(c->disk_sb.sb, replicas)))
@@ -566,13 +626,13 @@ int bch2_sb_replicas_to_cpu_replicas(struct bch_fs *c)
 	if (ret)
 		return ret;
 
-	bch2_cpu_replicas_sort(&new_r);
+	bch2_cpu_replicas_sort(&new_r, GFP_KERNEL);
 
 	percpu_down_write(&c->mark_lock);
 	swap(c->replicas, new_r);
 	percpu_up_write(&c->mark_lock);
 
-	kfree(new_r.entries);
+	bch2_cpu_replicas_free(&new_r);
 
 	return 0;
 }
@@ -708,7 +768,7 @@ static int bch2_sb_replicas_validate(struct bch_sb *sb, struct bch_sb_field *f,
 		return ret;
 
 	ret = bch2_cpu_replicas_validate(&cpu_r, sb, err);
-	kfree(cpu_r.entries);
+	bch2_cpu_replicas_free(&cpu_r);
 	return ret;
 }
 
@@ -747,7 +807,7 @@ static int bch2_sb_replicas_v0_validate(struct bch_sb *sb, struct bch_sb_field *
 		return ret;
 
 	ret = bch2_cpu_replicas_validate(&cpu_r, sb, err);
-	kfree(cpu_r.entries);
+	bch2_cpu_replicas_free(&cpu_r);
 	return ret;
 }
 
@@ -880,6 +940,6 @@ unsigned bch2_dev_has_data(struct bch_fs *c, struct bch_dev *ca)
 
 void bch2_fs_replicas_exit(struct bch_fs *c)
 {
-	kfree(c->replicas.entries);
-	kfree(c->replicas_gc.entries);
+	bch2_cpu_replicas_free(&c->replicas);
+	bch2_cpu_replicas_free(&c->replicas_gc);
 }
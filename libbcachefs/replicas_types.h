@@ -6,6 +6,9 @@ struct bch_replicas_cpu {
 	unsigned		nr;
 	unsigned		entry_size;
 	struct bch_replicas_entry_v1 *entries;
+	/* open addressing table of entry index + 1, 0 if empty; optional: */
+	u32			*hash;
+	unsigned		hash_mask;
 };
 
 #endif /* _BCACHEFS_REPLICAS_TYPES_H */
@@ -5,6 +5,8 @@
 #include "bcachefs.h"
 #include "super-io.h"
 
+extern const char * const bch2_counter_names[];
+
 int bch2_sb_counters_to_cpu(struct bch_fs *);
 int bch2_sb_counters_from_cpu(struct bch_fs *);
 
@@ -81,7 +81,15 @@
 	x(trans_restart_write_buffer_flush,		75)	\
 	x(trans_restart_split_race,			76)	\
 	x(write_buffer_flush_slowpath,			77)	\
-	x(write_buffer_flush_sync,			78)
+	x(write_buffer_flush_sync,			78)	\
+	x(io_read_hedge,				79)	\
+	x(io_read_hedge_won,				80)	\
+	x(io_move_write_as_is,				81)	\
+	x(io_read_promote_hit,				82)	\
+	x(io_read_promote_miss,				83)	\
+	x(io_read_promote_rejected,			84)	\
+	x(io_read_promote_sequential,			85)	\
+	x(io_write_foreground,				86)
 
 enum bch_persistent_counters {
 #define x(t, n, ...) BCH_COUNTER_##t,
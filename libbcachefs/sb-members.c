@@ -393,7 +393,7 @@ void bch2_dev_errors_reset(struct bch_dev *ca)
 		m->errors_at_reset[i] = cpu_to_le64(atomic64_read(&ca->errors[i]));
 	m->errors_reset_time = cpu_to_le64(ktime_get_real_seconds());
 
-	bch2_write_super(c);
+	bch2_write_super_async(c);
 	mutex_unlock(&c->sb_lock);
 }
 
@@ -0,0 +1,456 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Scrub: read back everything on a device and verify checksums, repairing
+ * from other replicas or erasure coding where they don't match.
+ *
+ * We walk the backpointers btree, so reads are issued in the order data is
+ * laid out on the device, and we read each pointer's replica directly instead
+ * of going through the normal read path - which would read whichever replica
+ * it thinks is best. Repair is done by rewriting the bad replica with the
+ * normal move path, which reads from a good replica or reconstructs from the
+ * stripe.
+ */
+
+#include "bcachefs.h"
+#include "alloc_foreground.h"
+#include "backpointers.h"
+#include "bkey_buf.h"
+#include "btree_io.h"
+#include "btree_iter.h"
+#include "btree_update_interior.h"
+#include "checksum.h"
+#include "errcode.h"
+#include "error.h"
+#include "extents.h"
+#include "move.h"
+#include "scrub.h"
+
+#include <linux/freezer.h>
+#include <linux/kthread.h>
+#include <linux/sched/task.h>
+
+/* How often the background scrub thread checks for devices that are due: */
+#define SCRUB_POLL_INTERVAL	(60 * HZ)
+
+int bch2_dev_read_sync(struct bch_dev *ca, u64 sector, void *buf, unsigned sectors)
+{
+	unsigned nr_bvecs = buf_pages(buf, sectors << 9);
+	struct bio *bio = bio_kmalloc(nr_bvecs, GFP_KERNEL);
+	if (!bio)
+		return -BCH_ERR_ENOMEM_scrub;
+
+	bio_init(bio, ca->disk_sb.bdev, bio->bi_inline_vecs, nr_bvecs, REQ_OP_READ);
+	bio->bi_iter.bi_sector	= sector;
+	bch2_bio_map(bio, buf, sectors << 9);
+
+	int ret = submit_bio_wait(bio);
+	kfree(bio);
+	return ret;
+}
+
+static bool scrub_extent_good(struct bch_fs *c, struct bkey_s_c k,
+			      struct extent_ptr_decoded *p, void *buf)
+{
+	if (!p->crc.csum_type)
+		return true;
+
+	struct bch_csum csum = bch2_checksum(c, p->crc.csum_type,
+					     extent_nonce(k.k->version, p->crc),
+					     buf, p->crc.compressed_size << 9);
+	return !bch2_crc_cmp(csum, p->crc.csum);
+}
+
+/*
+ * Checksums of a btree node replica, as btree_node_read_done() checks them;
+ * bset headers aren't encrypted, so this doesn't need to decrypt:
+ */
+static bool scrub_btree_node_good(struct bch_fs *c, void *buf, unsigned sectors)
+{
+	struct btree_node *bn = buf;
+	unsigned offset = 0;
+
+	if (le64_to_cpu(bn->magic) != bset_magic(c))
+		return false;
+
+	while (offset < sectors) {
+		struct bset *i;
+		struct bch_csum want, got;
+		unsigned bset_sectors;
+
+		if (!offset) {
+			i = &bn->keys;
+			bset_sectors = vstruct_sectors(bn, c->block_bits);
+		} else {
+			struct btree_node_entry *bne = buf + (offset << 9);
+
+			i = &bne->keys;
+			if (i->seq != bn->keys.seq)
+				break;
+			bset_sectors = vstruct_sectors(bne, c->block_bits);
+		}
+
+		if (!bch2_checksum_type_valid(c, BSET_CSUM_TYPE(i)) ||
+		    offset + bset_sectors > sectors)
+			return false;
+
+		if (!offset) {
+			want	= bn->csum;
+			got	= csum_vstruct(c, BSET_CSUM_TYPE(i),
+					       btree_nonce(i, 0), bn);
+		} else {
+			struct btree_node_entry *bne = buf + (offset << 9);
+
+			want	= bne->csum;
+			got	= csum_vstruct(c, BSET_CSUM_TYPE(i),
+					       btree_nonce(i, offset << 9), bne);
+		}
+
+		if (bch2_crc_cmp(want, got))
+			return false;
+
+		offset += bset_sectors;
+	}
+
+	return true;
+}
+
+static int scrub_repair_btree_node(struct btree_trans *trans, struct bpos bp_pos,
+				   struct bch_backpointer bp, struct bkey_s_c old)
+{
+	struct btree_iter iter;
+	struct btree *b = bch2_backpointer_get_node(trans, &iter, bp_pos, bp);
+	int ret = PTR_ERR_OR_ZERO(b);
+	if (ret == -BCH_ERR_backpointer_to_overwritten_btree_node)
+		return 0;
+	if (ret || !b)
+		return ret;
+
+	/* The node in memory was read from a good replica: */
+	if (bkey_and_val_eq(bkey_i_to_s_c(&b->key), old))
+		ret = bch2_btree_node_rewrite(trans, &iter, b, 0);
+
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+static int scrub_repair_extent(struct moving_context *ctxt, struct bpos bp_pos,
+			       struct bch_backpointer bp, struct bkey_s_c old,
+			       unsigned ptr_bit)
+{
+	struct btree_trans *trans = ctxt->trans;
+	struct btree_iter iter;
+	struct bch_io_opts io_opts;
+	struct bkey_s_c k = bch2_backpointer_get_key(trans, &iter, bp_pos, bp, 0);
+	int ret = bkey_err(k);
+	if (ret || !k.k)
+		return ret;
+
+	/* raced with something else rewriting it: */
+	if (!bkey_and_val_eq(k, old))
+		goto out;
+
+	ret = bch2_move_get_io_opts_one(trans, &io_opts, k);
+	if (ret)
+		goto out;
+
+	struct data_update_opts data_opts = {
+		.target		= io_opts.background_target,
+		.rewrite_ptrs	= BIT(ptr_bit),
+	};
+
+	ret = bch2_move_extent(ctxt, NULL, &iter, k, io_opts, data_opts);
+out:
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+static int scrub_one(struct moving_context *ctxt, struct bch_dev *ca,
+		     struct bpos bp_pos, struct bch_backpointer bp,
+		     struct bkey_buf *sk)
+{
+	struct btree_trans *trans = ctxt->trans;
+	struct bch_fs *c = trans->c;
+	struct bch_move_stats *stats = ctxt->stats;
+	struct bpos bucket = bp_pos_to_bucket(ca, bp_pos);
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	int ret;
+
+	k = bch2_backpointer_get_key(trans, &iter, bp_pos, bp, 0);
+	ret = bkey_err(k);
+	if (ret == -BCH_ERR_backpointer_to_overwritten_btree_node)
+		return 0;
+	if (ret || !k.k)
+		return ret;
+
+	bch2_bkey_buf_reassemble(sk, c, k);
+	bch2_trans_iter_exit(trans, &iter);
+	k = bkey_i_to_s_c(sk->k);
+
+	/* Stripe keys have parity pointers; data blocks are scrubbed as extents: */
+	bool is_btree = bkey_is_btree_ptr(k.k);
+	if (!is_btree && !bkey_extent_is_direct_data(k.k))
+		return 0;
+
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const union bch_extent_entry *entry;
+	struct extent_ptr_decoded p, mine;
+	unsigned i = 0, ptr_bit = 0, nr_other = 0;
+	bool found = false;
+
+	bkey_for_each_ptr_decode(k.k, ptrs, p, entry) {
+		if (!found &&
+		    p.ptr.dev == ca->dev_idx &&
+		    PTR_BUCKET_NR(ca, &p.ptr) == bucket.offset) {
+			mine	= p;
+			ptr_bit	= i;
+			found	= true;
+		} else if (!p.ptr.cached) {
+			nr_other++;
+		}
+		i++;
+	}
+
+	/* Cached data doesn't need to be repaired, reads will just miss: */
+	if (!found || mine.ptr.cached)
+		return 0;
+
+	unsigned sectors = is_btree
+		? (btree_ptr_sectors_written(k) ?: btree_sectors(c))
+		: mine.crc.compressed_size;
+
+	void *buf = kvmalloc(sectors << 9, GFP_KERNEL);
+	if (!buf)
+		return -BCH_ERR_ENOMEM_scrub;
+
+	/* Don't hold btree locks while we do IO: */
+	bch2_trans_unlock_long(trans);
+
+	bool good;
+	ret = bch2_dev_read_sync(ca, mine.ptr.offset, buf, sectors);
+	if (ret) {
+		bch2_io_error(ca, BCH_MEMBER_ERROR_read);
+		good = false;
+	} else {
+		good = is_btree
+			? scrub_btree_node_good(c, buf, sectors)
+			: scrub_extent_good(c, k, &mine, buf);
+		if (!good)
+			bch2_io_error(ca, BCH_MEMBER_ERROR_checksum);
+	}
+	kvfree(buf);
+
+	this_cpu_add(ca->io_done->sectors[READ][is_btree ? BCH_DATA_btree : BCH_DATA_user],
+		     sectors);
+	if (ctxt->rate)
+		bch2_ratelimit_increment(ctxt->rate, sectors);
+	atomic64_add(sectors, &stats->sectors_seen);
+
+	if (good)
+		return 0;
+
+	struct printbuf buf2 = PRINTBUF;
+	prt_printf(&buf2, "scrub: %s at sector %llu on %s: ",
+		   ret ? bch2_err_str(ret) : "checksum error",
+		   (u64) mine.ptr.offset, ca->name);
+	bch2_bkey_val_to_text(&buf2, c, k);
+
+	if (!nr_other && !mine.has_ec) {
+		bch_err_ratelimited(c, "%s\n  no other copy to repair from", buf2.buf);
+		printbuf_exit(&buf2);
+		atomic64_add(sectors, &stats->sectors_error_uncorrected);
+		return 0;
+	}
+
+	bch_err_ratelimited(c, "%s\n  repairing", buf2.buf);
+	printbuf_exit(&buf2);
+
+	do {
+		bch2_trans_begin(trans);
+
+		ret = is_btree
+			? scrub_repair_btree_node(trans, bp_pos, bp, k)
+			: scrub_repair_extent(ctxt, bp_pos, bp, k, ptr_bit);
+	} while (bch2_err_matches(ret, BCH_ERR_transaction_restart));
+
+	if (ret) {
+		bch_err_msg(c, ret, "repairing scrub error");
+		atomic64_add(sectors, &stats->sectors_error_uncorrected);
+		/* keep going, try the rest of the device: */
+		return bch2_err_matches(ret, EROFS) ? ret : 0;
+	}
+
+	atomic64_add(sectors, &stats->sectors_error_corrected);
+	return 0;
+}
+
+int bch2_dev_scrub(struct bch_fs *c, unsigned dev, struct bpos start,
+		   struct bch_move_stats *stats)
+{
+	bool is_kthread = current->flags & PF_KTHREAD;
+	struct bch_ratelimit rate;
+	struct moving_context ctxt;
+	struct bkey_buf sk;
+	int ret = 0;
+
+	struct bch_dev *ca = bch2_dev_get_ioref(c, dev, READ);
+	if (!ca)
+		return -EINVAL;
+
+	u32 max_rate = READ_ONCE(c->opts.scrub_max_rate);
+	if (max_rate) {
+		rate.rate = max(max_rate >> 9, 1U);
+		bch2_ratelimit_reset(&rate);
+	}
+
+	bch2_bkey_buf_init(&sk);
+	bch2_moving_ctxt_init(&ctxt, c, max_rate ? &rate : NULL, stats,
+			      writepoint_hashed((unsigned long) current),
+			      false);
+	struct btree_trans *trans = ctxt.trans;
+
+	stats->data_type = BCH_DATA_user;
+
+	struct bpos bp_pos	= start.inode == dev ? start : POS(dev, 0);
+	struct bpos bp_end	= POS(dev, U64_MAX);
+
+	while (!(ret = bch2_move_ratelimit(&ctxt))) {
+		struct btree_iter iter;
+		struct bkey_s_c k;
+
+		if (is_kthread && kthread_should_stop())
+			break;
+
+		stats->pos = BBPOS(BTREE_ID_backpointers, bp_pos);
+
+		ret = bch2_data_job_checkpoint(&ctxt);
+		if (ret)
+			break;
+
+		bch2_trans_begin(trans);
+
+		bch2_trans_iter_init(trans, &iter, BTREE_ID_backpointers, bp_pos, 0);
+		k = bch2_btree_iter_peek_upto(&iter, bp_end);
+		ret = bkey_err(k);
+		bch2_trans_iter_exit(trans, &iter);
+
+		if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+			continue;
+		if (ret || !k.k)
+			break;
+
+		bp_pos = k.k->p;
+
+		if (k.k->type == KEY_TYPE_backpointer) {
+			struct bch_backpointer bp = *bkey_s_c_to_backpointer(k).v;
+
+			ret = scrub_one(&ctxt, ca, bp_pos, bp, &sk);
+			if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+				continue;
+			if (ret)
+				break;
+		}
+
+		bp_pos = bpos_nosnap_successor(bp_pos);
+	}
+
+	/* kthread stopping: */
+	if (ret > 0)
+		ret = 0;
+
+	bch2_moving_ctxt_exit(&ctxt);
+	bch2_bkey_buf_exit(&sk, c);
+	percpu_ref_put(&ca->io_ref);
+	bch_err_fn(c, ret);
+	return ret;
+}
+
+/*
+ * Background scrub: every scrub_interval seconds each device gets a scrub
+ * data job, which is checkpointed like any other data job - an interrupted
+ * scrub picks up where it left off.
+ */
+static int bch2_scrub_thread(void *arg)
+{
+	struct bch_fs *c = arg;
+
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		u32 interval = READ_ONCE(c->opts.scrub_interval);
+
+		if (interval)
+			for_each_rw_member(c, ca) {
+				if (kthread_should_stop()) {
+					percpu_ref_put(&ca->io_ref);
+					break;
+				}
+
+				if (ktime_get_real_seconds() < ca->scrub_last + interval)
+					continue;
+
+				struct bch_ioctl_data op = {
+					.op		= BCH_DATA_OP_scrub,
+					.scrub.dev	= ca->dev_idx,
+				};
+				struct bch_move_stats stats;
+
+				int ret = bch2_data_job(c, &stats, op);
+				bch_err_msg(c, ret, "background scrub of %s", ca->name);
+
+				if (!kthread_should_stop())
+					ca->scrub_last = ktime_get_real_seconds();
+			}
+
+		try_to_freeze();
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop()) {
+			__set_current_state(TASK_RUNNING);
+			break;
+		}
+		schedule_timeout(SCRUB_POLL_INTERVAL);
+		__set_current_state(TASK_RUNNING);
+	}
+
+	return 0;
+}
+
+void bch2_scrub_stop(struct bch_fs *c)
+{
+	if (c->scrub_thread) {
+		kthread_stop(c->scrub_thread);
+		put_task_struct(c->scrub_thread);
+	}
+	c->scrub_thread = NULL;
+}
+
+int bch2_scrub_start(struct bch_fs *c)
+{
+	struct task_struct *t;
+	int ret;
+
+	if (c->scrub_thread)
+		return 0;
+
+	if (c->opts.nochanges)
+		return 0;
+
+	/* Don't scrub everything right away on every mount: */
+	u64 now = ktime_get_real_seconds();
+	for_each_member_device(c, ca)
+		ca->scrub_last = now;
+
+	t = kthread_create(bch2_scrub_thread, c, "bch-scrub/%s", c->name);
+	ret = PTR_ERR_OR_ZERO(t);
+	bch_err_msg(c, ret, "creating scrub thread");
+	if (ret)
+		return ret;
+
+	get_task_struct(t);
+
+	c->scrub_thread = t;
+	wake_up_process(c->scrub_thread);
+
+	return 0;
+}
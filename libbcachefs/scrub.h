@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_SCRUB_H
+#define _BCACHEFS_SCRUB_H
+
+struct bch_move_stats;
+
+int bch2_dev_read_sync(struct bch_dev *, u64, void *, unsigned);
+int bch2_dev_scrub(struct bch_fs *, unsigned, struct bpos, struct bch_move_stats *);
+
+void bch2_scrub_stop(struct bch_fs *);
+int bch2_scrub_start(struct bch_fs *);
+
+#endif /* _BCACHEFS_SCRUB_H */
@@ -163,11 +163,51 @@ u64 SipHash_End(SIPHASH_CTX *ctx, int rc, int rf)
 	return r;
 }
 
+/*
+ * One shot version: same result as SipHash_Init(), one SipHash_Update() and
+ * SipHash_End(), but without copying through ctx->buf - for short strings (e.g.
+ * filenames), that copying is a good fraction of the cost:
+ */
 u64 SipHash(const SIPHASH_KEY *key, int rc, int rf, const void *src, size_t len)
 {
 	SIPHASH_CTX ctx;
+	const u8 *ptr = src, *end = ptr + (len & ~7UL);
+	u64 m = (u64) (len & 0xff) << 56;
 
 	SipHash_Init(&ctx, key);
-	SipHash_Update(&ctx, rc, rf, src, len);
-	return SipHash_End(&ctx, rc, rf);
+
+	for (; ptr < end; ptr += 8)
+		SipHash_CRounds(&ctx, ptr, rc);
+
+	switch (len & 7) {
+	case 7:
+		m |= (u64) ptr[6] << 48;
+		fallthrough;
+	case 6:
+		m |= (u64) ptr[5] << 40;
+		fallthrough;
+	case 5:
+		m |= (u64) ptr[4] << 32;
+		fallthrough;
+	case 4:
+		m |= (u64) get_unaligned_le32(ptr);
+		break;
+	case 3:
+		m |= (u64) ptr[2] << 16;
+		fallthrough;
+	case 2:
+		m |= (u64) get_unaligned_le16(ptr);
+		break;
+	case 1:
+		m |= (u64) ptr[0];
+	}
+
+	ctx.v[3] ^= m;
+	SipHash_Rounds(&ctx, rc);
+	ctx.v[0] ^= m;
+
+	ctx.v[2] ^= 0xff;
+	SipHash_Rounds(&ctx, rf);
+
+	return (ctx.v[0] ^ ctx.v[1]) ^ (ctx.v[2] ^ ctx.v[3]);
 }
@@ -95,6 +95,10 @@ static inline void six_set_owner(struct six_lock *lock, enum six_lock_type type,
 	}
 }
 
+#ifdef __KERNEL__
+
+#define six_readers_add(_lock, _nr)	this_cpu_add(*(_lock)->readers, _nr)
+
 static inline unsigned pcpu_read_count(struct six_lock *lock)
 {
 	unsigned read_count = 0;
@@ -105,6 +109,59 @@ static inline unsigned pcpu_read_count(struct six_lock *lock)
 	return read_count;
 }
 
+static inline unsigned __percpu *six_readers_alloc(void)
+{
+	return alloc_percpu(unsigned);
+}
+
+#else
+
+/*
+ * Userspace doesn't have real percpu variables: reader counts are sharded by
+ * thread instead, a cacheline per shard, so that read locks taken by different
+ * threads don't bounce a shared cacheline.
+ *
+ * A read lock may be released by a different thread than took it - that's
+ * fine, as with percpu counts only the sum is meaningful:
+ */
+#define SIX_READER_SHARDS	16
+
+struct six_reader_shard {
+	atomic_t		v;
+} ____cacheline_aligned;
+
+static __thread int six_readers_this_shard = -1;
+static atomic_t six_readers_next_shard;
+
+static inline void six_readers_add(struct six_lock *lock, int nr)
+{
+	struct six_reader_shard *s = (void *) lock->readers;
+
+	if (unlikely(six_readers_this_shard < 0))
+		six_readers_this_shard = atomic_inc_return(&six_readers_next_shard) %
+			SIX_READER_SHARDS;
+
+	atomic_add(nr, &s[six_readers_this_shard].v);
+}
+
+static inline unsigned pcpu_read_count(struct six_lock *lock)
+{
+	struct six_reader_shard *s = (void *) lock->readers;
+	unsigned read_count = 0;
+
+	for (unsigned i = 0; i < SIX_READER_SHARDS; i++)
+		read_count += atomic_read(&s[i].v);
+	return read_count;
+}
+
+static inline unsigned __percpu *six_readers_alloc(void)
+{
+	return (void *) kcalloc(SIX_READER_SHARDS,
+				sizeof(struct six_reader_shard), GFP_KERNEL);
+}
+
+#endif
+
 /*
  * __do_six_trylock() - main trylock routine
  *
@@ -153,14 +210,14 @@ static int __do_six_trylock(struct six_lock *lock, enum six_lock_type type,
 	 */
 	if (type == SIX_LOCK_read && lock->readers) {
 		preempt_disable();
-		this_cpu_inc(*lock->readers); /* signal that we own lock */
+		six_readers_add(lock, 1); /* signal that we own lock */
 
 		smp_mb();
 
 		old = atomic_read(&lock->state);
 		ret = !(old & l[type].lock_fail);
 
-		this_cpu_sub(*lock->readers, !ret);
+		six_readers_add(lock, -!ret);
 		preempt_enable();
 
 		if (!ret) {
@@ -569,7 +626,7 @@ static void do_six_unlock_type(struct six_lock *lock, enum six_lock_type type)
 	if (type == SIX_LOCK_read &&
 	    lock->readers) {
 		smp_mb(); /* unlock barrier */
-		this_cpu_dec(*lock->readers);
+		six_readers_add(lock, -1);
 		smp_mb(); /* between unlocking and checking for waiters */
 		state = atomic_read(&lock->state);
 	} else {
@@ -664,7 +721,7 @@ bool six_lock_tryupgrade(struct six_lock *lock)
 	} while (!atomic_try_cmpxchg_acquire(&lock->state, &old, new));
 
 	if (lock->readers)
-		this_cpu_dec(*lock->readers);
+		six_readers_add(lock, -1);
 
 	six_set_owner(lock, SIX_LOCK_intent, old, current);
 
@@ -721,7 +778,7 @@ void six_lock_increment(struct six_lock *lock, enum six_lock_type type)
 	switch (type) {
 	case SIX_LOCK_read:
 		if (lock->readers) {
-			this_cpu_inc(*lock->readers);
+			six_readers_add(lock, 1);
 		} else {
 			EBUG_ON(!(atomic_read(&lock->state) &
 				  (SIX_LOCK_HELD_read|
@@ -810,7 +867,7 @@ EXPORT_SYMBOL_GPL(six_lock_counts);
 void six_lock_readers_add(struct six_lock *lock, int nr)
 {
 	if (lock->readers) {
-		this_cpu_add(*lock->readers, nr);
+		six_readers_add(lock, nr);
 	} else {
 		EBUG_ON((int) (atomic_read(&lock->state) & SIX_LOCK_HELD_read) + nr < 0);
 		/* reader count starts at bit 0 */
@@ -847,11 +904,6 @@ void __six_lock_init(struct six_lock *lock, const char *name,
 	lockdep_init_map(&lock->dep_map, name, key, 0);
 #endif
 
-	/*
-	 * Don't assume that we have real percpu variables available in
-	 * userspace:
-	 */
-#ifdef __KERNEL__
 	if (flags & SIX_LOCK_INIT_PCPU) {
 		/*
 		 * We don't return an error here on memory allocation failure
@@ -860,8 +912,7 @@ void __six_lock_init(struct six_lock *lock, const char *name,
 		 * failure if they wish by checking lock->readers, but generally
 		 * will not want to treat it as an error.
 		 */
-		lock->readers = alloc_percpu(unsigned);
+		lock->readers = six_readers_alloc();
 	}
-#endif
 }
 EXPORT_SYMBOL_GPL(__six_lock_init);
@@ -0,0 +1,118 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "bcachefs.h"
+#include "slow_ops.h"
+#include "trace.h"
+
+static const char * const bch2_slow_op_types[] = {
+#define x(n)	#n,
+	BCH_SLOW_OP_TYPES()
+#undef x
+	NULL
+};
+
+static const char * const bch2_write_phases[] = {
+#define x(n)	#n,
+	BCH_WRITE_PHASES()
+#undef x
+	NULL
+};
+
+static const char * const bch2_read_phases[] = {
+#define x(n)	#n,
+	BCH_READ_PHASES()
+#undef x
+	NULL
+};
+
+static const char * const bch2_trans_phases[] = {
+#define x(n)	#n,
+	BCH_TRANS_PHASES()
+#undef x
+	NULL
+};
+
+static const char * const *slow_op_phases[] = {
+	[BCH_SLOW_OP_write]	= bch2_write_phases,
+	[BCH_SLOW_OP_read]	= bch2_read_phases,
+	[BCH_SLOW_OP_trans]	= bch2_trans_phases,
+};
+
+static void bch2_slow_op_to_text(struct printbuf *out, struct bch_slow_op *op)
+{
+	const char * const *phases = slow_op_phases[op->type];
+
+	bch2_prt_datetime(out, op->time);
+	prt_printf(out, " %s ", bch2_slow_op_types[op->type]);
+
+	if (op->type == BCH_SLOW_OP_trans)
+		prt_str(out, op->fn);
+	else
+		prt_printf(out, "%llu:%llu len %u",
+			   op->inum, op->offset, op->sectors);
+
+	prt_str(out, " took ");
+	bch2_pr_time_units(out, op->duration);
+
+	for (unsigned i = 0; phases[i]; i++)
+		if (op->phase_ns[i]) {
+			prt_printf(out, " %s ", phases[i]);
+			bch2_pr_time_units(out, op->phase_ns[i]);
+		}
+}
+
+/*
+ * Called by the owner of a slow operation, once it's completed: adds it to the
+ * ringbuffer (debugfs slow_ops) and emits the slow_op tracepoint.
+ */
+void bch2_slow_op_record(struct bch_fs *c, struct bch_slow_op *op)
+{
+	struct bch_slow_ops *s = &c->slow_ops;
+	unsigned long flags;
+
+	op->time = ktime_get_real_seconds();
+
+	spin_lock_irqsave(&s->lock, flags);
+	s->entries[s->nr++ % ARRAY_SIZE(s->entries)] = *op;
+	spin_unlock_irqrestore(&s->lock, flags);
+
+	if (trace_slow_op_enabled()) {
+		struct printbuf buf = PRINTBUF;
+
+		bch2_slow_op_to_text(&buf, op);
+		trace_slow_op(c, buf.buf);
+		printbuf_exit(&buf);
+	}
+}
+
+void bch2_slow_ops_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	struct bch_slow_ops *s = &c->slow_ops;
+	struct bch_slow_op op;
+	u64 nr, i;
+
+	spin_lock_irq(&s->lock);
+	nr = s->nr;
+	spin_unlock_irq(&s->lock);
+
+	for (i = nr > ARRAY_SIZE(s->entries) ? nr - ARRAY_SIZE(s->entries) : 0;
+	     i < nr;
+	     i++) {
+		spin_lock_irq(&s->lock);
+		if (s->nr - i > ARRAY_SIZE(s->entries)) {
+			/* overwritten while we were printing */
+			spin_unlock_irq(&s->lock);
+			continue;
+		}
+		op = s->entries[i % ARRAY_SIZE(s->entries)];
+		spin_unlock_irq(&s->lock);
+
+		bch2_slow_op_to_text(out, &op);
+		prt_newline(out);
+	}
+}
+
+void bch2_fs_slow_ops_init_early(struct bch_fs *c)
+{
+	spin_lock_init(&c->slow_ops.lock);
+}
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_SLOW_OPS_H
+#define _BCACHEFS_SLOW_OPS_H
+
+#include "slow_ops_types.h"
+
+static inline bool bch2_slow_op_tracking(struct bch_fs *c)
+{
+	return unlikely(c->opts.slow_op_threshold_ms);
+}
+
+static inline bool bch2_slow_op_is_slow(struct bch_fs *c, u64 duration)
+{
+	return duration >= (u64) c->opts.slow_op_threshold_ms * NSEC_PER_MSEC;
+}
+
+/* Add the time since *@start to *@phase_ns, and restart the clock: */
+static inline void bch2_slow_op_phase_add(u64 *phase_ns, u64 *start)
+{
+	u64 now = local_clock();
+
+	if (time_after64(now, *start))
+		*phase_ns += now - *start;
+	*start = now;
+}
+
+void bch2_slow_op_record(struct bch_fs *, struct bch_slow_op *);
+void bch2_slow_ops_to_text(struct printbuf *, struct bch_fs *);
+
+void bch2_fs_slow_ops_init_early(struct bch_fs *);
+
+#endif /* _BCACHEFS_SLOW_OPS_H */
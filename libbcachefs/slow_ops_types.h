@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_SLOW_OPS_TYPES_H
+#define _BCACHEFS_SLOW_OPS_TYPES_H
+
+#include <linux/spinlock_types.h>
+#include <linux/types.h>
+
+/*
+ * Slow operation log: data reads/writes and btree transactions that take longer
+ * than the slow_op_threshold_ms option, with where the time went:
+ */
+#define BCH_SLOW_OP_TYPES()		\
+	x(write)			\
+	x(read)				\
+	x(trans)
+
+enum bch_slow_op_type {
+#define x(n)	BCH_SLOW_OP_##n,
+	BCH_SLOW_OP_TYPES()
+#undef x
+	BCH_SLOW_OP_NR,
+};
+
+#define BCH_WRITE_PHASES()		\
+	x(alloc)			\
+	x(encode)			\
+	x(io)				\
+	x(index_wait)			\
+	x(index_update)
+
+enum bch_write_phase {
+#define x(n)	BCH_WRITE_PHASE_##n,
+	BCH_WRITE_PHASES()
+#undef x
+	BCH_WRITE_PHASE_NR,
+};
+
+#define BCH_READ_PHASES()		\
+	x(lookup)			\
+	x(io)				\
+	x(endio)
+
+enum bch_read_phase {
+#define x(n)	BCH_READ_PHASE_##n,
+	BCH_READ_PHASES()
+#undef x
+	BCH_READ_PHASE_NR,
+};
+
+#define BCH_TRANS_PHASES()		\
+	x(restart)			\
+	x(lock_wait)			\
+	x(journal_res)
+
+enum bch_trans_phase {
+#define x(n)	BCH_TRANS_PHASE_##n,
+	BCH_TRANS_PHASES()
+#undef x
+	BCH_TRANS_PHASE_NR,
+};
+
+#define BCH_SLOW_OP_PHASES_MAX		BCH_WRITE_PHASE_NR
+
+struct bch_slow_op {
+	u64			time;		/* wall clock, seconds */
+	u64			duration;	/* nanoseconds */
+	enum bch_slow_op_type	type;
+	union {
+	struct {
+		u64		inum;
+		u64		offset;		/* sectors */
+		u32		sectors;
+	};
+	/* for btree transactions: */
+	const char		*fn;
+	};
+	u64			phase_ns[BCH_SLOW_OP_PHASES_MAX];
+};
+
+#define BCH_SLOW_OPS_NR			64
+
+struct bch_slow_ops {
+	spinlock_t		lock;
+	u64			nr;
+	struct bch_slow_op	entries[BCH_SLOW_OPS_NR];
+};
+
+#endif /* _BCACHEFS_SLOW_OPS_TYPES_H */
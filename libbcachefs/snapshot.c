@@ -8,6 +8,7 @@
 #include "errcode.h"
 #include "error.h"
 #include "fs.h"
+#include "journal_reclaim.h"
 #include "recovery_passes.h"
 #include "snapshot.h"
 
@@ -146,13 +147,33 @@ bool __bch2_snapshot_is_ancestor(struct bch_fs *c, u32 id, u32 ancestor)
 		goto out;
 	}
 
+	if (likely(READ_ONCE(c->snapshot_labels_valid))) {
+		unsigned seq = raw_read_seqcount(&c->snapshot_labels_seq);
+
+		if (!(seq & 1)) {
+			/* reread, the table may have been replaced before we read seq: */
+			t = rcu_dereference(c->snapshots);
+
+			const struct snapshot_t *s = __snapshot_t(t, id);
+			const struct snapshot_t *a = __snapshot_t(t, ancestor);
+
+			ret = id == ancestor ||
+				(s && a &&
+				 s->pre >= a->pre &&
+				 s->pre <= a->post);
+
+			if (!read_seqcount_retry(&c->snapshot_labels_seq, seq))
+				goto check;
+		}
+	}
+
 	while (id && id < ancestor - IS_ANCESTOR_BITMAP)
 		id = get_ancestor_below(t, id, ancestor);
 
 	ret = id && id < ancestor
 		? test_ancestor_bitmap(t, id, ancestor)
 		: id == ancestor;
-
+check:
 	EBUG_ON(ret != __bch2_snapshot_is_ancestor_early(t, id, ancestor));
 out:
 	rcu_read_unlock();
@@ -160,6 +181,28 @@ out:
 	return ret;
 }
 
+/*
+ * Returns the first ancestor of @id (or @id itself) with an ID greater than
+ * @above, or 0 if there is none:
+ */
+u32 bch2_snapshot_ancestor_above(struct bch_fs *c, u32 id, u32 above)
+{
+	rcu_read_lock();
+	struct snapshot_table *t = rcu_dereference(c->snapshots);
+	bool early = c->recovery_pass_done < BCH_RECOVERY_PASS_check_snapshots;
+
+	while (id && id <= above) {
+		const struct snapshot_t *s = __snapshot_t(t, id);
+
+		id = !s		? 0
+			: early	? s->parent
+			: get_ancestor_below(t, id, above);
+	}
+	rcu_read_unlock();
+
+	return id;
+}
+
 static noinline struct snapshot_t *__snapshot_t_mut(struct bch_fs *c, u32 id)
 {
 	size_t idx = U32_MAX - id;
@@ -298,6 +341,75 @@ static void set_is_ancestor_bitmap(struct bch_fs *c, u32 id)
 	mutex_unlock(&c->snapshot_table_lock);
 }
 
+static struct snapshot_t *snapshot_table_child(struct snapshot_table *t, u32 id, u32 child)
+{
+	struct snapshot_t *s = child && child < id ? __snapshot_t(t, child) : NULL;
+
+	return s && s->parent == id ? s : NULL;
+}
+
+/*
+ * Number the snapshot tree in preorder, so that bch2_snapshot_is_ancestor() is
+ * just two compares: children always have smaller IDs than their parents, i.e.
+ * higher indices in the snapshot table, so we can compute subtree sizes in one
+ * pass from the end of the table and hand out preorder numbers in one pass from
+ * the start.
+ *
+ * Snapshot creation and deletion is rare, so we just redo the whole table.
+ */
+static void bch2_snapshot_table_relabel(struct bch_fs *c)
+{
+	struct snapshot_table *t = rcu_dereference_protected(c->snapshots,
+				lockdep_is_held(&c->snapshot_table_lock));
+	u32 next = 1;
+
+	if (!t)
+		return;
+
+	preempt_disable();
+	write_seqcount_begin(&c->snapshot_labels_seq);
+
+	/* post is the subtree size, until the second pass: */
+	for (size_t i = t->nr; i--;) {
+		struct snapshot_t *s = t->s + i;
+		u32 id = U32_MAX - i;
+
+		s->pre	= 0;
+		s->post	= 1;
+
+		for (unsigned j = 0; j < ARRAY_SIZE(s->children); j++) {
+			struct snapshot_t *child = snapshot_table_child(t, id, s->children[j]);
+			if (child)
+				s->post += child->post;
+		}
+	}
+
+	for (size_t i = 0; i < t->nr; i++) {
+		struct snapshot_t *s = t->s + i;
+		u32 id = U32_MAX - i;
+		u32 size = s->post;
+
+		if (!s->pre) {
+			s->pre = next;
+			next += size;
+		}
+
+		u32 child_pre = s->pre + 1;
+		for (unsigned j = 0; j < ARRAY_SIZE(s->children); j++) {
+			struct snapshot_t *child = snapshot_table_child(t, id, s->children[j]);
+			if (child) {
+				child->pre = child_pre;
+				child_pre += child->post;
+			}
+		}
+
+		s->post = s->pre + size - 1;
+	}
+
+	write_seqcount_end(&c->snapshot_labels_seq);
+	preempt_enable();
+}
+
 static int __bch2_mark_snapshot(struct btree_trans *trans,
 		       enum btree_id btree, unsigned level,
 		       struct bkey_s_c old, struct bkey_s_c new,
@@ -316,6 +428,9 @@ static int __bch2_mark_snapshot(struct btree_trans *trans,
 		goto err;
 	}
 
+	u32 old_parent = t->parent;
+	u32 old_children[2] = { t->children[0], t->children[1] };
+
 	if (new.k->type == KEY_TYPE_snapshot) {
 		struct bkey_s_c_snapshot s = bkey_s_c_to_snapshot(new);
 
@@ -347,6 +462,12 @@ static int __bch2_mark_snapshot(struct btree_trans *trans,
 	} else {
 		memset(t, 0, sizeof(*t));
 	}
+
+	if (c->snapshot_labels_valid &&
+	    (t->parent	    != old_parent ||
+	     t->children[0] != old_children[0] ||
+	     t->children[1] != old_children[1]))
+		bch2_snapshot_table_relabel(c);
 err:
 	mutex_unlock(&c->snapshot_table_lock);
 	return ret;
@@ -1449,6 +1570,226 @@ static int delete_dead_snapshots_process_key(struct btree_trans *trans,
 	return 0;
 }
 
+static bool delete_dead_snapshots_key_affected(struct bch_fs *c, struct bkey_s_c k,
+					       snapshot_id_list *deleted)
+{
+	u32 snapshot = k.k->p.snapshot;
+
+	return snapshot_list_has_id(deleted, snapshot) ||
+		bch2_snapshot_equiv(c, snapshot) != snapshot;
+}
+
+/* Number of keys processed per transaction commit: */
+#define DELETE_DEAD_SNAPSHOTS_BATCH	64
+
+/*
+ * If @inums is non NULL, we're walking the inodes btree and building up the
+ * list of inodes that have keys in snapshots we're deleting or collapsing:
+ *
+ * Keys are processed in batches, one commit per batch; a batch only ends on a
+ * key position boundary, so that on transaction restart we can rewind to the
+ * start of the batch and redo it with fresh per-position state:
+ */
+static int delete_dead_snapshots_btree(struct btree_trans *trans, enum btree_id btree,
+				       struct bpos start, struct bpos end,
+				       snapshot_id_list *deleted,
+				       darray_u64 *inums)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct bpos last_pos, prev_pos;
+	snapshot_id_list equiv_seen = { 0 };
+	struct disk_reservation res = { 0 };
+	int ret;
+
+	bch2_trans_iter_init(trans, &iter, btree, start,
+			     BTREE_ITER_prefetch|BTREE_ITER_all_snapshots);
+	while (1) {
+		struct bpos batch_start = iter.pos;
+		unsigned nr = 0;
+
+		bch2_trans_begin(trans);
+		last_pos = prev_pos = POS_MIN;
+		equiv_seen.nr = 0;
+
+		while (1) {
+			k = bch2_btree_iter_peek_upto(&iter, end);
+			ret = bkey_err(k);
+			if (ret || !k.k)
+				break;
+
+			if (nr >= DELETE_DEAD_SNAPSHOTS_BATCH &&
+			    !bpos_eq(k.k->p, prev_pos))
+				break;
+
+			ret = (inums &&
+			       delete_dead_snapshots_key_affected(c, k, deleted) &&
+			       (!inums->nr || darray_last(*inums) != k.k->p.offset)
+			       ? darray_push(inums, k.k->p.offset)
+			       : 0) ?:
+				delete_dead_snapshots_process_key(trans, &iter, k, deleted,
+								  &equiv_seen, &last_pos);
+			if (ret)
+				break;
+
+			prev_pos = k.k->p;
+			nr++;
+			bch2_btree_iter_advance(&iter);
+		}
+
+		ret = ret ?: bch2_trans_commit(trans, &res, NULL, BCH_TRANS_COMMIT_no_enospc);
+		if (bch2_err_matches(ret, BCH_ERR_transaction_restart)) {
+			bch2_btree_iter_set_pos(&iter, batch_start);
+			continue;
+		}
+
+		if (ret || !k.k)
+			break;
+	}
+
+	bch2_trans_iter_exit(trans, &iter);
+	bch2_disk_reservation_put(c, &res);
+	darray_exit(&equiv_seen);
+	return ret;
+}
+
+/*
+ * Walking the snapshotted btrees is sharded by btree and by inode number range
+ * (or, when we have a list of affected inodes, by chunks of that list); shards
+ * run in parallel, each with its own transaction:
+ */
+#define DELETE_DEAD_SNAPSHOTS_SHARDS	8
+/* Don't bother splitting up inode lists smaller than this: */
+#define DELETE_DEAD_SNAPSHOTS_SHARD_MIN	16
+
+struct delete_dead_snapshots_shard {
+	struct closure		cl;
+	struct bch_fs		*c;
+	snapshot_id_list	*deleted;
+	enum btree_id		btree;
+	struct bpos		start;
+	struct bpos		end;
+	u64			*inums;
+	u64			*inums_end;
+	int			ret;
+};
+
+static int delete_dead_snapshots_shard(struct btree_trans *trans,
+				       struct delete_dead_snapshots_shard *s)
+{
+	if (!s->inums)
+		return delete_dead_snapshots_btree(trans, s->btree, s->start, s->end,
+						   s->deleted, NULL);
+
+	for (u64 *i = s->inums; i < s->inums_end; i++) {
+		int ret = delete_dead_snapshots_btree(trans, s->btree,
+					POS(*i, 0), SPOS(*i, U64_MAX, U32_MAX),
+					s->deleted, NULL);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static CLOSURE_CALLBACK(delete_dead_snapshots_shard_work)
+{
+	closure_type(s, struct delete_dead_snapshots_shard, cl);
+
+	s->ret = bch2_trans_run(s->c, delete_dead_snapshots_shard(trans, s));
+	closure_return(cl);
+}
+
+/*
+ * Walk every snapshotted btree except the inodes btree - over the whole
+ * keyspace, or just @inums if non NULL:
+ */
+static int delete_dead_snapshots_sharded(struct btree_trans *trans,
+					 snapshot_id_list *deleted,
+					 darray_u64 *inums)
+{
+	struct bch_fs *c = trans->c;
+	unsigned nr_per_btree = min_t(unsigned, num_online_cpus(), DELETE_DEAD_SNAPSHOTS_SHARDS);
+	unsigned nr = 0;
+	struct closure cl;
+	int ret = 0;
+
+	struct delete_dead_snapshots_shard *shards =
+		kcalloc(BTREE_ID_NR * nr_per_btree, sizeof(*shards), GFP_KERNEL);
+	if (!shards)
+		return -BCH_ERR_ENOMEM_delete_dead_snapshots;
+
+	closure_init_stack(&cl);
+
+	for (unsigned btree = 0; btree < BTREE_ID_NR; btree++) {
+		if (!btree_type_has_snapshots(btree) ||
+		    (inums && btree == BTREE_ID_inodes))
+			continue;
+
+		if (inums) {
+			if (!inums->nr)
+				continue;
+
+			unsigned per_shard = max_t(size_t, DELETE_DEAD_SNAPSHOTS_SHARD_MIN,
+						   DIV_ROUND_UP(inums->nr, nr_per_btree));
+
+			for (u64 *i = inums->data; i < &darray_top(*inums); i += per_shard) {
+				struct delete_dead_snapshots_shard *s = shards + nr++;
+
+				s->btree	= btree;
+				s->inums	= i;
+				s->inums_end	= min(i + per_shard, &darray_top(*inums));
+			}
+		} else {
+			/*
+			 * The inodes btree is indexed by offset, not inode
+			 * number, so isn't split up:
+			 */
+			u64 last = btree != BTREE_ID_inodes
+				? bch2_btree_last_inum(trans, btree)
+				: 0;
+			unsigned nr_ranges = last != U64_MAX
+				? min_t(u64, nr_per_btree, last + 1)
+				: 1;
+			u64 step = div_u64(last, nr_ranges) + 1;
+
+			for (unsigned r = 0; r < nr_ranges; r++) {
+				struct delete_dead_snapshots_shard *s = shards + nr++;
+
+				s->btree	= btree;
+				s->start	= r ? POS(r * step, 0) : POS_MIN;
+				s->end		= r + 1 < nr_ranges
+					? SPOS((r + 1) * step - 1, U64_MAX, U32_MAX)
+					: SPOS_MAX;
+			}
+		}
+	}
+
+	bch2_trans_unlock_long(trans);
+
+	/* The calling thread does the first shard, other shards get their own thread: */
+	for (struct delete_dead_snapshots_shard *s = shards; s < shards + nr; s++) {
+		s->c		= c;
+		s->deleted	= deleted;
+
+		if (s != shards)
+			closure_call(&s->cl, delete_dead_snapshots_shard_work,
+				     system_unbound_wq, &cl);
+	}
+
+	if (nr)
+		shards->ret = delete_dead_snapshots_shard(trans, shards);
+
+	closure_sync(&cl);
+
+	for (struct delete_dead_snapshots_shard *s = shards; s < shards + nr; s++)
+		ret = ret ?: s->ret;
+
+	kfree(shards);
+	return ret;
+}
+
 static int bch2_snapshot_needs_delete(struct btree_trans *trans, struct bkey_s_c k)
 {
 	struct bkey_s_c_snapshot snap;
@@ -1565,6 +1906,8 @@ int bch2_delete_dead_snapshots(struct bch_fs *c)
 	struct btree_trans *trans;
 	snapshot_id_list deleted = { 0 };
 	snapshot_id_list deleted_interior = { 0 };
+	darray_u64 inums = { 0 };
+	bool targeted = test_bit(BCH_FS_started, &c->flags);
 	int ret = 0;
 
 	if (!test_and_clear_bit(BCH_FS_need_delete_dead_snapshots, &c->flags))
@@ -1604,29 +1947,39 @@ int bch2_delete_dead_snapshots(struct bch_fs *c)
 	if (ret)
 		goto err;
 
-	for (unsigned btree = 0; btree < BTREE_ID_NR; btree++) {
-		struct bpos last_pos = POS_MIN;
-		snapshot_id_list equiv_seen = { 0 };
-		struct disk_reservation res = { 0 };
-
-		if (!btree_type_has_snapshots(btree))
-			continue;
-
-		ret = for_each_btree_key_commit(trans, iter,
-				btree, POS_MIN,
-				BTREE_ITER_prefetch|BTREE_ITER_all_snapshots, k,
-				&res, NULL, BCH_TRANS_COMMIT_no_enospc,
-			delete_dead_snapshots_process_key(trans, &iter, k, &deleted,
-							  &equiv_seen, &last_pos));
-
-		bch2_disk_reservation_put(c, &res);
-		darray_exit(&equiv_seen);
-
+	/*
+	 * Avoid a full scan of every snapshotted btree when we can: every key
+	 * written in a snapshot comes with an update to its inode in that
+	 * snapshot (i_size, i_sectors, times, bi_journal_seq), so the inodes
+	 * btree tells us which inodes the snapshots we're deleting or
+	 * collapsing touched - and we only walk the rest of the keyspace for
+	 * those inodes.
+	 *
+	 * Inode updates go through the key cache, so flush it first. Repair
+	 * can create keys without a matching inode update, so during recovery
+	 * we still do the full scan:
+	 */
+	if (targeted) {
+		bch2_trans_unlock_long(trans);
+		bch2_journal_flush_all_pins(&c->journal);
+
+		ret = delete_dead_snapshots_btree(trans, BTREE_ID_inodes, POS_MIN, SPOS_MAX,
+						  &deleted, &inums);
+		if (bch2_err_matches(ret, ENOMEM)) {
+			/* fall back to the full scan: */
+			targeted = false;
+			ret = 0;
+		}
 		bch_err_msg(c, ret, "deleting keys from dying snapshots");
 		if (ret)
 			goto err;
 	}
 
+	ret = delete_dead_snapshots_sharded(trans, &deleted, targeted ? &inums : NULL);
+	bch_err_msg(c, ret, "deleting keys from dying snapshots");
+	if (ret)
+		goto err;
+
 	bch2_trans_unlock(trans);
 	down_write(&c->snapshot_create_lock);
 
@@ -1674,6 +2027,7 @@ int bch2_delete_dead_snapshots(struct bch_fs *c)
 err_create_lock:
 	up_write(&c->snapshot_create_lock);
 err:
+	darray_exit(&inums);
 	darray_exit(&deleted_interior);
 	darray_exit(&deleted);
 	bch2_trans_put(trans);
@@ -1861,6 +2215,13 @@ int bch2_snapshots_read(struct bch_fs *c)
 			   (set_is_ancestor_bitmap(c, k.k->p.offset), 0)));
 	bch_err_fn(c, ret);
 
+	if (!ret) {
+		mutex_lock(&c->snapshot_table_lock);
+		bch2_snapshot_table_relabel(c);
+		WRITE_ONCE(c->snapshot_labels_valid, true);
+		mutex_unlock(&c->snapshot_table_lock);
+	}
+
 	/*
 	 * It's important that we check if we need to reconstruct snapshots
 	 * before going RW, so we mark that pass as required in the superblock -
@@ -166,6 +166,7 @@ static inline u32 bch2_snapshot_depth(struct bch_fs *c, u32 parent)
 }
 
 bool __bch2_snapshot_is_ancestor(struct bch_fs *, u32, u32);
+u32 bch2_snapshot_ancestor_above(struct bch_fs *, u32, u32);
 
 static inline bool bch2_snapshot_is_ancestor(struct bch_fs *c, u32 id, u32 ancestor)
 {
@@ -130,6 +130,24 @@ static inline u64 bch2_str_hash_end(struct bch_str_hash_ctx *ctx,
 	}
 }
 
+/* Hash of a single buffer - the common case, e.g. filenames: */
+static inline u64 bch2_str_hash(const struct bch_hash_info *info,
+				const void *data, size_t len)
+{
+	switch (info->type) {
+	case BCH_STR_HASH_siphash_old:
+	case BCH_STR_HASH_siphash:
+		return SipHash24(&info->siphash_key, data, len) >> 1;
+	default: {
+		struct bch_str_hash_ctx ctx;
+
+		bch2_str_hash_init(&ctx, info);
+		bch2_str_hash_update(&ctx, info, data, len);
+		return bch2_str_hash_end(&ctx, info);
+	}
+	}
+}
+
 struct bch_hash_desc {
 	enum btree_id	btree_id;
 	u8		key_type;
@@ -214,7 +232,8 @@ bch2_hash_hole(struct btree_trans *trans,
 	for_each_btree_key_upto_norestart(trans, *iter, desc.btree_id,
 			   SPOS(inum.inum, desc.hash_key(info, key), snapshot),
 			   POS(inum.inum, U64_MAX),
-			   BTREE_ITER_slots|BTREE_ITER_intent, k, ret)
+			   BTREE_ITER_slots|BTREE_ITER_intent|
+			   BTREE_ITER_with_updates, k, ret)
 		if (!is_visible_key(desc, inum, k))
 			return 0;
 	bch2_trans_iter_exit(trans, iter);
@@ -270,7 +289,8 @@ int bch2_hash_set_in_snapshot(struct btree_trans *trans,
 				desc.hash_bkey(info, bkey_i_to_s_c(insert)),
 				snapshot),
 			   POS(insert->k.p.inode, U64_MAX),
-			   BTREE_ITER_slots|BTREE_ITER_intent, k, ret) {
+			   BTREE_ITER_slots|BTREE_ITER_intent|
+			   BTREE_ITER_with_updates, k, ret) {
 		if (is_visible_key(desc, inum, k)) {
 			if (!desc.cmp_bkey(k, bkey_i_to_s_c(insert)))
 				goto found;
@@ -328,6 +348,51 @@ int bch2_hash_set(struct btree_trans *trans,
 					  snapshot, insert, flags);
 }
 
+/* Bound on how many whiteouts one delete will clean up: */
+#define STR_HASH_COMPACT_MAX	64
+
+/*
+ * We just left a hole at @start: whiteouts immediately before it only existed
+ * to keep probe chains through @start intact, nothing can be found past them
+ * now - delete them, so that probe chains don't keep growing with deletes:
+ */
+static __always_inline
+int bch2_hash_compact_whiteouts(struct btree_trans *trans,
+				const struct bch_hash_desc desc,
+				struct btree_iter *start,
+				enum btree_iter_update_trigger_flags flags)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	int ret = 0;
+
+	bch2_trans_copy_iter(&iter, start);
+
+	for (unsigned nr = 0;
+	     nr < STR_HASH_COMPACT_MAX && iter.pos.offset;
+	     nr++) {
+		k = bch2_btree_iter_prev_slot(&iter);
+		ret = bkey_err(k);
+		if (ret || k.k->type != KEY_TYPE_hash_whiteout)
+			break;
+
+		struct bkey_i *delete = bch2_trans_kmalloc(trans, sizeof(*delete));
+		ret = PTR_ERR_OR_ZERO(delete);
+		if (ret)
+			break;
+
+		bkey_init(&delete->k);
+		delete->k.p = iter.pos;
+
+		ret = bch2_trans_update(trans, &iter, delete, flags);
+		if (ret)
+			break;
+	}
+
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
 static __always_inline
 int bch2_hash_delete_at(struct btree_trans *trans,
 			const struct bch_hash_desc desc,
@@ -347,11 +412,16 @@ int bch2_hash_delete_at(struct btree_trans *trans,
 	if (ret < 0)
 		return ret;
 
+	bool needs_whiteout = ret;
+
 	bkey_init(&delete->k);
 	delete->k.p = iter->pos;
-	delete->k.type = ret ? KEY_TYPE_hash_whiteout : KEY_TYPE_deleted;
+	delete->k.type = needs_whiteout ? KEY_TYPE_hash_whiteout : KEY_TYPE_deleted;
 
-	return bch2_trans_update(trans, iter, delete, flags);
+	return  bch2_trans_update(trans, iter, delete, flags) ?:
+		(!needs_whiteout
+		 ? bch2_hash_compact_whiteouts(trans, desc, iter, flags)
+		 : 0);
 }
 
 static __always_inline
@@ -16,6 +16,12 @@ struct snapshot_t {
 	u32			subvol; /* Nonzero only if a subvolume points to this node: */
 	u32			tree;
 	u32			equiv;
+	/*
+	 * Preorder numbering of the snapshot tree: descendents of a node have
+	 * preorder numbers in [pre, post]
+	 */
+	u32			pre;
+	u32			post;
 	unsigned long		is_ancestor[BITS_TO_LONGS(IS_ANCESTOR_BITMAP)];
 };
 
@@ -34,4 +40,6 @@ typedef struct {
 	u64		inum;
 } subvol_inum;
 
+typedef DARRAY(subvol_inum) subvol_inum_list;
+
 #endif /* _BCACHEFS_SUBVOLUME_TYPES_H */
@@ -2,6 +2,7 @@
 
 #include "bcachefs.h"
 #include "checksum.h"
+#include "compress.h"
 #include "disk_groups.h"
 #include "ec.h"
 #include "error.h"
@@ -717,6 +718,9 @@ retry:
 #ifndef __KERNEL__
 	if (opt_get(*opts, direct_io) == false)
 		sb->mode |= BLK_OPEN_BUFFERED;
+
+	if (opt_get(*opts, mmap_devices))
+		sb->mode |= BLK_OPEN_MMAP;
 #endif
 
 	if (!opt_get(*opts, noexcl))
@@ -743,6 +747,17 @@ retry:
 	}
 	sb->bdev = file_bdev(sb->s_bdev_file);
 
+	/*
+	 * Zoned devices need buckets aligned to zones, and bucket size is
+	 * limited to U16_MAX sectors in the superblock - smaller than any real
+	 * zone size:
+	 */
+	if (bdev_is_zoned(sb->bdev)) {
+		ret = -BCH_ERR_device_zoned;
+		prt_printf(&err, "%s: zoned block devices are not supported", path);
+		goto err;
+	}
+
 	ret = bch2_sb_realloc(sb, 0);
 	if (ret) {
 		prt_printf(&err, "error allocating memory for superblock");
@@ -941,6 +956,9 @@ int bch2_write_super(struct bch_fs *c)
 
 	lockdep_assert_held(&c->sb_lock);
 
+	/* this write includes anything bch2_write_super_async() was waiting on: */
+	c->sb_write_pending = false;
+
 	closure_init_stack(cl);
 	memset(&sb_written, 0, sizeof(sb_written));
 
@@ -1115,6 +1133,50 @@ out:
 	return ret;
 }
 
+/*
+ * For superblock updates that only need to be persisted eventually: instead of
+ * writing every member's superblock and waiting on it while sb_lock is held,
+ * mark the superblock dirty and write it out shortly after, so that bursts of
+ * updates are coalesced into a single write.
+ *
+ * Must be called with sb_lock held, after modifying c->disk_sb:
+ */
+#define SB_WRITE_ASYNC_DELAY	(HZ / 10)
+
+void bch2_write_super_async(struct bch_fs *c)
+{
+	lockdep_assert_held(&c->sb_lock);
+
+	c->sb_write_pending = true;
+	queue_delayed_work(system_long_wq, &c->sb_write_work, SB_WRITE_ASYNC_DELAY);
+}
+
+static void bch2_write_super_work(struct work_struct *work)
+{
+	struct bch_fs *c = container_of(to_delayed_work(work), struct bch_fs,
+					sb_write_work);
+
+	mutex_lock(&c->sb_lock);
+	if (c->sb_write_pending)
+		bch2_write_super(c);
+	mutex_unlock(&c->sb_lock);
+}
+
+void bch2_fs_sb_write_exit(struct bch_fs *c)
+{
+	cancel_delayed_work_sync(&c->sb_write_work);
+
+	mutex_lock(&c->sb_lock);
+	if (c->sb_write_pending)
+		bch2_write_super(c);
+	mutex_unlock(&c->sb_lock);
+}
+
+void bch2_fs_sb_write_init(struct bch_fs *c)
+{
+	INIT_DELAYED_WORK(&c->sb_write_work, bch2_write_super_work);
+}
+
 void __bch2_check_set_feature(struct bch_fs *c, unsigned feat)
 {
 	mutex_lock(&c->sb_lock);
@@ -16,6 +16,7 @@
 #include "btree_journal_iter.h"
 #include "btree_key_cache.h"
 #include "btree_node_scan.h"
+#include "btree_trace.h"
 #include "btree_update_interior.h"
 #include "btree_io.h"
 #include "btree_write_buffer.h"
@@ -35,8 +36,10 @@
 #include "fs-io-buffered.h"
 #include "fs-io-direct.h"
 #include "fsck.h"
+#include "fsck_background.h"
 #include "inode.h"
 #include "io_read.h"
+#include "io_sched.h"
 #include "io_write.h"
 #include "journal.h"
 #include "journal_reclaim.h"
@@ -53,6 +56,10 @@
 #include "sb-counters.h"
 #include "sb-errors.h"
 #include "sb-members.h"
+#include "scrub.h"
+#include "io_attrib.h"
+#include "lock_profile.h"
+#include "slow_ops.h"
 #include "snapshot.h"
 #include "subvolume.h"
 #include "super.h"
@@ -261,6 +268,9 @@ static void __bch2_fs_read_only(struct bch_fs *c)
 	bch2_fs_ec_stop(c);
 	bch2_open_buckets_stop(c, NULL, true);
 	bch2_rebalance_stop(c);
+	bch2_scrub_stop(c);
+	bch2_bg_fsck_stop(c);
+	bch2_ec_compact_stop(c);
 	bch2_copygc_stop(c);
 	bch2_fs_ec_flush(c);
 
@@ -432,6 +442,24 @@ static int bch2_fs_read_write_late(struct bch_fs *c)
 		return ret;
 	}
 
+	ret = bch2_ec_compact_start(c);
+	if (ret) {
+		bch_err(c, "error starting stripe compaction thread");
+		return ret;
+	}
+
+	ret = bch2_scrub_start(c);
+	if (ret) {
+		bch_err(c, "error starting scrub thread");
+		return ret;
+	}
+
+	ret = bch2_bg_fsck_start(c);
+	if (ret) {
+		bch_err(c, "error starting background fsck thread");
+		return ret;
+	}
+
 	return 0;
 }
 
@@ -496,6 +524,9 @@ static int __bch2_fs_read_write(struct bch_fs *c, bool early)
 
 	bch2_do_discards(c);
 	bch2_do_invalidates(c);
+	if (c->opts.lazy_freespace_init &&
+	    c->curr_recovery_pass > BCH_RECOVERY_PASS_fs_freespace_init)
+		bch2_do_freespace_init(c);
 	bch2_do_stripe_deletes(c);
 	bch2_do_pending_node_rewrites(c);
 	return 0;
@@ -537,8 +568,12 @@ static void __bch2_fs_free(struct bch_fs *c)
 	bch2_free_pending_node_rewrites(c);
 	bch2_fs_accounting_exit(c);
 	bch2_fs_sb_errors_exit(c);
+	bch2_fs_lock_profile_exit(c);
+	bch2_fs_io_attrib_exit(c);
+	bch2_fs_btree_trace_exit(c);
 	bch2_fs_counters_exit(c);
 	bch2_fs_snapshots_exit(c);
+	bch2_fs_inode_exit(c);
 	bch2_fs_quota_exit(c);
 	bch2_fs_fs_io_direct_exit(c);
 	bch2_fs_fs_io_buffered_exit(c);
@@ -550,6 +585,7 @@ static void __bch2_fs_free(struct bch_fs *c)
 	bch2_fs_io_write_exit(c);
 	bch2_fs_io_read_exit(c);
 	bch2_fs_buckets_waiting_for_journal_exit(c);
+	bch2_fs_allocator_foreground_exit(c);
 	bch2_fs_btree_interior_update_exit(c);
 	bch2_fs_btree_key_cache_exit(&c->btree_key_cache);
 	bch2_fs_btree_cache_exit(c);
@@ -575,6 +611,7 @@ static void __bch2_fs_free(struct bch_fs *c)
 	free_percpu(c->usage);
 	mempool_exit(&c->large_bkey_pool);
 	mempool_exit(&c->btree_bounce_pool);
+	bch2_fs_btree_buf_exit(c);
 	bioset_exit(&c->btree_bio);
 	mempool_exit(&c->fill_iter);
 #ifndef BCH_WRITE_REF_DEBUG
@@ -582,12 +619,16 @@ static void __bch2_fs_free(struct bch_fs *c)
 #endif
 	kfree(rcu_dereference_protected(c->disk_groups, 1));
 	kfree(c->journal_seq_blacklist_table);
-	kfree(c->unused_inode_hints);
+	kfree(c->inode_alloc_shards);
 
+	if (c->compress_wq)
+		destroy_workqueue(c->compress_wq);
 	if (c->write_ref_wq)
 		destroy_workqueue(c->write_ref_wq);
 	if (c->btree_write_submit_wq)
 		destroy_workqueue(c->btree_write_submit_wq);
+	if (c->btree_read_csum_wq)
+		destroy_workqueue(c->btree_read_csum_wq);
 	if (c->btree_read_complete_wq)
 		destroy_workqueue(c->btree_read_complete_wq);
 	if (c->copygc_wq)
@@ -633,6 +674,8 @@ void __bch2_fs_stop(struct bch_fs *c)
 	bch2_ro_ref_put(c);
 	wait_event(c->ro_ref_wait, !refcount_read(&c->ro_ref));
 
+	bch2_fs_sb_write_exit(c);
+
 	kobject_put(&c->counters_kobj);
 	kobject_put(&c->time_stats);
 	kobject_put(&c->opts_dir);
@@ -763,10 +806,12 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	mutex_init(&c->replicas_gc_lock);
 	mutex_init(&c->btree_root_lock);
 	INIT_WORK(&c->read_only_work, bch2_fs_read_only_work);
+	bch2_fs_sb_write_init(c);
 
 	refcount_set(&c->ro_ref, 1);
 	init_waitqueue_head(&c->ro_ref_wait);
 	sema_init(&c->online_fsck_mutex, 1);
+	spin_lock_init(&c->recovery_pass_lock);
 
 	init_rwsem(&c->gc_lock);
 	mutex_init(&c->gc_gens_lock);
@@ -780,19 +825,25 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	bch2_fs_copygc_init(c);
 	bch2_fs_btree_key_cache_init_early(&c->btree_key_cache);
 	bch2_fs_btree_iter_init_early(c);
+	bch2_fs_btree_io_init_early(c);
 	bch2_fs_btree_interior_update_init_early(c);
 	bch2_fs_allocator_background_init(c);
 	bch2_fs_allocator_foreground_init(c);
 	bch2_fs_rebalance_init(c);
 	bch2_fs_quota_init(c);
+	bch2_fs_inode_init_early(c);
 	bch2_fs_ec_init_early(c);
 	bch2_fs_move_init(c);
 	bch2_fs_sb_errors_init_early(c);
+	bch2_fs_slow_ops_init_early(c);
+	bch2_fs_lock_profile_init_early(c);
+	bch2_fs_btree_trace_init_early(c);
 
 	INIT_LIST_HEAD(&c->list);
 
 	mutex_init(&c->bio_bounce_pages_lock);
 	mutex_init(&c->snapshot_table_lock);
+	seqcount_init(&c->snapshot_labels_seq);
 	init_rwsem(&c->snapshot_create_lock);
 
 	spin_lock_init(&c->btree_write_error_lock);
@@ -883,10 +934,14 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 				WQ_HIGHPRI|WQ_FREEZABLE|WQ_MEM_RECLAIM|WQ_CPU_INTENSIVE, 1)) ||
 	    !(c->btree_read_complete_wq = alloc_workqueue("bcachefs_btree_read_complete",
 				WQ_HIGHPRI|WQ_FREEZABLE|WQ_MEM_RECLAIM, 512)) ||
+	    !(c->btree_read_csum_wq = alloc_workqueue("bcachefs_btree_read_csum",
+				WQ_HIGHPRI|WQ_FREEZABLE|WQ_MEM_RECLAIM|WQ_UNBOUND, 0)) ||
 	    !(c->btree_write_submit_wq = alloc_workqueue("bcachefs_btree_write_sumit",
 				WQ_HIGHPRI|WQ_FREEZABLE|WQ_MEM_RECLAIM, 1)) ||
 	    !(c->write_ref_wq = alloc_workqueue("bcachefs_write_ref",
 				WQ_FREEZABLE, 0)) ||
+	    !(c->compress_wq = alloc_workqueue("bcachefs_compress",
+				WQ_MEM_RECLAIM|WQ_UNBOUND, 0)) ||
 #ifndef BCH_WRITE_REF_DEBUG
 	    percpu_ref_init(&c->writes, bch2_writes_disabled,
 			    PERCPU_REF_INIT_DEAD, GFP_KERNEL) ||
@@ -899,16 +954,19 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	    !(c->pcpu = alloc_percpu(struct bch_fs_pcpu)) ||
 	    !(c->usage = alloc_percpu(struct bch_fs_usage_base)) ||
 	    !(c->online_reserved = alloc_percpu(u64)) ||
-	    mempool_init_kvmalloc_pool(&c->btree_bounce_pool, 1,
-				       c->opts.btree_node_size) ||
+	    bch2_fs_btree_bounce_pool_init(c) ||
 	    mempool_init_kmalloc_pool(&c->large_bkey_pool, 1, 2048) ||
-	    !(c->unused_inode_hints = kcalloc(1U << c->inode_shard_bits,
-					      sizeof(u64), GFP_KERNEL))) {
+	    !(c->inode_alloc_shards = kcalloc(1U << c->inode_shard_bits,
+					      sizeof(*c->inode_alloc_shards),
+					      GFP_KERNEL))) {
 		ret = -BCH_ERR_ENOMEM_fs_other_alloc;
 		goto err;
 	}
 
 	ret = bch2_fs_counters_init(c) ?:
+	    bch2_fs_io_attrib_init(c) ?:
+	    bch2_fs_lock_profile_init(c) ?:
+	    bch2_fs_btree_trace_init(c) ?:
 	    bch2_fs_sb_errors_init(c) ?:
 	    bch2_io_clock_init(&c->io_clock[READ]) ?:
 	    bch2_io_clock_init(&c->io_clock[WRITE]) ?:
@@ -918,6 +976,7 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	    bch2_fs_btree_key_cache_init(&c->btree_key_cache) ?:
 	    bch2_fs_btree_interior_update_init(c) ?:
 	    bch2_fs_buckets_waiting_for_journal_init(c) ?:
+	    bch2_fs_write_points_init(c) ?:
 	    bch2_fs_btree_write_buffer_init(c) ?:
 	    bch2_fs_subvolumes_init(c) ?:
 	    bch2_fs_io_read_init(c) ?:
@@ -1186,6 +1245,7 @@ static void bch2_dev_release(struct kobject *kobj)
 static void bch2_dev_free(struct bch_dev *ca)
 {
 	cancel_work_sync(&ca->io_error_work);
+	bch2_dev_io_sched_exit(ca);
 
 	if (ca->kobj.state_in_sysfs &&
 	    ca->disk_sb.bdev)
@@ -1297,6 +1357,7 @@ static struct bch_dev *__bch2_dev_alloc(struct bch_fs *c,
 	init_rwsem(&ca->bucket_lock);
 
 	INIT_WORK(&ca->io_error_work, bch2_io_error_work);
+	bch2_dev_io_sched_init(ca);
 
 	bch2_time_stats_quantiles_init(&ca->io_latency[READ]);
 	bch2_time_stats_quantiles_init(&ca->io_latency[WRITE]);
@@ -1528,6 +1589,8 @@ static bool bch2_fs_may_start(struct bch_fs *c)
 
 static void __bch2_dev_read_only(struct bch_fs *c, struct bch_dev *ca)
 {
+	bch2_dev_copygc_stop(ca);
+
 	/*
 	 * The allocator thread itself allocates btree nodes, so stop it first:
 	 */
@@ -1545,6 +1608,8 @@ static void __bch2_dev_read_write(struct bch_fs *c, struct bch_dev *ca)
 	bch2_dev_allocator_add(c, ca);
 	bch2_recalc_capacity(c);
 	bch2_dev_do_discards(ca);
+
+	bch2_dev_copygc_start(c, ca);
 }
 
 int __bch2_dev_set_state(struct bch_fs *c, struct bch_dev *ca,
@@ -1927,6 +1992,10 @@ int bch2_dev_online(struct bch_fs *c, const char *path)
 			goto err;
 	}
 
+	ret = bch2_dev_free_summary_init(c, ca);
+	if (ret)
+		goto err;
+
 	if (!ca->journal.nr) {
 		ret = bch2_dev_journal_alloc(ca, false);
 		bch_err_msg(ca, ret, "allocating journal");
@@ -1937,7 +2006,7 @@ int bch2_dev_online(struct bch_fs *c, const char *path)
 	mutex_lock(&c->sb_lock);
 	bch2_members_v2_get_mut(c->disk_sb.sb, ca->dev_idx)->last_mount =
 		cpu_to_le64(ktime_get_real_seconds());
-	bch2_write_super(c);
+	bch2_write_super_async(c);
 	mutex_unlock(&c->sb_lock);
 
 	up_write(&c->state_lock);
@@ -2017,16 +2086,9 @@ int bch2_dev_resize(struct bch_fs *c, struct bch_dev *ca, u64 nbuckets)
 	mutex_unlock(&c->sb_lock);
 
 	if (ca->mi.freespace_initialized) {
-		struct disk_accounting_pos acc = {
-			.type = BCH_DISK_ACCOUNTING_dev_data_type,
-			.dev_data_type.dev = ca->dev_idx,
-			.dev_data_type.data_type = BCH_DATA_free,
-		};
-		u64 v[3] = { nbuckets - old_nbuckets, 0, 0 };
-
 		ret   = bch2_trans_do(ca->fs, NULL, NULL, 0,
-				bch2_disk_accounting_mod(trans, &acc, v, ARRAY_SIZE(v), false)) ?:
-			bch2_dev_freespace_init(c, ca, old_nbuckets, nbuckets);
+				bch2_dev_freespace_grow(trans, ca, old_nbuckets, nbuckets)) ?:
+			bch2_dev_free_summary_init(c, ca);
 		if (ret)
 			goto err;
 	}
@@ -2057,6 +2119,69 @@ static inline int sb_cmp(struct bch_sb *l, struct bch_sb *r)
 		cmp_int(le64_to_cpu(l->write_time), le64_to_cpu(r->write_time));
 }
 
+struct read_super_work {
+	struct work_struct	work;
+	const char		*path;
+	struct bch_opts		opts;
+	struct bch_sb_handle	sb;
+	int			ret;
+};
+
+static void bch2_read_super_work(struct work_struct *work)
+{
+	struct read_super_work *w = container_of(work, struct read_super_work, work);
+
+	w->ret = bch2_read_super(w->path, &w->opts, &w->sb);
+}
+
+/*
+ * Opening, reading and validating each device's superblock is mostly waiting
+ * on IO: with many devices, do them all in parallel.
+ *
+ * bch2_read_super() may modify the options it's passed (falling back to
+ * nochanges or buffered IO), so each device gets its own copy and we merge
+ * them afterwards:
+ */
+static int bch2_read_supers(char * const *devices, unsigned nr_devices,
+			    struct bch_opts *opts, struct bch_sb_handle *sbs)
+{
+	if (nr_devices == 1) {
+		memset(sbs, 0, sizeof(*sbs));
+		return bch2_read_super(devices[0], opts, sbs);
+	}
+
+	struct read_super_work *w = kcalloc(nr_devices, sizeof(*w), GFP_KERNEL);
+	if (!w)
+		return -ENOMEM;
+
+	for (unsigned i = 0; i < nr_devices; i++) {
+		INIT_WORK(&w[i].work, bch2_read_super_work);
+		w[i].path	= devices[i];
+		w[i].opts	= *opts;
+		queue_work(system_unbound_wq, &w[i].work);
+	}
+
+	int ret = 0;
+	for (unsigned i = 0; i < nr_devices; i++) {
+		flush_work(&w[i].work);
+		ret = ret ?: w[i].ret;
+
+		if (opt_get(w[i].opts, nochanges))
+			opt_set(*opts, nochanges, true);
+		if (opt_defined(w[i].opts, direct_io) && !w[i].opts.direct_io)
+			opt_set(*opts, direct_io, false);
+	}
+
+	for (unsigned i = 0; i < nr_devices; i++)
+		if (ret)
+			bch2_free_super(&w[i].sb);
+		else
+			sbs[i] = w[i].sb;
+
+	kfree(w);
+	return ret;
+}
+
 struct bch_fs *bch2_fs_open(char * const *devices, unsigned nr_devices,
 			    struct bch_opts opts)
 {
@@ -2078,15 +2203,10 @@ struct bch_fs *bch2_fs_open(char * const *devices, unsigned nr_devices,
 	if (ret)
 		goto err;
 
-	for (unsigned i = 0; i < nr_devices; i++) {
-		struct bch_sb_handle sb = { NULL };
-
-		ret = bch2_read_super(devices[i], &opts, &sb);
-		if (ret)
-			goto err;
-
-		BUG_ON(darray_push(&sbs, sb));
-	}
+	ret = bch2_read_supers(devices, nr_devices, &opts, sbs.data);
+	if (ret)
+		goto err;
+	sbs.nr = nr_devices;
 
 	if (opts.nochanges && !opts.read_only) {
 		ret = -BCH_ERR_erofs_nochanges;
@@ -16,6 +16,7 @@
 #include "btree_io.h"
 #include "btree_iter.h"
 #include "btree_key_cache.h"
+#include "btree_trace.h"
 #include "btree_update.h"
 #include "btree_update_interior.h"
 #include "btree_gc.h"
@@ -26,7 +27,10 @@
 #include "disk_groups.h"
 #include "ec.h"
 #include "inode.h"
+#include "io_attrib.h"
+#include "io_sched.h"
 #include "journal.h"
+#include "journal_io.h"
 #include "journal_reclaim.h"
 #include "keylist.h"
 #include "move.h"
@@ -169,8 +173,10 @@ read_attribute(btree_write_stats);
 
 read_attribute(btree_cache_size);
 read_attribute(compression_stats);
+read_attribute(journal_entry_stats);
 read_attribute(journal_debug);
 read_attribute(btree_cache);
+read_attribute(btree_cache_lookups);
 read_attribute(btree_key_cache);
 read_attribute(btree_reserve_cache);
 read_attribute(stripes_heap);
@@ -203,6 +209,8 @@ read_attribute(disk_groups);
 
 read_attribute(has_data);
 read_attribute(alloc_debug);
+read_attribute(discard_backlog);
+read_attribute(io_sched);
 read_attribute(accounting);
 read_attribute(usage_base);
 
@@ -226,6 +234,8 @@ read_attribute(io_timers_read);
 read_attribute(io_timers_write);
 
 read_attribute(moving_ctxts);
+read_attribute(io_attrib);
+write_attribute(io_attrib_reset);
 
 #ifdef CONFIG_BCACHEFS_TESTS
 write_attribute(perf_test);
@@ -354,6 +364,9 @@ SHOW(bch2_fs)
 	if (attr == &sysfs_btree_cache)
 		bch2_btree_cache_to_text(out, &c->btree_cache);
 
+	if (attr == &sysfs_btree_cache_lookups)
+		bch2_btree_cache_lookups_to_text(out, &c->btree_cache);
+
 	if (attr == &sysfs_btree_key_cache)
 		bch2_btree_key_cache_to_text(out, &c->btree_key_cache);
 
@@ -375,6 +388,16 @@ SHOW(bch2_fs)
 	if (attr == &sysfs_compression_stats)
 		bch2_compression_stats_to_text(out, c);
 
+	if (attr == &sysfs_journal_entry_stats) {
+		struct journal_entry_stats stats;
+
+		mutex_lock(&c->journal.buf_lock);
+		stats = c->journal.entry_stats;
+		mutex_unlock(&c->journal.buf_lock);
+
+		bch2_journal_entry_stats_to_text(out, &stats);
+	}
+
 	if (attr == &sysfs_new_stripes)
 		bch2_new_stripes_to_text(out, c);
 
@@ -387,6 +410,9 @@ SHOW(bch2_fs)
 	if (attr == &sysfs_moving_ctxts)
 		bch2_fs_moving_ctxts_to_text(out, c);
 
+	if (attr == &sysfs_io_attrib)
+		bch2_io_attrib_to_text(out, c);
+
 #ifdef BCH_WRITE_REF_DEBUG
 	if (attr == &sysfs_write_refs)
 		bch2_write_refs_to_text(out, c);
@@ -418,8 +444,7 @@ STORE(bch2_fs)
 		ssize_t ret = strtoul_safe(buf, c->copy_gc_enabled)
 			?: (ssize_t) size;
 
-		if (c->copygc_thread)
-			wake_up_process(c->copygc_thread);
+		bch2_copygc_wakeup(c);
 		return ret;
 	}
 
@@ -479,6 +504,9 @@ STORE(bch2_fs)
 	if (attr == &sysfs_trigger_freelist_wakeup)
 		closure_wake_up(&c->freelist_wait);
 
+	if (attr == &sysfs_io_attrib_reset)
+		bch2_io_attrib_reset(c);
+
 #ifdef CONFIG_BCACHEFS_TESTS
 	if (attr == &sysfs_perf_test) {
 		char *tmp = kstrdup(buf, GFP_KERNEL), *p = tmp;
@@ -512,6 +540,7 @@ struct attribute *bch2_fs_files[] = {
 	&sysfs_rebalance_status,
 
 	&sysfs_compression_stats,
+	&sysfs_journal_entry_stats,
 
 #ifdef CONFIG_BCACHEFS_TESTS
 	&sysfs_perf_test,
@@ -580,6 +609,7 @@ struct attribute *bch2_fs_internal_files[] = {
 	&sysfs_flags,
 	&sysfs_journal_debug,
 	&sysfs_btree_cache,
+	&sysfs_btree_cache_lookups,
 	&sysfs_btree_key_cache,
 	&sysfs_btree_reserve_cache,
 	&sysfs_new_stripes,
@@ -612,6 +642,8 @@ struct attribute *bch2_fs_internal_files[] = {
 	sysfs_pd_controller_files(rebalance),
 
 	&sysfs_moving_ctxts,
+	&sysfs_io_attrib,
+	&sysfs_io_attrib_reset,
 
 	&sysfs_internal_uuid,
 
@@ -641,6 +673,7 @@ STORE(bch2_fs_opts_dir)
 {
 	struct bch_fs *c = container_of(kobj, struct bch_fs, opts_dir);
 	const struct bch_option *opt = container_of(attr, struct bch_option, attr);
+	struct bch_io_opts old_io_opts;
 	int ret, id = opt - bch2_opt_table;
 	char *tmp;
 	u64 v;
@@ -668,15 +701,31 @@ STORE(bch2_fs_opts_dir)
 	if (ret < 0)
 		goto err;
 
+	old_io_opts = bch2_opts_to_inode_opts(c->opts);
+
 	bch2_opt_set_sb(c, NULL, opt, v);
 	bch2_opt_set_by_id(&c->opts, id, v);
 
-	if (v &&
-	    (id == Opt_background_target ||
-	     id == Opt_background_compression ||
-	     (id == Opt_compression && !c->opts.background_compression)))
+	if (bch2_rebalance_opts_changed(old_io_opts, bch2_opts_to_inode_opts(c->opts)))
 		bch2_set_rebalance_needs_scan(c, 0);
 
+	if (id == Opt_lock_profiling) {
+		ret = bch2_fs_lock_profile_init(c);
+		if (ret)
+			goto err;
+	}
+
+	if (id == Opt_btree_trace) {
+		ret = bch2_fs_btree_trace_init(c);
+		if (ret)
+			goto err;
+	}
+
+	if (id == Opt_writeback_high_watermark ||
+	    id == Opt_writeback_low_watermark ||
+	    id == Opt_writeback_idle_delay)
+		rebalance_wakeup(c);
+
 	ret = size;
 err:
 	bch2_write_ref_put(c, BCH_WRITE_REF_sysfs);
@@ -808,6 +857,12 @@ SHOW(bch2_dev)
 	if (attr == &sysfs_open_buckets)
 		bch2_open_buckets_to_text(out, c, ca);
 
+	if (attr == &sysfs_discard_backlog)
+		bch2_dev_discard_backlog_to_text(out, ca);
+
+	if (attr == &sysfs_io_sched)
+		bch2_dev_io_sched_to_text(out, ca);
+
 	return 0;
 }
 
@@ -875,6 +930,8 @@ struct attribute *bch2_dev_files[] = {
 	/* debug: */
 	&sysfs_alloc_debug,
 	&sysfs_open_buckets,
+	&sysfs_discard_backlog,
+	&sysfs_io_sched,
 	NULL
 };
 
@@ -2,11 +2,21 @@
 #ifdef CONFIG_BCACHEFS_TESTS
 
 #include "bcachefs.h"
+#include "alloc_foreground.h"
+#include "btree_trace_format.h"
 #include "btree_update.h"
+#include "buckets.h"
+#include "dirent.h"
+#include "fs-common.h"
+#include "inode.h"
+#include "io_read.h"
+#include "io_write.h"
 #include "journal_reclaim.h"
+#include "reflink.h"
 #include "snapshot.h"
 #include "tests.h"
 
+#include "linux/delay.h"
 #include "linux/kthread.h"
 #include "linux/random.h"
 
@@ -528,6 +538,117 @@ static int test_snapshots(struct bch_fs *c, u64 nr)
 
 /* perf tests */
 
+const char * const bch2_perf_test_dists[] = {
+#define x(n)	#n,
+	BCH_PERF_TEST_DISTS()
+#undef x
+	NULL
+};
+
+/* Latency histogram: log-linear, PERF_HIST_SUB linear buckets per power of two */
+
+static inline unsigned perf_hist_idx(u64 v)
+{
+	unsigned e = fls64(v);
+
+	if (e <= PERF_HIST_SUB_BITS)
+		return v;
+
+	e -= PERF_HIST_SUB_BITS + 1;
+	return (e + 1) * PERF_HIST_SUB + ((v >> e) - PERF_HIST_SUB);
+}
+
+/* highest value that maps to bucket @idx: */
+static inline u64 perf_hist_bucket_max(unsigned idx)
+{
+	unsigned e = idx / PERF_HIST_SUB;
+	u64 sub = idx % PERF_HIST_SUB;
+
+	if (!e)
+		return sub;
+
+	e--;
+	return ((PERF_HIST_SUB + sub + 1) << e) - 1;
+}
+
+static void perf_hist_add(struct bch2_perf_test_hist *h, u64 v)
+{
+	h->nr++;
+	h->sum += v;
+	h->max = max(h->max, v);
+	h->buckets[perf_hist_idx(v)]++;
+}
+
+void bch2_perf_test_hist_merge(struct bch2_perf_test_hist *dst,
+			       const struct bch2_perf_test_hist *src)
+{
+	dst->nr		+= src->nr;
+	dst->sum	+= src->sum;
+	dst->max	= max(dst->max, src->max);
+
+	for (unsigned i = 0; i < PERF_HIST_NR; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+/* @ppm: quantile in parts per million, e.g. 999000 for p99.9 */
+u64 bch2_perf_test_hist_quantile(const struct bch2_perf_test_hist *h, unsigned ppm)
+{
+	u64 target = div_u64(h->nr * ppm + 999999, 1000000), seen = 0;
+
+	if (!h->nr)
+		return 0;
+
+	for (unsigned i = 0; i < PERF_HIST_NR; i++) {
+		seen += h->buckets[i];
+		if (seen >= target)
+			return min(perf_hist_bucket_max(i), h->max);
+	}
+
+	return h->max;
+}
+
+/*
+ * State for the run in progress, serialized by perf_test_lock: each perf test
+ * thread claims its own histogram, so recording latency doesn't add
+ * contention; the caller merges them when the run completes.
+ */
+static DEFINE_MUTEX(perf_test_lock);
+static struct bch2_perf_test_hist *perf_test_hists;
+static unsigned perf_test_hists_nr;
+static atomic_t perf_test_hists_next;
+
+static enum bch2_perf_test_dist perf_test_dist;
+static u64 perf_test_nr_keys;
+static atomic64_t perf_test_seq_pos;
+
+struct perf_test_op {
+	struct bch2_perf_test_hist	*hist;
+	u64				last;
+};
+
+static void perf_test_op_start(struct perf_test_op *op)
+{
+	unsigned idx;
+
+	op->hist = NULL;
+	if (perf_test_hists) {
+		idx = atomic_inc_return(&perf_test_hists_next) - 1;
+		if (idx < perf_test_hists_nr)
+			op->hist = perf_test_hists + idx;
+	}
+	op->last = local_clock();
+}
+
+/* called once per iteration of a perf test, timed from the previous one: */
+static inline void perf_test_op_done(struct perf_test_op *op)
+{
+	u64 now = local_clock();
+
+	if (op->hist)
+		perf_hist_add(op->hist, now - op->last);
+	op->last = now;
+}
+
 static u64 test_rand(void)
 {
 	u64 v;
@@ -536,22 +657,52 @@ static u64 test_rand(void)
 	return v;
 }
 
+/*
+ * Approximately zipfian (s = 1) ranks in [1, nr]: each power of two is equally
+ * likely, so p(k) ~ 1/k. Ranks are then scrambled so that hot keys are spread
+ * over the keyspace instead of clustered in the first few leaf nodes:
+ */
+static u64 test_zipf_key(u64 nr)
+{
+	unsigned e = get_random_u32_below(fls64(max(nr, 1ULL)));
+	u64 rank = BIT_ULL(e) + (test_rand() & (BIT_ULL(e) - 1));
+
+	return hash_64(rank, 64);
+}
+
+static u64 test_key(void)
+{
+	switch (perf_test_dist) {
+	case BCH_PERF_TEST_DIST_zipfian:
+		return test_zipf_key(perf_test_nr_keys);
+	case BCH_PERF_TEST_DIST_sequential:
+		/* ascending, with random holes of up to 7 keys: */
+		return atomic64_add_return(1 + get_random_u32_below(8),
+					   &perf_test_seq_pos);
+	default:
+		return test_rand();
+	}
+}
+
 static int rand_insert(struct bch_fs *c, u64 nr)
 {
 	struct btree_trans *trans = bch2_trans_get(c);
 	struct bkey_i_cookie k;
 	int ret = 0;
+	struct perf_test_op op;
 	u64 i;
 
+	perf_test_op_start(&op);
 	for (i = 0; i < nr; i++) {
 		bkey_cookie_init(&k.k_i);
-		k.k.p.offset = test_rand();
+		k.k.p.offset = test_key();
 		k.k.p.snapshot = U32_MAX;
 
 		ret = commit_do(trans, NULL, NULL, 0,
 			bch2_btree_insert_trans(trans, BTREE_ID_xattrs, &k.k_i, 0));
 		if (ret)
 			break;
+		perf_test_op_done(&op);
 	}
 
 	bch2_trans_put(trans);
@@ -564,12 +715,14 @@ static int rand_insert_multi(struct bch_fs *c, u64 nr)
 	struct bkey_i_cookie k[8];
 	int ret = 0;
 	unsigned j;
+	struct perf_test_op op;
 	u64 i;
 
+	perf_test_op_start(&op);
 	for (i = 0; i < nr; i += ARRAY_SIZE(k)) {
 		for (j = 0; j < ARRAY_SIZE(k); j++) {
 			bkey_cookie_init(&k[j].k_i);
-			k[j].k.p.offset = test_rand();
+			k[j].k.p.offset = test_key();
 			k[j].k.p.snapshot = U32_MAX;
 		}
 
@@ -584,6 +737,7 @@ static int rand_insert_multi(struct bch_fs *c, u64 nr)
 			bch2_btree_insert_trans(trans, BTREE_ID_xattrs, &k[7].k_i, 0));
 		if (ret)
 			break;
+		perf_test_op_done(&op);
 	}
 
 	bch2_trans_put(trans);
@@ -596,18 +750,21 @@ static int rand_lookup(struct bch_fs *c, u64 nr)
 	struct btree_iter iter;
 	struct bkey_s_c k;
 	int ret = 0;
+	struct perf_test_op op;
 	u64 i;
 
 	bch2_trans_iter_init(trans, &iter, BTREE_ID_xattrs,
 			     SPOS(0, 0, U32_MAX), 0);
 
+	perf_test_op_start(&op);
 	for (i = 0; i < nr; i++) {
-		bch2_btree_iter_set_pos(&iter, SPOS(0, test_rand(), U32_MAX));
+		bch2_btree_iter_set_pos(&iter, SPOS(0, test_key(), U32_MAX));
 
 		lockrestart_do(trans, bkey_err(k = bch2_btree_iter_peek(&iter)));
 		ret = bkey_err(k);
 		if (ret)
 			break;
+		perf_test_op_done(&op);
 	}
 
 	bch2_trans_iter_exit(trans, &iter);
@@ -646,17 +803,20 @@ static int rand_mixed(struct bch_fs *c, u64 nr)
 	struct btree_iter iter;
 	struct bkey_i_cookie cookie;
 	int ret = 0;
+	struct perf_test_op op;
 	u64 i, rand;
 
 	bch2_trans_iter_init(trans, &iter, BTREE_ID_xattrs,
 			     SPOS(0, 0, U32_MAX), 0);
 
+	perf_test_op_start(&op);
 	for (i = 0; i < nr; i++) {
-		rand = test_rand();
+		rand = test_key();
 		ret = commit_do(trans, NULL, NULL, 0,
 			rand_mixed_trans(trans, &iter, &cookie, i, rand));
 		if (ret)
 			break;
+		perf_test_op_done(&op);
 	}
 
 	bch2_trans_iter_exit(trans, &iter);
@@ -690,15 +850,18 @@ static int rand_delete(struct bch_fs *c, u64 nr)
 {
 	struct btree_trans *trans = bch2_trans_get(c);
 	int ret = 0;
+	struct perf_test_op op;
 	u64 i;
 
+	perf_test_op_start(&op);
 	for (i = 0; i < nr; i++) {
-		struct bpos pos = SPOS(0, test_rand(), U32_MAX);
+		struct bpos pos = SPOS(0, test_key(), U32_MAX);
 
 		ret = commit_do(trans, NULL, NULL, 0,
 			__do_delete(trans, pos));
 		if (ret)
 			break;
+		perf_test_op_done(&op);
 	}
 
 	bch2_trans_put(trans);
@@ -708,9 +871,11 @@ static int rand_delete(struct bch_fs *c, u64 nr)
 static int seq_insert(struct bch_fs *c, u64 nr)
 {
 	struct bkey_i_cookie insert;
+	struct perf_test_op op;
 
 	bkey_cookie_init(&insert.k_i);
 
+	perf_test_op_start(&op);
 	return bch2_trans_run(c,
 		for_each_btree_key_commit(trans, iter, BTREE_ID_xattrs,
 					SPOS(0, 0, U32_MAX),
@@ -718,6 +883,7 @@ static int seq_insert(struct bch_fs *c, u64 nr)
 					NULL, NULL, 0, ({
 			if (iter.pos.offset >= nr)
 				break;
+			perf_test_op_done(&op);
 			insert.k.p = iter.pos;
 			bch2_trans_update(trans, &iter, &insert.k_i, 0);
 		})));
@@ -725,15 +891,23 @@ static int seq_insert(struct bch_fs *c, u64 nr)
 
 static int seq_lookup(struct bch_fs *c, u64 nr)
 {
+	struct perf_test_op op;
+
+	perf_test_op_start(&op);
 	return bch2_trans_run(c,
 		for_each_btree_key_upto(trans, iter, BTREE_ID_xattrs,
 				  SPOS(0, 0, U32_MAX), POS(0, U64_MAX),
-				  0, k,
-		0));
+				  0, k, ({
+			perf_test_op_done(&op);
+			0;
+		})));
 }
 
 static int seq_overwrite(struct bch_fs *c, u64 nr)
 {
+	struct perf_test_op op;
+
+	perf_test_op_start(&op);
 	return bch2_trans_run(c,
 		for_each_btree_key_commit(trans, iter, BTREE_ID_xattrs,
 					SPOS(0, 0, U32_MAX),
@@ -741,6 +915,7 @@ static int seq_overwrite(struct bch_fs *c, u64 nr)
 					NULL, NULL, 0, ({
 			struct bkey_i_cookie u;
 
+			perf_test_op_done(&op);
 			bkey_reassemble(&u.k_i, k);
 			bch2_trans_update(trans, &iter, &u.k_i, 0);
 		})));
@@ -754,6 +929,338 @@ static int seq_delete(struct bch_fs *c, u64 nr)
 				      0, NULL);
 }
 
+/*
+ * Data path and namespace perf tests: these go through the same paths as the
+ * filesystem (bch2_write(), bch2_read(), fs-common.c, reflink) on files in the
+ * root directory, with the filesystem's compression, checksum and replicas
+ * options; they bypass the VFS, so only run them on a scratch filesystem.
+ *
+ * For data tests, nr is the number of PERF_TEST_IO_BYTES IOs, and the test
+ * file is nr IOs in size.
+ */
+
+#define PERF_TEST_IO_BYTES	(64 << 10)
+
+struct perf_test_io {
+	struct closure		cl;
+	subvol_inum		inum;
+	struct bch_io_opts	opts;
+	void			*buf;
+	union {
+		struct bch_write_op	op;
+		struct bch_read_bio	rbio;
+	};
+	struct bio_vec		bv[PERF_TEST_IO_BYTES / PAGE_SIZE + 1];
+};
+
+static int perf_test_file(struct bch_fs *c, const char *name, subvol_inum *inum)
+{
+	subvol_inum root = BCACHEFS_ROOT_SUBVOL_INUM;
+	struct bch_inode_unpacked root_u, inode_u;
+	struct qstr qstr = QSTR(name);
+	int ret;
+
+	while (1) {
+		ret = bch2_inode_find_by_inum(c, root, &root_u);
+		if (ret)
+			return ret;
+
+		struct bch_hash_info hash = bch2_hash_info_init(c, &root_u);
+
+		ret = bch2_dirent_lookup(c, root, &hash, &qstr, inum);
+		if (ret != -ENOENT)
+			return ret;
+
+		bch2_inode_init_early(c, &inode_u);
+
+		ret = bch2_trans_do(c, NULL, NULL, 0,
+			bch2_create_trans(trans, root, &root_u, &inode_u, &qstr,
+					  0, 0, S_IFREG|0600, 0, NULL, NULL,
+					  (subvol_inum) {}, 0));
+		/* another test thread may have created it first: */
+		if (!bch2_err_matches(ret, EEXIST))
+			break;
+	}
+
+	if (!ret)
+		*inum = (subvol_inum) { root.subvol, inode_u.bi_inum };
+	return ret;
+}
+
+static struct perf_test_io *perf_test_io_alloc(struct bch_fs *c, const char *name)
+{
+	struct perf_test_io *io = kvzalloc(sizeof(*io), GFP_KERNEL);
+	struct bch_inode_unpacked inode_u;
+	int ret;
+
+	if (!io)
+		return ERR_PTR(-ENOMEM);
+
+	io->buf = kvmalloc(PERF_TEST_IO_BYTES, GFP_KERNEL);
+	if (!io->buf) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	/* half random, half zeroes: compressible, but not trivially */
+	get_random_bytes(io->buf, PERF_TEST_IO_BYTES / 2);
+	memset(io->buf + PERF_TEST_IO_BYTES / 2, 0, PERF_TEST_IO_BYTES / 2);
+
+	ret =   perf_test_file(c, name, &io->inum) ?:
+		bch2_inode_find_by_inum(c, io->inum, &inode_u);
+	if (ret)
+		goto err;
+
+	bch2_inode_opts_get(&io->opts, c, &inode_u);
+	return io;
+err:
+	kvfree(io->buf);
+	kvfree(io);
+	return ERR_PTR(ret);
+}
+
+static void perf_test_io_free(struct perf_test_io *io)
+{
+	kvfree(io->buf);
+	kvfree(io);
+}
+
+static u64 test_data_offset(void)
+{
+	u64 idx;
+
+	div64_u64_rem(test_key(), max(perf_test_nr_keys, 1ULL), &idx);
+	return idx * PERF_TEST_IO_BYTES;
+}
+
+static void perf_test_write_endio(struct bch_write_op *op)
+{
+	struct perf_test_io *io = container_of(op, struct perf_test_io, op);
+
+	closure_put(&io->cl);
+}
+
+static int perf_test_write(struct bch_fs *c, struct perf_test_io *io, u64 offset)
+{
+	struct bch_write_op *op = &io->op;
+	int ret;
+
+	bch2_write_op_init(op, c, io->opts);
+	op->write_point	= writepoint_hashed((unsigned long) current);
+	op->nr_replicas	= io->opts.data_replicas;
+	op->target	= io->opts.foreground_target;
+	op->subvol	= io->inum.subvol;
+	op->pos		= POS(io->inum.inum, offset >> 9);
+	op->new_i_size	= offset + PERF_TEST_IO_BYTES;
+	op->end_io	= perf_test_write_endio;
+
+	bio_init(&op->wbio.bio, NULL, io->bv, ARRAY_SIZE(io->bv), REQ_OP_WRITE);
+	bch2_bio_map(&op->wbio.bio, io->buf, PERF_TEST_IO_BYTES);
+
+	ret = bch2_disk_reservation_get(c, &op->res, PERF_TEST_IO_BYTES >> 9,
+					op->nr_replicas, 0);
+	if (ret)
+		return ret;
+
+	closure_init_stack(&io->cl);
+	closure_get(&io->cl);
+	closure_call(&op->cl, bch2_write, NULL, NULL);
+	closure_sync(&io->cl);
+
+	return op->error;
+}
+
+static void perf_test_read_endio(struct bio *bio)
+{
+	closure_put(bio->bi_private);
+}
+
+static int perf_test_read(struct bch_fs *c, struct perf_test_io *io, u64 offset)
+{
+	struct bio *bio = &io->rbio.bio;
+
+	bio_init(bio, NULL, io->bv, ARRAY_SIZE(io->bv), REQ_OP_READ);
+	bio->bi_iter.bi_sector	= offset >> 9;
+	bio->bi_end_io		= perf_test_read_endio;
+	bio->bi_private		= &io->cl;
+	bch2_bio_map(bio, io->buf, PERF_TEST_IO_BYTES);
+
+	closure_init_stack(&io->cl);
+	closure_get(&io->cl);
+	bch2_read(c, rbio_init(bio, io->opts), io->inum, 0);
+	closure_sync(&io->cl);
+
+	return blk_status_to_errno(bio->bi_status);
+}
+
+static int __data_test(struct bch_fs *c, u64 nr, bool write, bool seq)
+{
+	struct perf_test_io *io = perf_test_io_alloc(c, "perf_test_data");
+	struct perf_test_op op;
+	int ret = 0;
+
+	if (IS_ERR(io))
+		return PTR_ERR(io);
+
+	perf_test_op_start(&op);
+	for (u64 i = 0; i < nr; i++) {
+		/* sequential tests share one cursor, so threads don't overlap: */
+		u64 offset = seq
+			? (atomic64_inc_return(&perf_test_seq_pos) - 1) * PERF_TEST_IO_BYTES
+			: test_data_offset();
+
+		ret = write
+			? perf_test_write(c, io, offset)
+			: perf_test_read(c, io, offset);
+		if (ret)
+			break;
+		perf_test_op_done(&op);
+	}
+
+	perf_test_io_free(io);
+	return ret;
+}
+
+static int data_write_seq(struct bch_fs *c, u64 nr)
+{
+	return __data_test(c, nr, true, true);
+}
+
+static int data_write_rand(struct bch_fs *c, u64 nr)
+{
+	return __data_test(c, nr, true, false);
+}
+
+static int data_read_seq(struct bch_fs *c, u64 nr)
+{
+	return __data_test(c, nr, false, true);
+}
+
+static int data_read_rand(struct bch_fs *c, u64 nr)
+{
+	return __data_test(c, nr, false, false);
+}
+
+/* remaps random ranges of the data file (run data_write_* first) into another file: */
+static int reflink_remap(struct bch_fs *c, u64 nr)
+{
+	subvol_inum src, dst;
+	struct perf_test_op op;
+	s64 i_sectors_delta = 0;
+	int ret;
+
+	ret =   perf_test_file(c, "perf_test_data", &src) ?:
+		perf_test_file(c, "perf_test_reflink", &dst);
+	if (ret)
+		return ret;
+
+	perf_test_op_start(&op);
+	for (u64 i = 0; i < nr; i++) {
+		u64 dst_offset = (atomic64_inc_return(&perf_test_seq_pos) - 1) *
+			PERF_TEST_IO_BYTES;
+		s64 sectors = bch2_remap_range(c,
+					dst, dst_offset >> 9,
+					src, test_data_offset() >> 9,
+					PERF_TEST_IO_BYTES >> 9,
+					dst_offset + PERF_TEST_IO_BYTES,
+					&i_sectors_delta);
+		if (sectors < 0) {
+			ret = sectors;
+			break;
+		}
+		perf_test_op_done(&op);
+	}
+
+	return ret;
+}
+
+static int perf_test_unlink(struct bch_fs *c, const struct qstr *name)
+{
+	subvol_inum root = BCACHEFS_ROOT_SUBVOL_INUM;
+	struct bch_inode_unpacked root_u, inode_u;
+	int ret;
+
+	ret = bch2_trans_do(c, NULL, NULL, BCH_TRANS_COMMIT_no_enospc,
+		bch2_unlink_trans(trans, root, &root_u, &inode_u, name, false));
+	if (ret)
+		return ret;
+
+	/* what evict does for the last reference to an unlinked inode: */
+	return bch2_inode_rm(c, (subvol_inum) { root.subvol, inode_u.bi_inum });
+}
+
+/* each op creates a file in the root directory and then unlinks it: */
+static int fs_create_unlink(struct bch_fs *c, u64 nr)
+{
+	subvol_inum root = BCACHEFS_ROOT_SUBVOL_INUM;
+	struct bch_inode_unpacked root_u, inode_u;
+	struct perf_test_op op;
+	char name_buf[32];
+	int ret = 0;
+
+	perf_test_op_start(&op);
+	for (u64 i = 0; i < nr; i++) {
+		scnprintf(name_buf, sizeof(name_buf), "perf_test.%llu",
+			  atomic64_inc_return(&perf_test_seq_pos));
+
+		struct qstr name = QSTR(name_buf);
+
+		bch2_inode_init_early(c, &inode_u);
+
+		ret =   bch2_trans_do(c, NULL, NULL, 0,
+				bch2_create_trans(trans, root, &root_u, &inode_u, &name,
+						  0, 0, S_IFREG|0600, 0, NULL, NULL,
+						  (subvol_inum) {}, 0)) ?:
+			perf_test_unlink(c, &name);
+		if (ret)
+			break;
+		perf_test_op_done(&op);
+	}
+
+	return ret;
+}
+
+/* each op renames a file in the root directory, back and forth between two names: */
+static int fs_rename(struct bch_fs *c, u64 nr)
+{
+	subvol_inum root = BCACHEFS_ROOT_SUBVOL_INUM, inum;
+	struct bch_inode_unpacked src_dir_u, dst_dir_u, src_inode_u, dst_inode_u;
+	struct perf_test_op op;
+	char names[2][32];
+	unsigned cur = 0;
+	u64 id = atomic64_inc_return(&perf_test_seq_pos);
+	int ret;
+
+	scnprintf(names[0], sizeof(names[0]), "perf_test_rename.%llu.a", id);
+	scnprintf(names[1], sizeof(names[1]), "perf_test_rename.%llu.b", id);
+
+	ret = perf_test_file(c, names[0], &inum);
+	if (ret)
+		return ret;
+
+	perf_test_op_start(&op);
+	for (u64 i = 0; i < nr; i++) {
+		struct qstr src = QSTR(names[cur]);
+		struct qstr dst = QSTR(names[!cur]);
+
+		ret = bch2_trans_do(c, NULL, NULL, 0,
+			bch2_rename_trans(trans,
+					  root, &src_dir_u,
+					  root, &dst_dir_u,
+					  &src_inode_u, &dst_inode_u,
+					  &src, &dst, BCH_RENAME));
+		if (ret)
+			break;
+		cur ^= 1;
+		perf_test_op_done(&op);
+	}
+
+	struct qstr name = QSTR(names[cur]);
+	int ret2 = perf_test_unlink(c, &name);
+
+	return ret ?: ret2;
+}
+
 typedef int (*perf_test_fn)(struct bch_fs *, u64);
 
 struct test_job {
@@ -799,15 +1306,13 @@ static int btree_perf_test_thread(void *data)
 	return 0;
 }
 
-int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
-			 u64 nr, unsigned nr_threads)
+int __bch2_btree_perf_test(struct bch_fs *c, const char *testname,
+			   u64 nr, unsigned nr_threads,
+			   struct bch2_perf_test_result *r)
 {
 	struct test_job j = { .c = c, .nr = nr, .nr_threads = nr_threads };
-	char name_buf[20];
-	struct printbuf nr_buf = PRINTBUF;
-	struct printbuf per_sec_buf = PRINTBUF;
 	unsigned i;
-	u64 time;
+	int ret = 0;
 
 	atomic_set(&j.ready, nr_threads);
 	init_waitqueue_head(&j.ready_wait);
@@ -829,6 +1334,14 @@ int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 	perf_test(seq_overwrite);
 	perf_test(seq_delete);
 
+	perf_test(data_write_seq);
+	perf_test(data_write_rand);
+	perf_test(data_read_seq);
+	perf_test(data_read_rand);
+	perf_test(reflink_remap);
+	perf_test(fs_create_unlink);
+	perf_test(fs_rename);
+
 	/* a unit test, not a perf test: */
 	perf_test(test_delete);
 	perf_test(test_delete_written);
@@ -854,6 +1367,31 @@ int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 
 	//pr_info("running test %s:", testname);
 
+	mutex_lock(&perf_test_lock);
+	perf_test_dist		= r->dist;
+	perf_test_nr_keys	= nr;
+	atomic64_set(&perf_test_seq_pos, 0);
+
+	/* warm up caches and the btree shape; not measured: */
+	if (r->warmup) {
+		ret = j.fn(c, r->warmup);
+		if (ret) {
+			bch_err(c, "%ps: error %s during warmup", j.fn, bch2_err_str(ret));
+			goto out;
+		}
+	}
+
+	if (r->latency) {
+		perf_test_hists = kvzalloc(sizeof(*perf_test_hists) * nr_threads,
+					   GFP_KERNEL);
+		if (!perf_test_hists) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		perf_test_hists_nr = nr_threads;
+		atomic_set(&perf_test_hists_next, 0);
+	}
+
 	if (nr_threads == 1)
 		btree_perf_test_thread(&j);
 	else
@@ -864,7 +1402,163 @@ int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 	while (wait_for_completion_interruptible(&j.done_completion))
 		;
 
-	time = j.finish - j.start;
+	if (perf_test_hists) {
+		for (i = 0; i < nr_threads; i++)
+			bch2_perf_test_hist_merge(r->latency, perf_test_hists + i);
+		kvfree(perf_test_hists);
+		perf_test_hists = NULL;
+	}
+
+	r->time = j.finish - j.start;
+	ret = j.ret;
+out:
+	perf_test_dist = BCH_PERF_TEST_DIST_uniform;
+	mutex_unlock(&perf_test_lock);
+	return ret;
+}
+
+/*
+ * Replay of captured btree workloads (debugfs btree_trace): each update is
+ * mapped to a cookie key of the same size in the test keyspace, so that the
+ * replay can run on a scratch filesystem - the original btree and position
+ * are folded into the key's offset, preserving locality and overwrites, and
+ * updates are committed in the same groupings as the original transactions.
+ */
+
+#define BTREE_TRACE_REPLAY_MAX_U64s	U8_MAX
+
+static struct bpos btree_trace_replay_pos(const struct btree_trace_entry *e)
+{
+	return SPOS(0,
+		    (u64) e->btree_id << 56 |
+		    (le64_to_cpu(e->inode) & ((1ULL << 24) - 1)) << 32 |
+		    (le64_to_cpu(e->offset) & U32_MAX),
+		    U32_MAX);
+}
+
+static int btree_trace_replay_update(struct btree_trans *trans,
+				     const struct btree_trace_entry *e)
+{
+	unsigned u64s = e->op == BTREE_TRACE_delete
+		? BKEY_U64s
+		: clamp_t(unsigned, le16_to_cpu(e->u64s),
+			  sizeof(struct bkey_i_cookie) / sizeof(u64),
+			  BTREE_TRACE_REPLAY_MAX_U64s);
+	struct bkey_i *k = bch2_trans_kmalloc(trans, u64s * sizeof(u64));
+	int ret = PTR_ERR_OR_ZERO(k);
+	if (ret)
+		return ret;
+
+	if (e->op == BTREE_TRACE_delete)
+		bkey_init(&k->k);
+	else
+		bkey_cookie_init(k);
+	k->k.u64s	= u64s;
+	k->k.p		= btree_trace_replay_pos(e);
+
+	return bch2_btree_insert_trans(trans, BTREE_ID_xattrs, k, 0);
+}
+
+static int btree_trace_replay_trans(struct btree_trans *trans,
+				    const struct btree_trace_entry *e,
+				    size_t nr)
+{
+	for (size_t i = 0; i < nr; i++) {
+		int ret = btree_trace_replay_update(trans, e + i);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * @timed: issue transactions at the same offsets from the start as they were
+ * recorded, instead of as fast as possible
+ */
+int bch2_btree_trace_replay(struct bch_fs *c,
+			    const struct btree_trace_entry *e, size_t nr,
+			    bool timed, struct bch2_perf_test_result *r)
+{
+	struct btree_trans *trans = bch2_trans_get(c);
+	u64 trace_start = nr ? le64_to_cpu(e[0].time) : 0;
+	u64 start, now;
+	int ret = 0;
+
+	mutex_lock(&perf_test_lock);
+	start = local_clock();
+
+	for (size_t i = 0, n; i < nr; i += n) {
+		for (n = 1; i + n < nr && !(e[i + n].flags & BTREE_TRACE_FIRST); n++)
+			;
+
+		if (timed) {
+			u64 target = start + le64_to_cpu(e[i].time) - trace_start;
+
+			now = local_clock();
+			if (time_after64(target, now))
+				fsleep(div_u64(target - now, NSEC_PER_USEC));
+		}
+
+		u64 op_start = local_clock();
+
+		ret = commit_do(trans, NULL, NULL, 0,
+				btree_trace_replay_trans(trans, e + i, n));
+		if (ret) {
+			bch_err_msg(c, ret, "replaying btree trace");
+			break;
+		}
+
+		if (r->latency)
+			perf_hist_add(r->latency, local_clock() - op_start);
+	}
+
+	r->time = local_clock() - start;
+	mutex_unlock(&perf_test_lock);
+	bch2_trans_put(trans);
+	return ret;
+}
+
+static void perf_test_latency_to_text(struct printbuf *out,
+				      const struct bch2_perf_test_hist *h)
+{
+	static const struct {
+		const char	*name;
+		unsigned	ppm;
+	} q[] = {
+		{ "p50",	500000 },
+		{ "p99",	990000 },
+		{ "p999",	999000 },
+	};
+
+	prt_str(out, "latency");
+	for (unsigned i = 0; i < ARRAY_SIZE(q); i++) {
+		prt_printf(out, " %s ", q[i].name);
+		bch2_pr_time_units(out, bch2_perf_test_hist_quantile(h, q[i].ppm));
+	}
+	prt_str(out, " max ");
+	bch2_pr_time_units(out, h->max);
+}
+
+int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
+			 u64 nr, unsigned nr_threads)
+{
+	struct bch2_perf_test_result r = {};
+	char name_buf[20];
+	struct printbuf nr_buf = PRINTBUF;
+	struct printbuf per_sec_buf = PRINTBUF;
+	struct printbuf latency_buf = PRINTBUF;
+	u64 time;
+	int ret;
+
+	r.latency = kvzalloc(sizeof(*r.latency), GFP_KERNEL);
+	if (!r.latency)
+		return -ENOMEM;
+
+	ret = __bch2_btree_perf_test(c, testname, nr, nr_threads, &r);
+	if (!r.time)
+		goto out;
+
+	time = r.time;
 
 	scnprintf(name_buf, sizeof(name_buf), "%s:", testname);
 	prt_human_readable_u64(&nr_buf, nr);
@@ -874,9 +1568,16 @@ int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 		div_u64(time, NSEC_PER_SEC),
 		div_u64(time * nr_threads, nr),
 		per_sec_buf.buf);
+
+	perf_test_latency_to_text(&latency_buf, r.latency);
+	printk(KERN_INFO "%-12s %s\n", "", latency_buf.buf);
+
+	printbuf_exit(&latency_buf);
 	printbuf_exit(&per_sec_buf);
 	printbuf_exit(&nr_buf);
-	return j.ret;
+out:
+	kvfree(r.latency);
+	return ret;
 }
 
 #endif /* CONFIG_BCACHEFS_TESTS */
@@ -3,11 +3,56 @@
 #define _BCACHEFS_TEST_H
 
 struct bch_fs;
+struct btree_trace_entry;
 
 #ifdef CONFIG_BCACHEFS_TESTS
 
+#define BCH_PERF_TEST_DISTS()		\
+	x(uniform)			\
+	x(zipfian)			\
+	x(sequential)
+
+enum bch2_perf_test_dist {
+#define x(n)	BCH_PERF_TEST_DIST_##n,
+	BCH_PERF_TEST_DISTS()
+#undef x
+};
+
+extern const char * const bch2_perf_test_dists[];
+
+#define PERF_HIST_SUB_BITS	4
+#define PERF_HIST_SUB		(1U << PERF_HIST_SUB_BITS)
+#define PERF_HIST_NR		((64 - PERF_HIST_SUB_BITS + 1) * PERF_HIST_SUB)
+
+/* Latency histogram, in nanoseconds; relative error is at most 1/PERF_HIST_SUB */
+struct bch2_perf_test_hist {
+	u64			nr;
+	u64			sum;
+	u64			max;
+	u64			buckets[PERF_HIST_NR];
+};
+
+void bch2_perf_test_hist_merge(struct bch2_perf_test_hist *,
+			       const struct bch2_perf_test_hist *);
+u64 bch2_perf_test_hist_quantile(const struct bch2_perf_test_hist *, unsigned);
+
+struct bch2_perf_test_result {
+	/* operations to run, unmeasured, before the measured run: */
+	u64			warmup;
+	enum bch2_perf_test_dist dist;
+	/* if set, per operation latency is added here: */
+	struct bch2_perf_test_hist *latency;
+
+	u64			time;
+};
+
+int __bch2_btree_perf_test(struct bch_fs *, const char *, u64, unsigned,
+			   struct bch2_perf_test_result *);
 int bch2_btree_perf_test(struct bch_fs *, const char *, u64, unsigned);
 
+int bch2_btree_trace_replay(struct bch_fs *, const struct btree_trace_entry *,
+			    size_t, bool, struct bch2_perf_test_result *);
+
 #else
 
 #endif /* CONFIG_BCACHEFS_TESTS */
@@ -66,6 +66,72 @@ static void quantiles_update(struct quantiles *q, u64 v)
 	}
 }
 
+static inline unsigned time_stats_hist_idx(u64 v)
+{
+	unsigned e = fls64(v);
+
+	if (e <= TIME_STATS_HIST_SUB_BITS)
+		return v;
+	if (e > TIME_STATS_HIST_MAX_BITS)
+		return TIME_STATS_HIST_NR - 1;
+
+	e -= TIME_STATS_HIST_SUB_BITS + 1;
+	return (e + 1) * TIME_STATS_HIST_SUB + ((v >> e) - TIME_STATS_HIST_SUB);
+}
+
+/* highest duration that maps to bucket @idx: */
+static inline u64 time_stats_hist_bucket_max(unsigned idx)
+{
+	unsigned e = idx / TIME_STATS_HIST_SUB;
+	u64 sub = idx % TIME_STATS_HIST_SUB;
+
+	if (!e)
+		return sub;
+	if (idx == TIME_STATS_HIST_NR - 1)
+		return U64_MAX;
+
+	e--;
+	return ((TIME_STATS_HIST_SUB + sub + 1) << e) - 1;
+}
+
+void bch2_time_stats_hist_merge(struct time_stats_hist *dst,
+				const struct time_stats_hist *src)
+{
+	for (unsigned i = 0; i < TIME_STATS_HIST_NR; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+/*
+ * @nr:		number of events in @h
+ * @ppm:	quantile in parts per million, e.g. 990000 for p99
+ *
+ * Returns the upper bound of the bucket the quantile falls in
+ */
+u64 bch2_time_stats_hist_quantile(const struct time_stats_hist *h,
+				  u64 nr, unsigned ppm)
+{
+	u64 target = div_u64(nr * ppm + 999999, 1000000), seen = 0;
+
+	if (!nr)
+		return 0;
+
+	for (unsigned i = 0; i < TIME_STATS_HIST_NR; i++) {
+		seen += h->buckets[i];
+		if (seen >= target)
+			return time_stats_hist_bucket_max(i);
+	}
+
+	return U64_MAX;
+}
+
+/* Must be called with pending per cpu buffers flushed, as by bch2_time_stats_to_text() */
+u64 bch2_time_stats_quantile(struct bch2_time_stats *stats, unsigned ppm)
+{
+	return min(bch2_time_stats_hist_quantile(&stats->duration_hist,
+						 stats->duration_stats.n, ppm),
+		   stats->max_duration);
+}
+
 static inline void time_stats_update_one(struct bch2_time_stats *stats,
 					      u64 start, u64 end)
 {
@@ -82,6 +148,7 @@ static inline void time_stats_update_one(struct bch2_time_stats *stats,
 		stats->max_duration = max(stats->max_duration, duration);
 		stats->min_duration = min(stats->min_duration, duration);
 		stats->total_duration += duration;
+		stats->duration_hist.buckets[time_stats_hist_idx(duration)]++;
 
 		if (quantiles)
 			quantiles_update(quantiles, duration);
@@ -109,6 +176,19 @@ void __bch2_time_stats_clear_buffer(struct bch2_time_stats *stats,
 	b->nr = 0;
 }
 
+/* Fold any buffered percpu events into @stats, before reading it: */
+void bch2_time_stats_flush(struct bch2_time_stats *stats)
+{
+	if (stats->buffer) {
+		int cpu;
+
+		spin_lock_irq(&stats->lock);
+		for_each_possible_cpu(cpu)
+			__bch2_time_stats_clear_buffer(stats, per_cpu_ptr(stats->buffer, cpu));
+		spin_unlock_irq(&stats->lock);
+	}
+}
+
 static noinline void time_stats_clear_buffer(struct bch2_time_stats *stats,
 					     struct time_stat_buffer *b)
 {
@@ -12,6 +12,7 @@
  *  - sum of all event durations
  *  - average event duration, standard and weighted
  *  - standard deviation of event durations, standard and weighted
+ *  - a histogram of event durations, for percentiles
  * and analagous statistics for the frequency of events
  *
  * We provide both mean and weighted mean (exponentially weighted), and standard
@@ -59,6 +60,22 @@ struct quantiles {
 	}		entries[NR_QUANTILES];
 };
 
+/*
+ * Log-linear histogram of event durations: TIME_STATS_HIST_SUB linear buckets
+ * per power of two, so percentiles are accurate to within 1/TIME_STATS_HIST_SUB;
+ * durations past 2^TIME_STATS_HIST_MAX_BITS ns (~18 minutes) share the last
+ * bucket. Histograms are mergeable by adding buckets.
+ */
+#define TIME_STATS_HIST_SUB_BITS	3
+#define TIME_STATS_HIST_SUB		(1U << TIME_STATS_HIST_SUB_BITS)
+#define TIME_STATS_HIST_MAX_BITS	40
+#define TIME_STATS_HIST_NR		((TIME_STATS_HIST_MAX_BITS - TIME_STATS_HIST_SUB_BITS + 1) *\
+					 TIME_STATS_HIST_SUB)
+
+struct time_stats_hist {
+	u64		buckets[TIME_STATS_HIST_NR];
+};
+
 struct time_stat_buffer {
 	unsigned	nr;
 	struct time_stat_buffer_entry {
@@ -88,6 +105,8 @@ struct bch2_time_stats {
 	struct mean_and_variance_weighted duration_stats_weighted;
 	struct mean_and_variance_weighted freq_stats_weighted;
 	struct time_stat_buffer __percpu *buffer;
+
+	struct time_stats_hist	duration_hist;
 };
 
 struct bch2_time_stats_quantiles {
@@ -103,8 +122,13 @@ static inline struct quantiles *time_stats_to_quantiles(struct bch2_time_stats *
 }
 
 void __bch2_time_stats_clear_buffer(struct bch2_time_stats *, struct time_stat_buffer *);
+void bch2_time_stats_flush(struct bch2_time_stats *);
 void __bch2_time_stats_update(struct bch2_time_stats *stats, u64, u64);
 
+void bch2_time_stats_hist_merge(struct time_stats_hist *, const struct time_stats_hist *);
+u64 bch2_time_stats_hist_quantile(const struct time_stats_hist *, u64, unsigned);
+u64 bch2_time_stats_quantile(struct bch2_time_stats *, unsigned);
+
 /**
  * time_stats_update - collect a new event being tracked
  *
@@ -385,14 +385,7 @@ void bch2_time_stats_to_text(struct printbuf *out, struct bch2_time_stats *stats
 	s64 f_mean = 0, d_mean = 0;
 	u64 f_stddev = 0, d_stddev = 0;
 
-	if (stats->buffer) {
-		int cpu;
-
-		spin_lock_irq(&stats->lock);
-		for_each_possible_cpu(cpu)
-			__bch2_time_stats_clear_buffer(stats, per_cpu_ptr(stats->buffer, cpu));
-		spin_unlock_irq(&stats->lock);
-	}
+	bch2_time_stats_flush(stats);
 
 	/*
 	 * avoid divide by zero
@@ -445,6 +438,16 @@ void bch2_time_stats_to_text(struct printbuf *out, struct bch2_time_stats *stats
 	printbuf_indent_sub(out, 2);
 	prt_newline(out);
 
+	prt_printf(out, "duration percentiles (since mount)\n");
+	printbuf_indent_add(out, 2);
+
+	pr_name_and_units(out, "p50:",	 bch2_time_stats_quantile(stats, 500000));
+	pr_name_and_units(out, "p90:",	 bch2_time_stats_quantile(stats, 900000));
+	pr_name_and_units(out, "p99:",	 bch2_time_stats_quantile(stats, 990000));
+	pr_name_and_units(out, "p99.9:", bch2_time_stats_quantile(stats, 999000));
+
+	printbuf_indent_sub(out, 2);
+
 	prt_printf(out, "time between events\n");
 	printbuf_indent_add(out, 2);
 
@@ -127,3 +127,46 @@ int bch2_varint_decode_fast(const u8 *in, const u8 *end, u64 *out)
 	*out = v;
 	return bytes;
 }
+
+/**
+ * bch2_varint_decode_fast_n - decode an array of variable length integers
+ * @in:		varints to decode
+ * @end:	end of buffer to decode from
+ * @out:	on success, @nr decoded integers
+ * @nr:		number of integers to decode
+ * Returns:	size in bytes of the decoded integers - or -1 on failure (would
+ * have read past the end of the buffer)
+ *
+ * Most fields of packed keys are small, and varints of up to 7 bits are a
+ * single byte with the low bit clear: eight of those in a row are decoded
+ * with one load. Same rules as bch2_varint_decode_fast() for reading past
+ * @end.
+ */
+int bch2_varint_decode_fast_n(const u8 *in, const u8 *end, u64 *out, unsigned nr)
+{
+	const u8 *start = in;
+
+	while (nr) {
+		if (nr >= 8 && in + 8 <= end) {
+			u64 v = get_unaligned_le64(in);
+
+			if (!(v & 0x0101010101010101ULL)) {
+				for (unsigned i = 0; i < 8; i++)
+					out[i] = (v >> (i * 8 + 1)) & 127;
+				in	+= 8;
+				out	+= 8;
+				nr	-= 8;
+				continue;
+			}
+		}
+
+		int ret = bch2_varint_decode_fast(in, end, out);
+		if (ret < 0)
+			return ret;
+		in	+= ret;
+		out++;
+		nr--;
+	}
+
+	return in - start;
+}
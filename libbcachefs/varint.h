@@ -7,5 +7,17 @@ int bch2_varint_decode(const u8 *, const u8 *, u64 *);
 
 int bch2_varint_encode_fast(u8 *, u64);
 int bch2_varint_decode_fast(const u8 *, const u8 *, u64 *);
+int bch2_varint_decode_fast_n(const u8 *, const u8 *, u64 *, unsigned);
+
+/*
+ * Size in bytes of the varint at @in, without decoding it - or -1 if it would
+ * extend past @end; like bch2_varint_decode_fast(), may read past @end:
+ */
+static inline int bch2_varint_skip_fast(const u8 *in, const u8 *end)
+{
+	unsigned bytes = ffz(*in) + 1;
+
+	return likely(in + bytes <= end) ? bytes : -1;
+}
 
 #endif /* _BCACHEFS_VARINT_H */
@@ -485,6 +485,7 @@ static int bch2_xattr_bcachefs_set(const struct xattr_handler *handler,
 	const struct bch_option *opt;
 	char *buf;
 	struct inode_opt_set s;
+	struct bch_io_opts old_io_opts, new_io_opts;
 	int opt_id, inode_opt_id, ret;
 
 	opt_id = bch2_opt_lookup(name);
@@ -543,6 +544,8 @@ static int bch2_xattr_bcachefs_set(const struct xattr_handler *handler,
 	}
 
 	mutex_lock(&inode->ei_update_lock);
+	bch2_inode_opts_get(&old_io_opts, c, &inode->ei_inode);
+
 	if (inode_opt_id == Inode_opt_project) {
 		/*
 		 * inode fields accessible via the xattr interface are stored
@@ -554,13 +557,21 @@ static int bch2_xattr_bcachefs_set(const struct xattr_handler *handler,
 	}
 
 	ret = bch2_write_inode(c, inode, inode_opt_set_fn, &s, 0);
+	if (ret)
+		goto err;
+
+	bch2_inode_opts_get(&new_io_opts, c, &inode->ei_inode);
 err:
 	mutex_unlock(&inode->ei_update_lock);
 
-	if (value &&
-	    (opt_id == Opt_background_target ||
-	     opt_id == Opt_background_compression ||
-	     (opt_id == Opt_compression && !inode_opt_get(c, &inode->ei_inode, background_compression))))
+	/*
+	 * Only this inode's own extents can need moving: options set on a
+	 * directory are only inherited by new children, or pushed down by
+	 * BCHFS_IOC_REINHERIT_ATTRS, which rescans each child itself:
+	 */
+	if (!ret &&
+	    S_ISREG(inode->v.i_mode) &&
+	    bch2_rebalance_opts_changed(old_io_opts, new_io_opts))
 		bch2_set_rebalance_needs_scan(c, inode->ei_inode.bi_inum);
 
 err_class_exit:
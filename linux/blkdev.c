@@ -3,6 +3,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/blkzoned.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
@@ -10,6 +12,10 @@
 
 #include <libaio.h>
 
+#ifdef CONFIG_LIBURING
+#include <liburing.h>
+#endif
+
 #ifdef CONFIG_VALGRIND
 #include <valgrind/memcheck.h>
 #endif
@@ -18,21 +24,150 @@
 #include <linux/blkdev.h>
 #include <linux/completion.h>
 #include <linux/fs.h>
+#include <linux/ioprio.h>
 #include <linux/kthread.h>
 
+#include "qcow2.h"
 #include "tools-util.h"
 
 struct fops {
 	void (*init)(void);
 	void (*cleanup)(void);
+	void (*open)(struct block_device *bdev);
+	void (*close)(struct block_device *bdev);
 	void (*read)(struct bio *bio, struct iovec * iov, unsigned i);
 	void (*write)(struct bio *bio, struct iovec * iov, unsigned i);
+	void (*unplug)(void);
 };
 
 static struct fops *fops;
 static io_context_t aio_ctx;
 static atomic_t running_requests;
 
+/*
+ * Plugging: while a plug is held, backends that support it queue requests
+ * without kicking the kernel, and submit them all at once on unplug:
+ */
+static __thread struct blk_plug *current_plug;
+
+void blk_start_plug(struct blk_plug *plug)
+{
+	if (!current_plug)
+		current_plug = plug;
+}
+
+void blk_finish_plug(struct blk_plug *plug)
+{
+	if (current_plug != plug)
+		return;
+
+	current_plug = NULL;
+	if (fops->unplug)
+		fops->unplug();
+}
+
+/*
+ * qcow2 images are opened as devices, copy on write on top of their backing
+ * file - e.g. to run fsck against a metadata dump without touching the
+ * original device. IO to them is synchronous:
+ */
+static void qcow2_make_request(struct bio *bio, struct iovec *iov, unsigned nr)
+{
+	struct block_device *bdev = bio->bi_bdev;
+	u64 offset = bio->bi_iter.bi_sector << 9;
+	int ret = 0;
+
+	switch (bio_op(bio)) {
+	case REQ_OP_READ:
+	case REQ_OP_WRITE:
+		for (unsigned i = 0; i < nr && !ret; i++) {
+			ret = bio_op(bio) == REQ_OP_READ
+				? qcow2_pread(bdev->bd_qcow2, iov[i].iov_base, iov[i].iov_len, offset)
+				: qcow2_pwrite(bdev->bd_qcow2, iov[i].iov_base, iov[i].iov_len, offset);
+			offset += iov[i].iov_len;
+		}
+
+		if (!ret && bio_op(bio) == REQ_OP_WRITE && (bio->bi_opf & REQ_FUA))
+			ret = fdatasync(bdev->bd_fd) ? -errno : 0;
+		break;
+	case REQ_OP_FLUSH:
+		ret = fdatasync(bdev->bd_fd) ? -errno : 0;
+		break;
+	default:
+		BUG();
+	}
+
+	if (ret) {
+		fprintf(stderr, "IO error on %s: %s\n", bdev->name, strerror(-ret));
+		bio->bi_status = BLK_STS_IOERR;
+	}
+	bio_endio(bio);
+}
+
+/*
+ * Devices opened read only with BLK_OPEN_MMAP are mapped into memory: reads are
+ * copied from the mapping, without a syscall per bio, and btree node reads can
+ * skip the bio entirely and sort straight from the mapping - see
+ * bdev_mmap_addr().
+ *
+ * The mapping is private and writable, so that code reading in place can still
+ * fix things up in its buffer - see bdev_mmap_release().
+ */
+static void mmap_map(struct block_device *bdev)
+{
+	size_t size = get_capacity(bdev->bd_disk) << 9;
+
+	if (!size)
+		return;
+
+	void *p = mmap(NULL, size, PROT_READ|PROT_WRITE,
+		       MAP_PRIVATE|MAP_NORESERVE, bdev->bd_fd, 0);
+	if (p == MAP_FAILED)
+		return;
+
+	bdev->bd_map		= p;
+	bdev->bd_map_size	= size;
+}
+
+void *bdev_mmap_addr(struct block_device *bdev, u64 offset, size_t len)
+{
+	return bdev->bd_map &&
+		offset <= bdev->bd_map_size &&
+		len <= bdev->bd_map_size - offset
+		? bdev->bd_map + offset
+		: NULL;
+}
+
+/* Drop anything written to the mapping, so the next access sees the device: */
+void bdev_mmap_release(struct block_device *bdev, void *p, size_t len)
+{
+	unsigned long start	= round_down((unsigned long) p, PAGE_SIZE);
+	unsigned long end	= round_up((unsigned long) p + len, PAGE_SIZE);
+
+	madvise((void *) start, end - start, MADV_DONTNEED);
+}
+
+static void mmap_read(struct bio *bio, struct iovec *iov, unsigned nr)
+{
+	struct block_device *bdev = bio->bi_bdev;
+	u64 offset = bio->bi_iter.bi_sector << 9;
+
+	for (unsigned i = 0; i < nr; i++) {
+		void *p = bdev_mmap_addr(bdev, offset, iov[i].iov_len);
+
+		if (!p) {
+			fprintf(stderr, "IO error on %s: read past end of device\n", bdev->name);
+			bio->bi_status = BLK_STS_IOERR;
+			break;
+		}
+
+		memcpy(iov[i].iov_base, p, iov[i].iov_len);
+		offset += iov[i].iov_len;
+	}
+
+	bio_endio(bio);
+}
+
 void generic_make_request(struct bio *bio)
 {
 	struct iovec *iov;
@@ -74,6 +209,16 @@ void generic_make_request(struct bio *bio)
 #endif
 	}
 
+	if (bio->bi_bdev->bd_qcow2) {
+		qcow2_make_request(bio, iov, i);
+		return;
+	}
+
+	if (bio->bi_bdev->bd_map && bio_op(bio) == REQ_OP_READ) {
+		mmap_read(bio, iov, i);
+		return;
+	}
+
 	switch (bio_op(bio)) {
 	case REQ_OP_READ:
 		fops->read(bio, iov, i);
@@ -115,6 +260,16 @@ int blkdev_issue_discard(struct block_device *bdev,
 			 sector_t sector, sector_t nr_sects,
 			 gfp_t gfp_mask)
 {
+	u64 range[2] = { sector << 9, nr_sects << 9 };
+	struct stat st;
+
+	/* Discards are only a hint, and we don't punch holes in image files: */
+	if (bdev->bd_qcow2 ||
+	    fstat(bdev->bd_fd, &st) ||
+	    !S_ISBLK(st.st_mode))
+		return 0;
+
+	ioctl(bdev->bd_fd, BLKDISCARD, range);
 	return 0;
 }
 
@@ -142,6 +297,26 @@ unsigned bdev_logical_block_size(struct block_device *bdev)
 	return blksize;
 }
 
+/* Returns 0 if not a zoned device: */
+unsigned bdev_zone_sectors(struct block_device *bdev)
+{
+	struct stat statbuf;
+	__u32 sectors;
+	int ret;
+
+	if (bdev->bd_qcow2)
+		return 0;
+
+	ret = fstat(bdev->bd_fd, &statbuf);
+	BUG_ON(ret);
+
+	if (!S_ISBLK(statbuf.st_mode) ||
+	    ioctl(bdev->bd_fd, BLKGETZONESZ, &sectors))
+		return 0;
+
+	return sectors;
+}
+
 sector_t get_capacity(struct gendisk *disk)
 {
 	struct block_device *bdev =
@@ -150,6 +325,9 @@ sector_t get_capacity(struct gendisk *disk)
 	u64 bytes;
 	int ret;
 
+	if (bdev->bd_qcow2)
+		return qcow2_size(bdev->bd_qcow2) >> 9;
+
 	ret = fstat(bdev->bd_fd, &statbuf);
 	BUG_ON(ret);
 
@@ -166,6 +344,15 @@ void bdev_fput(struct file *file)
 {
 	struct block_device *bdev = file_bdev(file);
 
+	if (fops->close)
+		fops->close(bdev);
+
+	if (bdev->bd_qcow2)
+		qcow2_close(bdev->bd_qcow2);
+
+	if (bdev->bd_map)
+		munmap(bdev->bd_map, bdev->bd_map_size);
+
 	fdatasync(bdev->bd_fd);
 	close(bdev->bd_fd);
 	free(bdev);
@@ -175,6 +362,8 @@ void bdev_fput(struct file *file)
 struct file *bdev_file_open_by_path(const char *path, blk_mode_t mode,
 				    void *holder, const struct blk_holder_ops *hop)
 {
+	struct qcow2_file *qcow2 = NULL;
+	bool is_qcow2 = qcow2_probe(path);
 	int fd, flags = 0;
 
 	if ((mode & (BLK_OPEN_READ|BLK_OPEN_WRITE)) == (BLK_OPEN_READ|BLK_OPEN_WRITE))
@@ -184,7 +373,8 @@ struct file *bdev_file_open_by_path(const char *path, blk_mode_t mode,
 	else if (mode & BLK_OPEN_WRITE)
 		flags = O_WRONLY;
 
-	if (!(mode & BLK_OPEN_BUFFERED))
+	/* the qcow2 code does unaligned IO: */
+	if (!(mode & BLK_OPEN_BUFFERED) && !is_qcow2)
 		flags |= O_DIRECT;
 
 	if (mode & BLK_OPEN_EXCL)
@@ -194,6 +384,14 @@ struct file *bdev_file_open_by_path(const char *path, blk_mode_t mode,
 	if (fd < 0)
 		return ERR_PTR(-errno);
 
+	if (is_qcow2) {
+		qcow2 = qcow2_open(fd);
+		if (IS_ERR(qcow2)) {
+			close(fd);
+			return ERR_CAST(qcow2);
+		}
+	}
+
 	struct block_device *bdev = malloc(sizeof(*bdev));
 	memset(bdev, 0, sizeof(*bdev));
 
@@ -202,12 +400,20 @@ struct file *bdev_file_open_by_path(const char *path, blk_mode_t mode,
 
 	bdev->bd_dev		= xfstat(fd).st_rdev;
 	bdev->bd_fd		= fd;
+	bdev->bd_uring_slot	= -1;
+	bdev->bd_qcow2		= qcow2;
 	bdev->bd_holder		= holder;
 	bdev->bd_disk		= &bdev->__bd_disk;
 	bdev->bd_disk->bdi	= &bdev->bd_disk->__bdi;
 	bdev->queue.backing_dev_info = bdev->bd_disk->bdi;
 	bdev->bd_inode		= &bdev->__bd_inode;
 
+	if ((mode & BLK_OPEN_MMAP) && !(mode & BLK_OPEN_WRITE) && !qcow2)
+		mmap_map(bdev);
+
+	if (fops->open)
+		fops->open(bdev);
+
 	struct file *file = calloc(sizeof(*file), 1);
 	file->f_inode = bdev->bd_inode;
 
@@ -358,6 +564,10 @@ static void aio_cleanup(void)
 	close(fds[1]);
 }
 
+#ifndef IOCB_FLAG_IOPRIO
+#define IOCB_FLAG_IOPRIO	(1 << 1)
+#endif
+
 static void aio_op(struct bio *bio, struct iovec *iov, unsigned i, int opcode)
 {
 	ssize_t ret;
@@ -372,6 +582,11 @@ static void aio_op(struct bio *bio, struct iovec *iov, unsigned i, int opcode)
 
 	}, *iocbp = &iocb;
 
+	if (ioprio_valid(bio_prio(bio))) {
+		iocb.u.c.flags	|= IOCB_FLAG_IOPRIO;
+		iocb.aio_reqprio = bio_prio(bio);
+	}
+
 	atomic_inc(&running_requests);
 
 	wait_event(aio_events_completed,
@@ -391,15 +606,348 @@ static void aio_write(struct bio *bio, struct iovec * iov, unsigned i)
 	aio_op(bio, iov, i, IO_CMD_PWRITEV);
 }
 
+#ifdef CONFIG_LIBURING
+
+#define URING_ENTRIES		1024
+#define URING_MAX_FILES		256
+
+static struct io_uring	ring;
+/* liburing's submission side is single producer: */
+static DEFINE_MUTEX(ring_sq_lock);
+static struct task_struct *uring_task;
+static bool uring_fixed_files;
+static DECLARE_BITMAP(uring_file_slots, URING_MAX_FILES);
+
+struct uring_req {
+	struct list_head	list;
+	struct bio		*bio;
+	int			opcode;
+	unsigned		nr_iov;
+	struct iovec		iov[];
+};
+
+/*
+ * IO classes: requests are queued per class, and put on the ring in class
+ * order, each class only while the number of requests in flight is under its
+ * limit - so that btree node reads on the fsck critical path and journal
+ * flushes don't wait behind a deep queue of bulk data IO:
+ */
+enum uring_io_class {
+	URING_IO_latency,	/* metadata reads, flush/FUA writes, IOPRIO_CLASS_RT */
+	URING_IO_normal,
+	URING_IO_bulk,		/* IOPRIO_CLASS_IDLE, e.g. data moves */
+	URING_IO_NR,
+};
+
+static const unsigned uring_class_in_flight_max[URING_IO_NR] = {
+	[URING_IO_latency]	= URING_ENTRIES,
+	[URING_IO_normal]	= 256,
+	[URING_IO_bulk]		= 32,
+};
+
+/* protected by ring_sq_lock: */
+static struct list_head uring_queued[URING_IO_NR];
+static unsigned uring_in_flight;
+
+static enum uring_io_class uring_bio_class(struct bio *bio)
+{
+	switch (IOPRIO_PRIO_CLASS(bio_prio(bio))) {
+	case IOPRIO_CLASS_RT:
+		return URING_IO_latency;
+	case IOPRIO_CLASS_IDLE:
+		return URING_IO_bulk;
+	}
+
+	if (bio_op(bio) == REQ_OP_READ
+	    ? bio->bi_opf & (REQ_META|REQ_PRIO)
+	    : bio->bi_opf & (REQ_PREFLUSH|REQ_FUA))
+		return URING_IO_latency;
+
+	return URING_IO_normal;
+}
+
+static struct io_uring_sqe *uring_get_sqe(void);
+static void uring_submit(void);
 
-/* not implemented */
-static void uring_init(void) {
+static void uring_prep(struct uring_req *req)
+{
+	struct bio *bio = req->bio;
+	struct block_device *bdev = bio->bi_bdev;
+	struct io_uring_sqe *sqe = uring_get_sqe();
+	int fd = bdev->bd_fd;
+
+	if (req->opcode == IORING_OP_READV)
+		io_uring_prep_readv(sqe, fd, req->iov, req->nr_iov,
+				    bio->bi_iter.bi_sector << 9);
+	else
+		io_uring_prep_writev2(sqe, fd, req->iov, req->nr_iov,
+				      bio->bi_iter.bi_sector << 9,
+				      bio->bi_opf & REQ_FUA ? RWF_SYNC : 0);
+
+	if (bdev->bd_uring_slot >= 0) {
+		sqe->fd = bdev->bd_uring_slot;
+		io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+	}
+
+	/* so that the kernel's IO scheduler sees it too: */
+	if (ioprio_valid(bio_prio(bio)))
+		sqe->ioprio = bio_prio(bio);
+
+	io_uring_sqe_set_data(sqe, req);
+}
+
+/* Put queued requests on the ring, returns true if there were any: */
+static bool uring_dispatch(void)
+{
+	bool ret = false;
+
+	lockdep_assert_held(&ring_sq_lock);
+
+	for (unsigned class = 0; class < URING_IO_NR; class++)
+		while (!list_empty(&uring_queued[class]) &&
+		       uring_in_flight < uring_class_in_flight_max[class]) {
+			struct uring_req *req =
+				list_first_entry(&uring_queued[class], struct uring_req, list);
+
+			list_del(&req->list);
+			uring_prep(req);
+			uring_in_flight++;
+			ret = true;
+		}
+
+	return ret;
+}
+
+static int uring_completion_thread(void *arg)
+{
+	struct io_uring_cqe *cqes[32], *cqe;
+	struct uring_req *reqs[ARRAY_SIZE(cqes)];
+	int res[ARRAY_SIZE(cqes)];
+	bool stop = false;
+	int ret;
+
+	while (!stop) {
+		ret = io_uring_wait_cqe(&ring, &cqe);
+		if (ret == -EINTR)
+			continue;
+		if (ret)
+			die("io_uring_wait_cqe() error: %s", strerror(-ret));
+
+		unsigned i, nr = io_uring_peek_batch_cqe(&ring, cqes, ARRAY_SIZE(cqes));
+		unsigned done = 0;
+
+		for (i = 0; i < nr; i++) {
+			reqs[i]	= io_uring_cqe_get_data(cqes[i]);
+			res[i]	= cqes[i]->res;
+			done += reqs[i] != NULL;
+		}
+
+		/* Free up completion queue space before running completions: */
+		io_uring_cq_advance(&ring, nr);
+
+		/* Keep the device busy with queued requests while we run completions: */
+		if (done) {
+			mutex_lock(&ring_sq_lock);
+			uring_in_flight -= done;
+			if (uring_dispatch())
+				uring_submit();
+			mutex_unlock(&ring_sq_lock);
+		}
+
+		for (i = 0; i < nr; i++) {
+			struct uring_req *req = reqs[i];
+
+			/* This should only happen during blkdev_cleanup() */
+			if (!req) {
+				BUG_ON(atomic_read(&running_requests) != 0);
+				stop = true;
+				continue;
+			}
+
+			struct bio *bio = req->bio;
+			free(req);
+
+			if (res[i] != bio->bi_iter.bi_size)
+				bio->bi_status = BLK_STS_IOERR;
+
+			bio_endio(bio);
+			atomic_dec(&running_requests);
+		}
+	}
+
+	return 0;
+}
+
+static void uring_init(void)
+{
+	struct io_uring_params p = {
+		.flags		= IORING_SETUP_CQSIZE,
+		.cq_entries	= URING_ENTRIES * 4,
+	};
+	struct task_struct *t;
+	int ret;
+
+	if (getenv("BCACHEFS_IO_URING_SQPOLL")) {
+		p.flags		|= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = 1000;
+	}
+
+	ret = io_uring_queue_init_params(URING_ENTRIES, &ring, &p);
+	if (ret == -EPERM && (p.flags & IORING_SETUP_SQPOLL)) {
+		/* Older kernels require CAP_SYS_ADMIN for SQPOLL: */
+		p.flags &= ~IORING_SETUP_SQPOLL;
+		ret = io_uring_queue_init_params(URING_ENTRIES, &ring, &p);
+	}
+	if (ret) {
+		/* ENOSYS, or io_uring disabled by sysctl/seccomp: */
+		io_fallback();
+		return;
+	}
+
+	uring_fixed_files = !io_uring_register_files_sparse(&ring, URING_MAX_FILES);
+
+	for (unsigned i = 0; i < URING_IO_NR; i++)
+		INIT_LIST_HEAD(&uring_queued[i]);
+
+	t = kthread_run(uring_completion_thread, NULL, "uring_completion");
+	BUG_ON(IS_ERR(t));
+	uring_task = t;
+}
+
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	while (!(sqe = io_uring_get_sqe(&ring))) {
+		/* Submission queue is full: push it to the kernel and retry */
+		int ret = io_uring_submit(&ring);
+		if (ret < 0 && ret != -EAGAIN && ret != -EBUSY)
+			die("io_uring_submit() error: %s", strerror(-ret));
+
+		if (ring.flags & IORING_SETUP_SQPOLL)
+			io_uring_sqring_wait(&ring);
+	}
+
+	return sqe;
+}
+
+static void uring_submit(void)
+{
+	int ret = io_uring_submit(&ring);
+	if (ret < 0 && ret != -EAGAIN && ret != -EBUSY)
+		die("io_uring_submit() error: %s", strerror(-ret));
+}
+
+static void uring_cleanup(void)
+{
+	struct task_struct *p = NULL;
+	swap(uring_task, p);
+	get_task_struct(p);
+
+	/* Wake up the completion thread with a NULL request: */
+	mutex_lock(&ring_sq_lock);
+	io_uring_prep_nop(uring_get_sqe());
+	uring_submit();
+	mutex_unlock(&ring_sq_lock);
+
+	int ret = kthread_stop(p);
+	BUG_ON(ret);
+
+	put_task_struct(p);
+
+	io_uring_queue_exit(&ring);
+}
+
+static void uring_open(struct block_device *bdev)
+{
+	if (!uring_fixed_files)
+		return;
+
+	mutex_lock(&ring_sq_lock);
+	unsigned slot = find_first_zero_bit(uring_file_slots, URING_MAX_FILES);
+	if (slot < URING_MAX_FILES &&
+	    io_uring_register_files_update(&ring, slot, &bdev->bd_fd, 1) == 1) {
+		__set_bit(slot, uring_file_slots);
+		bdev->bd_uring_slot = slot;
+	}
+	mutex_unlock(&ring_sq_lock);
+}
+
+static void uring_close(struct block_device *bdev)
+{
+	int fd = -1;
+
+	if (bdev->bd_uring_slot < 0)
+		return;
+
+	mutex_lock(&ring_sq_lock);
+	io_uring_register_files_update(&ring, bdev->bd_uring_slot, &fd, 1);
+	__clear_bit(bdev->bd_uring_slot, uring_file_slots);
+	bdev->bd_uring_slot = -1;
+	mutex_unlock(&ring_sq_lock);
+}
+
+static void uring_op(struct bio *bio, struct iovec *iov, unsigned i, int opcode)
+{
+	struct uring_req *req = malloc(sizeof(*req) + sizeof(*iov) * i);
+
+	if (!req)
+		die("malloc error");
+
+	/* With SQPOLL the iovec is read asynchronously, it can't live on the stack: */
+	req->bio	= bio;
+	req->opcode	= opcode;
+	req->nr_iov	= i;
+	memcpy(req->iov, iov, sizeof(*iov) * i);
+
+	atomic_inc(&running_requests);
+
+	mutex_lock(&ring_sq_lock);
+	list_add_tail(&req->list, &uring_queued[uring_bio_class(bio)]);
+
+	/* If plugged, the whole batch goes to the kernel in blk_finish_plug(): */
+	if (uring_dispatch() && !current_plug)
+		uring_submit();
+	mutex_unlock(&ring_sq_lock);
+}
+
+static void uring_read(struct bio *bio, struct iovec *iov, unsigned i)
+{
+	uring_op(bio, iov, i, IORING_OP_READV);
+}
+
+static void uring_write(struct bio *bio, struct iovec *iov, unsigned i)
+{
+	uring_op(bio, iov, i, IORING_OP_WRITEV);
+}
+
+static void uring_unplug(void)
+{
+	mutex_lock(&ring_sq_lock);
+	uring_submit();
+	mutex_unlock(&ring_sq_lock);
+}
+
+#else
+
+static void uring_init(void)
+{
 	io_fallback();
 }
 
+#endif /* CONFIG_LIBURING */
+
 struct fops fops_list[] = {
 	{
 		.init		= uring_init,
+#ifdef CONFIG_LIBURING
+		.cleanup	= uring_cleanup,
+		.open		= uring_open,
+		.close		= uring_close,
+		.read		= uring_read,
+		.write		= uring_write,
+		.unplug		= uring_unplug,
+#endif
 	}, {
 		.init		= aio_init,
 		.cleanup	= aio_cleanup,
@@ -21,6 +21,8 @@
 
 #include <crypto/algapi.h>
 
+#include <sodium/core.h>
+
 static LIST_HEAD(crypto_alg_list);
 static DECLARE_RWSEM(crypto_alg_sem);
 
@@ -112,3 +114,15 @@ int crypto_register_shash(struct shash_alg *alg)
 
 	return crypto_register_alg(&alg->base);
 }
+
+/*
+ * The algorithms are implemented by libsodium, which only switches from its
+ * portable reference code to the SSSE3/AVX2 ChaCha20 and SSE2 Poly1305
+ * implementations after detecting CPU features in sodium_init():
+ */
+__attribute__((constructor(109)))
+static void crypto_api_init(void)
+{
+	if (sodium_init() < 0)
+		fprintf(stderr, "sodium_init() failed, using portable crypto implementations\n");
+}
@@ -16,9 +16,10 @@
 #include <linux/export.h>
 #include <linux/jiffies.h>
 #include <linux/mempool.h>
-#include <linux/mempool.h>
 #include <linux/sched.h>
 
+#include <stdio.h>
+
 #if defined(CONFIG_DEBUG_SLAB) || defined(CONFIG_SLUB_DEBUG_ON)
 static void poison_error(mempool_t *pool, void *element, size_t size,
 			 size_t byte)
@@ -137,6 +138,100 @@ static void *remove_element(mempool_t *pool)
 	return element;
 }
 
+/*
+ * Userspace: in front of the reserve, each pool has a few small caches of
+ * freed elements, and a thread always uses the same one. mempool_free() only
+ * fills a cache once the reserve is full, and mempool_alloc() only takes from
+ * the reserve when both the cache and pool->alloc come up empty, so the
+ * kernel's forward progress guarantee is unchanged - but the common case
+ * (an element freed and reallocated in a tight loop, e.g. bounce buffers)
+ * no longer goes through the heap or takes the pool lock.
+ *
+ * Set BCACHEFS_MEMPOOL_STATS to have per pool statistics printed on exit.
+ */
+#define MEMPOOL_CACHES		8
+#define MEMPOOL_CACHE_SIZE	2
+
+struct mempool_cache {
+	spinlock_t		lock;
+	unsigned		nr;
+	void			*elements[MEMPOOL_CACHE_SIZE];
+} ____cacheline_aligned;
+
+static atomic_t mempool_next_cache;
+static __thread int mempool_this_cache = -1;
+
+static struct mempool_cache *mempool_cache(mempool_t *pool)
+{
+	if (unlikely(mempool_this_cache < 0))
+		mempool_this_cache = (unsigned) atomic_inc_return(&mempool_next_cache) %
+			MEMPOOL_CACHES;
+	return pool->caches + mempool_this_cache;
+}
+
+static void *mempool_cache_pop(mempool_t *pool)
+{
+	struct mempool_cache *c;
+	void *element = NULL;
+
+	if (!pool->caches)
+		return NULL;
+
+	c = mempool_cache(pool);
+	spin_lock(&c->lock);
+	if (c->nr)
+		element = c->elements[--c->nr];
+	spin_unlock(&c->lock);
+
+	return element;
+}
+
+static bool mempool_cache_push(mempool_t *pool, void *element)
+{
+	struct mempool_cache *c;
+	bool ret = false;
+
+	if (!pool->caches)
+		return false;
+
+	c = mempool_cache(pool);
+	spin_lock(&c->lock);
+	if (c->nr < MEMPOOL_CACHE_SIZE) {
+		c->elements[c->nr++] = element;
+		ret = true;
+	}
+	spin_unlock(&c->lock);
+
+	return ret;
+}
+
+static void mempool_caches_exit(mempool_t *pool)
+{
+	if (!pool->caches)
+		return;
+
+	for (unsigned i = 0; i < MEMPOOL_CACHES; i++) {
+		struct mempool_cache *c = pool->caches + i;
+
+		while (c->nr)
+			pool->free(c->elements[--c->nr], pool->pool_data);
+	}
+
+	kfree(pool->caches);
+	pool->caches = NULL;
+}
+
+static void mempool_stats_print(mempool_t *pool)
+{
+	fprintf(stderr, "mempool %p (%d reserved): %llu cached %llu fresh "
+		"%llu from reserve %llu waited\n",
+		pool, pool->min_nr,
+		(u64) atomic64_read(&pool->alloc_cached),
+		(u64) atomic64_read(&pool->alloc_fresh),
+		(u64) atomic64_read(&pool->alloc_reserve),
+		(u64) atomic64_read(&pool->alloc_wait));
+}
+
 /**
  * mempool_exit - exit a mempool initialized with mempool_init()
  * @pool:      pointer to the memory pool which was initialized with
@@ -150,6 +245,11 @@ static void *remove_element(mempool_t *pool)
  */
 void mempool_exit(mempool_t *pool)
 {
+	if (pool->elements && getenv("BCACHEFS_MEMPOOL_STATS"))
+		mempool_stats_print(pool);
+
+	mempool_caches_exit(pool);
+
 	while (pool->curr_nr) {
 		void *element = remove_element(pool);
 		pool->free(element, pool->pool_data);
@@ -192,6 +292,12 @@ int mempool_init_node(mempool_t *pool, int min_nr, mempool_alloc_t *alloc_fn,
 	if (!pool->elements)
 		return -ENOMEM;
 
+	/* Not fatal: without caches we just always go to pool->alloc */
+	pool->caches = kcalloc(MEMPOOL_CACHES, sizeof(pool->caches[0]), gfp_mask);
+	if (pool->caches)
+		for (unsigned i = 0; i < MEMPOOL_CACHES; i++)
+			spin_lock_init(&pool->caches[i].lock);
+
 	/*
 	 * First pre-allocate the guaranteed number of buffers.
 	 */
@@ -385,16 +491,25 @@ void *mempool_alloc(mempool_t *pool, gfp_t gfp_mask)
 
 	gfp_temp = gfp_mask & ~(__GFP_IO);
 
+	element = mempool_cache_pop(pool);
+	if (likely(element != NULL)) {
+		atomic64_inc(&pool->alloc_cached);
+		return element;
+	}
+
 repeat_alloc:
 
 	element = pool->alloc(gfp_temp, pool->pool_data);
-	if (likely(element != NULL))
+	if (likely(element != NULL)) {
+		atomic64_inc(&pool->alloc_fresh);
 		return element;
+	}
 
 	spin_lock_irqsave(&pool->lock, flags);
 	if (likely(pool->curr_nr)) {
 		element = remove_element(pool);
 		spin_unlock_irqrestore(&pool->lock, flags);
+		atomic64_inc(&pool->alloc_reserve);
 		/* paired with rmb in mempool_free(), read comment there */
 		smp_wmb();
 		return element;
@@ -411,6 +526,7 @@ repeat_alloc:
 	}
 
 	/* Let's wait for someone else to return an element to @pool */
+	atomic64_inc(&pool->alloc_wait);
 	prepare_to_wait(&pool->wait, &wait, TASK_UNINTERRUPTIBLE);
 
 	spin_unlock_irqrestore(&pool->lock, flags);
@@ -484,6 +600,10 @@ void mempool_free(void *element, mempool_t *pool)
 		}
 		spin_unlock_irqrestore(&pool->lock, flags);
 	}
+
+	if (mempool_cache_push(pool, element))
+		return;
+
 	pool->free(element, pool->pool_data);
 }
 EXPORT_SYMBOL(mempool_free);
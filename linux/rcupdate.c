@@ -0,0 +1,120 @@
+#include <pthread.h>
+
+#include <linux/atomic.h>
+#include <linux/cache.h>
+#include <linux/jiffies.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+/*
+ * kfree_rcu() and friends: pointers are collected into per shard batches, and
+ * a full batch is handed to call_rcu() as a single callback. Partial batches
+ * are pushed out by kfree_rcu_work, so nothing waits for more than about a
+ * second plus a grace period.
+ *
+ * We don't use the caller's rcu_head, which means the headless (mightsleep)
+ * and headed variants are the same thing here.
+ */
+
+#define KFREE_RCU_BATCH		62
+#define KFREE_RCU_SHARDS	16
+#define KFREE_RCU_DELAY		HZ
+
+struct kfree_rcu_batch {
+	struct rcu_head		rcu;
+	unsigned		nr;
+	void			*ptrs[KFREE_RCU_BATCH];
+};
+
+struct kfree_rcu_shard {
+	pthread_mutex_t		lock;
+	struct kfree_rcu_batch	*batch;
+} ____cacheline_aligned;
+
+static struct kfree_rcu_shard kfree_rcu_shards[KFREE_RCU_SHARDS];
+static atomic_t kfree_rcu_next_shard;
+static __thread struct kfree_rcu_shard *kfree_rcu_this_shard;
+
+static void kfree_rcu_work_fn(struct work_struct *work);
+static struct delayed_work kfree_rcu_work;
+
+static void kfree_rcu_batch_free(struct rcu_head *rcu)
+{
+	struct kfree_rcu_batch *b = container_of(rcu, struct kfree_rcu_batch, rcu);
+
+	for (unsigned i = 0; i < b->nr; i++)
+		kvfree(b->ptrs[i]);
+	kfree(b);
+}
+
+static struct kfree_rcu_shard *kfree_rcu_shard(void)
+{
+	if (unlikely(!kfree_rcu_this_shard))
+		kfree_rcu_this_shard = kfree_rcu_shards +
+			(unsigned) atomic_inc_return(&kfree_rcu_next_shard) % KFREE_RCU_SHARDS;
+	return kfree_rcu_this_shard;
+}
+
+void __kvfree_rcu(void *p)
+{
+	struct kfree_rcu_shard *s = kfree_rcu_shard();
+	struct kfree_rcu_batch *b, *full = NULL;
+	bool first = false;
+
+	if (!p)
+		return;
+
+	pthread_mutex_lock(&s->lock);
+	b = s->batch;
+	if (!b) {
+		b = s->batch = kmalloc(sizeof(*b), GFP_NOWAIT);
+		if (unlikely(!b)) {
+			pthread_mutex_unlock(&s->lock);
+			/* Same fallback the kernel uses for headless kvfree_rcu(): */
+			synchronize_rcu();
+			kvfree(p);
+			return;
+		}
+		b->nr = 0;
+		first = true;
+	}
+
+	b->ptrs[b->nr++] = p;
+	if (b->nr == KFREE_RCU_BATCH) {
+		full = b;
+		s->batch = NULL;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	if (full)
+		call_rcu(&full->rcu, kfree_rcu_batch_free);
+	else if (first && system_wq)
+		queue_delayed_work(system_wq, &kfree_rcu_work, KFREE_RCU_DELAY);
+	else if (first)
+		kfree_rcu_work_fn(NULL);
+}
+
+static void kfree_rcu_work_fn(struct work_struct *work)
+{
+	for (unsigned i = 0; i < KFREE_RCU_SHARDS; i++) {
+		struct kfree_rcu_shard *s = &kfree_rcu_shards[i];
+		struct kfree_rcu_batch *b;
+
+		pthread_mutex_lock(&s->lock);
+		b = s->batch;
+		s->batch = NULL;
+		pthread_mutex_unlock(&s->lock);
+
+		if (b)
+			call_rcu(&b->rcu, kfree_rcu_batch_free);
+	}
+}
+
+__attribute__((constructor(101)))
+static void kfree_rcu_init(void)
+{
+	for (unsigned i = 0; i < KFREE_RCU_SHARDS; i++)
+		pthread_mutex_init(&kfree_rcu_shards[i].lock, NULL);
+	INIT_DELAYED_WORK(&kfree_rcu_work, kfree_rcu_work_fn);
+}
@@ -0,0 +1,62 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/err.h>
+#include <linux/file.h>
+#include <linux/shmem_fs.h>
+
+struct file *shmem_file_setup(const char *name, loff_t size, unsigned long flags)
+{
+	const char *dir = getenv("TMPDIR") ?: "/tmp";
+	struct file *file = calloc(1, sizeof(*file));
+	if (!file)
+		return ERR_PTR(-ENOMEM);
+
+	file->f_fd = open(dir, O_TMPFILE|O_RDWR, 0600);
+	if (file->f_fd < 0) {
+		int ret = -errno;
+
+		free(file);
+		return ERR_PTR(ret);
+	}
+
+	if (size && ftruncate(file->f_fd, size)) {
+		int ret = -errno;
+
+		fput(file);
+		return ERR_PTR(ret);
+	}
+
+	return file;
+}
+
+ssize_t kernel_read(struct file *file, void *buf, size_t count, loff_t *pos)
+{
+	ssize_t ret = pread(file->f_fd, buf, count, *pos);
+
+	if (ret < 0)
+		return -errno;
+	*pos += ret;
+	return ret;
+}
+
+ssize_t kernel_write(struct file *file, const void *buf, size_t count, loff_t *pos)
+{
+	ssize_t ret = pwrite(file->f_fd, buf, count, *pos);
+
+	if (ret < 0)
+		return -errno;
+	*pos += ret;
+	return ret;
+}
+
+void fput(struct file *file)
+{
+	close(file->f_fd);
+	free(file);
+}
@@ -1,4 +1,5 @@
 
+#include <ctype.h>
 #include <stdio.h>
 #include <unistd.h>
 
@@ -53,11 +54,137 @@ static void run_shrinkers_allocation_failed(gfp_t gfp_mask)
 	mutex_unlock(&shrinker_lock);
 }
 
+/*
+ * Memory budget: the smallest of physical RAM, our cgroup's memory.max, and
+ * $BCACHEFS_MEMORY_LIMIT (bytes, with an optional k/m/g/t suffix). We aim to
+ * keep our RSS 1/16th below it - and, as before, 6% of physical RAM free
+ * without anything in swap.
+ */
+static u64 memory_limit;
+
+static u64 read_u64_file(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	unsigned long long v;
+	int ret;
+
+	if (!f)
+		return U64_MAX;
+
+	ret = fscanf(f, "%llu", &v);
+	fclose(f);
+
+	return ret == 1 ? v : U64_MAX;
+}
+
+static u64 parse_memory_limit(const char *str)
+{
+	char *end;
+	u64 v = strtoull(str, &end, 10);
+
+	switch (tolower(*end)) {
+	case 't':
+		v <<= 10;
+		fallthrough;
+	case 'g':
+		v <<= 10;
+		fallthrough;
+	case 'm':
+		v <<= 10;
+		fallthrough;
+	case 'k':
+		v <<= 10;
+	}
+
+	return v ?: U64_MAX;
+}
+
+/* memory.max of our cgroup and its ancestors (cgroup v2), or v1's limit: */
+static u64 cgroup_memory_limit(void)
+{
+	char *line = NULL, path[PATH_MAX];
+	size_t n = 0;
+	u64 limit = read_u64_file("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+	FILE *f = fopen("/proc/self/cgroup", "r");
+
+	if (!f)
+		return limit;
+
+	while (getline(&line, &n, f) >= 0) {
+		if (strncmp(line, "0::", 3))
+			continue;
+
+		char *cg = strim(line + 3);
+
+		while (1) {
+			snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.max",
+				 strcmp(cg, "/") ? cg : "");
+			limit = min(limit, read_u64_file(path));
+
+			char *slash = strrchr(cg, '/');
+			if (!slash || slash == cg)
+				break;
+			*slash = '\0';
+		}
+
+		/* and the root of our cgroup namespace: */
+		limit = min(limit, read_u64_file("/sys/fs/cgroup/memory.max"));
+		break;
+	}
+
+	free(line);
+	fclose(f);
+	return limit;
+}
+
+static void memory_limit_init(void)
+{
+	struct sysinfo info;
+	const char *env = getenv("BCACHEFS_MEMORY_LIMIT");
+
+	si_meminfo(&info);
+
+	memory_limit = min((u64) info.totalram * info.mem_unit,
+			   cgroup_memory_limit());
+	if (env)
+		memory_limit = min(memory_limit, parse_memory_limit(env));
+}
+
+static u64 process_rss(void)
+{
+	FILE *f = fopen("/proc/self/statm", "r");
+	unsigned long long size, resident;
+	int ret;
+
+	if (!f)
+		return 0;
+
+	ret = fscanf(f, "%llu %llu", &size, &resident);
+	fclose(f);
+
+	return ret == 2 ? resident << PAGE_SHIFT : 0;
+}
+
+/* How many bytes of memory we'd like to free, and our current usage: */
+static s64 memory_want_shrink(u64 *rss)
+{
+	struct sysinfo info;
+	s64 want_shrink;
+
+	si_meminfo(&info);
+
+	want_shrink = ((s64) (info.totalram >> 4) - (s64) info.freeram +
+		       (s64) (info.totalswap - info.freeswap)) * info.mem_unit;
+
+	*rss = process_rss();
+	return max(want_shrink, (s64) (*rss - (memory_limit - (memory_limit >> 4))));
+}
+
 void run_shrinkers(gfp_t gfp_mask, bool allocation_failed)
 {
 	struct shrinker *shrinker;
-	struct sysinfo info;
 	s64 want_shrink;
+	u64 rss;
 
 	if (!(gfp_mask & GFP_KERNEL))
 		return;
@@ -71,20 +198,25 @@ void run_shrinkers(gfp_t gfp_mask, bool allocation_failed)
 		return;
 	}
 
-	si_meminfo(&info);
-
-	/* Aim for 6% of physical RAM free without anything in swap */
-	want_shrink = (info.totalram >> 4) - info.freeram
-			+ info.totalswap - info.freeswap;
+	want_shrink = memory_want_shrink(&rss);
 	if (want_shrink <= 0)
 		return;
 
+	/*
+	 * Ask each shrinker to free the same fraction of what it holds, the
+	 * fraction of our memory we want to free:
+	 */
 	mutex_lock(&shrinker_lock);
 	list_for_each_entry(shrinker, &shrinker_list, list) {
-		struct shrink_control sc = {
-			.gfp_mask	= gfp_mask,
-			.nr_to_scan	= want_shrink >> PAGE_SHIFT
-		};
+		struct shrink_control sc = { .gfp_mask = gfp_mask, };
+		unsigned long have = shrinker->count_objects(shrinker, &sc);
+
+		if (!have)
+			continue;
+
+		sc.nr_to_scan = rss > want_shrink
+			? div64_u64((u64) have * want_shrink, rss) + 1
+			: have;
 
 		shrinker->scan_objects(shrinker, &sc);
 	}
@@ -95,10 +227,25 @@ static int shrinker_thread(void *arg)
 {
 	while (!kthread_should_stop()) {
 		struct timespec to;
+		u64 rss;
 		int v;
 
+		/*
+		 * Poll faster when we're getting close to the limit, so that we
+		 * start freeing before we hit it:
+		 */
+		bool near_limit = memory_want_shrink(&rss) > -(s64) (memory_limit >> 3);
+
 		clock_gettime(CLOCK_MONOTONIC, &to);
-		to.tv_sec += 1;
+		if (near_limit) {
+			to.tv_nsec += NSEC_PER_SEC / 10;
+			if (to.tv_nsec >= NSEC_PER_SEC) {
+				to.tv_sec++;
+				to.tv_nsec -= NSEC_PER_SEC;
+			}
+		} else {
+			to.tv_sec += 1;
+		}
 		__set_current_state(TASK_INTERRUPTIBLE);
 		errno = 0;
 		while ((v = READ_ONCE(current->state)) != TASK_RUNNING &&
@@ -120,6 +267,8 @@ struct task_struct *shrinker_task;
 __attribute__((constructor(103)))
 static void shrinker_thread_init(void)
 {
+	memory_limit_init();
+
 	shrinker_task = kthread_run(shrinker_thread, NULL, "shrinkers");
 	BUG_ON(IS_ERR(shrinker_task));
 }
@@ -0,0 +1,360 @@
+#include <pthread.h>
+#include <stdio.h>
+
+#include <linux/atomic.h>
+#include <linux/cache.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+/*
+ * kmem_cache: a magazine layer in front of kmalloc().
+ *
+ * Each cache has a small array of shards; a thread always uses the same shard
+ * (assigned round robin on first use), so with a handful of threads the shard
+ * lock is effectively uncontended. A shard holds one loaded magazine of free
+ * objects: alloc and free are a push or pop on that magazine.
+ *
+ * When a shard's magazine is empty on alloc, or full on free, it's exchanged
+ * with the cache's depot of full and empty magazines; only when the depot has
+ * nothing to give us (or is at its limit) do we go to the heap. The depot is
+ * trimmed by a shrinker under memory pressure.
+ *
+ * Set BCACHEFS_SLAB_STATS in the environment to have per cache statistics
+ * printed at exit.
+ */
+
+#define KMEM_MAGAZINE_SIZE	32
+#define KMEM_SHARDS		16
+#define KMEM_DEPOT_MAX		64
+
+struct kmem_magazine {
+	struct list_head	list;
+	unsigned		nr;
+	void			*objs[KMEM_MAGAZINE_SIZE];
+};
+
+struct kmem_shard {
+	pthread_mutex_t		lock;
+	struct kmem_magazine	*mag;
+} ____cacheline_aligned;
+
+struct kmem_cache_stats {
+	atomic64_t		alloc_fast;
+	atomic64_t		alloc_depot;
+	atomic64_t		alloc_slow;
+	atomic64_t		free_fast;
+	atomic64_t		free_depot;
+	atomic64_t		free_slow;
+	atomic64_t		shrunk;
+};
+
+struct kmem_cache {
+	size_t			obj_size;
+	char			name[32];
+	struct list_head	list;
+
+	struct mutex		depot_lock;
+	struct list_head	depot_full;
+	struct list_head	depot_empty;
+	unsigned		nr_full;
+	unsigned		nr_empty;
+
+	struct shrinker		*shrinker;
+	struct kmem_cache_stats	stats;
+
+	struct kmem_shard	shards[KMEM_SHARDS];
+};
+
+static LIST_HEAD(kmem_caches);
+static DEFINE_MUTEX(kmem_caches_lock);
+
+static atomic_t kmem_next_shard;
+static __thread int kmem_this_shard = -1;
+
+static struct kmem_shard *kmem_shard(struct kmem_cache *s)
+{
+	if (unlikely(kmem_this_shard < 0))
+		kmem_this_shard = (unsigned) atomic_inc_return(&kmem_next_shard) % KMEM_SHARDS;
+	return &s->shards[kmem_this_shard];
+}
+
+static struct kmem_magazine *kmem_magazine_alloc(void)
+{
+	struct kmem_magazine *m = kmalloc(sizeof(*m), GFP_NOWAIT);
+
+	if (m)
+		m->nr = 0;
+	return m;
+}
+
+static void kmem_magazine_free(struct kmem_magazine *m)
+{
+	for (unsigned i = 0; i < m->nr; i++)
+		kfree(m->objs[i]);
+	kfree(m);
+}
+
+/*
+ * Exchange @m (empty, or full, or NULL) for a magazine from the depot that
+ * has objects (@want_full) or space for them:
+ */
+static struct kmem_magazine *kmem_depot_exchange(struct kmem_cache *s,
+						 struct kmem_magazine *m,
+						 bool want_full)
+{
+	struct kmem_magazine *ret = NULL;
+
+	mutex_lock(&s->depot_lock);
+	if (want_full) {
+		if (!s->nr_full)
+			goto out;
+
+		ret = list_first_entry(&s->depot_full, struct kmem_magazine, list);
+		list_del(&ret->list);
+		s->nr_full--;
+
+		if (m) {
+			list_add(&m->list, &s->depot_empty);
+			s->nr_empty++;
+			m = NULL;
+		}
+	} else {
+		if (s->nr_full >= KMEM_DEPOT_MAX)
+			goto out;
+
+		if (s->nr_empty) {
+			ret = list_first_entry(&s->depot_empty, struct kmem_magazine, list);
+			list_del(&ret->list);
+			s->nr_empty--;
+		} else {
+			/* kmalloc() may run shrinkers, which take depot_lock: */
+			mutex_unlock(&s->depot_lock);
+			ret = kmem_magazine_alloc();
+			if (!ret)
+				return NULL;
+			mutex_lock(&s->depot_lock);
+		}
+
+		list_add(&m->list, &s->depot_full);
+		s->nr_full++;
+		m = NULL;
+	}
+out:
+	mutex_unlock(&s->depot_lock);
+	return ret;
+}
+
+static void *__kmem_cache_alloc(struct kmem_cache *s, gfp_t gfp)
+{
+	struct kmem_shard *sh = kmem_shard(s);
+	struct kmem_magazine *m;
+	void *p = NULL;
+
+	pthread_mutex_lock(&sh->lock);
+	m = sh->mag;
+	if (likely(m && m->nr)) {
+		p = m->objs[--m->nr];
+		atomic64_inc(&s->stats.alloc_fast);
+	} else {
+		struct kmem_magazine *n = kmem_depot_exchange(s, m, true);
+
+		if (n) {
+			sh->mag = m = n;
+			p = m->objs[--m->nr];
+			atomic64_inc(&s->stats.alloc_depot);
+		}
+	}
+	pthread_mutex_unlock(&sh->lock);
+
+	if (!p) {
+		p = kmalloc(s->obj_size, gfp & ~__GFP_ZERO);
+		if (p)
+			atomic64_inc(&s->stats.alloc_slow);
+	}
+
+	return p;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *s, gfp_t gfp)
+{
+	void *p = __kmem_cache_alloc(s, gfp);
+
+	if (p && (gfp & __GFP_ZERO))
+		memset(p, 0, s->obj_size);
+	return p;
+}
+
+void *kmem_cache_zalloc(struct kmem_cache *s, gfp_t gfp)
+{
+	return kmem_cache_alloc(s, gfp|__GFP_ZERO);
+}
+
+void kmem_cache_free(struct kmem_cache *s, void *p)
+{
+	struct kmem_shard *sh = kmem_shard(s);
+	struct kmem_magazine *m;
+
+	if (!p)
+		return;
+
+	pthread_mutex_lock(&sh->lock);
+	m = sh->mag;
+	if (unlikely(!m))
+		m = sh->mag = kmem_magazine_alloc();
+
+	if (likely(m && m->nr < KMEM_MAGAZINE_SIZE)) {
+		m->objs[m->nr++] = p;
+		atomic64_inc(&s->stats.free_fast);
+		p = NULL;
+	} else if (m) {
+		struct kmem_magazine *n = kmem_depot_exchange(s, m, false);
+
+		if (n) {
+			sh->mag = m = n;
+			m->objs[m->nr++] = p;
+			atomic64_inc(&s->stats.free_depot);
+			p = NULL;
+		}
+	}
+	pthread_mutex_unlock(&sh->lock);
+
+	if (p) {
+		kfree(p);
+		atomic64_inc(&s->stats.free_slow);
+	}
+}
+
+static unsigned long kmem_cache_shrink_count(struct shrinker *shrink,
+					     struct shrink_control *sc)
+{
+	struct kmem_cache *s = shrink->private_data;
+
+	return READ_ONCE(s->nr_full) * KMEM_MAGAZINE_SIZE + READ_ONCE(s->nr_empty);
+}
+
+static unsigned long kmem_cache_shrink_scan(struct shrinker *shrink,
+					    struct shrink_control *sc)
+{
+	struct kmem_cache *s = shrink->private_data;
+	unsigned long freed = 0;
+	LIST_HEAD(victims);
+
+	mutex_lock(&s->depot_lock);
+	while (s->nr_empty) {
+		list_move(s->depot_empty.next, &victims);
+		s->nr_empty--;
+		freed++;
+	}
+
+	while (s->nr_full && freed < sc->nr_to_scan) {
+		list_move(s->depot_full.next, &victims);
+		s->nr_full--;
+		freed += KMEM_MAGAZINE_SIZE;
+	}
+	mutex_unlock(&s->depot_lock);
+
+	while (!list_empty(&victims)) {
+		struct kmem_magazine *m =
+			list_first_entry(&victims, struct kmem_magazine, list);
+
+		list_del(&m->list);
+		atomic64_add(m->nr, &s->stats.shrunk);
+		kmem_magazine_free(m);
+	}
+
+	return freed;
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t obj_size)
+{
+	struct kmem_cache *s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return NULL;
+
+	s->obj_size = obj_size;
+	strscpy(s->name, name, sizeof(s->name));
+	mutex_init(&s->depot_lock);
+	INIT_LIST_HEAD(&s->depot_full);
+	INIT_LIST_HEAD(&s->depot_empty);
+
+	for (unsigned i = 0; i < KMEM_SHARDS; i++)
+		pthread_mutex_init(&s->shards[i].lock, NULL);
+
+	s->shrinker = shrinker_alloc(0, "slab-%s", name);
+	if (s->shrinker) {
+		s->shrinker->count_objects	= kmem_cache_shrink_count;
+		s->shrinker->scan_objects	= kmem_cache_shrink_scan;
+		s->shrinker->seeks		= 1;
+		s->shrinker->private_data	= s;
+		shrinker_register(s->shrinker);
+	}
+
+	mutex_lock(&kmem_caches_lock);
+	list_add_tail(&s->list, &kmem_caches);
+	mutex_unlock(&kmem_caches_lock);
+
+	return s;
+}
+
+static void kmem_cache_stats_print(struct kmem_cache *s)
+{
+	struct kmem_cache_stats *st = &s->stats;
+
+	fprintf(stderr, "slab %s (%zu bytes): alloc %llu fast %llu depot %llu slow, "
+		"free %llu fast %llu depot %llu slow, %llu shrunk\n",
+		s->name, s->obj_size,
+		(u64) atomic64_read(&st->alloc_fast),
+		(u64) atomic64_read(&st->alloc_depot),
+		(u64) atomic64_read(&st->alloc_slow),
+		(u64) atomic64_read(&st->free_fast),
+		(u64) atomic64_read(&st->free_depot),
+		(u64) atomic64_read(&st->free_slow),
+		(u64) atomic64_read(&st->shrunk));
+}
+
+void kmem_cache_destroy(struct kmem_cache *s)
+{
+	struct kmem_magazine *m, *n;
+
+	if (!s)
+		return;
+
+	if (getenv("BCACHEFS_SLAB_STATS"))
+		kmem_cache_stats_print(s);
+
+	mutex_lock(&kmem_caches_lock);
+	list_del(&s->list);
+	mutex_unlock(&kmem_caches_lock);
+
+	if (s->shrinker)
+		shrinker_free(s->shrinker);
+
+	for (unsigned i = 0; i < KMEM_SHARDS; i++) {
+		if (s->shards[i].mag)
+			kmem_magazine_free(s->shards[i].mag);
+		pthread_mutex_destroy(&s->shards[i].lock);
+	}
+
+	list_for_each_entry_safe(m, n, &s->depot_full, list)
+		kmem_magazine_free(m);
+	list_for_each_entry_safe(m, n, &s->depot_empty, list)
+		kmem_magazine_free(m);
+
+	kfree(s);
+}
+
+__attribute__((destructor))
+static void kmem_caches_exit(void)
+{
+	struct kmem_cache *s;
+
+	if (!getenv("BCACHEFS_SLAB_STATS"))
+		return;
+
+	mutex_lock(&kmem_caches_lock);
+	list_for_each_entry(s, &kmem_caches, list)
+		kmem_cache_stats_print(s);
+	mutex_unlock(&kmem_caches_lock);
+}
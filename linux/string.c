@@ -123,3 +123,16 @@ void *memscan(void *addr, int c, size_t size)
 	}
   	return (void *)p;
 }
+
+void *memchr_inv(const void *start, int c, size_t bytes)
+{
+	const unsigned char *p = start;
+
+	while (bytes) {
+		if (*p != (unsigned char)c)
+			return (void *)p;
+		p++;
+		bytes--;
+	}
+	return NULL;
+}
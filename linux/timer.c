@@ -3,6 +3,9 @@
 #include <signal.h>
 #include <time.h>
 
+#include <linux/bitops.h>
+#include <linux/cache.h>
+#include <linux/hash.h>
 #include <linux/kernel.h>
 #include <linux/kthread.h>
 #include <linux/timer.h>
@@ -23,279 +26,362 @@ static struct timespec timespec_add_ns(struct timespec a, u64 ns)
 	return a;
 }
 
-#define DECLARE_HEAP(type)						\
-struct {								\
-	size_t size, used;						\
-	type *data;							\
+/*
+ * Hierarchical timer wheel, as in kernel/time/timer.c: LVL_DEPTH levels of
+ * LVL_SIZE buckets each, with every level 8 times coarser than the one below
+ * it. Adding or removing a timer is a list operation on one bucket; timers
+ * further out are less precise (they never fire early, but may fire up to one
+ * bucket granularity late).
+ *
+ * Timers are hashed by address to one of NR_TIMER_BASES bases, each with its
+ * own lock, so that unrelated mod_timer()/del_timer() calls don't contend.
+ * A single thread runs expired timers from all bases, sleeping until the
+ * earliest next_expiry of any base; timer_wake_lock protects its wakeup time.
+ */
+
+#define LVL_CLK_SHIFT		3
+#define LVL_CLK_DIV		(1UL << LVL_CLK_SHIFT)
+#define LVL_CLK_MASK		(LVL_CLK_DIV - 1)
+#define LVL_SHIFT(n)		((n) * LVL_CLK_SHIFT)
+#define LVL_GRAN(n)		(1UL << LVL_SHIFT(n))
+#define LVL_START(n)		((LVL_SIZE - 1) << (((n) - 1) * LVL_CLK_SHIFT))
+
+#define LVL_BITS		6
+#define LVL_SIZE		(1UL << LVL_BITS)
+#define LVL_MASK		(LVL_SIZE - 1)
+#define LVL_OFFS(n)		((n) * LVL_SIZE)
+
+#define LVL_DEPTH		9
+#define WHEEL_TIMEOUT_CUTOFF	(LVL_START(LVL_DEPTH))
+#define WHEEL_TIMEOUT_MAX	(WHEEL_TIMEOUT_CUTOFF - LVL_GRAN(LVL_DEPTH - 1))
+#define WHEEL_SIZE		(LVL_SIZE * LVL_DEPTH)
+
+#define NEXT_TIMER_MAX_DELTA	((1UL << 30) - 1)
+
+#define NR_TIMER_BASES_BITS	3
+#define NR_TIMER_BASES		(1U << NR_TIMER_BASES_BITS)
+
+struct timer_base {
+	pthread_mutex_t		lock;
+	pthread_cond_t		running_cond;
+	struct timer_list	*running_timer;
+	unsigned long		running_seq;
+	unsigned long		clk;
+	unsigned long		next_expiry;
+	DECLARE_BITMAP(pending_map, WHEEL_SIZE);
+	struct list_head	vectors[WHEEL_SIZE];
+} ____cacheline_aligned;
+
+static struct timer_base timer_bases[NR_TIMER_BASES];
+
+static pthread_mutex_t	timer_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	timer_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long	timer_next_wakeup;
+static bool		timer_thread_stop = false;
+
+static inline struct timer_base *timer_base(struct timer_list *timer)
+{
+	return &timer_bases[hash_ptr(timer, NR_TIMER_BASES_BITS)];
 }
 
-#define heap_init(heap, _size)						\
-({									\
-	size_t _bytes;							\
-	(heap)->used = 0;						\
-	(heap)->size = (_size);						\
-	_bytes = (heap)->size * sizeof(*(heap)->data);			\
-	(heap)->data = malloc(_bytes);					\
-	(heap)->data;							\
-})
-
-#define heap_free(heap)							\
-do {									\
-	kvfree((heap)->data);						\
-	(heap)->data = NULL;						\
-} while (0)
-
-#define heap_swap(h, i, j)	swap((h)->data[i], (h)->data[j])
-
-#define heap_sift(h, i, cmp)						\
-do {									\
-	size_t _r, _j = i;						\
-									\
-	for (; _j * 2 + 1 < (h)->used; _j = _r) {			\
-		_r = _j * 2 + 1;					\
-		if (_r + 1 < (h)->used &&				\
-		    cmp((h)->data[_r], (h)->data[_r + 1]))		\
-			_r++;						\
-									\
-		if (cmp((h)->data[_r], (h)->data[_j]))			\
-			break;						\
-		heap_swap(h, _r, _j);					\
-	}								\
-} while (0)
-
-#define heap_sift_down(h, i, cmp)					\
-do {									\
-	while (i) {							\
-		size_t p = (i - 1) / 2;					\
-		if (cmp((h)->data[i], (h)->data[p]))			\
-			break;						\
-		heap_swap(h, i, p);					\
-		i = p;							\
-	}								\
-} while (0)
-
-#define heap_add(h, d, cmp)						\
-({									\
-	bool _r = !heap_full(h);					\
-	if (_r) {							\
-		size_t _i = (h)->used++;				\
-		(h)->data[_i] = d;					\
-									\
-		heap_sift_down(h, _i, cmp);				\
-		heap_sift(h, _i, cmp);					\
-	}								\
-	_r;								\
-})
-
-#define heap_del(h, i, cmp)						\
-do {									\
-	size_t _i = (i);						\
-									\
-	BUG_ON(_i >= (h)->used);					\
-	(h)->used--;							\
-	if ((_i) < (h)->used) {						\
-		heap_swap(h, _i, (h)->used);				\
-		heap_sift_down(h, _i, cmp);				\
-		heap_sift(h, _i, cmp);					\
-	}								\
-} while (0)
-
-#define heap_pop(h, d, cmp)						\
-({									\
-	bool _r = (h)->used;						\
-	if (_r) {							\
-		(d) = (h)->data[0];					\
-		heap_del(h, 0, cmp);					\
-	}								\
-	_r;								\
-})
-
-#define heap_peek(h)	((h)->used ? &(h)->data[0] : NULL)
-#define heap_full(h)	((h)->used == (h)->size)
-#define heap_empty(h)	((h)->used == 0)
-
-#define heap_resort(heap, cmp)						\
-do {									\
-	ssize_t _i;							\
-	for (_i = (ssize_t) (heap)->used / 2 -  1; _i >= 0; --_i)	\
-		heap_sift(heap, _i, cmp);				\
-} while (0)
-
-struct pending_timer {
-	struct timer_list	*timer;
-	unsigned long		expires;
-};
-
-static inline bool pending_timer_cmp(struct pending_timer a,
-				     struct pending_timer b)
+static inline unsigned calc_index(unsigned long expires, unsigned lvl,
+				  unsigned long *bucket_expiry)
 {
-	return a.expires < b.expires;
+	/*
+	 * Round up to the next bucket, so that timers never expire early:
+	 */
+	expires = (expires >> LVL_SHIFT(lvl)) + 1;
+	*bucket_expiry = expires << LVL_SHIFT(lvl);
+	return LVL_OFFS(lvl) + (expires & LVL_MASK);
 }
 
-static DECLARE_HEAP(struct pending_timer) pending_timers;
+static unsigned calc_wheel_index(unsigned long expires, unsigned long clk,
+				 unsigned long *bucket_expiry)
+{
+	unsigned long delta = expires - clk;
+	unsigned lvl;
 
-static pthread_mutex_t	timer_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t	timer_cond = PTHREAD_COND_INITIALIZER;
-static pthread_cond_t	timer_running_cond = PTHREAD_COND_INITIALIZER;
-static unsigned long	timer_seq;
+	if ((long) delta < 0) {
+		*bucket_expiry = clk;
+		return clk & LVL_MASK;
+	}
 
-static inline bool timer_running(void)
-{
-	return timer_seq & 1;
+	if (delta >= WHEEL_TIMEOUT_CUTOFF) {
+		expires = clk + WHEEL_TIMEOUT_MAX;
+		delta = WHEEL_TIMEOUT_MAX;
+	}
+
+	for (lvl = 0; lvl < LVL_DEPTH - 1; lvl++)
+		if (delta < LVL_START(lvl + 1))
+			break;
+
+	return calc_index(expires, lvl, bucket_expiry);
 }
 
-static ssize_t timer_idx(struct timer_list *timer)
+/*
+ * Earliest time at which any pending bucket will be collected: a bucket at
+ * level n with index i is collected when clk == i << LVL_SHIFT(n).
+ */
+static unsigned long next_timer_expiry(struct timer_base *base)
 {
-	size_t i;
+	unsigned long next = base->clk + NEXT_TIMER_MAX_DELTA;
+
+	for (unsigned lvl = 0; lvl < LVL_DEPTH; lvl++) {
+		unsigned long clk = base->clk >> LVL_SHIFT(lvl);
+		unsigned pos = clk & LVL_MASK, bit;
+
+		bit = find_next_bit(base->pending_map, LVL_OFFS(lvl + 1),
+				    LVL_OFFS(lvl) + pos);
+		if (bit >= LVL_OFFS(lvl + 1)) {
+			bit = find_next_bit(base->pending_map, LVL_OFFS(lvl) + pos,
+					    LVL_OFFS(lvl));
+			if (bit >= LVL_OFFS(lvl) + pos)
+				continue;
+		}
+
+		unsigned long expiry = clk + ((bit - LVL_OFFS(lvl) - pos) & LVL_MASK);
+		expiry <<= LVL_SHIFT(lvl);
+		if (time_before(expiry, base->clk))
+			expiry += LVL_SIZE << LVL_SHIFT(lvl);
 
-	for (i = 0; i < pending_timers.used; i++)
-		if (pending_timers.data[i].timer == timer)
-			return i;
+		if (time_before(expiry, next))
+			next = expiry;
+	}
 
-	return -1;
+	return next;
 }
 
-int del_timer(struct timer_list *timer)
+/*
+ * Advance an idle base's clk, so that new timers are placed relative to the
+ * current time; never past a bucket that hasn't been collected yet.
+ */
+static void forward_timer_base(struct timer_base *base, unsigned long now)
 {
-	ssize_t idx;
+	if (time_after(now, base->clk))
+		base->clk = time_after(base->next_expiry, now)
+			? now
+			: base->next_expiry;
+}
 
-	pthread_mutex_lock(&timer_lock);
-	idx = timer_idx(timer);
-	if (idx >= 0)
-		heap_del(&pending_timers, idx, pending_timer_cmp);
+static bool detach_if_pending(struct timer_base *base, struct timer_list *timer)
+{
+	if (!timer->pending)
+		return false;
 
+	list_del(&timer->entry);
+	if (list_empty(&base->vectors[timer->idx]))
+		__clear_bit(timer->idx, base->pending_map);
 	timer->pending = false;
-	pthread_mutex_unlock(&timer_lock);
+	return true;
+}
 
-	return idx >= 0;
+static void timer_kick(unsigned long expiry)
+{
+	/* Pairs with the reset of timer_next_wakeup in timer_thread(): */
+	smp_mb();
+
+	if (!time_before(expiry, READ_ONCE(timer_next_wakeup)))
+		return;
+
+	pthread_mutex_lock(&timer_wake_lock);
+	if (time_before(expiry, timer_next_wakeup)) {
+		timer_next_wakeup = expiry;
+		pthread_cond_signal(&timer_cond);
+	}
+	pthread_mutex_unlock(&timer_wake_lock);
 }
 
-void flush_timers(void)
+int del_timer(struct timer_list *timer)
 {
-	unsigned long seq;
+	struct timer_base *base = timer_base(timer);
+	bool ret;
 
-	pthread_mutex_lock(&timer_lock);
-	seq = timer_seq;
-	while (timer_running() && seq == timer_seq)
-		pthread_cond_wait(&timer_running_cond, &timer_lock);
+	pthread_mutex_lock(&base->lock);
+	ret = detach_if_pending(base, timer);
+	pthread_mutex_unlock(&base->lock);
 
-	pthread_mutex_unlock(&timer_lock);
+	return ret;
+}
+
+void flush_timers(void)
+{
+	for (unsigned i = 0; i < NR_TIMER_BASES; i++) {
+		struct timer_base *base = &timer_bases[i];
+		unsigned long seq;
+
+		pthread_mutex_lock(&base->lock);
+		seq = base->running_seq;
+		while (base->running_timer && seq == base->running_seq)
+			pthread_cond_wait(&base->running_cond, &base->lock);
+		pthread_mutex_unlock(&base->lock);
+	}
 }
 
 int del_timer_sync(struct timer_list *timer)
 {
-	unsigned long seq;
-	ssize_t idx;
+	struct timer_base *base = timer_base(timer);
+	bool ret = false;
+
+	pthread_mutex_lock(&base->lock);
+	while (1) {
+		/* The callback may re-arm the timer, so detach each time: */
+		ret |= detach_if_pending(base, timer);
+		if (base->running_timer != timer)
+			break;
+		pthread_cond_wait(&base->running_cond, &base->lock);
+	}
+	pthread_mutex_unlock(&base->lock);
 
-	pthread_mutex_lock(&timer_lock);
-	idx = timer_idx(timer);
-	if (idx >= 0)
-		heap_del(&pending_timers, idx, pending_timer_cmp);
+	return ret;
+}
 
-	timer->pending = false;
+int mod_timer(struct timer_list *timer, unsigned long expires)
+{
+	struct timer_base *base = timer_base(timer);
+	unsigned long bucket_expiry;
+	bool ret, kick = false;
+
+	pthread_mutex_lock(&base->lock);
+	if (timer->pending && timer->expires == expires) {
+		pthread_mutex_unlock(&base->lock);
+		return 1;
+	}
+
+	ret = detach_if_pending(base, timer);
+
+	forward_timer_base(base, jiffies);
 
-	seq = timer_seq;
-	while (timer_running() && seq == timer_seq)
-		pthread_cond_wait(&timer_running_cond, &timer_lock);
-	pthread_mutex_unlock(&timer_lock);
+	timer->expires	= expires;
+	timer->idx	= calc_wheel_index(expires, base->clk, &bucket_expiry);
+	timer->pending	= true;
+	list_add_tail(&timer->entry, &base->vectors[timer->idx]);
+	__set_bit(timer->idx, base->pending_map);
 
-	return idx >= 0;
+	if (time_before(bucket_expiry, base->next_expiry)) {
+		base->next_expiry = bucket_expiry;
+		kick = true;
+	}
+	pthread_mutex_unlock(&base->lock);
+
+	if (kick)
+		timer_kick(bucket_expiry);
+
+	return ret;
 }
 
-int mod_timer(struct timer_list *timer, unsigned long expires)
+static unsigned collect_expired_timers(struct timer_base *base,
+				       struct list_head *heads)
 {
-	ssize_t idx;
-
-	pthread_mutex_lock(&timer_lock);
-	timer->expires = expires;
-	timer->pending = true;
-	idx = timer_idx(timer);
-
-	if (idx >= 0 &&
-	    pending_timers.data[idx].expires == expires)
-		goto out;
-
-	if (idx >= 0) {
-		pending_timers.data[idx].expires = expires;
-
-		heap_sift_down(&pending_timers, idx, pending_timer_cmp);
-		heap_sift(&pending_timers, idx, pending_timer_cmp);
-	} else {
-		if (heap_full(&pending_timers)) {
-			pending_timers.size *= 2;
-			pending_timers.data =
-				realloc(pending_timers.data,
-					pending_timers.size *
-					sizeof(struct pending_timer));
-
-			BUG_ON(!pending_timers.data);
-		}
+	unsigned long clk = base->clk;
+	unsigned levels = 0;
+
+	for (unsigned i = 0; i < LVL_DEPTH; i++) {
+		unsigned idx = (clk & LVL_MASK) + i * LVL_SIZE;
 
-		heap_add(&pending_timers,
-			 ((struct pending_timer) {
-				.timer = timer,
-				.expires = expires,
-			 }),
-			 pending_timer_cmp);
+		if (__test_and_clear_bit(idx, base->pending_map)) {
+			list_splice_init(&base->vectors[idx], &heads[levels]);
+			levels++;
+		}
+		/* Is it time to look at the next level? */
+		if (clk & LVL_CLK_MASK)
+			break;
+		clk >>= LVL_CLK_SHIFT;
 	}
 
-	pthread_cond_signal(&timer_cond);
-out:
-	pthread_mutex_unlock(&timer_lock);
+	return levels;
+}
 
-	return idx >= 0;
+static void expire_timers(struct timer_base *base, struct list_head *head)
+{
+	while (!list_empty(head)) {
+		struct timer_list *timer =
+			list_first_entry(head, struct timer_list, entry);
+
+		list_del(&timer->entry);
+		BUG_ON(!timer_pending(timer));
+		timer->pending = false;
+
+		base->running_timer = timer;
+		pthread_mutex_unlock(&base->lock);
+		timer->function(timer);
+		pthread_mutex_lock(&base->lock);
+		base->running_timer = NULL;
+		base->running_seq++;
+		pthread_cond_broadcast(&base->running_cond);
+	}
 }
 
-static bool timer_thread_stop = false;
+static void run_timer_base(struct timer_base *base, unsigned long now)
+{
+	struct list_head heads[LVL_DEPTH];
+
+	for (unsigned i = 0; i < LVL_DEPTH; i++)
+		INIT_LIST_HEAD(&heads[i]);
+
+	while (time_after_eq(now, base->clk) &&
+	       time_after_eq(now, base->next_expiry)) {
+		unsigned levels;
+
+		/* Nothing is pending before next_expiry, skip ahead: */
+		if (time_after(base->next_expiry, base->clk))
+			base->clk = base->next_expiry;
+
+		levels = collect_expired_timers(base, heads);
+		base->clk++;
+		base->next_expiry = next_timer_expiry(base);
+
+		while (levels--)
+			expire_timers(base, &heads[levels]);
+	}
+}
 
 static int timer_thread(void *arg)
 {
-	struct pending_timer *p;
 	struct timespec ts;
-	unsigned long now;
 	int ret;
 
-	pthread_mutex_lock(&timer_lock);
-
-	while (!timer_thread_stop) {
-		now = jiffies;
-		p = heap_peek(&pending_timers);
+	while (1) {
+		unsigned long now = jiffies, next;
 
-		if (!p) {
-			pthread_cond_wait(&timer_cond, &timer_lock);
-			continue;
+		pthread_mutex_lock(&timer_wake_lock);
+		if (timer_thread_stop) {
+			pthread_mutex_unlock(&timer_wake_lock);
+			break;
 		}
+		/* Anyone adding a timer while we scan will leave it here: */
+		timer_next_wakeup = now + NEXT_TIMER_MAX_DELTA;
+		pthread_mutex_unlock(&timer_wake_lock);
+		smp_mb();
 
-		if (time_after_eq(now, p->expires)) {
-			struct timer_list *timer = p->timer;
-
-			heap_del(&pending_timers, 0, pending_timer_cmp);
-			BUG_ON(!timer_pending(timer));
-			timer->pending = false;
+		next = now + NEXT_TIMER_MAX_DELTA;
 
-			timer_seq++;
-			BUG_ON(!timer_running());
+		for (unsigned i = 0; i < NR_TIMER_BASES; i++) {
+			struct timer_base *base = &timer_bases[i];
 
-			pthread_mutex_unlock(&timer_lock);
-			timer->function(timer);
-			pthread_mutex_lock(&timer_lock);
-
-			timer_seq++;
-			pthread_cond_broadcast(&timer_running_cond);
-			continue;
+			pthread_mutex_lock(&base->lock);
+			run_timer_base(base, now);
+			if (time_before(base->next_expiry, next))
+				next = base->next_expiry;
+			pthread_mutex_unlock(&base->lock);
 		}
 
+		pthread_mutex_lock(&timer_wake_lock);
+		if (time_before(timer_next_wakeup, next))
+			next = timer_next_wakeup;
+		timer_next_wakeup = next;
 
-		ret = clock_gettime(CLOCK_REALTIME, &ts);
-		BUG_ON(ret);
+		now = jiffies;
+		if (time_after(next, now) && !timer_thread_stop) {
+			ret = clock_gettime(CLOCK_REALTIME, &ts);
+			BUG_ON(ret);
 
-		ts = timespec_add_ns(ts, jiffies_to_nsecs(p->expires - now));
+			ts = timespec_add_ns(ts, jiffies_to_nsecs(next - now));
 
-		pthread_cond_timedwait(&timer_cond, &timer_lock, &ts);
+			pthread_cond_timedwait(&timer_cond, &timer_wake_lock, &ts);
+		}
+		pthread_mutex_unlock(&timer_wake_lock);
 	}
 
-	pthread_mutex_unlock(&timer_lock);
-
 	return 0;
 }
 
@@ -304,8 +390,21 @@ struct task_struct *timer_task;
 __attribute__((constructor(103)))
 static void timers_init(void)
 {
-	heap_init(&pending_timers, 64);
-	BUG_ON(!pending_timers.data);
+	unsigned long now = jiffies;
+
+	for (unsigned i = 0; i < NR_TIMER_BASES; i++) {
+		struct timer_base *base = &timer_bases[i];
+
+		pthread_mutex_init(&base->lock, NULL);
+		pthread_cond_init(&base->running_cond, NULL);
+		base->clk		= now;
+		base->next_expiry	= now + NEXT_TIMER_MAX_DELTA;
+
+		for (unsigned j = 0; j < WHEEL_SIZE; j++)
+			INIT_LIST_HEAD(&base->vectors[j]);
+	}
+
+	timer_next_wakeup = now + NEXT_TIMER_MAX_DELTA;
 
 	timer_task = kthread_run(timer_thread, NULL, "timers");
 	BUG_ON(IS_ERR(timer_task));
@@ -316,10 +415,10 @@ static void timers_cleanup(void)
 {
 	get_task_struct(timer_task);
 
-	pthread_mutex_lock(&timer_lock);
+	pthread_mutex_lock(&timer_wake_lock);
 	timer_thread_stop = true;
 	pthread_cond_signal(&timer_cond);
-	pthread_mutex_unlock(&timer_lock);
+	pthread_mutex_unlock(&timer_wake_lock);
 
 	int ret = kthread_stop(timer_task);
 	BUG_ON(ret);
@@ -1,23 +1,68 @@
 #include <pthread.h>
+#include <sched.h>
+#include <sys/sysinfo.h>
 
 #include <linux/kthread.h>
 #include <linux/slab.h>
 #include <linux/workqueue.h>
 
-static pthread_mutex_t	wq_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t	work_finished = PTHREAD_COND_INITIALIZER;
-static LIST_HEAD(wq_list);
-
-struct workqueue_struct {
+/*
+ * Workers live in pools. By default each workqueue has its own, with workers
+ * started on demand up to max_active (capped at the number of CPUs); ordered
+ * workqueues get exactly one.
+ *
+ * With BCACHEFS_WQ_SHARED_POOL set in the environment, all workqueues share one
+ * pool instead: work items - and so closure continuations - from every
+ * workqueue are multiplexed onto one set of threads, and a thread idle on one
+ * workqueue can run another's work. Each workqueue is still limited to
+ * max_active running work items, and the pool only grows (when every worker is
+ * busy) up to the sum of its workqueues' limits, so a workqueue under its
+ * limit can always get a worker - the same forward progress guarantee as with a
+ * pool per workqueue, with far fewer threads.
+ *
+ * A work item's list entry is protected by the lock of the pool of the
+ * workqueue it was last queued on, work->wq.
+ */
+
+struct worker_pool;
+
+struct worker {
+	struct worker_pool	*pool;
+	struct task_struct	*task;
+	struct workqueue_struct	*current_wq;
+	struct work_struct	*current_work;
 	struct list_head	list;
+	struct list_head	idle;
+};
 
-	struct work_struct	*current_work;
+struct worker_pool {
+	pthread_mutex_t		lock;
+	pthread_cond_t		work_finished;
+
+	struct list_head	workqueues;
+	struct list_head	workers;
+	struct list_head	idle_workers;
+
+	unsigned		nr_workers;
+	unsigned		max_workers;
+};
+
+struct workqueue_struct {
+	struct worker_pool	*pool;
+	struct list_head	list;		/* on pool->workqueues */
 	struct list_head	pending_work;
 
-	struct task_struct	*worker;
+	unsigned		nr_active;
+	unsigned		max_active;
 	char			name[24];
+
+	/* if not using the shared pool: */
+	struct worker_pool	own_pool;
 };
 
+static struct worker_pool *shared_pool;
+static pthread_once_t shared_pool_once = PTHREAD_ONCE_INIT;
+
 enum {
 	WORK_PENDING_BIT,
 };
@@ -37,24 +82,66 @@ static bool set_work_pending(struct work_struct *work)
 	return !test_and_set_bit(WORK_PENDING_BIT, work_data_bits(work));
 }
 
+static int worker_thread(void *arg);
+
+static void wake_worker(struct workqueue_struct *wq)
+{
+	struct worker_pool *pool = wq->pool;
+	struct worker *w;
+
+	/* Otherwise, a work item finishing will see our work: */
+	if (wq->nr_active >= wq->max_active)
+		return;
+
+	w = list_first_entry_or_null(&pool->idle_workers, struct worker, idle);
+	if (w) {
+		list_del_init(&w->idle);
+		wake_up_process(w->task);
+		return;
+	}
+
+	if (pool->nr_workers < pool->max_workers &&
+	    (w = kzalloc(sizeof(*w), GFP_KERNEL))) {
+		struct task_struct *p;
+
+		w->pool = pool;
+		INIT_LIST_HEAD(&w->idle);
+
+		p = pool == shared_pool
+			? kthread_run(worker_thread, w, "kworker/%u", pool->nr_workers)
+			: kthread_run(worker_thread, w, "%s/%u", wq->name, pool->nr_workers);
+		if (!IS_ERR(p)) {
+			w->task = p;
+			list_add_tail(&w->list, &pool->workers);
+			pool->nr_workers++;
+		} else {
+			kfree(w);
+		}
+	}
+
+	/* Otherwise every worker is busy, and will see our work when done */
+}
+
 static void __queue_work(struct workqueue_struct *wq,
 			 struct work_struct *work)
 {
 	BUG_ON(!work_pending(work));
 	BUG_ON(!list_empty(&work->entry));
 
+	work->wq = wq;
 	list_add_tail(&work->entry, &wq->pending_work);
-	wake_up_process(wq->worker);
+	wake_worker(wq);
 }
 
 bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
 {
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
-	if ((ret = set_work_pending(work)))
+	if ((ret = set_work_pending(work))) {
+		pthread_mutex_lock(&wq->pool->lock);
 		__queue_work(wq, work);
-	pthread_mutex_unlock(&wq_lock);
+		pthread_mutex_unlock(&wq->pool->lock);
+	}
 
 	return ret;
 }
@@ -63,10 +150,11 @@ void delayed_work_timer_fn(struct timer_list *timer)
 {
 	struct delayed_work *dwork =
 		container_of(timer, struct delayed_work, timer);
+	struct workqueue_struct *wq = dwork->wq;
 
-	pthread_mutex_lock(&wq_lock);
-	__queue_work(dwork->wq, &dwork->work);
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_lock(&wq->pool->lock);
+	__queue_work(wq, &dwork->work);
+	pthread_mutex_unlock(&wq->pool->lock);
 }
 
 static void __queue_delayed_work(struct workqueue_struct *wq,
@@ -81,9 +169,12 @@ static void __queue_delayed_work(struct workqueue_struct *wq,
 	BUG_ON(!list_empty(&work->entry));
 
 	if (!delay) {
+		pthread_mutex_lock(&wq->pool->lock);
 		__queue_work(wq, &dwork->work);
+		pthread_mutex_unlock(&wq->pool->lock);
 	} else {
 		dwork->wq = wq;
+		work->wq = wq;
 		timer->expires = jiffies + delay;
 		add_timer(timer);
 	}
@@ -96,16 +187,19 @@ bool queue_delayed_work(struct workqueue_struct *wq,
 	struct work_struct *work = &dwork->work;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
 	if ((ret = set_work_pending(work)))
 		__queue_delayed_work(wq, dwork, delay);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
 
+/*
+ * On return, the work item is pending, on no list and has no timer armed:
+ * the caller owns it. Returns true if it was previously pending.
+ */
 static bool grab_pending(struct work_struct *work, bool is_dwork)
 {
+	struct workqueue_struct *wq;
 retry:
 	if (set_work_pending(work)) {
 		BUG_ON(!list_empty(&work->entry));
@@ -121,25 +215,34 @@ retry:
 		}
 	}
 
-	if (!list_empty(&work->entry)) {
-		list_del_init(&work->entry);
-		return true;
+	wq = READ_ONCE(work->wq);
+	if (wq) {
+		pthread_mutex_lock(&wq->pool->lock);
+		if (work->wq == wq && !list_empty(&work->entry)) {
+			list_del_init(&work->entry);
+			pthread_mutex_unlock(&wq->pool->lock);
+			return true;
+		}
+		pthread_mutex_unlock(&wq->pool->lock);
 	}
 
-	BUG_ON(!is_dwork);
-
-	pthread_mutex_unlock(&wq_lock);
-	flush_timers();
-	pthread_mutex_lock(&wq_lock);
+	/*
+	 * Raced with the work being queued, or with the timer firing: the
+	 * window is short, so just wait for it to show up on a list:
+	 */
+	if (is_dwork)
+		flush_timers();
+	else
+		sched_yield();
 	goto retry;
 }
 
-static bool work_running(struct work_struct *work)
+static bool work_running(struct workqueue_struct *wq, struct work_struct *work)
 {
-	struct workqueue_struct *wq;
+	struct worker *w;
 
-	list_for_each_entry(wq, &wq_list, list)
-		if (wq->current_work == work)
+	list_for_each_entry(w, &wq->pool->workers, list)
+		if (w->current_work == work)
 			return true;
 
 	return false;
@@ -147,40 +250,46 @@ static bool work_running(struct work_struct *work)
 
 bool flush_work(struct work_struct *work)
 {
+	struct workqueue_struct *wq = READ_ONCE(work->wq);
 	bool ret = false;
 
-	pthread_mutex_lock(&wq_lock);
-	while (work_pending(work) || work_running(work)) {
-		pthread_cond_wait(&work_finished, &wq_lock);
+	if (!wq)
+		return false;
+
+	pthread_mutex_lock(&wq->pool->lock);
+	while (work_pending(work) || work_running(wq, work)) {
+		pthread_cond_wait(&wq->pool->work_finished, &wq->pool->lock);
 		ret = true;
 	}
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_unlock(&wq->pool->lock);
 
 	return ret;
 }
 
 static bool __flush_work(struct work_struct *work)
 {
+	struct workqueue_struct *wq = READ_ONCE(work->wq);
 	bool ret = false;
 
-	while (work_running(work)) {
-		pthread_cond_wait(&work_finished, &wq_lock);
+	if (!wq)
+		return false;
+
+	pthread_mutex_lock(&wq->pool->lock);
+	while (work_running(wq, work)) {
+		pthread_cond_wait(&wq->pool->work_finished, &wq->pool->lock);
 		ret = true;
 	}
+	pthread_mutex_unlock(&wq->pool->lock);
 
 	return ret;
 }
 
 bool cancel_work_sync(struct work_struct *work)
 {
-	bool ret;
-
-	pthread_mutex_lock(&wq_lock);
-	ret = grab_pending(work, false);
+	bool ret = grab_pending(work, false);
 
 	__flush_work(work);
 	clear_work_pending(work);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
@@ -189,28 +298,18 @@ bool mod_delayed_work(struct workqueue_struct *wq,
 		      struct delayed_work *dwork,
 		      unsigned long delay)
 {
-	struct work_struct *work = &dwork->work;
-	bool ret;
-
-	pthread_mutex_lock(&wq_lock);
-	ret = grab_pending(work, true);
+	bool ret = grab_pending(&dwork->work, true);
 
 	__queue_delayed_work(wq, dwork, delay);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
 
 bool cancel_delayed_work(struct delayed_work *dwork)
 {
-	struct work_struct *work = &dwork->work;
-	bool ret;
-
-	pthread_mutex_lock(&wq_lock);
-	ret = grab_pending(work, true);
+	bool ret = grab_pending(&dwork->work, true);
 
 	clear_work_pending(&dwork->work);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
@@ -218,64 +317,171 @@ bool cancel_delayed_work(struct delayed_work *dwork)
 bool cancel_delayed_work_sync(struct delayed_work *dwork)
 {
 	struct work_struct *work = &dwork->work;
-	bool ret;
-
-	pthread_mutex_lock(&wq_lock);
-	ret = grab_pending(work, true);
+	bool ret = grab_pending(work, true);
 
 	__flush_work(work);
 	clear_work_pending(work);
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
 
+static bool workqueue_busy(struct workqueue_struct *wq)
+{
+	struct worker *w;
+
+	if (!list_empty(&wq->pending_work))
+		return true;
+
+	list_for_each_entry(w, &wq->pool->workers, list)
+		if (w->current_wq == wq)
+			return true;
+
+	return false;
+}
+
+void flush_workqueue(struct workqueue_struct *wq)
+{
+	struct worker_pool *pool = wq->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	while (workqueue_busy(wq))
+		pthread_cond_wait(&pool->work_finished, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Work items are non reentrant: skip items that are already running on
+ * another worker, that worker will pick them up again when it's done.
+ *
+ * Workqueues in a pool are served round robin, skipping any already running
+ * max_active work items:
+ */
+static struct work_struct *next_work(struct worker_pool *pool,
+				     struct workqueue_struct **wqp)
+{
+	struct workqueue_struct *wq;
+	struct work_struct *work;
+
+	list_for_each_entry(wq, &pool->workqueues, list) {
+		if (wq->nr_active >= wq->max_active)
+			continue;
+
+		list_for_each_entry(work, &wq->pending_work, entry)
+			if (!work_running(wq, work)) {
+				list_move_tail(&wq->list, &pool->workqueues);
+				*wqp = wq;
+				return work;
+			}
+	}
+
+	*wqp = NULL;
+	return NULL;
+}
+
 static int worker_thread(void *arg)
 {
-	struct workqueue_struct *wq = arg;
+	struct worker *w = arg;
+	struct worker_pool *pool = w->pool;
+	struct workqueue_struct *wq;
 	struct work_struct *work;
 
-	pthread_mutex_lock(&wq_lock);
+	pthread_mutex_lock(&pool->lock);
 	while (1) {
 		__set_current_state(TASK_INTERRUPTIBLE);
-		work = list_first_entry_or_null(&wq->pending_work,
-				struct work_struct, entry);
-		wq->current_work = work;
+		work = next_work(pool, &wq);
+		w->current_work = work;
+		w->current_wq	= wq;
 
 		if (kthread_should_stop()) {
-			BUG_ON(wq->current_work);
+			BUG_ON(w->current_work);
 			break;
 		}
 
 		if (!work) {
-			pthread_mutex_unlock(&wq_lock);
+			list_add(&w->idle, &pool->idle_workers);
+			pthread_mutex_unlock(&pool->lock);
 			schedule();
-			pthread_mutex_lock(&wq_lock);
+			pthread_mutex_lock(&pool->lock);
+			list_del_init(&w->idle);
 			continue;
 		}
 
 		BUG_ON(!work_pending(work));
 		list_del_init(&work->entry);
 		clear_work_pending(work);
+		wq->nr_active++;
 
-		pthread_mutex_unlock(&wq_lock);
+		pthread_mutex_unlock(&pool->lock);
 		work->func(work);
-		pthread_mutex_lock(&wq_lock);
+		pthread_mutex_lock(&pool->lock);
 
-		pthread_cond_broadcast(&work_finished);
+		wq->nr_active--;
+		w->current_work = NULL;
+		w->current_wq	= NULL;
+		pthread_cond_broadcast(&pool->work_finished);
 	}
-	pthread_mutex_unlock(&wq_lock);
+	list_del_init(&w->idle);
+	pthread_mutex_unlock(&pool->lock);
 
 	return 0;
 }
 
+static void worker_pool_init(struct worker_pool *pool)
+{
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_finished, NULL);
+	INIT_LIST_HEAD(&pool->workqueues);
+	INIT_LIST_HEAD(&pool->workers);
+	INIT_LIST_HEAD(&pool->idle_workers);
+}
+
+static void worker_pool_exit(struct worker_pool *pool)
+{
+	struct worker *w, *n;
+
+	list_for_each_entry_safe(w, n, &pool->workers, list) {
+		kthread_stop(w->task);
+		kfree(w);
+	}
+
+	pthread_cond_destroy(&pool->work_finished);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+static void shared_pool_init(void)
+{
+	if (!getenv("BCACHEFS_WQ_SHARED_POOL"))
+		return;
+
+	shared_pool = kzalloc(sizeof(*shared_pool), GFP_KERNEL);
+	if (shared_pool)
+		worker_pool_init(shared_pool);
+}
+
 void destroy_workqueue(struct workqueue_struct *wq)
 {
-	kthread_stop(wq->worker);
+	struct worker_pool *pool = wq->pool;
 
-	pthread_mutex_lock(&wq_lock);
+	if (pool != shared_pool) {
+		worker_pool_exit(pool);
+		kfree(wq);
+		return;
+	}
+
+	/* Other workqueues' workers would otherwise run our work after we're gone: */
+	flush_workqueue(wq);
+
+	pthread_mutex_lock(&pool->lock);
 	list_del(&wq->list);
-	pthread_mutex_unlock(&wq_lock);
+	pool->max_workers -= wq->max_active;
+	bool last = list_empty(&pool->workqueues);
+	pthread_mutex_unlock(&pool->lock);
+
+	if (last) {
+		worker_pool_exit(pool);
+		kfree(pool);
+		shared_pool = NULL;
+	}
 
 	kfree(wq);
 }
@@ -292,26 +498,34 @@ struct workqueue_struct *alloc_workqueue(const char *fmt,
 	if (!wq)
 		return NULL;
 
-	INIT_LIST_HEAD(&wq->list);
 	INIT_LIST_HEAD(&wq->pending_work);
 
 	va_start(args, max_active);
 	vsnprintf(wq->name, sizeof(wq->name), fmt, args);
 	va_end(args);
 
-	wq->worker = kthread_run(worker_thread, wq, "%s", wq->name);
-	if (IS_ERR(wq->worker)) {
-		kfree(wq);
-		return NULL;
+	if (!max_active)
+		max_active = WQ_DFL_ACTIVE;
+
+	wq->max_active = flags & __WQ_ORDERED
+		? 1
+		: clamp_t(int, max_active, 1, get_nprocs());
+
+	pthread_once(&shared_pool_once, shared_pool_init);
+
+	wq->pool = shared_pool;
+	if (!wq->pool) {
+		wq->pool = &wq->own_pool;
+		worker_pool_init(wq->pool);
 	}
 
-	pthread_mutex_lock(&wq_lock);
-	list_add(&wq->list, &wq_list);
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_lock(&wq->pool->lock);
+	list_add_tail(&wq->list, &wq->pool->workqueues);
+	wq->pool->max_workers += wq->max_active;
+	pthread_mutex_unlock(&wq->pool->lock);
 
 	return wq;
 }
-
 struct workqueue_struct *system_wq;
 struct workqueue_struct *system_highpri_wq;
 struct workqueue_struct *system_long_wq;
@@ -17,6 +17,7 @@ BuildRequires:  libattr-devel
 BuildRequires:  libblkid-devel
 BuildRequires:  libsodium-devel
 BuildRequires:  libuuid-devel
+BuildRequires:  liburing-devel
 BuildRequires:  libzstd-devel
 BuildRequires:  lz4-devel
 BuildRequires:  systemd-devel
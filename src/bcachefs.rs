@@ -43,6 +43,7 @@ fn handle_c_command(mut argv: Vec<String>, symlink_cmd: Option<&str>) -> i32 {
                 c::bcachefs_usage();
                 0
             }
+            "bench" => c::cmd_bench(argc, argv),
             "data" => c::data_cmds(argc, argv),
             "device" => c::device_cmds(argc, argv),
             "dump" => c::cmd_dump(argc, argv),
@@ -60,8 +61,10 @@ fn handle_c_command(mut argv: Vec<String>, symlink_cmd: Option<&str>) -> i32 {
             "set-passphrase" => c::cmd_set_passphrase(argc, argv),
             "set-file-option" => c::cmd_setattr(argc, argv),
             "show-super" => c::cmd_show_super(argc, argv),
+            "subvolume" => c::subvolume_cmds(argc, argv),
             "unlock" => c::cmd_unlock(argc, argv),
             "version" => c::cmd_version(argc, argv),
+            "zstd-dict" => c::zstd_dict_cmds(argc, argv),
 
             #[cfg(fuse)]
             "fusemount" => c::cmd_fusemount(argc, argv),
@@ -110,6 +113,12 @@ fn main() -> ExitCode {
         }
         "list" => commands::list(args[1..].to_vec()).report(),
         "mount" => commands::mount(args, symlink_cmd).report(),
+        "subvolume" if matches!(args.get(2).map(String::as_str), Some("send" | "receive")) => {
+            let r = handle_c_command(args, symlink_cmd);
+
+            debug!("return code from C command: {r}");
+            ExitCode::from(r as u8)
+        }
         "subvolume" => commands::subvolume(args[1..].to_vec()).report(),
         _ => {
             let r = handle_c_command(args, symlink_cmd);
@@ -8,24 +8,143 @@ use bch_bindgen::btree::BtreeTrans;
 use bch_bindgen::fs::Fs;
 use bch_bindgen::opt_set;
 use clap::Parser;
-use std::io::{stdout, IsTerminal};
+use std::ffi::CStr;
+use std::io::{stdout, IsTerminal, Write};
+use std::mem::size_of;
 
 use crate::logging;
 
-fn list_keys(fs: &Fs, opt: &Cli) -> anyhow::Result<()> {
+/// Output is written in batches of about this size, so that threads listing
+/// different ranges don't contend on stdout for every key
+const OUTPUT_BATCH: usize = 1 << 20;
+
+fn bpos_successor(p: bcachefs::bpos) -> bcachefs::bpos {
+    let mut p = p;
+
+    if p.snapshot != u32::MAX {
+        p.snapshot += 1;
+    } else if p.offset != u64::MAX {
+        p.snapshot = 0;
+        p.offset += 1;
+    } else {
+        p.snapshot = 0;
+        p.offset = 0;
+        p.inode += 1;
+    }
+    p
+}
+
+/// Splits [start, end] into at most @nr ranges, at the boundaries of level 1
+/// btree nodes so that each range covers roughly the same number of leaves.
+/// Returns the end of each range; each range starts after the previous end.
+fn list_split_ranges(fs: &Fs, opt: &Cli, nr: usize) -> anyhow::Result<Vec<bcachefs::bpos>> {
+    let mut bounds = Vec::new();
+
+    if nr > 1 {
+        let trans = BtreeTrans::new(fs);
+        let mut iter = BtreeNodeIter::new(
+            &trans,
+            opt.btree,
+            opt.start,
+            0,
+            1,
+            BtreeIterFlags::PREFETCH,
+        );
+
+        while let Some(b) = iter.peek_and_restart()? {
+            if b.key.k.p >= opt.end {
+                break;
+            }
+
+            bounds.push(b.key.k.p);
+            iter.advance();
+        }
+    }
+
+    let mut ends: Vec<_> = (1..nr)
+        .filter_map(|i| bounds.get(bounds.len() * i / nr).copied())
+        .collect();
+    ends.dedup();
+    ends.push(opt.end);
+    Ok(ends)
+}
+
+fn bkey_type_name(ty: u8) -> &'static str {
+    match unsafe { bcachefs::bch2_bkey_types.get(ty as usize) } {
+        Some(s) if !s.is_null() => unsafe { CStr::from_ptr(*s) }
+            .to_str()
+            .unwrap_or("(unknown)"),
+        _ => "(unknown)",
+    }
+}
+
+fn bkey_val_bytes(k: &BkeySC) -> &[u8] {
+    let len = (k.k.u64s as usize * 8).saturating_sub(size_of::<bcachefs::bkey>());
+
+    unsafe { std::slice::from_raw_parts(k.v as *const bcachefs::bch_val as *const u8, len) }
+}
+
+fn key_to_ndjson(out: &mut Vec<u8>, btree: &str, k: &BkeySC) -> std::io::Result<()> {
+    const HEX: &[u8; 16] = b"0123456789abcdef";
+
+    write!(
+        out,
+        "{{\"btree\":\"{}\",\"inode\":{},\"offset\":{},\"snapshot\":{},\"type\":\"{}\",\"size\":{},\"val\":\"",
+        btree,
+        k.k.p.inode,
+        k.k.p.offset,
+        k.k.p.snapshot,
+        bkey_type_name(k.k.type_),
+        k.k.size
+    )?;
+    for b in bkey_val_bytes(k) {
+        out.push(HEX[(*b >> 4) as usize]);
+        out.push(HEX[(*b & 15) as usize]);
+    }
+    out.extend_from_slice(b"\"}\n");
+    Ok(())
+}
+
+/// Binary output is a stream of struct bkey_i in native byte order: the
+/// unpacked key, whose u64s field gives the size of the record, then the value
+fn key_to_binary(out: &mut Vec<u8>, k: &BkeySC) {
+    let key = unsafe {
+        std::slice::from_raw_parts(
+            k.k as *const bcachefs::bkey as *const u8,
+            size_of::<bcachefs::bkey>(),
+        )
+    };
+
+    out.extend_from_slice(key);
+    out.extend_from_slice(bkey_val_bytes(k));
+}
+
+fn list_keys_range(
+    fs: &Fs,
+    opt: &Cli,
+    after: Option<bcachefs::bpos>,
+    end: bcachefs::bpos,
+) -> anyhow::Result<()> {
+    let btree = opt.btree.to_string();
     let trans = BtreeTrans::new(fs);
     let mut iter = BtreeIter::new(
         &trans,
         opt.btree,
-        opt.start,
+        after.unwrap_or(opt.start),
         BtreeIterFlags::ALL_SNAPSHOTS | BtreeIterFlags::PREFETCH,
     );
+    let mut out = Vec::with_capacity(OUTPUT_BATCH * 2);
 
     while let Some(k) = iter.peek_and_restart()? {
-        if k.k.p > opt.end {
+        if k.k.p > end {
             break;
         }
 
+        if after.map_or(false, |after| k.k.p <= after) {
+            iter.advance();
+            continue;
+        }
+
         if let Some(ty) = opt.bkey_type {
             if k.k.type_ != ty as u8 {
                 iter.advance();
@@ -33,13 +152,48 @@ fn list_keys(fs: &Fs, opt: &Cli) -> anyhow::Result<()> {
             }
         }
 
-        println!("{}", k.to_text(fs));
+        match opt.format {
+            Format::Text => writeln!(out, "{}", k.to_text(fs))?,
+            Format::Ndjson => key_to_ndjson(&mut out, &btree, &k)?,
+            Format::Binary => key_to_binary(&mut out, &k),
+        }
+
+        if out.len() >= OUTPUT_BATCH {
+            stdout().lock().write_all(&out)?;
+            out.clear();
+        }
         iter.advance();
     }
 
+    stdout().lock().write_all(&out)?;
     Ok(())
 }
 
+fn list_keys(fs: &Fs, opt: &Cli) -> anyhow::Result<()> {
+    let ends = list_split_ranges(fs, opt, opt.threads.max(1))?;
+
+    if ends.len() == 1 {
+        return list_keys_range(fs, opt, None, opt.end);
+    }
+
+    std::thread::scope(|s| {
+        let threads: Vec<_> = ends
+            .iter()
+            .enumerate()
+            .map(|(i, end)| {
+                let after = if i > 0 { Some(ends[i - 1]) } else { None };
+
+                s.spawn(move || list_keys_range(fs, opt, after, *end))
+            })
+            .collect();
+
+        threads
+            .into_iter()
+            .map(|t| t.join().unwrap())
+            .collect::<anyhow::Result<()>>()
+    })
+}
+
 fn list_btree_formats(fs: &Fs, opt: &Cli) -> anyhow::Result<()> {
     let trans = BtreeTrans::new(fs);
     let mut iter = BtreeNodeIter::new(
@@ -109,12 +263,30 @@ fn list_nodes_ondisk(fs: &Fs, opt: &Cli) -> anyhow::Result<()> {
     Ok(())
 }
 
+fn list_btree_shape(fs: &Fs, opt: &Cli) -> anyhow::Result<()> {
+    let trans = BtreeTrans::new(fs);
+
+    print!("{}", trans.shape_to_text(opt.btree));
+    Ok(())
+}
+
+#[derive(Clone, clap::ValueEnum, Debug)]
+enum Format {
+    /// Keys as formatted by the kernel's to_text methods
+    Text,
+    /// One JSON object per key, with the value hex encoded
+    Ndjson,
+    /// Raw struct bkey_i records
+    Binary,
+}
+
 #[derive(Clone, clap::ValueEnum, Debug)]
 enum Mode {
     Keys,
     Formats,
     Nodes,
     NodesOndisk,
+    Shape,
 }
 
 /// List filesystem metadata in textual form
@@ -143,6 +315,16 @@ pub struct Cli {
     #[arg(short, long, default_value = "keys")]
     mode: Mode,
 
+    /// Output format for keys mode
+    #[arg(short = 'F', long, default_value = "text")]
+    format: Format,
+
+    /// List keys with this many threads, each walking its own part of the
+    /// range; output is in key order within each part, but the parts are
+    /// interleaved
+    #[arg(short = 'j', long, default_value_t = 1)]
+    threads: usize,
+
     /// Check (fsck) the filesystem first
     #[arg(short, long)]
     fsck: bool,
@@ -164,6 +346,7 @@ fn cmd_list_inner(opt: &Cli) -> anyhow::Result<()> {
     let mut fs_opts = bcachefs::bch_opts::default();
 
     opt_set!(fs_opts, nochanges, 1);
+    opt_set!(fs_opts, mmap_devices, 1);
     opt_set!(fs_opts, read_only, 1);
     opt_set!(fs_opts, norecovery, 1);
     opt_set!(fs_opts, degraded, 1);
@@ -194,6 +377,7 @@ fn cmd_list_inner(opt: &Cli) -> anyhow::Result<()> {
         Mode::Formats => list_btree_formats(&fs, opt),
         Mode::Nodes => list_btree_nodes(&fs, opt),
         Mode::NodesOndisk => list_nodes_ondisk(&fs, opt),
+        Mode::Shape => list_btree_shape(&fs, opt),
     }
 }
 
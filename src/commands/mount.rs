@@ -160,15 +160,42 @@ fn udev_bcachefs_info() -> anyhow::Result<HashMap<String, Vec<String>>> {
     Ok(info)
 }
 
+/// How many superblocks we read at once: they're small synchronous reads, so
+/// with many devices we're mostly waiting on IO
+const SB_READ_THREADS: usize = 64;
+
+fn read_supers_parallel(devices: &[&str]) -> Vec<anyhow::Result<bch_sb_handle>> {
+    devices
+        .chunks(SB_READ_THREADS)
+        .flat_map(|chunk| {
+            std::thread::scope(|s| {
+                chunk
+                    .iter()
+                    .map(|dev| s.spawn(move || read_super_silent(dev)))
+                    .collect::<Vec<_>>()
+                    .into_iter()
+                    .map(|t| t.join().unwrap())
+                    .collect::<Vec<_>>()
+            })
+        })
+        .collect()
+}
+
 fn get_super_blocks(uuid: Uuid, devices: &[String]) -> Vec<(PathBuf, bch_sb_handle)> {
+    let devs: Vec<&str> = devices.iter().map(String::as_str).collect();
+
     devices
         .iter()
-        .filter_map(|dev| {
-            read_super_silent(PathBuf::from(dev))
-                .ok()
-                .map(|sb| (PathBuf::from(dev), sb))
+        .zip(read_supers_parallel(&devs))
+        .filter_map(|(dev, sb)| sb.ok().map(|sb| (PathBuf::from(dev), sb)))
+        .filter_map(|(dev, mut sb)| {
+            if sb.sb().uuid() == uuid {
+                Some((dev, sb))
+            } else {
+                unsafe { bch_bindgen::sb_io::bch2_free_super(&mut sb) };
+                None
+            }
         })
-        .filter(|(_, sb)| sb.sb().uuid() == uuid)
         .collect::<Vec<_>>()
 }
 
@@ -274,10 +301,9 @@ fn cmd_mount_inner(cli: &Cli) -> Result<()> {
             // part of the FS. This appears to be the case when we get called during
             // fstab mount processing and the fstab specifies a UUID.
 
-            let sbs = cli
-                .dev
-                .split(':')
-                .map(read_super_silent)
+            let devs: Vec<&str> = cli.dev.split(':').collect();
+            let sbs = read_supers_parallel(&devs)
+                .into_iter()
                 .collect::<Result<Vec<_>>>()?;
 
             (cli.dev.clone(), sbs)